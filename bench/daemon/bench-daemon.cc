@@ -0,0 +1,325 @@
+/* Load generator for the Nix daemon. It runs a number of concurrent
+   clients, each on its own connection, that issue a weighted random
+   mix of worker protocol operations for a fixed time. It then reports
+   the throughput and latency percentiles of each operation and, if
+   the daemon exports metrics (see `daemon-metrics-socket'), how often
+   SQLite transactions were retried because the database was busy. */
+
+#include "archive.hh"
+#include "args.hh"
+#include "globals.hh"
+#include "hash.hh"
+#include "pool.hh"
+#include "remote-store.hh"
+#include "util.hh"
+#include "worker-protocol.hh"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <thread>
+
+using namespace nix;
+
+enum Op { opQueryPathInfo, opIsValidPath, opAddTempRoot, opAddToStoreNar, opNarFromPath, nrOps };
+
+static const char * opNames[nrOps] = {
+    "QueryPathInfo", "IsValidPath", "AddTempRoot", "AddToStoreNar", "NarFromPath"
+};
+
+/* A daemon client that fetches NARs through the daemon, like
+   SSHStore does, rather than reading them from the file system. */
+struct BenchStore : UDSRemoteStore
+{
+    BenchStore(const std::string & socketPath, const Params & params)
+        : Store(params)
+        , UDSRemoteStore(socketPath, params)
+    { }
+
+    void narFromPath(const StorePath & path, Sink & sink) override
+    {
+        auto conn(connections->get());
+        conn->to << wopNarFromPath << printStorePath(path);
+        if (auto ex = conn->processStderr()) std::rethrow_exception(ex);
+        copyNAR(conn->from, sink);
+    }
+};
+
+/* The latencies (in seconds) and failures of one kind of operation. */
+struct Samples
+{
+    std::vector<double> latencies;
+    uint64_t errors = 0;
+};
+
+/* The NAR of a single regular file of `size' bytes, unique to
+   `seed'. */
+static std::string makeNar(size_t size, const std::string & seed)
+{
+    std::string contents = seed + "\n";
+    std::mt19937_64 rng(std::hash<std::string>()(seed));
+    while (contents.size() < size)
+        contents += fmt("%016x\n", rng());
+    contents.resize(std::max(size, seed.size() + 1));
+    StringSink sink;
+    dumpString(contents, sink);
+    return *sink.s;
+}
+
+static void addNar(Store & store, const std::string & name, const std::string & nar)
+{
+    ValidPathInfo info(store.makeStorePath("source", hashString(htSHA256, nar), name));
+    info.narHash = hashString(htSHA256, nar);
+    info.narSize = nar.size();
+    StringSource source(nar);
+    store.addToStore(info, source, NoRepair, NoCheckSigs);
+}
+
+/* Return the value of the counter `name' from the daemon metrics
+   served on `socketPath'. */
+static std::optional<uint64_t> readMetric(const Path & socketPath, const std::string & name)
+{
+    AutoCloseFD fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (!fd) throw SysError("cannot create Unix domain socket");
+
+    struct sockaddr_un addr;
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() + 1 >= sizeof(addr.sun_path))
+        throw Error("socket path '%1%' is too long", socketPath);
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    if (::connect(fd.get(), (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        throw SysError("cannot connect to the daemon metrics at '%1%'", socketPath);
+
+    writeFull(fd.get(), "GET /metrics HTTP/1.0\r\n\r\n");
+
+    for (auto & line : tokenizeString<Strings>(drainFD(fd.get()), "\r\n")) {
+        auto fields = tokenizeString<std::vector<std::string>>(line, " ");
+        uint64_t n;
+        if (fields.size() == 2 && fields[0] == name && string2Int(fields[1], n))
+            return n;
+    }
+
+    return {};
+}
+
+static double percentile(const std::vector<double> & sorted, double p)
+{
+    if (sorted.empty()) return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t) (p * sorted.size()))];
+}
+
+static void showHelp()
+{
+    std::cout <<
+        "Usage: bench-daemon [options]\n"
+        "\n"
+        "  --socket PATH          daemon socket (default: the `nix-daemon' socket)\n"
+        "  --metrics-socket PATH  daemon metrics socket, to report SQLite busy retries\n"
+        "  --clients N            number of concurrent clients (default 8)\n"
+        "  --duration SECONDS     how long to generate load (default 10)\n"
+        "  --paths N              number of paths to query and fetch (default 100)\n"
+        "  --nar-size BYTES       size of the NARs added and fetched (default 4096)\n"
+        "  --mix OP=W,...         relative weights of the operations\n"
+        "                         (default QueryPathInfo=50,IsValidPath=30,AddTempRoot=10,\n"
+        "                          AddToStoreNar=5,NarFromPath=5)\n";
+}
+
+int main(int argc, char * * argv)
+{
+    Path socketPath = settings.nixDaemonSocketFile;
+    Path metricsSocket;
+    size_t nrClients = 8;
+    double duration = 10;
+    size_t nrPaths = 100;
+    size_t narSize = 4096;
+    std::vector<unsigned int> weights{50, 30, 10, 5, 5};
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            auto next = [&]() -> std::string {
+                if (i + 1 >= argc) throw UsageError("flag '%s' requires an argument", arg);
+                return argv[++i];
+            };
+            auto number = [&]() {
+                size_t n;
+                if (!string2Int(next(), n) || !n)
+                    throw UsageError("flag '%s' requires a positive number", arg);
+                return n;
+            };
+            if (arg == "--help") { showHelp(); return 0; }
+            else if (arg == "--socket") socketPath = next();
+            else if (arg == "--metrics-socket") metricsSocket = next();
+            else if (arg == "--clients") nrClients = number();
+            else if (arg == "--duration") duration = number();
+            else if (arg == "--paths") nrPaths = number();
+            else if (arg == "--nar-size") narSize = number();
+            else if (arg == "--mix") {
+                std::fill(weights.begin(), weights.end(), 0);
+                for (auto & s : tokenizeString<Strings>(next(), ",")) {
+                    auto eq = s.find('=');
+                    auto op = std::find(opNames, opNames + nrOps, s.substr(0, eq)) - opNames;
+                    unsigned int w;
+                    if (op == nrOps || eq == std::string::npos || !string2Int(s.substr(eq + 1), w))
+                        throw UsageError("invalid operation weight '%s'", s);
+                    weights[op] = w;
+                }
+            }
+            else throw UsageError("unknown flag '%s'", arg);
+        }
+
+        if (std::all_of(weights.begin(), weights.end(), [](auto w) { return w == 0; }))
+            throw UsageError("all operation weights are zero");
+
+        /* Every client has its own connection, and no client-side
+           caching, so that every operation reaches the daemon. */
+        Store::Params params{{"max-connections", "1"}, {"path-info-cache-size", "0"}};
+
+        /* Paths to look up, protect and fetch. Their names are
+           unique to this run so that they are not valid already. */
+        auto runId = fmt("%d-%d", getpid(), time(0));
+
+        std::cerr << fmt("adding %d paths of %d bytes...\n", nrPaths, narSize);
+
+        StorePaths paths;
+        {
+            auto store = make_ref<BenchStore>(socketPath, params);
+            for (size_t i = 0; i < nrPaths; i++) {
+                auto name = fmt("bench-%s-%d", runId, i);
+                auto nar = makeNar(narSize, name);
+                addNar(*store, name, nar);
+                paths.push_back(store->makeStorePath("source", hashString(htSHA256, nar), name));
+            }
+        }
+
+        std::optional<uint64_t> busyBefore;
+        if (metricsSocket != "")
+            busyBefore = readMetric(metricsSocket, "nix_daemon_sqlite_busy_total");
+
+        std::cerr << fmt("running %d clients for %g seconds...\n", nrClients, duration);
+
+        std::vector<std::array<Samples, nrOps>> samples(nrClients);
+        std::atomic<bool> stop{false};
+        std::vector<std::thread> threads;
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (size_t c = 0; c < nrClients; c++)
+            threads.emplace_back([&, c]() {
+                auto & mine(samples[c]);
+                std::mt19937 rng(c);
+                std::discrete_distribution<int> pickOp(weights.begin(), weights.end());
+                std::uniform_int_distribution<size_t> pickPath(0, paths.size() - 1);
+                size_t added = 0;
+
+                std::shared_ptr<BenchStore> store;
+
+                while (!stop) {
+                    auto op = (Op) pickOp(rng);
+                    auto & path(paths[pickPath(rng)]);
+
+                    /* Build the NAR to add before starting the clock. */
+                    std::string name, nar;
+                    if (op == opAddToStoreNar) {
+                        name = fmt("bench-%s-%d-%d", runId, c, added++);
+                        nar = makeNar(narSize, name);
+                    }
+
+                    auto opStart = std::chrono::steady_clock::now();
+
+                    try {
+                        if (!store) store = std::make_shared<BenchStore>(socketPath, params);
+
+                        switch (op) {
+                        case opQueryPathInfo:
+                            store->queryPathInfo(path);
+                            break;
+                        case opIsValidPath:
+                            store->isValidPath(path);
+                            break;
+                        case opAddTempRoot:
+                            store->addTempRoot(path);
+                            break;
+                        case opAddToStoreNar:
+                            addNar(*store, name, nar);
+                            break;
+                        case opNarFromPath: {
+                            LambdaSink sink([](const unsigned char *, size_t) { });
+                            store->narFromPath(path, sink);
+                            break;
+                        }
+                        default:
+                            abort();
+                        }
+
+                        mine[op].latencies.push_back(
+                            std::chrono::duration<double>(std::chrono::steady_clock::now() - opStart).count());
+                    } catch (Error & e) {
+                        /* Start over with a new connection, which the
+                           daemon may have closed. */
+                        if (!mine[op].errors++)
+                            std::cerr << fmt("client %d: %s: %s\n", c, opNames[op], e.what());
+                        store.reset();
+                    }
+                }
+            });
+
+        std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+        stop = true;
+        for (auto & thread : threads) thread.join();
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << fmt("%-16s %10s %10s %8s %9s %9s %9s %9s\n",
+            "operation", "count", "ops/s", "errors", "p50-ms", "p90-ms", "p99-ms", "max-ms");
+
+        std::vector<double> all;
+        uint64_t totalErrors = 0;
+
+        auto row = [&](const std::string & name, std::vector<double> & latencies, uint64_t errors) {
+            std::sort(latencies.begin(), latencies.end());
+            std::cout << fmt("%-16s %10d %10.1f %8d %9.3f %9.3f %9.3f %9.3f\n",
+                name, latencies.size(), latencies.size() / elapsed, errors,
+                percentile(latencies, 0.5) * 1e3,
+                percentile(latencies, 0.9) * 1e3,
+                percentile(latencies, 0.99) * 1e3,
+                latencies.empty() ? 0.0 : latencies.back() * 1e3);
+        };
+
+        for (size_t op = 0; op < nrOps; op++) {
+            if (!weights[op]) continue;
+            Samples merged;
+            for (auto & s : samples) {
+                merged.latencies.insert(merged.latencies.end(), s[op].latencies.begin(), s[op].latencies.end());
+                merged.errors += s[op].errors;
+            }
+            all.insert(all.end(), merged.latencies.begin(), merged.latencies.end());
+            totalErrors += merged.errors;
+            row(opNames[op], merged.latencies, merged.errors);
+        }
+
+        row("total", all, totalErrors);
+
+        if (busyBefore) {
+            auto busyAfter = readMetric(metricsSocket, "nix_daemon_sqlite_busy_total");
+            std::cout << fmt("\nSQLite busy retries: %d\n", busyAfter ? *busyAfter - *busyBefore : 0);
+        } else
+            std::cout << "\nSQLite busy retries: unknown (pass --metrics-socket)\n";
+
+    } catch (UsageError & e) {
+        std::cerr << "error: " << e.what() << "\nTry 'bench-daemon --help' for more information.\n";
+        return 1;
+    } catch (Error & e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
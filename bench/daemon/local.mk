@@ -0,0 +1,22 @@
+programs += bench-daemon
+
+bench-daemon_DIR := $(d)
+
+bench-daemon_INSTALL_DIR :=
+
+bench-daemon_SOURCES := $(wildcard $(d)/*.cc)
+
+bench-daemon_CXXFLAGS += -I src/libutil -I src/libstore
+
+bench-daemon_LIBS = libstore libutil
+
+# Load test of the worker protocol against a throwaway daemon. See
+# bench/daemon/run.sh for the BENCH_* knobs.
+
+.PHONY: bench-daemon
+
+bench-daemon: $(nix_PATH) $(bench-daemon_PATH)
+	@bench/daemon/run.sh $(nix_PATH) $(bench-daemon_PATH)
+
+print-top-help += \
+  echo "  bench-daemon: Measure daemon throughput and latency under concurrent clients";
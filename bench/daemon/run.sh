@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+#
+# Daemon load benchmark.
+#
+# Usage: run.sh <path to nix binary> <path to bench-daemon>
+#
+# Starts a daemon on an empty store in a scratch directory and runs
+# bench-daemon against it. Knobs (environment variables):
+#
+#   BENCH_CLIENTS   number of concurrent clients (default 8)
+#   BENCH_DURATION  seconds of load (default 10)
+#   BENCH_MIX       operation weights, e.g.
+#                   "QueryPathInfo=50,IsValidPath=30,AddTempRoot=10,AddToStoreNar=5,NarFromPath=5"
+#   BENCH_ARGS      further arguments to bench-daemon
+#
+# To measure a daemon that is already running, run bench-daemon
+# directly; see `bench-daemon --help'.
+
+set -e
+
+nix=$(realpath "$1")
+bench=$(realpath "$2")
+
+scratch=$(mktemp -d)
+trap 'kill $pidDaemon 2> /dev/null; wait; rm -rf "$scratch"' EXIT
+
+mkdir -p "$scratch/bin"
+ln -s "$nix" "$scratch/bin/nix-daemon"
+
+export NIX_STORE_DIR=$scratch/store
+export NIX_STATE_DIR=$scratch/var/nix
+export NIX_LOG_DIR=$scratch/var/log/nix
+export NIX_CONF_DIR=$scratch/etc
+export NIX_DAEMON_SOCKET_PATH=$scratch/daemon.socket
+export HOME=$scratch/home
+unset NIX_REMOTE NIX_USER_CONF_FILES XDG_CONFIG_HOME
+mkdir -p "$NIX_CONF_DIR" "$HOME"
+
+"$scratch/bin/nix-daemon" --daemon-metrics-socket "$scratch/metrics.socket" &
+pidDaemon=$!
+
+for ((i = 0; i < 30; i++)); do
+    if [[ -e $NIX_DAEMON_SOCKET_PATH && -e $scratch/metrics.socket ]]; then break; fi
+    sleep 1
+done
+
+args=(--clients "${BENCH_CLIENTS:-8}" --duration "${BENCH_DURATION:-10}")
+if [[ -n $BENCH_MIX ]]; then
+    args+=(--mix "$BENCH_MIX")
+fi
+
+"$bench" --metrics-socket "$scratch/metrics.socket" "${args[@]}" $BENCH_ARGS
@@ -0,0 +1,14 @@
+# Attribute set heavy workload: building, updating, merging and
+# looking up large sets, roughly like a package set with overrides.
+let
+  n = 20000;
+  names = builtins.genList (i: "attr${toString i}") n;
+  big = builtins.listToAttrs (map (name: { inherit name; value = { inherit name; x = 1; }; }) names);
+  updated = builtins.foldl' (acc: i: acc // { "attr${toString (i * 7)}" = { x = i; }; }) big (builtins.genList (i: i) 2000);
+  mapped = builtins.mapAttrs (name: v: v // { y = v.x + 1; }) updated;
+  nested = builtins.foldl' (acc: i: { "l${toString i}" = acc; }) { leaf = 1; } (builtins.genList (i: i) 1000);
+  depth = s: if s ? leaf then 0 else 1 + depth (s.${builtins.head (builtins.attrNames s)});
+in
+  builtins.foldl' (acc: name: acc + mapped.${name}.y) 0 names
+  + builtins.length (builtins.attrNames (builtins.intersectAttrs big mapped))
+  + depth nested
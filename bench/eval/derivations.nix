@@ -0,0 +1,15 @@
+# Derivation heavy workload: instantiating a deep and wide graph of
+# derivations. Forcing the `drvPath's computes all derivation hashes.
+let
+  mkDrv = name: deps: derivation {
+    inherit name;
+    system = "x86_64-linux";
+    builder = "/bin/sh";
+    args = [ "-c" "echo ${name} > $out" ];
+    buildInputs = deps;
+    outputs = [ "out" "dev" ];
+  };
+  layer = prev: i: builtins.genList (j: mkDrv "pkg-${toString i}-${toString j}" (if prev == [] then [] else [ (builtins.elemAt prev j) (builtins.elemAt prev ((j + 1) - (j + 1) / 50 * 50)) ])) 50;
+  layers = builtins.foldl' (acc: i: acc ++ [ (layer (if acc == [] then [] else builtins.elemAt acc (builtins.length acc - 1)) i) ]) [] (builtins.genList (i: i) 40);
+in
+  builtins.length (map (d: d.drvPath) (builtins.concatLists layers))
@@ -0,0 +1,15 @@
+# List heavy workload: generation, map/filter, folds, sorting and
+# concatenation.
+let
+  n = 100000;
+  xs = builtins.genList (i: (i * 7919) - (i / 13) * 13) n;
+  evens = builtins.filter (x: x / 2 * 2 == x) xs;
+  squares = map (x: x * x) evens;
+  sorted = builtins.sort builtins.lessThan (builtins.genList (i: (i * 104729) - (i * 104729) / 65536 * 65536) 20000);
+  chunks = builtins.genList (i: builtins.genList (j: i + j) 20) 5000;
+  flat = builtins.concatLists chunks;
+in
+  builtins.foldl' (a: b: a + b) 0 squares
+  + builtins.head sorted
+  + builtins.length flat
+  + builtins.length (builtins.filter (x: builtins.elem x [ 1 2 3 5 8 13 ]) (builtins.genList (i: i) 20000))
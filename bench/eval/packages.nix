@@ -0,0 +1,37 @@
+# A synthetic package set in the style of Nixpkgs: a fixpoint over
+# overlays, callPackage with automatic arguments, and overrides.
+let
+  fix = f: let x = f x; in x;
+  extends = overlay: f: self: let super = f self; in super // overlay self super;
+  composeOverlays = overlays: base: builtins.foldl' (f: o: extends o f) base overlays;
+
+  n = 3000;
+
+  callPackageWith = autoArgs: fn: args:
+    let f = if builtins.isFunction fn then fn else import fn;
+    in f (builtins.intersectAttrs (builtins.functionArgs f) autoArgs // args);
+
+  mkPackage = i: { stdenv, lib, dep ? null }: {
+    name = "pkg-${toString i}";
+    version = lib.version i;
+    deps = if dep == null then [] else [ dep ];
+    meta.description = "Package number ${toString i}";
+  };
+
+  base = self: {
+    lib = { version = i: "1.${toString i}"; };
+    stdenv = { cc = "gcc"; };
+    callPackage = callPackageWith self;
+  } // builtins.listToAttrs (builtins.genList (i: {
+    name = "pkg${toString i}";
+    value = self.callPackage (mkPackage i) (if i == 0 then {} else { dep = self."pkg${toString (i - 1)}"; });
+  }) n);
+
+  overlays = builtins.genList (k: self: super: {
+    "pkg${toString (k * 10)}" = super."pkg${toString (k * 10)}" // { patched = k; };
+  }) 100;
+
+  pkgs = fix (composeOverlays overlays base);
+in
+  builtins.length (builtins.filter (p: p ? name && builtins.length p.deps == 1)
+    (map (i: pkgs."pkg${toString i}") (builtins.genList (i: i) n)))
@@ -0,0 +1,92 @@
+#!/usr/bin/env bash
+#
+# Run the evaluator benchmarks.
+#
+# Usage: run.sh <path to nix binary> [runs]
+#
+# Each benchmark is evaluated `runs' times (default 3) in a scratch
+# store. The NIX_SHOW_STATS output of every run is kept in
+# $BENCH_RESULTS (default ./bench-results) and a summary with the best
+# wall time and the CPU time of that run is printed and written to
+# $BENCH_RESULTS/summary.tsv.
+
+set -e
+
+nix=$(realpath "$1")
+runs=${2:-3}
+dir=$(cd "$(dirname "$0")" && pwd)
+results=${BENCH_RESULTS:-bench-results}
+
+mkdir -p "$results"
+results=$(realpath "$results")
+
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+
+export NIX_STATE_DIR=$scratch/var/nix
+export NIX_LOG_DIR=$scratch/var/log/nix
+export NIX_CONF_DIR=$scratch/etc
+export HOME=$scratch/home
+unset NIX_PATH NIX_REMOTE NIX_USER_CONF_FILES XDG_CONFIG_HOME XDG_CACHE_HOME
+mkdir -p "$NIX_CONF_DIR" "$HOME"
+
+instantiate() {
+    (exec -a nix-instantiate "$nix" --store "local?root=$scratch/root" "$@")
+}
+
+# A large generated file for the parse-only benchmark.
+{
+    echo "rec {"
+    for ((i = 0; i < 20000; i++)); do
+        echo "  f$i = { a, b ? $i, ... }@args: if a > b then [ a \"s$i\" ] else args // { c = a + b * $i; s = \"\${toString a}-$i\"; };"
+    done
+    echo "}"
+} > "$scratch/parse.nix"
+
+# A Cargo.lock of about 5 MB for the fromTOML benchmark.
+{
+    echo "version = 3"
+    for ((i = 0; i < 20000; i++)); do
+        echo
+        echo "[[package]]"
+        echo "name = \"crate-$i\""
+        echo "version = \"0.$((i % 10)).$i\""
+        echo "source = \"registry+https://github.com/rust-lang/crates.io-index\""
+        echo "checksum = \"$(printf '%064x' $i)\""
+        echo "dependencies = ["
+        echo " \"crate-$((i / 2))\","
+        echo " \"crate-$((i / 3)) 0.1.$i\","
+        echo "]"
+    done
+} > "$scratch/Cargo.lock"
+echo "builtins.length (builtins.fromTOML (builtins.readFile ./Cargo.lock)).package" > "$scratch/toml.nix"
+
+benchmarks=(attrsets update lists strings derivations packages parse toml)
+
+summary=$results/summary.tsv
+printf "benchmark\twall-ms\tcpu-s\n" > "$summary"
+
+for name in "${benchmarks[@]}"; do
+    best=
+    bestCpu=
+    for ((run = 1; run <= runs; run++)); do
+        stats=$results/$name.$run.json
+        start=$(date +%s%N)
+        if [[ $name = parse ]]; then
+            NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$stats instantiate --parse "$scratch/parse.nix" > /dev/null
+        elif [[ $name = toml ]]; then
+            NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$stats instantiate --eval --strict "$scratch/toml.nix" > /dev/null
+        else
+            NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$stats instantiate --eval --strict "$dir/$name.nix" > /dev/null
+        fi
+        end=$(date +%s%N)
+        wall=$(( (end - start) / 1000000 ))
+        if [[ -z $best || $wall -lt $best ]]; then
+            best=$wall
+            bestCpu=$(grep -o '"cpuTime":[0-9.e+-]*' "$stats" | cut -d: -f2 || true)
+        fi
+    done
+    printf "%s\t%s\t%s\n" "$name" "$best" "${bestCpu:-?}" >> "$summary"
+done
+
+column -t "$summary" 2> /dev/null || cat "$summary"
@@ -0,0 +1,18 @@
+# String heavy workload: interpolation, concatenation, replacement,
+# regular expressions and JSON conversion.
+let
+  n = 20000;
+  words = builtins.genList (i: "word-${toString i}") n;
+  joined = builtins.concatStringsSep " " words;
+  replaced = builtins.replaceStrings [ "word" "-" ] [ "w" "_" ] joined;
+  matched = builtins.filter (w: builtins.match "word-[0-9]*7" w != null) words;
+  split = builtins.split " " (builtins.substring 0 100000 joined);
+  json = builtins.toJSON (builtins.genList (i: { name = "x${toString i}"; v = i; }) 5000);
+  lengths = map builtins.stringLength words;
+in
+  builtins.stringLength replaced
+  + builtins.length matched
+  + builtins.length split
+  + builtins.stringLength json
+  + builtins.foldl' (a: b: a + b) 0 lengths
+  + builtins.length (builtins.fromJSON json)
@@ -0,0 +1,10 @@
+# The '//' operator: overriding a few attributes of a large set many
+# times, like a chain of overlays, and merging sets of similar size.
+let
+  n = 10000;
+  big = builtins.listToAttrs (builtins.genList (i: { name = "attr${toString i}"; value = i; }) n);
+  overridden = builtins.foldl' (acc: i: acc // { "attr${toString (i * 13 % n)}" = -i; extra = i; }) big (builtins.genList (i: i) 5000);
+  other = builtins.listToAttrs (builtins.genList (i: { name = "attr${toString (i * 2)}"; value = 0; }) n);
+  merged = builtins.foldl' (acc: i: acc // other // { inherit i; }) big (builtins.genList (i: i) 200);
+in
+  overridden.attr0 + overridden.extra + builtins.length (builtins.attrNames merged)
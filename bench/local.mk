@@ -0,0 +1,22 @@
+# Evaluator benchmarks. Run with `make bench-eval [BENCH_RUNS=n]'.
+
+BENCH_RUNS ?= 3
+
+.PHONY: bench-eval
+
+bench-eval: $(nix_PATH)
+	@bench/eval/run.sh $(nix_PATH) $(BENCH_RUNS)
+
+print-top-help += \
+  echo "  bench-eval: Run the evaluator benchmarks";
+
+# End-to-end substitution benchmark. See bench/substitute/run.sh for
+# the BENCH_* knobs.
+
+.PHONY: bench-substitute
+
+bench-substitute: $(nix_PATH)
+	@bench/substitute/run.sh $(nix_PATH) $(BENCH_RUNS)
+
+print-top-help += \
+  echo "  bench-substitute: Time substituting a synthetic closure from a binary cache";
@@ -0,0 +1,259 @@
+/* Micro-benchmarks for the store layer's hot paths. Each benchmark
+   runs its body repeatedly for at least `--min-time' seconds and
+   reports the rate in operations and, where it makes sense, bytes per
+   second. Pass substrings of benchmark names to run only those. */
+
+#include "archive.hh"
+#include "compression.hh"
+#include "derivations.hh"
+#include "globals.hh"
+#include "hash.hh"
+#include "local-store.hh"
+#include "references.hh"
+#include "serialise.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <iostream>
+
+using namespace nix;
+
+struct Result
+{
+    uint64_t ops = 0;
+    uint64_t bytes = 0;
+};
+
+struct Benchmark
+{
+    std::string name;
+    /* Run one iteration and return what it processed. */
+    std::function<Result()> iterate;
+};
+
+static double minTime = 1.0;
+
+static void run(const Benchmark & bench)
+{
+    using namespace std::chrono;
+
+    Result total;
+    auto start = steady_clock::now();
+    double elapsed;
+
+    do {
+        auto r = bench.iterate();
+        total.ops += r.ops;
+        total.bytes += r.bytes;
+        elapsed = duration<double>(steady_clock::now() - start).count();
+    } while (elapsed < minTime);
+
+    std::cout << fmt("%-36s %12.1f ops/s", bench.name, total.ops / elapsed);
+    if (total.bytes)
+        std::cout << fmt(" %10.1f MB/s", total.bytes / elapsed / 1e6);
+    std::cout << "\n";
+}
+
+/* Deterministic, moderately compressible data. */
+static std::string makeData(size_t size, uint64_t seed)
+{
+    std::string s;
+    s.reserve(size);
+    uint64_t x = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    while (s.size() < size) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        if ((x >> 60) < 10)
+            s += fmt("line %d of some text\n", x >> 48);
+        else
+            s.push_back('a' + (x >> 59));
+    }
+    s.resize(size);
+    return s;
+}
+
+/* A tree of many small files, roughly like a typical package. */
+static void makeTree(const Path & root, size_t dirs, size_t filesPerDir, size_t fileSize)
+{
+    createDirs(root);
+    for (size_t d = 0; d < dirs; d++) {
+        auto dir = fmt("%s/dir-%d", root, d);
+        createDirs(dir);
+        for (size_t f = 0; f < filesPerDir; f++)
+            writeFile(fmt("%s/file-%d", dir, f), makeData(fileSize, d * filesPerDir + f));
+        createSymlink("file-0", dir + "/link");
+    }
+}
+
+static Result countBytes(std::function<void(Sink &)> fun)
+{
+    uint64_t n = 0;
+    LambdaSink sink([&](const unsigned char *, size_t len) { n += len; });
+    fun(sink);
+    return {1, n};
+}
+
+int main(int argc, char * * argv)
+{
+    std::vector<std::string> filters;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--min-time" && i + 1 < argc)
+            minTime = std::stod(argv[++i]);
+        else
+            filters.push_back(arg);
+    }
+
+    try {
+        AutoDelete tmpDir(createTempDir("", "nix-bench-store"), true);
+        Path tmp = tmpDir;
+
+        Path smallTree = tmp + "/small";
+        makeTree(smallTree, 50, 40, 4096);
+
+        Path bigTree = tmp + "/big";
+        makeTree(bigTree, 1, 1, 64 * 1024 * 1024);
+
+        StringSink smallNar;
+        dumpPath(smallTree, smallNar);
+
+        auto data = makeData(64 * 1024 * 1024, 42);
+
+        auto store = make_ref<LocalStore>(Store::Params{
+            {"root", tmp + "/root"},
+        });
+
+        std::vector<Benchmark> benchmarks;
+
+        for (auto & [name, path] : {std::pair{"small", smallTree}, std::pair{"big", bigTree}})
+            benchmarks.push_back({fmt("dumpPath/%s", name), [path = path]() {
+                return countBytes([&](Sink & sink) { dumpPath(path, sink); });
+            }});
+
+        benchmarks.push_back({"restorePath/small", [&]() {
+            Path dest = tmp + "/restored";
+            StringSource source(*smallNar.s);
+            restorePath(dest, source);
+            deletePath(dest);
+            return Result{1, smallNar.s->size()};
+        }});
+
+        {
+            PathSet refs;
+            for (size_t i = 0; i < 100; i++)
+                refs.insert(store->printStorePath(
+                    store->makeStorePath("source", hashString(htSHA256, std::to_string(i)), fmt("ref-%d", i))));
+
+            for (auto & [name, path] : {std::pair{"small", smallTree}, std::pair{"big", bigTree}})
+                benchmarks.push_back({fmt("scanForReferences/%s", name), [refs, path = path]() {
+                    HashResult hash;
+                    scanForReferences(path, refs, hash);
+                    return Result{1, hash.second};
+                }});
+        }
+
+        for (auto ht : {htMD5, htSHA1, htSHA256, htSHA512})
+            benchmarks.push_back({"HashSink/" + printHashType(ht), [ht, &data]() {
+                HashSink sink(ht);
+                sink((const unsigned char *) data.data(), data.size());
+                sink.finish();
+                return Result{1, data.size()};
+            }});
+
+        for (auto method : {"none", "xz", "bzip2", "br", "zstd"}) {
+            try {
+                compress(method, "");
+            } catch (UnknownCompressionMethod &) {
+                continue;
+            }
+            benchmarks.push_back({fmt("compress/%s", method), [method, &smallNar]() {
+                countBytes([&](Sink & out) {
+                    auto sink = makeCompressionSink(method, out);
+                    (*sink)(*smallNar.s);
+                    sink->finish();
+                });
+                return Result{1, smallNar.s->size()};
+            }});
+        }
+
+        {
+            Derivation drv;
+            drv.platform = "x86_64-linux";
+            drv.builder = "/bin/sh";
+            drv.args = {"-e", "builder.sh"};
+            for (size_t i = 0; i < 20; i++) {
+                drv.inputSrcs.insert(store->makeStorePath("source", hashString(htSHA256, fmt("src-%d", i)), "src"));
+                drv.inputDrvs.emplace(
+                    store->makeStorePath("source", hashString(htSHA256, fmt("drv-%d", i)), "dep.drv"),
+                    StringSet{"out"});
+            }
+            for (size_t i = 0; i < 50; i++)
+                drv.env[fmt("VAR_%d", i)] = makeData(100, i);
+            for (auto & output : {"out", "dev", "doc"}) {
+                auto path = store->makeStorePath("output:out", hashString(htSHA256, output), "pkg");
+                drv.outputs.emplace(output, DerivationOutput{path, std::nullopt});
+                drv.env[output] = store->printStorePath(path);
+            }
+            Path drvFile = tmp + "/pkg.drv";
+            auto text = drv.unparse(*store, false);
+            writeFile(drvFile, text);
+
+            benchmarks.push_back({"readDerivation", [&, drvFile, size = text.size()]() {
+                readDerivation(*store, drvFile);
+                return Result{1, size};
+            }});
+        }
+
+        /* Outlive the benchmark bodies below that refer to them. */
+        uint64_t round = 0;
+        std::vector<StorePath> registered;
+
+        {
+            size_t batch = 1000;
+
+            auto registerBatch = [&, batch]() {
+                ValidPathInfos infos;
+                for (size_t i = 0; i < batch; i++) {
+                    auto path = store->makeStorePath("source",
+                        hashString(htSHA256, fmt("%d-%d", round, i)), "path");
+                    ValidPathInfo info(path);
+                    info.narHash = hashString(htSHA256, "");
+                    info.narSize = 120;
+                    if (!infos.empty()) info.references.insert(infos.back().path);
+                    infos.push_back(std::move(info));
+                    registered.push_back(path);
+                }
+                round++;
+                store->registerValidPaths(infos);
+                return Result{batch, 0};
+            };
+
+            /* Make sure queryPathInfo has something to look up. */
+            registerBatch();
+
+            benchmarks.push_back({"registerValidPaths/1000", registerBatch});
+
+            benchmarks.push_back({"queryPathInfo/uncached", [&]() {
+                store->clearPathInfoCache();
+                size_t n = std::min(registered.size(), (size_t) 1000);
+                for (size_t i = 0; i < n; i++)
+                    store->queryPathInfo(registered[i]);
+                return Result{n, 0};
+            }});
+        }
+
+        for (auto & bench : benchmarks) {
+            if (!filters.empty() &&
+                std::none_of(filters.begin(), filters.end(),
+                    [&](auto & f) { return bench.name.find(f) != std::string::npos; }))
+                continue;
+            run(bench);
+        }
+
+    } catch (Error & e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
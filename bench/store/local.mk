@@ -0,0 +1,18 @@
+programs += bench-store
+
+bench-store_DIR := $(d)
+
+bench-store_INSTALL_DIR :=
+
+bench-store_SOURCES := $(wildcard $(d)/*.cc)
+
+bench-store_CXXFLAGS += -I src/libutil -I src/libstore
+
+bench-store_LIBS = libstore libutil
+
+.PHONY: bench-store
+
+bench-store: bench-store_RUN
+
+print-top-help += \
+  echo "  bench-store: Run the store micro-benchmarks";
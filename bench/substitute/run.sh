@@ -0,0 +1,114 @@
+#!/usr/bin/env bash
+#
+# End-to-end substitution benchmark.
+#
+# Usage: run.sh <path to nix binary> [runs]
+#
+# Generates a synthetic closure, puts it in a binary cache and then
+# times substituting it into an empty store, `runs' times (default 3)
+# for each client. Everything is deterministic, so results of two
+# builds can be compared. Knobs (environment variables):
+#
+#   BENCH_PATHS        number of paths in the closure (default 500)
+#   BENCH_MAX_SIZE     maximum path size in bytes; sizes are
+#                      log-uniform from 1 KiB (default 4 MiB)
+#   BENCH_COMPRESSION  compression method of the cache (default xz)
+#   BENCH_CACHE        "http" to go through the HTTP binary cache
+#                      store and the file transfer thread, or "file"
+#                      for the local binary cache store (default http)
+
+set -e
+
+nix=$(realpath "$1")
+runs=${2:-3}
+paths=${BENCH_PATHS:-500}
+maxSize=${BENCH_MAX_SIZE:-4194304}
+compression=${BENCH_COMPRESSION:-xz}
+cacheType=${BENCH_CACHE:-http}
+
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+
+mkdir -p "$scratch/bin"
+for i in nix nix-store nix-instantiate; do
+    ln -s "$nix" "$scratch/bin/$i"
+done
+export PATH=$scratch/bin:$PATH
+
+export NIX_STATE_DIR=$scratch/var/nix
+export NIX_LOG_DIR=$scratch/var/log/nix
+export NIX_CONF_DIR=$scratch/etc
+export HOME=$scratch/home
+export XDG_CACHE_HOME=$scratch/cache
+unset NIX_PATH NIX_REMOTE NIX_USER_CONF_FILES XDG_CONFIG_HOME
+mkdir -p "$NIX_CONF_DIR" "$HOME"
+
+src="local?root=$scratch/src"
+cacheDir=$scratch/binary-cache
+
+echo "generating $paths paths..." >&2
+
+awk -v n="$paths" -v max="$maxSize" 'BEGIN {
+    srand(42);
+    for (i = 0; i < n; i++)
+        printf "%d\n", exp(log(1024) + rand() * (log(max) - log(1024)));
+}' > "$scratch/sizes"
+
+# Pseudo-random hex text: compresses to roughly half its size, like
+# typical binaries.
+i=0
+while read -r size; do
+    mkdir -p "$scratch/gen/p$i"
+    awk -v seed="$i" -v size="$size" 'BEGIN {
+        srand(seed);
+        for (n = 0; n < size; n += 17)
+            printf "%08x%08x\n", rand() * 4294967295, rand() * 4294967295;
+    }' | head -c "$size" > "$scratch/gen/p$i/data"
+    i=$((i + 1))
+done < "$scratch/sizes"
+
+nix-store --store "$src" --add "$scratch"/gen/* > "$scratch/paths"
+
+# A root that refers to all paths, so the whole closure is fetched.
+root=$(nix-instantiate --store "$src" --read-write-mode --eval -E "
+  builtins.toFile \"closure-root\" (builtins.concatStringsSep \"\n\"
+    (map builtins.storePath
+      (builtins.filter (s: builtins.isString s && s != \"\")
+        (builtins.split \"\n\" (builtins.readFile $scratch/paths)))))" | tr -d '"')
+
+nix --store "$src" copy --to "file://$cacheDir?compression=$compression" "$root"
+
+if [[ $cacheType = http ]]; then
+    export _NIX_FORCE_HTTP=1
+fi
+cache=file://$cacheDir
+
+echo "closure: $((paths + 1)) paths, $(du -sh "$cacheDir" | cut -f1) in the cache ($compression, $cacheType)" >&2
+
+measure() {
+    local name=$1
+    shift
+    for ((run = 1; run <= runs; run++)); do
+        rm -rf "$scratch/dst" "$XDG_CACHE_HOME"
+        if [[ -x /usr/bin/time ]]; then
+            /usr/bin/time -o "$scratch/time" -f "%e %U %S %M" "$@" > /dev/null
+            read -r wall user sys rss < "$scratch/time"
+        else
+            local start=$(date +%s%N)
+            "$@" > /dev/null
+            local end=$(date +%s%N)
+            wall=$(awk -v d=$((end - start)) 'BEGIN { printf "%.2f", d / 1e9 }')
+            user=? sys=? rss=?
+        fi
+        printf "%s\t%s\t%s\t%s\t%s\t%s\n" "$name" "$run" "$wall" "$user" "$sys" "$rss"
+    done
+}
+
+{
+    printf "client\trun\twall-s\tuser-s\tsys-s\tmax-rss-kb\n"
+    measure "nix-copy" \
+        nix copy --from "$cache" --to "local?root=$scratch/dst" --no-check-sigs "$root"
+    measure "nix-store-r" \
+        nix-store --store "local?root=$scratch/dst" -r "$root" \
+            --option substituters "$cache" --option require-sigs false
+} | (column -t 2> /dev/null || cat)
@@ -45,7 +45,7 @@ rec {
       autoreconfHook
 
       curl
-      bzip2 xz brotli zlib editline
+      bzip2 xz brotli zstd zlib editline
       openssl pkgconfig sqlite
       libarchive
       boost
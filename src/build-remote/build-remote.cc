@@ -17,6 +17,7 @@
 #include "store-api.hh"
 #include "derivations.hh"
 #include "local-store.hh"
+#include "sqlite.hh"
 #include "../nix/legacy.hh"
 
 using namespace nix;
@@ -38,6 +39,60 @@ static AutoCloseFD openSlotLock(const Machine & m, unsigned long long slot)
     return openLockFile(fmt("%s/%s-%d", currentLoad, escapeUri(m.storeUri), slot), true);
 }
 
+/* A record of the store paths that are known to be valid on each
+   remote builder because we copied them there or built them there.
+   It's used to prefer builders that already have most of the input
+   closure of a derivation. Builders may garbage-collect those paths
+   at any time, so entries expire after a while; being wrong only
+   costs locality, since copyPaths() still checks what's missing. */
+struct BuilderPaths
+{
+    /* How long we assume a path stays valid on a builder. */
+    const time_t ttl = 3 * 24 * 3600;
+
+    SQLite db;
+    SQLiteStmt insertPath, queryPath, expirePaths;
+
+    BuilderPaths(const Path & dbPath)
+    {
+        db = SQLite(dbPath);
+        db.isCache();
+        db.exec(
+            "create table if not exists BuilderPaths ("
+            "  machine   text not null,"
+            "  hashPart  text not null,"
+            "  timestamp integer not null,"
+            "  primary key (machine, hashPart)"
+            ");");
+        insertPath.create(db,
+            "insert or replace into BuilderPaths (machine, hashPart, timestamp) values (?, ?, ?);");
+        queryPath.create(db,
+            "select 1 from BuilderPaths where machine = ? and hashPart = ? and timestamp > ?;");
+        expirePaths.create(db,
+            "delete from BuilderPaths where timestamp <= ?;");
+    }
+
+    bool isValid(const std::string & machine, const StorePath & path)
+    {
+        return retrySQLite<bool>([&]() {
+            auto use(queryPath.use()(machine)(std::string(path.hashPart()))(time(0) - ttl));
+            return use.next();
+        });
+    }
+
+    void addPaths(const std::string & machine, const StorePathSet & paths)
+    {
+        retrySQLite<void>([&]() {
+            SQLiteTxn txn(db);
+            auto now = time(0);
+            for (auto & path : paths)
+                insertPath.use()(machine)(std::string(path.hashPart()))(now).exec();
+            expirePaths.use()(now - ttl).exec();
+            txn.commit();
+        });
+    }
+};
+
 static bool allSupportedLocally(const std::set<std::string>& requiredFeatures) {
     for (auto & feature : requiredFeatures)
         if (!settings.systemFeatures.get().count(feature)) return false;
@@ -88,6 +143,13 @@ static int _main(int argc, char * * argv)
             return 0;
         }
 
+        std::unique_ptr<BuilderPaths> builderPaths;
+        try {
+            builderPaths = std::make_unique<BuilderPaths>(store->stateDir + "/builder-paths.sqlite");
+        } catch (Error & e) {
+            debug("not using builder locality: %s", e.what());
+        }
+
         std::optional<StorePath> drvPath;
         string storeUri;
 
@@ -111,6 +173,41 @@ static int _main(int argc, char * * argv)
             /* Error ignored here, will be caught later */
             mkdir(currentLoad.c_str(), 0777);
 
+            /* Estimate the cost of sending the input closure of the
+               derivation to each machine, namely the NAR size of the
+               paths that it isn't known to have. This is only
+               computed when it's needed to break a tie. */
+            std::optional<StorePathSet> inputClosure;
+            std::map<std::string, uint64_t> missingBytesCache;
+            auto missingBytes = [&](const Machine & m) -> uint64_t {
+                if (!builderPaths) return 0;
+                auto i = missingBytesCache.find(m.storeUri);
+                if (i != missingBytesCache.end()) return i->second;
+                uint64_t bytes = 0;
+                try {
+                    if (!inputClosure) {
+                        auto drv = store->readDerivation(*drvPath);
+                        StorePathSet inputs = drv.inputSrcs;
+                        for (auto & [inputDrv, wantedOutputs] : drv.inputDrvs) {
+                            auto outputs = store->readDerivation(inputDrv).outputs;
+                            for (auto & j : wantedOutputs) {
+                                auto k = outputs.find(j);
+                                if (k != outputs.end()) inputs.insert(k->second.path);
+                            }
+                        }
+                        inputClosure.emplace();
+                        store->computeFSClosure(inputs, *inputClosure);
+                    }
+                    for (auto & path : *inputClosure)
+                        if (!builderPaths->isValid(m.storeUri, path))
+                            bytes += store->queryPathInfo(path)->narSize;
+                } catch (Error & e) {
+                    debug("cannot estimate transfer cost: %s", e.what());
+                }
+                debug("remote machine '%s' is missing %d bytes of inputs", m.storeUri, bytes);
+                return missingBytesCache[m.storeUri] = bytes;
+            };
+
             while (true) {
                 bestSlotLock = -1;
                 AutoCloseFD lock = openLockFile(currentLoad + "/main-lock", true);
@@ -150,11 +247,17 @@ static int _main(int argc, char * * argv)
                         } else if (load / m.speedFactor < bestLoad / bestMachine->speedFactor) {
                             best = true;
                         } else if (load / m.speedFactor == bestLoad / bestMachine->speedFactor) {
-                            if (m.speedFactor > bestMachine->speedFactor) {
+                            auto missing = missingBytes(m);
+                            auto bestMissing = missingBytes(*bestMachine);
+                            if (missing < bestMissing) {
                                 best = true;
-                            } else if (m.speedFactor == bestMachine->speedFactor) {
-                                if (load < bestLoad) {
+                            } else if (missing == bestMissing) {
+                                if (m.speedFactor > bestMachine->speedFactor) {
                                     best = true;
+                                } else if (m.speedFactor == bestMachine->speedFactor) {
+                                    if (load < bestLoad) {
+                                        best = true;
+                                    }
                                 }
                             }
                         }
@@ -190,6 +293,7 @@ static int _main(int argc, char * * argv)
                     if (hasPrefix(bestMachine->storeUri, "ssh://")) {
                         storeParams["max-connections"] = "1";
                         storeParams["log-fd"] = "4";
+                        storeParams["master-persist"] = std::to_string(settings.buildersMasterPersist);
                         if (bestMachine->sshKey != "")
                             storeParams["ssh-key"] = bestMachine->sshKey;
                     }
@@ -242,6 +346,17 @@ connected:
             copyPaths(store, ref<Store>(sshStore), store->parseStorePathSet(inputs), NoRepair, NoCheckSigs, substitute);
         }
 
+        auto recordPaths = [&](const PathSet & paths) {
+            if (!builderPaths) return;
+            try {
+                builderPaths->addPaths(storeUri, store->parseStorePathSet(paths));
+            } catch (Error & e) {
+                debug("cannot record paths on '%s': %s", storeUri, e.what());
+            }
+        };
+
+        recordPaths(inputs);
+
         uploadLock = -1;
 
         auto drv = store->readDerivation(*drvPath);
@@ -252,6 +367,8 @@ connected:
         if (!result.success())
             throw Error("build of '%s' on '%s' failed: %s", store->printStorePath(*drvPath), storeUri, result.errorMsg);
 
+        recordPaths(outputs);
+
         StorePathSet missing;
         for (auto & path : outputs)
             if (!store->isValidPath(store->parseStorePath(path))) missing.insert(store->parseStorePath(path));
@@ -14,6 +14,7 @@ Bindings * EvalState::allocBindings(size_t capacity)
 {
     if (capacity > std::numeric_limits<Bindings::size_t>::max())
         throw Error("attribute set of size %d is too big", capacity);
+    if (curAllocStats) curAllocStats->bindings++;
     return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity)) Bindings((Bindings::size_t) capacity);
 }
 
@@ -25,7 +26,7 @@ void EvalState::mkAttrs(Value & v, size_t capacity)
         return;
     }
     clearValue(v);
-    v.type = tAttrs;
+    v.setType(tAttrs);
     v.attrs = allocBindings(capacity);
     nrAttrsets++;
     nrAttrsInAttrsets += capacity;
@@ -52,6 +53,29 @@ Value * EvalState::allocAttr(Value & vAttrs, const std::string & name)
 void Bindings::sort()
 {
     std::sort(begin(), end());
+    index = nullptr;
+}
+
+
+unsigned long nrAttrIndexes = 0;
+unsigned long nrAttrIndexLookups = 0;
+
+
+void Bindings::buildIndex() const
+{
+    nrAttrIndexes++;
+    size_t mask = indexSize() - 1;
+    auto index = (uint32_t *) allocBytes(sizeof(uint32_t) * (mask + 1));
+    /* If a name occurs more than once, the first occurrence wins, as
+       with the binary search in find(). */
+    for (size_t n = 0; n < size_; ++n) {
+        auto & name = attrs[n].name;
+        size_t h = name.hash() & mask;
+        while (index[h] && attrs[index[h] - 1].name != name)
+            h = (h + 1) & mask;
+        if (!index[h]) index[h] = n + 1;
+    }
+    this->index = index;
 }
 
 
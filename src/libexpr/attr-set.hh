@@ -27,6 +27,9 @@ struct Attr
     }
 };
 
+/* Statistics about lookups through the hash index of large sets. */
+extern unsigned long nrAttrIndexes, nrAttrIndexLookups;
+
 /* Bindings contains all the attributes of an attribute set. It is defined
    by its size and its capacity, the capacity being the number of Attr
    elements allocated after this structure, while the size corresponds to
@@ -36,13 +39,33 @@ class Bindings
 public:
     typedef uint32_t size_t;
 
+    /* Sets with at least this many attributes are looked up through a
+       hash index rather than by binary search. */
+    static constexpr size_t indexThreshold = 64;
+
 private:
     size_t size_, capacity_;
+
+    /* For sets of at least 'indexThreshold' attributes, an open
+       addressing hash table of indexSize() slots, keyed on
+       Symbol::hash(), that maps names to 1-based positions in
+       'attrs' (0 denotes an empty slot). It is built by the first
+       lookup and discarded when the set is modified. */
+    mutable uint32_t * index = nullptr;
+
     Attr attrs[0];
 
     Bindings(size_t capacity) : size_(0), capacity_(capacity) { }
     Bindings(const Bindings & bindings) = delete;
 
+    /* The smallest power of two that is at least twice the size. */
+    size_t indexSize() const
+    {
+        return (size_t) 1 << (32 - __builtin_clz(2 * size_ - 1));
+    }
+
+    void buildIndex() const;
+
 public:
     size_t size() const { return size_; }
 
@@ -54,22 +77,53 @@ public:
     {
         assert(size_ < capacity_);
         attrs[size_++] = attr;
+        index = nullptr;
+    }
+
+    /* Append the attributes in the range [first, last). */
+    void append(const Attr * first, const Attr * last)
+    {
+        assert(size_ + (last - first) <= capacity_);
+        std::copy(first, last, &attrs[size_]);
+        size_ += last - first;
+        index = nullptr;
     }
 
     iterator find(const Symbol & name)
     {
+        if (size_ >= indexThreshold) {
+            if (!index) buildIndex();
+            nrAttrIndexLookups++;
+            size_t mask = indexSize() - 1;
+            for (size_t h = name.hash() & mask; ; h = (h + 1) & mask) {
+                auto n = index[h];
+                if (!n) return end();
+                if (attrs[n - 1].name == name) return &attrs[n - 1];
+            }
+        }
         Attr key(name, 0);
         iterator i = std::lower_bound(begin(), end(), key);
         if (i != end() && i->name == name) return i;
         return end();
     }
 
+    /* Like find(), but first try position 'hint', and update it to
+       the position of the result. Call sites that keep seeing sets
+       of the same shape (as in 'pkgs.foo' or module option lookups)
+       thus mostly avoid the search. Since the names in a set are
+       unique, a match at 'hint' is always the right one. */
+    iterator find(const Symbol & name, uint32_t & hint)
+    {
+        if (hint < size_ && attrs[hint].name == name) return &attrs[hint];
+        iterator i = find(name);
+        if (i != end()) hint = i - begin();
+        return i;
+    }
+
     Attr * get(const Symbol & name)
     {
-        Attr key(name, 0);
-        iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return &*i;
-        return nullptr;
+        iterator i = find(name);
+        return i != end() ? &*i : nullptr;
     }
 
     Attr & need(const Symbol & name, const Pos & pos = noPos)
@@ -16,7 +16,7 @@ struct MixEvalArgs : virtual Args
 
     Strings searchPath;
 
-private:
+protected:
 
     std::map<std::string, std::string> autoArgs;
 };
@@ -0,0 +1,914 @@
+#include "eval-cache.hh"
+#include "sqlite.hh"
+#include "eval-inline.hh"
+#include "store-api.hh"
+#include "globals.hh"
+
+namespace nix::eval_cache {
+
+static const char * schema = R"sql(
+create table if not exists Attributes (
+    parent      integer not null,
+    name        text,
+    type        integer not null,
+    value       text,
+    context     text,
+    primary key (parent, name)
+);
+
+create table if not exists DrvIndexes (
+    prefix      text primary key not null
+);
+
+create table if not exists Derivations (
+    prefix      text not null,
+    seq         integer not null,
+    attrPath    text not null,
+    name        text not null,
+    system      text not null,
+    primary key (prefix, seq)
+);
+
+create table if not exists SearchIndexes (
+    prefix      text primary key not null
+);
+
+create table if not exists Packages (
+    prefix      text not null,
+    seq         integer not null,
+    attrPath    text not null,
+    name        text not null,
+    description text not null,
+    primary key (prefix, seq)
+);
+)sql";
+
+/* A trigram index over the text of the Packages rows with the same
+   rowid. This needs SQLite 3.34 built with FTS5, so the cache works
+   without it. */
+static const char * textSchema = R"sql(
+create virtual table if not exists PackageText using fts5(
+    attrPath, name, description, tokenize = 'trigram');
+)sql";
+
+struct AttrDb
+{
+    std::atomic_bool failed{false};
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertAttribute;
+        SQLiteStmt insertAttributeWithContext;
+        SQLiteStmt queryAttribute;
+        SQLiteStmt queryAttributes;
+        SQLiteStmt insertDrvIndex;
+        SQLiteStmt queryDrvIndex;
+        SQLiteStmt insertDerivation;
+        SQLiteStmt deleteDerivations;
+        SQLiteStmt queryDerivations;
+        SQLiteStmt insertSearchIndex;
+        SQLiteStmt querySearchIndex;
+        SQLiteStmt insertPackage;
+        SQLiteStmt deletePackages;
+        SQLiteStmt queryPackages;
+        bool haveText = false;
+        SQLiteStmt insertPackageText;
+        SQLiteStmt deletePackageText;
+        SQLiteStmt queryMatchingPackages;
+        std::unique_ptr<SQLiteTxn> txn;
+    };
+
+    std::unique_ptr<Sync<State>> _state;
+
+    AttrDb(const Hash & fingerprint)
+        : _state(std::make_unique<Sync<State>>())
+    {
+        auto state(_state->lock());
+
+        Path cacheDir = getCacheDir() + "/nix/eval-cache-v1";
+        createDirs(cacheDir);
+
+        Path dbPath = cacheDir + "/" + fingerprint.to_string(Base16, false) + ".sqlite";
+
+        state->db = SQLite(dbPath);
+        state->db.isCache();
+        state->db.exec(schema);
+
+        state->insertAttribute.create(state->db,
+            "insert or replace into Attributes(parent, name, type, value) values (?, ?, ?, ?)");
+
+        state->insertAttributeWithContext.create(state->db,
+            "insert or replace into Attributes(parent, name, type, value, context) values (?, ?, ?, ?, ?)");
+
+        state->queryAttribute.create(state->db,
+            "select rowid, type, value, context from Attributes where parent = ? and name = ?");
+
+        state->queryAttributes.create(state->db,
+            "select name from Attributes where parent = ?");
+
+        state->insertDrvIndex.create(state->db,
+            "insert or replace into DrvIndexes(prefix) values (?)");
+
+        state->queryDrvIndex.create(state->db,
+            "select 1 from DrvIndexes where prefix = ?");
+
+        state->insertDerivation.create(state->db,
+            "insert into Derivations(prefix, seq, attrPath, name, system) values (?, ?, ?, ?, ?)");
+
+        state->deleteDerivations.create(state->db,
+            "delete from Derivations where prefix = ?");
+
+        state->queryDerivations.create(state->db,
+            "select attrPath, name, system from Derivations where prefix = ? order by seq");
+
+        state->insertSearchIndex.create(state->db,
+            "insert or replace into SearchIndexes(prefix) values (?)");
+
+        state->querySearchIndex.create(state->db,
+            "select 1 from SearchIndexes where prefix = ?");
+
+        state->insertPackage.create(state->db,
+            "insert into Packages(prefix, seq, attrPath, name, description) values (?, ?, ?, ?, ?)");
+
+        state->deletePackages.create(state->db,
+            "delete from Packages where prefix = ?");
+
+        state->queryPackages.create(state->db,
+            "select attrPath, name, description from Packages where prefix = ? order by seq");
+
+        try {
+            state->db.exec(textSchema);
+
+            state->insertPackageText.create(state->db,
+                "insert into PackageText(rowid, attrPath, name, description) values (?, ?, ?, ?)");
+
+            state->deletePackageText.create(state->db,
+                "delete from PackageText where rowid in (select rowid from Packages where prefix = ?)");
+
+            state->queryMatchingPackages.create(state->db,
+                "select p.attrPath, p.name, p.description from Packages p join PackageText t on t.rowid = p.rowid "
+                "where p.prefix = ? and PackageText match ? order by p.seq");
+
+            state->haveText = true;
+        } catch (SQLiteError &) {
+            debug("SQLite full-text search is not available, 'nix search' will not use it");
+        }
+
+        /* All writes of a single evaluation go into one transaction,
+           which is committed when the cache is destroyed. */
+        state->txn = std::make_unique<SQLiteTxn>(state->db);
+    }
+
+    ~AttrDb()
+    {
+        try {
+            auto state(_state->lock());
+            if (!failed)
+                state->txn->commit();
+            state->txn.reset();
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
+    /* A broken or locked cache must never break evaluation, so
+       SQLite errors just disable the cache. */
+    template<typename F>
+    AttrId doSQLite(F && fun)
+    {
+        if (failed) return 0;
+        try {
+            return fun();
+        } catch (SQLiteError &) {
+            ignoreException();
+            failed = true;
+            return 0;
+        }
+    }
+
+    AttrId setAttrs(
+        AttrKey key,
+        const std::vector<Symbol> & attrs)
+    {
+        return doSQLite([&]()
+        {
+            auto state(_state->lock());
+
+            state->insertAttribute.use()
+                (key.first)
+                (key.second)
+                (AttrType::FullAttrs)
+                (0, false).exec();
+
+            AttrId rowId = state->db.getLastInsertedRowId();
+            assert(rowId);
+
+            for (auto & attr : attrs)
+                state->insertAttribute.use()
+                    (rowId)
+                    (attr)
+                    (AttrType::Placeholder)
+                    (0, false).exec();
+
+            return rowId;
+        });
+    }
+
+    AttrId setString(
+        AttrKey key,
+        std::string_view s,
+        const char * * context = nullptr)
+    {
+        return doSQLite([&]()
+        {
+            auto state(_state->lock());
+
+            if (context) {
+                std::string ctx;
+                for (const char * * p = context; *p; ++p) {
+                    if (p != context) ctx.push_back(' ');
+                    ctx.append(*p);
+                }
+                state->insertAttributeWithContext.use()
+                    (key.first)
+                    (key.second)
+                    (AttrType::String)
+                    (std::string(s))
+                    (ctx).exec();
+            } else {
+                state->insertAttribute.use()
+                    (key.first)
+                    (key.second)
+                    (AttrType::String)
+                    (std::string(s)).exec();
+            }
+
+            return state->db.getLastInsertedRowId();
+        });
+    }
+
+    AttrId setBool(
+        AttrKey key,
+        bool b)
+    {
+        return doSQLite([&]()
+        {
+            auto state(_state->lock());
+
+            state->insertAttribute.use()
+                (key.first)
+                (key.second)
+                (AttrType::Bool)
+                (b ? 1 : 0).exec();
+
+            return state->db.getLastInsertedRowId();
+        });
+    }
+
+    AttrId setPlaceholder(AttrKey key)
+    {
+        return setType(key, AttrType::Placeholder);
+    }
+
+    AttrId setMissing(AttrKey key)
+    {
+        return setType(key, AttrType::Missing);
+    }
+
+    AttrId setMisc(AttrKey key)
+    {
+        return setType(key, AttrType::Misc);
+    }
+
+    AttrId setFailed(AttrKey key)
+    {
+        return setType(key, AttrType::Failed);
+    }
+
+    AttrId setType(AttrKey key, AttrType type)
+    {
+        return doSQLite([&]()
+        {
+            auto state(_state->lock());
+
+            state->insertAttribute.use()
+                (key.first)
+                (key.second)
+                (type)
+                (0, false).exec();
+
+            return state->db.getLastInsertedRowId();
+        });
+    }
+
+    void clear()
+    {
+        doSQLite([&]()
+        {
+            auto state(_state->lock());
+            state->db.exec("delete from Attributes");
+            state->db.exec("delete from DrvIndexes");
+            state->db.exec("delete from Derivations");
+            state->db.exec("delete from SearchIndexes");
+            state->db.exec("delete from Packages");
+            if (state->haveText)
+                state->db.exec("delete from PackageText");
+            return 0;
+        });
+    }
+
+    void setDrvIndex(
+        const std::string & prefix,
+        const std::vector<DrvIndexEntry> & drvs)
+    {
+        doSQLite([&]()
+        {
+            auto state(_state->lock());
+
+            state->deleteDerivations.use()(prefix).exec();
+
+            int64_t seq = 0;
+            for (auto & drv : drvs)
+                state->insertDerivation.use()
+                    (prefix)
+                    (seq++)
+                    (drv.attrPath)
+                    (drv.name)
+                    (drv.system).exec();
+
+            state->insertDrvIndex.use()(prefix).exec();
+
+            return 0;
+        });
+    }
+
+    std::optional<std::vector<DrvIndexEntry>> getDrvIndex(const std::string & prefix)
+    {
+        if (failed) return {};
+
+        try {
+            auto state(_state->lock());
+
+            auto queryDrvIndex(state->queryDrvIndex.use()(prefix));
+            if (!queryDrvIndex.next()) return {};
+
+            std::vector<DrvIndexEntry> drvs;
+            auto queryDerivations(state->queryDerivations.use()(prefix));
+            while (queryDerivations.next())
+                drvs.push_back({
+                    queryDerivations.getStr(0),
+                    queryDerivations.getStr(1),
+                    queryDerivations.getStr(2)});
+            return drvs;
+        } catch (SQLiteError &) {
+            ignoreException();
+            failed = true;
+            return {};
+        }
+    }
+
+    void setSearchIndex(
+        const std::string & prefix,
+        const std::vector<SearchIndexEntry> & packages)
+    {
+        doSQLite([&]()
+        {
+            auto state(_state->lock());
+
+            if (state->haveText)
+                state->deletePackageText.use()(prefix).exec();
+            state->deletePackages.use()(prefix).exec();
+
+            int64_t seq = 0;
+            for (auto & package : packages) {
+                state->insertPackage.use()
+                    (prefix)
+                    (seq++)
+                    (package.attrPath)
+                    (package.name)
+                    (package.description).exec();
+
+                if (state->haveText)
+                    state->insertPackageText.use()
+                        (state->db.getLastInsertedRowId())
+                        (package.attrPath)
+                        (package.name)
+                        (package.description).exec();
+            }
+
+            state->insertSearchIndex.use()(prefix).exec();
+
+            return 0;
+        });
+    }
+
+    std::optional<std::vector<SearchIndexEntry>> getSearchIndex(
+        const std::string & prefix,
+        const std::vector<std::string> & terms)
+    {
+        if (failed) return {};
+
+        try {
+            auto state(_state->lock());
+
+            auto querySearchIndex(state->querySearchIndex.use()(prefix));
+            if (!querySearchIndex.next()) return {};
+
+            /* The trigram tokenizer cannot match anything shorter
+               than three characters. */
+            std::string match;
+            for (auto & term : terms) {
+                if (term.size() < 3) continue;
+                if (!match.empty()) match += " AND ";
+                match += "\"";
+                for (auto c : term) {
+                    if (c == '"') match += '"';
+                    match += c;
+                }
+                match += "\"";
+            }
+
+            auto queryPackages(state->haveText && !match.empty()
+                ? state->queryMatchingPackages.use()(prefix)(match)
+                : state->queryPackages.use()(prefix));
+
+            std::vector<SearchIndexEntry> packages;
+            while (queryPackages.next())
+                packages.push_back({
+                    queryPackages.getStr(0),
+                    queryPackages.getStr(1),
+                    queryPackages.getStr(2)});
+            return packages;
+        } catch (SQLiteError &) {
+            ignoreException();
+            failed = true;
+            return {};
+        }
+    }
+
+    std::optional<std::pair<AttrId, AttrValue>> getAttr(
+        AttrKey key,
+        SymbolTable & symbols)
+    {
+        if (failed) return {};
+
+        try {
+            auto state(_state->lock());
+
+            auto queryAttribute(state->queryAttribute.use()(key.first)(key.second));
+            if (!queryAttribute.next()) return {};
+
+            auto rowId = (AttrId) queryAttribute.getInt(0);
+            auto type = (AttrType) queryAttribute.getInt(1);
+
+            switch (type) {
+                case AttrType::Placeholder:
+                    return {{rowId, placeholder_t()}};
+                case AttrType::FullAttrs: {
+                    // FIXME: expensive, should separate this out.
+                    std::vector<Symbol> attrs;
+                    auto queryAttributes(state->queryAttributes.use()(rowId));
+                    while (queryAttributes.next())
+                        attrs.push_back(symbols.create(queryAttributes.getStr(0)));
+                    return {{rowId, attrs}};
+                }
+                case AttrType::String: {
+                    std::vector<std::string> context;
+                    if (!queryAttribute.isNull(3))
+                        for (auto & s : tokenizeString<std::vector<std::string>>(queryAttribute.getStr(3), " "))
+                            context.push_back(s);
+                    return {{rowId, string_t{queryAttribute.getStr(2), context}}};
+                }
+                case AttrType::Bool:
+                    return {{rowId, queryAttribute.getInt(2) != 0}};
+                case AttrType::Missing:
+                    return {{rowId, missing_t()}};
+                case AttrType::Misc:
+                    return {{rowId, misc_t()}};
+                case AttrType::Failed:
+                    return {{rowId, failed_t()}};
+                default:
+                    throw Error("unexpected type in evaluation cache");
+            }
+        } catch (SQLiteError &) {
+            ignoreException();
+            failed = true;
+            return {};
+        }
+    }
+};
+
+static std::shared_ptr<AttrDb> makeAttrDb(const Hash & fingerprint)
+{
+    try {
+        return std::make_shared<AttrDb>(fingerprint);
+    } catch (SQLiteError &) {
+        ignoreException();
+        return nullptr;
+    }
+}
+
+EvalCache::EvalCache(
+    std::optional<std::reference_wrapper<const Hash>> useCache,
+    EvalState & state,
+    RootLoader rootLoader,
+    Bindings * autoArgs)
+    : db(useCache ? makeAttrDb(*useCache) : nullptr)
+    , state(state)
+    , rootLoader(rootLoader)
+    , autoArgs(autoArgs)
+{
+}
+
+Value * EvalCache::getRootValue()
+{
+    if (!value) {
+        debug("getting root value");
+        value = allocRootValue(rootLoader());
+    }
+    return *value;
+}
+
+std::shared_ptr<AttrCursor> EvalCache::getRoot()
+{
+    return std::make_shared<AttrCursor>(ref(shared_from_this()), std::nullopt);
+}
+
+void EvalCache::clear()
+{
+    if (db) db->clear();
+}
+
+std::optional<std::vector<DrvIndexEntry>> EvalCache::getDrvIndex(const std::string & prefix)
+{
+    if (!db) return {};
+    return db->getDrvIndex(prefix);
+}
+
+void EvalCache::setDrvIndex(const std::string & prefix, const std::vector<DrvIndexEntry> & drvs)
+{
+    if (db) db->setDrvIndex(prefix, drvs);
+}
+
+std::optional<std::vector<SearchIndexEntry>> EvalCache::getSearchIndex(
+    const std::string & prefix,
+    const std::vector<std::string> & terms)
+{
+    if (!db) return {};
+    return db->getSearchIndex(prefix, terms);
+}
+
+void EvalCache::setSearchIndex(const std::string & prefix, const std::vector<SearchIndexEntry> & packages)
+{
+    if (db) db->setSearchIndex(prefix, packages);
+}
+
+AttrCursor::AttrCursor(
+    ref<EvalCache> root,
+    Parent parent,
+    Value * value,
+    std::optional<std::pair<AttrId, AttrValue>> && cachedValue)
+    : root(root), parent(parent), cachedValue(std::move(cachedValue))
+{
+    if (value)
+        _value = allocRootValue(value);
+}
+
+AttrKey AttrCursor::getKey()
+{
+    if (!parent)
+        return {0, root->state.sEpsilon};
+    if (!parent->first->cachedValue) {
+        parent->first->cachedValue = root->db->getAttr(
+            parent->first->getKey(), root->state.symbols);
+        assert(parent->first->cachedValue);
+    }
+    return {parent->first->cachedValue->first, parent->second};
+}
+
+Value & AttrCursor::getValue()
+{
+    if (!_value) {
+        if (parent) {
+            auto & vParent = parent->first->getValue();
+            root->state.forceAttrs(vParent);
+            auto attr = vParent.attrs->get(parent->second);
+            if (!attr)
+                throw Error("attribute '%s' is unexpectedly missing", getAttrPathStr());
+            _value = allocRootValue(attr->value);
+        } else
+            _value = allocRootValue(root->getRootValue());
+
+        /* Mimic findAlongAttrPath(): functions that can be called
+           with the automatic arguments are replaced by their
+           result. */
+        if (root->autoArgs) {
+            auto & v = **_value;
+            root->state.forceValue(v);
+            if (v.type() == tLambda && v.lambda.fun->matchAttrs) {
+                bool callable = true;
+                for (auto & i : v.lambda.fun->formals->formals)
+                    if (!i.def && root->autoArgs->find(i.name) == root->autoArgs->end())
+                        callable = false;
+                if (callable) {
+                    auto vRes = root->state.allocValue();
+                    root->state.autoCallFunction(*root->autoArgs, v, *vRes);
+                    _value = allocRootValue(vRes);
+                }
+            }
+        }
+    }
+    return **_value;
+}
+
+std::vector<Symbol> AttrCursor::getAttrPath() const
+{
+    if (parent) {
+        auto attrPath = parent->first->getAttrPath();
+        attrPath.push_back(parent->second);
+        return attrPath;
+    } else
+        return {};
+}
+
+std::vector<Symbol> AttrCursor::getAttrPath(Symbol name) const
+{
+    auto attrPath = getAttrPath();
+    attrPath.push_back(name);
+    return attrPath;
+}
+
+static std::string showAttrPath(const std::vector<Symbol> & attrPath)
+{
+    std::string res;
+    for (auto & s : attrPath) {
+        if (!res.empty()) res += '.';
+        res += (const std::string &) s;
+    }
+    return res;
+}
+
+std::string AttrCursor::getAttrPathStr() const
+{
+    return showAttrPath(getAttrPath());
+}
+
+std::string AttrCursor::getAttrPathStr(Symbol name) const
+{
+    return showAttrPath(getAttrPath(name));
+}
+
+Value & AttrCursor::forceValue()
+{
+    debug("evaluating uncached attribute %s", getAttrPathStr());
+
+    auto & v = getValue();
+
+    try {
+        root->state.forceValue(v);
+    } catch (EvalError &) {
+        debug("setting '%s' to failed", getAttrPathStr());
+        if (root->db)
+            cachedValue = {root->db->setFailed(getKey()), failed_t()};
+        throw;
+    }
+
+    if (root->db && (!cachedValue || std::get_if<placeholder_t>(&cachedValue->second))) {
+        if (v.type() == tString) {
+            string_t s{v.string.s, {}};
+            if (v.stringContext())
+                for (const char * * p = v.stringContext(); *p; ++p)
+                    s.second.push_back(*p);
+            cachedValue = {root->db->setString(getKey(), v.string.s, v.stringContext()), std::move(s)};
+        }
+        else if (v.type() == tPath)
+            cachedValue = {root->db->setString(getKey(), v.path), string_t{v.path, {}}};
+        else if (v.type() == tBool)
+            cachedValue = {root->db->setBool(getKey(), v.boolean), v.boolean};
+        else if (v.type() == tAttrs)
+            ; // FIXME: do something?
+        else
+            cachedValue = {root->db->setMisc(getKey()), misc_t()};
+    }
+
+    return v;
+}
+
+std::shared_ptr<AttrCursor> AttrCursor::maybeGetAttr(Symbol name)
+{
+    if (root->db) {
+        if (!cachedValue)
+            cachedValue = root->db->getAttr(getKey(), root->state.symbols);
+
+        if (cachedValue) {
+            if (auto attrs = std::get_if<std::vector<Symbol>>(&cachedValue->second)) {
+                for (auto & attr : *attrs)
+                    if (attr == name)
+                        return std::make_shared<AttrCursor>(root, std::make_pair(shared_from_this(), name));
+                return nullptr;
+            } else if (std::get_if<placeholder_t>(&cachedValue->second)) {
+                auto attr = root->db->getAttr({cachedValue->first, name}, root->state.symbols);
+                if (attr) {
+                    if (std::get_if<missing_t>(&attr->second))
+                        return nullptr;
+                    else if (std::get_if<failed_t>(&attr->second))
+                        throw CachedEvalError("cached failure of attribute '%s'", getAttrPathStr(name));
+                    else
+                        return std::make_shared<AttrCursor>(root,
+                            std::make_pair(shared_from_this(), name), nullptr, std::move(attr));
+                }
+                // Incomplete attrset, so need to fall thru and
+                // evaluate to see whether 'name' exists
+            } else
+                return nullptr;
+        }
+    }
+
+    auto & v = forceValue();
+
+    if (v.type() != tAttrs)
+        return nullptr;
+
+    auto attr = v.attrs->get(name);
+
+    if (!attr) {
+        if (root->db) {
+            if (!cachedValue)
+                cachedValue = {root->db->setPlaceholder(getKey()), placeholder_t()};
+            root->db->setMissing({cachedValue->first, name});
+        }
+        return nullptr;
+    }
+
+    std::optional<std::pair<AttrId, AttrValue>> cachedValue2;
+    if (root->db) {
+        if (!cachedValue)
+            cachedValue = {root->db->setPlaceholder(getKey()), placeholder_t()};
+        cachedValue2 = {root->db->setPlaceholder({cachedValue->first, name}), placeholder_t()};
+    }
+
+    return std::make_shared<AttrCursor>(
+        root, std::make_pair(shared_from_this(), name), attr->value, std::move(cachedValue2));
+}
+
+std::shared_ptr<AttrCursor> AttrCursor::maybeGetAttr(std::string_view name)
+{
+    return maybeGetAttr(root->state.symbols.create(std::string(name)));
+}
+
+std::shared_ptr<AttrCursor> AttrCursor::getAttr(Symbol name)
+{
+    auto p = maybeGetAttr(name);
+    if (!p)
+        throw Error("attribute '%s' does not exist", getAttrPathStr(name));
+    return p;
+}
+
+std::shared_ptr<AttrCursor> AttrCursor::getAttr(std::string_view name)
+{
+    return getAttr(root->state.symbols.create(std::string(name)));
+}
+
+std::shared_ptr<AttrCursor> AttrCursor::findAlongAttrPath(const std::vector<Symbol> & attrPath)
+{
+    auto res = shared_from_this();
+    for (auto & attr : attrPath) {
+        res = res->maybeGetAttr(attr);
+        if (!res) return {};
+    }
+    return res;
+}
+
+std::string AttrCursor::getString()
+{
+    if (root->db) {
+        if (!cachedValue)
+            cachedValue = root->db->getAttr(getKey(), root->state.symbols);
+        if (cachedValue && !std::get_if<placeholder_t>(&cachedValue->second)) {
+            if (auto s = std::get_if<string_t>(&cachedValue->second)) {
+                debug("using cached string attribute '%s'", getAttrPathStr());
+                return s->first;
+            } else
+                throw TypeError("'%s' is not a string", getAttrPathStr());
+        }
+    }
+
+    auto & v = forceValue();
+
+    if (v.type() != tString && v.type() != tPath)
+        throw TypeError("'%s' is not a string but %s", getAttrPathStr(), showType(v.type()));
+
+    return v.type() == tString ? v.string.s : v.path;
+}
+
+string_t AttrCursor::getStringWithContext()
+{
+    if (root->db) {
+        if (!cachedValue)
+            cachedValue = root->db->getAttr(getKey(), root->state.symbols);
+        if (cachedValue && !std::get_if<placeholder_t>(&cachedValue->second)) {
+            if (auto s = std::get_if<string_t>(&cachedValue->second)) {
+                debug("using cached string attribute '%s'", getAttrPathStr());
+                return *s;
+            } else
+                throw TypeError("'%s' is not a string", getAttrPathStr());
+        }
+    }
+
+    auto & v = forceValue();
+
+    if (v.type() == tString) {
+        string_t res{v.string.s, {}};
+        if (v.stringContext())
+            for (const char * * p = v.stringContext(); *p; ++p)
+                res.second.push_back(*p);
+        return res;
+    }
+    else if (v.type() == tPath)
+        return {v.path, {}};
+    else
+        throw TypeError("'%s' is not a string but %s", getAttrPathStr(), showType(v.type()));
+}
+
+bool AttrCursor::getBool()
+{
+    if (root->db) {
+        if (!cachedValue)
+            cachedValue = root->db->getAttr(getKey(), root->state.symbols);
+        if (cachedValue && !std::get_if<placeholder_t>(&cachedValue->second)) {
+            if (auto b = std::get_if<bool>(&cachedValue->second)) {
+                debug("using cached Boolean attribute '%s'", getAttrPathStr());
+                return *b;
+            } else
+                throw TypeError("'%s' is not a Boolean", getAttrPathStr());
+        }
+    }
+
+    auto & v = forceValue();
+
+    if (v.type() != tBool)
+        throw TypeError("'%s' is not a Boolean", getAttrPathStr());
+
+    return v.boolean;
+}
+
+std::vector<Symbol> AttrCursor::getAttrs()
+{
+    if (root->db) {
+        if (!cachedValue)
+            cachedValue = root->db->getAttr(getKey(), root->state.symbols);
+        if (cachedValue && !std::get_if<placeholder_t>(&cachedValue->second)) {
+            if (auto attrs = std::get_if<std::vector<Symbol>>(&cachedValue->second)) {
+                debug("using cached attrset attribute '%s'", getAttrPathStr());
+                return *attrs;
+            } else
+                throw TypeError("'%s' is not an attribute set", getAttrPathStr());
+        }
+    }
+
+    auto & v = forceValue();
+
+    if (v.type() != tAttrs)
+        throw TypeError("'%s' is not an attribute set", getAttrPathStr());
+
+    std::vector<Symbol> attrs;
+    for (auto & attr : *getValue().attrs)
+        attrs.push_back(attr.name);
+    std::sort(attrs.begin(), attrs.end(), [](const Symbol & a, const Symbol & b) {
+        return (const string &) a < (const string &) b;
+    });
+
+    if (root->db)
+        cachedValue = {root->db->setAttrs(getKey(), attrs), attrs};
+
+    return attrs;
+}
+
+bool AttrCursor::isDerivation()
+{
+    auto aType = maybeGetAttr(root->state.sType);
+    if (!aType) return false;
+    try {
+        return aType->getString() == "derivation";
+    } catch (TypeError &) {
+        return false;
+    }
+}
+
+StorePath AttrCursor::forceDerivation()
+{
+    auto aDrvPath = getAttr(root->state.sDrvPath);
+    auto drvPath = root->state.store->parseStorePath(aDrvPath->getString());
+    if (!root->state.store->isValidPath(drvPath) && !settings.readOnlyMode) {
+        /* The eval cache contains 'drvPath', but the actual path has
+           been garbage-collected. So force it to be regenerated. */
+        aDrvPath->forceValue();
+        if (!root->state.store->isValidPath(drvPath))
+            throw Error("don't know how to recreate store derivation '%s'!",
+                root->state.store->printStorePath(drvPath));
+    }
+    return drvPath;
+}
+
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "sync.hh"
+#include "hash.hh"
+#include "eval.hh"
+
+#include <variant>
+
+namespace nix::eval_cache {
+
+/* Thrown when the cache records that evaluating an attribute failed
+   previously. The original error is not preserved. */
+MakeError(CachedEvalError, EvalError);
+
+class AttrDb;
+class AttrCursor;
+
+/* A derivation found by getDerivations(). */
+struct DrvIndexEntry
+{
+    std::string attrPath, name, system;
+};
+
+/* A package found by 'nix search'. */
+struct SearchIndexEntry
+{
+    std::string attrPath, name, description;
+};
+
+/* A persistent cache of forced attribute values, keyed by a
+   fingerprint of the inputs of the evaluation. Values are only
+   recorded if they are strings, Booleans or attribute sets (in which
+   case only the attribute names are recorded); anything else is
+   marked as 'misc' and always requires a real evaluation. */
+class EvalCache : public std::enable_shared_from_this<EvalCache>
+{
+    friend class AttrCursor;
+
+    std::shared_ptr<AttrDb> db;
+    EvalState & state;
+    typedef std::function<Value *()> RootLoader;
+    RootLoader rootLoader;
+    RootValue value;
+
+    /* If set, functions encountered while walking the cache are
+       called with these arguments (as in findAlongAttrPath()). */
+    Bindings * autoArgs;
+
+    Value * getRootValue();
+
+public:
+
+    /* If 'useCache' is empty, the cache is disabled and every cursor
+       operation falls through to the evaluator. */
+    EvalCache(
+        std::optional<std::reference_wrapper<const Hash>> useCache,
+        EvalState & state,
+        RootLoader rootLoader,
+        Bindings * autoArgs = nullptr);
+
+    std::shared_ptr<AttrCursor> getRoot();
+
+    /* Forget all cached attributes, e.g. because the expressions
+       have impure inputs that are not covered by the fingerprint. */
+    void clear();
+
+    /* Return the derivations that getDerivations() found below the
+       attribute path ‘prefix’ of the root, in the order it found
+       them, if they were recorded with setDrvIndex(). This allows
+       selecting derivations by name without evaluating all of them. */
+    std::optional<std::vector<DrvIndexEntry>> getDrvIndex(const std::string & prefix);
+
+    void setDrvIndex(const std::string & prefix, const std::vector<DrvIndexEntry> & drvs);
+
+    /* Return the packages below the attribute path ‘prefix’ of the
+       root, in the order they were found, if they were recorded with
+       setSearchIndex(). If SQLite has full-text search, only packages
+       whose attribute path, name or description contains each of
+       ‘terms’ (ignoring case) are returned; otherwise the terms are
+       a hint only, so the caller must still check every entry. */
+    std::optional<std::vector<SearchIndexEntry>> getSearchIndex(
+        const std::string & prefix,
+        const std::vector<std::string> & terms);
+
+    void setSearchIndex(const std::string & prefix, const std::vector<SearchIndexEntry> & packages);
+};
+
+enum AttrType {
+    Placeholder = 0,
+    FullAttrs = 1,
+    String = 2,
+    Missing = 3,
+    Misc = 4,
+    Failed = 5,
+    Bool = 6,
+};
+
+struct placeholder_t {};
+struct missing_t {};
+struct misc_t {};
+struct failed_t {};
+typedef uint64_t AttrId;
+typedef std::pair<AttrId, Symbol> AttrKey;
+typedef std::pair<std::string, std::vector<std::string>> string_t;
+
+typedef std::variant<
+    std::vector<Symbol>,
+    string_t,
+    placeholder_t,
+    missing_t,
+    misc_t,
+    failed_t,
+    bool
+    > AttrValue;
+
+class AttrCursor : public std::enable_shared_from_this<AttrCursor>
+{
+    friend class EvalCache;
+
+    ref<EvalCache> root;
+    typedef std::optional<std::pair<std::shared_ptr<AttrCursor>, Symbol>> Parent;
+    Parent parent;
+    RootValue _value;
+    std::optional<std::pair<AttrId, AttrValue>> cachedValue;
+
+    AttrKey getKey();
+
+    Value & getValue();
+
+public:
+
+    AttrCursor(
+        ref<EvalCache> root,
+        Parent parent,
+        Value * value = nullptr,
+        std::optional<std::pair<AttrId, AttrValue>> && cachedValue = {});
+
+    std::vector<Symbol> getAttrPath() const;
+
+    std::vector<Symbol> getAttrPath(Symbol name) const;
+
+    std::string getAttrPathStr() const;
+
+    std::string getAttrPathStr(Symbol name) const;
+
+    std::shared_ptr<AttrCursor> maybeGetAttr(Symbol name);
+
+    std::shared_ptr<AttrCursor> maybeGetAttr(std::string_view name);
+
+    std::shared_ptr<AttrCursor> getAttr(Symbol name);
+
+    std::shared_ptr<AttrCursor> getAttr(std::string_view name);
+
+    /* Follow 'attrPath', returning nullptr if some element is not an
+       attribute set or lacks the requested attribute. */
+    std::shared_ptr<AttrCursor> findAlongAttrPath(const std::vector<Symbol> & attrPath);
+
+    std::string getString();
+
+    string_t getStringWithContext();
+
+    bool getBool();
+
+    std::vector<Symbol> getAttrs();
+
+    bool isDerivation();
+
+    Value & forceValue();
+
+    /* Force creation of the .drv file in the Nix store. */
+    StorePath forceDerivation();
+};
+
+}
@@ -8,8 +8,12 @@
 #include "filetransfer.hh"
 #include "json.hh"
 #include "function-trace.hh"
+#include "fetchers.hh"
+#include "cache.hh"
+#include "finally.hh"
 
 #include <algorithm>
+#include <array>
 #include <chrono>
 #include <cstring>
 #include <unistd.h>
@@ -73,7 +77,7 @@ static void printValue(std::ostream & str, std::set<const Value *> & active, con
         return;
     }
 
-    switch (v.type) {
+    switch (v.type()) {
     case tInt:
         str << v.integer;
         break;
@@ -107,7 +111,6 @@ static void printValue(std::ostream & str, std::set<const Value *> & active, con
         break;
     }
     case tList1:
-    case tList2:
     case tListN:
         str << "[ ";
         for (unsigned int n = 0; n < v.listSize(); ++n) {
@@ -153,10 +156,10 @@ std::ostream & operator << (std::ostream & str, const Value & v)
 
 const Value *getPrimOp(const Value &v) {
     const Value * primOp = &v;
-    while (primOp->type == tPrimOpApp) {
-        primOp = primOp->primOpApp.left;
+    while (primOp->type() == tPrimOpApp) {
+        primOp = primOp->primOpAppLeft();
     }
-    assert(primOp->type == tPrimOp);
+    assert(primOp->type() == tPrimOp);
     return primOp;
 }
 
@@ -170,7 +173,7 @@ string showType(ValueType type)
         case tPath: return "a path";
         case tNull: return "null";
         case tAttrs: return "a set";
-        case tList1: case tList2: case tListN: return "a list";
+        case tList1: case tListN: return "a list";
         case tThunk: return "a thunk";
         case tApp: return "a function application";
         case tLambda: return "a function";
@@ -186,19 +189,34 @@ string showType(ValueType type)
 
 string showType(const Value & v)
 {
-    switch (v.type) {
-        case tString: return v.string.context ? "a string with context" : "a string";
+    switch (v.type()) {
+        case tString: return v.stringContext() ? "a string with context" : "a string";
         case tPrimOp:
             return fmt("the built-in function '%s'", string(v.primOp->name));
         case tPrimOpApp:
             return fmt("the partially applied built-in function '%s'", string(getPrimOp(v)->primOp->name));
         case tExternal: return v.external->showType();
     default:
-        return showType(v.type);
+        return showType(v.type());
     }
 }
 
 
+/* The element array of a growable list (see Value::listGrowable()).
+   Lists sharing the array see a prefix of it; 'used' is the size of
+   the longest of them. */
+struct ListBuffer
+{
+    size_t capacity, used;
+    Value * elems[0];
+
+    static ListBuffer * of(Value * * elems)
+    {
+        return (ListBuffer *) ((char *) elems - sizeof(ListBuffer));
+    }
+};
+
+
 #if HAVE_BOEHMGC
 /* Called when the Boehm GC runs out of memory. */
 static void * oomHandler(size_t requested)
@@ -206,6 +224,29 @@ static void * oomHandler(size_t requested)
     /* Convert this to a proper C++ exception. */
     throw std::bad_alloc();
 }
+
+
+/* Statistics about the duration of garbage collections, reported by
+   printStats(). Bucket n of the histogram counts collections that
+   took less than 2^n milliseconds; the last one counts the rest. */
+static std::chrono::steady_clock::time_point gcStartTime;
+static std::chrono::nanoseconds gcTotalTime{0}, gcMaxTime{0};
+static std::array<uint64_t, 14> gcTimeHistogram{};
+
+static void onGCEvent(GC_EventType event)
+{
+    if (event == GC_EVENT_START)
+        gcStartTime = std::chrono::steady_clock::now();
+    else if (event == GC_EVENT_END) {
+        auto d = std::chrono::steady_clock::now() - gcStartTime;
+        gcTotalTime += d;
+        gcMaxTime = std::max(gcMaxTime, std::chrono::duration_cast<std::chrono::nanoseconds>(d));
+        size_t n = 0;
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+        while (n + 1 < gcTimeHistogram.size() && ms >= (1 << n)) n++;
+        gcTimeHistogram[n]++;
+    }
+}
 #endif
 
 
@@ -239,10 +280,26 @@ void initGC()
        there. */
     GC_set_no_dls(1);
 
+    /* libgc reads the number of marker threads from the environment
+       when it is initialised. */
+    if (evalSettings.gcMarkThreads && !getEnv("GC_MARKERS"))
+        setenv("GC_MARKERS", std::to_string(evalSettings.gcMarkThreads).c_str(), 1);
+
     GC_INIT();
 
+    /* Values store their type in the low bits of a pointer (see
+       Value::tag), so pointers with those offsets must keep their
+       target alive. */
+    for (size_t n = 1; n <= tPrimOpApp; ++n)
+        GC_register_displacement(n);
+
+    /* Likewise, the elements of growable lists follow a header. */
+    GC_register_displacement(sizeof(ListBuffer));
+
     GC_set_oom_fn(oomHandler);
 
+    GC_set_on_collection_event(onGCEvent);
+
     /* Set the initial heap size to something fairly big (25% of
        physical RAM, up to a maximum of 384 MiB) so that in most cases
        we don't need to garbage collect at all.  (Collection has a
@@ -262,13 +319,15 @@ void initGC()
             size = (pageSize * pages) / 4; // 25% of RAM
         if (size > maxSize) size = maxSize;
 #endif
-        debug(format("setting initial heap size to %1% bytes") % size);
+        debug("setting initial heap size to %1% bytes", size);
         GC_expand_hp(size);
     }
 
 #endif
 
     gcInitialised = true;
+
+    showStartupPhase("initGC");
 }
 
 
@@ -312,6 +371,7 @@ static Strings parseNixPath(const string & s)
 
 EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
     : sWith(symbols.create("<with>"))
+    , sEpsilon(symbols.create(""))
     , sOutPath(symbols.create("outPath"))
     , sDrvPath(symbols.create("drvPath"))
     , sType(symbols.create("type"))
@@ -337,13 +397,44 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
     , sOutputHashAlgo(symbols.create("outputHashAlgo"))
     , sOutputHashMode(symbols.create("outputHashMode"))
     , sRecurseForDerivations(symbols.create("recurseForDerivations"))
+    , sOut(symbols.create("out"))
+    , sAll(symbols.create("all"))
+    , sDrvAttrs(symbols.create("drvAttrs"))
     , repair(NoRepair)
     , store(store)
-    , baseEnv(allocEnv(128))
+    /* The collector is only initialised once something is
+       evaluated, so commands that don't evaluate anything start
+       faster. */
+    , baseEnv((initGC(), allocEnv(128)))
     , staticBaseEnv(false, 0)
 {
     countCalls = getEnv("NIX_COUNT_CALLS").value_or("0") != "0";
 
+#if HAVE_BOEHMGC
+    /* These are allocated from the collector, and so must not be
+       created before initGC() has applied its settings. */
+    valueAllocCache = std::allocate_shared<void *>(traceable_allocator<void *>(), nullptr);
+    env1AllocCache = std::allocate_shared<void *>(traceable_allocator<void *>(), nullptr);
+
+    /* Unlike gc-mark-threads, these can be changed after the
+       collector has been initialised, so they also apply to later
+       EvalStates. */
+    static bool incremental = false;
+    if (evalSettings.gcIncremental && !incremental) {
+        GC_enable_incremental();
+        incremental = true;
+    }
+    if (evalSettings.gcFreeSpaceDivisor)
+        GC_set_free_space_divisor(evalSettings.gcFreeSpaceDivisor);
+#endif
+
+    if (evalSettings.evalProfiler.get() == "flamegraph")
+        profiler = std::make_unique<EvalProfiler>(*this, EvalProfiler::Flamegraph, evalSettings.evalProfileFile);
+    else if (evalSettings.evalProfiler.get() == "chrome-trace")
+        profiler = std::make_unique<EvalProfiler>(*this, EvalProfiler::ChromeTrace, evalSettings.evalProfileFile);
+    else if (evalSettings.evalProfiler.get() != "")
+        throw Error("unknown evaluation profiler '%s'", evalSettings.evalProfiler.get());
+
     assert(gcInitialised);
 
     static_assert(sizeof(Env) <= 16, "environment must be <= 16 bytes");
@@ -375,7 +466,7 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
     }
 
     clearValue(vEmptySet);
-    vEmptySet.type = tAttrs;
+    vEmptySet.setType(tAttrs);
     vEmptySet.attrs = allocBindings(0);
 
     createBaseEnv();
@@ -387,6 +478,40 @@ EvalState::~EvalState()
 }
 
 
+EnvStack::EnvStack(size_t size)
+{
+#if HAVE_BOEHMGC
+    start = (char *) GC_MALLOC_UNCOLLECTABLE(size);
+#else
+    start = (char *) malloc(size);
+#endif
+    if (!start) throw std::bad_alloc();
+    memset(start, 0, size);
+    top = start;
+    end = start + size;
+}
+
+
+EnvStack::~EnvStack()
+{
+#if HAVE_BOEHMGC
+    GC_FREE(start);
+#else
+    free(start);
+#endif
+}
+
+
+/* Pops an environment taken from the environment stack, if any, when
+   leaving the scope. */
+struct PopStackEnv
+{
+    EnvStack & stack;
+    Env * env;
+    ~PopStackEnv() { if (env) stack.pop(env); }
+};
+
+
 Path EvalState::checkSourcePath(const Path & path_)
 {
     if (!allowedPaths) return path_;
@@ -414,7 +539,7 @@ Path EvalState::checkSourcePath(const Path & path_)
         throw RestrictedPathError("access to path '%1%' is forbidden in restricted mode", abspath);
 
     /* Resolve symlinks. */
-    debug(format("checking access to '%s'") % abspath);
+    debug("checking access to '%s'", abspath);
     Path path = canonPath(abspath, true);
 
     for (auto & i : *allowedPaths) {
@@ -428,6 +553,57 @@ Path EvalState::checkSourcePath(const Path & path_)
 }
 
 
+bool EvalState::pathExistsCached(const Path & path)
+{
+    auto i = pathExistsCache.find(path);
+    if (i != pathExistsCache.end()) {
+        nrFSCacheHits++;
+        return i->second;
+    }
+
+    nrFSCacheMisses++;
+    bool exists = pathExists(path);
+    /* Store paths may become valid during evaluation, e.g. by
+       import-from-derivation, so don't remember their absence. */
+    if (exists || !store->isInStore(path))
+        pathExistsCache.emplace(path, exists);
+    return exists;
+}
+
+
+const DirEntries & EvalState::readDirectoryCached(const Path & path)
+{
+    auto i = readDirCache.find(path);
+    if (i != readDirCache.end()) {
+        nrFSCacheHits++;
+        return i->second;
+    }
+
+    nrFSCacheMisses++;
+    auto entries = readDirectory(path);
+    for (auto & ent : entries)
+        if (ent.type == DT_UNKNOWN)
+            ent.type = getFileType(path + "/" + ent.name);
+    return readDirCache.emplace(path, std::move(entries)).first->second;
+}
+
+
+Hash EvalState::hashFileCached(HashType ht, const Path & path)
+{
+    auto key = std::make_pair(path, ht);
+    auto i = hashFileCache.find(key);
+    if (i != hashFileCache.end()) {
+        nrFSCacheHits++;
+        return i->second;
+    }
+
+    nrFSCacheMisses++;
+    auto hash = hashFile(ht, path);
+    hashFileCache.emplace(std::move(key), hash);
+    return hash;
+}
+
+
 void EvalState::checkURI(const std::string & uri)
 {
     if (!evalSettings.restrictEval) return;
@@ -492,7 +668,7 @@ Value * EvalState::addPrimOp(const string & name,
        the primop to a dummy value. */
     if (arity == 0) {
         auto vPrimOp = allocValue();
-        vPrimOp->type = tPrimOp;
+        vPrimOp->setType(tPrimOp);
         vPrimOp->primOp = new PrimOp(primOp, 1, sym);
         Value v;
         mkApp(v, *vPrimOp, *vPrimOp);
@@ -500,7 +676,7 @@ Value * EvalState::addPrimOp(const string & name,
     }
 
     Value * v = allocValue();
-    v->type = tPrimOp;
+    v->setType(tPrimOp);
     v->primOp = new PrimOp(primOp, arity, sym);
     staticBaseEnv.vars[symbols.create(name)] = baseEnvDispl;
     baseEnv.values[baseEnvDispl++] = v;
@@ -609,19 +785,131 @@ void mkString(Value & v, const char * s)
 }
 
 
-Value & mkString(Value & v, std::string_view s, const PathSet & context)
+/* The table of interned context elements and arrays. The elements
+   and arrays are allocated on the garbage-collected heap, and the
+   table is cleared when it grows too large, so contexts that are no
+   longer used are eventually freed. Nothing depends on equal
+   contexts being equal pointers, so clearing only costs some
+   sharing. */
+struct ContextTable
 {
-    v.type = tString;
-    v.string.s = dupStringWithLen(s.data(), s.size());
-    v.string.context = 0;
-    if (!context.empty()) {
-        size_t n = 0;
-        v.string.context = (const char * *)
-            allocBytes((context.size() + 1) * sizeof(char *));
-        for (auto & i : context)
-            v.string.context[n++] = dupString(i.c_str());
-        v.string.context[n] = 0;
+    static constexpr size_t maxSize = 1 << 16;
+
+    /* The table keeps its entries alive until it is cleared. */
+#if HAVE_BOEHMGC
+    template<typename T> using Allocator = traceable_allocator<T>;
+#else
+    template<typename T> using Allocator = std::allocator<T>;
+#endif
+
+    std::unordered_map<std::string_view, const char *,
+        std::hash<std::string_view>, std::equal_to<std::string_view>,
+        Allocator<std::pair<const std::string_view, const char *>>> elems;
+
+    struct ArrayHash
+    {
+        size_t operator()(const std::vector<const char *> & v) const
+        {
+            size_t h = v.size();
+            for (auto p : v)
+                h = h * 31 + std::hash<const char *>()(p);
+            return h;
+        }
+    };
+
+    std::unordered_map<std::vector<const char *>, const char * *, ArrayHash,
+        std::equal_to<std::vector<const char *>>,
+        Allocator<std::pair<const std::vector<const char *>, const char * *>>> arrays;
+
+    const char * elem(std::string_view s)
+    {
+        auto i = elems.find(s);
+        if (i != elems.end()) return i->second;
+        auto str = dupStringWithLen(s.data(), s.size());
+        elems.emplace(std::string_view(str, s.size()), str);
+        return str;
+    }
+
+    /* 'v' must be sorted and consist of interned elements. */
+    const char * * array(std::vector<const char *> && v)
+    {
+        if (v.empty()) return nullptr;
+        auto i = arrays.find(v);
+        if (i != arrays.end()) return i->second;
+        auto res = (const char * *) allocBytes((v.size() + 1) * sizeof(const char *));
+        std::copy(v.begin(), v.end(), res);
+        arrays.emplace(std::move(v), res);
+        return res;
+    }
+
+    /* Forget all interned elements and arrays. Those still referenced
+       by values stay alive, but are no longer shared with new
+       contexts. */
+    void clear()
+    {
+        elems.clear();
+        arrays.clear();
+    }
+};
+
+static ContextTable & contextTable()
+{
+    static ContextTable * table = new ContextTable;
+    /* This is called before a context is built, so the elements
+       interned for it can't be freed by clearing the table while
+       they're only referenced from a std::vector. */
+    if (table->elems.size() + table->arrays.size() >= ContextTable::maxSize)
+        table->clear();
+    return *table;
+}
+
+
+const char * * internContext(const PathSet & context)
+{
+    if (context.empty()) return nullptr;
+    auto & table(contextTable());
+    std::vector<const char *> v;
+    v.reserve(context.size());
+    for (auto & i : context)
+        v.push_back(table.elem(i));
+    return table.array(std::move(v));
+}
+
+
+/* Whether 'a' is a subset of 'b'. Both must be sorted. Elements are
+   compared by pointer, so this may return false for equal elements
+   interned before and after the table was cleared, which only costs
+   an extra array. */
+static bool isSubContext(const char * * a, const char * * b)
+{
+    for (; *a; ++a) {
+        while (*b && *b != *a && strcmp(*b, *a) < 0) ++b;
+        if (*b != *a) return false;
+        ++b;
     }
+    return true;
+}
+
+
+const char * * unionContexts(const char * * a, const char * * b)
+{
+    if (a == b || !b) return a;
+    if (!a) return b;
+    if (isSubContext(b, a)) return a;
+    if (isSubContext(a, b)) return b;
+    std::vector<const char *> v;
+    while (*a || *b) {
+        if (!*b || (*a && strcmp(*a, *b) < 0)) v.push_back(*a++);
+        else if (!*a || strcmp(*b, *a) < 0) v.push_back(*b++);
+        else { v.push_back(*a++); ++b; }
+    }
+    return contextTable().array(std::move(v));
+}
+
+
+Value & mkString(Value & v, std::string_view s, const PathSet & context)
+{
+    v.setString(dupStringWithLen(s.data(), s.size()), internContext(context));
     return v;
 }
 
@@ -646,8 +934,9 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
             env->values[0] = v;
             env->type = Env::HasWithAttrs;
         }
-        Bindings::iterator j = env->values[0]->attrs->find(var.name);
-        if (j != env->values[0]->attrs->end()) {
+        Bindings * attrs = env->values[0]->attrs;
+        Bindings::iterator j = attrs->find(var.name, var.withHint);
+        if (j != attrs->end()) {
             if (countCalls && j->pos) attrSelects[*j->pos]++;
             return j->value;
         }
@@ -665,10 +954,36 @@ void finalizeValue(void * obj, void * data)
     nrValuesFreed++;
 }
 
+#if HAVE_BOEHMGC
+/* Take an object of `size' bytes from the free list `cache',
+   refilling it with a batch from GC_malloc_many() when it's empty.
+   Since interior pointers are not recognised, each object must be a
+   separate allocation rather than part of one big block. The first
+   word of each object links to the next one, so it must be cleared;
+   the rest is zeroed by the collector. */
+static inline void * allocFromCache(void * & cache, size_t size)
+{
+    if (!cache) {
+        cache = GC_malloc_many(size);
+        if (!cache) throw std::bad_alloc();
+    }
+    void * p = cache;
+    cache = GC_NEXT(p);
+    GC_NEXT(p) = nullptr;
+    return p;
+}
+#endif
+
+
 Value * EvalState::allocValue()
 {
     nrValues++;
+    if (curAllocStats) curAllocStats->values++;
+#if HAVE_BOEHMGC
+    auto v = (Value *) allocFromCache(*valueAllocCache, sizeof(Value));
+#else
     auto v = (Value *) allocBytes(sizeof(Value));
+#endif
     //GC_register_finalizer_no_order(v, finalizeValue, nullptr, nullptr, nullptr);
     return v;
 }
@@ -678,7 +993,15 @@ Env & EvalState::allocEnv(size_t size)
 {
     nrEnvs++;
     nrValuesInEnvs += size;
-    Env * env = (Env *) allocBytes(sizeof(Env) + size * sizeof(Value *));
+    if (curAllocStats) curAllocStats->envs++;
+    Env * env;
+#if HAVE_BOEHMGC
+    /* Most functions take a single argument. */
+    if (size == 1)
+        env = (Env *) allocFromCache(*env1AllocCache, sizeof(Env) + sizeof(Value *));
+    else
+#endif
+        env = (Env *) allocBytes(sizeof(Env) + size * sizeof(Value *));
     env->type = Env::Plain;
 
     /* We assume that env->values has been cleared by the allocator; maybeThunk() and lookupVar fromWith expect this. */
@@ -691,14 +1014,9 @@ void EvalState::mkList(Value & v, size_t size)
 {
     clearValue(v);
     if (size == 1)
-        v.type = tList1;
-    else if (size == 2)
-        v.type = tList2;
-    else {
-        v.type = tListN;
-        v.bigList.size = size;
-        v.bigList.elems = size ? (Value * *) allocBytes(size * sizeof(Value *)) : 0;
-    }
+        v.setType(tList1);
+    else
+        v.setList(size, size ? (Value * *) allocBytes(size * sizeof(Value *)) : 0);
     nrListElems += size;
 }
 
@@ -707,9 +1025,7 @@ unsigned long nrThunks = 0;
 
 static inline void mkThunk(Value & v, Env & env, Expr * expr)
 {
-    v.type = tThunk;
-    v.thunk.env = &env;
-    v.thunk.expr = expr;
+    v.setThunk(&env, expr);
     nrThunks++;
 }
 
@@ -746,6 +1062,7 @@ Value * Expr::maybeThunk(EvalState & state, Env & env)
 
 
 unsigned long nrAvoided = 0;
+unsigned long nrSharedConstants = 0;
 
 Value * ExprVar::maybeThunk(EvalState & state, Env & env)
 {
@@ -757,6 +1074,16 @@ Value * ExprVar::maybeThunk(EvalState & state, Env & env)
 }
 
 
+Value * ExprLocalVar::maybeThunk(EvalState & state, Env & env)
+{
+    Env * e = &env;
+    for (auto l = level; l; --l, e = e->up) ;
+    Value * v = e->values[displ];
+    if (v) { nrAvoided++; return v; }
+    return Expr::maybeThunk(state, env);
+}
+
+
 Value * ExprString::maybeThunk(EvalState & state, Env & env)
 {
     nrAvoided++;
@@ -781,6 +1108,28 @@ Value * ExprPath::maybeThunk(EvalState & state, Env & env)
     return &v;
 }
 
+Value * ExprAttrs::maybeThunk(EvalState & state, Env & env)
+{
+    if (!constant) return Expr::maybeThunk(state, env);
+    if (!shared) {
+        Value v;
+        eval(state, env, v);
+    }
+    nrAvoided++;
+    return *shared;
+}
+
+Value * ExprList::maybeThunk(EvalState & state, Env & env)
+{
+    if (!constant) return Expr::maybeThunk(state, env);
+    if (!shared) {
+        Value v;
+        eval(state, env, v);
+    }
+    nrAvoided++;
+    return *shared;
+}
+
 
 void EvalState::evalFile(const Path & path_, Value & v)
 {
@@ -826,6 +1175,9 @@ void EvalState::resetFileCache()
 {
     fileEvalCache.clear();
     fileParseCache.clear();
+    pathExistsCache.clear();
+    readDirCache.clear();
+    hashFileCache.clear();
 }
 
 
@@ -839,7 +1191,7 @@ inline bool EvalState::evalBool(Env & env, Expr * e)
 {
     Value v;
     e->eval(*this, env, v);
-    if (v.type != tBool)
+    if (v.type() != tBool)
         throwTypeError("value is %1% while a Boolean was expected", v);
     return v.boolean;
 }
@@ -849,7 +1201,7 @@ inline bool EvalState::evalBool(Env & env, Expr * e, const Pos & pos)
 {
     Value v;
     e->eval(*this, env, v);
-    if (v.type != tBool)
+    if (v.type() != tBool)
         throwTypeError(pos, "value is %1% while a Boolean was expected", v);
     return v.boolean;
 }
@@ -858,7 +1210,7 @@ inline bool EvalState::evalBool(Env & env, Expr * e, const Pos & pos)
 inline void EvalState::evalAttrs(Env & env, Expr * e, Value & v)
 {
     e->eval(*this, env, v);
-    if (v.type != tAttrs)
+    if (v.type() != tAttrs)
         throwTypeError("value is %1% while a set was expected", v);
 }
 
@@ -894,6 +1246,14 @@ void ExprPath::eval(EvalState & state, Env & env, Value & v)
 
 void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
 {
+    /* Constant sets are immutable, so all evaluations can share the
+       same bindings. */
+    if (shared) {
+        nrSharedConstants++;
+        v = **shared;
+        return;
+    }
+
     state.mkAttrs(v, attrs.size() + dynamicAttrs.size());
     Env *dynamicEnv = &env;
 
@@ -958,7 +1318,7 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
         Value nameVal;
         i.nameExpr->eval(state, *dynamicEnv, nameVal);
         state.forceValue(nameVal, i.pos);
-        if (nameVal.type == tNull)
+        if (nameVal.type() == tNull)
             continue;
         state.forceStringNoCtx(nameVal);
         Symbol nameSym = state.symbols.create(nameVal.string.s);
@@ -971,10 +1331,16 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
         v.attrs->push_back(Attr(nameSym, i.valueExpr->maybeThunk(state, *dynamicEnv), &i.pos));
         v.attrs->sort(); // FIXME: inefficient
     }
+
+    if (constant) {
+        auto v2 = state.allocValue();
+        *v2 = v;
+        shared = allocRootValue(v2);
+    }
 }
 
 
-void ExprLet::eval(EvalState & state, Env & env, Value & v)
+Env & ExprLet::bindAttrs(EvalState & state, Env & env)
 {
     /* Create a new environment that contains the attributes in this
        `let'. */
@@ -988,15 +1354,32 @@ void ExprLet::eval(EvalState & state, Env & env, Value & v)
     for (auto & i : attrs->attrs)
         env2.values[displ++] = i.second.e->maybeThunk(state, i.second.inherited ? env : env2);
 
-    body->eval(state, env2, v);
+    return env2;
+}
+
+void ExprLet::eval(EvalState & state, Env & env, Value & v)
+{
+    body->eval(state, bindAttrs(state, env), v);
 }
 
 
 void ExprList::eval(EvalState & state, Env & env, Value & v)
 {
+    if (shared) {
+        nrSharedConstants++;
+        v = **shared;
+        return;
+    }
+
     state.mkList(v, elems.size());
     for (size_t n = 0; n < elems.size(); ++n)
         v.listElems()[n] = elems[n]->maybeThunk(state, env);
+
+    if (constant) {
+        auto v2 = state.allocValue();
+        *v2 = v;
+        shared = allocRootValue(v2);
+    }
 }
 
 
@@ -1008,6 +1391,16 @@ void ExprVar::eval(EvalState & state, Env & env, Value & v)
 }
 
 
+void ExprLocalVar::eval(EvalState & state, Env & env, Value & v)
+{
+    Env * e = &env;
+    for (auto l = level; l; --l, e = e->up) ;
+    Value * v2 = e->values[displ];
+    state.forceValue(*v2, pos);
+    v = *v2;
+}
+
+
 static string showAttrPath(EvalState & state, Env & env, const AttrPath & attrPath)
 {
     std::ostringstream out;
@@ -1043,15 +1436,15 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
             Symbol name = getName(i, state, env);
             if (def) {
                 state.forceValue(*vAttrs, pos);
-                if (vAttrs->type != tAttrs ||
-                    (j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+                if (vAttrs->type() != tAttrs ||
+                    (j = vAttrs->attrs->find(name, i.hint)) == vAttrs->attrs->end())
                 {
                     def->eval(state, env, v);
                     return;
                 }
             } else {
                 state.forceAttrs(*vAttrs, pos);
-                if ((j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+                if ((j = vAttrs->attrs->find(name, i.hint)) == vAttrs->attrs->end())
                     throwEvalError(pos, "attribute '%1%' missing", name);
             }
             vAttrs = j->value;
@@ -1062,7 +1455,7 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
         state.forceValue(*vAttrs, ( pos2 != NULL ? *pos2 : this->pos ) );
 
     } catch (Error & e) {
-        if (pos2 && pos2->file != state.sDerivationNix)
+        if (pos2 && pos2 != &state.derivationPos && !state.discardsError(e))
             addErrorTrace(e, *pos2, "while evaluating the attribute '%1%'",
                 showAttrPath(state, env, attrPath));
         throw;
@@ -1083,8 +1476,8 @@ void ExprOpHasAttr::eval(EvalState & state, Env & env, Value & v)
         state.forceValue(*vAttrs);
         Bindings::iterator j;
         Symbol name = getName(i, state, env);
-        if (vAttrs->type != tAttrs ||
-            (j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+        if (vAttrs->type() != tAttrs ||
+            (j = vAttrs->attrs->find(name, i.hint)) == vAttrs->attrs->end())
         {
             mkBool(v, false);
             return;
@@ -1099,9 +1492,7 @@ void ExprOpHasAttr::eval(EvalState & state, Env & env, Value & v)
 
 void ExprLambda::eval(EvalState & state, Env & env, Value & v)
 {
-    v.type = tLambda;
-    v.lambda.env = &env;
-    v.lambda.fun = this;
+    v.setLambda(&env, this);
 }
 
 
@@ -1119,11 +1510,11 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
     /* Figure out the number of arguments still needed. */
     size_t argsDone = 0;
     Value * primOp = &fun;
-    while (primOp->type == tPrimOpApp) {
+    while (primOp->type() == tPrimOpApp) {
         argsDone++;
-        primOp = primOp->primOpApp.left;
+        primOp = primOp->primOpAppLeft();
     }
-    assert(primOp->type == tPrimOp);
+    assert(primOp->type() == tPrimOp);
     auto arity = primOp->primOp->arity;
     auto argsLeft = arity - argsDone;
 
@@ -1134,19 +1525,26 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
         Value * vArgs[arity];
         auto n = arity - 1;
         vArgs[n--] = &arg;
-        for (Value * arg = &fun; arg->type == tPrimOpApp; arg = arg->primOpApp.left)
+        for (Value * arg = &fun; arg->type() == tPrimOpApp; arg = arg->primOpAppLeft())
             vArgs[n--] = arg->primOpApp.right;
 
         /* And call the primop. */
         nrPrimOpCalls++;
-        if (countCalls) primOpCalls[primOp->primOp->name]++;
-        primOp->primOp->fun(*this, pos, vArgs, v);
+        if (countCalls) {
+            auto & name = primOp->primOp->name;
+            primOpCalls[name]++;
+            ChargeAllocs charge(curAllocStats, primOpAllocs[name]);
+            auto start = std::chrono::steady_clock::now();
+            Finally addTime([&]() {
+                primOpTimes[name] += std::chrono::steady_clock::now() - start;
+            });
+            primOp->primOp->fun(*this, pos, vArgs, v);
+        } else
+            primOp->primOp->fun(*this, pos, vArgs, v);
     } else {
         Value * fun2 = allocValue();
         *fun2 = fun;
-        v.type = tPrimOpApp;
-        v.primOpApp.left = fun2;
-        v.primOpApp.right = &arg;
+        v.setPrimOpApp(fun2, &arg);
     }
 }
 
@@ -1156,12 +1554,16 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
 
     forceValue(fun, pos);
 
-    if (fun.type == tPrimOp || fun.type == tPrimOpApp) {
+    std::optional<EvalProfiler::Frame> profilerFrame;
+    if (profiler && (fun.type() == tLambda || fun.type() == tPrimOp || fun.type() == tPrimOpApp))
+        profilerFrame.emplace(*profiler, fun, pos);
+
+    if (fun.type() == tPrimOp || fun.type() == tPrimOpApp) {
         callPrimOp(fun, arg, v, pos);
         return;
     }
 
-    if (fun.type == tAttrs) {
+    if (fun.type() == tAttrs) {
       auto found = fun.attrs->find(sFunctor);
       if (found != fun.attrs->end()) {
         /* fun may be allocated on the stack of the calling function,
@@ -1177,16 +1579,61 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
       }
     }
 
-    if (fun.type != tLambda)
+    if (fun.type() != tLambda)
         throwTypeError(pos, "attempt to call something which is not a function but %1%", fun);
 
+    /* Tracing, profiling and counting calls need a C++ frame per
+       call. */
+    if (!trace && !profilerFrame && !countCalls && !loggerSettings.showTrace.get()) {
+        callLambdaLoop(fun, arg, v, pos);
+        return;
+    }
+
     ExprLambda & lambda(*fun.lambda.fun);
 
+    Env * stackEnv;
+    Env & env2(bindArgs(lambda, fun, arg, pos, stackEnv));
+    PopStackEnv popStackEnv{envStack, stackEnv};
+
+    nrFunctionCalls++;
+    if (countCalls) incrFunctionCall(&lambda);
+
+    std::optional<ChargeAllocs> chargeAllocs;
+    if (countCalls) chargeAllocs.emplace(curAllocStats, functionAllocs[&lambda]);
+
+    /* Evaluate the body.  This is conditional on showTrace, because
+       catching exceptions makes this function not tail-recursive. */
+    if (loggerSettings.showTrace.get())
+        try {
+            lambda.body->eval(*this, env2, v);
+        } catch (Error & e) {
+            if (discardsError(e)) throw;
+            addErrorTrace(e, lambda.pos, "while evaluating %s", 
+              (lambda.name.set() 
+                  ? "'" + (string) lambda.name + "'" 
+                  : "anonymous lambdaction"));
+            addErrorTrace(e, pos, "from call site%s", "");
+            throw;
+        }
+    else
+        fun.lambda.fun->body->eval(*this, env2, v);
+}
+
+
+Env & EvalState::bindArgs(ExprLambda & lambda, Value & fun, Value & arg, const Pos & pos, Env * & stackEnv)
+{
     auto size =
         (lambda.arg.empty() ? 0 : 1) +
         (lambda.matchAttrs ? lambda.formals->formals.size() : 0);
-    Env & env2(allocEnv(size));
-    env2.up = fun.lambda.env;
+
+    /* If no value can refer to the environment of this call after it
+       returns, take it from the environment stack rather than the
+       garbage-collected heap. */
+    stackEnv = lambda.envEscapes ? nullptr : envStack.push(size);
+    if (stackEnv) nrStackEnvs++;
+
+    Env & env2(stackEnv ? *stackEnv : allocEnv(size));
+    env2.up = fun.lambdaEnv();
 
     size_t displ = 0;
 
@@ -1227,24 +1674,70 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
         }
     }
 
-    nrFunctionCalls++;
-    if (countCalls) incrFunctionCall(&lambda);
+    return env2;
+}
 
-    /* Evaluate the body.  This is conditional on showTrace, because
-       catching exceptions makes this function not tail-recursive. */
-    if (loggerSettings.showTrace.get())
-        try {
-            lambda.body->eval(*this, env2, v);
-        } catch (Error & e) {
-            addErrorTrace(e, lambda.pos, "while evaluating %s", 
-              (lambda.name.set() 
-                  ? "'" + (string) lambda.name + "'" 
-                  : "anonymous lambdaction"));
-            addErrorTrace(e, pos, "from call site%s", "");
-            throw;
+
+void EvalState::callLambdaLoop(Value & fun, Value & arg, Value & v, const Pos & pos)
+{
+    /* The function and argument of the current call. Functions called
+       in tail position are evaluated into `vFun'; the lambda and
+       environment of the previous call are no longer needed by then. */
+    Value vFun;
+    Value * f = &fun, * a = &arg;
+    const Pos * p = &pos;
+
+    /* Only one call is active at a time, so its stack environment
+       can be released when the next one starts. Nothing refers to it
+       by then, since the environment of a function that passes a
+       reference to its environment in a call doesn't go on the stack
+       in the first place. */
+    PopStackEnv popStackEnv{envStack, nullptr};
+
+    while (true) {
+        ExprLambda & lambda(*f->lambda.fun);
+
+        if (popStackEnv.env) {
+            envStack.pop(popStackEnv.env);
+            popStackEnv.env = nullptr;
         }
-    else
-        fun.lambda.fun->body->eval(*this, env2, v);
+
+        Env * env = &bindArgs(lambda, *f, *a, *p, popStackEnv.env);
+
+        nrFunctionCalls++;
+
+        /* Find the expression in tail position. */
+        Expr * body = lambda.body;
+        while (true) {
+            if (auto e = dynamic_cast<ExprIf *>(body))
+                body = evalBool(*env, e->cond, e->pos) ? e->then : e->else_;
+            else if (auto e = dynamic_cast<ExprLet *>(body)) {
+                env = &e->bindAttrs(*this, *env);
+                body = e->body;
+            } else
+                break;
+        }
+
+        auto app = dynamic_cast<ExprApp *>(body);
+        if (!app) {
+            body->eval(*this, *env, v);
+            return;
+        }
+
+        /* A call in tail position. Calls of anything but a lambda
+           (primops, functors, errors) recurse as usual. */
+        app->e1->eval(*this, *env, vFun);
+        a = app->e2->maybeThunk(*this, *env);
+        p = &app->pos;
+
+        if (vFun.type() != tLambda) {
+            callFunction(vFun, *a, v, *p);
+            return;
+        }
+
+        f = &vFun;
+        nrTailCalls++;
+    }
 }
 
 
@@ -1260,7 +1753,7 @@ void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
 {
     forceValue(fun);
 
-    if (fun.type == tAttrs) {
+    if (fun.type() == tAttrs) {
         auto found = fun.attrs->find(sFunctor);
         if (found != fun.attrs->end()) {
             Value * v = allocValue();
@@ -1270,7 +1763,7 @@ void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
         }
     }
 
-    if (fun.type != tLambda || !fun.lambda.fun->matchAttrs) {
+    if (fun.type() != tLambda || !fun.lambda.fun->matchAttrs) {
         res = fun;
         return;
     }
@@ -1313,6 +1806,7 @@ void ExprIf::eval(EvalState & state, Env & env, Value & v)
 void ExprAssert::eval(EvalState & state, Env & env, Value & v)
 {
     if (!state.evalBool(env, cond, pos)) {
+        if (state.tryEvalDepth) throw AssertionError({ .level = lvlError, .errPos = pos });
         std::ostringstream out;
         cond->show(out);
         throwAssertionError(pos, "assertion '%1%' failed at %2%", out.str());
@@ -1379,19 +1873,33 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     Bindings::iterator i = v1.attrs->begin();
     Bindings::iterator j = v2.attrs->begin();
 
-    while (i != v1.attrs->end() && j != v2.attrs->end()) {
-        if (i->name == j->name) {
+    if (v2.attrs->size() * 16 < v1.attrs->size()) {
+        /* The common case of overriding a few attributes of a large
+           set: find where each attribute of the second set goes by
+           binary search, and copy the runs of the first set in
+           between in bulk. */
+        for (; j != v2.attrs->end(); ++j) {
+            auto k = std::lower_bound(i, v1.attrs->end(), *j);
+            v.attrs->append(i, k);
             v.attrs->push_back(*j);
-            ++i; ++j;
+            i = k != v1.attrs->end() && k->name == j->name ? k + 1 : k;
         }
-        else if (i->name < j->name)
-            v.attrs->push_back(*i++);
-        else
-            v.attrs->push_back(*j++);
     }
 
-    while (i != v1.attrs->end()) v.attrs->push_back(*i++);
-    while (j != v2.attrs->end()) v.attrs->push_back(*j++);
+    else
+        while (i != v1.attrs->end() && j != v2.attrs->end()) {
+            if (i->name == j->name) {
+                v.attrs->push_back(*j);
+                ++i; ++j;
+            }
+            else if (i->name < j->name)
+                v.attrs->push_back(*i++);
+            else
+                v.attrs->push_back(*j++);
+        }
+
+    v.attrs->append(i, v1.attrs->end());
+    v.attrs->append(j, v2.attrs->end());
 
     state.nrOpUpdateValuesCopied += v.attrs->size();
 }
@@ -1411,12 +1919,16 @@ void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const Po
     nrListConcats++;
 
     Value * nonEmpty = 0;
+    Value * first = 0;
     size_t len = 0;
     for (size_t n = 0; n < nrLists; ++n) {
         forceList(*lists[n], pos);
         auto l = lists[n]->listSize();
         len += l;
-        if (l) nonEmpty = lists[n];
+        if (l) {
+            nonEmpty = lists[n];
+            if (!first) first = lists[n];
+        }
     }
 
     if (nonEmpty && len == nonEmpty->listSize()) {
@@ -1424,22 +1936,57 @@ void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const Po
         return;
     }
 
-    mkList(v, len);
-    auto out = v.listElems();
-    for (size_t n = 0, pos = 0; n < nrLists; ++n) {
+    /* The result is a growable list. If the first list is the
+       longest one in its buffer, the other lists can be appended to
+       it without disturbing any other list sharing the buffer, which
+       makes repeated appending (as in 'foldl' (xs: x: xs ++ [x])')
+       linear rather than quadratic. */
+    size_t firstLen = first->listSize();
+    ListBuffer * buf = nullptr;
+    size_t capacity = len;
+    if (first->listGrowable()) {
+        auto buf2 = ListBuffer::of(first->listElems());
+        if (buf2->used == firstLen) {
+            if (len <= buf2->capacity) {
+                buf = buf2;
+                nrListConcatsInPlace++;
+            } else
+                /* Leave room to be extended again. */
+                capacity = 2 * len;
+        }
+    }
+
+    if (!buf) {
+        buf = (ListBuffer *) allocBytes(sizeof(ListBuffer) + capacity * sizeof(Value *));
+        buf->capacity = capacity;
+        memcpy(buf->elems, first->listElems(), firstLen * sizeof(Value *));
+        nrListElems += capacity;
+    }
+
+    size_t pos2 = firstLen;
+    bool skippedFirst = false;
+    for (size_t n = 0; n < nrLists; ++n) {
         auto l = lists[n]->listSize();
-        if (l)
-            memcpy(out + pos, lists[n]->listElems(), l * sizeof(Value *));
-        pos += l;
+        if (!l) continue;
+        if (!skippedFirst) { skippedFirst = true; continue; }
+        memcpy(buf->elems + pos2, lists[n]->listElems(), l * sizeof(Value *));
+        pos2 += l;
     }
+
+    buf->used = len;
+    v.setList(len, buf->elems, true);
 }
 
 
 void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
 {
     PathSet context;
-    std::ostringstream s;
+    std::string s;
     NixInt n = 0;
+
+    /* The context of the string operands, which are merged without
+       going through 'context'. */
+    const char * * stringContext = nullptr;
     NixFloat nf = 0;
 
     bool first = !forceString;
@@ -1454,14 +2001,14 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
            since paths are copied when they are used in a derivation),
            and none of the strings are allowed to have contexts. */
         if (first) {
-            firstType = vTmp.type;
+            firstType = vTmp.type();
             first = false;
         }
 
         if (firstType == tInt) {
-            if (vTmp.type == tInt) {
+            if (vTmp.type() == tInt) {
                 n += vTmp.integer;
-            } else if (vTmp.type == tFloat) {
+            } else if (vTmp.type() == tFloat) {
                 // Upgrade the type from int to float;
                 firstType = tFloat;
                 nf = n;
@@ -1469,14 +2016,17 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
             } else
                 throwEvalError(pos, "cannot add %1% to an integer", showType(vTmp));
         } else if (firstType == tFloat) {
-            if (vTmp.type == tInt) {
+            if (vTmp.type() == tInt) {
                 nf += vTmp.integer;
-            } else if (vTmp.type == tFloat) {
+            } else if (vTmp.type() == tFloat) {
                 nf += vTmp.fpoint;
             } else
                 throwEvalError(pos, "cannot add %1% to a float", showType(vTmp));
+        } else if (firstType == tString && vTmp.type() == tString) {
+            s.append(vTmp.string.s);
+            stringContext = unionContexts(stringContext, vTmp.stringContext());
         } else
-            s << state.coerceToString(pos, vTmp, context, false, firstType == tString);
+            s += state.coerceToString(pos, vTmp, context, false, firstType == tString);
     }
 
     if (firstType == tInt)
@@ -1486,10 +2036,11 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
     else if (firstType == tPath) {
         if (!context.empty())
             throwEvalError(pos, "a string that refers to a store path cannot be appended to a path");
-        auto path = canonPath(s.str());
+        auto path = canonPath(s);
         mkPath(v, path.c_str());
     } else
-        mkString(v, s.str(), context);
+        v.setString(dupStringWithLen(s.data(), s.size()),
+            unionContexts(stringContext, internContext(context)));
 }
 
 
@@ -1508,21 +2059,31 @@ void EvalState::forceValueDeep(Value & v)
     recurse = [&](Value & v) {
         if (!seen.insert(&v).second) return;
 
-        forceValue(v);
-
-        if (v.type == tAttrs) {
-            for (auto & i : *v.attrs)
-                try {
-                    recurse(*i.value);
-                } catch (Error & e) {
-                    addErrorTrace(e, *i.pos, "while evaluating the attribute '%1%'", i.name);
-                    throw;
-                }
-        }
+        try {
+            forceValue(v);
+
+            if (v.type() == tAttrs) {
+                forEachBatchingIFD(v.attrs->size(), [&](size_t n) {
+                    auto & i = (*v.attrs)[n];
+                    try {
+                        recurse(*i.value);
+                    } catch (Error & e) {
+                        if (!discardsError(e))
+                            addErrorTrace(e, *i.pos, "while evaluating the attribute '%1%'", i.name);
+                        throw;
+                    }
+                });
+            }
 
-        else if (v.isList()) {
-            for (size_t n = 0; n < v.listSize(); ++n)
-                recurse(*v.listElems()[n]);
+            else if (v.isList()) {
+                forEachBatchingIFD(v.listSize(), [&](size_t n) {
+                    recurse(*v.listElems()[n]);
+                });
+            }
+        } catch (ImportFromDerivationPending &) {
+            /* This value will be retried. */
+            seen.erase(&v);
+            throw;
         }
     };
 
@@ -1533,7 +2094,7 @@ void EvalState::forceValueDeep(Value & v)
 NixInt EvalState::forceInt(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
-    if (v.type != tInt)
+    if (v.type() != tInt)
         throwTypeError(pos, "value is %1% while an integer was expected", v);
     return v.integer;
 }
@@ -1542,9 +2103,9 @@ NixInt EvalState::forceInt(Value & v, const Pos & pos)
 NixFloat EvalState::forceFloat(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
-    if (v.type == tInt)
+    if (v.type() == tInt)
         return v.integer;
-    else if (v.type != tFloat)
+    else if (v.type() != tFloat)
         throwTypeError(pos, "value is %1% while a float was expected", v);
     return v.fpoint;
 }
@@ -1553,7 +2114,7 @@ NixFloat EvalState::forceFloat(Value & v, const Pos & pos)
 bool EvalState::forceBool(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
-    if (v.type != tBool)
+    if (v.type() != tBool)
         throwTypeError(pos, "value is %1% while a Boolean was expected", v);
     return v.boolean;
 }
@@ -1561,14 +2122,14 @@ bool EvalState::forceBool(Value & v, const Pos & pos)
 
 bool EvalState::isFunctor(Value & fun)
 {
-    return fun.type == tAttrs && fun.attrs->find(sFunctor) != fun.attrs->end();
+    return fun.type() == tAttrs && fun.attrs->find(sFunctor) != fun.attrs->end();
 }
 
 
 void EvalState::forceFunction(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
-    if (v.type != tLambda && v.type != tPrimOp && v.type != tPrimOpApp && !isFunctor(v))
+    if (v.type() != tLambda && v.type() != tPrimOp && v.type() != tPrimOpApp && !isFunctor(v))
         throwTypeError(pos, "value is %1% while a function was expected", v);
 }
 
@@ -1576,7 +2137,7 @@ void EvalState::forceFunction(Value & v, const Pos & pos)
 string EvalState::forceString(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
-    if (v.type != tString) {
+    if (v.type() != tString) {
         if (pos)
             throwTypeError(pos, "value is %1% while a string was expected", v);
         else
@@ -1588,8 +2149,8 @@ string EvalState::forceString(Value & v, const Pos & pos)
 
 void copyContext(const Value & v, PathSet & context)
 {
-    if (v.string.context)
-        for (const char * * p = v.string.context; *p; ++p)
+    if (v.stringContext())
+        for (const char * * p = v.stringContext(); *p; ++p)
             context.insert(*p);
 }
 
@@ -1605,13 +2166,13 @@ string EvalState::forceString(Value & v, PathSet & context, const Pos & pos)
 string EvalState::forceStringNoCtx(Value & v, const Pos & pos)
 {
     string s = forceString(v, pos);
-    if (v.string.context) {
+    if (v.stringContext()) {
         if (pos)
             throwEvalError(pos, "the string '%1%' is not allowed to refer to a store path (such as '%2%')",
-                v.string.s, v.string.context[0]);
+                v.string.s, v.stringContext()[0]);
         else
             throwEvalError("the string '%1%' is not allowed to refer to a store path (such as '%2%')",
-                v.string.s, v.string.context[0]);
+                v.string.s, v.stringContext()[0]);
     }
     return s;
 }
@@ -1619,11 +2180,11 @@ string EvalState::forceStringNoCtx(Value & v, const Pos & pos)
 
 bool EvalState::isDerivation(Value & v)
 {
-    if (v.type != tAttrs) return false;
+    if (v.type() != tAttrs) return false;
     Bindings::iterator i = v.attrs->find(sType);
     if (i == v.attrs->end()) return false;
     forceValue(*i->value);
-    if (i->value->type != tString) return false;
+    if (i->value->type() != tString) return false;
     return strcmp(i->value->string.s, "derivation") == 0;
 }
 
@@ -1648,17 +2209,17 @@ string EvalState::coerceToString(const Pos & pos, Value & v, PathSet & context,
 
     string s;
 
-    if (v.type == tString) {
+    if (v.type() == tString) {
         copyContext(v, context);
         return v.string.s;
     }
 
-    if (v.type == tPath) {
+    if (v.type() == tPath) {
         Path path(canonPath(v.path));
         return copyToStore ? copyPathToStore(context, path) : path;
     }
 
-    if (v.type == tAttrs) {
+    if (v.type() == tAttrs) {
         auto maybeString = tryAttrsToString(pos, v, context, coerceMore, copyToStore);
         if (maybeString) {
             return *maybeString;
@@ -1668,18 +2229,18 @@ string EvalState::coerceToString(const Pos & pos, Value & v, PathSet & context,
         return coerceToString(pos, *i->value, context, coerceMore, copyToStore);
     }
 
-    if (v.type == tExternal)
+    if (v.type() == tExternal)
         return v.external->coerceToString(pos, context, coerceMore, copyToStore);
 
     if (coerceMore) {
 
         /* Note that `false' is represented as an empty string for
            shell scripting convenience, just like `null'. */
-        if (v.type == tBool && v.boolean) return "1";
-        if (v.type == tBool && !v.boolean) return "";
-        if (v.type == tInt) return std::to_string(v.integer);
-        if (v.type == tFloat) return std::to_string(v.fpoint);
-        if (v.type == tNull) return "";
+        if (v.type() == tBool && v.boolean) return "1";
+        if (v.type() == tBool && !v.boolean) return "";
+        if (v.type() == tInt) return std::to_string(v.integer);
+        if (v.type() == tFloat) return std::to_string(v.fpoint);
+        if (v.type() == tNull) return "";
 
         if (v.isList()) {
             string result;
@@ -1699,6 +2260,44 @@ string EvalState::coerceToString(const Pos & pos, Value & v, PathSet & context,
 }
 
 
+/* Compute a hash of the metadata (but not the contents) of every file
+   in the tree rooted at 'path' that passes 'filter'. Returns an empty
+   value if some file was changed so recently that a further change
+   might not be reflected in its timestamps. */
+static std::optional<Hash> fingerprintSourceTree(const Path & path, const PathFilter & filter)
+{
+    HashSink sink(htSHA256);
+    auto now = time(0);
+    bool racy = false;
+
+    std::function<void(const Path &, const string &)> visit;
+    visit = [&](const Path & path, const string & relPath) {
+        auto st = lstat(path);
+        if (st.st_mtime >= now - 1 || st.st_ctime >= now - 1) racy = true;
+        sink << relPath
+             << (uint64_t) st.st_ino
+             << (uint64_t) st.st_mode
+             << (uint64_t) st.st_size
+             << (uint64_t) st.st_mtime
+             << (uint64_t) st.st_ctime;
+        if (S_ISDIR(st.st_mode)) {
+            std::vector<string> names;
+            for (auto & entry : readDirectory(path))
+                names.push_back(entry.name);
+            std::sort(names.begin(), names.end());
+            for (auto & name : names)
+                if (filter(path + "/" + name))
+                    visit(path + "/" + name, relPath + "/" + name);
+        }
+    };
+
+    visit(path, "");
+
+    if (racy) return {};
+    return sink.finish().first;
+}
+
+
 string EvalState::copyPathToStore(PathSet & context, const Path & path)
 {
     if (nix::isDerivation(path))
@@ -1709,9 +2308,8 @@ string EvalState::copyPathToStore(PathSet & context, const Path & path)
     if (i != srcToStore.end())
         dstPath = store->printStorePath(i->second);
     else {
-        auto p = settings.readOnlyMode
-            ? store->computeStorePathForPath(std::string(baseNameOf(path)), checkSourcePath(path)).first
-            : store->addToStore(std::string(baseNameOf(path)), checkSourcePath(path), FileIngestionMethod::Recursive, htSHA256, defaultPathFilter, repair);
+        auto p = addSourceToStore(std::string(baseNameOf(path)), checkSourcePath(path),
+            FileIngestionMethod::Recursive, defaultPathFilter, false);
         dstPath = store->printStorePath(p);
         srcToStore.insert_or_assign(path, std::move(p));
         printMsg(lvlChatty, "copied source '%1%' -> '%2%'", path, dstPath);
@@ -1722,6 +2320,58 @@ string EvalState::copyPathToStore(PathSet & context, const Path & path)
 }
 
 
+StorePath EvalState::addSourceToStore(const string & name, const Path & path,
+    FileIngestionMethod method, const PathFilter & filter, bool customFilter)
+{
+    /* Remember the results of a custom filter, since it calls into the
+       evaluator, and the tree is walked both for the fingerprint and
+       for copying it. */
+    std::map<Path, bool> filterResults;
+    PathFilter filter2 = !customFilter ? filter : [&](const Path & path) {
+        auto i = filterResults.find(path);
+        if (i != filterResults.end()) return i->second;
+        auto res = filter(path);
+        filterResults.emplace(path, res);
+        return res;
+    };
+
+    /* Consult the persistent cache of source paths, which is keyed by
+       the file metadata of the files that pass the filter, which
+       determine the contents of the resulting path regardless of what
+       the filter is. In read-only mode the resulting path need not be
+       valid, so skip it. */
+    std::optional<fetchers::Attrs> cacheKey;
+    if (evalSettings.useSourceCache && !settings.readOnlyMode) {
+        if (auto fingerprint = fingerprintSourceTree(path, filter2))
+            cacheKey = fetchers::Attrs({
+                {"type", "source"},
+                {"storeDir", store->storeDir},
+                {"path", path},
+                {"name", name},
+                {"filter", customFilter ? "custom" : "default"},
+                {"method", method == FileIngestionMethod::Recursive ? "recursive" : "flat"},
+                {"fingerprint", fingerprint->to_string(Base16, false)},
+            });
+    }
+
+    std::optional<StorePath> cached;
+    if (cacheKey && repair == NoRepair)
+        if (auto res = fetchers::getCache()->lookup(store, *cacheKey))
+            cached = std::move(res->second);
+
+    auto p = cached
+        ? std::move(*cached)
+        : settings.readOnlyMode
+        ? store->computeStorePathForPath(name, path, method, htSHA256, filter2).first
+        : store->addToStore(name, path, method, htSHA256, filter2, repair);
+
+    if (cacheKey && !cached)
+        fetchers::getCache()->add(store, *cacheKey, {}, p, true);
+
+    return p;
+}
+
+
 Path EvalState::coerceToPath(const Pos & pos, Value & v, PathSet & context)
 {
     string path = coerceToString(pos, v, context, false, false);
@@ -1742,15 +2392,15 @@ bool EvalState::eqValues(Value & v1, Value & v2)
     if (&v1 == &v2) return true;
 
     // Special case type-compatibility between float and int
-    if (v1.type == tInt && v2.type == tFloat)
+    if (v1.type() == tInt && v2.type() == tFloat)
         return v1.integer == v2.fpoint;
-    if (v1.type == tFloat && v2.type == tInt)
+    if (v1.type() == tFloat && v2.type() == tInt)
         return v1.fpoint == v2.integer;
 
     // All other types are not compatible with each other.
-    if (v1.type != v2.type) return false;
+    if (v1.type() != v2.type()) return false;
 
-    switch (v1.type) {
+    switch (v1.type()) {
 
         case tInt:
             return v1.integer == v2.integer;
@@ -1768,7 +2418,6 @@ bool EvalState::eqValues(Value & v1, Value & v2)
             return true;
 
         case tList1:
-        case tList2:
         case tListN:
             if (v1.listSize() != v2.listSize()) return false;
             for (size_t n = 0; n < v1.listSize(); ++n)
@@ -1840,6 +2489,7 @@ void EvalState::printStats()
         {
             auto envs = topObj.object("envs");
             envs.attr("number", nrEnvs);
+            envs.attr("onStack", nrStackEnvs);
             envs.attr("elements", nrValuesInEnvs);
             envs.attr("bytes", bEnvs);
         }
@@ -1848,6 +2498,7 @@ void EvalState::printStats()
             lists.attr("elements", nrListElems);
             lists.attr("bytes", bLists);
             lists.attr("concats", nrListConcats);
+            lists.attr("concatsInPlace", nrListConcatsInPlace);
         }
         {
             auto values = topObj.object("values");
@@ -1876,14 +2527,27 @@ void EvalState::printStats()
         topObj.attr("nrOpUpdateValuesCopied", nrOpUpdateValuesCopied);
         topObj.attr("nrThunks", nrThunks);
         topObj.attr("nrAvoided", nrAvoided);
+        topObj.attr("nrSharedConstants", nrSharedConstants);
         topObj.attr("nrLookups", nrLookups);
+        topObj.attr("nrAttrIndexes", nrAttrIndexes);
+        topObj.attr("nrAttrIndexLookups", nrAttrIndexLookups);
         topObj.attr("nrPrimOpCalls", nrPrimOpCalls);
         topObj.attr("nrFunctionCalls", nrFunctionCalls);
+        topObj.attr("nrTailCalls", nrTailCalls);
+        topObj.attr("nrFSCacheHits", nrFSCacheHits);
+        topObj.attr("nrFSCacheMisses", nrFSCacheMisses);
 #if HAVE_BOEHMGC
         {
             auto gc = topObj.object("gc");
             gc.attr("heapSize", heapSize);
             gc.attr("totalBytes", totalBytes);
+            gc.attr("cycles", GC_get_gc_no());
+            gc.attr("time", std::chrono::duration<double>(gcTotalTime).count());
+            gc.attr("maxTime", std::chrono::duration<double>(gcMaxTime).count());
+            auto histogram = gc.object("timeHistogram");
+            for (size_t n = 0; n < gcTimeHistogram.size(); ++n)
+                histogram.attr(n + 1 < gcTimeHistogram.size() ? fmt("<%dms", 1 << n) : fmt(">=%dms", 1 << (n - 1)),
+                    gcTimeHistogram[n]);
         }
 #endif
 
@@ -1923,6 +2587,39 @@ void EvalState::printStats()
             }
         }
 
+        if (countCalls) {
+            auto obj = topObj.object("primopTimes");
+            for (auto & i : primOpTimes)
+                obj.attr(i.first, std::chrono::duration<double>(i.second).count());
+        }
+
+        if (countCalls) {
+            auto list = topObj.list("allocations");
+            auto showAllocs = [&](JSONObject & obj, const AllocStats & stats) {
+                obj.attr("values", stats.values);
+                obj.attr("envs", stats.envs);
+                obj.attr("sets", stats.bindings);
+            };
+            for (auto & i : primOpAllocs) {
+                auto obj = list.object();
+                obj.attr("primop", (const string &) i.first);
+                showAllocs(obj, i.second);
+            }
+            for (auto & i : functionAllocs) {
+                auto obj = list.object();
+                if (i.first->name.set())
+                    obj.attr("name", (const string &) i.first->name);
+                else
+                    obj.attr("name", nullptr);
+                if (i.first->pos) {
+                    obj.attr("file", (const string &) i.first->pos.file);
+                    obj.attr("line", i.first->pos.line);
+                    obj.attr("column", i.first->pos.column);
+                }
+                showAllocs(obj, i.second);
+            }
+        }
+
         if (getEnv("NIX_SHOW_SYMBOLS").value_or("0") != "0") {
             auto list = topObj.list("symbols");
             symbols.dump([&](const std::string & s) { list.elem(s); });
@@ -6,9 +6,12 @@
 #include "symbol-table.hh"
 #include "hash.hh"
 #include "config.hh"
+#include "path.hh"
+#include "content-address.hh"
 
 #include <regex>
 #include <map>
+#include <chrono>
 #include <optional>
 #include <unordered_map>
 
@@ -18,6 +21,7 @@ namespace nix {
 
 class Store;
 class EvalState;
+class EvalProfiler;
 class StorePath;
 enum RepairFlag : bool;
 
@@ -44,10 +48,63 @@ struct Env
 };
 
 
+/* A stack from which the environments of function calls that cannot
+   escape (see ExprLambda::envEscapes) are allocated, and released
+   when the call returns. It is scanned by the garbage collector,
+   since these environments may hold the only references to the
+   arguments of a call. */
+class EnvStack
+{
+    char * start, * top, * end;
+
+public:
+
+    EnvStack(size_t size);
+    ~EnvStack();
+
+    /* Return a cleared environment of 'size' values, or nullptr if
+       the stack is full. */
+    Env * push(size_t size)
+    {
+        size_t n = sizeof(Env) + size * sizeof(Value *);
+        if ((size_t) (end - top) < n) return nullptr;
+        auto env = (Env *) top;
+        top += n;
+        return env;
+    }
+
+    /* Release 'env' and everything pushed after it. The memory is
+       cleared, both for the next push() and so that it doesn't keep
+       garbage alive. */
+    void pop(Env * env)
+    {
+        memset(env, 0, top - (char *) env);
+        top = (char *) env;
+    }
+};
+
+
 Value & mkString(Value & v, std::string_view s, const PathSet & context = PathSet());
 
 void copyContext(const Value & v, PathSet & context);
 
+/* Return the interned string context array for 'context'. Values
+   with the same context usually share one array, and their elements
+   are themselves interned. Returns nullptr for an empty context. */
+const char * * internContext(const PathSet & context);
+
+/* Return the interned union of two interned contexts. If one is a
+   subset of the other, the larger one is returned without allocating
+   anything. */
+const char * * unionContexts(const char * * a, const char * * b);
+
+
+/* Thrown by realiseContext() to defer a build needed for
+   import-from-derivation to the enclosing forEachBatchingIFD(). This
+   is deliberately not an Error, so that it passes through tryEval and
+   the handlers that add error traces. */
+struct ImportFromDerivationPending { };
+
 
 /* Cache for calls to addToStore(); maps source paths to the store
    paths. */
@@ -70,13 +127,20 @@ class EvalState
 public:
     SymbolTable symbols;
 
-    const Symbol sWith, sOutPath, sDrvPath, sType, sMeta, sName, sValue,
+    const Symbol sWith, sEpsilon, sOutPath, sDrvPath, sType, sMeta, sName, sValue,
         sSystem, sOverrides, sOutputs, sOutputName, sIgnoreNulls,
         sFile, sLine, sColumn, sFunctor, sToString,
         sRight, sWrong, sStructuredAttrs, sBuilder, sArgs,
         sOutputHash, sOutputHashAlgo, sOutputHashMode,
-        sRecurseForDerivations;
-    Symbol sDerivationNix;
+        sRecurseForDerivations, sOut, sAll, sDrvAttrs;
+
+    /* The position of the attributes that 'derivation' adds. Errors
+       in selecting them don't get a trace, since the user didn't
+       write them. */
+    Pos derivationPos;
+
+    /* The primops that 'derivation' builds on. */
+    Value * vDerivationStrict = nullptr, * vGetAttr = nullptr;
 
     /* If set, force copying files to the Nix store even if they
        already exist there. */
@@ -88,11 +152,32 @@ public:
 
     Value vEmptySet;
 
+    /* The number of calls to builtins.tryEval that are evaluating
+       their argument. Assertion failures (and thrown errors) in
+       their extent are caught and discarded by tryEval, so their
+       messages and traces are not worth formatting. */
+    unsigned int tryEvalDepth = 0;
+
+    /* Whether `e' will end up being discarded by tryEval. */
+    bool discardsError(Error & e)
+    {
+        return tryEvalDepth && dynamic_cast<AssertionError *>(&e);
+    }
+
     const ref<Store> store;
 
 private:
     SrcToStore srcToStore;
 
+#if HAVE_BOEHMGC
+    /* Free lists of Values and of Envs with one value, obtained in
+       batches from GC_malloc_many(). The heads live in traceable
+       memory, so that the collector doesn't reclaim the objects that
+       haven't been handed out yet. */
+    std::shared_ptr<void *> valueAllocCache;
+    std::shared_ptr<void *> env1AllocCache;
+#endif
+
     /* A cache from path names to parse trees. */
 #if HAVE_BOEHMGC
     typedef std::map<Path, Expr *, std::less<Path>, traceable_allocator<std::pair<const Path, Expr *> > > FileParseCache;
@@ -116,11 +201,34 @@ private:
     /* Cache used by checkSourcePath(). */
     std::unordered_map<Path, Path> resolvedPaths;
 
-    /* Cache used by prim_match(). */
-    std::unordered_map<std::string, std::regex> regexCache;
+    /* Caches used by the filesystem primops. Source files are assumed
+       not to change during an evaluation. */
+    std::unordered_map<Path, bool> pathExistsCache;
+    std::unordered_map<Path, DirEntries> readDirCache;
+    std::map<std::pair<Path, HashType>, Hash> hashFileCache;
 
 public:
 
+    /* A compiled regular expression. Patterns that contain no special
+       characters are matched as plain strings, which is much faster
+       than std::regex. */
+    struct CompiledRegex
+    {
+        std::optional<std::string> literal;
+        std::regex regex;
+    };
+
+private:
+
+    /* Cache used by getRegex(). */
+    std::unordered_map<std::string, CompiledRegex> regexCache;
+
+public:
+
+    /* Return the compiled form of the POSIX extended regular
+       expression 're'. Throws std::regex_error on invalid input. */
+    const CompiledRegex & getRegex(const std::string & re);
+
     EvalState(const Strings & _searchPath, ref<Store> store);
     ~EvalState();
 
@@ -132,6 +240,14 @@ public:
 
     void checkURI(const std::string & uri);
 
+    /* Cached versions of pathExists(), readDirectory() and hashFile()
+       for use by primops. 'path' must have been checked by
+       checkSourcePath(). The entries returned by readDirectoryCached()
+       have their type resolved. */
+    bool pathExistsCached(const Path & path);
+    const DirEntries & readDirectoryCached(const Path & path);
+    Hash hashFileCached(HashType ht, const Path & path);
+
     /* When using a diverted store and 'path' is in the Nix store, map
        'path' to the diverted location (e.g. /nix/store/foo is mapped
        to /home/alice/my-nix/nix/store/foo). However, this is only
@@ -213,6 +329,14 @@ public:
 
     string copyPathToStore(PathSet & context, const Path & path);
 
+    /* Add the tree at 'path', restricted by 'filter', to the store, or
+       in read-only mode just compute its store path. Store paths are
+       remembered across evaluations in the source cache. If
+       'customFilter' is set, 'filter' is assumed to be expensive; it
+       is called at most once for each file. */
+    StorePath addSourceToStore(const string & name, const Path & path,
+        FileIngestionMethod method, const PathFilter & filter, bool customFilter);
+
     /* Path coercion.  Converts strings, paths and derivations to a
        path.  The result is guaranteed to be a canonicalised, absolute
        path.  Nothing is copied to the store. */
@@ -250,7 +374,10 @@ private:
     friend struct ExprAttrs;
     friend struct ExprLet;
 
-    Expr * parse(const char * text, FileOrigin origin, const Path & path,
+    /* Parse 'length' bytes of 'text', which must be followed by two
+       NUL bytes so that the lexer can scan it in place. The buffer
+       is temporarily modified while scanning. */
+    Expr * parse(char * text, size_t length, FileOrigin origin, const Path & path,
         const Path & basePath, StaticEnv & staticEnv);
 
 public:
@@ -264,6 +391,19 @@ public:
     void callFunction(Value & fun, Value & arg, Value & v, const Pos & pos);
     void callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos);
 
+private:
+
+    /* Create the environment of a call to `lambda', taking it from the
+       environment stack if possible, in which case it is returned in
+       `stackEnv' as well. */
+    Env & bindArgs(ExprLambda & lambda, Value & fun, Value & arg, const Pos & pos, Env * & stackEnv);
+
+    /* Evaluate the body of a call to a lambda, making the calls in its
+       tail position by looping rather than recursing. */
+    void callLambdaLoop(Value & fun, Value & arg, Value & v, const Pos & pos);
+
+public:
+
     /* Automatically call a function for which each argument has a
        default value or has a binding in the `args' map. */
     void autoCallFunction(Bindings & args, Value & fun, Value & res);
@@ -289,9 +429,25 @@ public:
 
     void realiseContext(const PathSet & context);
 
+    /* Call 'f' for each of 'n' siblings (e.g. the elements of a list
+       or the attributes of a set). If 'batch-import-from-derivation'
+       is enabled, siblings that need a build for
+       import-from-derivation are deferred until the others have been
+       processed, so that all those builds can be done in parallel by
+       a single buildPaths() call. The deferred siblings are then
+       retried. */
+    void forEachBatchingIFD(size_t n, std::function<void(size_t)> f);
+
 private:
 
+    /* The number of active forEachBatchingIFD() calls. */
+    unsigned int ifdBatchDepth = 0;
+
+    /* The derivations that realiseContext() has deferred. */
+    std::vector<StorePathWithOutputs> pendingIFD;
+
     unsigned long nrEnvs = 0;
+    unsigned long nrStackEnvs = 0;
     unsigned long nrValuesInEnvs = 0;
     unsigned long nrValues = 0;
     unsigned long nrListElems = 0;
@@ -300,14 +456,50 @@ private:
     unsigned long nrOpUpdates = 0;
     unsigned long nrOpUpdateValuesCopied = 0;
     unsigned long nrListConcats = 0;
+    unsigned long nrListConcatsInPlace = 0;
     unsigned long nrPrimOpCalls = 0;
     unsigned long nrFunctionCalls = 0;
+    unsigned long nrTailCalls = 0;
+    unsigned long nrFSCacheHits = 0;
+    unsigned long nrFSCacheMisses = 0;
 
     bool countCalls;
 
+    std::unique_ptr<EvalProfiler> profiler;
+
+    EnvStack envStack{1024 * 1024};
+
     typedef std::map<Symbol, size_t> PrimOpCalls;
     PrimOpCalls primOpCalls;
 
+    /* Cumulative time spent in each primop, including any calls
+       made by it. */
+    typedef std::map<Symbol, std::chrono::nanoseconds> PrimOpTimes;
+    PrimOpTimes primOpTimes;
+
+    /* Allocations made while evaluating the body of a lambda or a
+       primop, not counting those made by nested calls. */
+    struct AllocStats
+    {
+        size_t values = 0, envs = 0, bindings = 0;
+    };
+
+    std::map<ExprLambda *, AllocStats> functionAllocs;
+    std::map<Symbol, AllocStats> primOpAllocs;
+
+    /* Where allocations are currently charged to, if 'countCalls' is
+       set. */
+    AllocStats * curAllocStats = nullptr;
+
+    struct ChargeAllocs
+    {
+        AllocStats * & cur;
+        AllocStats * prev;
+        ChargeAllocs(AllocStats * & cur, AllocStats & stats)
+            : cur(cur), prev(cur) { cur = &stats; }
+        ~ChargeAllocs() { cur = prev; }
+    };
+
     typedef std::map<ExprLambda *, size_t> FunctionCalls;
     FunctionCalls functionCalls;
 
@@ -316,11 +508,11 @@ private:
     typedef std::map<Pos, size_t> AttrSelects;
     AttrSelects attrSelects;
 
+    friend class EvalProfiler;
     friend struct ExprOpUpdate;
     friend struct ExprOpConcatLists;
     friend struct ExprSelect;
     friend void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v);
-    friend void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v);
 };
 
 
@@ -366,11 +558,57 @@ struct EvalSettings : Config
     Setting<bool> enableImportFromDerivation{this, true, "allow-import-from-derivation",
         "Whether the evaluator allows importing the result of a derivation."};
 
+    Setting<bool> batchImportFromDerivation{this, false, "batch-import-from-derivation",
+        "Whether to collect the builds needed for importing from derivations in sibling values and perform them in parallel."};
+
     Setting<Strings> allowedUris{this, {}, "allowed-uris",
         "Prefixes of URIs that builtin functions such as fetchurl and fetchGit are allowed to fetch."};
 
+    Setting<bool> useEvalCache{this, true, "eval-cache",
+        "Whether to cache the values of evaluated attributes (such as derivation paths) "
+        "in a database keyed by the contents of the Nix expressions being evaluated."};
+
+    Setting<bool> useSourceCache{this, true, "source-cache",
+        "Whether to remember the store paths of local sources copied to the store "
+        "across evaluations, keyed by the file metadata of the source tree."};
+
+    Setting<bool> useParseCache{this, true, "parse-cache",
+        "Whether to cache the parsed form of Nix expression files on disk, "
+        "keyed by a hash of their contents."};
+
+    Setting<bool> compileExpressions{this, false, "compile-expressions",
+        "Whether to rewrite parsed Nix expressions into a form that is faster to evaluate, "
+        "e.g. by resolving variable references to environment slots ahead of time."};
+
+    Setting<unsigned int> evalWorkers{this, 1, "eval-workers",
+        "Number of processes that 'nix-env -qa --json' uses to evaluate the "
+        "top-level attributes of the Nix expression in parallel, and that "
+        "'nix-instantiate' uses to evaluate several attribute paths."};
+
+    Setting<uint64_t> maxEvalWorkerHeapSize{this, 4096, "max-eval-worker-heap-size",
+        "Heap size (in MiB) after which an evaluation worker process is replaced by a fresh one."};
+
+    Setting<unsigned int> gcMarkThreads{this, 0, "gc-mark-threads",
+        "Number of threads used by the garbage collector for marking (0 means the libgc default). "
+        "Only takes effect before the first evaluation."};
+
+    Setting<bool> gcIncremental{this, false, "gc-incremental",
+        "Whether to collect garbage incrementally, in small steps interleaved with evaluation, "
+        "rather than stopping evaluation for each collection."};
+
+    Setting<unsigned int> gcFreeSpaceDivisor{this, 0, "gc-free-space-divisor",
+        "Trade-off between heap size and collection frequency used by the garbage collector "
+        "(0 means the libgc default). Higher values collect more often with a smaller heap."};
+
     Setting<bool> traceFunctionCalls{this, false, "trace-function-calls",
         "Emit log messages for each function entry and exit at the 'vomit' log level (-vvvv)."};
+
+    Setting<std::string> evalProfiler{this, "", "eval-profiler",
+        "If set to 'flamegraph' or 'chrome-trace', record the time and memory spent in each "
+        "function call stack and write it to 'eval-profile-file' in that format."};
+
+    Setting<Path> evalProfileFile{this, "nix.profile", "eval-profile-file",
+        "File to which the profile collected by 'eval-profiler' is written."};
 };
 
 extern EvalSettings evalSettings;
@@ -1,5 +1,8 @@
 #include "function-trace.hh"
 #include "logging.hh"
+#include "json.hh"
+
+#include <fstream>
 
 namespace nix {
 
@@ -15,4 +18,180 @@ FunctionCallTrace::~FunctionCallTrace() {
     printMsg(lvlInfo, "function-trace exited %1% at %2%", pos, ns.count());
 }
 
+
+EvalProfiler::EvalProfiler(EvalState & state, Format format, const Path & outFile)
+    : state(state)
+    , format(format)
+    , outFile(outFile)
+    , root(nullptr)
+    , current(&root)
+{
+    lastTime = std::chrono::steady_clock::now();
+    lastBytes = 0;
+    charge();
+}
+
+
+EvalProfiler::~EvalProfiler()
+{
+    try {
+        charge();
+        std::ofstream str(outFile);
+        if (!str) throw SysError("opening '%s'", outFile);
+        if (format == Flamegraph)
+            writeFlamegraph(str);
+        else
+            writeChromeTrace(str);
+        str.close();
+        if (!str) throw SysError("writing '%s'", outFile);
+        printInfo("wrote evaluation profile to '%s'", outFile);
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
+EvalProfiler::Frame::Frame(EvalProfiler & profiler, const Value & fun, const Pos & pos)
+    : profiler(profiler)
+{
+    profiler.enter(fun, pos);
+}
+
+
+EvalProfiler::Frame::~Frame()
+{
+    profiler.leave();
+}
+
+
+void EvalProfiler::charge()
+{
+    auto now = std::chrono::steady_clock::now();
+    auto bytes =
+        state.nrEnvs * sizeof(Env) + state.nrValuesInEnvs * sizeof(Value *)
+        + state.nrListElems * sizeof(Value *)
+        + state.nrValues * sizeof(Value)
+        + state.nrAttrsets * sizeof(Bindings) + state.nrAttrsInAttrsets * sizeof(Attr);
+    current->selfTime += std::chrono::duration_cast<std::chrono::nanoseconds>(now - lastTime).count();
+    current->selfBytes += bytes - lastBytes;
+    lastTime = now;
+    lastBytes = bytes;
+}
+
+
+void EvalProfiler::enter(const Value & fun, const Pos & pos)
+{
+    charge();
+
+    ExprLambda * lambda = nullptr;
+    PrimOp * primOp = nullptr;
+    if (fun.type() == tLambda)
+        lambda = fun.lambda.fun;
+    else {
+        auto f = &fun;
+        while (f->type() == tPrimOpApp) f = f->primOpAppLeft();
+        primOp = f->primOp;
+    }
+
+    auto key = lambda ? (const void *) lambda : (const void *) primOp;
+    auto & child = current->children[key];
+    if (!child) {
+        child = std::make_unique<Node>(current);
+        child->lambda = lambda;
+        child->primOp = primOp;
+        child->callPos = pos;
+    }
+    child->calls++;
+    current = child.get();
+}
+
+
+void EvalProfiler::leave()
+{
+    charge();
+    assert(current->parent);
+    current = current->parent;
+}
+
+
+std::string EvalProfiler::Node::label() const
+{
+    if (lambda)
+        return fmt("%s at %s",
+            lambda->name.set() ? (string) lambda->name : "anonymous function",
+            lambda->pos);
+    if (primOp)
+        return fmt("primop %s", primOp->name);
+    return "<toplevel>";
+}
+
+
+uint64_t EvalProfiler::Node::totalTime() const
+{
+    auto res = selfTime;
+    for (auto & i : children) res += i.second->totalTime();
+    return res;
+}
+
+
+uint64_t EvalProfiler::Node::totalBytes() const
+{
+    auto res = selfBytes;
+    for (auto & i : children) res += i.second->totalBytes();
+    return res;
+}
+
+
+void EvalProfiler::writeFlamegraph(std::ostream & str)
+{
+    /* One line per call stack, consisting of the frames separated by
+       semicolons and the self time in microseconds. */
+    std::function<void(const Node &, const std::string &)> write;
+    write = [&](const Node & node, const std::string & stack) {
+        auto us = node.selfTime / 1000;
+        if (us) str << stack << " " << us << "\n";
+        for (auto & i : node.children) {
+            auto label = replaceStrings(i.second->label(), ";", ":");
+            write(*i.second, stack.empty() ? label : stack + ";" + label);
+        }
+    };
+    write(root, "");
+}
+
+
+void EvalProfiler::writeChromeTrace(std::ostream & str)
+{
+    /* Since only aggregated data is available, each node of the call
+       tree becomes a single 'complete' event spanning its total time,
+       with its children laid out one after the other inside it. */
+    JSONObject top(str);
+    auto events = top.list("traceEvents");
+
+    std::function<void(const Node &, double)> write;
+    write = [&](const Node & node, double start) {
+        auto total = node.totalTime() / 1000.0;
+        {
+            auto event = events.object();
+            event.attr("name", node.label());
+            event.attr("ph", std::string("X"));
+            event.attr("ts", start);
+            event.attr("dur", total);
+            event.attr("pid", 1);
+            event.attr("tid", 1);
+            auto args = event.object("args");
+            args.attr("calls", node.calls);
+            args.attr("selfTime", node.selfTime / 1000.0);
+            args.attr("selfBytes", node.selfBytes);
+            args.attr("totalBytes", node.totalBytes());
+            if (node.callPos)
+                args.attr("callSite", fmt("%s", node.callPos));
+        }
+        for (auto & i : node.children) {
+            write(*i.second, start);
+            start += i.second->totalTime() / 1000.0;
+        }
+    };
+    write(root, 0);
+}
+
 }
@@ -12,4 +12,68 @@ struct FunctionCallTrace
     FunctionCallTrace(const Pos & pos);
     ~FunctionCallTrace();
 };
+
+/* A profiler that aggregates the time spent in and the memory
+   allocated by function calls per call stack, rather than logging
+   every call. The result is written when the profiler is destroyed,
+   either as collapsed stacks (for flamegraph.pl and compatible tools)
+   or in the Chrome trace event format. */
+class EvalProfiler
+{
+public:
+
+    enum Format { Flamegraph, ChromeTrace };
+
+    EvalProfiler(EvalState & state, Format format, const Path & outFile);
+
+    ~EvalProfiler();
+
+    /* Records a call of 'fun' (a lambda or primop) from 'pos' for
+       the lifetime of this object. */
+    struct Frame
+    {
+        EvalProfiler & profiler;
+        Frame(EvalProfiler & profiler, const Value & fun, const Pos & pos);
+        ~Frame();
+    };
+
+private:
+
+    struct Node
+    {
+        Node * parent;
+        ExprLambda * lambda = nullptr;
+        PrimOp * primOp = nullptr;
+        Pos callPos; // of the first call
+        uint64_t calls = 0;
+        uint64_t selfTime = 0; // in nanoseconds
+        uint64_t selfBytes = 0;
+        std::map<const void *, std::unique_ptr<Node>> children;
+        Node(Node * parent) : parent(parent) { }
+        std::string label() const;
+        uint64_t totalTime() const;
+        uint64_t totalBytes() const;
+    };
+
+    EvalState & state;
+    Format format;
+    Path outFile;
+
+    Node root;
+    Node * current;
+
+    std::chrono::steady_clock::time_point lastTime;
+    uint64_t lastBytes;
+
+    /* Charge the time and memory since the last event to the
+       current node. */
+    void charge();
+
+    void enter(const Value & fun, const Pos & pos);
+    void leave();
+
+    void writeFlamegraph(std::ostream & str);
+    void writeChromeTrace(std::ostream & str);
+};
+
 }
@@ -88,7 +88,7 @@ string DrvInfo::queryOutPath() const
 
 DrvInfo::Outputs DrvInfo::queryOutputs(bool onlyOutputsToInstall)
 {
-    if (outputs.empty()) {
+    if (!haveOutputs) {
         /* Get the ‘outputs’ list. */
         Bindings::iterator i;
         if (attrs && (i = attrs->find(state->sOutputs)) != attrs->end()) {
@@ -110,23 +110,30 @@ DrvInfo::Outputs DrvInfo::queryOutputs(bool onlyOutputsToInstall)
             }
         } else
             outputs["out"] = queryOutPath();
+        haveOutputs = true;
     }
     if (!onlyOutputsToInstall || !attrs)
         return outputs;
 
+    if (outputsToInstall) return *outputsToInstall;
+
     /* Check for `meta.outputsToInstall` and return `outputs` reduced to that. */
     const Value * outTI = queryMeta("outputsToInstall");
-    if (!outTI) return outputs;
+    if (!outTI) {
+        outputsToInstall = outputs;
+        return outputs;
+    }
     const auto errMsg = Error("this derivation has bad 'meta.outputsToInstall'");
         /* ^ this shows during `nix-env -i` right under the bad derivation */
     if (!outTI->isList()) throw errMsg;
     Outputs result;
     for (auto i = outTI->listElems(); i != outTI->listElems() + outTI->listSize(); ++i) {
-        if ((*i)->type != tString) throw errMsg;
+        if ((*i)->type() != tString) throw errMsg;
         auto out = outputs.find((*i)->string.s);
         if (out == outputs.end()) throw errMsg;
         result.insert(*out);
     }
+    outputsToInstall = result;
     return result;
 }
 
@@ -171,31 +178,38 @@ bool DrvInfo::checkMeta(Value & v)
             if (!checkMeta(*v.listElems()[n])) return false;
         return true;
     }
-    else if (v.type == tAttrs) {
+    else if (v.type() == tAttrs) {
         Bindings::iterator i = v.attrs->find(state->sOutPath);
         if (i != v.attrs->end()) return false;
         for (auto & i : *v.attrs)
             if (!checkMeta(*i.value)) return false;
         return true;
     }
-    else return v.type == tInt || v.type == tBool || v.type == tString ||
-                v.type == tFloat;
+    else return v.type() == tInt || v.type() == tBool || v.type() == tString ||
+                v.type() == tFloat;
 }
 
 
 Value * DrvInfo::queryMeta(const string & name)
 {
-    if (!getMeta()) return 0;
-    Bindings::iterator a = meta->find(state->symbols.create(name));
-    if (a == meta->end() || !checkMeta(*a->value)) return 0;
-    return a->value;
+    auto i = checkedMeta.find(name);
+    if (i != checkedMeta.end()) return i->second;
+
+    Value * v = nullptr;
+    if (getMeta()) {
+        Bindings::iterator a = meta->find(state->symbols.create(name));
+        if (a != meta->end() && checkMeta(*a->value)) v = a->value;
+    }
+
+    checkedMeta.emplace(name, v);
+    return v;
 }
 
 
 string DrvInfo::queryMetaString(const string & name)
 {
     Value * v = queryMeta(name);
-    if (!v || v->type != tString) return "";
+    if (!v || v->type() != tString) return "";
     return v->string.s;
 }
 
@@ -204,8 +218,8 @@ NixInt DrvInfo::queryMetaInt(const string & name, NixInt def)
 {
     Value * v = queryMeta(name);
     if (!v) return def;
-    if (v->type == tInt) return v->integer;
-    if (v->type == tString) {
+    if (v->type() == tInt) return v->integer;
+    if (v->type() == tString) {
         /* Backwards compatibility with before we had support for
            integer meta fields. */
         NixInt n;
@@ -218,8 +232,8 @@ NixFloat DrvInfo::queryMetaFloat(const string & name, NixFloat def)
 {
     Value * v = queryMeta(name);
     if (!v) return def;
-    if (v->type == tFloat) return v->fpoint;
-    if (v->type == tString) {
+    if (v->type() == tFloat) return v->fpoint;
+    if (v->type() == tString) {
         /* Backwards compatibility with before we had support for
            float meta fields. */
         NixFloat n;
@@ -233,8 +247,8 @@ bool DrvInfo::queryMetaBool(const string & name, bool def)
 {
     Value * v = queryMeta(name);
     if (!v) return def;
-    if (v->type == tBool) return v->boolean;
-    if (v->type == tString) {
+    if (v->type() == tBool) return v->boolean;
+    if (v->type() == tString) {
         /* Backwards compatibility with before we had support for
            Boolean meta fields. */
         if (strcmp(v->string.s, "true") == 0) return true;
@@ -246,6 +260,8 @@ bool DrvInfo::queryMetaBool(const string & name, bool def)
 
 void DrvInfo::setMeta(const string & name, Value * v)
 {
+    checkedMeta.erase(name);
+    if (name == "outputsToInstall") outputsToInstall.reset();
     getMeta();
     Bindings * old = meta;
     meta = state->allocBindings(1 + (old ? old->size() : 0));
@@ -314,6 +330,36 @@ static string addToPath(const string & s1, const string & s2)
 static std::regex attrRegex("[A-Za-z_][A-Za-z0-9-_+]*");
 
 
+static void getDerivations(EvalState & state, Value & vIn,
+    const string & pathPrefix, Bindings & autoArgs,
+    DrvInfos & drvs, Done & done,
+    bool ignoreAssertionFailures);
+
+
+static void getDerivationsFromAttr(EvalState & state, const Attr & attr,
+    bool combineChannels, const string & pathPrefix, Bindings & autoArgs,
+    DrvInfos & drvs, Done & done,
+    bool ignoreAssertionFailures)
+{
+    debug("evaluating attribute '%1%'", attr.name);
+    if (!std::regex_match(std::string(attr.name), attrRegex))
+        return;
+    string pathPrefix2 = addToPath(pathPrefix, attr.name);
+    if (combineChannels)
+        getDerivations(state, *attr.value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
+    else if (getDerivation(state, *attr.value, pathPrefix2, drvs, done, ignoreAssertionFailures)) {
+        /* If the value of this attribute is itself a set,
+           should we recurse into it?  => Only if it has a
+           `recurseForDerivations = true' attribute. */
+        if (attr.value->type() == tAttrs) {
+            Bindings::iterator j = attr.value->attrs->find(state.sRecurseForDerivations);
+            if (j != attr.value->attrs->end() && state.forceBool(*j->value, *j->pos))
+                getDerivations(state, *attr.value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
+        }
+    }
+}
+
+
 static void getDerivations(EvalState & state, Value & vIn,
     const string & pathPrefix, Bindings & autoArgs,
     DrvInfos & drvs, Done & done,
@@ -325,7 +371,7 @@ static void getDerivations(EvalState & state, Value & vIn,
     /* Process the expression. */
     if (!getDerivation(state, v, pathPrefix, drvs, done, ignoreAssertionFailures)) ;
 
-    else if (v.type == tAttrs) {
+    else if (v.type() == tAttrs) {
 
         /* !!! undocumented hackery to support combining channels in
            nix-env.cc. */
@@ -336,24 +382,8 @@ static void getDerivations(EvalState & state, Value & vIn,
            there are names clashes between derivations, the derivation
            bound to the attribute with the "lower" name should take
            precedence). */
-        for (auto & i : v.attrs->lexicographicOrder()) {
-            debug("evaluating attribute '%1%'", i->name);
-            if (!std::regex_match(std::string(i->name), attrRegex))
-                continue;
-            string pathPrefix2 = addToPath(pathPrefix, i->name);
-            if (combineChannels)
-                getDerivations(state, *i->value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
-            else if (getDerivation(state, *i->value, pathPrefix2, drvs, done, ignoreAssertionFailures)) {
-                /* If the value of this attribute is itself a set,
-                   should we recurse into it?  => Only if it has a
-                   `recurseForDerivations = true' attribute. */
-                if (i->value->type == tAttrs) {
-                    Bindings::iterator j = i->value->attrs->find(state.sRecurseForDerivations);
-                    if (j != i->value->attrs->end() && state.forceBool(*j->value, *j->pos))
-                        getDerivations(state, *i->value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
-                }
-            }
-        }
+        for (auto & i : v.attrs->lexicographicOrder())
+            getDerivationsFromAttr(state, *i, combineChannels, pathPrefix, autoArgs, drvs, done, ignoreAssertionFailures);
     }
 
     else if (v.isList()) {
@@ -376,4 +406,28 @@ void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
 }
 
 
+void getDerivationsFromAttr(EvalState & state, Value & v, const Symbol & name,
+    const string & pathPrefix, Bindings & autoArgs, DrvInfos & drvs,
+    bool ignoreAssertionFailures)
+{
+    assert(v.type() == tAttrs);
+    auto i = v.attrs->find(name);
+    if (i == v.attrs->end()) return;
+    Done done;
+    bool combineChannels = v.attrs->find(state.symbols.create("_combineChannels")) != v.attrs->end();
+    getDerivationsFromAttr(state, *i, combineChannels, pathPrefix, autoArgs, drvs, done, ignoreAssertionFailures);
+}
+
+
+void queryDrvPaths(EvalState & state, DrvInfos & drvs)
+{
+    std::vector<DrvInfo *> drvs2;
+    for (auto & drv : drvs)
+        drvs2.push_back(&drv);
+    state.forEachBatchingIFD(drvs2.size(), [&](size_t n) {
+        drvs2[n]->queryDrvPath();
+    });
+}
+
+
 }
@@ -4,6 +4,7 @@
 
 #include <string>
 #include <map>
+#include <optional>
 
 
 namespace nix {
@@ -23,6 +24,12 @@ private:
     mutable string outPath;
     mutable string outputName;
     Outputs outputs;
+    bool haveOutputs = false;
+    std::optional<Outputs> outputsToInstall;
+
+    /* The results of queryMeta(), which has to check the entire
+       value. */
+    std::map<string, Value *> checkedMeta;
 
     bool failed = false; // set if we get an AssertionError
 
@@ -85,5 +92,21 @@ void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
     Bindings & autoArgs, DrvInfos & drvs,
     bool ignoreAssertionFailures);
 
+/* Process only the attribute 'name' of 'v', which must be an
+   attribute set obtained by auto-calling the argument of
+   getDerivations(). Calling this for every attribute of 'v' in
+   lexicographic order yields the same derivations as
+   getDerivations(), except that a derivation bound to several
+   attributes is returned for each of them. */
+void getDerivationsFromAttr(EvalState & state, Value & v, const Symbol & name,
+    const string & pathPrefix, Bindings & autoArgs, DrvInfos & drvs,
+    bool ignoreAssertionFailures);
+
+/* Evaluate the derivation paths of 'drvs'. This is equivalent to
+   calling queryDrvPath() on each of them, except that builds for
+   import-from-derivation are batched (see
+   EvalState::forEachBatchingIFD()). */
+void queryDrvPaths(EvalState & state, DrvInfos & drvs);
+
 
 }
@@ -7,26 +7,36 @@ using json = nlohmann::json;
 
 namespace nix {
 
+#if HAVE_BOEHMGC
+typedef std::vector<std::pair<Symbol, Value *>, traceable_allocator<std::pair<Symbol, Value *>>> AttrVector;
+#else
+typedef std::vector<std::pair<Symbol, Value *>> AttrVector;
+#endif
+
 // for more information, refer to
 // https://github.com/nlohmann/json/blob/master/include/nlohmann/detail/input/json_sax.hpp
 class JSONSax : nlohmann::json_sax<json> {
+    /* The states are not scanned by the garbage collector. This is
+       fine because 'v' is only set while a value is being stored: in
+       an object, it is also reachable from 'attrs', and in a list it
+       is added to 'values' by the same callback that allocates it. */
     class JSONState {
     protected:
         std::unique_ptr<JSONState> parent;
-        RootValue v;
+        Value * v = nullptr;
     public:
         virtual std::unique_ptr<JSONState> resolve(EvalState &)
         {
             throw std::logic_error("tried to close toplevel json parser state");
         }
         explicit JSONState(std::unique_ptr<JSONState> && p) : parent(std::move(p)) {}
-        explicit JSONState(Value * v) : v(allocRootValue(v)) {}
+        explicit JSONState(Value * v) : v(v) {}
         JSONState(JSONState & p) = delete;
         Value & value(EvalState & state)
         {
             if (!v)
-                v = allocRootValue(state.allocValue());
-            return **v;
+                v = state.allocValue();
+            return *v;
         }
         virtual ~JSONState() {}
         virtual void add() {}
@@ -34,9 +44,22 @@ class JSONSax : nlohmann::json_sax<json> {
 
     class JSONObjectState : public JSONState {
         using JSONState::JSONState;
-        ValueMap attrs;
+        AttrVector attrs;
         std::unique_ptr<JSONState> resolve(EvalState & state) override
         {
+            /* Sort the attributes into Bindings order once, rather
+               than maintaining a map while parsing. For duplicate
+               keys, the last one wins. */
+            std::stable_sort(attrs.begin(), attrs.end(),
+                [](const auto & a, const auto & b) { return a.first < b.first; });
+            size_t n = 0;
+            for (size_t i = 0; i < attrs.size(); ++i) {
+                if (n && attrs[n - 1].first == attrs[i].first)
+                    attrs[n - 1] = attrs[i];
+                else
+                    attrs[n++] = attrs[i];
+            }
+            attrs.resize(n);
             Value & v = parent->value(state);
             state.mkAttrs(v, attrs.size());
             for (auto & i : attrs)
@@ -45,9 +68,10 @@ class JSONSax : nlohmann::json_sax<json> {
         }
         void add() override { v = nullptr; }
     public:
+        void reserve(size_t len) { attrs.reserve(len); }
         void key(string_t & name, EvalState & state)
         {
-            attrs.insert_or_assign(state.symbols.create(name), &value(state));
+            attrs.emplace_back(state.symbols.create(name), &value(state));
         }
     };
 
@@ -63,7 +87,7 @@ class JSONSax : nlohmann::json_sax<json> {
             return std::move(parent);
         }
         void add() override {
-            values.push_back(*v);
+            values.push_back(v);
             v = nullptr;
         }
     public:
@@ -118,7 +142,10 @@ public:
 
     bool start_object(std::size_t len)
     {
-        rs = std::make_unique<JSONObjectState>(std::move(rs));
+        auto obj = std::make_unique<JSONObjectState>(std::move(rs));
+        if (len != std::numeric_limits<size_t>::max())
+            obj->reserve(len);
+        rs = std::move(obj);
         return true;
     }
 
@@ -149,10 +176,10 @@ public:
     }
 };
 
-void parseJSON(EvalState & state, const string & s_, Value & v)
+void parseJSON(EvalState & state, std::string_view s, Value & v)
 {
     JSONSax parser(state, v);
-    bool res = json::sax_parse(s_, &parser);
+    bool res = json::sax_parse(s.data(), s.data() + s.size(), &parser);
     if (!res)
         throw JSONParseError("Invalid JSON Value");
 }
@@ -8,6 +8,8 @@ namespace nix {
 
 MakeError(JSONParseError, EvalError);
 
-void parseJSON(EvalState & state, const string & s, Value & v);
+/* Parse 's' directly into 'v', without building an intermediate
+   JSON document. */
+void parseJSON(EvalState & state, std::string_view s, Value & v);
 
 }
@@ -54,7 +54,7 @@ static void showId(std::ostream & str, const string & s)
 
 std::ostream & operator << (std::ostream & str, const Symbol & sym)
 {
-    showId(str, *sym.s);
+    showId(str, sym.s->s);
     return str;
 }
 
@@ -88,6 +88,11 @@ void ExprVar::show(std::ostream & str) const
     str << name;
 }
 
+void ExprLocalVar::show(std::ostream & str) const
+{
+    str << name;
+}
+
 void ExprSelect::show(std::ostream & str) const
 {
     str << "(" << *e << ")." << showAttrPath(attrPath);
@@ -332,12 +337,19 @@ void ExprAttrs::bindVars(const StaticEnv & env)
         i.nameExpr->bindVars(*dynamicEnv);
         i.valueExpr->bindVars(*dynamicEnv);
     }
+
+    constant = !recursive && dynamicAttrs.empty();
+    for (auto & i : attrs)
+        if (i.second.inherited || !i.second.e->isConstant()) constant = false;
 }
 
 void ExprList::bindVars(const StaticEnv & env)
 {
-    for (auto & i : elems)
+    constant = true;
+    for (auto & i : elems) {
         i->bindVars(env);
+        if (!i->isConstant()) constant = false;
+    }
 }
 
 void ExprLambda::bindVars(const StaticEnv & env)
@@ -357,6 +369,18 @@ void ExprLambda::bindVars(const StaticEnv & env)
     }
 
     body->bindVars(newEnv);
+
+    envEscapes = body->capturesEnv();
+    if (matchAttrs)
+        for (auto & i : formals->formals) {
+            if (!i.def) continue;
+            /* A default that refers to another formal argument is
+               looked up before the environment is complete, and so
+               becomes a thunk. */
+            auto var = dynamic_cast<ExprVar *>(i.def);
+            if (i.def->thunkCapturesEnv() || (var && var->level == 0))
+                envEscapes = true;
+        }
 }
 
 void ExprLet::bindVars(const StaticEnv & env)
@@ -421,6 +445,196 @@ void ExprPos::bindVars(const StaticEnv & env)
 }
 
 
+/* Escape analysis. Lambdas, lets, withs and recursive sets create
+   closures or environments that point to the current one, so they
+   use the default (conservative) answer. */
+
+bool ExprVar::thunkCapturesEnv() const
+{
+    /* Variables from a "with" are looked up lazily, through a thunk.
+       The others are already in the environment when the body of a
+       function is evaluated. */
+    return fromWith;
+}
+
+bool ExprSelect::capturesEnv() const
+{
+    if (e->capturesEnv() || (def && def->capturesEnv())) return true;
+    for (auto & i : attrPath)
+        if (!i.symbol.set() && i.expr->capturesEnv()) return true;
+    return false;
+}
+
+bool ExprOpHasAttr::capturesEnv() const
+{
+    if (e->capturesEnv()) return true;
+    for (auto & i : attrPath)
+        if (!i.symbol.set() && i.expr->capturesEnv()) return true;
+    return false;
+}
+
+bool ExprAttrs::capturesEnv() const
+{
+    if (recursive) return true;
+    for (auto & i : attrs)
+        if (i.second.e->thunkCapturesEnv()) return true;
+    for (auto & i : dynamicAttrs)
+        if (i.nameExpr->capturesEnv() || i.valueExpr->thunkCapturesEnv()) return true;
+    return false;
+}
+
+bool ExprList::capturesEnv() const
+{
+    for (auto & i : elems)
+        if (i->thunkCapturesEnv()) return true;
+    return false;
+}
+
+bool ExprIf::capturesEnv() const
+{
+    return cond->capturesEnv() || then->capturesEnv() || else_->capturesEnv();
+}
+
+bool ExprAssert::capturesEnv() const
+{
+    return cond->capturesEnv() || body->capturesEnv();
+}
+
+bool ExprOpNot::capturesEnv() const
+{
+    return e->capturesEnv();
+}
+
+bool ExprApp::capturesEnv() const
+{
+    /* The argument is passed as a thunk. */
+    return e1->capturesEnv() || e2->thunkCapturesEnv();
+}
+
+#define BinOpCapturesEnv(name) \
+    bool name::capturesEnv() const \
+    { \
+        return e1->capturesEnv() || e2->capturesEnv(); \
+    }
+
+BinOpCapturesEnv(ExprOpEq)
+BinOpCapturesEnv(ExprOpNEq)
+BinOpCapturesEnv(ExprOpAnd)
+BinOpCapturesEnv(ExprOpOr)
+BinOpCapturesEnv(ExprOpImpl)
+BinOpCapturesEnv(ExprOpUpdate)
+BinOpCapturesEnv(ExprOpConcatLists)
+
+bool ExprConcatStrings::capturesEnv() const
+{
+    for (auto & i : *es)
+        if (i->capturesEnv()) return true;
+    return false;
+}
+
+
+/* Compiling expressions into a form that is faster to evaluate. */
+
+Expr * Expr::compile()
+{
+    return this;
+}
+
+Expr * ExprVar::compile()
+{
+    if (fromWith) return this;
+    return new ExprLocalVar(*this);
+}
+
+Expr * ExprSelect::compile()
+{
+    e = e->compile();
+    if (def) def = def->compile();
+    for (auto & i : attrPath)
+        if (!i.symbol.set())
+            i.expr = i.expr->compile();
+    return this;
+}
+
+Expr * ExprOpHasAttr::compile()
+{
+    e = e->compile();
+    for (auto & i : attrPath)
+        if (!i.symbol.set())
+            i.expr = i.expr->compile();
+    return this;
+}
+
+Expr * ExprAttrs::compile()
+{
+    for (auto & i : attrs)
+        i.second.e = i.second.e->compile();
+    for (auto & i : dynamicAttrs) {
+        i.nameExpr = i.nameExpr->compile();
+        i.valueExpr = i.valueExpr->compile();
+    }
+    return this;
+}
+
+Expr * ExprList::compile()
+{
+    for (auto & i : elems)
+        i = i->compile();
+    return this;
+}
+
+Expr * ExprLambda::compile()
+{
+    if (matchAttrs)
+        for (auto & i : formals->formals)
+            if (i.def) i.def = i.def->compile();
+    body = body->compile();
+    return this;
+}
+
+Expr * ExprLet::compile()
+{
+    attrs->compile();
+    body = body->compile();
+    return this;
+}
+
+Expr * ExprWith::compile()
+{
+    attrs = attrs->compile();
+    body = body->compile();
+    return this;
+}
+
+Expr * ExprIf::compile()
+{
+    cond = cond->compile();
+    then = then->compile();
+    else_ = else_->compile();
+    return this;
+}
+
+Expr * ExprAssert::compile()
+{
+    cond = cond->compile();
+    body = body->compile();
+    return this;
+}
+
+Expr * ExprOpNot::compile()
+{
+    e = e->compile();
+    return this;
+}
+
+Expr * ExprConcatStrings::compile()
+{
+    for (auto & i : *es)
+        i = i->compile();
+    return this;
+}
+
+
 /* Storing function names. */
 
 void Expr::setName(Symbol & name)
@@ -447,8 +661,8 @@ string ExprLambda::showNamePos() const
 size_t SymbolTable::totalSize() const
 {
     size_t n = 0;
-    for (auto & i : symbols)
-        n += i.size();
+    for (auto & i : store)
+        n += i.s.size();
     return n;
 }
 
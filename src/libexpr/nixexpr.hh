@@ -4,6 +4,7 @@
 #include "symbol-table.hh"
 #include "error.hh"
 
+#include <algorithm>
 #include <map>
 
 
@@ -20,16 +21,19 @@ MakeError(UndefinedVarError, Error);
 MakeError(RestrictedPathError, Error);
 
 
-/* Position objects. */
+/* Position objects. Every AST node that can be the site of an error
+   embeds one, so the column and the origin are packed into a single
+   word to keep a position at two words. */
 
 struct Pos
 {
-    FileOrigin origin;
     Symbol file;
-    unsigned int line, column;
-    Pos() : origin(foString), line(0), column(0) { };
+    unsigned int line;
+    unsigned int column : 29;
+    FileOrigin origin : 3;
+    Pos() : line(0), column(0), origin(foString) { };
     Pos(FileOrigin origin, const Symbol & file, unsigned int line, unsigned int column)
-        : origin(origin), file(file), line(line), column(column) { };
+        : file(file), line(line), column(std::min(column, (1U << 29) - 1)), origin(origin) { };
     operator bool() const
     {
         return line != 0;
@@ -63,6 +67,9 @@ struct AttrName
 {
     Symbol symbol;
     Expr * expr;
+    /* Where this attribute was found by the previous lookup at this
+       call site; see Bindings::find(name, hint). */
+    uint32_t hint = 0;
     AttrName(const Symbol & s) : symbol(s) {};
     AttrName(Expr * e) : expr(e) {};
 };
@@ -82,6 +89,27 @@ struct Expr
     virtual void eval(EvalState & state, Env & env, Value & v);
     virtual Value * maybeThunk(EvalState & state, Env & env);
     virtual void setName(Symbol & name);
+
+    /* Return an equivalent expression that is cheaper to evaluate,
+       e.g. with variable references resolved into direct environment
+       slot loads. Must be called after bindVars(). Subexpressions are
+       replaced in place; leaves are returned unchanged. */
+    virtual Expr * compile();
+
+    /* Whether evaluating this expression may store a reference to
+       its environment in a value (by creating a thunk or closure),
+       so that the environment can outlive the evaluation. Must be
+       called after bindVars(). */
+    virtual bool capturesEnv() const { return true; }
+
+    /* Whether maybeThunk() may store a reference to the
+       environment. */
+    virtual bool thunkCapturesEnv() const { return true; }
+
+    /* Whether this expression is closed and always evaluates to the
+       same value, which can therefore be shared by all evaluations.
+       Must be called after bindVars(). */
+    virtual bool isConstant() const { return false; }
 };
 
 std::ostream & operator << (std::ostream & str, const Expr & e);
@@ -98,6 +126,9 @@ struct ExprInt : Expr
     ExprInt(NixInt n) : n(n) { mkInt(v, n); };
     COMMON_METHODS
     Value * maybeThunk(EvalState & state, Env & env);
+    bool capturesEnv() const { return false; }
+    bool thunkCapturesEnv() const { return false; }
+    bool isConstant() const { return true; }
 };
 
 struct ExprFloat : Expr
@@ -107,6 +138,9 @@ struct ExprFloat : Expr
     ExprFloat(NixFloat nf) : nf(nf) { mkFloat(v, nf); };
     COMMON_METHODS
     Value * maybeThunk(EvalState & state, Env & env);
+    bool capturesEnv() const { return false; }
+    bool thunkCapturesEnv() const { return false; }
+    bool isConstant() const { return true; }
 };
 
 struct ExprString : Expr
@@ -116,6 +150,9 @@ struct ExprString : Expr
     ExprString(const Symbol & s) : s(s) { mkString(v, s); };
     COMMON_METHODS
     Value * maybeThunk(EvalState & state, Env & env);
+    bool capturesEnv() const { return false; }
+    bool thunkCapturesEnv() const { return false; }
+    bool isConstant() const { return true; }
 };
 
 /* Temporary class used during parsing of indented strings. */
@@ -132,6 +169,9 @@ struct ExprPath : Expr
     ExprPath(const string & s) : s(s) { mkPathNoCopy(v, this->s.c_str()); };
     COMMON_METHODS
     Value * maybeThunk(EvalState & state, Env & env);
+    bool capturesEnv() const { return false; }
+    bool thunkCapturesEnv() const { return false; }
+    bool isConstant() const { return true; }
 };
 
 struct ExprVar : Expr
@@ -152,10 +192,36 @@ struct ExprVar : Expr
     unsigned int level;
     unsigned int displ;
 
+    /* For variables from a "with", the position of the attribute in
+       the set in which the previous lookup found it (see
+       EvalState::lookupVar()). */
+    mutable uint32_t withHint = 0;
+
     ExprVar(const Symbol & name) : name(name) { };
     ExprVar(const Pos & pos, const Symbol & name) : pos(pos), name(name) { };
     COMMON_METHODS
     Value * maybeThunk(EvalState & state, Env & env);
+    Expr * compile();
+    bool capturesEnv() const { return false; }
+    bool thunkCapturesEnv() const;
+};
+
+/* A non-"with" variable whose location has been resolved by
+   compile(). Unlike ExprVar, it does not go through
+   EvalState::lookupVar(). */
+struct ExprLocalVar : Expr
+{
+    Pos pos;
+    Symbol name;
+    unsigned int level;
+    unsigned int displ;
+    ExprLocalVar(const ExprVar & var)
+        : pos(var.pos), name(var.name), level(var.level), displ(var.displ) { };
+    void show(std::ostream & str) const;
+    void eval(EvalState & state, Env & env, Value & v);
+    Value * maybeThunk(EvalState & state, Env & env);
+    bool capturesEnv() const { return false; }
+    bool thunkCapturesEnv() const { return false; }
 };
 
 struct ExprSelect : Expr
@@ -166,6 +232,8 @@ struct ExprSelect : Expr
     ExprSelect(const Pos & pos, Expr * e, const AttrPath & attrPath, Expr * def) : pos(pos), e(e), def(def), attrPath(attrPath) { };
     ExprSelect(const Pos & pos, Expr * e, const Symbol & name) : pos(pos), e(e), def(0) { attrPath.push_back(AttrName(name)); };
     COMMON_METHODS
+    Expr * compile();
+    bool capturesEnv() const;
 };
 
 struct ExprOpHasAttr : Expr
@@ -174,6 +242,8 @@ struct ExprOpHasAttr : Expr
     AttrPath attrPath;
     ExprOpHasAttr(Expr * e, const AttrPath & attrPath) : e(e), attrPath(attrPath) { };
     COMMON_METHODS
+    Expr * compile();
+    bool capturesEnv() const;
 };
 
 struct ExprAttrs : Expr
@@ -198,15 +268,33 @@ struct ExprAttrs : Expr
     };
     typedef std::vector<DynamicAttrDef> DynamicAttrDefs;
     DynamicAttrDefs dynamicAttrs;
+    /* Set by bindVars() if this is a non-recursive set of constant
+       attributes. Its value is then built only once, on first use,
+       and kept in `shared'. */
+    bool constant = false;
+    RootValue shared;
     ExprAttrs() : recursive(false) { };
     COMMON_METHODS
+    Value * maybeThunk(EvalState & state, Env & env);
+    Expr * compile();
+    bool capturesEnv() const;
+    bool thunkCapturesEnv() const { return !constant; }
+    bool isConstant() const { return constant; }
 };
 
 struct ExprList : Expr
 {
     std::vector<Expr *> elems;
+    /* As for ExprAttrs, set if all elements are constant. */
+    bool constant = false;
+    RootValue shared;
     ExprList() { };
     COMMON_METHODS
+    Value * maybeThunk(EvalState & state, Env & env);
+    Expr * compile();
+    bool capturesEnv() const;
+    bool thunkCapturesEnv() const { return !constant; }
+    bool isConstant() const { return constant; }
 };
 
 struct Formal
@@ -233,6 +321,11 @@ struct ExprLambda : Expr
     bool matchAttrs;
     Formals * formals;
     Expr * body;
+    /* Whether the environment of a call to this function can be
+       referenced by any value after the call returns. If not, it is
+       allocated on EvalState's environment stack. Set by
+       bindVars(). */
+    bool envEscapes = true;
     ExprLambda(const Pos & pos, const Symbol & arg, bool matchAttrs, Formals * formals, Expr * body)
         : pos(pos), arg(arg), matchAttrs(matchAttrs), formals(formals), body(body)
     {
@@ -244,6 +337,7 @@ struct ExprLambda : Expr
     };
     void setName(Symbol & name);
     string showNamePos() const;
+    Expr * compile();
     COMMON_METHODS
 };
 
@@ -252,7 +346,10 @@ struct ExprLet : Expr
     ExprAttrs * attrs;
     Expr * body;
     ExprLet(ExprAttrs * attrs, Expr * body) : attrs(attrs), body(body) { };
+    /* Create the environment in which the body is evaluated. */
+    Env & bindAttrs(EvalState & state, Env & env);
     COMMON_METHODS
+    Expr * compile();
 };
 
 struct ExprWith : Expr
@@ -262,6 +359,7 @@ struct ExprWith : Expr
     size_t prevWith;
     ExprWith(const Pos & pos, Expr * attrs, Expr * body) : pos(pos), attrs(attrs), body(body) { };
     COMMON_METHODS
+    Expr * compile();
 };
 
 struct ExprIf : Expr
@@ -270,6 +368,8 @@ struct ExprIf : Expr
     Expr * cond, * then, * else_;
     ExprIf(const Pos & pos, Expr * cond, Expr * then, Expr * else_) : pos(pos), cond(cond), then(then), else_(else_) { };
     COMMON_METHODS
+    Expr * compile();
+    bool capturesEnv() const;
 };
 
 struct ExprAssert : Expr
@@ -278,6 +378,8 @@ struct ExprAssert : Expr
     Expr * cond, * body;
     ExprAssert(const Pos & pos, Expr * cond, Expr * body) : pos(pos), cond(cond), body(body) { };
     COMMON_METHODS
+    Expr * compile();
+    bool capturesEnv() const;
 };
 
 struct ExprOpNot : Expr
@@ -285,6 +387,8 @@ struct ExprOpNot : Expr
     Expr * e;
     ExprOpNot(Expr * e) : e(e) { };
     COMMON_METHODS
+    Expr * compile();
+    bool capturesEnv() const;
 };
 
 #define MakeBinOp(name, s) \
@@ -302,6 +406,12 @@ struct ExprOpNot : Expr
         { \
             e1->bindVars(env); e2->bindVars(env); \
         } \
+        Expr * compile() \
+        { \
+            e1 = e1->compile(); e2 = e2->compile(); \
+            return this; \
+        } \
+        bool capturesEnv() const; \
         void eval(EvalState & state, Env & env, Value & v); \
     };
 
@@ -322,6 +432,8 @@ struct ExprConcatStrings : Expr
     ExprConcatStrings(const Pos & pos, bool forceString, vector<Expr *> * es)
         : pos(pos), forceString(forceString), es(es) { };
     COMMON_METHODS
+    Expr * compile();
+    bool capturesEnv() const;
 };
 
 struct ExprPos : Expr
@@ -329,6 +441,7 @@ struct ExprPos : Expr
     Pos pos;
     ExprPos(const Pos & pos) : pos(pos) { };
     COMMON_METHODS
+    bool capturesEnv() const { return false; }
 };
 
 
@@ -0,0 +1,619 @@
+#include "parse-cache.hh"
+#include "serialise.hh"
+#include "globals.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unordered_map>
+
+
+namespace nix {
+
+
+/* Bump this whenever the serialisation format or the meaning of any
+   serialised field changes. */
+static const uint64_t parseCacheVersion = 3;
+
+
+/* Node tags. 'tagNull' and 'tagRef' are followed by nothing and by
+   the index of a previously written node, respectively. */
+enum : uint64_t {
+    tagNull = 0,
+    tagRef,
+    tagInt,
+    tagFloat,
+    tagString,
+    tagPath,
+    tagVar,
+    tagLocalVar,
+    tagSelect,
+    tagOpHasAttr,
+    tagAttrs,
+    tagList,
+    tagLambda,
+    tagLet,
+    tagWith,
+    tagIf,
+    tagAssert,
+    tagOpNot,
+    tagApp,
+    tagOpEq,
+    tagOpNEq,
+    tagOpAnd,
+    tagOpOr,
+    tagOpImpl,
+    tagOpUpdate,
+    tagOpConcatLists,
+    tagConcatStrings,
+    tagPos,
+};
+
+
+struct ExprWriter
+{
+    Sink & sink;
+    std::unordered_map<Symbol, uint64_t> symbols;
+    std::unordered_map<Expr *, uint64_t> exprs;
+
+    ExprWriter(Sink & sink) : sink(sink) { }
+
+    /* Symbols are written as their index in the order of first
+       occurrence; new symbols get the next index and are followed by
+       their string. 0 denotes an unset symbol. */
+    void write(const Symbol & s)
+    {
+        if (!s.set()) { sink << (uint64_t) 0; return; }
+        auto i = symbols.find(s);
+        if (i != symbols.end()) { sink << i->second; return; }
+        auto n = symbols.size() + 1;
+        symbols.emplace(s, n);
+        sink << n << (const string &) s;
+    }
+
+    void write(const Pos & pos)
+    {
+        sink << (uint64_t) pos.origin;
+        write(pos.file);
+        sink << pos.line << pos.column;
+    }
+
+    void write(const AttrPath & attrPath)
+    {
+        sink << attrPath.size();
+        for (auto & i : attrPath) {
+            write(i.symbol);
+            if (!i.symbol.set()) write(i.expr);
+        }
+    }
+
+    template<class T>
+    bool writeBinOp(uint64_t tag, Expr * e)
+    {
+        auto e2 = dynamic_cast<T *>(e);
+        if (!e2) return false;
+        sink << tag;
+        write(e2->pos);
+        write(e2->e1);
+        write(e2->e2);
+        return true;
+    }
+
+    void write(Expr * e)
+    {
+        if (!e) { sink << tagNull; return; }
+
+        auto i = exprs.find(e);
+        if (i != exprs.end()) { sink << tagRef << i->second; return; }
+        exprs.emplace(e, exprs.size());
+
+        if (auto e2 = dynamic_cast<ExprInt *>(e))
+            sink << tagInt << (uint64_t) e2->n;
+
+        else if (auto e2 = dynamic_cast<ExprFloat *>(e)) {
+            uint64_t bits;
+            static_assert(sizeof(bits) == sizeof(e2->nf));
+            memcpy(&bits, &e2->nf, sizeof(bits));
+            sink << tagFloat << bits;
+        }
+
+        else if (auto e2 = dynamic_cast<ExprString *>(e)) {
+            sink << tagString;
+            write(e2->s);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprPath *>(e))
+            sink << tagPath << e2->s;
+
+        else if (auto e2 = dynamic_cast<ExprVar *>(e)) {
+            sink << tagVar;
+            write(e2->pos);
+            write(e2->name);
+            sink << e2->fromWith << e2->level << e2->displ;
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLocalVar *>(e)) {
+            sink << tagLocalVar;
+            write(e2->pos);
+            write(e2->name);
+            sink << e2->level << e2->displ;
+        }
+
+        else if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+            sink << tagSelect;
+            write(e2->pos);
+            write(e2->e);
+            write(e2->attrPath);
+            write(e2->def);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+            sink << tagOpHasAttr;
+            write(e2->e);
+            write(e2->attrPath);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAttrs *>(e)) {
+            sink << tagAttrs << e2->recursive << e2->constant << e2->attrs.size();
+            for (auto & [name, def] : e2->attrs) {
+                write(name);
+                sink << def.inherited;
+                write(def.e);
+                write(def.pos);
+                sink << def.displ;
+            }
+            sink << e2->dynamicAttrs.size();
+            for (auto & def : e2->dynamicAttrs) {
+                write(def.nameExpr);
+                write(def.valueExpr);
+                write(def.pos);
+            }
+        }
+
+        else if (auto e2 = dynamic_cast<ExprList *>(e)) {
+            sink << tagList << e2->constant << e2->elems.size();
+            for (auto & i : e2->elems) write(i);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLambda *>(e)) {
+            sink << tagLambda;
+            write(e2->pos);
+            write(e2->name);
+            write(e2->arg);
+            sink << e2->matchAttrs << e2->envEscapes << (e2->formals != nullptr);
+            if (e2->formals) {
+                sink << e2->formals->ellipsis << e2->formals->formals.size();
+                for (auto & i : e2->formals->formals) {
+                    write(i.pos);
+                    write(i.name);
+                    write(i.def);
+                }
+            }
+            write(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLet *>(e)) {
+            sink << tagLet;
+            write(e2->attrs);
+            write(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprWith *>(e)) {
+            sink << tagWith;
+            write(e2->pos);
+            write(e2->attrs);
+            write(e2->body);
+            sink << e2->prevWith;
+        }
+
+        else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+            sink << tagIf;
+            write(e2->pos);
+            write(e2->cond);
+            write(e2->then);
+            write(e2->else_);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+            sink << tagAssert;
+            write(e2->pos);
+            write(e2->cond);
+            write(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpNot *>(e)) {
+            sink << tagOpNot;
+            write(e2->e);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+            sink << tagConcatStrings;
+            write(e2->pos);
+            sink << e2->forceString << e2->es->size();
+            for (auto & i : *e2->es) write(i);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprPos *>(e)) {
+            sink << tagPos;
+            write(e2->pos);
+        }
+
+        else if (writeBinOp<ExprApp>(tagApp, e)) ;
+        else if (writeBinOp<ExprOpEq>(tagOpEq, e)) ;
+        else if (writeBinOp<ExprOpNEq>(tagOpNEq, e)) ;
+        else if (writeBinOp<ExprOpAnd>(tagOpAnd, e)) ;
+        else if (writeBinOp<ExprOpOr>(tagOpOr, e)) ;
+        else if (writeBinOp<ExprOpImpl>(tagOpImpl, e)) ;
+        else if (writeBinOp<ExprOpUpdate>(tagOpUpdate, e)) ;
+        else if (writeBinOp<ExprOpConcatLists>(tagOpConcatLists, e)) ;
+
+        else
+            throw Error("cannot serialise expression '%s'", *e);
+    }
+};
+
+
+void writeExpr(Sink & sink, Expr * e)
+{
+    ExprWriter(sink).write(e);
+}
+
+
+struct ExprReader
+{
+    Source & source;
+    SymbolTable & symbolTable;
+    std::vector<Symbol> symbols;
+    std::vector<Expr *> exprs;
+
+    ExprReader(Source & source, SymbolTable & symbolTable)
+        : source(source), symbolTable(symbolTable) { }
+
+    uint64_t num()
+    {
+        return readNum<uint64_t>(source);
+    }
+
+    unsigned int uint()
+    {
+        return readNum<unsigned int>(source);
+    }
+
+    bool boolean()
+    {
+        return readNum<uint64_t>(source) != 0;
+    }
+
+    Symbol symbol()
+    {
+        auto n = num();
+        if (n == 0) return Symbol();
+        if (n <= symbols.size()) return symbols[n - 1];
+        if (n != symbols.size() + 1)
+            throw Error("invalid symbol reference in serialised expression");
+        symbols.push_back(symbolTable.create(readString(source)));
+        return symbols.back();
+    }
+
+    Pos pos()
+    {
+        auto origin = (FileOrigin) num();
+        auto file = symbol();
+        auto line = uint();
+        auto column = uint();
+        return Pos(origin, file, line, column);
+    }
+
+    AttrPath attrPath()
+    {
+        AttrPath res;
+        auto n = num();
+        for (uint64_t i = 0; i < n; ++i) {
+            auto s = symbol();
+            if (s.set())
+                res.push_back(AttrName(s));
+            else
+                res.push_back(AttrName(expr()));
+        }
+        return res;
+    }
+
+    template<class T>
+    T * binOp()
+    {
+        auto p = pos();
+        auto e1 = expr();
+        auto e2 = expr();
+        return new T(p, e1, e2);
+    }
+
+    /* Read an expression whose type has been checked by the caller. */
+    template<class T>
+    T * expr()
+    {
+        auto e = dynamic_cast<T *>(expr());
+        if (!e) throw Error("unexpected node type in serialised expression");
+        return e;
+    }
+
+    Expr * expr()
+    {
+        auto tag = num();
+
+        if (tag == tagNull) return nullptr;
+
+        if (tag == tagRef) {
+            auto n = num();
+            if (n >= exprs.size() || !exprs[n])
+                throw Error("invalid node reference in serialised expression");
+            return exprs[n];
+        }
+
+        /* Reserve the index of this node before reading its children,
+           which get higher indices. */
+        auto index = exprs.size();
+        exprs.push_back(nullptr);
+
+        Expr * res;
+
+        switch (tag) {
+
+        case tagInt:
+            res = new ExprInt((NixInt) num());
+            break;
+
+        case tagFloat: {
+            auto bits = num();
+            NixFloat nf;
+            memcpy(&nf, &bits, sizeof(nf));
+            res = new ExprFloat(nf);
+            break;
+        }
+
+        case tagString:
+            res = new ExprString(symbol());
+            break;
+
+        case tagPath:
+            res = new ExprPath(readString(source));
+            break;
+
+        case tagVar: {
+            auto p = pos();
+            auto e = new ExprVar(p, symbol());
+            e->fromWith = boolean();
+            e->level = uint();
+            e->displ = uint();
+            res = e;
+            break;
+        }
+
+        case tagLocalVar: {
+            ExprVar var(pos(), symbol());
+            var.fromWith = false;
+            var.level = uint();
+            var.displ = uint();
+            res = new ExprLocalVar(var);
+            break;
+        }
+
+        case tagSelect: {
+            auto p = pos();
+            auto e = expr();
+            auto path = attrPath();
+            res = new ExprSelect(p, e, path, expr());
+            break;
+        }
+
+        case tagOpHasAttr: {
+            auto e = expr();
+            res = new ExprOpHasAttr(e, attrPath());
+            break;
+        }
+
+        case tagAttrs: {
+            auto e = new ExprAttrs;
+            e->recursive = boolean();
+            e->constant = boolean();
+            auto n = num();
+            for (uint64_t i = 0; i < n; ++i) {
+                auto name = symbol();
+                auto & def = e->attrs[name];
+                def.inherited = boolean();
+                def.e = expr();
+                def.pos = pos();
+                def.displ = uint();
+            }
+            n = num();
+            for (uint64_t i = 0; i < n; ++i) {
+                auto nameExpr = expr();
+                auto valueExpr = expr();
+                e->dynamicAttrs.emplace_back(nameExpr, valueExpr, pos());
+            }
+            res = e;
+            break;
+        }
+
+        case tagList: {
+            auto e = new ExprList;
+            e->constant = boolean();
+            auto n = num();
+            for (uint64_t i = 0; i < n; ++i)
+                e->elems.push_back(expr());
+            res = e;
+            break;
+        }
+
+        case tagLambda: {
+            auto p = pos();
+            auto name = symbol();
+            auto arg = symbol();
+            auto matchAttrs = boolean();
+            auto envEscapes = boolean();
+            Formals * formals = nullptr;
+            if (boolean()) {
+                formals = new Formals;
+                formals->ellipsis = boolean();
+                auto n = num();
+                for (uint64_t i = 0; i < n; ++i) {
+                    auto fp = pos();
+                    auto fname = symbol();
+                    formals->formals.emplace_back(fp, fname, expr());
+                    formals->argNames.insert(fname);
+                }
+            }
+            auto e = new ExprLambda(p, arg, matchAttrs, formals, expr());
+            e->name = name;
+            e->envEscapes = envEscapes;
+            res = e;
+            break;
+        }
+
+        case tagLet: {
+            auto attrs = expr<ExprAttrs>();
+            res = new ExprLet(attrs, expr());
+            break;
+        }
+
+        case tagWith: {
+            auto p = pos();
+            auto attrs = expr();
+            auto e = new ExprWith(p, attrs, expr());
+            e->prevWith = num();
+            res = e;
+            break;
+        }
+
+        case tagIf: {
+            auto p = pos();
+            auto cond = expr();
+            auto then = expr();
+            res = new ExprIf(p, cond, then, expr());
+            break;
+        }
+
+        case tagAssert: {
+            auto p = pos();
+            auto cond = expr();
+            res = new ExprAssert(p, cond, expr());
+            break;
+        }
+
+        case tagOpNot:
+            res = new ExprOpNot(expr());
+            break;
+
+        case tagApp: res = binOp<ExprApp>(); break;
+        case tagOpEq: res = binOp<ExprOpEq>(); break;
+        case tagOpNEq: res = binOp<ExprOpNEq>(); break;
+        case tagOpAnd: res = binOp<ExprOpAnd>(); break;
+        case tagOpOr: res = binOp<ExprOpOr>(); break;
+        case tagOpImpl: res = binOp<ExprOpImpl>(); break;
+        case tagOpUpdate: res = binOp<ExprOpUpdate>(); break;
+        case tagOpConcatLists: res = binOp<ExprOpConcatLists>(); break;
+
+        case tagConcatStrings: {
+            auto p = pos();
+            auto forceString = boolean();
+            auto es = new vector<Expr *>;
+            auto n = num();
+            for (uint64_t i = 0; i < n; ++i)
+                es->push_back(expr());
+            res = new ExprConcatStrings(p, forceString, es);
+            break;
+        }
+
+        case tagPos:
+            res = new ExprPos(pos());
+            break;
+
+        default:
+            throw Error("invalid node type %d in serialised expression", tag);
+        }
+
+        exprs[index] = res;
+        return res;
+    }
+};
+
+
+Expr * readExpr(Source & source, SymbolTable & symbols)
+{
+    return ExprReader(source, symbols).expr();
+}
+
+
+Hash parseCacheKey(const Path & path, std::string_view contents,
+    const StaticEnv & staticEnv, bool compiled)
+{
+    HashSink sink(htSHA256);
+    sink << parseCacheVersion << nixVersion << path << compiled;
+
+    /* The displacements computed by bindVars() depend on the
+       variables in scope. `vars' is ordered by the symbols' addresses,
+       which differ between runs, so sort them by name. */
+    for (auto env = &staticEnv; env; env = env->up) {
+        sink << env->isWith << env->vars.size();
+        std::vector<std::pair<string, unsigned int>> vars;
+        for (auto & [name, displ] : env->vars)
+            vars.emplace_back((const string &) name, displ);
+        std::sort(vars.begin(), vars.end());
+        for (auto & [name, displ] : vars)
+            sink << name << displ;
+    }
+
+    sink << contents.size();
+    sink((const unsigned char *) contents.data(), contents.size());
+
+    return sink.finish().first;
+}
+
+
+static Path parseCachePath(const Hash & key)
+{
+    return getCacheDir() + "/nix/parse-cache-v1/" + key.to_string(Base32, false);
+}
+
+
+Expr * lookupParseCache(SymbolTable & symbols, const Hash & key)
+{
+    auto path = parseCachePath(key);
+
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) return nullptr;
+
+    try {
+        auto data = readFile(fd.get());
+        StringSource source(data);
+        auto e = readExpr(source, symbols);
+        if (source.pos != data.size())
+            throw Error("trailing garbage");
+        debug("using parse cache entry '%s'", path);
+        return e;
+    } catch (Error & e) {
+        debug("ignoring invalid parse cache entry '%s': %s", path, e.msg());
+        return nullptr;
+    }
+}
+
+
+void addToParseCache(const Hash & key, Expr * e)
+{
+    auto path = parseCachePath(key);
+
+    try {
+        StringSink sink;
+        writeExpr(sink, e);
+        createDirs(dirOf(path));
+        auto tmp = fmt("%s.tmp-%d", path, getpid());
+        writeFile(tmp, *sink.s);
+        if (rename(tmp.c_str(), path.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, path);
+    } catch (Error & e) {
+        debug("cannot write parse cache entry '%s': %s", path, e.msg());
+    }
+}
+
+
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "nixexpr.hh"
+#include "hash.hh"
+
+namespace nix {
+
+/* Serialise an expression tree, including the variable displacements
+   computed by bindVars(). Subexpressions that are shared between
+   several parents are written only once. */
+void writeExpr(Sink & sink, Expr * e);
+
+/* Read an expression tree written by writeExpr(), interning its
+   symbols in 'symbols'. */
+Expr * readExpr(Source & source, SymbolTable & symbols);
+
+/* Return the key under which the result of parsing 'contents' (read
+   from 'path') in 'staticEnv' is stored in the parse cache. */
+Hash parseCacheKey(const Path & path, std::string_view contents,
+    const StaticEnv & staticEnv, bool compiled);
+
+/* Return the cached expression for 'key', or nullptr if there is no
+   usable cache entry. */
+Expr * lookupParseCache(SymbolTable & symbols, const Hash & key);
+
+void addToParseCache(const Hash & key, Expr * e);
+
+}
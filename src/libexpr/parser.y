@@ -24,6 +24,16 @@
 
 namespace nix {
 
+    /* An identifier token. It points into the lexer's input buffer,
+       which lives until the end of the parse, so it doesn't need to
+       be copied before it's turned into a symbol. */
+    struct StringToken
+    {
+        const char * p;
+        size_t l;
+        operator std::string_view() const { return {p, l}; }
+    };
+
     struct ParseData
     {
         EvalState & state;
@@ -275,7 +285,7 @@ void yyerror(YYLTYPE * loc, yyscan_t scanner, ParseData * data, const char * err
   nix::Formal * formal;
   nix::NixInt n;
   nix::NixFloat nf;
-  const char * id; // !!! -> Symbol
+  nix::StringToken id;
   char * path;
   char * uri;
   std::vector<nix::AttrName> * attrNames;
@@ -394,7 +404,7 @@ expr_select
 
 expr_simple
   : ID {
-      if (strcmp($1, "__curPos") == 0)
+      if (std::string_view($1) == "__curPos")
           $$ = new ExprPos(CUR_POS);
       else
           $$ = new ExprVar(CUR_POS, data->symbols.create($1));
@@ -523,7 +533,7 @@ attrpath
 
 attr
   : ID { $$ = $1; }
-  | OR_KW { $$ = "or"; }
+  | OR_KW { $$ = {"or", 2}; }
   ;
 
 string_attr
@@ -561,6 +571,7 @@ formal
 #include <unistd.h>
 
 #include "eval.hh"
+#include "parse-cache.hh"
 #include "filetransfer.hh"
 #include "fetchers.hh"
 #include "store-api.hh"
@@ -569,7 +580,7 @@ formal
 namespace nix {
 
 
-Expr * EvalState::parse(const char * text, FileOrigin origin,
+Expr * EvalState::parse(char * text, size_t length, FileOrigin origin,
     const Path & path, const Path & basePath, StaticEnv & staticEnv)
 {
     yyscan_t scanner;
@@ -581,15 +592,17 @@ Expr * EvalState::parse(const char * text, FileOrigin origin,
             break;
         case foStdin:
         case foString:
-            data.file = data.symbols.create(text);
+            data.file = data.symbols.create(std::string_view(text, length));
             break;
         default:
             assert(false);
     }
     data.basePath = basePath;
 
+    assert(!text[length] && !text[length + 1]);
+
     yylex_init(&scanner);
-    yy_scan_string(text, scanner);
+    yy_scan_buffer(text, length + 2, scanner);
     int res = yyparse(scanner, &data);
     yylex_destroy(scanner);
 
@@ -597,6 +610,9 @@ Expr * EvalState::parse(const char * text, FileOrigin origin,
 
     data.result->bindVars(staticEnv);
 
+    if (evalSettings.compileExpressions)
+        data.result = data.result->compile();
+
     return data.result;
 }
 
@@ -634,15 +650,54 @@ Expr * EvalState::parseExprFromFile(const Path & path)
 }
 
 
+/* Read a source file into a buffer followed by the two NUL bytes that
+   the lexer needs, so that it can be scanned without copying it
+   again. */
+static std::string readSource(const Path & path)
+{
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd)
+        throw SysError("opening file '%1%'", path);
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw SysError("statting file '%1%'", path);
+
+    if (S_ISREG(st.st_mode)) {
+        std::string text(st.st_size + 2, '\0');
+        readFull(fd.get(), (unsigned char *) text.data(), st.st_size);
+        return text;
+    }
+
+    auto text = drainFD(fd.get());
+    text.append(2, '\0');
+    return text;
+}
+
+
 Expr * EvalState::parseExprFromFile(const Path & path, StaticEnv & staticEnv)
 {
-    return parse(readFile(path).c_str(), foFile, path, dirOf(path), staticEnv);
+    auto text = readSource(path);
+    auto length = text.size() - 2;
+
+    if (!evalSettings.useParseCache)
+        return parse(text.data(), length, foFile, path, dirOf(path), staticEnv);
+
+    auto key = parseCacheKey(path, std::string_view(text.data(), length), staticEnv, evalSettings.compileExpressions);
+    if (auto e = lookupParseCache(symbols, key))
+        return e;
+
+    auto e = parse(text.data(), length, foFile, path, dirOf(path), staticEnv);
+    addToParseCache(key, e);
+    return e;
 }
 
 
 Expr * EvalState::parseExprFromString(std::string_view s, const Path & basePath, StaticEnv & staticEnv)
 {
-    return parse(s.data(), foString, "", basePath, staticEnv);
+    std::string text(s);
+    text.append(2, '\0');
+    return parse(text.data(), s.size(), foString, "", basePath, staticEnv);
 }
 
 
@@ -655,7 +710,10 @@ Expr * EvalState::parseExprFromString(std::string_view s, const Path & basePath)
 Expr * EvalState::parseStdin()
 {
     //Activity act(*logger, lvlTalkative, format("parsing standard input"));
-    return parse(drainFD(0).data(), foStdin, "", absPath("."), staticBaseEnv);
+    auto text = drainFD(0);
+    auto length = text.size();
+    text.append(2, '\0');
+    return parse(text.data(), length, foStdin, "", absPath("."), staticBaseEnv);
 }
 
 
@@ -2,6 +2,7 @@
 #include "derivations.hh"
 #include "eval-inline.hh"
 #include "eval.hh"
+#include "finally.hh"
 #include "globals.hh"
 #include "json-to-value.hh"
 #include "names.hh"
@@ -19,6 +20,7 @@
 #include <algorithm>
 #include <cstring>
 #include <regex>
+#include <unordered_set>
 #include <dlfcn.h>
 
 
@@ -80,10 +82,67 @@ void EvalState::realiseContext(const PathSet & context)
     unsigned long long downloadSize, narSize;
     store->queryMissing(drvs, willBuild, willSubstitute, unknown, downloadSize, narSize);
 
+    /* Let forEachBatchingIFD() build these together with those needed
+       by sibling values. */
+    if (ifdBatchDepth && (!willBuild.empty() || !willSubstitute.empty())) {
+        pendingIFD.insert(pendingIFD.end(), drvs.begin(), drvs.end());
+        throw ImportFromDerivationPending();
+    }
+
     store->buildPaths(drvs);
 }
 
 
+void EvalState::forEachBatchingIFD(size_t n, std::function<void(size_t)> f)
+{
+    if (!evalSettings.batchImportFromDerivation) {
+        for (size_t i = 0; i < n; ++i)
+            f(i);
+        return;
+    }
+
+    std::vector<size_t> todo(n);
+    for (size_t i = 0; i < n; ++i)
+        todo[i] = i;
+
+    while (!todo.empty()) {
+        std::vector<size_t> deferred;
+
+        {
+            ifdBatchDepth++;
+            Finally finally([&]() { ifdBatchDepth--; });
+
+            for (auto i : todo)
+                try {
+                    f(i);
+                } catch (ImportFromDerivationPending &) {
+                    deferred.push_back(i);
+                }
+        }
+
+        if (deferred.empty()) break;
+
+        /* If we're nested in another forEachBatchingIFD(), let it do
+           the builds, so that they include those of our parent's
+           siblings. */
+        if (ifdBatchDepth) throw ImportFromDerivationPending();
+
+        auto drvs = std::move(pendingIFD);
+        pendingIFD.clear();
+
+        debug("building %d derivations needed by %d values", drvs.size(), deferred.size());
+
+        StorePathSet willBuild, willSubstitute, unknown;
+        unsigned long long downloadSize, narSize;
+        store->queryMissing(drvs, willBuild, willSubstitute, unknown, downloadSize, narSize);
+
+        store->buildPaths(drvs);
+
+        todo = std::move(deferred);
+    }
+}
+
+
 /* Load and evaluate an expression from path specified by the
    argument. */
 static void prim_scopedImport(EvalState & state, const Pos & pos, Value * * args, Value & v)
@@ -256,14 +315,14 @@ static void prim_typeOf(EvalState & state, const Pos & pos, Value * * args, Valu
 {
     state.forceValue(*args[0], pos);
     string t;
-    switch (args[0]->type) {
+    switch (args[0]->type()) {
         case tInt: t = "int"; break;
         case tBool: t = "bool"; break;
         case tString: t = "string"; break;
         case tPath: t = "path"; break;
         case tNull: t = "null"; break;
         case tAttrs: t = "set"; break;
-        case tList1: case tList2: case tListN: t = "list"; break;
+        case tList1: case tListN: t = "list"; break;
         case tLambda:
         case tPrimOp:
         case tPrimOpApp:
@@ -283,7 +342,7 @@ static void prim_typeOf(EvalState & state, const Pos & pos, Value * * args, Valu
 static void prim_isNull(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tNull);
+    mkBool(v, args[0]->type() == tNull);
 }
 
 
@@ -292,7 +351,7 @@ static void prim_isFunction(EvalState & state, const Pos & pos, Value * * args,
 {
     state.forceValue(*args[0], pos);
     bool res;
-    switch (args[0]->type) {
+    switch (args[0]->type()) {
         case tLambda:
         case tPrimOp:
         case tPrimOpApp:
@@ -310,21 +369,21 @@ static void prim_isFunction(EvalState & state, const Pos & pos, Value * * args,
 static void prim_isInt(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tInt);
+    mkBool(v, args[0]->type() == tInt);
 }
 
 /* Determine whether the argument is a float. */
 static void prim_isFloat(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tFloat);
+    mkBool(v, args[0]->type() == tFloat);
 }
 
 /* Determine whether the argument is a string. */
 static void prim_isString(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tString);
+    mkBool(v, args[0]->type() == tString);
 }
 
 
@@ -332,27 +391,27 @@ static void prim_isString(EvalState & state, const Pos & pos, Value * * args, Va
 static void prim_isBool(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tBool);
+    mkBool(v, args[0]->type() == tBool);
 }
 
 /* Determine whether the argument is a path. */
 static void prim_isPath(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tPath);
+    mkBool(v, args[0]->type() == tPath);
 }
 
 struct CompareValues
 {
     bool operator () (const Value * v1, const Value * v2) const
     {
-        if (v1->type == tFloat && v2->type == tInt)
+        if (v1->type() == tFloat && v2->type() == tInt)
             return v1->fpoint < v2->integer;
-        if (v1->type == tInt && v2->type == tFloat)
+        if (v1->type() == tInt && v2->type() == tFloat)
             return v1->integer < v2->fpoint;
-        if (v1->type != v2->type)
+        if (v1->type() != v2->type())
             throw EvalError("cannot compare %1% with %2%", showType(*v1), showType(*v2));
-        switch (v1->type) {
+        switch (v1->type()) {
             case tInt:
                 return v1->integer < v2->integer;
             case tFloat:
@@ -368,6 +427,44 @@ struct CompareValues
 };
 
 
+/* A hash that is consistent with the equivalence induced by
+   CompareValues: numbers are hashed by their value as a float, since
+   an integer and a float compare equal if the integer converts to the
+   float. */
+struct HashValue
+{
+    size_t operator () (const Value * v) const
+    {
+        switch (v->type()) {
+            case tInt:
+                return hashNumber(v->integer);
+            case tFloat:
+                return hashNumber(v->fpoint);
+            case tString:
+                return std::hash<std::string_view>()(v->string.s);
+            case tPath:
+                return std::hash<std::string_view>()(v->path);
+            default:
+                return 0;
+        }
+    }
+
+    static size_t hashNumber(NixFloat f)
+    {
+        return std::hash<NixFloat>()(f == 0 ? 0 : f);
+    }
+};
+
+struct EqualValues
+{
+    bool operator () (const Value * v1, const Value * v2) const
+    {
+        CompareValues comp;
+        return !comp(v1, v2) && !comp(v2, v1);
+    }
+};
+
+
 #if HAVE_BOEHMGC
 typedef list<Value *, gc_allocator<Value *> > ValueList;
 #else
@@ -409,7 +506,11 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
     ValueList res;
     // `doneKeys' doesn't need to be a GC root, because its values are
     // reachable from res.
-    set<Value *, CompareValues> doneKeys;
+    std::unordered_set<Value *, HashValue, EqualValues> doneKeys;
+
+    /* Keys are checked for comparability against the first one, which
+       is what a comparison-based set would have done on insertion. */
+    Value * firstKey = nullptr;
     while (!workSet.empty()) {
         Value * e = *(workSet.begin());
         workSet.pop_front();
@@ -425,6 +526,11 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
             });
         state.forceValue(*key->value, pos);
 
+        if (!firstKey)
+            firstKey = key->value;
+        else
+            CompareValues()(key->value, firstKey);
+
         if (!doneKeys.insert(key->value).second) continue;
         res.push_back(e);
 
@@ -460,6 +566,7 @@ static void prim_throw(EvalState & state, const Pos & pos, Value * * args, Value
 {
     PathSet context;
     string s = state.coerceToString(pos, *args[0], context);
+    if (state.tryEvalDepth) throw ThrownError({ .level = lvlError });
     throw ThrownError(s);
 }
 
@@ -471,7 +578,9 @@ static void prim_addErrorContext(EvalState & state, const Pos & pos, Value * * a
         v = *args[1];
     } catch (Error & e) {
         PathSet context;
-        e.addTrace(std::nullopt, state.coerceToString(pos, *args[0], context));
+        auto s = state.coerceToString(pos, *args[0], context);
+        if (!state.discardsError(e))
+            e.addTrace(std::nullopt, s);
         throw;
     }
 }
@@ -483,6 +592,8 @@ static void prim_tryEval(EvalState & state, const Pos & pos, Value * * args, Val
 {
     state.mkAttrs(v, 2);
     try {
+        state.tryEvalDepth++;
+        Finally finally([&]() { state.tryEvalDepth--; });
         state.forceValue(*args[0], pos);
         v.attrs->push_back(Attr(state.sValue, args[0]));
         mkBool(*state.allocAttr(v, state.symbols.create("success")), true);
@@ -526,7 +637,7 @@ static void prim_deepSeq(EvalState & state, const Pos & pos, Value * * args, Val
 static void prim_trace(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    if (args[0]->type == tString)
+    if (args[0]->type() == tString)
         printError("trace: %1%", args[0]->string.s);
     else
         printError("trace: %1%", *args[0]);
@@ -638,7 +749,7 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
 
             if (ignoreNulls) {
                 state.forceValue(*i->value, pos);
-                if (i->value->type == tNull) continue;
+                if (i->value->type() == tNull) continue;
             }
 
             /* The `args' attribute is special: it supplies the
@@ -696,9 +807,10 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
             }
 
         } catch (Error & e) {
-            e.addTrace(posDrvName, 
-                "while evaluating the attribute '%1%' of the derivation '%2%'",
-                key, drvName);
+            if (!state.discardsError(e))
+                e.addTrace(posDrvName, 
+                    "while evaluating the attribute '%1%' of the derivation '%2%'",
+                    key, drvName);
             throw;
         }
     }
@@ -822,8 +934,10 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
     /* Optimisation, but required in read-only mode! because in that
        case we don't actually write store derivations, so we can't
        read them later. */
-    drvHashes.insert_or_assign(drvPath,
-        hashDerivationModulo(*state.store, Derivation(drv), false));
+    auto drvHash = hashDerivationModulo(*state.store, Derivation(drv), false);
+    drvHashes.insert_or_assign(drvPath, drvHash);
+    if (!settings.readOnlyMode)
+        state.store->registerDrvHashModulo(drvPath, drvHash);
 
     state.mkAttrs(v, 1 + drv.outputs.size());
     mkString(*state.allocAttr(v, state.sDrvPath), drvPathS, {"=" + drvPathS});
@@ -835,6 +949,125 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
 }
 
 
+/* A wrapper around derivationStrict that computes the `drvPath' and
+   `outPath' attributes lazily. It returns, for the first output, the
+   argument set extended with an attribute for each output, `all'
+   (the list of outputs), `drvAttrs' (the argument set), `outPath',
+   `drvPath', `type' and `outputName'. This is equivalent to
+
+     drvAttrs @ { outputs ? [ "out" ], ... }:
+     let
+       strict = derivationStrict drvAttrs;
+       commonAttrs = drvAttrs // (builtins.listToAttrs outputsList) //
+         { all = map (x: x.value) outputsList; inherit drvAttrs; };
+       outputToAttrListElement = outputName:
+         { name = outputName;
+           value = commonAttrs // {
+             outPath = builtins.getAttr outputName strict;
+             drvPath = strict.drvPath;
+             type = "derivation";
+             inherit outputName;
+           };
+         };
+       outputsList = map outputToAttrListElement outputs;
+     in (builtins.head outputsList).value
+
+   but builds each output's set directly rather than through a chain
+   of intermediate sets. */
+static void prim_derivation(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.forceAttrs(*args[0], pos);
+    Bindings & drvAttrs(*args[0]->attrs);
+
+    std::vector<Symbol> outputs;
+    auto i = drvAttrs.find(state.sOutputs);
+    if (i == drvAttrs.end())
+        outputs.push_back(state.sOut);
+    else {
+        state.forceList(*i->value, pos);
+        for (unsigned int n = 0; n < i->value->listSize(); ++n)
+            outputs.push_back(state.symbols.create(
+                state.forceStringNoCtx(*i->value->listElems()[n], pos)));
+    }
+
+    if (outputs.empty())
+        throw Error({
+            .hint = hintfmt("list index %1% is out of bounds", 0),
+            .errPos = pos
+        });
+
+    auto vStrict = state.allocValue();
+    mkApp(*vStrict, *state.vDerivationStrict, *args[0]);
+
+    /* Return a thunk for `builtins.getAttr name strict'. */
+    auto selectStrict = [&](const Symbol & name) {
+        auto vName = state.allocValue();
+        mkString(*vName, name);
+        auto vFun = state.allocValue();
+        mkApp(*vFun, *state.vGetAttr, *vName);
+        auto vRes = state.allocValue();
+        mkApp(*vRes, *vFun, *vStrict);
+        return vRes;
+    };
+
+    auto vDrvPath = selectStrict(state.sDrvPath);
+
+    auto vType = state.allocValue();
+    mkString(*vType, "derivation");
+
+    auto vAll = state.allocValue();
+    state.mkList(*vAll, outputs.size());
+    for (size_t n = 0; n < outputs.size(); ++n)
+        vAll->listElems()[n] = state.allocValue();
+
+    /* Compute the attributes shared by all outputs, with the
+       precedence of the `//' operators above. For duplicate output
+       names, the first one wins, like in listToAttrs. */
+    std::set<Symbol> seen{state.sOutPath, state.sDrvPath, state.sType, state.sOutputName};
+    std::vector<Attr> common;
+    common.reserve(drvAttrs.size() + outputs.size() + 2);
+    for (auto & [name, value] : std::initializer_list<std::pair<Symbol, Value *>>{
+            {state.sAll, vAll}, {state.sDrvAttrs, args[0]}})
+        if (seen.insert(name).second)
+            common.push_back(Attr(name, value, &state.derivationPos));
+    for (size_t n = 0; n < outputs.size(); ++n)
+        if (seen.insert(outputs[n]).second)
+            common.push_back(Attr(outputs[n], vAll->listElems()[n], &state.derivationPos));
+    for (auto & j : drvAttrs)
+        if (!seen.count(j.name))
+            common.push_back(j);
+    std::sort(common.begin(), common.end());
+
+    for (size_t n = 0; n < outputs.size(); ++n) {
+        auto vOutputName = state.allocValue();
+        mkString(*vOutputName, outputs[n]);
+
+        Attr extra[] = {
+            Attr(state.sOutPath, selectStrict(outputs[n]), &state.derivationPos),
+            Attr(state.sDrvPath, vDrvPath, &state.derivationPos),
+            Attr(state.sType, vType, &state.derivationPos),
+            Attr(state.sOutputName, vOutputName, &state.derivationPos),
+        };
+        std::sort(std::begin(extra), std::end(extra));
+
+        /* Merge the (sorted) common and output-specific attributes,
+           so that the result doesn't need sorting. */
+        Value & vOut(*vAll->listElems()[n]);
+        state.mkAttrs(vOut, common.size() + std::size(extra));
+        auto j = common.begin();
+        for (auto & k : extra) {
+            for (; j != common.end() && *j < k; ++j)
+                vOut.attrs->push_back(*j);
+            vOut.attrs->push_back(k);
+        }
+        for (; j != common.end(); ++j)
+            vOut.attrs->push_back(*j);
+    }
+
+    v = *vAll->listElems()[0];
+}
+
+
 /* Return a placeholder string for the specified output that will be
    substituted by the corresponding output path at build time. For
    example, 'placeholder "out"' returns the string
@@ -907,7 +1140,7 @@ static void prim_pathExists(EvalState & state, const Pos & pos, Value * * args,
     }
 
     try {
-        mkBool(v, pathExists(state.checkSourcePath(path)));
+        mkBool(v, state.pathExistsCached(state.checkSourcePath(path)));
     } catch (SysError & e) {
         /* Don't give away info from errors while canonicalising
            ‘path’ in restricted mode. */
@@ -934,7 +1167,7 @@ static void prim_dirOf(EvalState & state, const Pos & pos, Value * * args, Value
 {
     PathSet context;
     Path dir = dirOf(state.coerceToString(pos, *args[0], context, false, false));
-    if (args[0]->type == tPath) mkPath(v, dir.c_str()); else mkString(v, dir, context);
+    if (args[0]->type() == tPath) mkPath(v, dir.c_str()); else mkString(v, dir, context);
 }
 
 
@@ -1016,7 +1249,7 @@ static void prim_hashFile(EvalState & state, const Pos & pos, Value * * args, Va
     PathSet context; // discarded
     Path p = state.coerceToPath(pos, *args[1], context);
 
-    mkString(v, hashFile(*ht, state.checkSourcePath(p)).to_string(Base16, false), context);
+    mkString(v, state.hashFileCached(*ht, state.checkSourcePath(p)).to_string(Base16, false), context);
 }
 
 /* Read a directory (without . or ..) */
@@ -1033,13 +1266,11 @@ static void prim_readDir(EvalState & state, const Pos & pos, Value * * args, Val
         });
     }
 
-    DirEntries entries = readDirectory(state.checkSourcePath(path));
+    auto & entries = state.readDirectoryCached(state.checkSourcePath(path));
     state.mkAttrs(v, entries.size());
 
     for (auto & ent : entries) {
         Value * ent_val = state.allocAttr(v, state.symbols.create(ent.name));
-        if (ent.type == DT_UNKNOWN)
-            ent.type = getFileType(path + "/" + ent.name);
         mkStringNoCopy(*ent_val,
             ent.type == DT_REG ? "regular" :
             ent.type == DT_DIR ? "directory" :
@@ -1083,8 +1314,13 @@ static void prim_toJSON(EvalState & state, const Pos & pos, Value * * args, Valu
 /* Parse a JSON string to a value. */
 static void prim_fromJSON(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
-    string s = state.forceStringNoCtx(*args[0], pos);
-    parseJSON(state, s, v);
+    /* Parse the string in place rather than copying it, since it
+       can be large (e.g. the result of readFile). forceStringNoCtx()
+       returns a copy, so only use it to report errors. */
+    state.forceValue(*args[0], pos);
+    if (args[0]->type() != tString || args[0]->stringContext())
+        state.forceStringNoCtx(*args[0], pos);
+    parseJSON(state, args[0]->string.s, v);
 }
 
 
@@ -1157,9 +1393,8 @@ static void addPath(EvalState & state, const Pos & pos, const string & name, con
         expectedStorePath = state.store->makeFixedOutputPath(method, expectedHash, name);
     Path dstPath;
     if (!expectedHash || !state.store->isValidPath(*expectedStorePath)) {
-        dstPath = state.store->printStorePath(settings.readOnlyMode
-            ? state.store->computeStorePathForPath(name, path, method, htSHA256, filter).first
-            : state.store->addToStore(name, path, method, htSHA256, filter, state.repair));
+        dstPath = state.store->printStorePath(
+            state.addSourceToStore(name, path, method, filter, filterFun));
         if (expectedHash && expectedStorePath != state.store->parseStorePath(dstPath))
             throw Error("store path mismatch in (possibly filtered) path added from '%s'", path);
     } else
@@ -1180,7 +1415,7 @@ static void prim_filterSource(EvalState & state, const Pos & pos, Value * * args
         });
 
     state.forceValue(*args[0], pos);
-    if (args[0]->type != tLambda)
+    if (args[0]->type() != tLambda)
         throw TypeError({
             .hint = hintfmt(
                 "first argument in call to 'filterSource' is not a function but %1%",
@@ -1272,7 +1507,9 @@ static void prim_attrValues(EvalState & state, const Pos & pos, Value * * args,
         v.listElems()[n++] = (Value *) &i;
 
     std::sort(v.listElems(), v.listElems() + n,
-        [](Value * v1, Value * v2) { return (string) ((Attr *) v1)->name < (string) ((Attr *) v2)->name; });
+        [](Value * v1, Value * v2) {
+            return (const string &) ((Attr *) v1)->name < (const string &) ((Attr *) v2)->name;
+        });
 
     for (unsigned int i = 0; i < n; ++i)
         v.listElems()[i] = ((Attr *) v.listElems()[i])->value;
@@ -1324,7 +1561,23 @@ static void prim_hasAttr(EvalState & state, const Pos & pos, Value * * args, Val
 static void prim_isAttrs(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    mkBool(v, args[0]->type == tAttrs);
+    mkBool(v, args[0]->type() == tAttrs);
+}
+
+
+/* Return the first attribute in the sorted range [first, last) whose
+   name is not less than 'name', like std::lower_bound, but by
+   galloping from 'first': the cost is logarithmic in the distance to
+   the result rather than in the length of the range. Walking a set
+   with successive calls is thus a linear merge when the names being
+   looked up are dense in the set, and still cheap when they are
+   sparse. */
+static Bindings::iterator gallop(Bindings::iterator first, Bindings::iterator last, const Symbol & name)
+{
+    Attr key(name, 0);
+    size_t n = last - first, bound = 1;
+    while (bound < n && first[bound] < key) bound *= 2;
+    return std::lower_bound(first + bound / 2, first + std::min(bound + 1, n), key);
 }
 
 
@@ -1333,21 +1586,38 @@ static void prim_removeAttrs(EvalState & state, const Pos & pos, Value * * args,
     state.forceAttrs(*args[0], pos);
     state.forceList(*args[1], pos);
 
-    /* Get the attribute names to be removed. */
-    std::set<Symbol> names;
+    /* Get the attribute names to be removed, in the order of the
+       set. */
+    std::vector<Symbol> names;
+    names.reserve(args[1]->listSize());
     for (unsigned int i = 0; i < args[1]->listSize(); ++i) {
         state.forceStringNoCtx(*args[1]->listElems()[i], pos);
-        names.insert(state.symbols.create(args[1]->listElems()[i]->string.s));
+        names.push_back(state.symbols.create(args[1]->listElems()[i]->string.s));
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+
+    /* Find the attributes to be removed by merging the names with
+       the set. */
+    Bindings & attrs(*args[0]->attrs);
+    std::vector<Bindings::iterator> removed;
+    auto i = attrs.begin();
+    for (auto & name : names) {
+        i = gallop(i, attrs.end(), name);
+        if (i == attrs.end()) break;
+        if (i->name == name) removed.push_back(i++);
     }
 
-    /* Copy all attributes not in that set.  Note that we don't need
-       to sort v.attrs because it's a subset of an already sorted
-       vector. */
-    state.mkAttrs(v, args[0]->attrs->size());
-    for (auto & i : *args[0]->attrs) {
-        if (names.find(i.name) == names.end())
-            v.attrs->push_back(i);
+    /* Copy the runs of attributes between them.  Note that we don't
+       need to sort v.attrs because it's a subset of an already
+       sorted vector. */
+    state.mkAttrs(v, attrs.size() - removed.size());
+    i = attrs.begin();
+    for (auto & j : removed) {
+        v.attrs->append(i, j);
+        i = j + 1;
     }
+    v.attrs->append(i, attrs.end());
 }
 
 
@@ -1360,9 +1630,11 @@ static void prim_listToAttrs(EvalState & state, const Pos & pos, Value * * args,
 {
     state.forceList(*args[0], pos);
 
-    state.mkAttrs(v, args[0]->listSize());
-
-    std::set<Symbol> seen;
+    /* Pair each name with the element defining it, ordered by name
+       and then by position in the list, so that the first
+       occurrence of a name comes first. */
+    std::vector<std::pair<Symbol, Value *>> elems;
+    elems.reserve(args[0]->listSize());
 
     for (unsigned int i = 0; i < args[0]->listSize(); ++i) {
         Value & v2(*args[0]->listElems()[i]);
@@ -1376,36 +1648,57 @@ static void prim_listToAttrs(EvalState & state, const Pos & pos, Value * * args,
             });
         string name = state.forceStringNoCtx(*j->value, pos);
 
-        Symbol sym = state.symbols.create(name);
-        if (seen.insert(sym).second) {
-            Bindings::iterator j2 = v2.attrs->find(state.symbols.create(state.sValue));
-            if (j2 == v2.attrs->end())
-                throw TypeError({
-                    .hint = hintfmt("'value' attribute missing in a call to 'listToAttrs'"),
-                    .errPos = pos
-                });
-            v.attrs->push_back(Attr(sym, j2->value, j2->pos));
-        }
+        elems.emplace_back(state.symbols.create(name), &v2);
     }
 
-    v.attrs->sort();
+    auto byName = [](const auto & a, const auto & b) { return a.first < b.first; };
+    if (!std::is_sorted(elems.begin(), elems.end(), byName))
+        std::stable_sort(elems.begin(), elems.end(), byName);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < elems.size(); ++i)
+        if (!i || elems[i].first != elems[i - 1].first) unique++;
+
+    state.mkAttrs(v, unique);
+
+    for (size_t i = 0; i < elems.size(); ++i) {
+        if (i && elems[i].first == elems[i - 1].first) continue;
+        Bindings::iterator j = elems[i].second->attrs->find(state.sValue);
+        if (j == elems[i].second->attrs->end())
+            throw TypeError({
+                .hint = hintfmt("'value' attribute missing in a call to 'listToAttrs'"),
+                .errPos = pos
+            });
+        v.attrs->push_back(Attr(elems[i].first, j->value, j->pos));
+    }
 }
 
 
 /* Return the right-biased intersection of two sets as1 and as2,
    i.e. a set that contains every attribute from as2 that is also a
-   member of as1. */
+   member of as1.  Both sets are sorted by name, so this merges them,
+   walking the smaller one and galloping through the larger one.
+   That matters for callPackage-style calls, which intersect the few
+   formals of a function with the whole package set. */
 static void prim_intersectAttrs(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceAttrs(*args[0], pos);
     state.forceAttrs(*args[1], pos);
 
-    state.mkAttrs(v, std::min(args[0]->attrs->size(), args[1]->attrs->size()));
+    Bindings & left(*args[0]->attrs);
+    Bindings & right(*args[1]->attrs);
+    bool leftSmaller = left.size() <= right.size();
+    Bindings & small(leftSmaller ? left : right);
+    Bindings & large(leftSmaller ? right : left);
 
-    for (auto & i : *args[0]->attrs) {
-        Bindings::iterator j = args[1]->attrs->find(i.name);
-        if (j != args[1]->attrs->end())
-            v.attrs->push_back(*j);
+    state.mkAttrs(v, small.size());
+
+    auto j = large.begin();
+    for (auto & i : small) {
+        j = gallop(j, large.end(), i.name);
+        if (j == large.end()) break;
+        if (j->name == i.name)
+            v.attrs->push_back(leftSmaller ? *j : i);
     }
 }
 
@@ -1425,10 +1718,14 @@ static void prim_catAttrs(EvalState & state, const Pos & pos, Value * * args, Va
     Value * res[args[1]->listSize()];
     unsigned int found = 0;
 
+    /* The sets in such lists usually have the same shape, so the
+       attribute tends to be at the same position in each. */
+    uint32_t hint = 0;
+
     for (unsigned int n = 0; n < args[1]->listSize(); ++n) {
         Value & v2(*args[1]->listElems()[n]);
         state.forceAttrs(v2, pos);
-        Bindings::iterator i = v2.attrs->find(attrName);
+        Bindings::iterator i = v2.attrs->find(attrName, hint);
         if (i != v2.attrs->end())
             res[found++] = i->value;
     }
@@ -1455,7 +1752,7 @@ static void prim_catAttrs(EvalState & state, const Pos & pos, Value * * args, Va
 static void prim_functionArgs(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0], pos);
-    if (args[0]->type != tLambda)
+    if (args[0]->type() != tLambda)
         throw TypeError({
             .hint = hintfmt("'functionArgs' requires a function"),
             .errPos = pos
@@ -1705,6 +2002,104 @@ static void prim_genList(EvalState & state, const Pos & pos, Value * * args, Val
 static void prim_lessThan(EvalState & state, const Pos & pos, Value * * args, Value & v);
 
 
+/* Whether `e' is the argument of the function `level' levels up, or
+   a selection of constant attributes from it (in which case
+   `attrPath' and `pos' are set). */
+static bool matchComparatorArg(Expr * e, unsigned int level,
+    const AttrPath * & attrPath, const Pos * & pos)
+{
+    auto select = dynamic_cast<ExprSelect *>(e);
+    if (select) {
+        if (select->def) return false;
+        for (auto & i : select->attrPath)
+            if (!i.symbol.set()) return false;
+        attrPath = &select->attrPath;
+        pos = &select->pos;
+        e = select->e;
+    }
+    auto var = dynamic_cast<ExprLocalVar *>(e);
+    return var && var->level == level && var->displ == 0;
+}
+
+
+/* A comparator of the form `a: b: a.x.y < b.x.y' (or `a: b: a < b'),
+   which can be replaced by comparing the keys `x.y' of all elements
+   natively. */
+struct KeyComparator
+{
+    const AttrPath * attrPath = nullptr;
+    const Pos * pos = nullptr;
+    bool reversed = false;
+};
+
+
+static std::optional<KeyComparator> matchComparator(Value & fun)
+{
+    if (fun.type() != tLambda || fun.lambda.fun->matchAttrs) return {};
+    auto inner = dynamic_cast<ExprLambda *>(fun.lambda.fun->body);
+    if (!inner || inner->matchAttrs) return {};
+
+    /* `x < y' is parsed as `__lessThan x y'. */
+    auto app = dynamic_cast<ExprApp *>(inner->body);
+    if (!app) return {};
+    auto app2 = dynamic_cast<ExprApp *>(app->e1);
+    if (!app2) return {};
+
+    /* Check that `__lessThan' is the builtin by looking it up in the
+       environment of the comparator, which is two levels above the
+       body. */
+    auto var = dynamic_cast<ExprLocalVar *>(app2->e1);
+    if (!var || var->level < 2) return {};
+    Env * env = fun.lambdaEnv();
+    for (auto l = var->level - 2; l; --l) env = env->up;
+    auto vLessThan = env->values[var->displ];
+    if (!vLessThan
+        || vLessThan->type() != tPrimOp
+        || vLessThan->primOp->fun != prim_lessThan)
+        return {};
+
+    KeyComparator cmp, cmp2;
+    if (matchComparatorArg(app2->e2, 1, cmp.attrPath, cmp.pos)
+        && matchComparatorArg(app->e2, 0, cmp2.attrPath, cmp2.pos))
+        cmp.reversed = false;
+    else if (matchComparatorArg(app2->e2, 0, cmp.attrPath, cmp.pos)
+        && matchComparatorArg(app->e2, 1, cmp2.attrPath, cmp2.pos))
+        cmp.reversed = true;
+    else
+        return {};
+
+    /* Both sides must select the same attribute. */
+    if (!cmp.attrPath != !cmp2.attrPath) return {};
+    if (cmp.attrPath) {
+        if (cmp.attrPath->size() != cmp2.attrPath->size()) return {};
+        for (size_t n = 0; n < cmp.attrPath->size(); ++n)
+            if ((*cmp.attrPath)[n].symbol != (*cmp2.attrPath)[n].symbol) return {};
+    }
+
+    return cmp;
+}
+
+
+/* Stably sort the elements of the list `v' by the values `keys[n]'
+   computed from each element `n'. */
+static void sortByKeys(Value & v, const ValueVector & keys, bool reversed)
+{
+    auto len = v.listSize();
+
+    std::vector<size_t> order(len);
+    for (size_t n = 0; n < len; ++n) order[n] = n;
+
+    CompareValues comp;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return reversed ? comp(keys[b], keys[a]) : comp(keys[a], keys[b]);
+    });
+
+    ValueVector elems(v.listElems(), v.listElems() + len);
+    for (size_t n = 0; n < len; ++n)
+        v.listElems()[n] = elems[order[n]];
+}
+
+
 static void prim_sort(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceFunction(*args[0], pos);
@@ -1717,11 +2112,37 @@ static void prim_sort(EvalState & state, const Pos & pos, Value * * args, Value
         v.listElems()[n] = args[1]->listElems()[n];
     }
 
+    if (len < 2) return;
+
+    /* Optimization: comparators that only apply lessThan to an
+       attribute of both elements need no function calls; compute
+       the attribute of every element once and compare those. */
+    if (auto cmp = matchComparator(*args[0])) {
+        ValueVector keys(len);
+        for (size_t n = 0; n < len; ++n) {
+            auto key = v.listElems()[n];
+            if (cmp->attrPath)
+                for (auto & i : *cmp->attrPath) {
+                    state.forceAttrs(*key, *cmp->pos);
+                    auto j = key->attrs->find(i.symbol);
+                    if (j == key->attrs->end())
+                        throw EvalError({
+                            .hint = hintfmt("attribute '%1%' missing", i.symbol),
+                            .errPos = *cmp->pos
+                        });
+                    key = j->value;
+                }
+            state.forceValue(*key, pos);
+            keys[n] = key;
+        }
+        sortByKeys(v, keys, cmp->reversed);
+        return;
+    }
 
     auto comparator = [&](Value * a, Value * b) {
         /* Optimization: if the comparator is lessThan, bypass
            callFunction. */
-        if (args[0]->type == tPrimOp && args[0]->primOp->fun == prim_lessThan)
+        if (args[0]->type() == tPrimOp && args[0]->primOp->fun == prim_lessThan)
             return CompareValues()(a, b);
 
         Value vTmp1, vTmp2;
@@ -1737,6 +2158,26 @@ static void prim_sort(EvalState & state, const Pos & pos, Value * * args, Value
 }
 
 
+static void prim_sortOn(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.forceFunction(*args[0], pos);
+    state.forceList(*args[1], pos);
+
+    auto len = args[1]->listSize();
+    state.mkList(v, len);
+
+    ValueVector keys(len);
+    for (unsigned int n = 0; n < len; ++n) {
+        v.listElems()[n] = args[1]->listElems()[n];
+        keys[n] = state.allocValue();
+        state.callFunction(*args[0], *v.listElems()[n], *keys[n], pos);
+        state.forceValue(*keys[n], pos);
+    }
+
+    sortByKeys(v, keys, false);
+}
+
+
 static void prim_partition(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceFunction(*args[0], pos);
@@ -1813,7 +2254,7 @@ static void prim_add(EvalState & state, const Pos & pos, Value * * args, Value &
 {
     state.forceValue(*args[0], pos);
     state.forceValue(*args[1], pos);
-    if (args[0]->type == tFloat || args[1]->type == tFloat)
+    if (args[0]->type() == tFloat || args[1]->type() == tFloat)
         mkFloat(v, state.forceFloat(*args[0], pos) + state.forceFloat(*args[1], pos));
     else
         mkInt(v, state.forceInt(*args[0], pos) + state.forceInt(*args[1], pos));
@@ -1824,7 +2265,7 @@ static void prim_sub(EvalState & state, const Pos & pos, Value * * args, Value &
 {
     state.forceValue(*args[0], pos);
     state.forceValue(*args[1], pos);
-    if (args[0]->type == tFloat || args[1]->type == tFloat)
+    if (args[0]->type() == tFloat || args[1]->type() == tFloat)
         mkFloat(v, state.forceFloat(*args[0], pos) - state.forceFloat(*args[1], pos));
     else
         mkInt(v, state.forceInt(*args[0], pos) - state.forceInt(*args[1], pos));
@@ -1835,7 +2276,7 @@ static void prim_mul(EvalState & state, const Pos & pos, Value * * args, Value &
 {
     state.forceValue(*args[0], pos);
     state.forceValue(*args[1], pos);
-    if (args[0]->type == tFloat || args[1]->type == tFloat)
+    if (args[0]->type() == tFloat || args[1]->type() == tFloat)
         mkFloat(v, state.forceFloat(*args[0], pos) * state.forceFloat(*args[1], pos));
     else
         mkInt(v, state.forceInt(*args[0], pos) * state.forceInt(*args[1], pos));
@@ -1854,7 +2295,7 @@ static void prim_div(EvalState & state, const Pos & pos, Value * * args, Value &
             .errPos = pos
         });
 
-    if (args[0]->type == tFloat || args[1]->type == tFloat) {
+    if (args[0]->type() == tFloat || args[1]->type() == tFloat) {
         mkFloat(v, state.forceFloat(*args[0], pos) / state.forceFloat(*args[1], pos));
     } else {
         NixInt i1 = state.forceInt(*args[0], pos);
@@ -1957,6 +2398,39 @@ static void prim_hashString(EvalState & state, const Pos & pos, Value * * args,
 }
 
 
+/* If 're' matches only a fixed, non-empty string, return that
+   string. */
+static std::optional<std::string> regexToLiteral(const std::string & re)
+{
+    static const char * special = ".[]()*+?{}|^$\\";
+    std::string res;
+    for (size_t i = 0; i < re.size(); ++i) {
+        if (re[i] == '\\') {
+            if (i + 1 == re.size() || !strchr(special, re[i + 1]))
+                return {};
+            res += re[++i];
+        } else if (strchr(special, re[i]))
+            return {};
+        else
+            res += re[i];
+    }
+    if (res.empty()) return {};
+    return res;
+}
+
+
+const EvalState::CompiledRegex & EvalState::getRegex(const std::string & re)
+{
+    auto i = regexCache.find(re);
+    if (i != regexCache.end()) return i->second;
+    CompiledRegex regex;
+    regex.literal = regexToLiteral(re);
+    if (!regex.literal)
+        regex.regex = std::regex(re, std::regex::extended);
+    return regexCache.emplace(re, std::move(regex)).first->second;
+}
+
+
 /* Match a regular expression against a string and return either
    ‘null’ or a list containing substring matches. */
 void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v)
@@ -1965,15 +2439,21 @@ void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v)
 
     try {
 
-        auto regex = state.regexCache.find(re);
-        if (regex == state.regexCache.end())
-            regex = state.regexCache.emplace(re, std::regex(re, std::regex::extended)).first;
+        auto & regex = state.getRegex(re);
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
 
+        if (regex.literal) {
+            if (str == *regex.literal)
+                state.mkList(v, 0);
+            else
+                mkNull(v);
+            return;
+        }
+
         std::smatch match;
-        if (!std::regex_match(str, match, regex->second)) {
+        if (!std::regex_match(str, match, regex.regex)) {
             mkNull(v);
             return;
         }
@@ -2013,12 +2493,35 @@ static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value
 
     try {
 
-        std::regex regex(re, std::regex::extended);
+        auto & regex = state.getRegex(re);
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
 
-        auto begin = std::sregex_iterator(str.begin(), str.end(), regex);
+        if (regex.literal) {
+            auto & sep = *regex.literal;
+            std::vector<size_t> matches;
+            for (auto p = str.find(sep); p != std::string::npos; p = str.find(sep, p + sep.size()))
+                matches.push_back(p);
+
+            if (matches.empty()) {
+                state.mkList(v, 1);
+                v.listElems()[0] = args[1];
+                return;
+            }
+
+            state.mkList(v, 2 * matches.size() + 1);
+            size_t idx = 0, prev = 0;
+            for (auto p : matches) {
+                mkString(*(v.listElems()[idx++] = state.allocValue()), std::string_view(str).substr(prev, p - prev));
+                state.mkList(*(v.listElems()[idx++] = state.allocValue()), 0);
+                prev = p + sep.size();
+            }
+            mkString(*(v.listElems()[idx++] = state.allocValue()), std::string_view(str).substr(prev));
+            return;
+        }
+
+        auto begin = std::sregex_iterator(str.begin(), str.end(), regex.regex);
         auto end = std::sregex_iterator();
 
         // Any matches results are surrounded by non-matching results.
@@ -2326,7 +2829,7 @@ void EvalState::createBaseEnv()
     // Sets
     addPrimOp("__attrNames", 1, prim_attrNames);
     addPrimOp("__attrValues", 1, prim_attrValues);
-    addPrimOp("__getAttr", 2, prim_getAttr);
+    vGetAttr = addPrimOp("__getAttr", 2, prim_getAttr);
     addPrimOp("__unsafeGetAttrPos", 2, prim_unsafeGetAttrPos);
     addPrimOp("__hasAttr", 2, prim_hasAttr);
     addPrimOp("__isAttrs", 1, prim_isAttrs);
@@ -2352,6 +2855,7 @@ void EvalState::createBaseEnv()
     addPrimOp("__all", 2, prim_all);
     addPrimOp("__genList", 2, prim_genList);
     addPrimOp("__sort", 2, prim_sort);
+    addPrimOp("__sortOn", 2, prim_sortOn);
     addPrimOp("__partition", 2, prim_partition);
     addPrimOp("__concatMap", 2, prim_concatMap);
 
@@ -2381,16 +2885,10 @@ void EvalState::createBaseEnv()
     addPrimOp("__splitVersion", 1, prim_splitVersion);
 
     // Derivations
-    addPrimOp("derivationStrict", 1, prim_derivationStrict);
+    vDerivationStrict = addPrimOp("derivationStrict", 1, prim_derivationStrict);
+    addPrimOp("derivation", 1, prim_derivation);
     addPrimOp("placeholder", 1, prim_placeholder);
 
-    /* Add a wrapper around the derivation primop that computes the
-       `drvPath' and `outPath' attributes lazily. */
-    string path = canonPath(settings.nixDataDir + "/nix/corepkgs/derivation.nix", true);
-    sDerivationNix = symbols.create(path);
-    evalFile(path, v);
-    addConstant("derivation", v);
-
     /* Add a value containing the current Nix expression search path. */
     mkList(v, searchPath.size());
     int n = 0;
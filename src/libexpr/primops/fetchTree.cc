@@ -49,16 +49,16 @@ static void prim_fetchTree(EvalState & state, const Pos & pos, Value * * args, V
 
     state.forceValue(*args[0]);
 
-    if (args[0]->type == tAttrs) {
+    if (args[0]->type() == tAttrs) {
         state.forceAttrs(*args[0], pos);
 
         fetchers::Attrs attrs;
 
         for (auto & attr : *args[0]->attrs) {
             state.forceValue(*attr.value);
-            if (attr.value->type == tString)
+            if (attr.value->type() == tString)
                 attrs.emplace(attr.name, attr.value->string.s);
-            else if (attr.value->type == tBool)
+            else if (attr.value->type() == tBool)
                 attrs.emplace(attr.name, attr.value->boolean);
             else
                 throw TypeError("fetchTree argument '%s' is %s while a string or Boolean is expected",
@@ -97,7 +97,7 @@ static void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
 
     state.forceValue(*args[0]);
 
-    if (args[0]->type == tAttrs) {
+    if (args[0]->type() == tAttrs) {
 
         state.forceAttrs(*args[0], pos);
 
@@ -1,91 +1,599 @@
 #include "primops.hh"
 #include "eval-inline.hh"
 
-#include "../../cpptoml/cpptoml.h"
+#include <charconv>
+#include <limits>
+#include <unordered_map>
 
 namespace nix {
 
-static void prim_fromTOML(EvalState & state, const Pos & pos, Value * * args, Value & v)
+/* A TOML (v1.0) reader that builds Nix values as it goes. Plain
+   values, arrays and inline tables are converted to Values right away,
+   since nothing can extend them later. Only the tables that can be
+   reopened ([headers], dotted keys and [[arrays of tables]]) are kept
+   in a small intermediate tree, which is turned into attribute sets at
+   the end. Dates and times are rejected because Nix has no type for
+   them. */
+class TOMLParser
 {
-    using namespace cpptoml;
+    struct Table;
 
-    auto toml = state.forceStringNoCtx(*args[0], pos);
+    struct Entry
+    {
+        Symbol name;
+        /* A value that cannot be extended (including inline tables
+           and arrays), or... */
+        Value * value = nullptr;
+        /* ...a table, or... */
+        std::unique_ptr<Table> table;
+        /* ...an array of tables. */
+        std::vector<std::unique_ptr<Table>> tables;
+    };
+
+    struct Table
+    {
+        std::vector<Entry> entries;
+        /* Only built once a table gets big, e.g. the [metadata]
+           section of a Cargo.lock. */
+        std::unordered_map<Symbol, size_t> index;
+        /* Whether the table has been defined by a [header] or by
+           dotted keys, as opposed to being implied by either. */
+        bool defined = false;
+        bool dotted = false;
+
+        Entry * find(const Symbol & name)
+        {
+            if (index.empty()) {
+                for (auto & e : entries)
+                    if (e.name == name) return &e;
+                return nullptr;
+            }
+            auto i = index.find(name);
+            return i == index.end() ? nullptr : &entries[i->second];
+        }
+
+        Entry & add(const Symbol & name)
+        {
+            entries.emplace_back();
+            entries.back().name = name;
+            if (!index.empty())
+                index.emplace(name, entries.size() - 1);
+            else if (entries.size() > 8)
+                for (size_t i = 0; i < entries.size(); ++i)
+                    index.emplace(entries[i].name, i);
+            return entries.back();
+        }
+    };
+
+    EvalState & state;
+    const Pos & pos;
+    std::string_view s;
+    size_t p = 0;
+
+    /* Keeps the values stored in the intermediate tree reachable for
+       the garbage collector until they have been put into attribute
+       sets. */
+    ValueVector roots;
+
+    typedef std::vector<Symbol> Key;
+
+    [[noreturn]] void fail(const std::string & msg)
+    {
+        size_t line = 1 + std::count(s.begin(), s.begin() + std::min(p, s.size()), '\n');
+        throw EvalError({
+            .hint = hintfmt("while parsing a TOML string: %s at line %d", msg, line),
+            .errPos = pos
+        });
+    }
 
-    std::istringstream tomlStream(toml);
+    bool atEnd() { return p >= s.size(); }
 
-    std::function<void(Value &, std::shared_ptr<base>)> visit;
+    char peek(size_t n = 0) { return p + n < s.size() ? s[p + n] : 0; }
 
-    visit = [&](Value & v, std::shared_ptr<base> t) {
+    bool startsWith(std::string_view prefix)
+    {
+        return s.substr(p, prefix.size()) == prefix;
+    }
+
+    void expect(char c)
+    {
+        if (peek() != c)
+            fail(atEnd() ? fmt("expected '%c' but got end of input", c) : fmt("expected '%c'", c));
+        p++;
+    }
 
-        if (auto t2 = t->as_table()) {
+    void skipWhitespace()
+    {
+        while (peek() == ' ' || peek() == '\t') p++;
+    }
 
-            size_t size = 0;
-            for (auto & i : *t2) { (void) i; size++; }
+    void skipComment()
+    {
+        if (peek() != '#') return;
+        while (!atEnd() && s[p] != '\n') {
+            unsigned char c = s[p];
+            if ((c < 0x20 && c != '\t' && !(c == '\r' && peek(1) == '\n')) || c == 0x7f)
+                fail("control character in comment");
+            p++;
+        }
+    }
 
-            state.mkAttrs(v, size);
+    bool skipNewline()
+    {
+        if (peek() == '\n') { p++; return true; }
+        if (peek() == '\r' && peek(1) == '\n') { p += 2; return true; }
+        return false;
+    }
 
-            for (auto & i : *t2) {
-                auto & v2 = *state.allocAttr(v, state.symbols.create(i.first));
+    /* Skip whitespace, comments and newlines, as allowed in arrays. */
+    void skipBlank()
+    {
+        while (true) {
+            skipWhitespace();
+            skipComment();
+            if (!skipNewline()) break;
+        }
+    }
 
-                if (auto i2 = i.second->as_table_array()) {
-                    size_t size2 = i2->get().size();
-                    state.mkList(v2, size2);
-                    for (size_t j = 0; j < size2; ++j)
-                        visit(*(v2.listElems()[j] = state.allocValue()), i2->get()[j]);
+    void expectEndOfLine()
+    {
+        skipWhitespace();
+        skipComment();
+        if (!atEnd() && !skipNewline())
+            fail("expected a newline after a key/value pair or table header");
+    }
+
+    static bool isBareKeyChar(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+    }
+
+    static void appendUTF8(std::string & res, uint32_t c)
+    {
+        if (c < 0x80)
+            res += (char) c;
+        else if (c < 0x800) {
+            res += (char) (0xc0 | (c >> 6));
+            res += (char) (0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            res += (char) (0xe0 | (c >> 12));
+            res += (char) (0x80 | ((c >> 6) & 0x3f));
+            res += (char) (0x80 | (c & 0x3f));
+        } else {
+            res += (char) (0xf0 | (c >> 18));
+            res += (char) (0x80 | ((c >> 12) & 0x3f));
+            res += (char) (0x80 | ((c >> 6) & 0x3f));
+            res += (char) (0x80 | (c & 0x3f));
+        }
+    }
+
+    void parseEscape(std::string & res)
+    {
+        p++; // '\'
+        char c = peek();
+        p++;
+        switch (c) {
+            case 'b': res += '\b'; return;
+            case 't': res += '\t'; return;
+            case 'n': res += '\n'; return;
+            case 'f': res += '\f'; return;
+            case 'r': res += '\r'; return;
+            case '"': res += '"'; return;
+            case '\\': res += '\\'; return;
+            case 'u': case 'U': {
+                size_t len = c == 'u' ? 4 : 8;
+                uint32_t code = 0;
+                auto digits = s.substr(p, len);
+                auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), code, 16);
+                if (digits.size() != len || ec != std::errc() || end != digits.data() + len)
+                    fail("invalid unicode escape");
+                if (code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff))
+                    fail("invalid unicode scalar value in escape");
+                p += len;
+                appendUTF8(res, code);
+                return;
+            }
+            default:
+                p--;
+                fail("invalid escape sequence in string");
+        }
+    }
+
+    void checkStringChar(unsigned char c, bool multiline)
+    {
+        if ((c < 0x20 && c != '\t' && !(multiline && (c == '\n' || c == '\r'))) || c == 0x7f)
+            fail(c == '\n' ? "unterminated string" : "control character in string");
+        if (c == '\r' && peek(1) != '\n')
+            fail("bare carriage return in string");
+    }
+
+    /* Parse a basic ("...") or literal ('...') string, in their
+       single-line or multi-line (""" / ''') forms. */
+    std::string parseString(bool allowMultiline = true)
+    {
+        char quote = peek();
+        bool literal = quote == '\'';
+        std::string res;
+
+        if (allowMultiline && peek(1) == quote && peek(2) == quote) {
+            p += 3;
+            /* A newline right after the opening delimiter is trimmed. */
+            skipNewline();
+            while (true) {
+                if (atEnd()) fail("unterminated multi-line string");
+                char c = s[p];
+                if (c == quote) {
+                    /* Up to two quotes may precede the closing
+                       delimiter. */
+                    size_t n = 0;
+                    while (peek(n) == quote) n++;
+                    if (n >= 3) {
+                        if (n > 5) fail("too many quotes at the end of a multi-line string");
+                        res.append(n - 3, quote);
+                        p += n;
+                        return res;
+                    }
+                    res.append(n, quote);
+                    p += n;
+                }
+                else if (c == '\\' && !literal) {
+                    /* A line-ending backslash trims all whitespace up
+                       to the next non-whitespace character. */
+                    size_t q = p + 1;
+                    while (q < s.size() && (s[q] == ' ' || s[q] == '\t')) q++;
+                    if (q < s.size() && (s[q] == '\n' || (s[q] == '\r' && q + 1 < s.size() && s[q + 1] == '\n'))) {
+                        p = q;
+                        while (true) {
+                            skipWhitespace();
+                            if (!skipNewline()) break;
+                        }
+                    } else
+                        parseEscape(res);
+                }
+                else {
+                    checkStringChar(c, true);
+                    res += c;
+                    p++;
                 }
-                else
-                    visit(v2, i.second);
             }
+        }
+
+        p++;
+        while (true) {
+            /* Copy runs of ordinary characters in one go. */
+            size_t start = p;
+            while (p < s.size() && s[p] != quote && s[p] != '\\'
+                && ((unsigned char) s[p] >= 0x20 || s[p] == '\t') && s[p] != 0x7f)
+                p++;
+            res.append(s.substr(start, p - start));
+
+            if (atEnd()) fail("unterminated string");
+            char c = s[p];
+            if (c == quote) { p++; return res; }
+            if (c == '\\' && !literal)
+                parseEscape(res);
+            else {
+                checkStringChar(c, false);
+                res += c;
+                p++;
+            }
+        }
+    }
+
+    Key parseKey()
+    {
+        Key key;
+        while (true) {
+            skipWhitespace();
+            char c = peek();
+            if (c == '"' || c == '\'')
+                key.push_back(state.symbols.create(parseString(false)));
+            else {
+                size_t start = p;
+                while (isBareKeyChar(peek())) p++;
+                if (p == start) fail(atEnd() ? "expected a key but got end of input" : "invalid key");
+                key.push_back(state.symbols.create(s.substr(start, p - start)));
+            }
+            skipWhitespace();
+            if (peek() != '.') return key;
+            p++;
+        }
+    }
+
+    static std::string showKey(const Key & key, size_t n)
+    {
+        std::string res;
+        for (size_t i = 0; i < n; ++i) {
+            if (i) res += '.';
+            res += (const std::string &) key[i];
+        }
+        return res;
+    }
+
+    /* Validate a run of digits with single underscores between them
+       and return it without the underscores. */
+    std::string cleanDigits(std::string_view token, bool (*isDigit)(char))
+    {
+        std::string res;
+        res.reserve(token.size());
+        for (size_t i = 0; i < token.size(); ++i) {
+            char c = token[i];
+            if (c == '_') {
+                if (i == 0 || i + 1 == token.size() || !isDigit(token[i - 1]) || !isDigit(token[i + 1]))
+                    fail("invalid use of '_' in a number");
+            } else
+                res += c;
+        }
+        return res;
+    }
+
+    static bool isDecDigit(char c) { return c >= '0' && c <= '9'; }
+    static bool isHexDigit(char c) { return isDecDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'); }
+    static bool isOctDigit(char c) { return c >= '0' && c <= '7'; }
+    static bool isBinDigit(char c) { return c == '0' || c == '1'; }
+
+    void parseNumber(Value & v, std::string_view token)
+    {
+        if (token == "inf" || token == "+inf") { mkFloat(v, std::numeric_limits<NixFloat>::infinity()); return; }
+        if (token == "-inf") { mkFloat(v, -std::numeric_limits<NixFloat>::infinity()); return; }
+        if (token == "nan" || token == "+nan" || token == "-nan") { mkFloat(v, std::numeric_limits<NixFloat>::quiet_NaN()); return; }
+
+        auto isDateLike = [&]() {
+            return token.find(':') != token.npos
+                || (token.size() >= 5 && isDecDigit(token[0]) && isDecDigit(token[1])
+                    && isDecDigit(token[2]) && isDecDigit(token[3]) && token[4] == '-');
+        };
+        if (isDateLike()) fail("unsupported value type (dates and times are not supported)");
+
+        if (token.size() > 2 && token[0] == '0' && (token[1] == 'x' || token[1] == 'o' || token[1] == 'b')) {
+            int base = token[1] == 'x' ? 16 : token[1] == 'o' ? 8 : 2;
+            auto digits = token.substr(2);
+            auto isDigit = base == 16 ? isHexDigit : base == 8 ? isOctDigit : isBinDigit;
+            for (auto c : digits)
+                if (c != '_' && !isDigit(c)) fail(fmt("invalid number '%s'", token));
+            auto clean = cleanDigits(digits, isDigit);
+            NixInt n;
+            auto [end, ec] = std::from_chars(clean.data(), clean.data() + clean.size(), n, base);
+            if (ec == std::errc::result_out_of_range) fail(fmt("integer '%s' is out of range", token));
+            if (ec != std::errc() || end != clean.data() + clean.size()) fail(fmt("invalid number '%s'", token));
+            mkInt(v, n);
+            return;
+        }
+
+        /* [sign] int [. digits] [(e|E) [sign] digits] */
+        size_t i = 0;
+        auto digitRun = [&]() {
+            size_t start = i;
+            while (i < token.size() && (isDecDigit(token[i]) || token[i] == '_')) i++;
+            if (i == start) fail(fmt("invalid number '%s'", token));
+            return cleanDigits(token.substr(start, i - start), isDecDigit);
+        };
+
+        std::string clean;
+        if (i < token.size() && (token[i] == '+' || token[i] == '-')) {
+            if (token[i] == '-') clean += '-';
+            i++;
+        }
+        auto intPart = digitRun();
+        if (intPart.size() > 1 && intPart[0] == '0') fail(fmt("leading zeros are not allowed in '%s'", token));
+        clean += intPart;
+
+        bool isFloat = false;
+        if (i < token.size() && token[i] == '.') {
+            i++;
+            clean += '.';
+            clean += digitRun();
+            isFloat = true;
+        }
+        if (i < token.size() && (token[i] == 'e' || token[i] == 'E')) {
+            i++;
+            clean += 'e';
+            if (i < token.size() && (token[i] == '+' || token[i] == '-'))
+                clean += token[i++];
+            clean += digitRun();
+            isFloat = true;
+        }
+        if (i != token.size()) fail(fmt("invalid value '%s'", token));
 
-            v.attrs->sort();
+        if (isFloat)
+            mkFloat(v, strtod(clean.c_str(), nullptr));
+        else {
+            NixInt n;
+            auto [end, ec] = std::from_chars(clean.data(), clean.data() + clean.size(), n);
+            if (ec == std::errc::result_out_of_range) fail(fmt("integer '%s' is out of range", token));
+            if (ec != std::errc()) fail(fmt("invalid number '%s'", token));
+            mkInt(v, n);
         }
+    }
 
-        else if (auto t2 = t->as_array()) {
-            size_t size = t2->get().size();
+    void parseValue(Value & v)
+    {
+        char c = peek();
 
-            state.mkList(v, size);
+        if (c == '"' || c == '\'')
+            mkString(v, parseString());
 
-            for (size_t i = 0; i < size; ++i)
-                visit(*(v.listElems()[i] = state.allocValue()), t2->get()[i]);
+        else if (c == '[') {
+            p++;
+            ValueVector elems;
+            while (true) {
+                skipBlank();
+                if (peek() == ']') break;
+                auto v2 = state.allocValue();
+                elems.push_back(v2);
+                parseValue(*v2);
+                skipBlank();
+                if (peek() != ',') break;
+                p++;
+            }
+            expect(']');
+            state.mkList(v, elems.size());
+            for (size_t n = 0; n < elems.size(); ++n)
+                v.listElems()[n] = elems[n];
+        }
+
+        else if (c == '{') {
+            p++;
+            Table table;
+            skipWhitespace();
+            if (peek() != '}') {
+                while (true) {
+                    parseKeyValue(table);
+                    skipWhitespace();
+                    if (peek() != ',') break;
+                    p++;
+                }
+            }
+            expect('}');
+            finish(table, v);
         }
 
-        // Handle cases like 'a = [[{ a = true }]]', which IMHO should be
-        // parsed as a array containing an array containing a table,
-        // but instead are parsed as an array containing a table array
-        // containing a table.
-        else if (auto t2 = t->as_table_array()) {
-            size_t size = t2->get().size();
+        else {
+            size_t start = p;
+            while (!atEnd() && (isBareKeyChar(s[p]) || s[p] == '+' || s[p] == '.' || s[p] == ':')) p++;
+            /* Date-times may contain a space between the date and the
+               time; let parseNumber() reject those. */
+            auto token = s.substr(start, p - start);
+            if (token.empty())
+                fail(atEnd() ? "expected a value but got end of input" : "expected a value");
+            if (token == "true") mkBool(v, true);
+            else if (token == "false") mkBool(v, false);
+            else parseNumber(v, token);
+        }
+    }
 
-            state.mkList(v, size);
+    /* Parse 'key = value', defining any tables implied by a dotted
+       key within 'table'. */
+    void parseKeyValue(Table & table)
+    {
+        auto key = parseKey();
+        expect('=');
+        skipWhitespace();
 
-            for (size_t j = 0; j < size; ++j)
-                visit(*(v.listElems()[j] = state.allocValue()), t2->get()[j]);
+        Table * t = &table;
+        for (size_t i = 0; i + 1 < key.size(); ++i) {
+            auto e = t->find(key[i]);
+            if (!e) {
+                e = &t->add(key[i]);
+                e->table = std::make_unique<Table>();
+                e->table->dotted = true;
+            }
+            else if (!e->table || (e->table->defined && !e->table->dotted))
+                fail(fmt("cannot define '%s' because '%s' is not a table that can be extended",
+                        showKey(key, key.size()), showKey(key, i + 1)));
+            t = e->table.get();
+            t->defined = t->dotted = true;
         }
 
-        else if (t->is_value()) {
-            if (auto val = t->as<int64_t>())
-                mkInt(v, val->get());
-            else if (auto val = t->as<NixFloat>())
-                mkFloat(v, val->get());
-            else if (auto val = t->as<bool>())
-                mkBool(v, val->get());
-            else if (auto val = t->as<std::string>())
-                mkString(v, val->get());
+        if (t->find(key.back()))
+            fail(fmt("duplicate key '%s'", showKey(key, key.size())));
+
+        auto v = state.allocValue();
+        roots.push_back(v);
+        parseValue(*v);
+        t->add(key.back()).value = v;
+    }
+
+    /* Parse a '[table]' or '[[array of tables]]' header and return the
+       table that subsequent key/value pairs belong to. */
+    Table * parseHeader(Table & root)
+    {
+        bool isArray = startsWith("[[");
+        p += isArray ? 2 : 1;
+
+        auto key = parseKey();
+        expect(']');
+        if (isArray) expect(']');
+
+        Table * t = &root;
+        for (size_t i = 0; i + 1 < key.size(); ++i) {
+            auto e = t->find(key[i]);
+            if (!e) {
+                e = &t->add(key[i]);
+                e->table = std::make_unique<Table>();
+            }
+            if (e->table)
+                t = e->table.get();
+            else if (!e->tables.empty())
+                t = e->tables.back().get();
             else
-                throw EvalError("unsupported value type in TOML");
+                fail(fmt("cannot define table '%s' because '%s' is not a table",
+                        showKey(key, key.size()), showKey(key, i + 1)));
         }
 
-        else abort();
-    };
+        auto e = t->find(key.back());
 
-    try {
-        visit(v, parser(tomlStream).parse());
-    } catch (std::runtime_error & e) {
-        throw EvalError({
-            .hint = hintfmt("while parsing a TOML string: %s", e.what()),
-            .errPos = pos
-        });
+        if (isArray) {
+            if (!e)
+                e = &t->add(key.back());
+            else if (e->value || e->table)
+                fail(fmt("cannot define array of tables '%s' because it is already defined as something else",
+                        showKey(key, key.size())));
+            e->tables.push_back(std::make_unique<Table>());
+            return e->tables.back().get();
+        }
+
+        if (!e) {
+            e = &t->add(key.back());
+            e->table = std::make_unique<Table>();
+        }
+        else if (!e->table || e->table->defined)
+            fail(fmt("duplicate definition of table '%s'", showKey(key, key.size())));
+        e->table->defined = true;
+        return e->table.get();
+    }
+
+    /* Turn a table into an attribute set. */
+    void finish(Table & table, Value & v)
+    {
+        state.mkAttrs(v, table.entries.size());
+        for (auto & e : table.entries) {
+            Value * v2 = e.value;
+            if (!v2) {
+                v2 = state.allocValue();
+                if (e.table)
+                    finish(*e.table, *v2);
+                else {
+                    state.mkList(*v2, e.tables.size());
+                    for (size_t n = 0; n < e.tables.size(); ++n)
+                        finish(*e.tables[n], *(v2->listElems()[n] = state.allocValue()));
+                }
+            }
+            v.attrs->push_back(Attr(e.name, v2));
+        }
+        v.attrs->sort();
     }
+
+public:
+
+    TOMLParser(EvalState & state, const Pos & pos, std::string_view s)
+        : state(state), pos(pos), s(s)
+    { }
+
+    void parse(Value & v)
+    {
+        Table root;
+        Table * current = &root;
+
+        while (true) {
+            skipBlank();
+            if (atEnd()) break;
+            if (peek() == '[')
+                current = parseHeader(root);
+            else
+                parseKeyValue(*current);
+            expectEndOfLine();
+        }
+
+        finish(root, v);
+    }
+};
+
+static void prim_fromTOML(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    auto toml = state.forceStringNoCtx(*args[0], pos);
+
+    TOMLParser(state, pos, toml).parse(v);
 }
 
 static RegisterPrimOp r("fromTOML", 1, prim_fromTOML);
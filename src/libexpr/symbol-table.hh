@@ -1,7 +1,8 @@
 #pragma once
 
+#include <deque>
 #include <map>
-#include <unordered_set>
+#include <unordered_map>
 
 #include "types.hh"
 
@@ -13,11 +14,19 @@ namespace nix {
    they can be compared efficiently (using a pointer equality test),
    because the symbol table stores only one copy of each string. */
 
+/* The string of a symbol, together with its hash, which is computed
+   once when the symbol is created. */
+struct SymbolData
+{
+    const std::string s;
+    const size_t hash;
+};
+
 class Symbol
 {
 private:
-    const string * s; // pointer into SymbolTable
-    Symbol(const string * s) : s(s) { };
+    const SymbolData * s; // pointer into SymbolTable
+    Symbol(const SymbolData * s) : s(s) { };
     friend class SymbolTable;
 
 public:
@@ -40,12 +49,12 @@ public:
 
     operator const std::string & () const
     {
-        return *s;
+        return s->s;
     }
 
     operator const std::string_view () const
     {
-        return *s;
+        return s->s;
     }
 
     bool set() const
@@ -55,7 +64,12 @@ public:
 
     bool empty() const
     {
-        return s->empty();
+        return s->s.empty();
+    }
+
+    size_t hash() const
+    {
+        return s->hash;
     }
 
     friend std::ostream & operator << (std::ostream & str, const Symbol & sym);
@@ -64,19 +78,29 @@ public:
 class SymbolTable
 {
 private:
-    typedef std::unordered_set<string> Symbols;
+    /* The symbols. A deque never moves its elements, so this acts as
+       an arena that Symbols and the keys of 'symbols' can point
+       into. */
+    std::deque<SymbolData> store;
+
+    typedef std::unordered_map<std::string_view, const SymbolData *> Symbols;
     Symbols symbols;
 
 public:
-    Symbol create(const string & s)
+    /* Return the symbol for 's', creating it if it doesn't exist
+       yet. Looking up an existing symbol doesn't allocate. */
+    Symbol create(std::string_view s)
     {
-        std::pair<Symbols::iterator, bool> res = symbols.insert(s);
-        return Symbol(&*res.first);
+        auto i = symbols.find(s);
+        if (i != symbols.end()) return Symbol(i->second);
+        auto & data = store.emplace_back(SymbolData{std::string(s), std::hash<std::string_view>()(s)});
+        symbols.emplace(data.s, &data);
+        return Symbol(&data);
     }
 
     size_t size() const
     {
-        return symbols.size();
+        return store.size();
     }
 
     size_t totalSize() const;
@@ -84,8 +108,20 @@ public:
     template<typename T>
     void dump(T callback)
     {
-        for (auto & s : symbols)
-            callback(s);
+        for (auto & s : store)
+            callback(s.s);
+    }
+};
+
+}
+
+namespace std {
+
+template<> struct hash<nix::Symbol>
+{
+    size_t operator()(const nix::Symbol & s) const
+    {
+        return s.hash();
     }
 };
 
@@ -16,7 +16,7 @@ void printValueAsJSON(EvalState & state, bool strict,
 
     if (strict) state.forceValue(v);
 
-    switch (v.type) {
+    switch (v.type()) {
 
         case tInt:
             out.write(v.integer);
@@ -48,20 +48,16 @@ void printValueAsJSON(EvalState & state, bool strict,
             auto i = v.attrs->find(state.sOutPath);
             if (i == v.attrs->end()) {
                 auto obj(out.object());
-                StringSet names;
-                for (auto & j : *v.attrs)
-                    names.insert(j.name);
-                for (auto & j : names) {
-                    Attr & a(*v.attrs->find(state.symbols.create(j)));
-                    auto placeholder(obj.placeholder(j));
-                    printValueAsJSON(state, strict, *a.value, placeholder, context);
+                for (auto & a : v.attrs->lexicographicOrder()) {
+                    auto placeholder(obj.placeholder(a->name));
+                    printValueAsJSON(state, strict, *a->value, placeholder, context);
                 }
             } else
                 printValueAsJSON(state, strict, *i->value, out, context);
             break;
         }
 
-        case tList1: case tList2: case tListN: {
+        case tList1: case tListN: {
             auto list(out.list());
             for (unsigned int n = 0; n < v.listSize(); ++n) {
                 auto placeholder(list.placeholder());
@@ -10,21 +10,23 @@ namespace nix {
 
 
 typedef enum {
-    tInt = 1,
+    /* Types whose payload takes two words (see Value::tag). These
+       must be the first seven values. */
+    tString = 1,
+    tListN,
+    tThunk,
+    tApp,
+    tLambda,
+    tPrimOpApp,
+    /* Types whose payload takes at most one word. */
+    tInt,
     tBool,
-    tString,
     tPath,
     tNull,
     tAttrs,
     tList1,
-    tList2,
-    tListN,
-    tThunk,
-    tApp,
-    tLambda,
     tBlackhole,
     tPrimOp,
-    tPrimOpApp,
     tExternal,
     tFloat
 } ValueType;
@@ -88,9 +90,52 @@ class ExternalValueBase
 std::ostream & operator << (std::ostream & str, const ExternalValueBase & v);
 
 
-struct Value
+struct alignas(8) Value
 {
-    ValueType type;
+private:
+
+    /* The type of the value. For the types that need two words of
+       payload (tString up to tPrimOpApp), the low 3 bits hold the type
+       and the remaining bits hold the first word of the payload: an
+       8-byte aligned pointer or, for tListN, the size of the list
+       (shifted left by one more bit, to make room for the flag
+       returned by listGrowable()). For
+       all other types, the low 3 bits are zero and the type is stored
+       in the bits above them. This keeps a Value at 16 bytes. Since
+       'tag' may then point slightly past the start of an object, the
+       garbage collector is told to recognise such pointers (see
+       initGC()). */
+    uintptr_t tag;
+
+    static constexpr uintptr_t tagMask = 7;
+
+    template<typename T>
+    T * tagPointer() const
+    {
+        return (T *) (tag & ~tagMask);
+    }
+
+    void setPair(ValueType t, const void * p)
+    {
+        tag = (uintptr_t) p | t;
+    }
+
+public:
+
+    ValueType type() const
+    {
+        auto t = tag & tagMask;
+        return (ValueType) (t ? t : tag >> 3);
+    }
+
+    /* Set the type of a value whose payload is at most one word. */
+    void setType(ValueType t)
+    {
+        tag = (uintptr_t) t << 3;
+    }
+
+    /* The (second word of the) payload. The first word of the types
+       that need two is accessed through the methods below. */
     union
     {
         NixInt integer;
@@ -115,72 +160,145 @@ struct Value
            derivation, and the other store paths in C will be added to
            the inputSrcs of the derivations.
 
-           For canonicity, the store paths should be in sorted order. */
+           For canonicity, the store paths should be in sorted order.
+           Contexts are interned (see internContext()), so they must
+           not be modified and equal contexts are usually equal
+           pointers.
+           The context is returned by stringContext(). */
         struct {
             const char * s;
-            const char * * context; // must be in sorted order
         } string;
 
         const char * path;
         Bindings * attrs;
         struct {
-            size_t size;
             Value * * elems;
         } bigList;
-        Value * smallList[2];
+        Value * smallList[1];
         struct {
-            Env * env;
             Expr * expr;
         } thunk;
         struct {
-            Value * left, * right;
+            Value * right;
         } app;
         struct {
-            Env * env;
             ExprLambda * fun;
         } lambda;
         PrimOp * primOp;
         struct {
-            Value * left, * right;
+            Value * right;
         } primOpApp;
         ExternalValueBase * external;
         NixFloat fpoint;
     };
 
+    const char * * stringContext() const
+    {
+        return tagPointer<const char *>();
+    }
+
+    Env * thunkEnv() const
+    {
+        return tagPointer<Env>();
+    }
+
+    Value * appLeft() const
+    {
+        return tagPointer<Value>();
+    }
+
+    Env * lambdaEnv() const
+    {
+        return tagPointer<Env>();
+    }
+
+    Value * primOpAppLeft() const
+    {
+        return tagPointer<Value>();
+    }
+
+    void setString(const char * s, const char * * context)
+    {
+        setPair(tString, context);
+        string.s = s;
+    }
+
+    void setList(size_t size, Value * * elems, bool growable = false)
+    {
+        tag = (size << 4) | ((uintptr_t) growable << 3) | tListN;
+        bigList.elems = elems;
+    }
+
+    void setThunk(Env * env, Expr * expr)
+    {
+        setPair(tThunk, env);
+        thunk.expr = expr;
+    }
+
+    void setApp(Value * left, Value * right)
+    {
+        setPair(tApp, left);
+        app.right = right;
+    }
+
+    void setLambda(Env * env, ExprLambda * fun)
+    {
+        setPair(tLambda, env);
+        lambda.fun = fun;
+    }
+
+    void setPrimOpApp(Value * left, Value * right)
+    {
+        setPair(tPrimOpApp, left);
+        primOpApp.right = right;
+    }
+
     bool isList() const
     {
-        return type == tList1 || type == tList2 || type == tListN;
+        auto t = type();
+        return t == tList1 || t == tListN;
     }
 
     Value * * listElems()
     {
-        return type == tList1 || type == tList2 ? smallList : bigList.elems;
+        return type() == tList1 ? smallList : bigList.elems;
     }
 
     const Value * const * listElems() const
     {
-        return type == tList1 || type == tList2 ? smallList : bigList.elems;
+        return type() == tList1 ? smallList : bigList.elems;
     }
 
     size_t listSize() const
     {
-        return type == tList1 ? 1 : type == tList2 ? 2 : bigList.size;
+        return type() == tList1 ? 1 : tag >> 4;
+    }
+
+    /* Whether the elements of this list are stored in a ListBuffer,
+       which concatenation may extend in place (see
+       EvalState::concatLists()). */
+    bool listGrowable() const
+    {
+        return type() == tListN && (tag & 8);
     }
 };
 
+static_assert(sizeof(Value) == 16, "Value should fit in two words");
+
 
 /* After overwriting an app node, be sure to clear pointers in the
    Value to ensure that the target isn't kept alive unnecessarily. */
 static inline void clearValue(Value & v)
 {
-    v.app.left = v.app.right = 0;
+    v.setType((ValueType) 0);
+    v.app.right = 0;
 }
 
 
 static inline void mkInt(Value & v, NixInt n)
 {
     clearValue(v);
-    v.type = tInt;
+    v.setType(tInt);
     v.integer = n;
 }
 
@@ -188,7 +306,7 @@ static inline void mkInt(Value & v, NixInt n)
 static inline void mkFloat(Value & v, NixFloat n)
 {
     clearValue(v);
-    v.type = tFloat;
+    v.setType(tFloat);
     v.fpoint = n;
 }
 
@@ -196,7 +314,7 @@ static inline void mkFloat(Value & v, NixFloat n)
 static inline void mkBool(Value & v, bool b)
 {
     clearValue(v);
-    v.type = tBool;
+    v.setType(tBool);
     v.boolean = b;
 }
 
@@ -204,31 +322,25 @@ static inline void mkBool(Value & v, bool b)
 static inline void mkNull(Value & v)
 {
     clearValue(v);
-    v.type = tNull;
+    v.setType(tNull);
 }
 
 
 static inline void mkApp(Value & v, Value & left, Value & right)
 {
-    v.type = tApp;
-    v.app.left = &left;
-    v.app.right = &right;
+    v.setApp(&left, &right);
 }
 
 
 static inline void mkPrimOpApp(Value & v, Value & left, Value & right)
 {
-    v.type = tPrimOpApp;
-    v.app.left = &left;
-    v.app.right = &right;
+    v.setPrimOpApp(&left, &right);
 }
 
 
 static inline void mkStringNoCopy(Value & v, const char * s)
 {
-    v.type = tString;
-    v.string.s = s;
-    v.string.context = 0;
+    v.setString(s, nullptr);
 }
 
 
@@ -244,7 +356,7 @@ void mkString(Value & v, const char * s);
 static inline void mkPathNoCopy(Value & v, const char * s)
 {
     clearValue(v);
-    v.type = tPath;
+    v.setType(tPath);
     v.path = s;
 }
 
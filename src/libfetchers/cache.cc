@@ -21,14 +21,40 @@ create table if not exists Cache (
 
 struct CacheImpl : Cache
 {
+    /* A row of the Cache table. */
+    struct Entry
+    {
+        std::string infoJson;
+        Path storePath;
+        bool immutable;
+        time_t timestamp;
+        /* Whether we've already checked that `storePath' is valid and
+           made it a temporary root, so it can't disappear anymore. */
+        bool rooted = false;
+    };
+
     struct State
     {
         SQLite db;
         SQLiteStmt add, lookup;
+
+        /* Entries that have been looked up or added by this process,
+           keyed by the JSON serialisation of the input attributes.
+           Repeated lookups of the same input are answered from here
+           without touching the database. */
+        std::map<std::string, Entry> entries;
+
+        /* Keys of entries that still have to be written to the
+           database. */
+        std::vector<std::string> pending;
     };
 
     Sync<State> _state;
 
+    /* Write pending entries in one transaction when there are this
+       many of them, and at exit. */
+    static constexpr size_t maxPending = 64;
+
     CacheImpl()
     {
         auto state(_state.lock());
@@ -47,6 +73,38 @@ struct CacheImpl : Cache
             "select info, path, immutable, timestamp from Cache where input = ?");
     }
 
+    ~CacheImpl()
+    {
+        try {
+            flush(*_state.lock());
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
+    void flush(State & state)
+    {
+        if (state.pending.empty()) return;
+
+        SQLiteTxn txn(state.db);
+
+        for (auto & key : state.pending) {
+            auto i = state.entries.find(key);
+            /* Dropped by lookupExpired() because the path is gone. */
+            if (i == state.entries.end()) continue;
+            state.add.use()
+                (key)
+                (i->second.infoJson)
+                (i->second.storePath)
+                (i->second.immutable)
+                (i->second.timestamp).exec();
+        }
+
+        txn.commit();
+
+        state.pending.clear();
+    }
+
     void add(
         ref<Store> store,
         const Attrs & inAttrs,
@@ -54,12 +112,21 @@ struct CacheImpl : Cache
         const StorePath & storePath,
         bool immutable) override
     {
-        _state.lock()->add.use()
-            (attrsToJson(inAttrs).dump())
-            (attrsToJson(infoAttrs).dump())
-            (store->printStorePath(storePath))
-            (immutable)
-            (time(0)).exec();
+        auto state(_state.lock());
+
+        auto key = attrsToJson(inAttrs).dump();
+
+        state->entries.insert_or_assign(key, Entry {
+            .infoJson = attrsToJson(infoAttrs).dump(),
+            .storePath = store->printStorePath(storePath),
+            .immutable = immutable,
+            .timestamp = time(0),
+        });
+
+        state->pending.push_back(std::move(key));
+
+        if (state->pending.size() >= maxPending)
+            flush(*state);
     }
 
     std::optional<std::pair<Attrs, StorePath>> lookup(
@@ -83,30 +150,44 @@ struct CacheImpl : Cache
 
         auto inAttrsJson = attrsToJson(inAttrs).dump();
 
-        auto stmt(state->lookup.use()(inAttrsJson));
-        if (!stmt.next()) {
-            debug("did not find cache entry for '%s'", inAttrsJson);
-            return {};
+        auto i = state->entries.find(inAttrsJson);
+
+        if (i == state->entries.end()) {
+            auto stmt(state->lookup.use()(inAttrsJson));
+            if (!stmt.next()) {
+                debug("did not find cache entry for '%s'", inAttrsJson);
+                return {};
+            }
+
+            i = state->entries.emplace(inAttrsJson, Entry {
+                .infoJson = stmt.getStr(0),
+                .storePath = stmt.getStr(1),
+                .immutable = stmt.getInt(2) != 0,
+                .timestamp = stmt.getInt(3),
+            }).first;
         }
 
-        auto infoJson = stmt.getStr(0);
-        auto storePath = store->parseStorePath(stmt.getStr(1));
-        auto immutable = stmt.getInt(2) != 0;
-        auto timestamp = stmt.getInt(3);
+        auto & entry = i->second;
+
+        auto storePath = store->parseStorePath(entry.storePath);
 
-        store->addTempRoot(storePath);
-        if (!store->isValidPath(storePath)) {
-            // FIXME: we could try to substitute 'storePath'.
-            debug("ignoring disappeared cache entry '%s'", inAttrsJson);
-            return {};
+        if (!entry.rooted) {
+            store->addTempRoot(storePath);
+            if (!store->isValidPath(storePath)) {
+                // FIXME: we could try to substitute 'storePath'.
+                debug("ignoring disappeared cache entry '%s'", inAttrsJson);
+                state->entries.erase(i);
+                return {};
+            }
+            entry.rooted = true;
         }
 
         debug("using cache entry '%s' -> '%s', '%s'",
-            inAttrsJson, infoJson, store->printStorePath(storePath));
+            inAttrsJson, entry.infoJson, entry.storePath);
 
         return Result {
-            .expired = !immutable && (settings.tarballTtl.get() == 0 || timestamp + settings.tarballTtl < time(0)),
-            .infoAttrs = jsonToAttrs(nlohmann::json::parse(infoJson)),
+            .expired = !entry.immutable && (settings.tarballTtl.get() == 0 || entry.timestamp + settings.tarballTtl < time(0)),
+            .infoAttrs = jsonToAttrs(nlohmann::json::parse(entry.infoJson)),
             .storePath = std::move(storePath)
         };
     }
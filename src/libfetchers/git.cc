@@ -304,6 +304,11 @@ struct GitInput : Input
                 input->rev = Hash(chomp(readFile(localRefFile)), htSHA1);
         }
 
+        /* Now that we know the ref, check again whether we have it in
+           the store. */
+        if (auto res = getCache()->lookup(store, getImmutableAttrs()))
+            return makeResult(res->first, std::move(res->second));
+
         bool isShallow = chomp(runProgram("git", true, { "-C", repoDir, "rev-parse", "--is-shallow-repository" })) == "true";
 
         if (isShallow && !shallow)
@@ -313,16 +318,11 @@ struct GitInput : Input
 
         printTalkative("using revision %s of repo '%s'", input->rev->gitRev(), actualUrl);
 
-        /* Now that we know the ref, check again whether we have it in
-           the store. */
-        if (auto res = getCache()->lookup(store, getImmutableAttrs()))
-            return makeResult(res->first, std::move(res->second));
-
-        Path tmpDir = createTempDir();
-        AutoDelete delTmpDir(tmpDir, true);
-        PathFilter filter = defaultPathFilter;
+        std::optional<StorePath> storePath;
 
         if (submodules) {
+            Path tmpDir = createTempDir();
+            AutoDelete delTmpDir(tmpDir, true);
             Path tmpGitDir = createTempDir();
             AutoDelete delTmpGitDir(tmpGitDir, true);
 
@@ -337,20 +337,52 @@ struct GitInput : Input
             runProgram("git", true, { "-C", tmpDir, "remote", "add", "origin", actualUrl });
             runProgram("git", true, { "-C", tmpDir, "submodule", "--quiet", "update", "--init", "--recursive" });
 
-            filter = isNotDotGitDirectory;
+            PathFilter filter = isNotDotGitDirectory;
+            storePath = store->addToStore(name, tmpDir, FileIngestionMethod::Recursive, htSHA256, filter);
         } else {
-            // FIXME: should pipe this, or find some better way to extract a
-            // revision.
-            auto source = sinkToSource([&](Sink & sink) {
-                RunOptions gitOptions("git", { "-C", repoDir, "archive", input->rev->gitRev() });
-                gitOptions.standardOut = &sink;
-                runProgram2(gitOptions);
+            /* Different revisions often have the same tree (e.g. after
+               a merge), so look for the tree before exporting it. */
+            auto treeHash = chomp(runProgram("git", true, { "-C", repoDir, "rev-parse", input->rev->gitRev() + "^{tree}" }));
+
+            Attrs treeAttrs({
+                {"type", "git-tree"},
+                {"name", name},
+                {"tree", treeHash},
             });
 
-            unpackTarfile(*source, tmpDir);
-        }
+            if (auto res = getCache()->lookup(store, treeAttrs))
+                storePath = std::move(res->second);
+
+            else {
+                /* Convert the output of 'git archive' straight to a
+                   NAR, rather than unpacking it and reading it back. */
+                auto source = sinkToSource([&](Sink & sink) {
+                    RunOptions gitOptions("git", { "-C", repoDir, "archive", input->rev->gitRev() });
+                    gitOptions.standardOut = &sink;
+                    runProgram2(gitOptions);
+                });
 
-        auto storePath = store->addToStore(name, tmpDir, FileIngestionMethod::Recursive, htSHA256, filter);
+                StringSink sink;
+                unpackTarfileToNar(*source, sink);
+
+                storePath = store->addToStoreFromDump(*sink.s, name);
+
+                /* With the export-subst attribute, 'git archive'
+                   expands placeholders with information about the
+                   commit, so the result doesn't only depend on the
+                   tree. */
+                bool exportSubst = true;
+                try {
+                    runProgram("git", true, { "-C", repoDir, "grep", "-q", "-F", "export-subst", treeHash, "--", "*.gitattributes" });
+                } catch (ExecError & e) {
+                    if (!WIFEXITED(e.status) || WEXITSTATUS(e.status) != 1) throw;
+                    exportSubst = false;
+                }
+
+                if (!exportSubst)
+                    getCache()->add(store, treeAttrs, {}, *storePath, true);
+            }
+        }
 
         auto lastModified = std::stoull(runProgram("git", true, { "-C", repoDir, "log", "-1", "--format=%ct", input->rev->gitRev() }));
 
@@ -368,17 +400,17 @@ struct GitInput : Input
                 store,
                 mutableAttrs,
                 infoAttrs,
-                storePath,
+                *storePath,
                 false);
 
         getCache()->add(
             store,
             getImmutableAttrs(),
             infoAttrs,
-            storePath,
+            *storePath,
             true);
 
-        return makeResult(infoAttrs, std::move(storePath));
+        return makeResult(infoAttrs, std::move(*storePath));
     }
 };
 
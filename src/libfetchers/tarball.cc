@@ -128,29 +128,43 @@ Tree downloadTarball(
             },
         };
 
-    auto res = downloadFile(store, url, name, immutable);
-
     std::optional<StorePath> unpackedStorePath;
     time_t lastModified;
-
-    if (cached && res.etag != "" && getStrAttr(cached->infoAttrs, "etag") == res.etag) {
-        unpackedStorePath = std::move(cached->storePath);
-        lastModified = getIntAttr(cached->infoAttrs, "lastModified");
+    std::string etag;
+
+    /* Convert the tarball straight to a NAR rather than unpacking it
+       into a temporary directory and reading that back. */
+    StringSink nar;
+    std::optional<time_t> mtime;
+
+    if (immutable) {
+        /* An immutable tarball is never revalidated, so there is no
+           point in keeping it in the store: convert it while it's
+           being downloaded. */
+        auto source = sinkToSource([&](Sink & sink) {
+            getFileTransfer()->download(FileTransferRequest(url), sink);
+        });
+        mtime = tarballToNar(*source, nar);
     } else {
-        Path tmpDir = createTempDir();
-        AutoDelete autoDelete(tmpDir, true);
-        unpackTarfile(store->toRealPath(res.storePath), tmpDir);
-        auto members = readDirectory(tmpDir);
-        if (members.size() != 1)
+        auto res = downloadFile(store, url, name, immutable);
+        etag = res.etag;
+        if (cached && res.etag != "" && getStrAttr(cached->infoAttrs, "etag") == res.etag) {
+            unpackedStorePath = std::move(cached->storePath);
+            lastModified = getIntAttr(cached->infoAttrs, "lastModified");
+        } else
+            mtime = tarballToNar(store->toRealPath(res.storePath), nar);
+    }
+
+    if (!unpackedStorePath) {
+        if (!mtime)
             throw nix::Error("tarball '%s' contains an unexpected number of top-level files", url);
-        auto topDir = tmpDir + "/" + members.begin()->name;
-        lastModified = lstat(topDir).st_mtime;
-        unpackedStorePath = store->addToStore(name, topDir, FileIngestionMethod::Recursive, htSHA256, defaultPathFilter, NoRepair);
+        lastModified = *mtime;
+        unpackedStorePath = store->addToStoreFromDump(*nar.s, name);
     }
 
     Attrs infoAttrs({
         {"lastModified", lastModified},
-        {"etag", res.etag},
+        {"etag", etag},
     });
 
     getCache()->add(
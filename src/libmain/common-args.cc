@@ -41,7 +41,7 @@ MixCommonArgs::MixCommonArgs(const string & programName)
 
     addFlag({
         .longName = "log-format",
-        .description = "format of log output; \"raw\", \"internal-json\", \"bar\" "
+        .description = "format of log output; \"raw\", \"internal-json\", \"internal-binary\", \"bar\" "
                         "or \"bar-with-logs\"",
         .labels = {"format"},
         .handler = {[](std::string format) { setLogFormat(format); }},
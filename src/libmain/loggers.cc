@@ -12,6 +12,8 @@ LogFormat parseLogFormat(const std::string & logFormatStr) {
         return LogFormat::rawWithLogs;
     else if (logFormatStr == "internal-json")
         return LogFormat::internalJson;
+    else if (logFormatStr == "internal-binary")
+        return LogFormat::internalBinary;
     else if (logFormatStr == "bar")
         return LogFormat::bar;
     else if (logFormatStr == "bar-with-logs")
@@ -27,6 +29,8 @@ Logger * makeDefaultLogger() {
         return makeSimpleLogger(true);
     case LogFormat::internalJson:
         return makeJSONLogger(*makeSimpleLogger(true));
+    case LogFormat::internalBinary:
+        return makeBinaryLogger();
     case LogFormat::bar:
         return makeProgressBar();
     case LogFormat::barWithLogs:
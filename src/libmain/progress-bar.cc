@@ -5,6 +5,7 @@
 #include "names.hh"
 
 #include <atomic>
+#include <deque>
 #include <map>
 #include <thread>
 #include <iostream>
@@ -69,12 +70,27 @@ private:
 
         uint64_t corruptedPaths = 0, untrustedPaths = 0;
 
+        /* Recent (time, bytes downloaded) samples, used to show the
+           download speed. */
+        std::deque<std::pair<std::chrono::steady_clock::time_point, uint64_t>> downloadSamples;
+
         bool active = true;
         bool haveUpdate = true;
     };
 
     Sync<State> state_;
 
+    /* Serialises writes to stderr. This is separate from `state_' so
+       that threads reporting activity updates don't wait while the
+       status line is written to a slow terminal. Lock order is
+       `state_' before `output_'. */
+    struct Output
+    {
+        bool active = true;
+    };
+
+    Sync<Output> output_;
+
     std::thread updateThread;
 
     std::condition_variable quitCV, updateCV;
@@ -89,13 +105,31 @@ public:
         , isTTY(isTTY)
     {
         state_.lock()->active = isTTY;
+        output_.lock()->active = isTTY;
+        /* Redraw at most every 50 ms, coalescing all updates that
+           arrived in the meantime. Only rendering the status line
+           happens under the state lock. */
         updateThread = std::thread([&]() {
-            auto state(state_.lock());
-            while (state->active) {
-                if (!state->haveUpdate)
-                    state.wait(updateCV);
-                draw(*state);
-                state.wait_for(quitCV, std::chrono::milliseconds(50));
+            while (true) {
+                std::string line;
+                {
+                    auto state(state_.lock());
+                    if (!state->active) break;
+                    if (!state->haveUpdate)
+                        state.wait(updateCV);
+                    if (!state->active) break;
+                    line = render(*state);
+                }
+                {
+                    auto output(output_.lock());
+                    if (output->active)
+                        writeToStderr(line);
+                }
+                {
+                    auto state(state_.lock());
+                    if (!state->active) break;
+                    state.wait_for(quitCV, std::chrono::milliseconds(50));
+                }
             }
         });
     }
@@ -111,7 +145,11 @@ public:
         auto state(state_.lock());
         if (!state->active) return;
         state->active = false;
-        writeToStderr("\r\e[K");
+        {
+            auto output(output_.lock());
+            output->active = false;
+            writeToStderr("\r\e[K");
+        }
         updateCV.notify_one();
         quitCV.notify_one();
     }
@@ -139,8 +177,9 @@ public:
     void log(State & state, Verbosity lvl, const std::string & s)
     {
         if (state.active) {
+            auto output(output_.lock());
             writeToStderr("\r\e[K" + filterANSIEscapes(s, !isTTY) + ANSI_NORMAL "\n");
-            draw(state);
+            update(state);
         } else {
             auto s2 = s + ANSI_NORMAL "\n";
             if (!isTTY) s2 = filterANSIEscapes(s2, true);
@@ -318,16 +357,19 @@ public:
         }
     }
 
+    /* Cheap enough to call on every event: the update thread only
+       needs waking up when it has nothing pending. */
     void update(State & state)
     {
+        if (state.haveUpdate) return;
         state.haveUpdate = true;
         updateCV.notify_one();
     }
 
-    void draw(State & state)
+    /* Return the escape sequence that redraws the status line. */
+    std::string render(State & state)
     {
         state.haveUpdate = false;
-        if (!state.active) return;
 
         std::string line;
 
@@ -362,7 +404,7 @@ public:
         auto width = getWindowSize().second;
         if (width <= 0) width = std::numeric_limits<decltype(width)>::max();
 
-        writeToStderr("\r" + filterANSIEscapes(line, false, width) + "\e[K");
+        return "\r" + filterANSIEscapes(line, false, width) + "\e[K";
     }
 
     std::string getStatus(State & state)
@@ -428,7 +470,29 @@ public:
             if (!s2.empty()) { res += " ("; res += s2; res += ')'; }
         }
 
-        showActivity(actFileTransfer, "%s MiB DL", "%.1f", MiB);
+        {
+            auto s = renderActivity(actFileTransfer, "%s MiB DL", "%.1f", MiB);
+            if (!s.empty()) {
+                auto & act = state.activitiesByType[actFileTransfer];
+                uint64_t done = act.done;
+                for (auto & j : act.its)
+                    done += j.second->done;
+
+                /* Show the speed over the last few seconds. */
+                auto now = std::chrono::steady_clock::now();
+                auto & samples = state.downloadSamples;
+                samples.emplace_back(now, done);
+                while (samples.size() > 1 && now - samples.front().first > std::chrono::seconds(5))
+                    samples.pop_front();
+
+                auto elapsed = std::chrono::duration<double>(now - samples.front().first).count();
+                if (!act.its.empty() && elapsed >= 1 && done >= samples.front().second)
+                    s += fmt(" at %.1f MiB/s", (done - samples.front().second) / elapsed / MiB);
+
+                if (!res.empty()) res += ", ";
+                res += s;
+            }
+        }
 
         {
             auto s = renderActivity(actOptimiseStore, "%s paths optimised");
@@ -459,9 +523,10 @@ public:
     {
         auto state(state_.lock());
         if (state->active) {
+            auto output(output_.lock());
             std::cerr << "\r\e[K";
             Logger::writeToStdout(s);
-            draw(*state);
+            update(*state);
         } else {
             Logger::writeToStdout(s);
         }
@@ -483,9 +548,10 @@ void startProgressBar(bool printBuildLogs)
 
 void stopProgressBar()
 {
-    auto progressBar = dynamic_cast<ProgressBar *>(logger);
-    if (progressBar) progressBar->stop();
-
+    /* Go through the virtual stop() rather than casting to
+       ProgressBar, since the progress bar may be wrapped (e.g. by
+       the activity trace logger). Other loggers ignore stop(). */
+    logger->stop();
 }
 
 }
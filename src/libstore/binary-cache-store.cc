@@ -1,6 +1,7 @@
 #include "archive.hh"
 #include "binary-cache-store.hh"
 #include "compression.hh"
+#include "crypto.hh"
 #include "derivations.hh"
 #include "fs-accessor.hh"
 #include "globals.hh"
@@ -9,15 +10,21 @@
 #include "remote-fs-accessor.hh"
 #include "nar-info-disk-cache.hh"
 #include "nar-accessor.hh"
+#include "nar-chunks.hh"
+#include "names.hh"
 #include "json.hh"
 #include "thread-pool.hh"
 
+#include <atomic>
 #include <chrono>
+#include <fstream>
 #include <future>
 #include <regex>
 
 #include <nlohmann/json.hpp>
 
+#include <fcntl.h>
+
 namespace nix {
 
 BinaryCacheStore::BinaryCacheStore(const Params & params)
@@ -37,8 +44,13 @@ void BinaryCacheStore::init()
 
     auto cacheInfo = getFile(cacheInfoFile);
     if (!cacheInfo) {
-        upsertFile(cacheInfoFile, "StoreDir: " + storeDir + "\n", "text/x-nix-cache-info");
+        upsertFile(cacheInfoFile,
+            "StoreDir: " + storeDir + "\n"
+            + (writeClosureManifest ? "ClosureManifests: 1\n" : "")
+            + (writePresenceFilter ? "PresenceFilter: " + presenceFilterFile() + "\n" : ""),
+            "text/x-nix-cache-info");
     } else {
+        bool havePresenceFilter = false;
         for (auto & line : tokenizeString<Strings>(*cacheInfo, "\n")) {
             size_t colon= line.find(':');
             if (colon ==std::string::npos) continue;
@@ -52,8 +64,21 @@ void BinaryCacheStore::init()
                 wantMassQuery.setDefault(value == "1" ? "true" : "false");
             } else if (name == "Priority") {
                 priority.setDefault(fmt("%d", std::stoi(value)));
+            } else if (name == "ClosureManifests") {
+                closureManifests.setDefault(value == "1" ? "true" : "false");
+            } else if (name == "PresenceFilter") {
+                presenceFilter.setDefault(value);
+                havePresenceFilter = true;
             }
         }
+
+        /* Start publishing a presence filter for an existing cache. */
+        if (writePresenceFilter && !havePresenceFilter) {
+            auto s = *cacheInfo;
+            if (!s.empty() && s.back() != '\n') s += "\n";
+            upsertFile(cacheInfoFile, s + "PresenceFilter: " + presenceFilterFile() + "\n",
+                "text/x-nix-cache-info");
+        }
     }
 }
 
@@ -96,30 +121,151 @@ std::string BinaryCacheStore::narInfoFileFor(const StorePath & storePath)
     return std::string(storePath.hashPart()) + ".narinfo";
 }
 
+std::string BinaryCacheStore::closureManifestFileFor(const StorePath & storePath)
+{
+    return std::string(storePath.hashPart()) + ".closure";
+}
+
+std::string BinaryCacheStore::presenceFilterFile()
+{
+    return presenceFilter.get().empty() ? "presence-filter" : presenceFilter.get();
+}
+
+bool BinaryCacheStore::mayHavePath(const StorePath & path)
+{
+    if (writePresenceFilter || presenceFilter.get().empty()) return true;
+
+    auto state(presenceFilterState.lock());
+
+    /* Since the filter may lag behind the cache, trust it only as
+       long as negative lookups in the NAR info disk cache. */
+    auto ttl = std::chrono::seconds(settings.ttlNegativeNarInfoCache);
+    auto now = std::chrono::steady_clock::now();
+
+    if (!state->fetched || (ttl.count() && now > *state->fetched + ttl)) {
+        state->fetched = now;
+        state->filter.reset();
+
+        /* Keep a copy on disk, so that short-lived processes don't
+           each have to download it. */
+        Path cacheFile = fmt("%s/nix/presence-filters/%s", getCacheDir(),
+            hashString(htSHA256, getUri() + "\n" + presenceFilter.get()).to_string(Base32, false));
+        auto whence = getUri() + "/" + presenceFilter.get();
+
+        try {
+            struct stat st;
+            if (stat(cacheFile.c_str(), &st) == 0
+                && st.st_mtime + settings.ttlNegativeNarInfoCache > time(0))
+                state->filter.emplace(readFile(cacheFile), whence);
+            else if (auto data = getFile(presenceFilter)) {
+                state->filter.emplace(*data, whence);
+                createDirs(dirOf(cacheFile));
+                Path tmp = fmt("%s.tmp.%d", cacheFile, getpid());
+                writeFile(tmp, *data);
+                if (rename(tmp.c_str(), cacheFile.c_str()) == -1)
+                    throw SysError("renaming '%s' to '%s'", tmp, cacheFile);
+            }
+        } catch (Error & e) {
+            warn("not using the presence filter of '%s': %s", getUri(), e.msg());
+        }
+    }
+
+    if (!state->filter || state->filter->mayContain(path.hashPart())) return true;
+
+    stats.narInfoReadAverted++;
+    return false;
+}
+
+void BinaryCacheStore::addToPresenceFilter(const StorePath & path)
+{
+    auto state(presenceFilterState.lock());
+    auto file = presenceFilterFile();
+
+    /* Note that concurrent writers may overwrite each other's
+       additions. The periodic rebuild repairs that. */
+    if (!state->filter && !state->fetched) {
+        state->fetched = std::chrono::steady_clock::now();
+        try {
+            if (auto data = getFile(file))
+                state->filter.emplace(*data, getUri() + "/" + file);
+        } catch (Error & e) {
+            warn("discarding the presence filter of '%s': %s", getUri(), e.msg());
+        }
+    }
+
+    auto & filter(state->filter);
+
+    if (!filter
+        || filter->count >= filter->capacity()
+        || time(0) >= filter->timestamp + (time_t) presenceFilterRefresh)
+    {
+        if (!state->cannotList) {
+            try {
+                auto paths = queryAllValidPaths();
+                /* Leave room for the paths added until the next
+                   rebuild. */
+                PresenceFilter fresh(2 * paths.size() + 1024);
+                for (auto & p : paths)
+                    fresh.insert(p.hashPart());
+                filter = std::move(fresh);
+                debug("rebuilt the presence filter of '%s' with %d paths", getUri(), paths.size());
+            } catch (Error & e) {
+                warn("cannot list the contents of '%s' to build its presence filter: %s",
+                    getUri(), e.msg());
+                state->cannotList = true;
+            }
+        }
+        if (!filter) return;
+    }
+
+    if (!filter->mayContain(path.hashPart()))
+        filter->insert(path.hashPart());
+
+    upsertFile(file, filter->to_string(), "application/x-nix-presence-filter");
+}
+
 void BinaryCacheStore::writeNarInfo(ref<NarInfo> narInfo)
 {
     auto narInfoFile = narInfoFileFor(narInfo->path);
 
     upsertFile(narInfoFile, narInfo->to_string(*this), "text/x-nix-narinfo");
 
+    if (writePresenceFilter)
+        addToPresenceFilter(narInfo->path);
+
     std::string hashPart(narInfo->path.hashPart());
 
-    {
-        auto state_(state.lock());
-        state_->pathInfoCache.upsert(hashPart, PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
-    }
+    pathInfoCache.upsert(hashPart, PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
 
     if (diskCache)
         diskCache->upsertNarInfo(getUri(), hashPart, std::shared_ptr<NarInfo>(narInfo));
 }
 
+void BinaryCacheStore::upsertFile(const std::string & path,
+    std::shared_ptr<std::basic_iostream<char>> istream,
+    const std::string & mimeType)
+{
+    upsertFile(path, std::string(std::istreambuf_iterator<char>(*istream), {}), mimeType);
+}
+
+void BinaryCacheStore::upsertFileFrom(const std::string & path,
+    const Path & file,
+    const std::string & mimeType)
+{
+    upsertFile(path,
+        std::make_shared<std::fstream>(file, std::ios_base::in | std::ios_base::binary),
+        mimeType);
+}
+
 void BinaryCacheStore::addToStore(const ValidPathInfo & info, Source & narSource,
     RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
 {
-    // FIXME: See if we can use the original source to reduce memory usage.
-    auto nar = make_ref<std::string>(narSource.drain());
-
-    if (!repair && isValidPath(info.path)) return;
+    if (!repair && isValidPath(info.path)) {
+        /* Consume the NAR. */
+        ParseSink parseSink;
+        parseDump(parseSink, narSource);
+        return;
+    }
 
     /* Verify that all references are valid. This may do some .narinfo
        reads, but typically they'll already be cached. */
@@ -132,22 +278,91 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, Source & narSource
                 printStorePath(info.path), printStorePath(ref));
         }
 
-    assert(nar->compare(0, narMagic.size(), narMagic) == 0);
+    auto accessor_ = std::dynamic_pointer_cast<RemoteFSAccessor>(accessor);
+
+    /* Stream the NAR through the hasher, the indexer and the
+       compressor into a temporary file, so that memory usage doesn't
+       depend on the size of the NAR. Only if the caller wants the NAR
+       in its accessor's cache do we keep a copy in memory. */
+    AutoCloseFD fdTemp;
+    Path fnTemp;
+    if (auto dir = stagingDir(); dir != "") {
+        static std::atomic<uint64_t> counter{0};
+        fnTemp = fmt("%s/.staging.%d.%d", dir, getpid(), counter++);
+        fdTemp = open(fnTemp.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (!fdTemp) throw SysError("creating file '%s'", fnTemp);
+    } else
+        std::tie(fdTemp, fnTemp) = createTempFile();
+    AutoDelete autoDelete(fnTemp, false);
+
+    FdSink fileSink(fdTemp.get());
+    HashSink fileHashSink(htSHA256);
+    LambdaSink teeSink([&](const unsigned char * data, size_t len) {
+        fileSink(data, len);
+        fileHashSink(data, len);
+    });
+
+    /* If chunking is enabled, upload the NAR as content-defined
+       chunks, individually compressed and named by their hash, and
+       skip chunks that the cache already has. */
+    std::optional<ChunkManifest> chunkManifest;
+    std::unique_ptr<ChunkingSink> chunker;
+    std::shared_ptr<CompressionSink> compressionSink;
+
+    if (narChunkSize) {
+        chunkManifest.emplace(compression);
+        chunker = std::make_unique<ChunkingSink>(narChunkSize, [&](std::string_view chunk_) {
+            std::string chunk(chunk_);
+            auto hash = hashString(htSHA256, chunk);
+            chunkManifest->chunks.emplace_back(hash, chunk.size());
+            auto chunkFile = chunkFileFor(hash, compression);
+            if (repair || !fileExists(chunkFile))
+                upsertFile(chunkFile,
+                    *nix::compress(compression, chunk, false, compressionLevel, compressionLongWindow),
+                    "application/x-nix-nar-chunk");
+        });
+    } else
+        compressionSink = makeCompressionSink(compression, teeSink, parallelCompression,
+            compressionLevel, compressionLongWindow);
+
+    HashSink narHashSink(htSHA256);
+    auto nar = accessor_ || deltaBaseStore != "" ? std::make_shared<std::string>() : nullptr;
+
+    auto now1 = std::chrono::steady_clock::now();
+
+    LambdaSource teeSource([&](unsigned char * data, size_t len) {
+        size_t n = narSource.read(data, len);
+        narHashSink(data, n);
+        if (chunker)
+            (*chunker)(data, n);
+        else
+            (*compressionSink)(data, n);
+        if (nar) nar->append((const char *) data, n);
+        return n;
+    });
+
+    auto narAccessor = makeNarAccessor(teeSource);
+
+    if (chunker)
+        chunker->finish();
+    else {
+        compressionSink->finish();
+        fileSink.flush();
+    }
+
+    auto now2 = std::chrono::steady_clock::now();
 
     auto narInfo = make_ref<NarInfo>(info);
 
-    narInfo->narSize = nar->size();
-    narInfo->narHash = hashString(htSHA256, *nar);
+    std::tie(narInfo->narHash, narInfo->narSize) = narHashSink.finish();
 
     if (info.narHash && info.narHash != narInfo->narHash)
         throw Error("refusing to copy corrupted path '%1%' to binary cache", printStorePath(info.path));
 
-    auto accessor_ = std::dynamic_pointer_cast<RemoteFSAccessor>(accessor);
-
-    auto narAccessor = makeNarAccessor(nar);
-
-    if (accessor_)
-        accessor_->addToCache(printStorePath(info.path), *nar, narAccessor);
+    if (accessor_) {
+        auto narAccessor2 = makeNarAccessor(ref<std::string>(nar));
+        accessor_->addToCache(printStorePath(info.path), *nar, narAccessor2);
+    }
 
     /* Optionally write a JSON file containing a listing of the
        contents of the NAR. */
@@ -167,25 +382,57 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, Source & narSource
         upsertFile(std::string(info.path.to_string()) + ".ls", jsonOut.str(), "application/json");
     }
 
-    /* Compress the NAR. */
-    narInfo->compression = compression;
-    auto now1 = std::chrono::steady_clock::now();
-    auto narCompressed = compress(compression, *nar, parallelCompression);
-    auto now2 = std::chrono::steady_clock::now();
-    narInfo->fileHash = hashString(htSHA256, *narCompressed);
-    narInfo->fileSize = narCompressed->size();
-
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
-    printMsg(lvlTalkative, "copying path '%1%' (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache",
-        printStorePath(narInfo->path), narInfo->narSize,
-        ((1.0 - (double) narCompressed->size() / nar->size()) * 100.0),
-        duration);
 
-    narInfo->url = "nar/" + narInfo->fileHash.to_string(Base32, false) + ".nar"
-        + (compression == "xz" ? ".xz" :
-           compression == "bzip2" ? ".bz2" :
-           compression == "br" ? ".br" :
-           "");
+    std::string chunkManifestS;
+
+    if (chunkManifest) {
+        /* The URL points to the chunk manifest. The download size
+           depends on which chunks the client already has, so leave it
+           unknown. */
+        chunkManifestS = chunkManifest->to_string();
+        narInfo->compression = "chunked";
+        narInfo->fileHash = hashString(htSHA256, chunkManifestS);
+        narInfo->fileSize = 0;
+        narInfo->url = "nar/" + narInfo->fileHash.to_string(Base32, false) + ".chunks";
+
+        printMsg(lvlTalkative, "copying path '%1%' (%2% bytes, %3% chunks in %4% ms) to binary cache",
+            printStorePath(narInfo->path), narInfo->narSize, chunkManifest->chunks.size(), duration);
+    } else {
+        narInfo->compression = compression;
+        std::tie(narInfo->fileHash, narInfo->fileSize) = fileHashSink.finish();
+
+        printMsg(lvlTalkative, "copying path '%1%' (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache",
+            printStorePath(narInfo->path), narInfo->narSize,
+            ((1.0 - (double) narInfo->fileSize / narInfo->narSize) * 100.0),
+            duration);
+
+        narInfo->url = "nar/" + narInfo->fileHash.to_string(Base32, false) + ".nar"
+            + compressionExtension(compression);
+    }
+
+    /* Optionally upload a binary delta against an older version of
+       this path, so that clients that have it can download just the
+       difference. */
+    if (auto base = deltaBaseStore != "" ? findDeltaBase(info.path) : std::nullopt) {
+        auto & [baseStore, basePath] = *base;
+        StringSink baseNar;
+        baseStore->narFromPath(basePath, baseNar);
+        auto delta = makeDelta(*baseNar.s, *nar, compressionLevel);
+        if (chunkManifest || delta->size() < narInfo->fileSize) {
+            auto deltaUrl = "delta/" + hashString(htSHA256, *delta).to_string(Base32, false) + ".zst";
+            if (repair || !fileExists(deltaUrl))
+                upsertFile(deltaUrl, *delta, "application/x-nix-delta");
+            printMsg(lvlTalkative, "created delta of %d bytes from '%s' to '%s'",
+                delta->size(), printStorePath(basePath), printStorePath(info.path));
+            narInfo->deltas.push_back(NarInfo::Delta {
+                .base = basePath,
+                .baseNarHash = baseStore->queryPathInfo(basePath)->narHash,
+                .url = deltaUrl,
+                .fileSize = delta->size()
+            });
+        }
+    }
 
     /* Optionally maintain an index of DWARF debug info files
        consisting of JSON files named 'debuginfo/<build-id>' that
@@ -247,12 +494,15 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, Source & narSource
     /* Atomically write the NAR file. */
     if (repair || !fileExists(narInfo->url)) {
         stats.narWrite++;
-        upsertFile(narInfo->url, *narCompressed, "application/x-nix-nar");
+        if (chunkManifest)
+            upsertFile(narInfo->url, chunkManifestS, "text/x-nix-chunks");
+        else
+            upsertFileFrom(narInfo->url, fnTemp, "application/x-nix-nar");
     } else
         stats.narWriteAverted++;
 
-    stats.narWriteBytes += nar->size();
-    stats.narWriteCompressedBytes += narCompressed->size();
+    stats.narWriteBytes += narInfo->narSize;
+    stats.narWriteCompressedBytes += narInfo->fileSize;
     stats.narWriteCompressionTimeMs += duration;
 
     /* Atomically write the NAR info file.*/
@@ -260,6 +510,25 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, Source & narSource
 
     writeNarInfo(narInfo);
 
+    /* Optionally write a closure manifest: the .narinfo files of all
+       paths in the closure, separated by empty lines. This allows
+       clients to get the info about an entire closure in a single
+       request. */
+    if (writeClosureManifest) {
+        StorePathSet closure;
+        computeFSClosure(info.path, closure);
+
+        std::string manifest;
+        for (auto & path : closure) {
+            auto pathInfo = std::dynamic_pointer_cast<const NarInfo>(queryPathInfo(path).get_ptr());
+            if (!pathInfo) continue;
+            if (!manifest.empty()) manifest += "\n";
+            manifest += pathInfo->to_string(*this);
+        }
+
+        upsertFile(closureManifestFileFor(info.path), manifest, "text/x-nix-closure");
+    }
+
     stats.narInfoWrite++;
 }
 
@@ -268,9 +537,87 @@ bool BinaryCacheStore::isValidPathUncached(const StorePath & storePath)
     // FIXME: this only checks whether a .narinfo with a matching hash
     // part exists. So ‘f4kb...-foo’ matches ‘f4kb...-bar’, even
     // though they shouldn't. Not easily fixed.
+    if (!mayHavePath(storePath)) return false;
     return fileExists(narInfoFileFor(storePath));
 }
 
+void BinaryCacheStore::prefetchClosureInfos(const StorePathSet & paths)
+{
+    if (!closureManifests) return;
+
+    StorePathSet todo;
+    {
+        auto prefetched(closuresPrefetched.lock());
+        for (auto & path : paths)
+            if (prefetched->insert(path).second)
+                todo.insert(path);
+    }
+
+    if (todo.empty()) return;
+
+    /* Fetch the manifests in parallel. */
+    std::vector<std::pair<StorePath, std::future<std::shared_ptr<std::string>>>> manifests;
+
+    for (auto & path : todo) {
+        auto promise = std::make_shared<std::promise<std::shared_ptr<std::string>>>();
+        manifests.emplace_back(path, promise->get_future());
+        getFile(closureManifestFileFor(path),
+            {[promise](std::future<std::shared_ptr<std::string>> result) {
+                try {
+                    promise->set_value(result.get());
+                } catch (...) {
+                    promise->set_exception(std::current_exception());
+                }
+            }});
+    }
+
+    for (auto & [path, manifest_] : manifests) {
+        auto whence = closureManifestFileFor(path);
+        try {
+            auto manifest = manifest_.get();
+            if (!manifest) continue;
+
+            size_t count = 0;
+
+            std::vector<std::pair<std::string, std::shared_ptr<const ValidPathInfo>>> diskCacheInfos;
+
+            for (size_t pos = 0; pos < manifest->size(); ) {
+                auto end = manifest->find("\n\n", pos);
+                if (end == std::string::npos) end = manifest->size();
+                auto s = manifest->substr(pos, end - pos);
+                if (!hasSuffix(s, "\n")) s += "\n";
+                pos = end + 2;
+                auto narInfo = std::make_shared<NarInfo>(*this, s, whence);
+                std::string hashPart(narInfo->path.hashPart());
+
+                pathInfoCache.upsert(hashPart, PathInfoCacheValue { .value = narInfo });
+
+                diskCacheInfos.emplace_back(hashPart, narInfo);
+
+                closuresPrefetched.lock()->insert(narInfo->path);
+                count++;
+            }
+
+            if (diskCache)
+                diskCache->upsertNarInfos(getUri(), diskCacheInfos);
+
+            /* Check the signatures of the whole closure at once, so
+               that the substitution goals find them verified. */
+            if (settings.requireSigs && !isTrusted) {
+                std::vector<std::shared_ptr<const ValidPathInfo>> infos;
+                for (auto & i : diskCacheInfos) infos.push_back(i.second);
+                ValidPathInfo::checkSignatures(*this, infos, getDefaultPublicKeys());
+            }
+
+            debug("got info about %d paths from '%s' in '%s'", count, whence, getUri());
+
+        } catch (Error & e) {
+            /* Manifests are only an optimisation. */
+            debug("cannot use '%s' in '%s': %s", whence, getUri(), e.what());
+        }
+    }
+}
+
 void BinaryCacheStore::narFromPath(const StorePath & storePath, Sink & sink)
 {
     auto info = queryPathInfo(storePath).cast<const NarInfo>();
@@ -282,21 +629,181 @@ void BinaryCacheStore::narFromPath(const StorePath & storePath, Sink & sink)
         narSize += len;
     });
 
-    auto decompressor = makeDecompressionSink(info->compression, wrapperSink);
-
     try {
-        getFile(info->url, *decompressor);
+        if (info->compression == "chunked")
+            narFromChunks(*info, wrapperSink);
+        else {
+            auto decompressor = makeDecompressionSink(info->compression, wrapperSink, true);
+            getFile(info->url, *decompressor);
+            decompressor->finish();
+        }
     } catch (NoSuchBinaryCacheFile & e) {
         throw SubstituteGone(e.info());
     }
 
-    decompressor->finish();
-
     stats.narRead++;
     //stats.narReadCompressedBytes += nar->size(); // FIXME
     stats.narReadBytes += narSize;
 }
 
+void BinaryCacheStore::narFromPathUsingDeltas(const StorePath & storePath, Store & baseStore, Sink & sink)
+{
+#if HAVE_ZSTD
+    auto info = queryPathInfo(storePath).cast<const NarInfo>();
+
+    /* Only use bases that are cheap to read, and whose contents are
+       the ones the delta was made against. */
+    std::vector<const NarInfo::Delta *> candidates;
+    if (useDeltas && dynamic_cast<LocalFSStore *>(&baseStore))
+        for (auto & delta : info->deltas)
+            if (baseStore.isValidPath(delta.base)
+                && baseStore.queryPathInfo(delta.base)->narHash == delta.baseNarHash)
+                candidates.push_back(&delta);
+
+    std::sort(candidates.begin(), candidates.end(),
+        [](const NarInfo::Delta * a, const NarInfo::Delta * b) { return a->fileSize < b->fileSize; });
+
+    for (auto delta : candidates) {
+        try {
+            auto deltaData = getFile(delta->url);
+            if (!deltaData) continue;
+
+            StringSink baseNar;
+            baseStore.narFromPath(delta->base, baseNar);
+
+            auto nar = applyDelta(*baseNar.s, *deltaData);
+            if (hashString(htSHA256, *nar) != info->narHash) {
+                warn("delta '%s' in binary cache '%s' does not produce the expected NAR", delta->url, getUri());
+                continue;
+            }
+
+            debug("reconstructed '%s' from '%s' using a %d-byte delta",
+                printStorePath(storePath), printStorePath(delta->base), deltaData->size());
+
+            stats.narRead++;
+            stats.narReadBytes += nar->size();
+            sink(*nar);
+            return;
+        } catch (Error & e) {
+            warn("unable to use delta '%s' from binary cache '%s': %s", delta->url, getUri(), e.what());
+        }
+    }
+#endif
+
+    narFromPath(storePath, sink);
+}
+
+std::optional<std::pair<ref<Store>, StorePath>> BinaryCacheStore::findDeltaBase(const StorePath & path)
+{
+    std::multimap<std::string, StorePath>::const_iterator begin, end;
+
+    auto state(deltaBases.lock());
+
+    if (!*state) {
+        DeltaBases bases;
+        bases.store = openStore(deltaBaseStore).get_ptr();
+        for (auto & p : bases.store->queryAllValidPaths())
+            bases.byName.emplace(DrvName(p.name()).name, p);
+        *state = std::move(bases);
+    }
+
+    DrvName name(path.name());
+    if (name.version.empty()) return std::nullopt;
+
+    std::optional<StorePath> best;
+    std::string bestVersion;
+
+    std::tie(begin, end) = (*state)->byName.equal_range(name.name);
+
+    for (auto i = begin; i != end; ++i) {
+        auto & candidate = i->second;
+        if (candidate == path) continue;
+        DrvName candidateName(candidate.name());
+        if (candidateName.version.empty()
+            || compareVersions(candidateName.version, name.version) >= 0
+            || (best && compareVersions(candidateName.version, bestVersion) <= 0))
+            continue;
+        if (!isValidPath(candidate)) continue;
+        best = candidate;
+        bestVersion = candidateName.version;
+    }
+
+    if (!best) return std::nullopt;
+    return std::make_pair(ref<Store>((*state)->store), *best);
+}
+
+void BinaryCacheStore::narFromChunks(const NarInfo & info, Sink & sink)
+{
+    auto manifestS = getFile(info.url);
+    if (!manifestS)
+        throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", info.url, getUri());
+
+    if (hashString(htSHA256, *manifestS) != info.fileHash)
+        throw Error("chunk manifest '%s' in binary cache '%s' is corrupt", info.url, getUri());
+
+    ChunkManifest manifest(*manifestS, getUri() + "/" + info.url);
+
+    createDirs(chunkCache);
+
+    /* Download missing chunks with a bounded number of requests in
+       flight, but write them to the sink in order. */
+    static const size_t window = 16;
+
+    std::vector<std::optional<std::future<std::shared_ptr<std::string>>>> pending(manifest.chunks.size());
+
+    auto cachePathFor = [&](const Hash & hash) {
+        return chunkCache.get() + "/" + hash.to_string(Base32, false);
+    };
+
+    auto startDownload = [&](size_t n) {
+        if (n >= manifest.chunks.size() || pending[n]) return;
+        auto & hash = manifest.chunks[n].first;
+        if (pathExists(cachePathFor(hash))) return;
+        auto promise = std::make_shared<std::promise<std::shared_ptr<std::string>>>();
+        pending[n] = promise->get_future();
+        getFile(chunkFileFor(hash, manifest.compression),
+            {[promise](std::future<std::shared_ptr<std::string>> fut) {
+                try {
+                    promise->set_value(fut.get());
+                } catch (...) {
+                    promise->set_exception(std::current_exception());
+                }
+            }});
+    };
+
+    for (size_t n = 0; n < manifest.chunks.size(); ++n) {
+        for (size_t m = n; m < n + window; ++m)
+            startDownload(m);
+
+        auto & [hash, size] = manifest.chunks[n];
+        auto cachePath = cachePathFor(hash);
+
+        std::string chunk;
+
+        if (pending[n]) {
+            auto data = pending[n]->get();
+            pending[n].reset();
+            if (!data)
+                throw NoSuchBinaryCacheFile("chunk '%s' does not exist in binary cache '%s'",
+                    hash.to_string(Base32, false), getUri());
+            chunk = *decompress(manifest.compression, *data);
+            if (chunk.size() != size || hashString(htSHA256, chunk) != hash)
+                throw Error("chunk '%s' in binary cache '%s' is corrupt",
+                    hash.to_string(Base32, false), getUri());
+            auto tmp = cachePath + ".tmp." + std::to_string(getpid());
+            writeFile(tmp, chunk);
+            if (rename(tmp.c_str(), cachePath.c_str()) == -1)
+                throw SysError("renaming '%s' to '%s'", tmp, cachePath);
+        } else {
+            chunk = readFile(cachePath);
+            if (chunk.size() != size)
+                throw Error("cached chunk '%s' has the wrong size", cachePath);
+        }
+
+        sink(chunk);
+    }
+}
+
 void BinaryCacheStore::queryPathInfoUncached(const StorePath & storePath,
     Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
 {
@@ -306,6 +813,12 @@ void BinaryCacheStore::queryPathInfoUncached(const StorePath & storePath,
         fmt("querying info about '%s' on '%s'", storePathS, uri), Logger::Fields{storePathS, uri});
     PushActivity pact(act->id);
 
+    try {
+        if (!mayHavePath(storePath)) return callback(nullptr);
+    } catch (...) {
+        return callback.rethrow();
+    }
+
     auto narInfoFile = narInfoFileFor(storePath);
 
     auto callbackPtr = std::make_shared<decltype(callback)>(std::move(callback));
@@ -374,7 +887,7 @@ StorePath BinaryCacheStore::addTextToStore(const string & name, const string & s
 
 ref<FSAccessor> BinaryCacheStore::getFSAccessor()
 {
-    return make_ref<RemoteFSAccessor>(ref<Store>(shared_from_this()), localNarCache);
+    return make_ref<RemoteFSAccessor>(ref<Store>(shared_from_this()), localNarCache, localNarCacheSegmentsSize);
 }
 
 void BinaryCacheStore::addSignatures(const StorePath & storePath, const StringSet & sigs)
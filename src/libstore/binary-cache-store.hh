@@ -4,8 +4,11 @@
 #include "store-api.hh"
 
 #include "pool.hh"
+#include "presence-filter.hh"
 
 #include <atomic>
+#include <chrono>
+#include <iostream>
 
 namespace nix {
 
@@ -15,18 +18,83 @@ class BinaryCacheStore : public Store
 {
 public:
 
-    const Setting<std::string> compression{this, "xz", "compression", "NAR compression method ('xz', 'bzip2', or 'none')"};
+    const Setting<std::string> compression{this, "xz", "compression", "NAR compression method ('xz', 'bzip2', 'br', 'zstd', or 'none')"};
     const Setting<bool> writeNARListing{this, false, "write-nar-listing", "whether to write a JSON file listing the files in each NAR"};
     const Setting<bool> writeDebugInfo{this, false, "index-debug-info", "whether to index DWARF debug info files by build ID"};
     const Setting<Path> secretKeyFile{this, "", "secret-key", "path to secret key used to sign the binary cache"};
     const Setting<Path> localNarCache{this, "", "local-nar-cache", "path to a local cache of NARs"};
+    const Setting<uint64_t> localNarCacheSegmentsSize{this, 256 * 1024 * 1024, "local-nar-cache-segments-size",
+        "maximum total size of the parts of NARs fetched by byte range that are kept in 'local-nar-cache'"};
     const Setting<bool> parallelCompression{this, false, "parallel-compression",
-        "enable multi-threading compression, available for xz only currently"};
+        "enable multi-threading compression, available for xz and zstd only currently"};
+    const Setting<int> compressionLevel{this, -1, "compression-level",
+        "NAR compression level (-1 for the method's default)"};
+    const Setting<bool> compressionLongWindow{this, false, "compression-long-window",
+        "enable long-distance matching when compressing NARs, available for zstd only"};
+    const Setting<bool> writeClosureManifest{this, false, "write-closure-manifest",
+        "whether to write a file containing the .narinfo files of the closure of each path"};
+    Setting<bool> closureManifests{this, false, "closure-manifests",
+        "whether to use closure manifests to prefetch path info"};
+    const Setting<uint64_t> narChunkSize{this, 0, "nar-chunk-size",
+        "average size of the content-defined chunks NARs are split into (0 to disable chunking)"};
+    const Setting<Path> chunkCache{this, getCacheDir() + "/nix/nar-chunks", "chunk-cache",
+        "directory in which to cache downloaded NAR chunks"};
+    const Setting<std::string> deltaBaseStore{this, "", "delta-base-store",
+        "URI of a store containing older versions of uploaded paths against which to compute binary deltas"};
+    const Setting<bool> useDeltas{this, true, "use-deltas",
+        "whether to reconstruct NARs from binary deltas against paths in the local store"};
+    const Setting<bool> writePresenceFilter{this, false, "write-presence-filter",
+        "whether to maintain a Bloom filter of the paths in the cache, which clients use to skip queries for missing paths"};
+    const Setting<unsigned int> presenceFilterRefresh{this, 3600, "presence-filter-refresh",
+        "how often (in seconds) to rebuild the presence filter from the full contents of the cache"};
+    Setting<std::string> presenceFilter{this, "", "presence-filter",
+        "file in the cache holding its presence filter (normally taken from 'nix-cache-info'; empty to not use one)"};
 
 private:
 
     std::unique_ptr<SecretKey> secretKey;
 
+    /* Paths whose closure manifest we fetched, or whose info we got
+       from a closure manifest. */
+    Sync<StorePathSet> closuresPrefetched;
+
+    struct DeltaBases
+    {
+        std::shared_ptr<Store> store;
+        /* Valid paths in `store', indexed by package name. */
+        std::multimap<std::string, StorePath> byName;
+    };
+
+    Sync<std::optional<DeltaBases>> deltaBases;
+
+    struct PresenceFilterState
+    {
+        std::optional<PresenceFilter> filter;
+        /* When the filter was last fetched. */
+        std::optional<std::chrono::steady_clock::time_point> fetched;
+        /* Whether queryAllValidPaths() failed, so that a writer can
+           only add to an existing filter. */
+        bool cannotList = false;
+    };
+
+    Sync<PresenceFilterState> presenceFilterState;
+
+    std::string presenceFilterFile();
+
+    /* Return false if the presence filter of the cache shows that it
+       doesn't have `path'. */
+    bool mayHavePath(const StorePath & path);
+
+    /* Add `path' to the presence filter and upload it, rebuilding it
+       from the contents of the cache if it is missing, full or due
+       for a refresh. */
+    void addToPresenceFilter(const StorePath & path);
+
+    /* Return the path in 'delta-base-store' that is the closest
+       older version of `path' and is valid in this cache, if any,
+       together with that store. */
+    std::optional<std::pair<ref<Store>, StorePath>> findDeltaBase(const StorePath & path);
+
 protected:
 
     BinaryCacheStore(const Params & params);
@@ -39,6 +107,28 @@ public:
         const std::string & data,
         const std::string & mimeType) = 0;
 
+    /* Upload the contents of a stream. Subclasses that can upload
+       without holding the entire file in memory should override
+       this; the default reads the stream into a string. */
+    virtual void upsertFile(const std::string & path,
+        std::shared_ptr<std::basic_iostream<char>> istream,
+        const std::string & mimeType);
+
+    /* Upload the contents of the local file `file', which the caller
+       deletes afterwards. The default streams it to upsertFile(). */
+    virtual void upsertFileFrom(const std::string & path,
+        const Path & file,
+        const std::string & mimeType);
+
+    /* The directory in which addToStore() writes NARs before
+       uploading them, or empty for $TMPDIR. A subclass can put them
+       next to their destination so that upsertFileFrom() doesn't
+       have to copy them. */
+    virtual Path stagingDir()
+    {
+        return "";
+    }
+
     /* Note: subclasses must implement at least one of the two
        following getFile() methods. */
 
@@ -52,6 +142,20 @@ public:
 
     std::shared_ptr<std::string> getFile(const std::string & path);
 
+    /* Whether getFileRange() is supported. */
+    virtual bool supportsFileRanges()
+    {
+        return false;
+    }
+
+    /* Fetch `length' bytes starting at `offset' from the specified
+       file. */
+    virtual std::string getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length)
+    {
+        unsupported("getFileRange");
+    }
+
 public:
 
     virtual void init();
@@ -62,12 +166,20 @@ private:
 
     std::string narInfoFileFor(const StorePath & storePath);
 
+    std::string closureManifestFileFor(const StorePath & storePath);
+
     void writeNarInfo(ref<NarInfo> narInfo);
 
+    /* Reassemble a NAR that was uploaded as content-defined chunks
+       (see 'nar-chunk-size'), reusing chunks in 'chunk-cache'. */
+    void narFromChunks(const NarInfo & info, Sink & sink);
+
 public:
 
     bool isValidPathUncached(const StorePath & path) override;
 
+    void prefetchClosureInfos(const StorePathSet & paths) override;
+
     void queryPathInfoUncached(const StorePath & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept override;
 
@@ -87,6 +199,8 @@ public:
 
     void narFromPath(const StorePath & path, Sink & sink) override;
 
+    void narFromPathUsingDeltas(const StorePath & path, Store & baseStore, Sink & sink) override;
+
     BuildResult buildDerivation(const StorePath & drvPath, const BasicDerivation & drv,
         BuildMode buildMode) override
     { unsupported("buildDerivation"); }
@@ -5,6 +5,7 @@
 #include "util.hh"
 #include "archive.hh"
 #include "affinity.hh"
+#include "cgroup.hh"
 #include "builtins.hh"
 #include "builtins/buildenv.hh"
 #include "filetransfer.hh"
@@ -16,6 +17,8 @@
 #include "machines.hh"
 #include "daemon.hh"
 #include "worker-protocol.hh"
+#include "daemon-metrics.hh"
+#include "names.hh"
 
 #include <algorithm>
 #include <iostream>
@@ -26,6 +29,7 @@
 #include <chrono>
 #include <regex>
 #include <queue>
+#include <unordered_map>
 #include <climits>
 
 #include <sys/time.h>
@@ -43,6 +47,7 @@
 #include <cstring>
 #include <termios.h>
 #include <poll.h>
+#include <sys/ioctl.h>
 
 #include <pwd.h>
 #include <grp.h>
@@ -50,7 +55,7 @@
 /* Includes required for chroot support. */
 #if __linux__
 #include <sys/socket.h>
-#include <sys/ioctl.h>
+#include <sys/epoll.h>
 #include <net/if.h>
 #include <netinet/ip.h>
 #include <sys/personality.h>
@@ -97,7 +102,7 @@ struct CompareGoalPtrs {
 
 /* Set of goals. */
 typedef set<GoalPtr, CompareGoalPtrs> Goals;
-typedef list<WeakGoalPtr> WeakGoals;
+typedef std::vector<WeakGoalPtr> WeakGoals;
 
 /* A map of paths to goals (and the other way around). */
 typedef std::map<StorePath, WeakGoalPtr> WeakGoalMap;
@@ -111,8 +116,10 @@ struct Goal : public std::enable_shared_from_this<Goal>
     /* Backlink to the worker. */
     Worker & worker;
 
-    /* Goals that this goal is waiting for. */
-    Goals waitees;
+    /* Goals that this goal is waiting for. This is a vector rather
+       than a Goals set, since a graph of many goals has even more
+       edges, and ordering them by key() is expensive. */
+    std::vector<GoalPtr> waitees;
 
     /* Goals waiting for this one to finish.  Must use weak pointers
        here to prevent cycles. */
@@ -165,7 +172,14 @@ struct Goal : public std::enable_shared_from_this<Goal>
         abort();
     }
 
-    void trace(const FormatOrString & fs);
+    /* Print a debug message about this goal. Like debug(), this
+       doesn't format the message unless it is shown, so it's cheap
+       enough for the scheduler's hot paths. */
+    template<typename... Args>
+    void trace(const char * fs, const Args & ... args)
+    {
+        debug("%1%: %2%", name, fmt(fs, args...));
+    }
 
     string getName()
     {
@@ -179,7 +193,30 @@ struct Goal : public std::enable_shared_from_this<Goal>
 
     virtual string key() = 0;
 
+    /* Estimated time in seconds that this goal itself will take to
+       complete once it can run, used to prioritise goals on the
+       critical path. */
+    virtual uint64_t estimatedDuration()
+    {
+        return 0;
+    }
+
+    /* Estimated number of bytes that this goal is about to add to
+       the store, used to start the auto-GC ahead of time. Goals
+       that don't know yet whether they'll have to do anything
+       return 0. */
+    virtual uint64_t expectedDiskUse()
+    {
+        return 0;
+    }
+
     void amDone(ExitCode result, std::optional<Error> ex = {});
+
+    /* Free the state that is only needed while the goal runs. Called
+       once the goal is done, since finished goals may be kept around
+       until all others are (e.g. the top-level goals of a large
+       build). */
+    virtual void releaseState() { }
 };
 
 
@@ -198,11 +235,13 @@ typedef std::chrono::time_point<std::chrono::steady_clock> steady_time_point;
    path creation commands. */
 struct Child
 {
+    uint64_t id;
     WeakGoalPtr goal;
     Goal * goal2; // ugly hackery
     set<int> fds;
     bool respectTimeouts;
     bool inBuildSlot;
+    bool inSubstitutionSlot;
     steady_time_point lastOutput; /* time we last got output on stdout/stderr */
     steady_time_point timeStarted;
 };
@@ -225,13 +264,51 @@ private:
     /* Goals waiting for a build slot. */
     WeakGoals wantingToBuild;
 
+    /* Goals waiting for a substitution slot. */
+    WeakGoals wantingToSubstitute;
+
     /* Child processes currently running. */
     std::list<Child> children;
 
-    /* Number of build slots occupied.  This includes local builds and
-       substitutions but not remote builds via the build hook. */
+    /* Indices into `children', so that looking up the child of a goal
+       or file descriptor doesn't require a scan. */
+    uint64_t nextChildId = 0;
+    std::unordered_map<uint64_t, std::list<Child>::iterator> childrenById;
+    std::unordered_map<Goal *, std::list<Child>::iterator> childrenByGoal;
+    std::unordered_map<int, std::list<Child>::iterator> childrenByFD;
+
+#if __linux__
+    /* Persistent epoll set containing the file descriptors of all
+       children. */
+    AutoCloseFD epollFD;
+#endif
+
+    /* A min-heap of the times at which a child may have exceeded
+       'max-silent-time' or 'timeout'.  Entries are not updated when a
+       child produces output or terminates; instead they're checked
+       against the child when they expire, and pushed again with the
+       current deadline if that has moved. */
+    struct Deadline
+    {
+        steady_time_point time;
+        uint64_t child;
+        bool silence;
+        bool operator > (const Deadline & other) const { return time > other.time; }
+    };
+    std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> deadlines;
+
+    void watchFD(int fd);
+    void unwatchFD(int fd);
+
+    /* Number of build slots occupied.  This includes local builds
+       but not substitutions or remote builds via the build hook. */
     unsigned int nrLocalBuilds;
 
+    /* Number of substitution slots occupied.  Substitutions are
+       limited separately by 'max-substitution-jobs', since they are
+       mostly network-bound. */
+    unsigned int nrSubstitutions;
+
     /* Maps used to prevent multiple instantiations of a goal for the
        same derivation / path. */
     WeakGoalMap derivationGoals;
@@ -249,6 +326,21 @@ private:
     /* Cache for pathContentsGood(). */
     std::map<StorePath, bool> pathContentsGoodCache;
 
+public:
+
+    /* Cache of the closures of the store paths in 'sandbox-paths',
+       which are the same for most builds. */
+    std::map<StorePathSet, StorePathSet> sandboxPathsClosures;
+
+private:
+
+    /* Return the estimated length in seconds of the longest chain of
+       goals that is blocked on `goal', including `goal' itself. */
+    uint64_t criticalPath(Goal * goal, std::map<Goal *, uint64_t> & memo);
+
+    /* Return the total expectedDiskUse() of all goals. */
+    uint64_t expectedDiskUse();
+
 public:
 
     const Activity act;
@@ -272,6 +364,12 @@ public:
 
     std::unique_ptr<HookInstance> hook;
 
+    /* A GNU Make jobserver shared by all local builds, if enabled
+       through 'jobserver-tokens'.  Every running make holds one
+       implicit token, and acquires the others by reading a byte
+       from this pipe and returns them by writing it back. */
+    Pipe jobserver;
+
     uint64_t expectedBuilds = 0;
     uint64_t doneBuilds = 0;
     uint64_t failedBuilds = 0;
@@ -286,6 +384,9 @@ public:
     uint64_t expectedNarSize = 0;
     uint64_t doneNarSize = 0;
 
+    /* Outputs queued for the post-build hook. */
+    StorePathSet hookedOutputs;
+
     /* Whether to ask the build hook if it can build a derivation. If
        it answers with "decline-permanently", we don't try again. */
     bool tryBuildHook = true;
@@ -305,15 +406,20 @@ public:
     /* Wake up a goal (i.e., there is something for it to do). */
     void wakeUp(GoalPtr goal);
 
-    /* Return the number of local build and substitution processes
-       currently running (but not remote builds via the build
+    /* Return the number of local build processes currently running
+       (but not substitutions or remote builds via the build
        hook). */
     unsigned int getNrLocalBuilds();
 
+    /* Return the number of substitutions currently running. */
+    unsigned int getNrSubstitutions();
+
     /* Registers a running child process.  `inBuildSlot' means that
-       the process counts towards the jobs limit. */
+       the process counts towards the jobs limit, and
+       `inSubstitutionSlot' that it counts towards the substitution
+       jobs limit. */
     void childStarted(GoalPtr goal, const set<int> & fds,
-        bool inBuildSlot, bool respectTimeouts);
+        bool inBuildSlot, bool respectTimeouts, bool inSubstitutionSlot = false);
 
     /* Unregisters a running child process.  `wakeSleepers' should be
        false if there is no sense in waking up goals that are sleeping
@@ -325,10 +431,16 @@ public:
        might be right away). */
     void waitForBuildSlot(GoalPtr goal);
 
+    /* Likewise for a substitution slot. */
+    void waitForSubstitutionSlot(GoalPtr goal);
+
     /* Wait for any goal to finish.  Pretty indiscriminate way to
        wait for some resource that some other goal is holding. */
     void waitForAnyGoal(GoalPtr goal);
 
+    /* Reset the jobserver to 'jobserver-tokens' tokens. */
+    void refillJobserver();
+
     /* Wait for a few seconds and then retry this goal.  Used when
        waiting for a lock held by another process.  This kind of
        polling is inefficient, but POSIX doesn't really provide a way
@@ -374,17 +486,20 @@ void addToWeakGoals(WeakGoals & goals, GoalPtr p)
 
 void Goal::addWaitee(GoalPtr waitee)
 {
-    waitees.insert(waitee);
-    addToWeakGoals(waitee->waiters, shared_from_this());
+    if (std::find(waitees.begin(), waitees.end(), waitee) != waitees.end()) return;
+    waitees.push_back(waitee);
+    waitee->waiters.push_back(shared_from_this());
 }
 
 
 void Goal::waiteeDone(GoalPtr waitee, ExitCode result)
 {
-    assert(waitees.find(waitee) != waitees.end());
-    waitees.erase(waitee);
+    auto i = std::find(waitees.begin(), waitees.end(), waitee);
+    assert(i != waitees.end());
+    *i = std::move(waitees.back());
+    waitees.pop_back();
 
-    trace(fmt("waitee '%s' done; %d left", waitee->name, waitees.size()));
+    trace("waitee '%s' done; %d left", waitee->name, waitees.size());
 
     if (result == ecFailed || result == ecNoSubstituters || result == ecIncompleteClosure) ++nrFailed;
 
@@ -397,12 +512,13 @@ void Goal::waiteeDone(GoalPtr waitee, ExitCode result)
         /* If we failed and keepGoing is not set, we remove all
            remaining waitees. */
         for (auto & goal : waitees) {
-            WeakGoals waiters2;
-            for (auto & j : goal->waiters)
-                if (j.lock() != shared_from_this()) waiters2.push_back(j);
-            goal->waiters = waiters2;
+            auto & waiters(goal->waiters);
+            waiters.erase(std::remove_if(waiters.begin(), waiters.end(),
+                    [&](const WeakGoalPtr & j) { return j.lock() == shared_from_this(); }),
+                waiters.end());
         }
         waitees.clear();
+        waitees.shrink_to_fit();
 
         worker.wakeUp(shared_from_this());
     }
@@ -428,16 +544,12 @@ void Goal::amDone(ExitCode result, std::optional<Error> ex)
         if (goal) goal->waiteeDone(shared_from_this(), result);
     }
     waiters.clear();
+    waiters.shrink_to_fit();
+    releaseState();
     worker.removeGoal(shared_from_this());
 }
 
 
-void Goal::trace(const FormatOrString & fs)
-{
-    debug("%1%: %2%", name, fs.s);
-}
-
-
 
 //////////////////////////////////////////////////////////////////////
 
@@ -764,6 +876,14 @@ private:
     /* The process ID of the builder. */
     Pid pid;
 
+    /* The thread running a builtin:fetchurl derivation in-process
+       instead of a builder, and its result. When it finishes, it
+       closes the write side of `builderOut'. Setting `fetchInterrupt'
+       makes it stop. */
+    std::thread fetchThread;
+    std::promise<void> fetchPromise;
+    std::shared_ptr<std::atomic<bool>> fetchInterrupt;
+
     /* The temporary directory. */
     Path tmpDir;
 
@@ -848,6 +968,28 @@ private:
 
     BuildResult result;
 
+    /* Cached result of estimatedDuration(). */
+    std::optional<uint64_t> estimate;
+
+    /* Expected size of the outputs, set once we know that we have to
+       build them. */
+    std::optional<uint64_t> outputSizeEstimate;
+
+#if __linux__
+    /* The NUMA node that the builder runs on, and the lock that
+       records this (see acquireNumaSlot()). */
+    std::optional<NumaNode> numaNode;
+    AutoCloseFD numaSlot;
+
+    /* The cgroup of the builder, if ‘use-cgroups’ is enabled. */
+    std::optional<Path> cgroup;
+#endif
+
+    /* Whether `tmpDir' is a tmpfs (see ‘build-dir-tmpfs-size’), and
+       whether it has to be on disk because the build didn't fit. */
+    bool tmpDirIsTmpfs = false;
+    bool tmpDirOnDisk = false;
+
     /* The current round, if we're building multiple times. */
     size_t curRound = 1;
 
@@ -865,6 +1007,7 @@ private:
     const static Path homeDir;
 
     std::unique_ptr<MaintainCount<uint64_t>> mcExpectedBuilds, mcRunningBuilds;
+    std::unique_ptr<MaintainCount<std::atomic<uint64_t>>> mcActiveBuilds;
 
     std::unique_ptr<Activity> act;
 
@@ -922,6 +1065,15 @@ public:
 
     void work() override;
 
+    uint64_t estimatedDuration() override;
+
+    uint64_t expectedDiskUse() override
+    {
+        return exitCode == ecBusy && outputSizeEstimate ? *outputSizeEstimate : 0;
+    }
+
+    void releaseState() override;
+
     StorePath getDrvPath()
     {
         return drvPath;
@@ -937,6 +1089,9 @@ private:
     void getDerivation();
     void loadDerivation();
     void haveDerivation();
+    /* Read the derivation again if it was dropped while waiting for
+       the inputs. */
+    void reloadDerivation();
     void outputsSubstituted();
     void closureRepaired();
     void inputsRealised();
@@ -950,6 +1105,17 @@ private:
     /* Start building a derivation. */
     void startBuilder();
 
+    /* Whether to build this derivation with startFetch() rather than
+       startBuilder(). */
+    bool canFetchInProcess();
+
+    /* Run a builtin:fetchurl derivation on a thread. */
+    void startFetch();
+
+    /* Wait for the thread started by startFetch() and return the
+       equivalent of a builder's exit status. */
+    int finishFetch();
+
     /* Fill in the environment for the builder. */
     void initEnv();
 
@@ -1083,6 +1249,12 @@ inline bool DerivationGoal::needsHashRewrite()
 
 void DerivationGoal::killChild()
 {
+    if (fetchThread.joinable()) {
+        *fetchInterrupt = true;
+        fetchThread.join();
+        worker.childTerminated(this);
+    }
+
     if (pid != -1) {
         worker.childTerminated(this);
 
@@ -1102,6 +1274,19 @@ void DerivationGoal::killChild()
         assert(pid == -1);
     }
 
+#if __linux__
+    if (cgroup) {
+        try {
+            destroyCgroup(*cgroup);
+        } catch (Error & e) {
+            ignoreException();
+        }
+        cgroup.reset();
+    }
+
+    numaSlot = -1;
+#endif
+
     hook.reset();
 }
 
@@ -1119,6 +1304,73 @@ void DerivationGoal::work()
 }
 
 
+#if __linux__
+/* Pick the NUMA node with the fewest local builds of any Nix process,
+   and take a slot on it that is held while the build runs. Like
+   build users, slots are lock files, so those of crashed processes
+   are freed automatically. */
+static std::optional<std::pair<NumaNode, AutoCloseFD>> acquireNumaSlot()
+{
+    static auto nodes = getNumaNodes();
+    if (nodes.empty()) return {};
+
+    auto dir = settings.nixStateDir + "/numa";
+    createDirs(dir);
+
+    std::map<unsigned int, size_t> occupancy;
+    for (auto & ent : readDirectory(dir)) {
+        unsigned int id;
+        auto dash = ent.name.find('-');
+        if (dash == std::string::npos || !string2Int(ent.name.substr(0, dash), id)) continue;
+        AutoCloseFD fd = openLockFile(dir + "/" + ent.name, false);
+        if (fd && !lockFile(fd.get(), ltWrite, false))
+            occupancy[id]++;
+    }
+
+    auto best = &nodes[0];
+    for (auto & node : nodes)
+        if (occupancy[node.id] < occupancy[best->id])
+            best = &node;
+
+    for (size_t slot = 0; ; slot++) {
+        auto fd = openLockFile(fmt("%s/%d-%d", dir, best->id, slot), true);
+        if (lockFile(fd.get(), ltWrite, false))
+            return std::make_pair(*best, std::move(fd));
+    }
+}
+#endif
+
+
+/* Key under which build durations are recorded.  The version is
+   dropped so that the history of e.g. gcc-9.3.0 carries over to
+   gcc-10.1.0. */
+static std::string buildTimeKey(const StorePath & drvPath)
+{
+    std::string_view name(drvPath.name());
+    if (hasSuffix(name, drvExtension))
+        name.remove_suffix(drvExtension.size());
+    return DrvName(name).name;
+}
+
+
+uint64_t DerivationGoal::estimatedDuration()
+{
+    if (!estimate) {
+        /* Derivations we have never built are assumed to be cheap
+           but not free, so that a chain of them is still preferred
+           over a single one. */
+        estimate = 30;
+        try {
+            if (auto d = worker.store.queryBuildTime(buildTimeKey(drvPath)))
+                estimate = std::max<uint64_t>(*d, 1);
+        } catch (Error & e) {
+            ignoreException();
+        }
+    }
+    return *estimate;
+}
+
+
 void DerivationGoal::addWantedOutputs(const StringSet & outputs)
 {
     /* If we already want all outputs, there is nothing to do. */
@@ -1255,6 +1507,15 @@ void DerivationGoal::outputsSubstituted()
     /* Otherwise, at least one of the output paths could not be
        produced using a substitute.  So we have to build instead. */
 
+    /* Unless a previous build failed permanently, in which case it
+       will fail again, and so will building the inputs first. */
+    if (settings.cacheFailures && buildMode == bmNormal && worker.store.queryFailedBuild(drvPath)) {
+        done(BuildResult::CachedFailure, Error(
+            "build of '%s' failed previously; use 'nix-store --clear-failed-paths' to retry it",
+            worker.store.printStorePath(drvPath)));
+        return;
+    }
+
     /* Make sure checkPathValidity() from now on checks all
        outputs. */
     wantedOutputs.clear();
@@ -1274,8 +1535,25 @@ void DerivationGoal::outputsSubstituted()
 
     if (waitees.empty()) /* to prevent hang (no wake-up event) */
         inputsRealised();
-    else
+    else {
+        /* Realising the inputs may take a long time for goals deep
+           in a large graph, so don't hold on to the parsed
+           derivation in the meantime. */
+        if (useDerivation) {
+            drv.reset();
+            parsedDrv.reset();
+        }
         state = &DerivationGoal::inputsRealised;
+    }
+}
+
+
+void DerivationGoal::reloadDerivation()
+{
+    if (drv) return;
+    assert(useDerivation);
+    drv = std::unique_ptr<BasicDerivation>(new Derivation(worker.store.derivationFromPath(drvPath)));
+    parsedDrv = std::make_unique<ParsedDerivation>(drvPath, *drv);
 }
 
 
@@ -1358,6 +1636,8 @@ void DerivationGoal::inputsRealised()
         return;
     }
 
+    reloadDerivation();
+
     if (retrySubstitution) {
         haveDerivation();
         return;
@@ -1392,6 +1672,8 @@ void DerivationGoal::inputsRealised()
 
     debug("added input paths %s", worker.store.showPaths(inputPaths));
 
+    worker.store.recordPathUse(inputPaths);
+
     /* Is this a fixed-output derivation? */
     fixedOutput = drv->isFixedOutput();
 
@@ -1399,6 +1681,16 @@ void DerivationGoal::inputsRealised()
        verified by their output hash.*/
     nrRounds = fixedOutput ? 1 : settings.buildRepeat + 1;
 
+    /* Let the auto-GC know how much space the outputs are likely to
+       need, judging from previous builds. */
+    outputSizeEstimate = 0;
+    try {
+        if (auto size = worker.store.queryOutputSize(buildTimeKey(drvPath)))
+            outputSizeEstimate = *size;
+    } catch (Error & e) {
+        ignoreException();
+    }
+
     /* Okay, try to build.  Note that here we don't wait for a build
        slot to become available, since we don't need one if there is a
        build hook. */
@@ -1419,6 +1711,7 @@ void DerivationGoal::started() {
     act = std::make_unique<Activity>(*logger, lvlInfo, actBuild, msg,
         Logger::Fields{worker.store.printStorePath(drvPath), hook ? machineName : "", curRound, nrRounds});
     mcRunningBuilds = std::make_unique<MaintainCount<uint64_t>>(worker.runningBuilds);
+    mcActiveBuilds = std::make_unique<MaintainCount<std::atomic<uint64_t>>>(daemonMetrics->activeBuilds);
     worker.updateProgress();
 }
 
@@ -1505,6 +1798,18 @@ void DerivationGoal::tryToBuild()
 
     actLock.reset();
 
+    /* Fetches don't need a builder process or a build slot, only a
+       download, so they're limited like substitutions. */
+    if (canFetchInProcess()) {
+        if (worker.getNrSubstitutions() >= std::max(1U, settings.maxSubstitutionJobs.get())) {
+            worker.waitForSubstitutionSlot(shared_from_this());
+            outputLocks.unlock();
+            return;
+        }
+        startFetch();
+        return;
+    }
+
     /* Make sure that we are allowed to start a build.  If this
        derivation prefers to be done locally, do it even if
        maxBuildJobs is 0. */
@@ -1568,6 +1873,71 @@ void DerivationGoal::tryLocalBuild() {
 }
 
 
+bool DerivationGoal::canFetchInProcess()
+{
+    return settings.builtinFetchurlInProcess
+        && drv->builder == "builtin:fetchurl"
+        && fixedOutput
+        && buildMode == bmNormal
+        && nrRounds == 1
+        && worker.store.storeDir == worker.store.realStoreDir;
+}
+
+
+void DerivationGoal::startFetch()
+{
+    /* There is no sandbox, so the output is written to its final
+       location directly. registerOutputs() checks its hash as
+       usual. */
+    useChroot = false;
+
+    result.startTime = time(0);
+
+    started();
+
+    builderOut.create();
+    fetchPromise = std::promise<void>();
+    fetchInterrupt = std::make_shared<std::atomic<bool>>(false);
+
+    fetchThread = std::thread([this]() {
+        try {
+            /* Wake up the worker loop when we're done. */
+            Finally wakeUp([this]() { builderOut.writeSide = -1; });
+
+            PushActivity pact(act->id);
+
+            builtinFetchurl(*drv, *getFileTransfer(), fetchInterrupt);
+
+            fetchPromise.set_value();
+        } catch (...) {
+            fetchPromise.set_exception(std::current_exception());
+        }
+    });
+
+    worker.childStarted(shared_from_this(), {builderOut.readSide.get()}, false, false, true);
+
+    state = &DerivationGoal::buildDone;
+}
+
+
+int DerivationGoal::finishFetch()
+{
+    fetchThread.join();
+
+    try {
+        fetchPromise.get_future().get();
+        return 0;
+    } catch (Error & e) {
+        /* Report the error like a builder writing it to stderr. */
+        for (auto & line : tokenizeString<Strings>(e.msg(), "\n")) {
+            currentLogLine = line;
+            flushLine();
+        }
+        return 1 << 8;
+    }
+}
+
+
 void replaceValidPath(const Path & storePath, const Path tmpPath)
 {
     /* We can't atomically replace storePath (the original) with
@@ -1603,7 +1973,7 @@ void DerivationGoal::buildDone()
        to have terminated.  In fact, the builder could also have
        simply have closed its end of the pipe, so just to be sure,
        kill it. */
-    int status = hook ? hook->pid.kill() : pid.kill();
+    int status = fetchThread.joinable() ? finishFetch() : hook ? hook->pid.kill() : pid.kill();
 
     debug("builder process for '%s' finished", worker.store.printStorePath(drvPath));
 
@@ -1630,6 +2000,29 @@ void DerivationGoal::buildDone()
        root. */
     if (buildUser) buildUser->kill();
 
+#if __linux__
+    /* Likewise for any processes left in the cgroup, which also gives
+       us its resource usage. */
+    if (cgroup) {
+        try {
+            auto stats = destroyCgroup(*cgroup);
+            result.cpuUser = stats.cpuUser;
+            result.cpuSystem = stats.cpuSystem;
+            result.memoryPeak = stats.memoryPeak;
+            if (stats.cpuUser && stats.cpuSystem)
+                printMsg(lvlChatty, "building '%s' used %.3f s user and %.3f s system CPU time%s",
+                    worker.store.printStorePath(drvPath),
+                    stats.cpuUser->count() / 1e6, stats.cpuSystem->count() / 1e6,
+                    stats.memoryPeak ? fmt(", with a peak of %d MiB of memory", *stats.memoryPeak >> 20) : "");
+        } catch (Error & e) {
+            ignoreException();
+        }
+        cgroup.reset();
+    }
+
+    numaSlot = -1;
+#endif
+
     /* Terminate the recursive Nix daemon. */
     stopDaemon();
 
@@ -1651,9 +2044,25 @@ void DerivationGoal::buildDone()
             if (statvfs(worker.store.realStoreDir.c_str(), &st) == 0 &&
                 (unsigned long long) st.f_bavail * st.f_bsize < required)
                 diskFull = true;
+            bool tmpfsFull = false;
             if (statvfs(tmpDir.c_str(), &st) == 0 &&
                 (unsigned long long) st.f_bavail * st.f_bsize < required)
-                diskFull = true;
+                (tmpDirIsTmpfs ? tmpfsFull : diskFull) = true;
+
+            /* If the build ran out of memory for its build directory,
+               give it another go with the directory on disk. */
+            if (tmpfsFull && !diskFull) {
+                printError("build directory of '%s' is full; retrying with the build directory on disk",
+                    worker.store.printStorePath(drvPath));
+                tmpDirOnDisk = true;
+                result.timesBuilt--;
+                deleteTmpDir(true);
+                autoDelChroot.reset(); /* this runs the destructor */
+                outputLocks.unlock();
+                state = &DerivationGoal::tryToBuild;
+                worker.wakeUp(shared_from_this());
+                return;
+            }
 #endif
 
             deleteTmpDir(false);
@@ -1688,54 +2097,12 @@ void DerivationGoal::buildDone()
         registerOutputs();
 
         if (settings.postBuildHook != "") {
-            Activity act(*logger, lvlInfo, actPostBuildHook,
-                fmt("running post-build-hook '%s'", settings.postBuildHook),
-                Logger::Fields{worker.store.printStorePath(drvPath)});
-            PushActivity pact(act.id);
             auto outputPaths = drv->outputPaths();
-            std::map<std::string, std::string> hookEnvironment = getEnv();
-
-            hookEnvironment.emplace("DRV_PATH", worker.store.printStorePath(drvPath));
-            hookEnvironment.emplace("OUT_PATHS", chomp(concatStringsSep(" ", worker.store.printStorePathSet(outputPaths))));
-
-            RunOptions opts(settings.postBuildHook, {});
-            opts.environment = hookEnvironment;
-
-            struct LogSink : Sink {
-                Activity & act;
-                std::string currentLine;
-
-                LogSink(Activity & act) : act(act) { }
-
-                void operator() (const unsigned char * data, size_t len) override {
-                    for (size_t i = 0; i < len; i++) {
-                        auto c = data[i];
-
-                        if (c == '\n') {
-                            flushLine();
-                        } else {
-                            currentLine += c;
-                        }
-                    }
-                }
-
-                void flushLine() {
-                    act.result(resPostBuildLogLine, currentLine);
-                    currentLine.clear();
-                }
-
-                ~LogSink() {
-                    if (currentLine != "") {
-                        currentLine += '\n';
-                        flushLine();
-                    }
-                }
-            };
-            LogSink sink(act);
-
-            opts.standardOut = &sink;
-            opts.mergeStderrToStdout = true;
-            runProgram2(opts);
+            if (settings.postBuildHookJobs) {
+                worker.store.queuePostBuildHook(drvPath, outputPaths);
+                worker.hookedOutputs.insert(outputPaths.begin(), outputPaths.end());
+            } else
+                worker.store.runPostBuildHook({drvPath}, outputPaths);
         }
 
         if (buildMode == bmCheck) {
@@ -1761,6 +2128,25 @@ void DerivationGoal::buildDone()
             return;
         }
 
+        /* Remember how long this took for scheduling future builds. */
+        if (result.startTime && result.stopTime >= result.startTime)
+            try {
+                worker.store.recordBuildTime(buildTimeKey(drvPath),
+                    result.stopTime - result.startTime);
+            } catch (Error & e) {
+                ignoreException();
+            }
+
+        /* And how much space the outputs took. */
+        try {
+            uint64_t size = 0;
+            for (auto & i : drv->outputs)
+                size += worker.store.queryPathInfo(i.second.path)->narSize;
+            worker.store.recordOutputSize(buildTimeKey(drvPath), size);
+        } catch (Error & e) {
+            ignoreException();
+        }
+
         /* It is now safe to delete the lock files, since all future
            lockers will see that the output paths are valid; they will
            not create new lock files with the same names as the old
@@ -1963,6 +2349,8 @@ void linkOrCopy(const Path & from, const Path & to)
 
 void DerivationGoal::startBuilder()
 {
+    auto setupStart = std::chrono::steady_clock::now();
+
     /* Right platform? */
     if (!parsedDrv->canBuildLocally())
         throw Error("a '%s' with features {%s} is required to build '%s', but I am a '%s' with features {%s}",
@@ -2011,6 +2399,21 @@ void DerivationGoal::startBuilder()
        place. */
     tmpDir = createTempDir("", "nix-build-" + std::string(drvPath.name()), false, false, 0700);
 
+#if __linux__
+    /* Builds that write many temporary files spend much of their time
+       on filesystem metadata, so put the directory in memory if
+       allowed. Only root can mount a tmpfs here, outside of the
+       sandbox, where we and the builder can both see it. */
+    tmpDirIsTmpfs = false;
+    if (settings.buildDirTmpfsSize.get() != "" && !tmpDirOnDisk && getuid() == 0) {
+        if (mount("none", tmpDir.c_str(), "tmpfs", MS_NOSUID | MS_NODEV,
+                fmt("size=%s,mode=0700", settings.buildDirTmpfsSize).c_str()) == -1)
+            printError("warning: cannot mount a tmpfs on '%s': %s", tmpDir, strerror(errno));
+        else
+            tmpDirIsTmpfs = true;
+    }
+#endif
+
     chownToBuilder(tmpDir);
 
     /* Substitute output placeholders with the actual output paths. */
@@ -2076,16 +2479,27 @@ void DerivationGoal::startBuilder()
         dirsInChroot[tmpDirInSandbox] = tmpDir;
 
         /* Add the closure of store paths to the chroot. */
-        StorePathSet closure;
+        StorePathSet roots;
         for (auto & i : dirsInChroot)
             try {
                 if (worker.store.isInStore(i.second.source))
-                    worker.store.computeFSClosure(worker.store.parseStorePath(worker.store.toStorePath(i.second.source)), closure);
-            } catch (InvalidPath & e) {
+                    roots.insert(worker.store.parseStorePath(worker.store.toStorePath(i.second.source)));
             } catch (Error & e) {
                 throw Error("while processing 'sandbox-paths': %s", e.what());
             }
-        for (auto & i : closure) {
+        auto cachedClosure = worker.sandboxPathsClosures.find(roots);
+        if (cachedClosure == worker.sandboxPathsClosures.end()) {
+            StorePathSet closure;
+            for (auto & i : roots)
+                try {
+                    worker.store.computeFSClosure(i, closure);
+                } catch (InvalidPath & e) {
+                } catch (Error & e) {
+                    throw Error("while processing 'sandbox-paths': %s", e.what());
+                }
+            cachedClosure = worker.sandboxPathsClosures.emplace(roots, std::move(closure)).first;
+        }
+        for (auto & i : cachedClosure->second) {
             auto p = worker.store.printStorePath(i);
             dirsInChroot.insert_or_assign(p, p);
         }
@@ -2329,6 +2743,22 @@ void DerivationGoal::startBuilder()
     if (tcsetattr(builderOut.writeSide.get(), TCSANOW, &term))
         throw SysError("putting pseudoterminal into raw mode");
 
+#if __linux__
+    if (settings.numaPlacement)
+        try {
+            if (auto slot = acquireNumaSlot()) {
+                numaNode = std::move(slot->first);
+                numaSlot = std::move(slot->second);
+                debug("placing the build of '%s' on NUMA node %d", worker.store.printStorePath(drvPath), numaNode->id);
+            }
+        } catch (Error & e) {
+            ignoreException();
+        }
+
+    if (settings.useCgroups)
+        cgroup = createCgroup(fmt("nix-build-%s", drvPath.hashPart()));
+#endif
+
     result.startTime = time(0);
 
     /* Fork a child to build the package. */
@@ -2439,6 +2869,12 @@ void DerivationGoal::startBuilder()
         if (!string2Int<pid_t>(readLine(builderOut.readSide.get()), tmp)) abort();
         pid = tmp;
 
+        /* Move the builder into its cgroup while it's still waiting
+           for us, so that all its children end up there too. It can't
+           do this itself from inside its user namespace. */
+        if (cgroup)
+            writeFile(*cgroup + "/cgroup.procs", std::to_string(pid));
+
         /* Set the UID/GID mapping of the builder's user namespace
            such that the sandbox user maps to the build user, or to
            the calling user (if build users are disabled). */
@@ -2487,6 +2923,13 @@ void DerivationGoal::startBuilder()
         }
         debug(msg);
     }
+
+    auto setupTime = std::chrono::steady_clock::now() - setupStart;
+    auto setupMicros = std::chrono::duration_cast<std::chrono::microseconds>(setupTime).count();
+    printMsg(lvlChatty, "setting up the build environment of '%s' took %.3f s",
+        worker.store.printStorePath(drvPath), setupMicros / 1e6);
+    daemonMetrics->buildSetups++;
+    daemonMetrics->buildSetupMicros += setupMicros;
 }
 
 
@@ -2509,6 +2952,7 @@ void DerivationGoal::initTmpDir() {
     if (!parsedDrv->getStructuredAttrs()) {
 
         StringSet passAsFile = tokenizeString<StringSet>(get(drv->env, "passAsFile").value_or(""));
+        StringRewriter inputRewriter(inputRewrites);
         for (auto & i : drv->env) {
             if (passAsFile.find(i.first) == passAsFile.end()) {
                 env[i.first] = i.second;
@@ -2516,7 +2960,7 @@ void DerivationGoal::initTmpDir() {
                 auto hash = hashString(htSHA256, i.first);
                 string fn = ".attr-" + hash.to_string(Base32, false);
                 Path p = tmpDir + "/" + fn;
-                writeFile(p, rewriteStrings(i.second, inputRewrites));
+                writeFile(p, inputRewriter(i.second));
                 chownToBuilder(p);
                 env[i.first + "Path"] = tmpDirInSandbox + "/" + fn;
             }
@@ -2565,6 +3009,14 @@ void DerivationGoal::initEnv()
     /* The maximum number of cores to utilize for parallel building. */
     env["NIX_BUILD_CORES"] = (format("%d") % settings.buildCores).str();
 
+    /* Let make and anything else that speaks its protocol share job
+       slots with the other builds. */
+    if (worker.jobserver.readSide) {
+        auto auth = fmt("%d,%d", worker.jobserver.readSide.get(), worker.jobserver.writeSide.get());
+        env["MAKEFLAGS"] = "-j --jobserver-auth=" + auth;
+        env["NIX_BUILD_JOBSERVER"] = auth;
+    }
+
     initTmpDir();
 
     /* Compatibility hack with Nix <= 0.7: if this is a fixed-output
@@ -2607,10 +3059,12 @@ void DerivationGoal::writeStructuredAttrs()
 
     auto json = *structuredAttrs;
 
+    StringRewriter inputRewriter(inputRewrites);
+
     /* Add an "outputs" object containing the output paths. */
     nlohmann::json outputs;
     for (auto & i : drv->outputs)
-        outputs[i.first] = rewriteStrings(worker.store.printStorePath(i.second.path), inputRewrites);
+        outputs[i.first] = inputRewriter(worker.store.printStorePath(i.second.path));
     json["outputs"] = outputs;
 
     /* Handle exportReferencesGraph. */
@@ -2630,7 +3084,7 @@ void DerivationGoal::writeStructuredAttrs()
         }
     }
 
-    writeFile(tmpDir + "/.attrs.json", rewriteStrings(json.dump(), inputRewrites));
+    writeFile(tmpDir + "/.attrs.json", inputRewriter(json.dump()));
     chownToBuilder(tmpDir + "/.attrs.json");
 
     /* As a convenience to bash scripts, write a shell file that
@@ -2699,7 +3153,7 @@ void DerivationGoal::writeStructuredAttrs()
         }
     }
 
-    writeFile(tmpDir + "/.attrs.sh", rewriteStrings(jsonSh, inputRewrites));
+    writeFile(tmpDir + "/.attrs.sh", inputRewriter(jsonSh));
     chownToBuilder(tmpDir + "/.attrs.sh");
 }
 
@@ -3091,6 +3545,14 @@ void DerivationGoal::runChild()
 
         commonChildInit(builderOut);
 
+#if __linux__
+        if (cgroup && !useChroot)
+            writeFile(*cgroup + "/cgroup.procs", "0");
+
+        if (numaNode)
+            bindToNumaNode(*numaNode);
+#endif
+
         try {
             setupSeccomp();
         } catch (...) {
@@ -3222,9 +3684,13 @@ void DerivationGoal::runChild()
                     else
                         throw SysError("getting attributes of path '%1%'", source);
                 }
-                if (S_ISDIR(st.st_mode))
-                    createDirs(target);
-                else {
+                /* Most targets are directly below a directory that
+                   already exists (such as the chroot's store), so
+                   avoid createDirs() walking the whole path. */
+                if (S_ISDIR(st.st_mode)) {
+                    if (mkdir(target.c_str(), 0777) == -1 && errno != EEXIST)
+                        createDirs(target);
+                } else {
                     createDirs(dirOf(target));
                     writeFile(target, "");
                 }
@@ -3318,8 +3784,16 @@ void DerivationGoal::runChild()
         if (chdir(tmpDirInSandbox.c_str()) == -1)
             throw SysError("changing into '%1%'", tmpDir);
 
-        /* Close all other file descriptors. */
-        closeMostFDs({STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO});
+        /* Close all other file descriptors, except the jobserver
+           pipe, which must also survive the exec. */
+        set<int> keepFDs{STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+        if (worker.jobserver.readSide)
+            for (int fd : {worker.jobserver.readSide.get(), worker.jobserver.writeSide.get()}) {
+                keepFDs.insert(fd);
+                if (fcntl(fd, F_SETFD, 0) == -1)
+                    throw SysError("clearing close-on-exec flag of the jobserver");
+            }
+        closeMostFDs(keepFDs);
 
 #if __linux__
         /* Change the personality to 32-bit if we're doing an
@@ -3353,9 +3827,10 @@ void DerivationGoal::runChild()
         // FIXME: set other limits to deterministic values?
 
         /* Fill in the environment. */
+        StringRewriter inputRewriter(inputRewrites);
         Strings envStrs;
         for (auto & i : env)
-            envStrs.push_back(rewriteStrings(i.first + "=" + i.second, inputRewrites));
+            envStrs.push_back(inputRewriter(i.first + "=" + i.second));
 
         /* If we are running in `build-users' mode, then switch to the
            user we allocated above.  Make sure that we drop all root
@@ -3527,7 +4002,7 @@ void DerivationGoal::runChild()
 #endif
 
         for (auto & i : drv->args)
-            args.push_back(rewriteStrings(i, inputRewrites));
+            args.push_back(inputRewriter(i));
 
         /* Indicate that we managed to set up the build environment. */
         writeFull(STDERR_FILENO, string("\1\n"));
@@ -3539,7 +4014,7 @@ void DerivationGoal::runChild()
 
                 BasicDerivation & drv2(*drv);
                 for (auto & e : drv2.env)
-                    e.second = rewriteStrings(e.second, inputRewrites);
+                    e.second = inputRewriter(e.second);
 
                 if (drv->builder == "builtin:fetchurl")
                     builtinFetchurl(drv2, netrcData);
@@ -3703,17 +4178,70 @@ void DerivationGoal::registerOutputs()
                something like that. */
             canonicalisePathMetaData(actualPath, buildUser ? buildUser->getUID() : -1, inodesSeen);
 
-            /* FIXME: this is in-memory. */
-            StringSink sink;
-            dumpPath(actualPath, sink);
+            /* Stream the rewritten NAR into a new copy of the
+               path, then replace the original. */
+            Path tmpPath = actualPath + ".rewrite-tmp";
+            deletePath(tmpPath);
+            auto source = sinkToSource([&](Sink & sink) {
+                RewritingSink rsink(outputRewrites, sink);
+                dumpPath(actualPath, rsink);
+                rsink.flush();
+            });
+            restorePath(tmpPath, *source);
             deletePath(actualPath);
-            sink.s = make_ref<std::string>(rewriteStrings(*sink.s, outputRewrites));
-            StringSource source(*sink.s);
-            restorePath(actualPath, source);
+            if (rename(tmpPath.c_str(), actualPath.c_str()) == -1)
+                throw SysError("renaming '%s' to '%s'", tmpPath, actualPath);
 
             rewritten = true;
         }
 
+        /* Get rid of all weird permissions.  This also checks that
+           all files are owned by the build user, if applicable. */
+        canonicalisePathMetaData(actualPath,
+            buildUser && !rewritten ? buildUser->getUID() : -1, inodesSeen);
+
+        /* For this output path, find the references to other paths
+           contained in it.  Compute the SHA-256 NAR hash at the same
+           time.  The hash is stored in the database so that we can
+           verify later on whether nobody has messed with the store.
+           In the same pass, compute the hash of a recursive
+           fixed-output path if it's of a different type, and the
+           per-file hashes needed by optimisePath(), so that the
+           output is only read once. */
+        debug("scanning for references inside '%1%'", path);
+
+        std::optional<HashSink> fixedHashSink;
+        if (fixedOutput
+            && i.second.hash->method == FileIngestionMethod::Recursive
+            && *i.second.hash->hash.type != htSHA256)
+            fixedHashSink.emplace(*i.second.hash->hash.type);
+
+        std::optional<FileHashesSink> fileHashes;
+        if (settings.autoOptimiseStore && curRound == nrRounds && buildMode != bmCheck)
+            fileHashes.emplace(actualPath);
+
+        HashResult hash;
+        StorePathSet references;
+        auto refs = worker.store.printStorePathSet(referenceablePaths);
+
+        auto scan = [&](Sink * narSink) {
+            references = worker.store.parseStorePathSet(scanForReferences(actualPath, refs, hash, narSink));
+        };
+
+        if (fileHashes) {
+            auto source = sinkToSource([&](Sink & nar) {
+                LambdaSink narSink([&](const unsigned char * data, size_t len) {
+                    nar(data, len);
+                    if (fixedHashSink) (*fixedHashSink)(data, len);
+                });
+                scan(&narSink);
+            });
+            parseDump(*fileHashes, *source);
+            /* Let the scan run to completion. */
+            source->drain();
+        } else
+            scan(fixedHashSink ? &*fixedHashSink : nullptr);
+
         /* Check that fixed-output derivations produced the right
            outputs (i.e., the content hash should match the specified
            hash). */
@@ -3733,7 +4261,7 @@ void DerivationGoal::registerOutputs()
             /* Check the hash. In hash mode, move the path produced by
                the derivation to its content-addressed location. */
             Hash h2 = i.second.hash->method == FileIngestionMethod::Recursive
-                ? hashPath(*i.second.hash->hash.type, actualPath).first
+                ? (fixedHashSink ? fixedHashSink->finish().first : hash.first)
                 : hashFile(*i.second.hash->hash.type, actualPath);
 
             auto dest = worker.store.makeFixedOutputPath(i.second.hash->method, h2, i.second.path.name());
@@ -3763,6 +4291,7 @@ void DerivationGoal::registerOutputs()
 
                 path = worker.store.printStorePath(dest);
                 actualPath = actualDest;
+                fileHashes.reset();
             }
             else
                 assert(worker.store.parseStorePath(path) == dest);
@@ -3773,19 +4302,6 @@ void DerivationGoal::registerOutputs()
             };
         }
 
-        /* Get rid of all weird permissions.  This also checks that
-           all files are owned by the build user, if applicable. */
-        canonicalisePathMetaData(actualPath,
-            buildUser && !rewritten ? buildUser->getUID() : -1, inodesSeen);
-
-        /* For this output path, find the references to other paths
-           contained in it.  Compute the SHA-256 NAR hash at the same
-           time.  The hash is stored in the database so that we can
-           verify later on whether nobody has messed with the store. */
-        debug("scanning for references inside '%1%'", path);
-        HashResult hash;
-        auto references = worker.store.parseStorePathSet(scanForReferences(actualPath, worker.store.printStorePathSet(referenceablePaths), hash));
-
         if (buildMode == bmCheck) {
             if (!worker.store.isValidPath(worker.store.parseStorePath(path))) continue;
             ValidPathInfo info(*worker.store.queryPathInfo(worker.store.parseStorePath(path)));
@@ -3830,7 +4346,7 @@ void DerivationGoal::registerOutputs()
         }
 
         if (curRound == nrRounds) {
-            worker.store.optimisePath(actualPath); // FIXME: combine with scanForReferences()
+            worker.store.optimisePath(actualPath, fileHashes ? &fileHashes->hashes : nullptr);
             worker.markContentsGood(worker.store.parseStorePath(path));
         }
 
@@ -4099,7 +4615,7 @@ Path DerivationGoal::openLogFile()
     createDirs(dir);
 
     Path logFileName = fmt("%s/%s%s", dir, string(baseName, 2),
-        settings.compressLog ? ".bz2" : "");
+        settings.compressLog ? compressionExtension(settings.logCompression) : "");
 
     fdLogFile = open(logFileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
     if (!fdLogFile) throw SysError("creating log file '%1%'", logFileName);
@@ -4107,7 +4623,7 @@ Path DerivationGoal::openLogFile()
     logFileSink = std::make_shared<FdSink>(fdLogFile.get());
 
     if (settings.compressLog)
-        logSink = std::shared_ptr<CompressionSink>(makeCompressionSink("bzip2", *logFileSink));
+        logSink = std::shared_ptr<CompressionSink>(makeCompressionSink(settings.logCompression, *logFileSink));
     else
         logSink = logFileSink;
 
@@ -4131,12 +4647,19 @@ void DerivationGoal::deleteTmpDir(bool force)
         /* Don't keep temporary directories for builtins because they
            might have privileged stuff (like a copy of netrc). */
         if (settings.keepFailed && !force && !drv->isBuiltin()) {
-            printError("note: keeping build directory '%s'", tmpDir);
+            printError("note: keeping build directory '%s'%s", tmpDir,
+                tmpDirIsTmpfs ? " (a tmpfs, which you have to unmount)" : "");
             chmod(tmpDir.c_str(), 0755);
         }
-        else
+        else {
+#if __linux__
+            if (tmpDirIsTmpfs && umount2(tmpDir.c_str(), MNT_DETACH) == -1)
+                throw SysError("unmounting '%s'", tmpDir);
+#endif
             deletePath(tmpDir);
+        }
         tmpDir = "";
+        tmpDirIsTmpfs = false;
     }
 }
 
@@ -4156,16 +4679,25 @@ void DerivationGoal::handleChildOutput(int fd, const string & data)
             return;
         }
 
-        for (auto c : data)
-            if (c == '\r')
+        /* Copy runs of ordinary characters into the current line in
+           one go, rather than a character at a time. */
+        size_t pos = 0;
+        while (pos < data.size()) {
+            auto end = data.find_first_of("\r\n", pos);
+            auto n = (end == string::npos ? data.size() : end) - pos;
+            if (n) {
+                if (currentLogLinePos + n > currentLogLine.size())
+                    currentLogLine.resize(currentLogLinePos + n);
+                currentLogLine.replace(currentLogLinePos, n, data, pos, n);
+                currentLogLinePos += n;
+            }
+            if (end == string::npos) break;
+            if (data[end] == '\r')
                 currentLogLinePos = 0;
-            else if (c == '\n')
+            else
                 flushLine();
-            else {
-                if (currentLogLinePos >= currentLogLine.size())
-                    currentLogLine.resize(currentLogLinePos + 1);
-                currentLogLine[currentLogLinePos++] = c;
-            }
+            pos = end + 1;
+        }
 
         if (logSink) (*logSink)(data);
     }
@@ -4233,6 +4765,32 @@ void DerivationGoal::addHashRewrite(const StorePath & path)
 }
 
 
+void DerivationGoal::releaseState()
+{
+    /* The daemon threads of a recursive build may still be using
+       the state; the destructor stops them. */
+    if (daemonThread.joinable()) return;
+
+    drv.reset();
+    parsedDrv.reset();
+    inputPaths = {};
+    validPaths = {};
+    missingPaths = {};
+    env = {};
+    dirsInChroot = {};
+#if __APPLE__
+    additionalSandboxProfile = {};
+#endif
+    inputRewrites = {};
+    outputRewrites = {};
+    redirectedOutputs = {};
+    redirectedBadOutputs = {};
+    prevInfos = {};
+    logTail = {};
+    addedPaths = {};
+}
+
+
 void DerivationGoal::done(BuildResult::Status status, std::optional<Error> ex)
 {
     result.status = status;
@@ -4241,18 +4799,33 @@ void DerivationGoal::done(BuildResult::Status status, std::optional<Error> ex)
     amDone(result.success() ? ecSuccess : ecFailed, ex);
     if (result.status == BuildResult::TimedOut)
         worker.timedOut = true;
-    if (result.status == BuildResult::PermanentFailure)
+    if (result.status == BuildResult::PermanentFailure || result.status == BuildResult::CachedFailure)
         worker.permanentFailure = true;
 
+    /* Failures that don't depend on the build machine will recur, so
+       remember them if requested. */
+    if (settings.cacheFailures && buildMode == bmNormal
+        && (result.status == BuildResult::PermanentFailure || result.status == BuildResult::OutputRejected))
+        try {
+            worker.store.recordFailedBuild(drvPath, result.status);
+        } catch (Error & e) {
+            ignoreException();
+        }
+
     mcExpectedBuilds.reset();
     mcRunningBuilds.reset();
+    mcActiveBuilds.reset();
 
     if (result.success()) {
-        if (status == BuildResult::Built)
+        if (status == BuildResult::Built) {
             worker.doneBuilds++;
+            daemonMetrics->buildsSucceeded++;
+        }
     } else {
-        if (status != BuildResult::DependencyFailed)
+        if (status != BuildResult::DependencyFailed) {
             worker.failedBuilds++;
+            daemonMetrics->buildsFailed++;
+        }
     }
 
     worker.updateProgress();
@@ -4273,6 +4846,10 @@ private:
     /* The remaining substituters. */
     std::list<ref<Store>> subs;
 
+    /* The results of querying the remaining substituters for the
+       path info, in the same order as `subs'. */
+    std::list<std::shared_future<ref<const ValidPathInfo>>> pendingInfos;
+
     /* The current substituter. */
     std::shared_ptr<Store> sub;
 
@@ -4299,6 +4876,7 @@ private:
 
     std::unique_ptr<MaintainCount<uint64_t>> maintainExpectedSubstitutions,
         maintainRunningSubstitutions, maintainExpectedNar, maintainExpectedDownload;
+    std::unique_ptr<MaintainCount<std::atomic<uint64_t>>> maintainActiveSubstitutions;
 
     typedef void (SubstitutionGoal::*GoalState)();
     GoalState state;
@@ -4309,6 +4887,19 @@ public:
 
     void timedOut(Error && ex) override { abort(); };
 
+    uint64_t expectedDiskUse() override
+    {
+        return exitCode == ecBusy && info ? info->narSize : 0;
+    }
+
+    void releaseState() override
+    {
+        subs = {};
+        pendingInfos = {};
+        sub.reset();
+        info.reset();
+    }
+
     string key() override
     {
         /* "a$" ensures substitution goals happen before derivation
@@ -4381,7 +4972,26 @@ void SubstitutionGoal::init()
     if (settings.readOnlyMode)
         throw Error("cannot substitute path '%s' - no write access to the Nix store", worker.store.printStorePath(storePath));
 
-    subs = settings.useSubstitutes ? getDefaultSubstituters() : std::list<ref<Store>>();
+    if (settings.useSubstitutes)
+        for (auto & sub : getDefaultSubstituters())
+            if (sub->storeDir == worker.store.storeDir)
+                subs.push_back(sub);
+
+    /* Query all substituters at the same time, so that a miss in one
+       doesn't delay asking the next. tryNext() then takes the answers
+       in priority order. */
+    for (auto & sub : subs) {
+        auto promise = std::make_shared<std::promise<ref<const ValidPathInfo>>>();
+        pendingInfos.push_back(promise->get_future().share());
+        sub->queryPathInfo(storePath,
+            {[promise](std::future<ref<const ValidPathInfo>> result) {
+                try {
+                    promise->set_value(result.get());
+                } catch (...) {
+                    promise->set_exception(std::current_exception());
+                }
+            }});
+    }
 
     tryNext();
 }
@@ -4412,14 +5022,11 @@ void SubstitutionGoal::tryNext()
     sub = subs.front();
     subs.pop_front();
 
-    if (sub->storeDir != worker.store.storeDir) {
-        tryNext();
-        return;
-    }
+    auto pendingInfo = std::move(pendingInfos.front());
+    pendingInfos.pop_front();
 
     try {
-        // FIXME: make async
-        info = sub->queryPathInfo(storePath);
+        info = pendingInfo.get().get_ptr();
     } catch (InvalidPath &) {
         tryNext();
         return;
@@ -4502,16 +5109,17 @@ void SubstitutionGoal::tryToRun()
 {
     trace("trying to run");
 
-    /* Make sure that we are allowed to start a build.  Note that even
-       if maxBuildJobs == 0 (no local builds allowed), we still allow
-       a substituter to run.  This is because substitutions cannot be
-       distributed to another machine via the build hook. */
-    if (worker.getNrLocalBuilds() >= std::max(1U, (unsigned int) settings.maxBuildJobs)) {
-        worker.waitForBuildSlot(shared_from_this());
+    /* Make sure that we are allowed to start a substitution.  These
+       have their own limit, independent of maxBuildJobs, so that
+       (even if no local builds are allowed) many small downloads can
+       run in parallel without starving CPU-bound builds. */
+    if (worker.getNrSubstitutions() >= std::max(1U, settings.maxSubstitutionJobs.get())) {
+        worker.waitForSubstitutionSlot(shared_from_this());
         return;
     }
 
     maintainRunningSubstitutions = std::make_unique<MaintainCount<uint64_t>>(worker.runningSubstitutions);
+    maintainActiveSubstitutions = std::make_unique<MaintainCount<std::atomic<uint64_t>>>(daemonMetrics->activeSubstitutions);
     worker.updateProgress();
 
     outPipe.create();
@@ -4535,7 +5143,7 @@ void SubstitutionGoal::tryToRun()
         }
     });
 
-    worker.childStarted(shared_from_this(), {outPipe.readSide.get()}, true, false);
+    worker.childStarted(shared_from_this(), {outPipe.readSide.get()}, false, false, true);
 
     state = &SubstitutionGoal::finished;
 }
@@ -4553,6 +5161,9 @@ void SubstitutionGoal::finished()
     } catch (std::exception & e) {
         printError(e.what());
 
+        maintainActiveSubstitutions.reset();
+        daemonMetrics->substitutionsFailed++;
+
         /* Cause the parent build to fail unless --fallback is given,
            or the substitute has disappeared. The latter case behaves
            the same as the substitute never having existed in the
@@ -4575,9 +5186,12 @@ void SubstitutionGoal::finished()
     printMsg(lvlChatty, "substitution of path '%s' succeeded", worker.store.printStorePath(storePath));
 
     maintainRunningSubstitutions.reset();
+    maintainActiveSubstitutions.reset();
 
     maintainExpectedSubstitutions.reset();
     worker.doneSubstitutions++;
+    daemonMetrics->substitutionsSucceeded++;
+    daemonMetrics->substitutedBytes += maintainExpectedNar->delta;
 
     if (maintainExpectedDownload) {
         auto fileSize = maintainExpectedDownload->delta;
@@ -4615,11 +5229,39 @@ Worker::Worker(LocalStore & store)
 {
     /* Debugging: prevent recursive workers. */
     nrLocalBuilds = 0;
+    nrSubstitutions = 0;
+#if __linux__
+    epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (!epollFD) throw SysError("creating epoll instance");
+#endif
     lastWokenUp = steady_time_point::min();
     permanentFailure = false;
     timedOut = false;
     hashMismatch = false;
     checkMismatch = false;
+
+    if (settings.jobserverTokens) {
+        jobserver.create();
+        refillJobserver();
+    }
+}
+
+
+void Worker::refillJobserver()
+{
+    /* Builders that get killed can't return the tokens they hold,
+       so when no local build is running, reset the pipe to its
+       full size. Use FIONREAD rather than non-blocking reads,
+       since O_NONBLOCK would be shared with the builders. */
+    int available = 0;
+    if (ioctl(jobserver.readSide.get(), FIONREAD, &available) == -1)
+        throw SysError("querying the jobserver");
+    if ((unsigned int) available == settings.jobserverTokens) return;
+    if (available > 0) {
+        std::vector<char> buf(available);
+        readFull(jobserver.readSide.get(), (unsigned char *) buf.data(), buf.size());
+    }
+    writeFull(jobserver.writeSide.get(), std::string(settings.jobserverTokens, '+'));
 }
 
 
@@ -4721,34 +5363,96 @@ unsigned Worker::getNrLocalBuilds()
 }
 
 
+unsigned Worker::getNrSubstitutions()
+{
+    return nrSubstitutions;
+}
+
+
 void Worker::childStarted(GoalPtr goal, const set<int> & fds,
-    bool inBuildSlot, bool respectTimeouts)
+    bool inBuildSlot, bool respectTimeouts, bool inSubstitutionSlot)
 {
     Child child;
+    child.id = nextChildId++;
     child.goal = goal;
     child.goal2 = goal.get();
     child.fds = fds;
     child.timeStarted = child.lastOutput = steady_time_point::clock::now();
     child.inBuildSlot = inBuildSlot;
+    child.inSubstitutionSlot = inSubstitutionSlot;
     child.respectTimeouts = respectTimeouts;
-    children.emplace_back(child);
+    auto i = children.insert(children.end(), child);
+    childrenById.emplace(child.id, i);
+    childrenByGoal.emplace(child.goal2, i);
+    for (auto fd : fds) {
+        childrenByFD[fd] = i;
+        watchFD(fd);
+    }
+    if (respectTimeouts) {
+        if (0 != settings.maxSilentTime)
+            deadlines.push({child.lastOutput + std::chrono::seconds(settings.maxSilentTime), child.id, true});
+        if (0 != settings.buildTimeout)
+            deadlines.push({child.timeStarted + std::chrono::seconds(settings.buildTimeout), child.id, false});
+    }
     if (inBuildSlot) nrLocalBuilds++;
+    if (inSubstitutionSlot) nrSubstitutions++;
+}
+
+
+void Worker::watchFD(int fd)
+{
+#if __linux__
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollFD.get(), EPOLL_CTL_ADD, fd, &ev) == -1) {
+        /* A reused descriptor number may still be registered if its
+           previous incarnation was dup()ed. */
+        if (errno != EEXIST || epoll_ctl(epollFD.get(), EPOLL_CTL_MOD, fd, &ev) == -1)
+            throw SysError("adding file descriptor %d to the epoll set", fd);
+    }
+#endif
+}
+
+
+void Worker::unwatchFD(int fd)
+{
+#if __linux__
+    /* This fails harmlessly if the goal already closed `fd', which
+       removes it from the set. */
+    epoll_ctl(epollFD.get(), EPOLL_CTL_DEL, fd, nullptr);
+#endif
 }
 
 
 void Worker::childTerminated(Goal * goal, bool wakeSleepers)
 {
-    auto i = std::find_if(children.begin(), children.end(),
-        [&](const Child & child) { return child.goal2 == goal; });
-    if (i == children.end()) return;
+    auto j = childrenByGoal.find(goal);
+    if (j == childrenByGoal.end()) return;
+    auto i = j->second;
 
     if (i->inBuildSlot) {
         assert(nrLocalBuilds > 0);
         nrLocalBuilds--;
     }
 
+    bool freedSubstitutionSlot = i->inSubstitutionSlot;
+    if (freedSubstitutionSlot) {
+        assert(nrSubstitutions > 0);
+        nrSubstitutions--;
+    }
+
+    for (auto fd : i->fds) {
+        unwatchFD(fd);
+        childrenByFD.erase(fd);
+    }
+    childrenByGoal.erase(j);
+    childrenById.erase(i->id);
     children.erase(i);
 
+    if (jobserver.readSide && !nrLocalBuilds) refillJobserver();
+
     if (wakeSleepers) {
 
         /* Wake up goals waiting for a build slot. */
@@ -4758,6 +5462,15 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
         }
 
         wantingToBuild.clear();
+
+        if (freedSubstitutionSlot) {
+            for (auto & j : wantingToSubstitute) {
+                GoalPtr goal = j.lock();
+                if (goal) wakeUp(goal);
+            }
+
+            wantingToSubstitute.clear();
+        }
     }
 }
 
@@ -4772,6 +5485,16 @@ void Worker::waitForBuildSlot(GoalPtr goal)
 }
 
 
+void Worker::waitForSubstitutionSlot(GoalPtr goal)
+{
+    debug("wait for substitution slot");
+    if (getNrSubstitutions() < std::max(1U, settings.maxSubstitutionJobs.get()))
+        wakeUp(goal); /* we can do it right away */
+    else
+        addToWeakGoals(wantingToSubstitute, goal);
+}
+
+
 void Worker::waitForAnyGoal(GoalPtr goal)
 {
     debug("wait for any goal");
@@ -4796,7 +5519,7 @@ void Worker::run(const Goals & _topGoals)
 
         checkInterrupt();
 
-        store.autoGC(false);
+        store.autoGC(false, [&]() { return expectedDiskUse(); });
 
         /* Call every wake goal (in the ordering established by
            CompareGoalPtrs). */
@@ -4807,7 +5530,23 @@ void Worker::run(const Goals & _topGoals)
                 if (goal) awake2.insert(goal);
             }
             awake.clear();
-            for (auto & goal : awake2) {
+
+            /* Goals compete for build slots in the order in which
+               they run, so let those heading the longest remaining
+               chain of expected work go first.  Ties (such as when no
+               build times have been recorded yet) keep the ordering
+               of CompareGoalPtrs. */
+            std::vector<GoalPtr> ordered(awake2.begin(), awake2.end());
+            if (ordered.size() > 1) {
+                std::map<Goal *, uint64_t> memo;
+                for (auto & goal : ordered) criticalPath(goal.get(), memo);
+                std::stable_sort(ordered.begin(), ordered.end(),
+                    [&](const GoalPtr & a, const GoalPtr & b) {
+                        return memo[a.get()] > memo[b.get()];
+                    });
+            }
+
+            for (auto & goal : ordered) {
                 checkInterrupt();
                 goal->work();
                 if (topGoals.empty()) break; // stuff may have been cancelled
@@ -4832,9 +5571,43 @@ void Worker::run(const Goals & _topGoals)
        --keep-going *is* set, then they must all be finished now. */
     assert(!settings.keepGoing || awake.empty());
     assert(!settings.keepGoing || wantingToBuild.empty());
+    assert(!settings.keepGoing || wantingToSubstitute.empty());
     assert(!settings.keepGoing || children.empty());
+
+    if (settings.postBuildHookWait && !hookedOutputs.empty())
+        store.waitForPostBuildHook(hookedOutputs);
+}
+
+uint64_t Worker::criticalPath(Goal * goal, std::map<Goal *, uint64_t> & memo)
+{
+    auto i = memo.find(goal);
+    if (i != memo.end()) return i->second;
+
+    /* Goals can't be waiting on each other in a cycle, so a
+       placeholder suffices to terminate the recursion. */
+    memo[goal] = 0;
+
+    uint64_t rest = 0;
+    for (auto & w : goal->waiters) {
+        GoalPtr waiter = w.lock();
+        if (waiter) rest = std::max(rest, criticalPath(waiter.get(), memo));
+    }
+
+    return memo[goal] = goal->estimatedDuration() + rest;
 }
 
+
+uint64_t Worker::expectedDiskUse()
+{
+    uint64_t total = 0;
+    for (auto goals : {&derivationGoals, &substitutionGoals})
+        for (auto & i : *goals)
+            if (auto goal = i.second.lock())
+                total += goal->expectedDiskUse();
+    return total;
+}
+
+
 void Worker::waitForInput()
 {
     printMsg(lvlVomit, "waiting for children");
@@ -4845,116 +5618,128 @@ void Worker::waitForInput()
        the logger pipe of a build, we assume that the builder has
        terminated. */
 
-    bool useTimeout = false;
-    long timeout = 0;
     auto before = steady_time_point::clock::now();
 
-    /* If we're monitoring for silence on stdout/stderr, or if there
-       is a build timeout, then wait for input until the first
-       deadline for any child. */
+    /* Wait for input until the first deadline of any child for
+       silence on stdout/stderr or the build timeout, if any. */
     auto nearest = steady_time_point::max(); // nearest deadline
     if (settings.minFree.get() != 0)
         // Periodicallty wake up to see if we need to run the garbage collector.
         nearest = before + std::chrono::seconds(10);
-    for (auto & i : children) {
-        if (!i.respectTimeouts) continue;
-        if (0 != settings.maxSilentTime)
-            nearest = std::min(nearest, i.lastOutput + std::chrono::seconds(settings.maxSilentTime));
-        if (0 != settings.buildTimeout)
-            nearest = std::min(nearest, i.timeStarted + std::chrono::seconds(settings.buildTimeout));
-    }
-    if (nearest != steady_time_point::max()) {
-        timeout = std::max(1L, (long) std::chrono::duration_cast<std::chrono::seconds>(nearest - before).count());
-        useTimeout = true;
-    }
+    if (!deadlines.empty())
+        nearest = std::min(nearest, deadlines.top().time);
 
     /* If we are polling goals that are waiting for a lock, then wake
        up after a few seconds at most. */
     if (!waitingForAWhile.empty()) {
-        useTimeout = true;
         if (lastWokenUp == steady_time_point::min() || lastWokenUp > before) lastWokenUp = before;
-        timeout = std::max(1L,
-            (long) std::chrono::duration_cast<std::chrono::seconds>(
-                lastWokenUp + std::chrono::seconds(settings.pollInterval) - before).count());
+        nearest = std::min(nearest, lastWokenUp + std::chrono::seconds(settings.pollInterval));
     } else lastWokenUp = steady_time_point::min();
 
-    if (useTimeout)
-        vomit("sleeping %d seconds", timeout);
+    int timeout = -1;
+    if (nearest != steady_time_point::max()) {
+        timeout = std::max(0L, (long) std::chrono::duration_cast<std::chrono::milliseconds>(nearest - before).count());
+        vomit("sleeping %d ms", timeout);
+    }
 
-    /* Use select() to wait for the input side of any logger pipe to
-       become `available'.  Note that `available' (i.e., non-blocking)
+    /* Wait for the input side of any logger pipe to become
+       `available'.  Note that `available' (i.e., non-blocking)
        includes EOF. */
-    std::vector<struct pollfd> pollStatus;
-    std::map <int, int> fdToPollStatus;
-    for (auto & i : children) {
-        for (auto & j : i.fds) {
-            pollStatus.push_back((struct pollfd) { .fd = j, .events = POLLIN });
-            fdToPollStatus[j] = pollStatus.size() - 1;
-        }
+    std::vector<int> readyFDs;
+
+#if __linux__
+    std::vector<struct epoll_event> events(std::max((size_t) 1, std::min(childrenByFD.size(), (size_t) 1024)));
+    int nrEvents = epoll_wait(epollFD.get(), events.data(), events.size(), timeout);
+    if (nrEvents == -1) {
+        if (errno == EINTR) return;
+        throw SysError("waiting for input");
     }
+    for (int n = 0; n < nrEvents; ++n)
+        readyFDs.push_back(events[n].data.fd);
+#else
+    std::vector<struct pollfd> pollStatus;
+    for (auto & i : childrenByFD)
+        pollStatus.push_back((struct pollfd) { .fd = i.first, .events = POLLIN });
 
-    if (poll(pollStatus.data(), pollStatus.size(),
-            useTimeout ? timeout * 1000 : -1) == -1) {
+    if (poll(pollStatus.data(), pollStatus.size(), timeout) == -1) {
         if (errno == EINTR) return;
         throw SysError("waiting for input");
     }
+    for (auto & i : pollStatus)
+        if (i.revents) readyFDs.push_back(i.fd);
+#endif
 
     auto after = steady_time_point::clock::now();
 
-    /* Process all available file descriptors. FIXME: this is
-       O(children * fds). */
-    decltype(children)::iterator i;
-    for (auto j = children.begin(); j != children.end(); j = i) {
-        i = std::next(j);
-
+    /* Process the available file descriptors.  Handling one may
+       terminate its child (or another one), so look it up afresh
+       every time. */
+    /* Chatty builders can fill a pipe quickly, so read in large
+       chunks to reduce the number of wakeups and writes to the
+       log. */
+    std::vector<unsigned char> buffer(64 * 1024);
+    for (auto k : readyFDs) {
         checkInterrupt();
 
-        GoalPtr goal = j->goal.lock();
+        auto j = childrenByFD.find(k);
+        if (j == childrenByFD.end()) continue;
+        auto child = j->second;
+
+        GoalPtr goal = child->goal.lock();
         assert(goal);
 
-        set<int> fds2(j->fds);
-        std::vector<unsigned char> buffer(4096);
-        for (auto & k : fds2) {
-            if (pollStatus.at(fdToPollStatus.at(k)).revents) {
-                ssize_t rd = read(k, buffer.data(), buffer.size());
-                // FIXME: is there a cleaner way to handle pt close
-                // than EIO? Is this even standard?
-                if (rd == 0 || (rd == -1 && errno == EIO)) {
-                    debug("%1%: got EOF", goal->getName());
-                    goal->handleEOF(k);
-                    j->fds.erase(k);
-                } else if (rd == -1) {
-                    if (errno != EINTR)
-                        throw SysError("%s: read failed", goal->getName());
-                } else {
-                    printMsg(lvlVomit, "%1%: read %2% bytes",
-                        goal->getName(), rd);
-                    string data((char *) buffer.data(), rd);
-                    j->lastOutput = after;
-                    goal->handleChildOutput(k, data);
-                }
+        ssize_t rd = read(k, buffer.data(), buffer.size());
+        // FIXME: is there a cleaner way to handle pt close
+        // than EIO? Is this even standard?
+        if (rd == 0 || (rd == -1 && errno == EIO)) {
+            debug("%1%: got EOF", goal->getName());
+            unwatchFD(k);
+            childrenByFD.erase(j);
+            child->fds.erase(k);
+            goal->handleEOF(k);
+        } else if (rd == -1) {
+            if (errno != EINTR)
+                throw SysError("%s: read failed", goal->getName());
+        } else {
+            printMsg(lvlVomit, "%1%: read %2% bytes",
+                goal->getName(), rd);
+            string data((char *) buffer.data(), rd);
+            child->lastOutput = after;
+            goal->handleChildOutput(k, data);
+        }
+    }
+
+    /* Time out the children whose deadlines have passed. */
+    while (!deadlines.empty() && deadlines.top().time <= after) {
+        checkInterrupt();
+
+        auto deadline = deadlines.top();
+        deadlines.pop();
+
+        auto j = childrenById.find(deadline.child);
+        if (j == childrenById.end()) continue;
+        auto child = j->second;
+
+        if (deadline.silence) {
+            auto time = child->lastOutput + std::chrono::seconds(settings.maxSilentTime);
+            if (time > after) {
+                deadlines.push({time, deadline.child, true});
+                continue;
             }
         }
 
-        if (goal->exitCode == Goal::ecBusy &&
-            0 != settings.maxSilentTime &&
-            j->respectTimeouts &&
-            after - j->lastOutput >= std::chrono::seconds(settings.maxSilentTime))
-        {
+        GoalPtr goal = child->goal.lock();
+        assert(goal);
+        if (goal->exitCode != Goal::ecBusy) continue;
+
+        if (deadline.silence)
             goal->timedOut(Error(
                     "%1% timed out after %2% seconds of silence",
                     goal->getName(), settings.maxSilentTime));
-        }
-
-        else if (goal->exitCode == Goal::ecBusy &&
-            0 != settings.buildTimeout &&
-            j->respectTimeouts &&
-            after - j->timeStarted >= std::chrono::seconds(settings.buildTimeout))
-        {
+        else
             goal->timedOut(Error(
                     "%1% timed out after %2% seconds",
                     goal->getName(), settings.buildTimeout));
-        }
     }
 
     if (!waitingForAWhile.empty() && lastWokenUp + std::chrono::seconds(settings.pollInterval) <= after) {
@@ -2,10 +2,20 @@
 
 #include "derivations.hh"
 
+#include <atomic>
+
 namespace nix {
 
+struct FileTransfer;
+
 // TODO: make pluggable.
 void builtinFetchurl(const BasicDerivation & drv, const std::string & netrcData);
+
+/* Perform the fetch of a builtin:fetchurl derivation without a
+   builder process, using `fileTransfer'. If `interrupt' is set, the
+   fetch is aborted once it becomes true. */
+void builtinFetchurl(const BasicDerivation & drv, FileTransfer & fileTransfer,
+    std::shared_ptr<std::atomic<bool>> interrupt = {});
 void builtinUnpackChannel(const BasicDerivation & drv);
 
 }
@@ -1,4 +1,5 @@
 #include "buildenv.hh"
+#include "thread-pool.hh"
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -7,50 +8,136 @@
 
 namespace nix {
 
-struct State
+/* An entry of a package directory. */
+struct Entry
 {
-    std::map<Path, int> priorities;
-    unsigned long symlinks = 0;
+    std::string name;
+    enum { tFile, tDirectory, tDangling } type;
 };
 
-/* For each activated package, create symlinks */
-static void createLinks(State & state, const Path & srcDir, const Path & dstDir, int priority)
+/* The non-hidden entries of a package directory. */
+struct Listing
 {
-    DirEntries srcFiles;
+    bool notDir = false;
+    std::vector<Entry> entries;
+};
 
-    try {
-        srcFiles = readDirectory(srcDir);
-    } catch (SysError & e) {
-        if (e.errNo == ENOTDIR) {
-            logWarning({
-                .name = "Create links - directory",
-                .hint = hintfmt("not including '%s' in the user environment because it's not a directory", srcDir)
-            });
-            return;
+static Listing scanDirectory(const Path & dir)
+{
+    Listing listing;
+
+    AutoCloseDir d(opendir(dir.c_str()));
+    if (!d) {
+        if (errno == ENOTDIR) {
+            listing.notDir = true;
+            return listing;
         }
-        throw;
+        throw SysError("opening directory '%1%'", dir);
     }
 
-    for (const auto & ent : srcFiles) {
+    for (auto & ent : readDirectory(d.get(), dir)) {
         if (ent.name[0] == '.')
             /* not matched by glob */
             continue;
+        Entry entry{ent.name, Entry::tFile};
+        /* Only symlinks need to be followed to find out whether they
+           point to a directory. */
+        if (ent.type == DT_DIR)
+            entry.type = Entry::tDirectory;
+        else if (ent.type == DT_LNK || ent.type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(d.get()), ent.name.c_str(), &st, 0) == -1) {
+                if (errno != ENOENT && errno != ENOTDIR)
+                    throw SysError("getting status of '%1%/%2%'", dir, ent.name);
+                entry.type = Entry::tDangling;
+            } else if (S_ISDIR(st.st_mode))
+                entry.type = Entry::tDirectory;
+        }
+        listing.entries.push_back(std::move(entry));
+    }
+
+    return listing;
+}
+
+/* A file in the user environment: either a symlink to `target', or
+   (if `target' is empty) a directory merging several packages. The
+   environment is built in memory and only written out at the end,
+   so symlinks that get replaced or expanded into directories never
+   touch the disk. */
+struct Node
+{
+    Path target;
+    bool targetIsDir = false;
+    int priority = 0;
+    std::map<std::string, Node> children;
+
+    bool isDirectory() const { return target.empty(); }
+};
+
+struct State
+{
+    /* Directory listings read ahead by prefetch(). */
+    std::map<Path, Listing> prefetched;
+    unsigned long symlinks = 0;
+};
+
+/* Read the top levels of all packages in parallel. That's where
+   almost all collisions (bin, share, share/man, ...) happen, so this
+   takes most of the I/O out of the (sequential) merge. */
+static void prefetch(State & state, const Packages & pkgs)
+{
+    Sync<std::map<Path, Listing>> prefetched;
+    ThreadPool pool;
+
+    std::function<void(const Path &, unsigned int)> scan;
+    scan = [&](const Path & dir, unsigned int depth) {
+        Listing listing;
+        try {
+            listing = scanDirectory(dir);
+        } catch (Error &) {
+            /* createLinks() will try again and report it. */
+            return;
+        }
+        if (depth > 1)
+            for (auto & ent : listing.entries)
+                if (ent.type == Entry::tDirectory)
+                    pool.enqueue(std::bind(scan, dir + "/" + ent.name, depth - 1));
+        prefetched.lock()->emplace(dir, std::move(listing));
+    };
+
+    for (auto & pkg : pkgs)
+        if (pkg.active)
+            pool.enqueue(std::bind(scan, pkg.path, 3));
+
+    pool.process();
+
+    state.prefetched = std::move(*prefetched.lock());
+}
+
+/* For each activated package, create symlinks */
+static void createLinks(State & state, const Path & srcDir, const Path & dstDir, Node & dst, int priority)
+{
+    auto i = state.prefetched.find(srcDir);
+    auto listing = i != state.prefetched.end() ? i->second : scanDirectory(srcDir);
+
+    if (listing.notDir) {
+        logWarning({
+            .name = "Create links - directory",
+            .hint = hintfmt("not including '%s' in the user environment because it's not a directory", srcDir)
+        });
+        return;
+    }
+
+    for (const auto & ent : listing.entries) {
         auto srcFile = srcDir + "/" + ent.name;
         auto dstFile = dstDir + "/" + ent.name;
 
-        struct stat srcSt;
-        try {
-            if (stat(srcFile.c_str(), &srcSt) == -1)
-                throw SysError("getting status of '%1%'", srcFile);
-        } catch (SysError & e) {
-            if (e.errNo == ENOENT || e.errNo == ENOTDIR) {
-                logWarning({
-                    .name = "Create links - skipping symlink",
-                    .hint = hintfmt("skipping dangling symlink '%s'", dstFile)
-                });
-                continue;
-            }
-            throw;
+        if (ent.type == Entry::tDangling) {
+            logWarning({
+                .name = "Create links - skipping symlink",
+                .hint = hintfmt("skipping dangling symlink '%s'", dstFile)
+            });
+            continue;
         }
 
         /* The files below are special-cased to that they don't show up
@@ -66,67 +153,71 @@ static void createLinks(State & state, const Path & srcDir, const Path & dstDir,
             hasSuffix(srcFile, "/log"))
             continue;
 
-        else if (S_ISDIR(srcSt.st_mode)) {
-            struct stat dstSt;
-            auto res = lstat(dstFile.c_str(), &dstSt);
-            if (res == 0) {
-                if (S_ISDIR(dstSt.st_mode)) {
-                    createLinks(state, srcFile, dstFile, priority);
-                    continue;
-                } else if (S_ISLNK(dstSt.st_mode)) {
-                    auto target = canonPath(dstFile, true);
-                    if (!S_ISDIR(lstat(target).st_mode))
-                        throw Error("collision between '%1%' and non-directory '%2%'", srcFile, target);
-                    if (unlink(dstFile.c_str()) == -1)
-                        throw SysError("unlinking '%1%'", dstFile);
-                    if (mkdir(dstFile.c_str(), 0755) == -1)
-                        throw SysError("creating directory '%1%'", dstFile);
-                    createLinks(state, target, dstFile, state.priorities[dstFile]);
-                    createLinks(state, srcFile, dstFile, priority);
+        auto j = dst.children.find(ent.name);
+
+        if (j != dst.children.end()) {
+            auto & node = j->second;
+
+            if (ent.type == Entry::tDirectory) {
+                if (node.isDirectory()) {
+                    createLinks(state, srcFile, dstFile, node, priority);
                     continue;
                 }
-            } else if (errno != ENOENT)
-                throw SysError("getting status of '%1%'", dstFile);
-        }
+                auto target = canonPath(node.target, true);
+                if (!node.targetIsDir)
+                    throw Error("collision between '%1%' and non-directory '%2%'", srcFile, target);
+                /* Replace the symlink by a directory merging both. */
+                auto prevPriority = node.priority;
+                node = Node();
+                createLinks(state, target, dstFile, node, prevPriority);
+                createLinks(state, srcFile, dstFile, node, priority);
+                continue;
+            }
 
-        else {
-            struct stat dstSt;
-            auto res = lstat(dstFile.c_str(), &dstSt);
-            if (res == 0) {
-                if (S_ISLNK(dstSt.st_mode)) {
-                    auto prevPriority = state.priorities[dstFile];
-                    if (prevPriority == priority)
-                        throw Error(
-                                "packages '%1%' and '%2%' have the same priority %3%; "
-                                "use 'nix-env --set-flag priority NUMBER INSTALLED_PKGNAME' "
-                                "to change the priority of one of the conflicting packages"
-                                " (0 being the highest priority)",
-                                srcFile, readLink(dstFile), priority);
-                    if (prevPriority < priority)
-                        continue;
-                    if (unlink(dstFile.c_str()) == -1)
-                        throw SysError("unlinking '%1%'", dstFile);
-                } else if (S_ISDIR(dstSt.st_mode))
-                    throw Error("collision between non-directory '%1%' and directory '%2%'", srcFile, dstFile);
-            } else if (errno != ENOENT)
-                throw SysError("getting status of '%1%'", dstFile);
+            if (node.isDirectory())
+                throw Error("collision between non-directory '%1%' and directory '%2%'", srcFile, dstFile);
+            if (node.priority == priority)
+                throw Error(
+                        "packages '%1%' and '%2%' have the same priority %3%; "
+                        "use 'nix-env --set-flag priority NUMBER INSTALLED_PKGNAME' "
+                        "to change the priority of one of the conflicting packages"
+                        " (0 being the highest priority)",
+                        srcFile, node.target, priority);
+            if (node.priority < priority)
+                continue;
         }
 
-        createSymlink(srcFile, dstFile);
-        state.priorities[dstFile] = priority;
-        state.symlinks++;
+        dst.children[ent.name] = Node{srcFile, ent.type == Entry::tDirectory, priority, {}};
+    }
+}
+
+static void writeTree(State & state, const Path & path, const Node & node)
+{
+    for (auto & [name, child] : node.children) {
+        auto childPath = path + "/" + name;
+        if (child.isDirectory()) {
+            if (mkdir(childPath.c_str(), 0755) == -1)
+                throw SysError("creating directory '%1%'", childPath);
+            writeTree(state, childPath, child);
+        } else {
+            createSymlink(child.target, childPath);
+            state.symlinks++;
+        }
     }
 }
 
 void buildProfile(const Path & out, Packages && pkgs)
 {
     State state;
+    Node root;
+
+    prefetch(state, pkgs);
 
     std::set<Path> done, postponed;
 
     auto addPkg = [&](const Path & pkgDir, int priority) {
         if (!done.insert(pkgDir).second) return;
-        createLinks(state, pkgDir, out, priority);
+        createLinks(state, pkgDir, out, root, priority);
 
         try {
             for (const auto & p : tokenizeString<std::vector<string>>(
@@ -162,6 +253,8 @@ void buildProfile(const Path & out, Packages && pkgs)
             addPkg(pkgDir, priorityCounter++);
     }
 
+    writeTree(state, out, root);
+
     debug("created %d symlinks in user environment", state.symlinks);
 }
 
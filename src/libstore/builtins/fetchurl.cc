@@ -16,6 +16,19 @@ void builtinFetchurl(const BasicDerivation & drv, const std::string & netrcData)
         writeFile(settings.netrcFile, netrcData, 0600);
     }
 
+    /* Note: have to use a fresh fileTransfer here because we're in
+       a forked process. */
+    builtinFetchurl(drv, *makeFileTransfer());
+}
+
+void builtinFetchurl(const BasicDerivation & drv, FileTransfer & fileTransfer,
+    std::shared_ptr<std::atomic<bool>> interrupt)
+{
+    auto checkInterrupted = [&]() {
+        if (interrupt && *interrupt)
+            throw Interrupted("fetch of '%s' was interrupted", drv.env.at("out"));
+    };
+
     auto getAttr = [&](const string & name) {
         auto i = drv.env.find(name);
         if (i == drv.env.end()) throw Error("attribute '%s' missing", name);
@@ -26,10 +39,6 @@ void builtinFetchurl(const BasicDerivation & drv, const std::string & netrcData)
     auto mainUrl = getAttr("url");
     bool unpack = get(drv.env, "unpack").value_or("") == "1";
 
-    /* Note: have to use a fresh fileTransfer here because we're in
-       a forked process. */
-    auto fileTransfer = makeFileTransfer();
-
     auto fetch = [&](const std::string & url) {
 
         auto source = sinkToSource([&](Sink & sink) {
@@ -39,10 +48,11 @@ void builtinFetchurl(const BasicDerivation & drv, const std::string & netrcData)
             FileTransferRequest request(url);
             request.verifyTLS = false;
             request.decompress = false;
+            request.interrupt = interrupt;
 
             auto decompressor = makeDecompressionSink(
                 unpack && hasSuffix(mainUrl, ".xz") ? "xz" : "none", sink);
-            fileTransfer->download(std::move(request), *decompressor);
+            fileTransfer.download(std::move(request), *decompressor);
             decompressor->finish();
         });
 
@@ -62,19 +72,41 @@ void builtinFetchurl(const BasicDerivation & drv, const std::string & netrcData)
        checked below) it must be the only output */
     auto & output = drv.outputs.begin()->second;
 
-    /* Try the hashed mirrors first. */
-    if (output.hash && output.hash->method == FileIngestionMethod::Flat)
-        for (auto hashedMirror : settings.hashedMirrors.get())
+    /* Try the hashed mirrors first. Ask all of them at the same time
+       whether they have the file, so that we don't wait for each
+       mirror that doesn't in turn, and skip those that said no. */
+    if (output.hash && output.hash->method == FileIngestionMethod::Flat) {
+        std::vector<std::pair<std::string, std::future<FileTransferResult>>> mirrors;
+
+        for (auto hashedMirror : settings.hashedMirrors.get()) {
+            if (!hasSuffix(hashedMirror, "/")) hashedMirror += '/';
+            auto & h = output.hash->hash;
+            FileTransferRequest request(hashedMirror + printHashType(*h.type) + "/" + h.to_string(Base16, false));
+            request.verifyTLS = false;
+            request.head = true;
+            request.tries = 1;
+            request.interrupt = interrupt;
+            mirrors.emplace_back(request.uri, fileTransfer.enqueueFileTransfer(request));
+        }
+
+        for (auto & [url, future] : mirrors)
             try {
-                if (!hasSuffix(hashedMirror, "/")) hashedMirror += '/';
-                auto & h = output.hash->hash;
-                fetch(hashedMirror + printHashType(*h.type) + "/" + h.to_string(Base16, false));
+                try {
+                    future.get();
+                } catch (FileTransferError & e) {
+                    if (e.error == FileTransfer::NotFound) throw;
+                    /* Some servers don't support HEAD requests. */
+                }
+                fetch(url);
                 return;
             } catch (Error & e) {
+                checkInterrupted();
                 debug(e.what());
             }
+    }
 
     /* Otherwise try the specified URL. */
+    checkInterrupted();
     fetch(mainUrl);
 }
 
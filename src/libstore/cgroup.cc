@@ -0,0 +1,122 @@
+#if __linux__
+
+#include "cgroup.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <thread>
+
+#include <dirent.h>
+#include <signal.h>
+
+namespace nix {
+
+std::optional<Path> getOwnCgroup()
+{
+    if (!pathExists("/sys/fs/cgroup/cgroup.controllers"))
+        return {};
+
+    /* On the unified hierarchy, /proc/self/cgroup has a single line
+       "0::<path>". */
+    for (auto & line : tokenizeString<std::vector<std::string>>(readFile("/proc/self/cgroup"), "\n"))
+        if (hasPrefix(line, "0::"))
+            return canonPath("/sys/fs/cgroup/" + line.substr(3));
+
+    return {};
+}
+
+
+Path createCgroup(const std::string & name)
+{
+    auto parent = getOwnCgroup();
+    if (!parent)
+        throw Error("cannot create cgroup '%s': this system does not use the unified cgroup hierarchy", name);
+
+    /* Memory accounting requires the memory controller to be enabled
+       for the children of the parent. This fails if the parent is a
+       domain cgroup that contains processes with other controllers
+       enabled; we then simply don't get memory statistics. */
+    try {
+        writeFile(*parent + "/cgroup.subtree_control", "+memory");
+    } catch (SysError &) { }
+
+    auto cgroup = *parent + "/" + name;
+
+    if (pathExists(cgroup))
+        destroyCgroup(cgroup);
+
+    if (mkdir(cgroup.c_str(), 0755) == -1)
+        throw SysError("creating cgroup '%s'", cgroup);
+
+    return cgroup;
+}
+
+
+static CgroupStats readStats(const Path & cgroup)
+{
+    CgroupStats stats;
+
+    try {
+        for (auto & line : tokenizeString<std::vector<std::string>>(readFile(cgroup + "/cpu.stat"), "\n")) {
+            auto fields = tokenizeString<std::vector<std::string>>(line, " ");
+            uint64_t n;
+            if (fields.size() != 2 || !string2Int(fields[1], n)) continue;
+            if (fields[0] == "user_usec") stats.cpuUser = std::chrono::microseconds(n);
+            else if (fields[0] == "system_usec") stats.cpuSystem = std::chrono::microseconds(n);
+        }
+    } catch (SysError &) { }
+
+    /* memory.peak exists since Linux 5.19. */
+    try {
+        uint64_t n;
+        if (string2Int(trim(readFile(cgroup + "/memory.peak")), n))
+            stats.memoryPeak = n;
+    } catch (SysError &) { }
+
+    return stats;
+}
+
+
+CgroupStats destroyCgroup(const Path & cgroup)
+{
+    /* Child cgroups must be removed first. */
+    for (auto & ent : readDirectory(cgroup))
+        if (ent.type == DT_DIR)
+            destroyCgroup(cgroup + "/" + ent.name);
+
+    /* Since Linux 5.14, the kernel can kill the whole cgroup
+       atomically. Otherwise kill its processes until there are none
+       left, since they may be forking. */
+    auto procsFile = cgroup + "/cgroup.procs";
+    bool killed = false;
+    try {
+        writeFile(cgroup + "/cgroup.kill", "1");
+        killed = true;
+    } catch (SysError &) { }
+
+    for (int round = 0; ; round++) {
+        auto pids = tokenizeString<std::vector<std::string>>(readFile(procsFile), "\n");
+        if (pids.empty()) break;
+        if (round == 1000)
+            throw Error("cannot kill the processes in cgroup '%s'", cgroup);
+        if (!killed || round % 100 == 99)
+            for (auto & s : pids) {
+                pid_t pid;
+                if (string2Int(s, pid) && kill(pid, SIGKILL) == -1 && errno != ESRCH)
+                    throw SysError("killing process %d in cgroup '%s'", pid, cgroup);
+            }
+        /* Killed processes disappear from the cgroup asynchronously. */
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    auto stats = readStats(cgroup);
+
+    if (rmdir(cgroup.c_str()) == -1)
+        throw SysError("deleting cgroup '%s'", cgroup);
+
+    return stats;
+}
+
+}
+
+#endif
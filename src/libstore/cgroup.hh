@@ -0,0 +1,34 @@
+#pragma once
+
+#if __linux__
+
+#include "types.hh"
+
+#include <chrono>
+#include <optional>
+
+namespace nix {
+
+struct CgroupStats
+{
+    std::optional<std::chrono::microseconds> cpuUser, cpuSystem;
+    std::optional<uint64_t> memoryPeak;
+};
+
+/* Return the cgroup (v2) that this process is in, as a path under
+   /sys/fs/cgroup. */
+std::optional<Path> getOwnCgroup();
+
+/* Create a cgroup ‘name’ below the cgroup of this process, enabling
+   memory accounting on it if possible, and return its path. An
+   existing cgroup of the same name (left over by a previous daemon)
+   is destroyed first. */
+Path createCgroup(const std::string & name);
+
+/* Kill all processes in the given cgroup, remove it, and return the
+   resources used by its processes. */
+CgroupStats destroyCgroup(const Path & cgroup);
+
+}
+
+#endif
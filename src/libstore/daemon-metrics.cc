@@ -0,0 +1,226 @@
+#include "daemon-metrics.hh"
+#include "store-api.hh"
+#include "worker-protocol.hh"
+
+#include <cstring>
+#include <functional>
+
+#include <sys/mman.h>
+
+namespace nix {
+
+
+const double DaemonMetrics::bucketBounds[DaemonMetrics::nrBuckets] =
+    { 0.001, 0.005, 0.025, 0.1, 0.5, 2.5, 10, 60 };
+
+
+static DaemonMetrics privateMetrics;
+
+DaemonMetrics * daemonMetrics = &privateMetrics;
+
+
+void shareDaemonMetrics()
+{
+    auto p = mmap(nullptr, sizeof(DaemonMetrics), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        throw SysError("allocating shared memory for daemon metrics");
+    /* Anonymous mappings are zero-filled, which is the initial state
+       of all counters. */
+    daemonMetrics = (DaemonMetrics *) p;
+}
+
+
+void DaemonMetrics::recordOp(uint64_t op, std::chrono::steady_clock::duration duration, bool failed)
+{
+    if (op >= maxOps) return;
+    auto & o = ops[op];
+    o.count++;
+    if (failed) o.errors++;
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    o.durationMicros += micros;
+    size_t bucket = 0;
+    while (bucket < nrBuckets && micros > bucketBounds[bucket] * 1e6) bucket++;
+    o.buckets[bucket]++;
+}
+
+
+DaemonMetrics::Host * DaemonMetrics::getHost(const std::string & host)
+{
+    auto name = host.substr(0, sizeof(hosts[0].name) - 1);
+
+    for (auto & h : hosts) {
+        int state = h.state;
+        if (state == 0) {
+            if (h.state.compare_exchange_strong(state, 1)) {
+                strcpy(h.name, name.c_str());
+                h.state = 2;
+                return &h;
+            }
+        }
+        /* Another process may be filling in this slot. */
+        while (state == 1) state = h.state;
+        if (name == h.name) return &h;
+    }
+
+    return nullptr;
+}
+
+
+static const char * opName(uint64_t op)
+{
+    switch ((WorkerOp) op) {
+    case wopIsValidPath: return "IsValidPath";
+    case wopHasSubstitutes: return "HasSubstitutes";
+    case wopQueryPathHash: return "QueryPathHash";
+    case wopQueryReferences: return "QueryReferences";
+    case wopQueryReferrers: return "QueryReferrers";
+    case wopAddToStore: return "AddToStore";
+    case wopAddTextToStore: return "AddTextToStore";
+    case wopBuildPaths: return "BuildPaths";
+    case wopEnsurePath: return "EnsurePath";
+    case wopAddTempRoot: return "AddTempRoot";
+    case wopAddIndirectRoot: return "AddIndirectRoot";
+    case wopSyncWithGC: return "SyncWithGC";
+    case wopFindRoots: return "FindRoots";
+    case wopExportPath: return "ExportPath";
+    case wopQueryDeriver: return "QueryDeriver";
+    case wopSetOptions: return "SetOptions";
+    case wopCollectGarbage: return "CollectGarbage";
+    case wopQuerySubstitutablePathInfo: return "QuerySubstitutablePathInfo";
+    case wopQueryDerivationOutputs: return "QueryDerivationOutputs";
+    case wopQueryAllValidPaths: return "QueryAllValidPaths";
+    case wopQueryFailedPaths: return "QueryFailedPaths";
+    case wopClearFailedPaths: return "ClearFailedPaths";
+    case wopQueryPathInfo: return "QueryPathInfo";
+    case wopImportPaths: return "ImportPaths";
+    case wopQueryDerivationOutputNames: return "QueryDerivationOutputNames";
+    case wopQueryPathFromHashPart: return "QueryPathFromHashPart";
+    case wopQuerySubstitutablePathInfos: return "QuerySubstitutablePathInfos";
+    case wopQueryValidPaths: return "QueryValidPaths";
+    case wopQuerySubstitutablePaths: return "QuerySubstitutablePaths";
+    case wopQueryValidDerivers: return "QueryValidDerivers";
+    case wopOptimiseStore: return "OptimiseStore";
+    case wopVerifyStore: return "VerifyStore";
+    case wopBuildDerivation: return "BuildDerivation";
+    case wopAddSignatures: return "AddSignatures";
+    case wopNarFromPath: return "NarFromPath";
+    case wopAddToStoreNar: return "AddToStoreNar";
+    case wopQueryMissing: return "QueryMissing";
+    case wopQueryDerivationOutputMap: return "QueryDerivationOutputMap";
+    case wopAddTextsToStore: return "AddTextsToStore";
+    case wopQueryPathInfos: return "QueryPathInfos";
+    case wopAddMultipleToStore: return "AddMultipleToStore";
+    }
+    return nullptr;
+}
+
+
+std::string DaemonMetrics::render()
+{
+    std::string res;
+
+    auto header = [&](const std::string & name, const std::string & type, const std::string & help) {
+        res += fmt("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    };
+
+    auto value = [&](const std::string & name, uint64_t n) {
+        res += fmt("%s %d\n", name, n);
+    };
+
+    auto forEachOp = [&](std::function<void(const std::string & label, Op & op)> f) {
+        for (uint64_t n = 0; n < maxOps; ++n) {
+            auto name = opName(n);
+            if (!ops[n].count) continue;
+            f(fmt("op=\"%s\"", name ? name : std::to_string(n)), ops[n]);
+        }
+    };
+
+    header("nix_daemon_operations_total", "counter", "Number of worker protocol operations handled.");
+    forEachOp([&](const std::string & label, Op & op) {
+        value(fmt("nix_daemon_operations_total{%s}", label), op.count);
+    });
+
+    header("nix_daemon_operation_errors_total", "counter", "Number of worker protocol operations that failed.");
+    forEachOp([&](const std::string & label, Op & op) {
+        value(fmt("nix_daemon_operation_errors_total{%s}", label), op.errors);
+    });
+
+    header("nix_daemon_operation_duration_seconds", "histogram", "Time spent handling worker protocol operations.");
+    forEachOp([&](const std::string & label, Op & op) {
+        uint64_t cumulative = 0;
+        for (size_t n = 0; n <= nrBuckets; ++n) {
+            cumulative += op.buckets[n];
+            value(fmt("nix_daemon_operation_duration_seconds_bucket{%s,le=\"%s\"}", label,
+                    n < nrBuckets ? fmt("%g", bucketBounds[n]) : "+Inf"),
+                cumulative);
+        }
+        res += fmt("nix_daemon_operation_duration_seconds_sum{%s} %g\n", label, op.durationMicros / 1e6);
+        value(fmt("nix_daemon_operation_duration_seconds_count{%s}", label), op.count);
+    });
+
+    header("nix_daemon_connections", "gauge", "Number of open client connections.");
+    value("nix_daemon_connections", connections);
+
+    header("nix_daemon_connections_total", "counter", "Number of client connections accepted.");
+    value("nix_daemon_connections_total", connectionsTotal);
+
+    header("nix_daemon_sqlite_busy_total", "counter", "Number of times a SQLite transaction was retried because the database was busy.");
+    value("nix_daemon_sqlite_busy_total", sqliteBusy);
+
+    header("nix_daemon_path_lock_waits_total", "counter", "Number of path locks that took at least 1 ms to acquire.");
+    value("nix_daemon_path_lock_waits_total", pathLockWaits);
+
+    header("nix_daemon_path_lock_wait_seconds_total", "counter", "Time spent waiting for path locks.");
+    res += fmt("nix_daemon_path_lock_wait_seconds_total %g\n", pathLockWaitMicros / 1e6);
+
+    header("nix_daemon_builds_active", "gauge", "Number of running builds.");
+    value("nix_daemon_builds_active", activeBuilds);
+
+    header("nix_daemon_builds_total", "counter", "Number of finished builds.");
+    value("nix_daemon_builds_total{result=\"success\"}", buildsSucceeded);
+    value("nix_daemon_builds_total{result=\"failure\"}", buildsFailed);
+
+    header("nix_daemon_build_setup_seconds", "summary", "Time spent setting up the environment of local builds.");
+    res += fmt("nix_daemon_build_setup_seconds_sum %g\n", buildSetupMicros / 1e6);
+    value("nix_daemon_build_setup_seconds_count", buildSetups);
+
+    header("nix_daemon_substitutions_active", "gauge", "Number of running substitutions.");
+    value("nix_daemon_substitutions_active", activeSubstitutions);
+
+    header("nix_daemon_substitutions_total", "counter", "Number of finished substitutions.");
+    value("nix_daemon_substitutions_total{result=\"success\"}", substitutionsSucceeded);
+    value("nix_daemon_substitutions_total{result=\"failure\"}", substitutionsFailed);
+
+    header("nix_daemon_substituted_bytes_total", "counter", "NAR size of the paths obtained from substituters.");
+    value("nix_daemon_substituted_bytes_total", substitutedBytes);
+
+    header("nix_daemon_nar_served_bytes_total", "counter", "Number of bytes of NARs sent to clients.");
+    value("nix_daemon_nar_served_bytes_total", narBytesServed);
+
+    auto forEachHost = [&](std::function<void(const std::string & label, Host & host)> f) {
+        for (auto & h : hosts)
+            if (h.state == 2)
+                f(fmt("host=\"%s\"", h.name), h);
+    };
+
+    header("nix_daemon_download_bytes_total", "counter", "Number of bytes downloaded, by host.");
+    forEachHost([&](const std::string & label, Host & host) {
+        value(fmt("nix_daemon_download_bytes_total{%s}", label), host.bytes);
+    });
+
+    header("nix_daemon_downloads_total", "counter", "Number of finished downloads, by host.");
+    forEachHost([&](const std::string & label, Host & host) {
+        value(fmt("nix_daemon_downloads_total{%s}", label), host.transfers);
+    });
+
+    header("nix_daemon_download_duration_seconds_total", "counter", "Time spent downloading, by host.");
+    forEachHost([&](const std::string & label, Host & host) {
+        res += fmt("nix_daemon_download_duration_seconds_total{%s} %g\n", label, host.durationMicros / 1e6);
+    });
+
+    return res;
+}
+
+
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "types.hh"
+
+#include <atomic>
+#include <chrono>
+
+namespace nix {
+
+/* Counters describing the load on the Nix daemon, exported in the
+   Prometheus text format through the socket named by the
+   'daemon-metrics-socket' setting. The daemon moves them into shared
+   memory before it forks any connection processes, so that all of
+   them update the same counters. In other processes they are private
+   and have no effect. */
+struct DaemonMetrics
+{
+    /* Larger than any WorkerOp. */
+    static constexpr size_t maxOps = 64;
+
+    /* Upper bounds (in seconds) of the operation duration histogram
+       buckets, not counting the final +Inf bucket. */
+    static constexpr size_t nrBuckets = 8;
+    static const double bucketBounds[nrBuckets];
+
+    struct Op
+    {
+        std::atomic<uint64_t> count, errors, durationMicros;
+        std::atomic<uint64_t> buckets[nrBuckets + 1];
+    };
+
+    Op ops[maxOps];
+
+    std::atomic<uint64_t> connections, connectionsTotal;
+
+    std::atomic<uint64_t> sqliteBusy;
+
+    /* Path locks that took noticeable time (at least 1 ms) to
+       acquire, and the total time spent waiting for them. */
+    std::atomic<uint64_t> pathLockWaits, pathLockWaitMicros;
+
+    std::atomic<uint64_t> activeBuilds, buildsSucceeded, buildsFailed;
+
+    /* Time spent setting up the environment of local builds, up to
+       the exec of the builder. */
+    std::atomic<uint64_t> buildSetups, buildSetupMicros;
+
+    std::atomic<uint64_t> activeSubstitutions, substitutionsSucceeded,
+        substitutionsFailed, substitutedBytes;
+
+    std::atomic<uint64_t> narBytesServed;
+
+    /* Download counters per host. Slots are claimed on first use and
+       never released; hosts beyond the first `maxHosts' are not
+       counted. */
+    static constexpr size_t maxHosts = 32;
+
+    struct Host
+    {
+        /* 0 = free, 1 = being claimed, 2 = in use. */
+        std::atomic<int> state;
+        char name[128];
+        std::atomic<uint64_t> bytes, transfers, durationMicros;
+    };
+
+    Host hosts[maxHosts];
+
+    /* Return the counters for `host', or nullptr if the table is
+       full. */
+    Host * getHost(const std::string & host);
+
+    void recordOp(uint64_t op, std::chrono::steady_clock::duration duration, bool failed);
+
+    /* Render the counters in the Prometheus text exposition format. */
+    std::string render();
+};
+
+extern DaemonMetrics * daemonMetrics;
+
+/* Move the metrics into memory that is shared with child processes
+   forked from now on. */
+void shareDaemonMetrics();
+
+}
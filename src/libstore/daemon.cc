@@ -1,4 +1,5 @@
 #include "daemon.hh"
+#include "compression.hh"
 #include "monitor-fd.hh"
 #include "worker-protocol.hh"
 #include "store-api.hh"
@@ -7,6 +8,8 @@
 #include "affinity.hh"
 #include "archive.hh"
 #include "derivations.hh"
+#include "daemon-metrics.hh"
+#include "maintenance-priority.hh"
 #include "args.hh"
 
 namespace nix::daemon {
@@ -249,6 +252,7 @@ struct ClientSettings
                     ;
                 else if (trusted
                     || name == settings.buildTimeout.name
+                    || name == settings.postBuildHookWait.name
                     || name == "connect-timeout"
                     || (name == "builders" && value == ""))
                     settings.set(name, value);
@@ -265,9 +269,17 @@ struct ClientSettings
     }
 };
 
+/* Where the store is on disk, for limiting the I/O of maintenance
+   operations. */
+static Path realStoreDirOf(Store & store)
+{
+    auto localStore = dynamic_cast<LocalFSStore *>(&store);
+    return localStore ? localStore->getRealStoreDir() : "";
+}
+
 static void performOp(TunnelLogger * logger, ref<Store> store,
     TrustedFlag trusted, RecursiveFlag recursive, unsigned int clientVersion,
-    Source & from, BufferedSink & to, unsigned int op)
+    Source & from, FdSink & to, unsigned int op)
 {
     switch (op) {
 
@@ -428,6 +440,21 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopAddTextsToStore: {
+        std::vector<StoreText> texts;
+        texts.resize(readInt(from));
+        for (auto & text : texts) {
+            text.name = readString(from);
+            text.contents = readString(from);
+            text.references = readStorePaths<StorePathSet>(*store, from);
+        }
+        logger->startWork();
+        store->addTextsToStore(texts, NoRepair);
+        logger->stopWork();
+        to << 1;
+        break;
+    }
+
     case wopExportPath: {
         auto path = store->parseStorePath(readString(from));
         readInt(from); // obsolete
@@ -553,7 +580,10 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         logger->startWork();
         if (options.ignoreLiveness)
             throw Error("you are not allowed to ignore liveness");
-        store->collectGarbage(options, results);
+        {
+            MaintenancePriority priority(realStoreDirOf(*store), true);
+            store->collectGarbage(options, results);
+        }
         logger->stopWork();
 
         to << results.paths << results.bytesFreed << 0 /* obsolete */;
@@ -670,12 +700,49 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopQueryPathInfos: {
+        auto paths = readStorePaths<StorePathSet>(*store, from);
+        std::vector<ref<const ValidPathInfo>> infos;
+        logger->startWork();
+        for (auto & path : paths) {
+            try {
+                infos.push_back(store->queryPathInfo(path));
+            } catch (InvalidPath &) {
+            }
+        }
+        logger->stopWork();
+        to << infos.size();
+        for (auto & info : infos)
+            writeValidPathInfo(*store, to, *info);
+        break;
+    }
+
     case wopOptimiseStore:
         logger->startWork();
-        store->optimiseStore();
+        {
+            MaintenancePriority priority(realStoreDirOf(*store), true);
+            store->optimiseStore();
+        }
+        logger->stopWork();
+        to << 1;
+        break;
+
+    case wopQueryFailedPaths: {
+        logger->startWork();
+        auto paths = store->queryFailedPaths();
+        logger->stopWork();
+        writeStorePaths(*store, to, paths);
+        break;
+    }
+
+    case wopClearFailedPaths: {
+        auto paths = readStorePaths<StorePathSet>(*store, from);
+        logger->startWork();
+        store->clearFailedPaths(paths);
         logger->stopWork();
         to << 1;
         break;
+    }
 
     case wopVerifyStore: {
         bool checkContents, repair;
@@ -683,7 +750,11 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         logger->startWork();
         if (repair && !trusted)
             throw Error("you are not privileged to repair paths");
-        bool errors = store->verifyStore(checkContents, (RepairFlag) repair);
+        bool errors;
+        {
+            MaintenancePriority priority(realStoreDirOf(*store), true);
+            errors = store->verifyStore(checkContents, (RepairFlag) repair);
+        }
         logger->stopWork();
         to << errors;
         break;
@@ -705,7 +776,9 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         auto path = store->parseStorePath(readString(from));
         logger->startWork();
         logger->stopWork();
+        auto written = to.written;
         dumpPath(store->printStorePath(path), to);
+        daemonMetrics->narBytesServed += to.written - written;
         break;
     }
 
@@ -747,6 +820,21 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopAddMultipleToStore: {
+        bool repair, dontCheckSigs;
+        from >> repair >> dontCheckSigs;
+        if (!trusted && dontCheckSigs)
+            dontCheckSigs = false;
+
+        TunnelSource source(from, to);
+
+        logger->startWork();
+        store->addMultipleToStore(source, (RepairFlag) repair,
+            dontCheckSigs ? NoCheckSigs : CheckSigs);
+        logger->stopWork();
+        break;
+    }
+
     case wopQueryMissing: {
         std::vector<StorePathWithOutputs> targets;
         for (auto & s : readStrings<Strings>(from))
@@ -797,6 +885,9 @@ void processConnection(
 
     unsigned int opCount = 0;
 
+    MaintainCount<std::atomic<uint64_t>> mcConnections(daemonMetrics->connections);
+    daemonMetrics->connectionsTotal++;
+
     Finally finally([&]() {
         _isInterrupted = false;
         prevLogger->log(lvlDebug, fmt("%d operations", opCount));
@@ -809,6 +900,25 @@ void processConnection(
 
     readInt(from); // obsolete reserveSpace
 
+    /* Switch to a compressed channel if the client asks for a method
+       we support. The reply is sent uncompressed. */
+    AutoCloseFD channel;
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 0x1a) {
+        auto wanted = readString(from);
+        if (wanted != "") {
+            try {
+                channel = makeCompressedChannel(wanted, from.fd, to.fd, from.takeBuffered());
+            } catch (UnknownCompressionMethod &) {
+            }
+            to << (channel ? wanted : "");
+            to.flush();
+            if (channel) {
+                to = FdSink(channel.get());
+                from = FdSource(channel.get());
+            }
+        }
+    }
+
     /* Send startup error messages to the client. */
     tunnelLogger->startWork();
 
@@ -842,9 +952,16 @@ void processConnection(
 
             opCount++;
 
+            auto opStart = std::chrono::steady_clock::now();
+            bool opFailed = false;
+            Finally recordOp([&]() {
+                daemonMetrics->recordOp(op, std::chrono::steady_clock::now() - opStart, opFailed);
+            });
+
             try {
                 performOp(tunnelLogger, store, trusted, recursive, clientVersion, from, to, op);
             } catch (Error & e) {
+                opFailed = true;
                 /* If we're not in a state where we can send replies, then
                    something went wrong processing the input of the
                    client.  This can happen especially if I/O errors occur
@@ -854,6 +971,7 @@ void processConnection(
                 tunnelLogger->stopWork(false, e.msg(), e.status);
                 if (!errorAllowed) throw;
             } catch (std::bad_alloc & e) {
+                opFailed = true;
                 tunnelLogger->stopWork(false, "Nix daemon out of memory", 1);
                 throw;
             }
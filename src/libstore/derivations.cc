@@ -4,7 +4,8 @@
 #include "util.hh"
 #include "worker-protocol.hh"
 #include "fs-accessor.hh"
-#include "istringstream_nocopy.hh"
+#include "lru-cache.hh"
+#include "sync.hh"
 
 namespace nix {
 
@@ -40,85 +41,123 @@ StorePath writeDerivation(ref<Store> store,
 }
 
 
-/* Read string `s' from stream `str'. */
-static void expect(std::istream & str, const string & s)
+/* A cursor over the text of a derivation. The parser works on views
+   into the text and only allocates for the values it returns. */
+struct DrvParser
 {
-    char s2[s.size()];
-    str.read(s2, s.size());
-    if (string(s2, s.size()) != s)
-        throw FormatError("expected string '%1%'", s);
-}
+    std::string_view s;
+    size_t pos = 0;
 
+    DrvParser(std::string_view s) : s(s) { }
 
-/* Read a C-style string from stream `str'. */
-static string parseString(std::istream & str)
-{
-    string res;
-    expect(str, "\"");
-    int c;
-    while ((c = str.get()) != '"')
-        if (c == '\\') {
-            c = str.get();
+    /* Skip string `expected', which must come next. */
+    void expect(std::string_view expected)
+    {
+        if (s.compare(pos, expected.size(), expected) != 0)
+            throw FormatError("expected string '%1%'", expected);
+        pos += expected.size();
+    }
+
+    /* Read a C-style string. Runs of characters without escapes are
+       appended in one go. */
+    string parseString()
+    {
+        expect("\"");
+        string res;
+        while (true) {
+            auto end = s.find_first_of("\"\\", pos);
+            if (end == std::string_view::npos)
+                throw FormatError("unterminated string in derivation");
+            res.append(s, pos, end - pos);
+            pos = end + 1;
+            if (s[end] == '"') break;
+            if (pos == s.size())
+                throw FormatError("unterminated string in derivation");
+            char c = s[pos++];
             if (c == 'n') res += '\n';
             else if (c == 'r') res += '\r';
             else if (c == 't') res += '\t';
             else res += c;
         }
-        else res += c;
-    return res;
-}
-
+        return res;
+    }
 
-static Path parsePath(std::istream & str)
-{
-    string s = parseString(str);
-    if (s.size() == 0 || s[0] != '/')
-        throw FormatError("bad path '%1%' in derivation", s);
-    return s;
-}
+    /* Read a string that may not contain escapes, such as a store
+       path, without copying it. */
+    std::string_view parseUnescaped()
+    {
+        expect("\"");
+        auto end = s.find_first_of("\"\\", pos);
+        if (end == std::string_view::npos)
+            throw FormatError("unterminated string in derivation");
+        if (s[end] == '\\') {
+            pos--;
+            throw FormatError("unexpected escape in string '%1%'", parseString());
+        }
+        auto res = s.substr(pos, end - pos);
+        pos = end + 1;
+        return res;
+    }
 
+    std::string_view parsePath()
+    {
+        auto p = parseUnescaped();
+        if (p.size() == 0 || p[0] != '/')
+            throw FormatError("bad path '%1%' in derivation", p);
+        return p;
+    }
 
-static bool endOfList(std::istream & str)
-{
-    if (str.peek() == ',') {
-        str.get();
+    bool endOfList()
+    {
+        if (pos < s.size()) {
+            if (s[pos] == ',') {
+                pos++;
+                return false;
+            }
+            if (s[pos] == ']') {
+                pos++;
+                return true;
+            }
+        }
         return false;
     }
-    if (str.peek() == ']') {
-        str.get();
-        return true;
-    }
-    return false;
-}
 
+    StringSet parseStrings()
+    {
+        StringSet res;
+        while (!endOfList())
+            res.insert(parseString());
+        return res;
+    }
 
-static StringSet parseStrings(std::istream & str, bool arePaths)
-{
-    StringSet res;
-    while (!endOfList(str))
-        res.insert(arePaths ? parsePath(str) : parseString(str));
-    return res;
-}
+    StorePathSet parsePaths(const Store & store)
+    {
+        StorePathSet res;
+        while (!endOfList())
+            res.insert(store.parseStorePath(parsePath()));
+        return res;
+    }
+};
 
 
-static DerivationOutput parseDerivationOutput(const Store & store, istringstream_nocopy & str)
+static DerivationOutput parseDerivationOutput(const Store & store, DrvParser & str)
 {
-    expect(str, ","); auto path = store.parseStorePath(parsePath(str));
-    expect(str, ","); auto hashAlgo = parseString(str);
-    expect(str, ","); const auto hash = parseString(str);
-    expect(str, ")");
+    str.expect(","); auto path = store.parseStorePath(str.parsePath());
+    str.expect(","); auto hashAlgo = str.parseUnescaped();
+    str.expect(","); const auto hash = str.parseUnescaped();
+    str.expect(")");
 
     std::optional<FixedOutputHash> fsh;
     if (hashAlgo != "") {
         auto method = FileIngestionMethod::Flat;
-        if (string(hashAlgo, 0, 2) == "r:") {
+        if (hasPrefix(hashAlgo, "r:")) {
             method = FileIngestionMethod::Recursive;
-            hashAlgo = string(hashAlgo, 2);
+            hashAlgo.remove_prefix(2);
         }
-        const HashType hashType = parseHashType(hashAlgo);
+        const HashType hashType = parseHashType(string(hashAlgo));
         fsh = FixedOutputHash {
             .method = std::move(method),
-            .hash = Hash(hash, hashType),
+            .hash = Hash(string(hash), hashType),
         };
     }
 
@@ -129,48 +168,48 @@ static DerivationOutput parseDerivationOutput(const Store & store, istringstream
 }
 
 
-static Derivation parseDerivation(const Store & store, const string & s)
+static Derivation parseDerivation(const Store & store, std::string_view s)
 {
     Derivation drv;
-    istringstream_nocopy str(s);
-    expect(str, "Derive([");
+    DrvParser str(s);
+    str.expect("Derive([");
 
     /* Parse the list of outputs. */
-    while (!endOfList(str)) {
-        expect(str, "("); std::string id = parseString(str);
+    while (!str.endOfList()) {
+        str.expect("("); std::string id = str.parseString();
         auto output = parseDerivationOutput(store, str);
         drv.outputs.emplace(std::move(id), std::move(output));
     }
 
     /* Parse the list of input derivations. */
-    expect(str, ",[");
-    while (!endOfList(str)) {
-        expect(str, "(");
-        Path drvPath = parsePath(str);
-        expect(str, ",[");
-        drv.inputDrvs.insert_or_assign(store.parseStorePath(drvPath), parseStrings(str, false));
-        expect(str, ")");
+    str.expect(",[");
+    while (!str.endOfList()) {
+        str.expect("(");
+        auto drvPath = store.parseStorePath(str.parsePath());
+        str.expect(",[");
+        drv.inputDrvs.insert_or_assign(std::move(drvPath), str.parseStrings());
+        str.expect(")");
     }
 
-    expect(str, ",["); drv.inputSrcs = store.parseStorePathSet(parseStrings(str, true));
-    expect(str, ","); drv.platform = parseString(str);
-    expect(str, ","); drv.builder = parseString(str);
+    str.expect(",["); drv.inputSrcs = str.parsePaths(store);
+    str.expect(","); drv.platform = str.parseString();
+    str.expect(","); drv.builder = str.parseString();
 
     /* Parse the builder arguments. */
-    expect(str, ",[");
-    while (!endOfList(str))
-        drv.args.push_back(parseString(str));
+    str.expect(",[");
+    while (!str.endOfList())
+        drv.args.push_back(str.parseString());
 
     /* Parse the environment variables. */
-    expect(str, ",[");
-    while (!endOfList(str)) {
-        expect(str, "("); string name = parseString(str);
-        expect(str, ","); string value = parseString(str);
-        expect(str, ")");
-        drv.env[name] = value;
+    str.expect(",[");
+    while (!str.endOfList()) {
+        str.expect("("); string name = str.parseString();
+        str.expect(","); string value = str.parseString();
+        str.expect(")");
+        drv.env.insert_or_assign(std::move(name), std::move(value));
     }
 
-    expect(str, ")");
+    str.expect(")");
     return drv;
 }
 
@@ -192,13 +231,27 @@ Derivation Store::derivationFromPath(const StorePath & drvPath)
 }
 
 
+/* Derivations are immutable, and the same ones are read over and over
+   by queryMissing(), the build goals and hashDerivationModulo(), so
+   keep the most recently parsed ones, keyed by store and path. */
+static Sync<LRUCache<std::string, std::shared_ptr<const Derivation>>> drvCache(4096);
+
+
 Derivation Store::readDerivation(const StorePath & drvPath)
 {
+    auto path = printStorePath(drvPath);
+    auto key = getUri() + " " + path;
+
+    if (auto drv = drvCache.lock()->get(key))
+        return **drv;
+
     auto accessor = getFSAccessor();
     try {
-        return parseDerivation(*this, accessor->readFile(printStorePath(drvPath)));
+        auto drv = std::make_shared<const Derivation>(parseDerivation(*this, accessor->readFile(path)));
+        drvCache.lock()->upsert(key, drv);
+        return *drv;
     } catch (FormatError & e) {
-        throw Error("error parsing derivation '%s': %s", printStorePath(drvPath), e.msg());
+        throw Error("error parsing derivation '%s': %s", path, e.msg());
     }
 }
 
@@ -368,8 +421,17 @@ Hash hashDerivationModulo(Store & store, const Derivation & drv, bool maskOutput
         auto h = drvHashes.find(i.first);
         if (h == drvHashes.end()) {
             assert(store.isValidPath(i.first));
-            h = drvHashes.insert_or_assign(i.first, hashDerivationModulo(store,
-                store.readDerivation(i.first), false)).first;
+            /* Since a derivation's path determines its contents, its
+               hash can be recorded persistently. This saves reading
+               and hashing its closure again in later evaluations
+               (unless the store must not be written to). */
+            auto hash = store.queryDrvHashModulo(i.first);
+            if (!hash) {
+                hash = hashDerivationModulo(store, store.readDerivation(i.first), false);
+                if (!settings.readOnlyMode)
+                    store.registerDrvHashModulo(i.first, *hash);
+            }
+            h = drvHashes.insert_or_assign(i.first, *hash).first;
         }
         inputs2.insert_or_assign(h->second.to_string(Base16, false), i.second);
     }
@@ -83,7 +83,9 @@ bool isDerivation(const string & fileName);
 
 Hash hashDerivationModulo(Store & store, const Derivation & drv, bool maskOutputs);
 
-/* Memoisation of hashDerivationModulo(). */
+/* In-process memoisation of hashDerivationModulo(). Results for
+   valid derivations are also recorded persistently via
+   Store::registerDrvHashModulo(). */
 typedef std::map<StorePath, Hash> DrvHashes;
 
 extern DrvHashes drvHashes; // FIXME: global, not thread-safe
@@ -4,6 +4,7 @@
 #include "worker-protocol.hh"
 
 #include <algorithm>
+#include <future>
 
 namespace nix {
 
@@ -25,19 +26,71 @@ struct HashAndWriteSink : Sink
     }
 };
 
+/* Refuse to export paths that have changed.  This prevents
+   filesystem corruption from spreading to other machines.  Don't
+   complain if the stored hash is zero (unknown). */
+static void checkExportHash(const Store & store, const StorePath & path,
+    const ValidPathInfo & info, const Hash & hash)
+{
+    if (hash != info.narHash && info.narHash != Hash(*info.narHash.type))
+        throw Error("hash of path '%s' has changed from '%s' to '%s'!",
+            store.printStorePath(path), info.narHash.to_string(Base32, true), hash.to_string(Base32, true));
+}
+
+/* Write the part of an exported path that follows its NAR. */
+static void writeExportTrailer(const Store & store, Sink & sink, const ValidPathInfo & info)
+{
+    sink
+        << exportMagic
+        << store.printStorePath(info.path);
+    writeStorePaths(store, sink, info.references);
+    sink
+        << (info.deriver ? store.printStorePath(*info.deriver) : "")
+        << 0;
+}
+
+/* exportPaths() dumps and hashes the NARs of the next few paths in
+   the background while writing the current one. Larger NARs are
+   streamed directly to keep memory usage bounded. */
+static const size_t exportLookahead = 4;
+static const uint64_t maxPrefetchNarSize = 32 * 1024 * 1024;
+
 void Store::exportPaths(const StorePathSet & paths, Sink & sink)
 {
     auto sorted = topoSortPaths(paths);
     std::reverse(sorted.begin(), sorted.end());
 
-    std::string doneLabel("paths exported");
-    //logger->incExpected(doneLabel, sorted.size());
-
-    for (auto & path : sorted) {
-        //Activity act(*logger, lvlInfo, format("exporting path '%s'") % path);
+    typedef std::pair<std::string, Hash> Dump;
+    std::map<size_t, std::future<Dump>> prefetched;
+    size_t next = 0;
+
+    for (size_t n = 0; n < sorted.size(); n++) {
+        for (; next < sorted.size() && next <= n + exportLookahead; next++) {
+            auto info = queryPathInfo(sorted[next]);
+            if (!info->narSize || info->narSize > maxPrefetchNarSize) continue;
+            prefetched.emplace(next, std::async(std::launch::async, [this, path{sorted[next]}]() {
+                StringSink nar;
+                narFromPath(path, nar);
+                auto hash = hashString(htSHA256, *nar.s);
+                return Dump(std::move(*nar.s), hash);
+            }));
+        }
+
+        auto & path = sorted[n];
+        auto i = prefetched.find(n);
+        if (i == prefetched.end()) {
+            sink << 1;
+            exportPath(path, sink);
+            continue;
+        }
+
+        auto dump = i->second.get();
+        prefetched.erase(i);
+        auto info = queryPathInfo(path);
+        checkExportHash(*this, path, *info, dump.second);
         sink << 1;
-        exportPath(path, sink);
-        //logger->incProgress(doneLabel);
+        sink(dump.first);
+        writeExportTrailer(*this, sink, *info);
     }
 
     sink << 0;
@@ -51,26 +104,36 @@ void Store::exportPath(const StorePath & path, Sink & sink)
 
     narFromPath(path, hashAndWriteSink);
 
-    /* Refuse to export paths that have changed.  This prevents
-       filesystem corruption from spreading to other machines.
-       Don't complain if the stored hash is zero (unknown). */
-    Hash hash = hashAndWriteSink.currentHash();
-    if (hash != info->narHash && info->narHash != Hash(*info->narHash.type))
-        throw Error("hash of path '%s' has changed from '%s' to '%s'!",
-            printStorePath(path), info->narHash.to_string(Base32, true), hash.to_string(Base32, true));
+    checkExportHash(*this, path, *info, hashAndWriteSink.currentHash());
 
-    hashAndWriteSink
-        << exportMagic
-        << printStorePath(path);
-    writeStorePaths(*this, hashAndWriteSink, info->references);
-    hashAndWriteSink
-        << (info->deriver ? printStorePath(*info->deriver) : "")
-        << 0;
+    writeExportTrailer(*this, sink, *info);
 }
 
 StorePaths Store::importPaths(Source & source, std::shared_ptr<FSAccessor> accessor, CheckSigsFlag checkSigs)
 {
     StorePaths res;
+    auto importer = beginImport(NoRepair, checkSigs, accessor);
+
+    /* The NAR of each path is hashed in the background while the
+       previous path is being restored and the next one is read. */
+    struct Pending
+    {
+        ValidPathInfo info;
+        std::shared_ptr<std::string> nar;
+        std::future<Hash> narHash;
+    };
+    std::optional<Pending> pending;
+
+    auto addPending = [&]() {
+        if (!pending) return;
+        pending->info.narHash = pending->narHash.get();
+        // Can't use underlying source, which would have been exhausted
+        auto source = StringSource { *pending->nar };
+        importer->add(pending->info, source);
+        res.push_back(pending->info.path);
+        pending.reset();
+    };
+
     while (true) {
         auto n = readNum<uint64_t>(source);
         if (n == 0) break;
@@ -94,20 +157,26 @@ StorePaths Store::importPaths(Source & source, std::shared_ptr<FSAccessor> acces
         if (deriver != "")
             info.deriver = parseStorePath(deriver);
 
-        info.narHash = hashString(htSHA256, *tee.source.data);
-        info.narSize = tee.source.data->size();
+        auto nar = tee.source.data;
+        info.narSize = nar->size();
 
         // Ignore optional legacy signature.
         if (readInt(source) == 1)
             readString(source);
 
-        // Can't use underlying source, which would have been exhausted
-        auto source = StringSource { *tee.source.data };
-        addToStore(info, source, NoRepair, checkSigs, accessor);
+        auto narHash = std::async(std::launch::async, [nar]() {
+            return hashString(htSHA256, *nar);
+        });
+
+        addPending();
 
-        res.push_back(info.path);
+        pending.emplace(Pending { std::move(info), nar, std::move(narHash) });
     }
 
+    addPending();
+
+    importer->finish();
+
     return res;
 }
 
@@ -5,6 +5,7 @@
 #include "s3.hh"
 #include "compression.hh"
 #include "finally.hh"
+#include "daemon-metrics.hh"
 
 #ifdef ENABLE_S3
 #include <aws/core/client/ClientConfiguration.h>
@@ -43,9 +44,72 @@ struct curlFileTransfer : public FileTransfer
 {
     CURLM * curlm = 0;
 
+    /* Shared between all easy handles, so that new connections can
+       reuse TLS sessions. Only used on the worker thread, so it
+       doesn't need locking. */
+    CURLSH * curlsh = 0;
+
     std::random_device rd;
     std::mt19937 mt19937;
 
+    /* Token buckets for 'max-download-speed' and
+       'max-download-speed-per-host', holding the number of bytes that
+       may be received right now. They're only used on the worker
+       thread. */
+    struct TokenBucket
+    {
+        double tokens = 0;
+        std::chrono::steady_clock::time_point last;
+
+        /* Add tokens for the time since the last refill, keeping at
+           most one second's worth. */
+        void refill(uint64_t rate, std::chrono::steady_clock::time_point now)
+        {
+            if (last == std::chrono::steady_clock::time_point())
+                tokens = rate;
+            else
+                tokens = std::min((double) rate,
+                    tokens + rate * std::chrono::duration<double>(now - last).count());
+            last = now;
+        }
+    };
+
+    TokenBucket globalBucket;
+    std::map<std::string, TokenBucket> hostBuckets;
+
+    static uint64_t globalRate()
+    {
+        return fileTransferSettings.maxDownloadSpeed * 1024;
+    }
+
+    static uint64_t hostRate()
+    {
+        return fileTransferSettings.maxDownloadSpeedPerHost * 1024;
+    }
+
+    TokenBucket & hostBucket(const std::string & host)
+    {
+        auto i = hostBuckets.find(host);
+        if (i == hostBuckets.end()) {
+            i = hostBuckets.emplace(host, TokenBucket()).first;
+            i->second.refill(hostRate(), std::chrono::steady_clock::now());
+        }
+        return i->second;
+    }
+
+    /* Whether a transfer from `host' must wait for tokens. */
+    bool isThrottled(const std::string & host)
+    {
+        return (globalRate() && globalBucket.tokens <= 0)
+            || (hostRate() && hostBucket(host).tokens <= 0);
+    }
+
+    void consumeTokens(const std::string & host, size_t len)
+    {
+        if (globalRate()) globalBucket.tokens -= len;
+        if (hostRate()) hostBucket(host).tokens -= len;
+    }
+
     struct TransferItem : public std::enable_shared_from_this<TransferItem>
     {
         curlFileTransfer & fileTransfer;
@@ -58,6 +122,14 @@ struct curlFileTransfer : public FileTransfer
         bool active = false; // whether the handle has been added to the multi object
         std::string status;
 
+        std::string host;
+        DaemonMetrics::Host * hostMetrics = nullptr;
+        std::chrono::steady_clock::time_point startTime;
+
+        /* Whether curl is holding back data because of a rate
+           limit. */
+        bool paused = false;
+
         unsigned int attempt = 0;
 
         /* Don't start this download until the specified time point
@@ -72,6 +144,23 @@ struct curlFileTransfer : public FileTransfer
 
         curl_off_t writtenToSink = 0;
 
+        /* When writing to a sink, the number of (possibly compressed)
+           body bytes fed to the decompression sink so far. A retry
+           resumes from this offset, keeping the decompressor's
+           state. */
+        curl_off_t bodyOffset = 0;
+
+        /* The offset requested by the current attempt, and the number
+           of bytes to discard if the server ignored the range and
+           sent the entire file. */
+        curl_off_t resumeOffset = 0;
+        curl_off_t skip = 0;
+
+        /* The ETag of the first attempt, sent as If-Range when
+           resuming, so that we notice if the file has changed. */
+        std::string resumeETag;
+        bool ifRangeSent = false;
+
         inline static const std::set<long> successfulStatuses {200, 201, 204, 206, 304, 0 /* other protocol */};
         /* Get the HTTP status code, or 0 for other protocols. */
         long getHTTPStatus()
@@ -107,6 +196,15 @@ struct curlFileTransfer : public FileTransfer
                     this->result.data->append((char *) data, len);
               })
         {
+            auto s = request.uri.find("://");
+            if (s != std::string::npos) {
+                auto e = request.uri.compare(s + 3, 1, "[") == 0
+                    ? request.uri.find(']', s + 3) + 1
+                    : request.uri.find_first_of(":/?", s + 3);
+                host = std::string(request.uri, s + 3, e == std::string::npos ? e : e - s - 3);
+                hostMetrics = daemonMetrics->getHost(host);
+            }
+
             if (!request.expectedETag.empty())
                 requestHeaders = curl_slist_append(requestHeaders, ("If-None-Match: " + request.expectedETag).c_str());
             if (!request.mimeType.empty())
@@ -151,12 +249,37 @@ struct curlFileTransfer : public FileTransfer
         {
             try {
                 size_t realSize = size * nmemb;
+
+                if (fileTransfer.isThrottled(host)) {
+                    paused = true;
+                    return CURL_WRITEFUNC_PAUSE;
+                }
+
+                fileTransfer.consumeTokens(host, realSize);
+                if (hostMetrics) hostMetrics->bytes += realSize;
+
                 result.bodySize += realSize;
 
+                auto data = (unsigned char *) contents;
+                size_t len = realSize;
+
+                if (request.dataCallback) {
+                    /* Don't let error pages reach the decompressor. */
+                    if (!successfulStatuses.count(getHTTPStatus()))
+                        return realSize;
+
+                    auto n = std::min((curl_off_t) len, skip);
+                    skip -= n;
+                    data += n;
+                    len -= n;
+
+                    bodyOffset += len;
+                }
+
                 if (!decompressionSink)
                     decompressionSink = makeDecompressionSink(encoding, finalSink);
 
-                (*decompressionSink)((unsigned char *) contents, realSize);
+                (*decompressionSink)(data, len);
 
                 return realSize;
             } catch (...) {
@@ -183,6 +306,15 @@ struct curlFileTransfer : public FileTransfer
                 result.bodySize = 0;
                 acceptRanges = false;
                 encoding = "";
+                skip = 0;
+                if (resumeOffset) {
+                    if (status == "206")
+                        acceptRanges = true;
+                    else if (status == "200" && !request.range) {
+                        debug("server ignored range request for '%s'; skipping %d bytes", request.uri, resumeOffset);
+                        skip = resumeOffset;
+                    }
+                }
             } else {
                 auto i = line.find(':');
                 if (i != string::npos) {
@@ -198,10 +330,29 @@ struct curlFileTransfer : public FileTransfer
                             debug(format("shutting down on 200 HTTP response with expected ETag"));
                             return 0;
                         }
+                        if (resumeOffset && !resumeETag.empty() && result.etag != resumeETag && status == "200") {
+                            writeException = std::make_exception_ptr(FileTransferError(Misc,
+                                "'%s' changed while it was being downloaded", request.uri));
+                            return 0;
+                        }
                     } else if (name == "content-encoding")
                         encoding = trim(string(line, i + 1));
                     else if (name == "accept-ranges" && toLower(trim(std::string(line, i + 1))) == "bytes")
                         acceptRanges = true;
+                    else if (name == "content-range" && resumeOffset && status == "206") {
+                        /* Make sure the server resumed where we asked. */
+                        auto value = trim(string(line, i + 1));
+                        curl_off_t start;
+                        auto expected = (request.range ? (curl_off_t) request.range->first : 0) + resumeOffset;
+                        if (!hasPrefix(value, "bytes ")
+                            || !string2Int(std::string(value, 6, value.find('-') - 6), start)
+                            || start != expected)
+                        {
+                            writeException = std::make_exception_ptr(FileTransferError(Misc,
+                                "server returned range '%s' for '%s', expected offset %d", value, request.uri, expected));
+                            return 0;
+                        }
+                    }
                 }
             }
             return realSize;
@@ -212,6 +363,11 @@ struct curlFileTransfer : public FileTransfer
             return ((TransferItem *) userp)->headerCallback(contents, size, nmemb);
         }
 
+        bool isInterrupted()
+        {
+            return _isInterrupted || (request.interrupt && *request.interrupt);
+        }
+
         int progressCallback(double dltotal, double dlnow)
         {
             try {
@@ -219,7 +375,7 @@ struct curlFileTransfer : public FileTransfer
             } catch (nix::Interrupted &) {
               assert(_isInterrupted);
             }
-            return _isInterrupted;
+            return isInterrupted();
         }
 
         static int progressCallbackWrapper(void * userp, double dltotal, double dlnow, double ultotal, double ulnow)
@@ -255,6 +411,11 @@ struct curlFileTransfer : public FileTransfer
         {
             if (!req) req = curl_easy_init();
 
+            if (startTime == std::chrono::steady_clock::time_point())
+                startTime = std::chrono::steady_clock::now();
+
+            paused = false;
+
             curl_easy_reset(req);
 
             if (verbosity >= lvlVomit) {
@@ -262,6 +423,7 @@ struct curlFileTransfer : public FileTransfer
                 curl_easy_setopt(req, CURLOPT_DEBUGFUNCTION, TransferItem::debugCallback);
             }
 
+            curl_easy_setopt(req, CURLOPT_SHARE, fileTransfer.curlsh);
             curl_easy_setopt(req, CURLOPT_URL, request.uri.c_str());
             curl_easy_setopt(req, CURLOPT_FOLLOWLOCATION, 1L);
             curl_easy_setopt(req, CURLOPT_MAXREDIRS, 10);
@@ -287,8 +449,22 @@ struct curlFileTransfer : public FileTransfer
             curl_easy_setopt(req, CURLOPT_PROGRESSDATA, this);
             curl_easy_setopt(req, CURLOPT_NOPROGRESS, 0);
 
+            resumeOffset = request.dataCallback ? bodyOffset : 0;
+
+            if (resumeOffset && !resumeETag.empty() && !ifRangeSent) {
+                requestHeaders = curl_slist_append(requestHeaders, ("If-Range: " + resumeETag).c_str());
+                ifRangeSent = true;
+            }
+
             curl_easy_setopt(req, CURLOPT_HTTPHEADER, requestHeaders);
 
+            if (request.range) {
+                assert(request.range->second);
+                curl_easy_setopt(req, CURLOPT_RANGE,
+                    fmt("%d-%d", request.range->first + resumeOffset, request.range->first + request.range->second - 1).c_str());
+            } else if (resumeOffset)
+                curl_easy_setopt(req, CURLOPT_RESUME_FROM_LARGE, resumeOffset);
+
             if (request.head)
                 curl_easy_setopt(req, CURLOPT_NOBODY, 1);
 
@@ -318,9 +494,6 @@ struct curlFileTransfer : public FileTransfer
             curl_easy_setopt(req, CURLOPT_NETRC_FILE, settings.netrcFile.get().c_str());
             curl_easy_setopt(req, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
 
-            if (writtenToSink)
-                curl_easy_setopt(req, CURLOPT_RESUME_FROM_LARGE, writtenToSink);
-
             result.data = std::make_shared<std::string>();
             result.bodySize = 0;
         }
@@ -337,12 +510,11 @@ struct curlFileTransfer : public FileTransfer
             debug("finished %s of '%s'; curl status = %d, HTTP status = %d, body = %d bytes",
                 request.verb(), request.uri, code, httpStatus, result.bodySize);
 
-            if (decompressionSink) {
-                try {
-                    decompressionSink->finish();
-                } catch (...) {
-                    writeException = std::current_exception();
-                }
+            if (hostMetrics) {
+                hostMetrics->transfers++;
+                hostMetrics->durationMicros += std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - startTime).count();
+                startTime = std::chrono::steady_clock::now();
             }
 
             if (code == CURLE_WRITE_ERROR && result.etag == request.expectedETag) {
@@ -350,6 +522,16 @@ struct curlFileTransfer : public FileTransfer
                 httpStatus = 304;
             }
 
+            /* Only flush the decompressor once the transfer has
+               succeeded; otherwise a retry may continue feeding it. */
+            if (decompressionSink && !writeException && code == CURLE_OK && successfulStatuses.count(httpStatus)) {
+                try {
+                    decompressionSink->finish();
+                } catch (...) {
+                    writeException = std::current_exception();
+                }
+            }
+
             if (writeException)
                 failEx(writeException);
 
@@ -409,7 +591,7 @@ struct curlFileTransfer : public FileTransfer
                 attempt++;
 
                 auto exc =
-                    code == CURLE_ABORTED_BY_CALLBACK && _isInterrupted
+                    code == CURLE_ABORTED_BY_CALLBACK && isInterrupted()
                     ? FileTransferError(Interrupted, fmt("%s of '%s' was interrupted", request.verb(), request.uri))
                     : httpStatus != 0
                     ? FileTransferError(err,
@@ -423,19 +605,25 @@ struct curlFileTransfer : public FileTransfer
 
                 /* If this is a transient error, then maybe retry the
                    download after a while. If we're writing to a
-                   sink, we can only retry if the server supports
-                   ranged requests. */
+                   sink, we resume from where we left off if the
+                   server supports ranged requests, and can otherwise
+                   only retry if the sink hasn't seen any data yet. */
+                bool resume = this->request.dataCallback && bodyOffset && acceptRanges;
+
                 if (err == Transient
                     && attempt < request.tries
-                    && (!this->request.dataCallback
-                        || writtenToSink == 0
-                        || (acceptRanges && encoding.empty())))
+                    && (resume || !this->request.dataCallback || writtenToSink == 0))
                 {
                     int ms = request.baseRetryTimeMs * std::pow(2.0f, attempt - 1 + std::uniform_real_distribution<>(0.0, 0.5)(fileTransfer.mt19937));
-                    if (writtenToSink)
-                        warn("%s; retrying from offset %d in %d ms", exc.what(), writtenToSink, ms);
-                    else
+                    if (resume) {
+                        if (resumeETag.empty()) resumeETag = result.etag;
+                        warn("%s; retrying from offset %d in %d ms", exc.what(), bodyOffset, ms);
+                    } else {
+                        /* Start over with a fresh decompressor. */
+                        decompressionSink.reset();
+                        bodyOffset = 0;
                         warn("%s; retrying in %d ms", exc.what(), ms);
+                    }
                     embargo = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
                     fileTransfer.enqueueItem(shared_from_this());
                 }
@@ -473,6 +661,10 @@ struct curlFileTransfer : public FileTransfer
 
         curlm = curl_multi_init();
 
+        curlsh = curl_share_init();
+        curl_share_setopt(curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+
         #if LIBCURL_VERSION_NUM >= 0x072b00 // Multiplex requires >= 7.43.0
         curl_multi_setopt(curlm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
         #endif
@@ -494,6 +686,7 @@ struct curlFileTransfer : public FileTransfer
         workerThread.join();
 
         if (curlm) curl_multi_cleanup(curlm);
+        if (curlsh) curl_share_cleanup(curlsh);
     }
 
     void stopWorkerThread()
@@ -522,6 +715,24 @@ struct curlFileTransfer : public FileTransfer
         while (!quit) {
             checkInterrupt();
 
+            /* Refill the rate limiting buckets and resume transfers
+               that may receive data again. */
+            bool anyPaused = false;
+            if (globalRate() || hostRate()) {
+                auto now = std::chrono::steady_clock::now();
+                globalBucket.refill(globalRate(), now);
+                for (auto & i : hostBuckets)
+                    i.second.refill(hostRate(), now);
+                for (auto & i : items) {
+                    auto & item = i.second;
+                    if (item->paused && !isThrottled(item->host)) {
+                        item->paused = false;
+                        curl_easy_pause(item->req, CURLPAUSE_CONT);
+                    }
+                    anyPaused |= item->paused;
+                }
+            }
+
             /* Let curl do its thing. */
             int running;
             CURLMcode mc = curl_multi_perform(curlm, &running);
@@ -548,7 +759,7 @@ struct curlFileTransfer : public FileTransfer
             extraFDs[0].fd = wakeupPipe.readSide.get();
             extraFDs[0].events = CURL_WAIT_POLLIN;
             extraFDs[0].revents = 0;
-            long maxSleepTimeMs = items.empty() ? 10000 : 100;
+            long maxSleepTimeMs = items.empty() ? 10000 : anyPaused ? 10 : 100;
             auto sleepTimeMs =
                 nextWakeup != std::chrono::steady_clock::time_point()
                 ? std::max(0, (int) std::chrono::duration_cast<std::chrono::milliseconds>(nextWakeup - std::chrono::steady_clock::now()).count())
@@ -622,6 +833,10 @@ struct curlFileTransfer : public FileTransfer
         }
     }
 
+    /* Callbacks of requests that are waiting for an identical,
+       already running download. */
+    Sync<std::map<std::string, std::list<Callback<FileTransferResult>>>> waiters;
+
     void enqueueItem(std::shared_ptr<TransferItem> item)
     {
         if (item->request.data
@@ -685,6 +900,59 @@ struct curlFileTransfer : public FileTransfer
             return;
         }
 
+        /* Coalesce concurrent downloads of the same file into a
+           single transfer. This is only possible if the result is
+           delivered in one piece. */
+        if (!request.data && !request.head && !request.dataCallback && !request.range) {
+            auto key = request.uri + "\n" + request.expectedETag + (request.verifyTLS ? "" : "\ninsecure");
+
+            {
+                auto waiters_(waiters.lock());
+                auto i = waiters_->find(key);
+                if (i != waiters_->end()) {
+                    debug("coalescing download of '%s' with a running one", request.uri);
+                    i->second.push_back(std::move(callback));
+                    return;
+                }
+                (*waiters_)[key].push_back(std::move(callback));
+            }
+
+            enqueueItem(std::make_shared<TransferItem>(*this, request,
+                Callback<FileTransferResult>([this, key](std::future<FileTransferResult> fut) {
+                    std::list<Callback<FileTransferResult>> callbacks;
+                    {
+                        auto waiters_(waiters.lock());
+                        auto i = waiters_->find(key);
+                        assert(i != waiters_->end());
+                        callbacks = std::move(i->second);
+                        waiters_->erase(i);
+                    }
+
+                    std::exception_ptr exc;
+                    FileTransferResult res;
+                    try {
+                        res = fut.get();
+                    } catch (...) {
+                        exc = std::current_exception();
+                    }
+
+                    /* Give every waiter its own copy of the data,
+                       since callers may modify it. */
+                    for (auto & cb : callbacks) {
+                        if (exc)
+                            cb.rethrow(exc);
+                        else if (&cb == &callbacks.back())
+                            cb(std::move(res));
+                        else {
+                            auto res2 = res;
+                            if (res.data) res2.data = std::make_shared<std::string>(*res.data);
+                            cb(std::move(res2));
+                        }
+                    }
+                })));
+            return;
+        }
+
         enqueueItem(std::make_shared<TransferItem>(*this, request, std::move(callback)));
     }
 };
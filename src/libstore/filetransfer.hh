@@ -6,6 +6,7 @@
 
 #include <string>
 #include <future>
+#include <atomic>
 
 namespace nix {
 
@@ -27,6 +28,12 @@ struct FileTransferSettings : Config
     Setting<unsigned long> stalledDownloadTimeout{this, 300, "stalled-download-timeout",
         "Timeout (in seconds) for receiving data from servers during download. Nix cancels idle downloads after this timeout's duration."};
 
+    Setting<uint64_t> maxDownloadSpeed{this, 0, "max-download-speed",
+        "Maximum total download speed in KiB/s. 0 means unlimited."};
+
+    Setting<uint64_t> maxDownloadSpeedPerHost{this, 0, "max-download-speed-per-host",
+        "Maximum download speed from a single host in KiB/s. 0 means unlimited."};
+
     Setting<unsigned int> tries{this, 5, "download-attempts",
         "How often Nix will attempt to download a file before giving up."};
 };
@@ -46,6 +53,13 @@ struct FileTransferRequest
     std::shared_ptr<std::string> data;
     std::string mimeType;
     std::function<void(char *, size_t)> dataCallback;
+    /* If set, only request this many bytes (second) starting at this
+       offset (first). Servers may ignore this and return the whole
+       file. */
+    std::optional<std::pair<uint64_t, uint64_t>> range;
+    /* If set, the transfer is aborted with an `Interrupted' error
+       once this becomes true. */
+    std::shared_ptr<std::atomic<bool>> interrupt;
 
     FileTransferRequest(const std::string & uri)
         : uri(uri), parentAct(getCurActivity()) { }
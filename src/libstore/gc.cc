@@ -2,6 +2,8 @@
 #include "globals.hh"
 #include "local-store.hh"
 #include "finally.hh"
+#include "thread-pool.hh"
+#include "maintenance-priority.hh"
 
 #include <functional>
 #include <queue>
@@ -22,6 +24,12 @@ namespace nix {
 
 static string gcLockName = "gc.lock";
 static string gcRootsDir = "gcroots";
+static string linkCandidatesName = "gc-link-candidates";
+static string linksScannedName = "gc-links-scanned";
+
+/* How often to scan all of `.links' even if there is a candidates
+   list (see removeUnusedLinks()). */
+static const time_t linksScanInterval = 7 * 24 * 60 * 60;
 
 
 /* Acquire the global GC lock.  This is used to prevent new Nix
@@ -193,6 +201,8 @@ void LocalStore::addTempRoot(const StorePath & path)
     /* Downgrade to a read lock. */
     debug(format("downgrading to read lock on '%1%'") % fnTempRoots);
     lockFile(state->fdTempRoots.get(), ltRead, true);
+
+    recordPathUse({path});
 }
 
 
@@ -345,7 +355,9 @@ Roots LocalStore::findRoots(bool censor)
 
 typedef std::unordered_map<Path, std::unordered_set<std::string>> UncheckedRoots;
 
-static void readProcLink(const string & file, UncheckedRoots & roots)
+/* Record the target of the symlink `file' if it's below `prefix'.
+   Returns false if the link doesn't exist. */
+static bool readProcLink(const string & file, const Path & prefix, UncheckedRoots & roots)
 {
     /* 64 is the starting buffer size gnu readlink uses... */
     auto bufsiz = ssize_t{64};
@@ -353,8 +365,10 @@ try_again:
     char buf[bufsiz];
     auto res = readlink(file.c_str(), buf, bufsiz);
     if (res == -1) {
-        if (errno == ENOENT || errno == EACCES || errno == ESRCH)
-            return;
+        if (errno == ENOENT || errno == ESRCH)
+            return false;
+        if (errno == EACCES)
+            return true;
         throw SysError("reading symlink");
     }
     if (res == bufsiz) {
@@ -363,15 +377,10 @@ try_again:
         bufsiz *= 2;
         goto try_again;
     }
-    if (res > 0 && buf[0] == '/')
+    if (std::string_view(buf, res).substr(0, prefix.size()) == prefix)
         roots[std::string(static_cast<char *>(buf), res)]
             .emplace(file);
-}
-
-static string quoteRegexChars(const string & raw)
-{
-    static auto specialRegex = std::regex(R"([.^$\\*+?()\[\]{}|])");
-    return std::regex_replace(raw, specialRegex, R"(\$&)");
+    return true;
 }
 
 static void readFileRoots(const char * path, UncheckedRoots & roots)
@@ -384,64 +393,137 @@ static void readFileRoots(const char * path, UncheckedRoots & roots)
     }
 }
 
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/* Record the file mapped by each line of /proc/<pid>/maps, i.e. the
+   sixth field if it's below `prefix' and doesn't contain spaces. */
+static void scanMaps(const std::string & maps, const Path & mapFile, const Path & prefix, UncheckedRoots & roots)
+{
+    std::string_view rest = maps;
+    while (!rest.empty()) {
+        auto eol = rest.find('\n');
+        auto line = rest.substr(0, eol);
+        rest.remove_prefix(eol == std::string_view::npos ? rest.size() : eol + 1);
+
+        size_t pos = 0;
+        for (int field = 0; field < 5; ++field) {
+            while (pos < line.size() && isSpace(line[pos])) ++pos;
+            while (pos < line.size() && !isSpace(line[pos])) ++pos;
+        }
+        while (pos < line.size() && isSpace(line[pos])) ++pos;
+        auto end = pos;
+        while (end < line.size() && !isSpace(line[end])) ++end;
+        auto path = line.substr(pos, end - pos);
+        while (end < line.size() && isSpace(line[end])) ++end;
+        if (end == line.size() && path.substr(0, prefix.size()) == prefix)
+            roots[std::string(path)].emplace(mapFile);
+    }
+}
+
+/* Record the store paths that occur anywhere in `s', i.e. `prefix'
+   followed by a lower-case letter or digit and then any characters
+   allowed in store path names. */
+static void scanForStorePaths(const std::string & s, const Path & envFile, const Path & prefix, UncheckedRoots & roots)
+{
+    auto isNameChar = [](char c) {
+        return isalnum((unsigned char) c) || c == '+' || c == '-' || c == '.' || c == '_' || c == '?' || c == '=';
+    };
+
+    size_t pos = 0;
+    while ((pos = s.find(prefix, pos)) != std::string::npos) {
+        auto end = pos + prefix.size();
+        if (end == s.size() || !((s[end] >= '0' && s[end] <= '9') || (s[end] >= 'a' && s[end] <= 'z'))) {
+            pos++;
+            continue;
+        }
+        while (end < s.size() && isNameChar(s[end])) ++end;
+        roots[s.substr(pos, end - pos)].emplace(envFile);
+        pos = end;
+    }
+}
+
+/* Find the store paths that process `pid' has open, mapped, as its
+   executable or working directory, or in its environment. */
+static void findProcessRoots(const std::string & pid, const Path & prefix, UncheckedRoots & roots)
+{
+    /* Kernel threads and zombies have no executable, and nothing
+       else worth looking at. */
+    if (!readProcLink(fmt("/proc/%s/exe", pid), prefix, roots)) return;
+    readProcLink(fmt("/proc/%s/cwd", pid), prefix, roots);
+
+    auto fdStr = fmt("/proc/%s/fd", pid);
+    auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
+    if (!fdDir) {
+        if (errno == ENOENT || errno == EACCES)
+            return;
+        throw SysError("opening %1%", fdStr);
+    }
+    struct dirent * fd_ent;
+    while (errno = 0, fd_ent = readdir(fdDir.get())) {
+        if (fd_ent->d_name[0] != '.')
+            readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), prefix, roots);
+    }
+    if (errno) {
+        if (errno == ESRCH)
+            return;
+        throw SysError("iterating /proc/%1%/fd", pid);
+    }
+    fdDir.reset();
+
+    try {
+        auto mapFile = fmt("/proc/%s/maps", pid);
+        scanMaps(readFile(mapFile), mapFile, prefix, roots);
+
+        auto envFile = fmt("/proc/%s/environ", pid);
+        scanForStorePaths(readFile(envFile), envFile, prefix, roots);
+    } catch (SysError & e) {
+        if (errno == ENOENT || errno == EACCES || errno == ESRCH)
+            return;
+        throw;
+    }
+}
+
 void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
 {
     UncheckedRoots unchecked;
 
+    /* Only paths in the store can be roots, so don't bother
+       recording anything else. */
+    auto prefix = storeDir + "/";
+
     auto procDir = AutoCloseDir{opendir("/proc")};
     if (procDir) {
+        std::vector<std::string> pids;
         struct dirent * ent;
-        auto digitsRegex = std::regex(R"(^\d+$)");
-        auto mapRegex = std::regex(R"(^\s*\S+\s+\S+\s+\S+\s+\S+\s+\S+\s+(/\S+)\s*$)");
-        auto storePathRegex = std::regex(quoteRegexChars(storeDir) + R"(/[0-9a-z]+[0-9a-zA-Z\+\-\._\?=]*)");
         while (errno = 0, ent = readdir(procDir.get())) {
             checkInterrupt();
-            if (std::regex_match(ent->d_name, digitsRegex)) {
-                readProcLink(fmt("/proc/%s/exe" ,ent->d_name), unchecked);
-                readProcLink(fmt("/proc/%s/cwd", ent->d_name), unchecked);
-
-                auto fdStr = fmt("/proc/%s/fd", ent->d_name);
-                auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
-                if (!fdDir) {
-                    if (errno == ENOENT || errno == EACCES)
-                        continue;
-                    throw SysError("opening %1%", fdStr);
-                }
-                struct dirent * fd_ent;
-                while (errno = 0, fd_ent = readdir(fdDir.get())) {
-                    if (fd_ent->d_name[0] != '.')
-                        readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), unchecked);
-                }
-                if (errno) {
-                    if (errno == ESRCH)
-                        continue;
-                    throw SysError("iterating /proc/%1%/fd", ent->d_name);
-                }
-                fdDir.reset();
-
-                try {
-                    auto mapFile = fmt("/proc/%s/maps", ent->d_name);
-                    auto mapLines = tokenizeString<std::vector<string>>(readFile(mapFile), "\n");
-                    for (const auto & line : mapLines) {
-                        auto match = std::smatch{};
-                        if (std::regex_match(line, match, mapRegex))
-                            unchecked[match[1]].emplace(mapFile);
-                    }
-
-                    auto envFile = fmt("/proc/%s/environ", ent->d_name);
-                    auto envString = readFile(envFile);
-                    auto env_end = std::sregex_iterator{};
-                    for (auto i = std::sregex_iterator{envString.begin(), envString.end(), storePathRegex}; i != env_end; ++i)
-                        unchecked[i->str()].emplace(envFile);
-                } catch (SysError & e) {
-                    if (errno == ENOENT || errno == EACCES || errno == ESRCH)
-                        continue;
-                    throw;
-                }
-            }
+            std::string_view name = ent->d_name;
+            if (std::all_of(name.begin(), name.end(), [](char c) { return c >= '0' && c <= '9'; }))
+                pids.emplace_back(name);
         }
         if (errno)
             throw SysError("iterating /proc");
+
+        /* Reading /proc is mostly waiting for the kernel to render
+           each process's files, so scan the processes in parallel. */
+        Sync<UncheckedRoots> unchecked_;
+        ThreadPool pool;
+        for (auto & pid : pids)
+            pool.enqueue([&, pid]() {
+                checkInterrupt();
+                UncheckedRoots found;
+                findProcessRoots(pid, prefix, found);
+                if (found.empty()) return;
+                auto unchecked(unchecked_.lock());
+                for (auto & [target, links] : found)
+                    (*unchecked)[target].merge(links);
+            });
+        pool.process();
+
+        unchecked = std::move(*unchecked_.lock());
     }
 
 #if !defined(__linux__)
@@ -501,11 +583,31 @@ struct LocalStore::GCState
     unsigned long long bytesInvalidated;
     bool moveToTrash = true;
     bool shouldDelete;
+
+    /* If set, garbage paths are queued in `pending' and invalidated
+       in a single transaction per batch by flushDeletions(), rather
+       than one at a time. */
+    bool batchDeletions = false;
+    std::vector<std::pair<Path, uint64_t>> pending;
+    std::vector<StorePath> pendingInvalidations;
+    StringSet pendingPaths;
+    uint64_t bytesPending = 0;
+
+    /* The persistent list of `.links' entries that may have become
+       unused, if it is being maintained (see removeUnusedLinks()). */
+    AutoCloseFD fdLinkCandidates;
+    std::mutex linkCandidatesMutex;
+
     GCState(const GCOptions & options, GCResults & results)
         : options(options), results(results), bytesInvalidated(0) { }
 };
 
 
+/* The maximum number of paths to invalidate in one transaction when
+   deletions are batched. */
+static const size_t deletionBatchSize = 1024;
+
+
 bool LocalStore::isActiveTempFile(const GCState & state,
     const Path & path, const string & suffix)
 {
@@ -514,10 +616,29 @@ bool LocalStore::isActiveTempFile(const GCState & state,
 }
 
 
+/* Append the inodes of files that were left with only one other link
+   (i.e. presumably their `.links' entry) to the candidates list. */
+void LocalStore::recordLinkCandidates(GCState & state, const std::vector<ino_t> & inodes)
+{
+    if (!state.fdLinkCandidates || inodes.empty()) return;
+
+    std::string s;
+    for (auto ino : inodes)
+        s += std::to_string(ino) + "\n";
+
+    std::lock_guard<std::mutex> lock(state.linkCandidatesMutex);
+    lockFile(state.fdLinkCandidates.get(), ltWrite, true);
+    writeFull(state.fdLinkCandidates.get(), s);
+    lockFile(state.fdLinkCandidates.get(), ltNone, true);
+}
+
+
 void LocalStore::deleteGarbage(GCState & state, const Path & path)
 {
     unsigned long long bytesFreed;
-    deletePath(path, bytesFreed);
+    std::vector<ino_t> lastLinks;
+    deletePath(path, bytesFreed, lastLinks);
+    recordLinkCandidates(state, lastLinks);
     state.results.bytesFreed += bytesFreed;
 }
 
@@ -526,6 +647,8 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
 {
     checkInterrupt();
 
+    if (state.batchDeletions && state.pendingPaths.count(path)) return;
+
     unsigned long long size = 0;
 
     auto storePath = maybeParseStorePath(path);
@@ -535,9 +658,33 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
         for (auto & i : referrers)
             if (printStorePath(i) != path) deletePathRecursive(state, printStorePath(i));
         size = queryPathInfo(*storePath)->narSize;
-        invalidatePathChecked(*storePath);
+        if (state.batchDeletions)
+            state.pendingInvalidations.push_back(*storePath);
+        else
+            invalidatePathChecked(*storePath);
     }
 
+    if (state.batchDeletions) {
+        /* Referrers have been queued before `path', so they will be
+           invalidated first. */
+        state.pendingPaths.insert(path);
+        state.pending.emplace_back(path, size);
+        state.bytesPending += size;
+        if (state.pending.size() >= deletionBatchSize)
+            flushDeletions(state);
+    } else
+        deleteFromStore(state, path, size);
+
+    if (state.results.bytesFreed + state.bytesInvalidated + state.bytesPending > state.options.maxFreed) {
+        printInfo(format("deleted or invalidated more than %1% bytes; stopping") % state.options.maxFreed);
+        throw GCLimitReached();
+    }
+}
+
+
+/* Remove an invalid (or just invalidated) path from the store. */
+void LocalStore::deleteFromStore(GCState & state, const Path & path, uint64_t narSize)
+{
     Path realPath = realStoreDir + "/" + std::string(baseNameOf(path));
 
     struct stat st;
@@ -565,7 +712,7 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
             Path tmp = trashDir + "/" + std::string(baseNameOf(path));
             if (rename(realPath.c_str(), tmp.c_str()))
                 throw SysError("unable to rename '%1%' to '%2%'", realPath, tmp);
-            state.bytesInvalidated += size;
+            state.bytesInvalidated += narSize;
         } catch (SysError & e) {
             if (e.errNo == ENOSPC) {
                 printInfo(format("note: can't create move '%1%': %2%") % realPath % e.msg());
@@ -574,11 +721,55 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
         }
     } else
         deleteGarbage(state, realPath);
+}
 
-    if (state.results.bytesFreed + state.bytesInvalidated > state.options.maxFreed) {
-        printInfo(format("deleted or invalidated more than %1% bytes; stopping") % state.options.maxFreed);
-        throw GCLimitReached();
+
+/* Invalidate the queued garbage paths in one transaction, then remove
+   them from the store. */
+void LocalStore::flushDeletions(GCState & state)
+{
+    if (state.pending.empty()) return;
+
+    invalidatePathsChecked(state.pendingInvalidations);
+
+    for (auto & [path, narSize] : state.pending)
+        deleteFromStore(state, path, narSize);
+
+    state.pending.clear();
+    state.pendingInvalidations.clear();
+    state.pendingPaths.clear();
+    state.bytesPending = 0;
+}
+
+
+/* Delete the contents of the trash directory, using up to
+   `gc-delete-threads' threads to delete independent paths
+   concurrently. */
+void LocalStore::deleteTrash(GCState & state)
+{
+    if (!pathExists(trashDir)) return;
+
+    printInfo(format("deleting '%1%'") % trashDir);
+
+    if (settings.gcDeleteThreads > 1) {
+        ThreadPool pool(settings.gcDeleteThreads);
+        std::atomic<uint64_t> bytesFreed{0};
+
+        for (auto & i : readDirectory(trashDir))
+            pool.enqueue([&, path(trashDir + "/" + i.name)]() {
+                unsigned long long bytes;
+                std::vector<ino_t> lastLinks;
+                deletePath(path, bytes, lastLinks);
+                recordLinkCandidates(state, lastLinks);
+                bytesFreed += bytes;
+            });
+
+        pool.process();
+
+        state.results.bytesFreed += bytesFreed;
     }
+
+    deleteGarbage(state, trashDir);
 }
 
 
@@ -675,13 +866,271 @@ void LocalStore::tryToDelete(GCState & state, const Path & path)
 }
 
 
+/* Determine the live and dead valid paths in one pass over the
+   reference graph held in memory, rather than by walking referrers
+   with a database query per path.  A path is live if it's reachable
+   from a root via references, via the deriver link (if
+   keep-derivations is set) or via the outputs of a derivation (if
+   keep-outputs is set).  Paths that become valid after the graph was
+   loaded are in neither set and are handled by canReachRoot(). */
+void LocalStore::markLive(GCState & state)
+{
+    auto graph = queryReferenceGraph();
+
+    auto n = graph.paths.size();
+    std::vector<bool> live(n, false);
+    std::vector<uint32_t> todo;
+
+    auto mark = [&](uint32_t i) {
+        if (live[i]) return;
+        live[i] = true;
+        todo.push_back(i);
+    };
+
+    for (auto & root : state.roots) {
+        auto i = graph.index.find(printStorePath(root));
+        if (i != graph.index.end()) mark(i->second);
+    }
+
+    auto isOutputOf = [&](uint32_t i, uint32_t drv) {
+        for (auto j = graph.outputStart[drv]; j < graph.outputStart[drv + 1]; ++j)
+            if (graph.outputs[j] == i) return true;
+        return false;
+    };
+
+    while (!todo.empty()) {
+        checkInterrupt();
+
+        auto i = todo.back();
+        todo.pop_back();
+
+        for (auto j = graph.refStart[i]; j < graph.refStart[i + 1]; ++j)
+            mark(graph.refs[j]);
+
+        if (state.gcKeepDerivations) {
+            auto drv = graph.deriver[i];
+            if (drv != ReferenceGraph::none && isOutputOf(i, drv))
+                mark(drv);
+        }
+
+        if (state.gcKeepOutputs)
+            for (auto j = graph.outputStart[i]; j < graph.outputStart[i + 1]; ++j)
+                mark(graph.outputs[j]);
+    }
+
+    for (size_t i = 0; i < n; ++i)
+        (live[i] ? state.alive : state.dead).insert(parseStorePath(graph.paths[i]));
+}
+
+
+/* Determine the order in which to delete valid paths.  Randomise it
+   to make the collector less biased towards deleting paths that come
+   alphabetically first (e.g. /nix/store/000...), or, if gc-lru is
+   set, delete the least recently used paths first.  This matters
+   when using --max-freed etc. */
+void LocalStore::orderGarbage(std::vector<Path> & paths)
+{
+    std::mt19937 gen(1);
+    std::shuffle(paths.begin(), paths.end(), gen);
+
+    if (!settings.gcLRU) return;
+
+    auto lastUse = queryLastUse();
+
+    std::vector<std::pair<time_t, Path>> sorted;
+    for (auto & path : paths) {
+        auto i = lastUse.find(path);
+        sorted.emplace_back(i == lastUse.end() ? 0 : i->second, std::move(path));
+    }
+
+    std::stable_sort(sorted.begin(), sorted.end(),
+        [](const auto & a, const auto & b) { return a.first < b.first; });
+
+    paths.clear();
+    for (auto & i : sorted)
+        paths.push_back(std::move(i.second));
+}
+
+
+/* Check that a path that was found to be dead is still dead, i.e. it
+   hasn't since become a root and it hasn't acquired any referrers
+   that weren't dead already.  This is needed when deleting while
+   not holding the GC lock all the time. */
+bool LocalStore::isStillDead(GCState & state, StorePathSet & visited, const StorePath & path)
+{
+    if (!visited.insert(path).second) return true;
+
+    if (!state.dead.count(path) || state.roots.count(path)) return false;
+
+    StorePathSet referrers;
+    queryReferrers(path, referrers);
+
+    for (auto & i : referrers)
+        if (i != path && !isStillDead(state, visited, i))
+            return false;
+
+    return true;
+}
+
+
+/* Delete all garbage, but without holding the GC lock for the whole
+   run.  The dead set is computed from the roots found while holding
+   the lock (as passed in by the caller).  Then the lock is released,
+   and the dead paths are deleted in batches of `gc-batch-size'
+   paths.  For every batch we re-acquire the lock, rescan the
+   permanent and temporary roots to pick up those that were added in
+   the meantime and keep their closures, and check that a path hasn't
+   acquired new referrers before deleting it.  (Temporary root files
+   of processes that have exited are released between batches, so a
+   path made a permanent root by such a process is only protected by
+   the rescan.) */
+void LocalStore::collectGarbageIncremental(GCState & state, AutoCloseFD & fdGCLock, FDs & fds)
+{
+    printInfo("determining dead paths...");
+
+    AutoCloseDir dir(opendir(realStoreDir.c_str()));
+    if (!dir) throw SysError("opening directory '%1%'", realStoreDir);
+
+    /* As in the non-incremental case, invalid paths come first and
+       the valid ones are shuffled.  The flag records whether the path
+       was valid at the time of the snapshot. */
+    std::vector<std::pair<Path, bool>> garbage;
+    vector<Path> valid;
+
+    struct dirent * dirent;
+    while (errno = 0, dirent = readdir(dir.get())) {
+        checkInterrupt();
+        string name = dirent->d_name;
+        if (name == "." || name == "..") continue;
+        Path path = storeDir + "/" + name;
+        auto realPath = realStoreDir + "/" + name;
+        if (realPath == linksDir || realPath == trashDir) continue;
+        auto storePath = maybeParseStorePath(path);
+        if (storePath && isValidPath(*storePath))
+            valid.push_back(path);
+        else
+            garbage.emplace_back(path, false);
+    }
+
+    dir.reset();
+
+    orderGarbage(valid);
+
+    state.shouldDelete = false;
+    for (auto & i : valid) {
+        tryToDelete(state, i);
+        if (state.dead.count(parseStorePath(i)))
+            garbage.emplace_back(i, true);
+    }
+    state.shouldDelete = true;
+
+    printInfo("deleting %d dead paths in batches of %d...", garbage.size(), settings.gcBatchSize);
+
+    /* Let builds and other store operations proceed. */
+    fdGCLock = -1;
+    fds.clear();
+
+    size_t pos = 0;
+    while (pos < garbage.size()) {
+
+        fdGCLock = openGCLock(ltWrite);
+
+        /* Keep anything that was registered as a root since the last
+           batch. */
+        Roots newRoots;
+        if (!state.options.ignoreLiveness)
+            findRootsNoTemp(newRoots, true);
+        Roots tempRoots;
+        findTempRoots(fds, tempRoots, true);
+        for (auto & root : tempRoots) {
+            state.tempRoots.insert(root.first);
+            newRoots.emplace(root.first, root.second);
+        }
+        for (auto & root : newRoots) {
+            if (!state.roots.insert(root.first).second) continue;
+            if (!isValidPath(root.first)) continue;
+            StorePathSet closure;
+            computeFSClosure(root.first, closure, false,
+                state.gcKeepOutputs, state.gcKeepDerivations);
+            for (auto & i : closure) {
+                state.dead.erase(i);
+                state.alive.insert(i);
+            }
+        }
+
+        for (auto end = std::min(pos + settings.gcBatchSize, garbage.size()); pos < end; ++pos) {
+            checkInterrupt();
+
+            auto & [path, wasValid] = garbage[pos];
+            auto storePath = maybeParseStorePath(path);
+
+            if (storePath && isValidPath(*storePath)) {
+                /* Don't delete paths that were registered after the
+                   snapshot or that have become reachable since. */
+                StorePathSet visited;
+                if (!wasValid || !isStillDead(state, visited, *storePath)) {
+                    debug("not deleting '%s' because it's no longer dead", path);
+                    continue;
+                }
+            } else {
+                /* Paths that are being built right now aren't
+                   garbage, nor are their lock files etc. */
+                if (storePath && state.roots.count(*storePath)) continue;
+                if (isActiveTempFile(state, path, ".lock")) continue;
+                if (isActiveTempFile(state, path, ".chroot")) continue;
+                if (isActiveTempFile(state, path, ".check")) continue;
+            }
+
+            deletePathRecursive(state, path);
+        }
+
+        flushDeletions(state);
+
+        fdGCLock = -1;
+        fds.clear();
+    }
+}
+
+
 /* Unlink all files in /nix/store/.links that have a link count of 1,
    which indicates that there are no other links and so they can be
    safely deleted.  FIXME: race condition with optimisePath(): we
    might see a link count of 1 just before optimisePath() increases
-   the link count. */
+   the link count.
+
+   Scanning (and lstat()ing) all of /nix/store/.links is slow, so the
+   collector records the inodes of deleted files that had exactly one
+   other link in `gc-link-candidates', and only those are checked.
+   The first collection that finds no such file does a full scan, and
+   creates it.  Store paths are also deleted outside of the collector
+   (e.g. when repairing them or by `--check' builds), so a full scan
+   is still done if the last one, whose time is recorded in
+   `gc-links-scanned', was more than a week ago. */
 void LocalStore::removeUnusedLinks(const GCState & state)
 {
+    Path fnCandidates = stateDir + "/" + linkCandidatesName;
+    Path fnScanned = stateDir + "/" + linksScannedName;
+
+    time_t lastScan = 0;
+    if (pathExists(fnScanned))
+        string2Int(trim(readFile(fnScanned)), lastScan);
+
+    if (lastScan + linksScanInterval > time(0)) {
+        AutoCloseFD fdCandidates = open(fnCandidates.c_str(), O_RDWR | O_CLOEXEC);
+        if (fdCandidates) {
+            removeCandidateLinks(state, fdCandidates.get());
+            return;
+        }
+        if (errno != ENOENT)
+            throw SysError("opening '%1%'", fnCandidates);
+    }
+
+    auto scanStart = time(0);
+
+    /* Create the list before scanning, so that paths deleted by
+       concurrent collectors are not missed. */
+    writeFile(fnCandidates, "");
+
     AutoCloseDir dir(opendir(linksDir.c_str()));
     if (!dir) throw SysError("opening directory '%1%'", linksDir);
 
@@ -719,6 +1168,67 @@ void LocalStore::removeUnusedLinks(const GCState & state)
 
     printInfo(format("note: currently hard linking saves %.2f MiB")
         % ((unsharedSize - actualSize - overhead) / (1024.0 * 1024.0)));
+
+    writeFile(fnScanned, std::to_string(scanStart));
+}
+
+
+void LocalStore::removeCandidateLinks(const GCState & state, int fdCandidates)
+{
+    /* Read the list, but leave it in place until we're done, so that
+       an interrupted collection doesn't lose candidates. */
+    lockFile(fdCandidates, ltWrite, true);
+    auto contents = readFile(fdCandidates);
+    lockFile(fdCandidates, ltNone, true);
+
+    std::set<ino_t> candidates;
+    for (auto & s : tokenizeString<Strings>(contents, "\n")) {
+        ino_t ino;
+        if (string2Int(s, ino)) candidates.insert(ino);
+    }
+
+    if (!candidates.empty()) {
+        AutoCloseDir dir(opendir(linksDir.c_str()));
+        if (!dir) throw SysError("opening directory '%1%'", linksDir);
+
+        /* readdir() gives us the inode numbers, so we only need to
+           lstat() the candidates. */
+        struct dirent * dirent;
+        while (errno = 0, dirent = readdir(dir.get())) {
+            checkInterrupt();
+            if (!candidates.count(dirent->d_ino)) continue;
+            string name = dirent->d_name;
+            if (name == "." || name == "..") continue;
+            Path path = linksDir + "/" + name;
+
+            struct stat st;
+            if (lstat(path.c_str(), &st) == -1) {
+                if (errno == ENOENT) continue;
+                throw SysError("statting '%1%'", path);
+            }
+
+            if (st.st_nlink != 1) continue;
+
+            printMsg(lvlTalkative, format("deleting unused link '%1%'") % path);
+
+            if (unlink(path.c_str()) == -1)
+                throw SysError("deleting '%1%'", path);
+
+            state.results.bytesFreed += st.st_size;
+        }
+        if (errno) throw SysError("reading directory '%1%'", linksDir);
+    }
+
+    /* Drop the entries we've processed, keeping any that were added
+       by concurrent collectors in the meantime. */
+    lockFile(fdCandidates, ltWrite, true);
+    if (lseek(fdCandidates, contents.size(), SEEK_SET) == -1)
+        throw SysError("seeking in the link candidates list");
+    auto rest = readFile(fdCandidates);
+    if (ftruncate(fdCandidates, 0) == -1 || lseek(fdCandidates, 0, SEEK_SET) == -1)
+        throw SysError("truncating the link candidates list");
+    writeFull(fdCandidates, rest);
+    lockFile(fdCandidates, ltNone, true);
 }
 
 
@@ -738,6 +1248,14 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     }
 
     state.shouldDelete = options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific;
+    state.batchDeletions = options.action == GCOptions::gcDeleteDead;
+
+    if (state.shouldDelete) {
+        Path fnCandidates = stateDir + "/" + linkCandidatesName;
+        state.fdLinkCandidates = open(fnCandidates.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (!state.fdLinkCandidates && errno != ENOENT)
+            throw SysError("opening '%1%'", fnCandidates);
+    }
 
     if (state.shouldDelete)
         deletePath(reservedPath);
@@ -772,7 +1290,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
        that is not reachable from `roots' is garbage. */
 
     if (state.shouldDelete) {
-        if (pathExists(trashDir)) deleteGarbage(state, trashDir);
+        deleteTrash(state);
         try {
             createDirs(trashDir);
         } catch (SysError & e) {
@@ -783,6 +1301,13 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         }
     }
 
+    /* Compute the live and dead sets up front, unless we're only
+       looking at a few specific paths. */
+    if (options.action != GCOptions::gcDeleteSpecific) {
+        printInfo("computing live paths...");
+        markLive(state);
+    }
+
     /* Now either delete all garbage paths, or just the specified
        paths (for gcDeleteSpecific). */
 
@@ -798,6 +1323,13 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                     printStorePath(i));
         }
 
+    } else if (options.maxFreed > 0 && state.shouldDelete && settings.gcBatchSize > 0) {
+
+        try {
+            collectGarbageIncremental(state, fdGCLock, fds);
+        } catch (GCLimitReached & e) {
+        }
+
     } else if (options.maxFreed > 0) {
 
         if (state.shouldDelete)
@@ -832,14 +1364,9 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
             dir.reset();
 
-            /* Now delete the unreachable valid paths.  Randomise the
-               order in which we delete entries to make the collector
-               less biased towards deleting paths that come
-               alphabetically first (e.g. /nix/store/000...).  This
-               matters when using --max-freed etc. */
+            /* Now delete the unreachable valid paths. */
             vector<Path> entries_(entries.begin(), entries.end());
-            std::mt19937 gen(1);
-            std::shuffle(entries_.begin(), entries_.end(), gen);
+            orderGarbage(entries_);
 
             for (auto & i : entries_)
                 tryToDelete(state, i);
@@ -848,6 +1375,8 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         }
     }
 
+    flushDeletions(state);
+
     if (state.options.action == GCOptions::gcReturnLive) {
         for (auto & i : state.alive)
             state.results.paths.insert(printStorePath(i));
@@ -865,8 +1394,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     fds.clear();
 
     /* Delete the trash directory. */
-    printInfo(format("deleting '%1%'") % trashDir);
-    deleteGarbage(state, trashDir);
+    deleteTrash(state);
 
     /* Clean up the links directory. */
     if (options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific) {
@@ -879,7 +1407,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 }
 
 
-void LocalStore::autoGC(bool sync)
+void LocalStore::autoGC(bool sync, std::function<uint64_t()> pendingUse)
 {
     static auto fakeFreeSpaceFile = getEnv("_NIX_TEST_FREE_SPACE_FILE");
 
@@ -909,13 +1437,19 @@ void LocalStore::autoGC(bool sync)
 
         if (now < state->lastGCCheck + std::chrono::seconds(settings.minFreeCheckInterval)) return;
 
-        auto avail = getAvail();
+        auto realAvail = getAvail();
 
         state->lastGCCheck = now;
 
+        auto pending = pendingUse ? pendingUse() : 0;
+        auto avail = realAvail > pending ? realAvail - pending : 0;
+
+        if (pending)
+            debug("%d bytes available, %d bytes expected to be used by pending work", realAvail, pending);
+
         if (avail >= settings.minFree || avail >= settings.maxFree) return;
 
-        if (avail > state->availAfterGC * 0.97) return;
+        if (realAvail > state->availAfterGC * 0.97) return;
 
         state->gcRunning = true;
 
@@ -941,7 +1475,10 @@ void LocalStore::autoGC(bool sync)
 
                 GCResults results;
 
-                collectGarbage(options, results);
+                {
+                    MaintenancePriority priority(realStoreDir, false);
+                    collectGarbage(options, results);
+                }
 
                 _state.lock()->availAfterGC = getAvail();
 
@@ -187,6 +187,36 @@ template<> void BaseSetting<SandboxMode>::convertToArg(Args & args, const std::s
     });
 }
 
+template<> void BaseSetting<OptimiseMethod>::set(const std::string & str)
+{
+    if (str == "hardlink") value = omHardlink;
+    else if (str == "reflink") value = omReflink;
+    else throw UsageError("option '%s' has invalid value '%s'", name, str);
+}
+
+template<> std::string BaseSetting<OptimiseMethod>::to_string() const
+{
+    if (value == omHardlink) return "hardlink";
+    else if (value == omReflink) return "reflink";
+    else abort();
+}
+
+template<> void BaseSetting<OptimiseMethod>::toJSON(JSONPlaceholder & out)
+{
+    AbstractSetting::toJSON(out);
+}
+
+template<> void BaseSetting<OptimiseMethod>::convertToArg(Args & args, const std::string & category)
+{
+    args.addFlag({
+        .longName = name,
+        .description = description,
+        .category = category,
+        .labels = {"method"},
+        .handler = {[=](std::string s) { overriden = true; set(s); }},
+    });
+}
+
 void MaxBuildJobsSetting::set(const std::string & str)
 {
     if (str == "auto") value = std::max(1U, std::thread::hardware_concurrency());
@@ -13,6 +13,8 @@ namespace nix {
 
 typedef enum { smEnabled, smRelaxed, smDisabled } SandboxMode;
 
+typedef enum { omHardlink, omReflink } OptimiseMethod;
+
 struct MaxBuildJobsSetting : public BaseSetting<unsigned int>
 {
     MaxBuildJobsSetting(Config * options,
@@ -80,6 +82,11 @@ public:
     Setting<bool> keepGoing{this, false, "keep-going",
         "Whether to keep building derivations when another build fails."};
 
+    Setting<bool> cacheFailures{this, false, "cache-failures",
+        "Whether to remember derivations whose build failed permanently, and "
+        "fail further builds of them right away.",
+        {"build-cache-failure"}};
+
     Setting<bool> tryFallback{this, false, "fallback",
         "Whether to fall back to building when substitution fails.",
         {"build-fallback"}};
@@ -95,12 +102,21 @@ public:
         "Maximum number of parallel build jobs. \"auto\" means use number of cores.",
         {"build-max-jobs"}};
 
+    Setting<unsigned int> maxSubstitutionJobs{this, 16, "max-substitution-jobs",
+        "Maximum number of substitutions to run in parallel, independent "
+        "of max-jobs."};
+
     Setting<unsigned int> buildCores{this, getDefaultCores(), "cores",
         "Number of CPU cores to utilize in parallel within a build, "
         "i.e. by passing this number to Make via '-j'. 0 means that the "
         "number of actual CPU cores on the local host ought to be "
         "auto-detected.", {"build-cores"}};
 
+    Setting<unsigned int> jobserverTokens{this, 0, "jobserver-tokens",
+        "If non-zero, the number of job tokens in a GNU Make jobserver "
+        "shared by all local builds, which is passed to builders via "
+        "MAKEFLAGS. 0 disables the jobserver."};
+
     /* Read-only mode.  Don't copy stuff to the store, don't change
        the database. */
     bool readOnlyMode = false;
@@ -129,6 +145,11 @@ public:
         "build dependencies if possible, rather than waiting for this host to "
         "upload them."};
 
+    Setting<unsigned int> buildersMasterPersist{this, 60, "builders-master-persist",
+        "Number of seconds that an SSH master connection to a remote "
+        "builder stays alive after its last use, so that subsequent builds "
+        "can reuse it. 0 means that every build opens its own connection."};
+
     Setting<off_t> reservedSize{this, 8 * 1024 * 1024, "gc-reserved-space",
         "Amount of reserved disk space for the garbage collector."};
 
@@ -139,7 +160,17 @@ public:
         "Whether SQLite should use WAL mode."};
 
     Setting<bool> syncBeforeRegistering{this, false, "sync-before-registering",
-        "Whether to call sync() before registering a path as valid."};
+        "Whether to sync the file system of the store before registering paths as valid."};
+
+    Setting<size_t> importBatchSize{this, 128, "import-batch-size",
+        "Maximum number of imported paths to register in one transaction."};
+
+    Setting<unsigned long> verifyMaxAge{this, 0, "verify-max-age",
+        "When checking the contents of the store, skip paths that were "
+        "verified less than this many seconds ago."};
+
+    Setting<unsigned long> verifyTimeBudget{this, 0, "verify-time-budget",
+        "If non-zero, stop checking the contents of the store after this many seconds."};
 
     Setting<bool> useSubstitutes{this, true, "substitute",
         "Whether to use substitutes.",
@@ -160,6 +191,15 @@ public:
         "Whether to compress logs.",
         {"build-compress-log"}};
 
+    Setting<std::string> logCompression{this,
+#if HAVE_ZSTD
+        "zstd",
+#else
+        "bzip2",
+#endif
+        "build-log-compression",
+        "The compression method for build logs ('bzip2' or 'zstd')."};
+
     Setting<unsigned long> maxLogSize{this, 0, "max-build-log-size",
         "Maximum number of bytes a builder can write to stdout/stderr "
         "before being killed (0 means no limit).",
@@ -185,9 +225,45 @@ public:
         "Whether the garbage collector should keep derivers of live paths.",
         {"gc-keep-derivations"}};
 
+    Setting<size_t> gcBatchSize{this, 0, "gc-batch-size",
+        "If non-zero, delete garbage in batches of this many paths, "
+        "holding the GC lock only while deleting a batch."};
+
+    Setting<unsigned int> gcDeleteThreads{this, 1, "gc-delete-threads",
+        "The number of threads the garbage collector uses to delete paths."};
+
+    Setting<bool> gcLRU{this, false, "gc-lru",
+        "Whether the garbage collector should delete the least recently used paths first."};
+
+    Setting<bool> builtinFetchurlInProcess{this, false, "builtin-fetchurl-in-process",
+        "Whether to perform the downloads of builtin:fetchurl derivations in the Nix process "
+        "rather than in a builder process."};
+
     Setting<bool> autoOptimiseStore{this, false, "auto-optimise-store",
         "Whether to automatically replace files with identical contents with hard links."};
 
+    Setting<uint64_t> autoOptimiseQueueSize{this, 0, "auto-optimise-queue-size",
+        "The maximum number of new store paths whose files are deduplicated in the background "
+        "rather than before they are registered. 0 deduplicates all of them synchronously."};
+
+    Setting<int> maintenanceNiceness{this, 0, "maintenance-niceness",
+        "The amount by which to increase the niceness of garbage collection, store optimisation "
+        "and store verification."};
+
+#if __linux__
+    Setting<std::string> maintenanceIOClass{this, "", "maintenance-io-class",
+        "The I/O scheduling class of garbage collection, store optimisation and store verification. "
+        "Can be \"idle\", \"best-effort\" or empty to leave it unchanged."};
+
+    Setting<uint64_t> maintenanceIOMax{this, 0, "maintenance-io-max",
+        "The maximum number of bytes per second that garbage collection, store optimisation and "
+        "store verification requested through the daemon may read and write on the store's disk. "
+        "0 means no limit."};
+#endif
+
+    Setting<OptimiseMethod> optimiseMethod{this, omHardlink, "optimise-method",
+        "How to deduplicate files with identical contents. Can be \"hardlink\" or \"reflink\"."};
+
     Setting<bool> envKeepDerivations{this, false, "keep-env-derivations",
         "Whether to add derivations as a dependency of user environments "
         "(to prevent them from being GCed).",
@@ -227,6 +303,10 @@ public:
 
     Setting<Path> sandboxBuildDir{this, "/build", "sandbox-build-dir",
         "The build directory inside the sandbox."};
+
+    Setting<std::string> buildDirTmpfsSize{this, "", "build-dir-tmpfs-size",
+        "If not empty, the size of a tmpfs mounted on the temporary directory of each "
+        "local build, e.g. '25%'. Builds that fill it up are retried on disk."};
 #endif
 
     Setting<PathSet> allowedImpureHostPrefixes{this, {}, "allowed-impure-host-deps",
@@ -307,6 +387,18 @@ public:
     Setting<Strings> allowedUsers{this, {"*"}, "allowed-users",
         "Which users or groups are allowed to connect to the daemon."};
 
+    Setting<unsigned int> sharedPathInfoCacheSize{this, 0, "shared-path-info-cache-size",
+        "Number of entries in a cache of path information that is shared by all processes "
+        "using the local Nix store, such as the daemon's. 0 disables the cache."};
+
+    Setting<unsigned int> daemonPreforkWorkers{this, 0, "daemon-prefork-workers",
+        "Number of daemon processes to keep ready to handle a connection, with the "
+        "Nix store already opened. If 0, a process is forked for every connection."};
+
+    Setting<Path> daemonMetricsSocket{this, "", "daemon-metrics-socket",
+        "Path of a Unix domain socket on which the daemon serves metrics in the "
+        "Prometheus text format over HTTP. Empty to disable."};
+
     Setting<bool> printMissing{this, true, "print-missing",
         "Whether to print what paths need to be built or downloaded."};
 
@@ -317,6 +409,22 @@ public:
     Setting<std::string> postBuildHook{this, "", "post-build-hook",
         "A program to run just after each successful build."};
 
+    Setting<unsigned int> postBuildHookJobs{this, 0, "post-build-hook-jobs",
+        "The number of post-build hooks to run concurrently in the background, "
+        "so that builds don't wait for them. 0 runs the hook synchronously after each build."};
+
+    Setting<unsigned int> postBuildHookBatchSize{this, 32, "post-build-hook-batch-size",
+        "The maximum number of builds whose outputs are passed to a single background "
+        "invocation of the post-build hook. 0 means no limit."};
+
+    Setting<unsigned int> postBuildHookQueueSize{this, 256, "post-build-hook-queue-size",
+        "The maximum number of builds waiting for a background post-build hook. "
+        "Finishing builds wait for space in the queue. 0 means no limit."};
+
+    Setting<bool> postBuildHookWait{this, true, "post-build-hook-wait",
+        "Whether to wait for the background post-build hook to process the outputs "
+        "of a build before reporting them as built."};
+
     Setting<std::string> netrcFile{this, fmt("%s/%s", nixConfDir, "netrc"), "netrc-file",
         "Path to the netrc file used to obtain usernames/passwords for downloads."};
 
@@ -333,6 +441,14 @@ public:
     Setting<bool> allowNewPrivileges{this, false, "allow-new-privileges",
         "Whether builders can acquire new privileges by calling programs with "
         "setuid/setgid bits or with file capabilities."};
+
+    Setting<bool> useCgroups{this, false, "use-cgroups",
+        "Whether to run each local build in its own cgroup (cgroups v2 only), "
+        "which ensures all its processes are killed and records its CPU and memory usage."};
+
+    Setting<bool> numaPlacement{this, false, "numa-placement",
+        "Whether to run each local build on a single NUMA node, choosing the node "
+        "with the fewest builds."};
 #endif
 
     Setting<Strings> hashedMirrors{this, {"http://tarballs.nixos.org/"}, "hashed-mirrors",
@@ -45,13 +45,14 @@ public:
         if (auto cacheInfo = diskCache->cacheExists(cacheUri)) {
             wantMassQuery.setDefault(cacheInfo->wantMassQuery ? "true" : "false");
             priority.setDefault(fmt("%d", cacheInfo->priority));
+            presenceFilter.setDefault(cacheInfo->presenceFilter);
         } else {
             try {
                 BinaryCacheStore::init();
             } catch (UploadToHTTP &) {
                 throw Error("'%s' does not appear to be a binary cache", cacheUri);
             }
-            diskCache->createCache(cacheUri, storeDir, wantMassQuery, priority);
+            diskCache->createCache(cacheUri, storeDir, wantMassQuery, priority, presenceFilter);
         }
     }
 
@@ -133,6 +134,40 @@ protected:
         }
     }
 
+    bool asyncQueries() override
+    {
+        return true;
+    }
+
+    bool supportsFileRanges() override
+    {
+        return true;
+    }
+
+    std::string getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length) override
+    {
+        checkEnabled();
+        if (!length) return "";
+        auto request(makeRequest(path));
+        request.range = {offset, length};
+        try {
+            auto data = getFileTransfer()->download(request).data;
+            /* A server that doesn't support ranges returns the whole
+               file, which is longer than the range unless the range
+               starts at 0. */
+            if (data->size() == length) return *data;
+            if (data->size() >= offset + length) return data->substr(offset, length);
+            throw Error("got %d bytes instead of %d from offset %d of '%s' in binary cache '%s'",
+                data->size(), length, offset, path, getUri());
+        } catch (FileTransferError & e) {
+            if (e.error == FileTransfer::NotFound || e.error == FileTransfer::Forbidden)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+            maybeDisable();
+            throw;
+        }
+    }
+
     void getFile(const std::string & path,
         Callback<std::shared_ptr<std::string>> callback) noexcept override
     {
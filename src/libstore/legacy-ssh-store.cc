@@ -18,6 +18,8 @@ struct LegacySSHStore : public Store
     const Setting<bool> compress{this, false, "compress", "whether to compress the connection"};
     const Setting<Path> remoteProgram{this, "nix-store", "remote-program", "path to the nix-store executable on the remote system"};
     const Setting<std::string> remoteStore{this, "", "remote-store", "URI of the store on the remote system"};
+    const Setting<unsigned int> masterPersist{this, 0, "master-persist",
+        "number of seconds to keep an SSH master connection shared with other processes alive after its last use"};
 
     // Hack for getting remote build log output.
     const Setting<int> logFD{this, -1, "log-fd", "file descriptor to which SSH's stderr is connected"};
@@ -51,7 +53,8 @@ struct LegacySSHStore : public Store
             // Use SSH master only if using more than 1 connection.
             connections->capacity() > 1,
             compress,
-            logFD)
+            logFD,
+            masterPersist)
     {
     }
 
@@ -182,6 +185,50 @@ struct LegacySSHStore : public Store
             throw Error("failed to add path '%s' to remote host '%s'", printStorePath(info.path), host);
     }
 
+    /* Send all paths in one stream, and wait only for a single
+       acknowledgement at the end. */
+    void addMultipleToStore(Source & source, RepairFlag repair, CheckSigsFlag checkSigs) override
+    {
+        {
+            auto conn(connections->get());
+
+            if (GET_PROTOCOL_MINOR(conn->remoteVersion) >= 6) {
+                auto expected = readNum<uint64_t>(source);
+
+                debug("adding %d paths to remote host '%s'", expected, host);
+
+                conn->to << cmdAddMultipleToStore << expected;
+
+                try {
+                    for (uint64_t n = 0; n < expected; n++) {
+                        auto info = readValidPathInfo(*this, source);
+                        writeValidPathInfo(*this, conn->to, info);
+                        copyNAR(source, conn->to);
+                    }
+                } catch (...) {
+                    conn->good = false;
+                    throw;
+                }
+
+                conn->to.flush();
+
+                if (readInt(conn->from) != 1)
+                    throw Error("failed to add %d paths to remote host '%s'", expected, host);
+
+                return;
+            }
+        }
+
+        // Don't hold the connection handle in the fallback case, since
+        // addToStore() needs one as well.
+        Store::addMultipleToStore(source, repair, checkSigs);
+    }
+
+    bool batchesImports() override
+    {
+        return GET_PROTOCOL_MINOR(getProtocol()) >= 6;
+    }
+
     void narFromPath(const StorePath & path, Sink & sink) override
     {
         auto conn(connections->get());
@@ -2,6 +2,8 @@
 #include "globals.hh"
 #include "nar-info-disk-cache.hh"
 
+#include <fcntl.h>
+
 namespace nix {
 
 class LocalBinaryCacheStore : public BinaryCacheStore
@@ -34,6 +36,19 @@ protected:
         const std::string & data,
         const std::string & mimeType) override;
 
+    void upsertFile(const std::string & path,
+        std::shared_ptr<std::basic_iostream<char>> istream,
+        const std::string & mimeType) override;
+
+    void upsertFileFrom(const std::string & path,
+        const Path & file,
+        const std::string & mimeType) override;
+
+    Path stagingDir() override
+    {
+        return binaryCacheDir + "/nar";
+    }
+
     void getFile(const std::string & path, Sink & sink) override
     {
         try {
@@ -44,6 +59,29 @@ protected:
         }
     }
 
+    bool supportsFileRanges() override
+    {
+        return true;
+    }
+
+    std::string getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length) override
+    {
+        Path p = binaryCacheDir + "/" + path;
+        AutoCloseFD fd = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd) {
+            if (errno == ENOENT)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache", path);
+            throw SysError("opening '%s'", p);
+        }
+        std::string buf(length, 0);
+        auto n = pread(fd.get(), buf.data(), length, offset);
+        if (n == -1) throw SysError("reading '%s'", p);
+        if ((uint64_t) n != length)
+            throw Error("file '%s' in binary cache is truncated", path);
+        return buf;
+    }
+
     StorePathSet queryAllValidPaths() override
     {
         StorePathSet paths;
@@ -83,6 +121,49 @@ bool LocalBinaryCacheStore::fileExists(const std::string & path)
     return pathExists(binaryCacheDir + "/" + path);
 }
 
+void LocalBinaryCacheStore::upsertFile(const std::string & path,
+    std::shared_ptr<std::basic_iostream<char>> istream,
+    const std::string & mimeType)
+{
+    Path dst = binaryCacheDir + "/" + path;
+    Path tmp = dst + ".tmp." + std::to_string(getpid());
+    AutoDelete del(tmp, false);
+
+    {
+        AutoCloseFD fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (!fd) throw SysError("opening file '%1%' for writing", tmp);
+        std::vector<char> buf(65536);
+        while (*istream) {
+            istream->read(buf.data(), buf.size());
+            writeFull(fd.get(), (unsigned char *) buf.data(), istream->gcount());
+        }
+        if (istream->bad())
+            throw Error("error reading data to be written to '%s'", dst);
+    }
+
+    if (rename(tmp.c_str(), dst.c_str()))
+        throw SysError("renaming '%1%' to '%2%'", tmp, dst);
+    del.cancel();
+}
+
+void LocalBinaryCacheStore::upsertFileFrom(const std::string & path,
+    const Path & file,
+    const std::string & mimeType)
+{
+    Path dst = binaryCacheDir + "/" + path;
+    Path tmp = dst + ".tmp." + std::to_string(getpid());
+    AutoDelete del(tmp, false);
+
+    /* The NARs written by addToStore() are staged in the cache, so
+       they can usually be hard-linked into place. */
+    if (link(file.c_str(), tmp.c_str()) == -1)
+        copyFileFast(file, tmp);
+
+    if (rename(tmp.c_str(), dst.c_str()))
+        throw SysError("renaming '%1%' to '%2%'", tmp, dst);
+    del.cancel();
+}
+
 void LocalBinaryCacheStore::upsertFile(const std::string & path,
     const std::string & data,
     const std::string & mimeType)
@@ -110,15 +110,17 @@ std::shared_ptr<std::string> LocalFSStore::getBuildLog(const StorePath & path_)
             j == 0
             ? fmt("%s/%s/%s/%s", logDir, drvsLogDir, string(baseName, 0, 2), string(baseName, 2))
             : fmt("%s/%s/%s", logDir, drvsLogDir, baseName);
-        Path logBz2Path = logPath + ".bz2";
 
         if (pathExists(logPath))
             return std::make_shared<std::string>(readFile(logPath));
 
-        else if (pathExists(logBz2Path)) {
-            try {
-                return decompress("bzip2", readFile(logBz2Path));
-            } catch (Error &) { }
+        for (auto method : {"bzip2", "zstd"}) {
+            Path compressedPath = logPath + compressionExtension(method);
+            if (pathExists(compressedPath)) {
+                try {
+                    return decompress(method, readFile(compressedPath));
+                } catch (Error &) { }
+            }
         }
 
     }
@@ -6,6 +6,7 @@
 #include "derivations.hh"
 #include "nar-info.hh"
 #include "references.hh"
+#include "thread-pool.hh"
 
 #include <iostream>
 #include <algorithm>
@@ -41,6 +42,34 @@
 namespace nix {
 
 
+/* The key of a path in the ValidPaths table: the 20 bytes encoded by
+   its hash part. The name is stored in a separate column. */
+static SQLiteBlob pathKey(std::string_view hashPart)
+{
+    Hash hash(hashPart, htSHA1);
+    return SQLiteBlob { std::string((const char *) hash.hash, hash.hashSize) };
+}
+
+
+static SQLiteBlob pathKey(const StorePath & path)
+{
+    return pathKey(path.hashPart());
+}
+
+
+/* Read the path stored as a key in column `col' and a name in column
+   `col + 1' of the current row of `use'. */
+static StorePath readPath(SQLiteStmt::Use & use, int col)
+{
+    auto key = use.getBlob(col);
+    Hash hash(htSHA1);
+    if (key.size() != hash.hashSize)
+        throw Error("invalid path key of size %d in the Nix database", key.size());
+    memcpy(hash.hash, key.data(), key.size());
+    return StorePath(hash, use.getStr(col + 1));
+}
+
+
 LocalStore::LocalStore(const Params & params)
     : Store(params)
     , LocalFSStore(params)
@@ -213,6 +242,72 @@ LocalStore::LocalStore(const Params & params)
             txn.commit();
         }
 
+        if (curSchema < 11) {
+            printInfo("upgrading the Nix database schema (this may take a while)...");
+
+            /* Rebuild ValidPaths with the path split into a binary
+               hash part and a name, keeping the IDs that the other
+               tables refer to. Foreign keys have to be off while the
+               old table is dropped, or the referring rows would be
+               deleted with it. */
+            state->db.exec("pragma foreign_keys = 0");
+
+            SQLiteTxn txn(state->db);
+
+            state->db.exec(
+                "create table ValidPathsNew ("
+                "  id               integer primary key autoincrement not null,"
+                "  hashPart         blob unique not null,"
+                "  name             text not null,"
+                "  hash             text not null,"
+                "  registrationTime integer not null,"
+                "  deriver          text,"
+                "  narSize          integer,"
+                "  ultimate         integer,"
+                "  sigs             text,"
+                "  ca               text"
+                ");");
+
+            SQLiteStmt select(state->db,
+                "select id, path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths;");
+            SQLiteStmt insert(state->db,
+                "insert into ValidPathsNew (id, hashPart, name, hash, registrationTime, deriver, narSize, ultimate, sigs, ca) "
+                "values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?);");
+
+            auto use(select.use());
+            while (use.next()) {
+                auto path = parseStorePath(use.getStr(1));
+                insert.use()
+                    (use.getInt(0))
+                    (pathKey(path))
+                    (std::string(path.name()))
+                    (use.getStr(2))
+                    (use.getInt(3))
+                    (use.isNull(4) ? "" : use.getStr(4), !use.isNull(4))
+                    (use.getInt(5), !use.isNull(5))
+                    (use.getInt(6), !use.isNull(6))
+                    (use.isNull(7) ? "" : use.getStr(7), !use.isNull(7))
+                    (use.isNull(8) ? "" : use.getStr(8), !use.isNull(8))
+                    .exec();
+            }
+
+            state->db.exec(
+                "update sqlite_sequence set seq = (select seq from sqlite_sequence where name = 'ValidPaths') "
+                "where name = 'ValidPathsNew';");
+            state->db.exec("drop table ValidPaths");
+            state->db.exec("alter table ValidPathsNew rename to ValidPaths");
+            state->db.exec(
+                "create trigger DeleteSelfRefs before delete on ValidPaths"
+                "  begin"
+                "    delete from Refs where referrer = old.id and reference = old.id;"
+                "  end;");
+
+            txn.commit();
+
+            state->db.exec("pragma foreign_keys = 1");
+            state->db.exec("vacuum");
+        }
+
         writeFile(schemaPath, (format("%1%") % nixSchemaVersion).str());
 
         lockFile(globalLock.get(), ltRead, true);
@@ -221,36 +316,99 @@ LocalStore::LocalStore(const Params & params)
     else openDB(*state, false);
 
     /* Prepare SQL statements. */
+    state->prepareQueries();
     state->stmtRegisterValidPath.create(state->db,
-        "insert into ValidPaths (path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca) values (?, ?, ?, ?, ?, ?, ?, ?);");
+        "insert into ValidPaths (hashPart, name, hash, registrationTime, deriver, narSize, ultimate, sigs, ca) values (?, ?, ?, ?, ?, ?, ?, ?, ?);");
     state->stmtUpdatePathInfo.create(state->db,
-        "update ValidPaths set narSize = ?, hash = ?, ultimate = ?, sigs = ?, ca = ? where path = ?;");
+        "update ValidPaths set narSize = ?, hash = ?, ultimate = ?, sigs = ?, ca = ? where hashPart = ?;");
     state->stmtAddReference.create(state->db,
         "insert or replace into Refs (referrer, reference) values (?, ?);");
-    state->stmtQueryPathInfo.create(state->db,
-        "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
-    state->stmtQueryReferences.create(state->db,
-        "select path from Refs join ValidPaths on reference = id where referrer = ?;");
-    state->stmtQueryReferrers.create(state->db,
-        "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
     state->stmtInvalidatePath.create(state->db,
-        "delete from ValidPaths where path = ?;");
+        "delete from ValidPaths where hashPart = ?;");
     state->stmtAddDerivationOutput.create(state->db,
         "insert or replace into DerivationOutputs (drv, id, path) values (?, ?, ?);");
-    state->stmtQueryValidDerivers.create(state->db,
-        "select v.id, v.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
-    state->stmtQueryDerivationOutputs.create(state->db,
-        "select id, path from DerivationOutputs where drv = ?;");
-    // Use "path >= ?" with limit 1 rather than "path like '?%'" to
-    // ensure efficient lookup.
-    state->stmtQueryPathFromHashPart.create(state->db,
-        "select path from ValidPaths where path >= ? limit 1;");
-    state->stmtQueryValidPaths.create(state->db, "select path from ValidPaths");
+    state->stmtRegisterDrvHash.create(state->db,
+        "insert or replace into DrvHashes (drv, hash) select id, ? from ValidPaths where hashPart = ?;");
+    state->stmtRegisterClosureSize.create(state->db,
+        "insert or replace into ClosureSizes (id, narSize) select id, ? from ValidPaths where hashPart = ?;");
+    /* Keep an exponentially weighted average so that the estimate
+       follows builds getting slower or faster over time. */
+    state->stmtRegisterBuildTime.create(state->db,
+        "insert or replace into BuildTimes (name, duration) values "
+        "(?1, coalesce((select (3 * duration + ?2) / 4 from BuildTimes where name = ?1), ?2));");
+    state->stmtRegisterOutputSize.create(state->db,
+        "insert or replace into OutputSizes (name, size) values "
+        "(?1, coalesce((select (3 * size + ?2) / 4 from OutputSizes where name = ?1), ?2));");
+    state->stmtRegisterLastUse.create(state->db,
+        "insert or replace into LastUse (id, time) select id, ? from ValidPaths where hashPart = ?;");
+    state->stmtRegisterOptimisedPath.create(state->db,
+        "insert or replace into OptimisedPaths (id) select id from ValidPaths where hashPart = ?;");
+    state->stmtQueueOptimisation.create(state->db,
+        "insert or ignore into PendingOptimisations (id) select id from ValidPaths where hashPart = ?;");
+    state->stmtFinishOptimisation.create(state->db,
+        "delete from PendingOptimisations where id = (select id from ValidPaths where hashPart = ?);");
+    state->stmtRegisterVerifiedPath.create(state->db,
+        "insert or replace into VerifiedPaths (id, time) select id, ? from ValidPaths where hashPart = ?;");
+    state->stmtRegisterFailedBuild.create(state->db,
+        "insert or replace into FailedBuilds (id, status, time) select id, ?, ? from ValidPaths where hashPart = ?;");
+    state->stmtClearFailedBuild.create(state->db,
+        "delete from FailedBuilds where id = (select id from ValidPaths where hashPart = ?);");
+
+    /* In WAL mode, readers don't block each other or the writer, so
+       give concurrent queries their own connections. They are only
+       opened when needed. */
+    if (settings.useSQLiteWAL && maxReadConnections) {
+        auto dbPath = dbDir + "/db.sqlite";
+        readConnections = std::make_unique<Pool<DBConnection>>(maxReadConnections, [dbPath]() {
+            auto conn = make_ref<DBConnection>();
+            conn->db = SQLite(dbPath, false);
+            conn->db.exec("pragma query_only = 1");
+            conn->prepareQueries();
+            return conn;
+        });
+    }
+
+    /* Use the shared path info cache if it's enabled, or if other
+       processes have enabled it, since we must then invalidate it
+       when changing path info. */
+    auto sharedCachePath = dbDir + "/path-info-cache-v1";
+    if (settings.sharedPathInfoCacheSize || pathExists(sharedCachePath)) {
+        try {
+            sharedPathInfoCache = std::make_unique<SharedPathInfoCache>(
+                sharedCachePath, settings.sharedPathInfoCacheSize);
+        } catch (Error & e) {
+            debug("not using the shared path info cache: %s", e.msg());
+        }
+    }
 }
 
 
 LocalStore::~LocalStore()
 {
+    /* Let the post-build hook work through the queue, so that no
+       build is left unprocessed. */
+    std::vector<std::thread> hookThreads;
+    {
+        auto state(postBuildHooks.lock());
+        state->quit = true;
+        if (!state->pending.empty())
+            printInfo("waiting for the post-build hook to process %d builds on exit...", state->pending.size());
+        hookThreads = std::move(state->threads);
+    }
+    postBuildHookQueued.notify_all();
+    for (auto & thread : hookThreads)
+        thread.join();
+
+    /* Let the background optimiser finish the queue. In the daemon,
+       this happens after the client has disconnected. If we're
+       killed, the rest of the queue is picked up by the next process
+       that adds to it. */
+    {
+        std::lock_guard<std::mutex> lock(optimiserMutex);
+        if (optimiserThread.joinable())
+            optimiserThread.join();
+    }
+
     std::shared_future<void> future;
 
     {
@@ -264,6 +422,13 @@ LocalStore::~LocalStore()
         future.get();
     }
 
+    try {
+        auto state(_state.lock());
+        flushLastUse(*state);
+    } catch (...) {
+        ignoreException();
+    }
+
     try {
         auto state(_state.lock());
         if (state->fdTempRoots) {
@@ -294,6 +459,93 @@ int LocalStore::getSchema()
 }
 
 
+/* The number of parameters of the statements that look up a batch of
+   paths or path IDs. Shorter batches are padded by repeating the last
+   element. */
+static const size_t queryBatchSize = 256;
+
+
+static std::string batchQuery(const std::string & prefix, const std::string & suffix = "")
+{
+    std::string sql = prefix + " (?";
+    for (size_t n = 1; n < queryBatchSize; ++n) sql += ", ?";
+    return sql + ")" + suffix + ";";
+}
+
+
+/* Call `f' for each batch of at most queryBatchSize elements of
+   `xs', with a statement use to which all elements of the batch have
+   been bound. */
+template<typename T, typename F>
+static void forEachBatch(SQLiteStmt & stmt, const std::vector<T> & xs, F && f)
+{
+    for (size_t start = 0; start < xs.size(); start += queryBatchSize) {
+        auto use(stmt.use());
+        auto end = std::min(xs.size(), start + queryBatchSize);
+        for (size_t n = 0; n < queryBatchSize; ++n)
+            use(xs[std::min(start + n, end - 1)]);
+        f(use);
+    }
+}
+
+
+void LocalStore::DBConnection::prepareQueries()
+{
+    stmtQueryPathInfo.create(db,
+        "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where hashPart = ? and name = ?;");
+    stmtQueryReferences.create(db,
+        "select hashPart, name from Refs join ValidPaths on reference = id where referrer = ?;");
+    stmtQueryReferrers.create(db,
+        "select hashPart, name from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where hashPart = ?);");
+    stmtQueryValidDerivers.create(db,
+        "select v.id, v.hashPart, v.name from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
+    stmtQueryDerivationOutputs.create(db,
+        "select id, path from DerivationOutputs where drv = ?;");
+    stmtQueryPathFromHashPart.create(db,
+        "select hashPart, name from ValidPaths where hashPart = ?;");
+    stmtQueryValidPaths.create(db, "select hashPart, name from ValidPaths");
+    stmtQueryDrvHash.create(db,
+        "select d.hash from DrvHashes d join ValidPaths v on d.drv = v.id where v.hashPart = ?;");
+    stmtQueryClosureSize.create(db,
+        "select c.narSize from ClosureSizes c join ValidPaths v on c.id = v.id where v.hashPart = ?;");
+    stmtQueryBuildTime.create(db,
+        "select duration from BuildTimes where name = ?;");
+    stmtQueryOutputSize.create(db,
+        "select size from OutputSizes where name = ?;");
+    stmtQueryFailedBuild.create(db,
+        "select f.status from FailedBuilds f join ValidPaths v on f.id = v.id where v.hashPart = ?;");
+    stmtQueryFailedBuilds.create(db,
+        "select v.hashPart, v.name from FailedBuilds f join ValidPaths v on f.id = v.id;");
+    stmtQueryValidPathsIn.create(db,
+        batchQuery("select hashPart, name from ValidPaths where hashPart in"));
+    stmtQueryPathInfos.create(db,
+        batchQuery("select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca, hashPart, name from ValidPaths where hashPart in"));
+    stmtQueryReferencesOf.create(db,
+        batchQuery("select referrer, hashPart, name from Refs join ValidPaths on reference = id where referrer in"));
+    stmtQueryClosureInfos.create(db,
+        batchQuery(
+            "with recursive closure(id) as (select id from ValidPaths where hashPart in",
+            " union select reference from Refs join closure on referrer = closure.id) "
+            "select v.id, v.hash, v.registrationTime, v.deriver, v.narSize, v.ultimate, v.sigs, v.ca, v.hashPart, v.name, r.hashPart, r.name "
+            "from closure c join ValidPaths v on v.id = c.id "
+            "left join Refs on Refs.referrer = c.id left join ValidPaths r on r.id = Refs.reference"));
+}
+
+
+template<typename T, typename F>
+T LocalStore::retryQuery(F && f)
+{
+    return retrySQLite<T>([&]() -> T {
+        if (readConnections) {
+            auto conn(readConnections->get());
+            return f(*conn);
+        }
+        auto state(_state.lock());
+        return f(*state);
+    });
+}
+
+
 void LocalStore::openDB(State & state, bool create)
 {
     if (access(dbDir.c_str(), R_OK | W_OK))
@@ -352,6 +604,82 @@ void LocalStore::openDB(State & state, bool create)
             ;
         db.exec(schema);
     }
+
+    /* The memo table of hashDerivationModulo() is only a cache that
+       older versions of Nix can safely ignore, so rather than
+       bumping the schema version, create it on demand. */
+    db.exec(
+        "create table if not exists DrvHashes ("
+        "  drv  integer primary key not null,"
+        "  hash text not null,"
+        "  foreign key (drv) references ValidPaths(id) on delete cascade"
+        ");");
+
+    /* Likewise for the memo table of getClosureSize(). */
+    db.exec(
+        "create table if not exists ClosureSizes ("
+        "  id      integer primary key not null,"
+        "  narSize integer not null,"
+        "  foreign key (id) references ValidPaths(id) on delete cascade"
+        ");");
+
+    /* Likewise for the last-use times used by gc-lru. */
+    db.exec(
+        "create table if not exists LastUse ("
+        "  id   integer primary key not null,"
+        "  time integer not null,"
+        "  foreign key (id) references ValidPaths(id) on delete cascade"
+        ");");
+
+    /* Historical build durations per derivation name, used to
+       schedule the longest chains first. */
+    db.exec(
+        "create table if not exists BuildTimes ("
+        "  name     text primary key not null,"
+        "  duration integer not null"
+        ");");
+
+    /* Likewise for the total NAR size of their outputs, used to
+       anticipate the disk space that pending builds will take. */
+    db.exec(
+        "create table if not exists OutputSizes ("
+        "  name text primary key not null,"
+        "  size integer not null"
+        ");");
+
+    /* Derivations whose build failed permanently, if ‘cache-failures’
+       is enabled. The entry goes away with the derivation. */
+    db.exec(
+        "create table if not exists FailedBuilds ("
+        "  id     integer primary key not null,"
+        "  status integer not null,"
+        "  time   integer not null,"
+        "  foreign key (id) references ValidPaths(id) on delete cascade"
+        ");");
+
+    /* And for the paths already processed by optimiseStore(). */
+    db.exec(
+        "create table if not exists OptimisedPaths ("
+        "  id integer primary key not null,"
+        "  foreign key (id) references ValidPaths(id) on delete cascade"
+        ");");
+
+    /* Paths waiting to be deduplicated in the background because
+       auto-optimise-queue-size is set. */
+    db.exec(
+        "create table if not exists PendingOptimisations ("
+        "  id integer primary key not null,"
+        "  foreign key (id) references ValidPaths(id) on delete cascade"
+        ");");
+
+    /* When the contents of a path were last checked by
+       verifyStore(). Re-registering a path drops its entry. */
+    db.exec(
+        "create table if not exists VerifiedPaths ("
+        "  id   integer primary key not null,"
+        "  time integer not null,"
+        "  foreign key (id) references ValidPaths(id) on delete cascade"
+        ");");
 }
 
 
@@ -424,93 +752,189 @@ void canonicaliseTimestampAndPermissions(const Path & path)
 }
 
 
-static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
+namespace {
+
+/* Canonicalises a tree using system calls relative to the file
+   descriptor of the containing directory, so that the kernel doesn't
+   resolve the full path of every file several times. Directories are
+   processed in parallel. */
+struct MetaDataCanonicaliser
 {
-    checkInterrupt();
+    uid_t fromUid;
 
-#if __APPLE__
-    /* Remove flags, in particular UF_IMMUTABLE which would prevent
-       the file from being garbage-collected. FIXME: Use
-       setattrlist() to remove other attributes as well. */
-    if (lchflags(path.c_str(), 0)) {
-        if (errno != ENOTSUP)
-            throw SysError("clearing flags of path '%1%'", path);
+    /* Inodes seen by previous calls, which aren't modified during the
+       walk, and the inodes seen by this one, sharded to avoid lock
+       contention on large trees. */
+    const InodesSeen & inodesSeenBefore;
+    std::array<Sync<InodesSeen>, 64> inodesSeen;
+
+    ThreadPool pool;
+
+    MetaDataCanonicaliser(uid_t fromUid, const InodesSeen & inodesSeenBefore)
+        : fromUid(fromUid), inodesSeenBefore(inodesSeenBefore)
+    { }
+
+    Sync<InodesSeen> & shard(const Inode & inode)
+    {
+        return inodesSeen[(inode.first ^ inode.second) % inodesSeen.size()];
     }
+
+    bool seen(const Inode & inode)
+    {
+        return inodesSeenBefore.count(inode) || shard(inode).lock()->count(inode);
+    }
+
+    void mergeInto(InodesSeen & result)
+    {
+        for (auto & s : inodesSeen) {
+            auto inodes(s.lock());
+            result.insert(inodes->begin(), inodes->end());
+        }
+    }
+
+    /* Canonicalise the entry `name' of the directory `dirFd', whose
+       full path is `path'. */
+    void canonicaliseEntry(int dirFd, const char * name, const Path & path)
+    {
+        checkInterrupt();
+
+#if __APPLE__
+        /* Remove flags, in particular UF_IMMUTABLE which would prevent
+           the file from being garbage-collected. FIXME: Use
+           setattrlist() to remove other attributes as well. */
+        if (lchflags(path.c_str(), 0)) {
+            if (errno != ENOTSUP)
+                throw SysError("clearing flags of path '%1%'", path);
+        }
 #endif
 
-    struct stat st;
-    if (lstat(path.c_str(), &st))
-        throw SysError("getting attributes of path '%1%'", path);
+        struct stat st;
+        if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW))
+            throw SysError("getting attributes of path '%1%'", path);
 
-    /* Really make sure that the path is of a supported type. */
-    if (!(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode) || S_ISLNK(st.st_mode)))
-        throw Error("file '%1%' has an unsupported type", path);
+        /* Really make sure that the path is of a supported type. */
+        if (!(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode) || S_ISLNK(st.st_mode)))
+            throw Error("file '%1%' has an unsupported type", path);
 
 #if __linux__
-    /* Remove extended attributes / ACLs. */
-    ssize_t eaSize = llistxattr(path.c_str(), nullptr, 0);
-
-    if (eaSize < 0) {
-        if (errno != ENOTSUP && errno != ENODATA)
-            throw SysError("querying extended attributes of '%s'", path);
-    } else if (eaSize > 0) {
-        std::vector<char> eaBuf(eaSize);
-
-        if ((eaSize = llistxattr(path.c_str(), eaBuf.data(), eaBuf.size())) < 0)
-            throw SysError("querying extended attributes of '%s'", path);
-
-        for (auto & eaName: tokenizeString<Strings>(std::string(eaBuf.data(), eaSize), std::string("\000", 1))) {
-            /* Ignore SELinux security labels since these cannot be
-               removed even by root. */
-            if (eaName == "security.selinux") continue;
-            if (lremovexattr(path.c_str(), eaName.c_str()) == -1)
-                throw SysError("removing extended attribute '%s' from '%s'", eaName, path);
+        /* Remove extended attributes / ACLs. */
+        ssize_t eaSize = llistxattr(path.c_str(), nullptr, 0);
+
+        if (eaSize < 0) {
+            if (errno != ENOTSUP && errno != ENODATA)
+                throw SysError("querying extended attributes of '%s'", path);
+        } else if (eaSize > 0) {
+            std::vector<char> eaBuf(eaSize);
+
+            if ((eaSize = llistxattr(path.c_str(), eaBuf.data(), eaBuf.size())) < 0)
+                throw SysError("querying extended attributes of '%s'", path);
+
+            for (auto & eaName: tokenizeString<Strings>(std::string(eaBuf.data(), eaSize), std::string("\000", 1))) {
+                /* Ignore SELinux security labels since these cannot be
+                   removed even by root. */
+                if (eaName == "security.selinux") continue;
+                if (lremovexattr(path.c_str(), eaName.c_str()) == -1)
+                    throw SysError("removing extended attribute '%s' from '%s'", eaName, path);
+            }
         }
-     }
 #endif
 
-    /* Fail if the file is not owned by the build user.  This prevents
-       us from messing up the ownership/permissions of files
-       hard-linked into the output (e.g. "ln /etc/shadow $out/foo").
-       However, ignore files that we chown'ed ourselves previously to
-       ensure that we don't fail on hard links within the same build
-       (i.e. "touch $out/foo; ln $out/foo $out/bar"). */
-    if (fromUid != (uid_t) -1 && st.st_uid != fromUid) {
-        assert(!S_ISDIR(st.st_mode));
-        if (inodesSeen.find(Inode(st.st_dev, st.st_ino)) == inodesSeen.end())
-            throw BuildError("invalid ownership on file '%1%'", path);
-        mode_t mode = st.st_mode & ~S_IFMT;
-        assert(S_ISLNK(st.st_mode) || (st.st_uid == geteuid() && (mode == 0444 || mode == 0555) && st.st_mtime == mtimeStore));
-        return;
-    }
+        Inode inode(st.st_dev, st.st_ino);
+
+        /* Fail if the file is not owned by the build user.  This
+           prevents us from messing up the ownership/permissions of
+           files hard-linked into the output (e.g. "ln /etc/shadow
+           $out/foo").  However, ignore files that we chown'ed
+           ourselves previously to ensure that we don't fail on hard
+           links within the same build (i.e. "touch $out/foo; ln
+           $out/foo $out/bar").  Since an inode is recorded before it
+           is chown'ed, a concurrent visit of another link to it
+           either still sees the build user as the owner, or finds it
+           in the set. */
+        if (fromUid != (uid_t) -1 && st.st_uid != fromUid) {
+            assert(!S_ISDIR(st.st_mode));
+            if (!seen(inode))
+                throw BuildError("invalid ownership on file '%1%'", path);
+            mode_t mode = st.st_mode & ~S_IFMT;
+            assert(S_ISLNK(st.st_mode) || (st.st_uid == geteuid() && (mode == 0444 || mode == 0555) && st.st_mtime == mtimeStore));
+            return;
+        }
 
-    inodesSeen.insert(Inode(st.st_dev, st.st_ino));
+        shard(inode).lock()->insert(inode);
 
-    canonicaliseTimestampAndPermissions(path, st);
+        if (!S_ISLNK(st.st_mode)) {
 
-    /* Change ownership to the current uid.  If it's a symlink, use
-       lchown if available, otherwise don't bother.  Wrong ownership
-       of a symlink doesn't matter, since the owning user can't change
-       the symlink and can't delete it because the directory is not
-       writable.  The only exception is top-level paths in the Nix
-       store (since that directory is group-writable for the Nix build
-       users group); we check for this case below. */
-    if (st.st_uid != geteuid()) {
-#if HAVE_LCHOWN
-        if (lchown(path.c_str(), geteuid(), getegid()) == -1)
-#else
-        if (!S_ISLNK(st.st_mode) &&
-            chown(path.c_str(), geteuid(), getegid()) == -1)
-#endif
-            throw SysError("changing owner of '%1%' to %2%",
-                path, geteuid());
+            /* Mask out all type related bits. */
+            mode_t mode = st.st_mode & ~S_IFMT;
+
+            if (mode != 0444 && mode != 0555) {
+                mode = 0444 | (st.st_mode & S_IXUSR ? 0111 : 0);
+                if (fchmodat(dirFd, name, mode, 0) == -1)
+                    throw SysError("changing mode of '%1%' to %2$o", path, mode);
+            }
+
+        }
+
+        if (st.st_mtime != mtimeStore) {
+            struct timespec times[2];
+            times[0].tv_sec = st.st_atime;
+            times[0].tv_nsec = 0;
+            times[1].tv_sec = mtimeStore;
+            times[1].tv_nsec = 0;
+            if (utimensat(dirFd, name, times, AT_SYMLINK_NOFOLLOW) == -1)
+                throw SysError("changing modification time of '%1%'", path);
+        }
+
+        /* Change ownership to the current uid.  Wrong ownership of a
+           symlink doesn't matter, since the owning user can't change
+           the symlink and can't delete it because the directory is
+           not writable.  The only exception is top-level paths in
+           the Nix store (since that directory is group-writable for
+           the Nix build users group); we check for this case in
+           canonicalisePathMetaData(). */
+        if (st.st_uid != geteuid()) {
+            if (fchownat(dirFd, name, geteuid(), getegid(), AT_SYMLINK_NOFOLLOW) == -1)
+                throw SysError("changing owner of '%1%' to %2%",
+                    path, geteuid());
+        }
+
+        if (S_ISDIR(st.st_mode))
+            pool.enqueue([this, path]() { canonicaliseDirectory(path); });
     }
 
-    if (S_ISDIR(st.st_mode)) {
-        DirEntries entries = readDirectory(path);
-        for (auto & i : entries)
-            canonicalisePathMetaData_(path + "/" + i.name, fromUid, inodesSeen);
+    void canonicaliseDirectory(const Path & path)
+    {
+        /* The builder is gone, so nobody can replace the directory by
+           a symlink anymore; O_NOFOLLOW is just a precaution. Opening
+           by path rather than relative to the parent means we only
+           have a directory open per thread. */
+        AutoCloseDir dir;
+        {
+            int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd == -1) throw SysError("opening directory '%1%'", path);
+            dir.reset(fdopendir(fd));
+            if (!dir) {
+                close(fd);
+                throw SysError("opening directory '%1%'", path);
+            }
+        }
+
+        int fd = dirfd(dir.get());
+
+        for (auto & i : readDirectory(dir.get(), path))
+            canonicaliseEntry(fd, i.name.c_str(), path + "/" + i.name);
     }
+};
+
+}
+
+
+static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
+{
+    MetaDataCanonicaliser canonicaliser(fromUid, inodesSeen);
+    canonicaliser.canonicaliseEntry(AT_FDCWD, path.c_str(), path);
+    canonicaliser.pool.process();
+    canonicaliser.mergeInto(inodesSeen);
 }
 
 
@@ -585,7 +1009,8 @@ uint64_t LocalStore::addValidPath(State & state,
             printStorePath(info.path));
 
     state.stmtRegisterValidPath.use()
-        (printStorePath(info.path))
+        (pathKey(info.path))
+        (std::string(info.path.name()))
         (info.narHash.to_string(Base16, true))
         (info.registrationTime == 0 ? time(0) : info.registrationTime)
         (info.deriver ? printStorePath(*info.deriver) : "", (bool) info.deriver)
@@ -619,60 +1044,112 @@ uint64_t LocalStore::addValidPath(State & state,
         }
     }
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.upsert(std::string(info.path.hashPart()),
-            PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
-    }
+    pathInfoCache.upsert(std::string(info.path.hashPart()),
+        PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
 
     return id;
 }
 
 
-void LocalStore::queryPathInfoUncached(const StorePath & path,
-    Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
+/* The format of path info in the shared path info cache. */
+static std::string serialisePathInfo(const Store & store, const ValidPathInfo & info)
+{
+    StringSink sink;
+    sink << store.printStorePath(info.path)
+         << info.id
+         << info.narHash.to_string(Base16, true)
+         << info.registrationTime
+         << (info.deriver ? store.printStorePath(*info.deriver) : "")
+         << info.narSize
+         << info.ultimate
+         << info.sigs
+         << renderContentAddress(info.ca);
+    writeStorePaths(store, sink, info.references);
+    return *sink.s;
+}
+
+
+static std::shared_ptr<ValidPathInfo> parsePathInfo(const Store & store,
+    const StorePath & path, const std::string & s)
 {
+    StringSource source(s);
+    if (readString(source) != store.printStorePath(path)) return nullptr;
+    auto info = std::make_shared<ValidPathInfo>(path);
+    info->id = readNum<uint64_t>(source);
+    info->narHash = Hash(readString(source));
+    info->registrationTime = readNum<time_t>(source);
+    auto deriver = readString(source);
+    if (deriver != "") info->deriver = store.parseStorePath(deriver);
+    info->narSize = readNum<uint64_t>(source);
+    info->ultimate = readNum<bool>(source);
+    info->sigs = readStrings<StringSet>(source);
+    info->ca = parseContentAddressOpt(readString(source));
+    info->references = readStorePaths<StorePathSet>(store, source);
+    return info;
+}
+
+
+void LocalStore::readPathInfoRow(SQLiteStmt::Use & use, ValidPathInfo & info)
+{
+    info.id = use.getInt(0);
+
     try {
-        auto info = std::make_shared<ValidPathInfo>(path);
+        info.narHash = Hash(use.getStr(1));
+    } catch (BadHash & e) {
+        throw Error("in valid-path entry for '%s': %s", printStorePath(info.path), e.what());
+    }
 
-        callback(retrySQLite<std::shared_ptr<ValidPathInfo>>([&]() {
-            auto state(_state.lock());
+    info.registrationTime = use.getInt(2);
 
-            /* Get the path info. */
-            auto useQueryPathInfo(state->stmtQueryPathInfo.use()(printStorePath(info->path)));
+    if (!use.isNull(3)) info.deriver = parseStorePath(use.getStr(3));
 
-            if (!useQueryPathInfo.next())
-                return std::shared_ptr<ValidPathInfo>();
+    /* Note that narSize = NULL yields 0. */
+    info.narSize = use.getInt(4);
 
-            info->id = useQueryPathInfo.getInt(0);
+    info.ultimate = use.getInt(5) == 1;
 
-            try {
-                info->narHash = Hash(useQueryPathInfo.getStr(1));
-            } catch (BadHash & e) {
-                throw Error("in valid-path entry for '%s': %s", printStorePath(path), e.what());
-            }
+    if (!use.isNull(6)) info.sigs = tokenizeString<StringSet>(use.getStr(6), " ");
+
+    if (!use.isNull(7)) info.ca = parseContentAddressOpt(use.getStr(7));
+}
 
-            info->registrationTime = useQueryPathInfo.getInt(2);
 
-            auto s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 3);
-            if (s) info->deriver = parseStorePath(s);
+void LocalStore::queryPathInfoUncached(const StorePath & path,
+    Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
+{
+    try {
+        /* Note: the generation must be read before querying the
+           database, so that we don't cache info that has been changed
+           in the meantime. */
+        uint64_t generation = 0;
+        if (sharedPathInfoCache) {
+            generation = sharedPathInfoCache->generation();
+            if (auto s = sharedPathInfoCache->lookup(path.hashPart()))
+                if (auto info = parsePathInfo(*this, path, *s))
+                    return callback(info);
+        }
 
-            /* Note that narSize = NULL yields 0. */
-            info->narSize = useQueryPathInfo.getInt(4);
+        auto info = std::make_shared<ValidPathInfo>(path);
 
-            info->ultimate = useQueryPathInfo.getInt(5) == 1;
+        callback(retryQuery<std::shared_ptr<ValidPathInfo>>([&](DBConnection & conn) {
+            /* Get the path info. */
+            auto useQueryPathInfo(conn.stmtQueryPathInfo.use()
+                (pathKey(info->path))
+                (std::string(info->path.name())));
 
-            s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 6);
-            if (s) info->sigs = tokenizeString<StringSet>(s, " ");
+            if (!useQueryPathInfo.next())
+                return std::shared_ptr<ValidPathInfo>();
 
-            s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 7);
-            if (s) info->ca = parseContentAddressOpt(s);
+            readPathInfoRow(useQueryPathInfo, *info);
 
             /* Get the references. */
-            auto useQueryReferences(state->stmtQueryReferences.use()(info->id));
+            auto useQueryReferences(conn.stmtQueryReferences.use()(info->id));
 
             while (useQueryReferences.next())
-                info->references.insert(parseStorePath(useQueryReferences.getStr(0)));
+                info->references.insert(readPath(useQueryReferences, 0));
+
+            if (sharedPathInfoCache)
+                sharedPathInfoCache->insert(path.hashPart(), serialisePathInfo(*this, *info), generation);
 
             return info;
         }));
@@ -681,6 +1158,79 @@ void LocalStore::queryPathInfoUncached(const StorePath & path,
 }
 
 
+bool LocalStore::queryPathInfosUncached(const StorePathSet & paths,
+    std::map<StorePath, std::shared_ptr<const ValidPathInfo>> & infos)
+{
+    std::vector<SQLiteBlob> keys;
+    for (auto & path : paths)
+        keys.push_back(pathKey(path));
+
+    auto res = retryQuery<std::map<StorePath, std::shared_ptr<const ValidPathInfo>>>([&](DBConnection & conn) {
+        std::map<StorePath, std::shared_ptr<const ValidPathInfo>> res;
+
+        std::map<int64_t, std::shared_ptr<ValidPathInfo>> byId;
+        forEachBatch(conn.stmtQueryPathInfos, keys, [&](SQLiteStmt::Use & use) {
+            while (use.next()) {
+                /* Skip paths that only share the hash part of a
+                   requested path. */
+                auto path = readPath(use, 8);
+                if (!paths.count(path)) continue;
+                auto info = std::make_shared<ValidPathInfo>(std::move(path));
+                readPathInfoRow(use, *info);
+                byId.emplace(info->id, info);
+            }
+        });
+
+        std::vector<int64_t> ids;
+        for (auto & i : byId)
+            ids.push_back(i.first);
+
+        forEachBatch(conn.stmtQueryReferencesOf, ids, [&](SQLiteStmt::Use & use) {
+            while (use.next())
+                byId.at(use.getInt(0))->references.insert(readPath(use, 1));
+        });
+
+        for (auto & i : byId)
+            res.emplace(i.second->path, i.second);
+
+        return res;
+    });
+
+    infos.merge(res);
+
+    return true;
+}
+
+
+void LocalStore::prefetchClosureInfos(const StorePathSet & paths)
+{
+    /* Walk the closure with a single recursive query over Refs,
+       rather than with a query per path or per level. */
+    std::vector<SQLiteBlob> keys;
+    for (auto & path : paths)
+        keys.push_back(pathKey(path));
+
+    auto infos = retryQuery<std::map<int64_t, std::shared_ptr<ValidPathInfo>>>([&](DBConnection & conn) {
+        std::map<int64_t, std::shared_ptr<ValidPathInfo>> byId;
+        forEachBatch(conn.stmtQueryClosureInfos, keys, [&](SQLiteStmt::Use & use) {
+            while (use.next()) {
+                auto & info = byId[use.getInt(0)];
+                if (!info) {
+                    info = std::make_shared<ValidPathInfo>(readPath(use, 8));
+                    readPathInfoRow(use, *info);
+                }
+                if (!use.isNull(10))
+                    info->references.insert(readPath(use, 10));
+            }
+        });
+        return byId;
+    });
+
+    for (auto & [id, info] : infos)
+        pathInfoCache.upsert(std::string(info->path.hashPart()), PathInfoCacheValue { .value = info });
+}
+
+
 /* Update path info in the database. */
 void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
 {
@@ -690,136 +1240,550 @@ void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
         (info.ultimate ? 1 : 0, info.ultimate)
         (concatStringsSep(" ", info.sigs), !info.sigs.empty())
         (renderContentAddress(info.ca), (bool) info.ca)
-        (printStorePath(info.path))
+        (pathKey(info.path))
         .exec();
+
+    state.pathInfoChanged = true;
+}
+
+
+void LocalStore::invalidateSharedPathInfoCache(State & state)
+{
+    if (!state.pathInfoChanged) return;
+    state.pathInfoChanged = false;
+    if (sharedPathInfoCache)
+        sharedPathInfoCache->invalidate();
+}
+
+
+std::optional<std::pair<uint64_t, uint64_t>> LocalStore::getSharedPathInfoCacheStats()
+{
+    if (!sharedPathInfoCache) return {};
+    return sharedPathInfoCache->getStats();
 }
 
 
-uint64_t LocalStore::queryValidPathId(State & state, const StorePath & path)
+uint64_t LocalStore::queryValidPathId(DBConnection & conn, const StorePath & path)
 {
-    auto use(state.stmtQueryPathInfo.use()(printStorePath(path)));
+    auto use(conn.stmtQueryPathInfo.use()(pathKey(path))(std::string(path.name())));
     if (!use.next())
         throw Error("path '%s' is not valid", printStorePath(path));
     return use.getInt(0);
 }
 
 
-bool LocalStore::isValidPath_(State & state, const StorePath & path)
+bool LocalStore::isValidPath_(DBConnection & conn, const StorePath & path)
 {
-    return state.stmtQueryPathInfo.use()(printStorePath(path)).next();
+    return conn.stmtQueryPathInfo.use()(pathKey(path))(std::string(path.name())).next();
 }
 
 
 bool LocalStore::isValidPathUncached(const StorePath & path)
 {
-    return retrySQLite<bool>([&]() {
-        auto state(_state.lock());
-        return isValidPath_(*state, path);
+    if (sharedPathInfoCache)
+        if (auto s = sharedPathInfoCache->lookup(path.hashPart()))
+            if (parsePathInfo(*this, path, *s))
+                return true;
+
+    return retryQuery<bool>([&](DBConnection & conn) {
+        return isValidPath_(conn, path);
     });
 }
 
 
 StorePathSet LocalStore::queryValidPaths(const StorePathSet & paths, SubstituteFlag maybeSubstitute)
 {
+    /* Look up the paths that aren't in the path info cache in
+       batches. */
     StorePathSet res;
-    for (auto & i : paths)
-        if (isValidPath(i)) res.insert(i);
+    std::vector<SQLiteBlob> uncached;
+
+    for (auto & path : paths) {
+        auto info = pathInfoCache.get(std::string(path.hashPart()));
+        if (info && info->isKnownNow()) {
+            if (info->didExist()) res.insert(path);
+        } else
+            uncached.push_back(pathKey(path));
+    }
+
+    if (uncached.empty()) return res;
+
+    auto valid = retryQuery<StorePathSet>([&](DBConnection & conn) {
+        StorePathSet valid;
+        forEachBatch(conn.stmtQueryValidPathsIn, uncached, [&](SQLiteStmt::Use & use) {
+            while (use.next()) {
+                auto path = readPath(use, 0);
+                if (paths.count(path)) valid.insert(std::move(path));
+            }
+        });
+        return valid;
+    });
+
+    res.merge(valid);
+
     return res;
 }
 
 
 StorePathSet LocalStore::queryAllValidPaths()
 {
-    return retrySQLite<StorePathSet>([&]() {
-        auto state(_state.lock());
-        auto use(state->stmtQueryValidPaths.use());
+    return retryQuery<StorePathSet>([&](DBConnection & conn) {
+        auto use(conn.stmtQueryValidPaths.use());
         StorePathSet res;
-        while (use.next()) res.insert(parseStorePath(use.getStr(0)));
+        while (use.next()) res.insert(readPath(use, 0));
         return res;
     });
 }
 
 
-void LocalStore::queryReferrers(State & state, const StorePath & path, StorePathSet & referrers)
+/* Write the pending last-use times to the database when there are
+   this many of them, or when they were last written this many seconds
+   ago. */
+static const size_t lastUseBatchSize = 256;
+static const time_t lastUseFlushInterval = 60;
+
+
+void LocalStore::recordPathUse(const StorePathSet & paths)
 {
-    auto useQueryReferrers(state.stmtQueryReferrers.use()(printStorePath(path)));
+    if (!settings.gcLRU) return;
 
-    while (useQueryReferrers.next())
-        referrers.insert(parseStorePath(useQueryReferrers.getStr(0)));
-}
+    auto state(_state.lock());
 
+    auto now = time(0);
+    for (auto & path : paths)
+        state->pendingLastUse.insert_or_assign(path, now);
 
-void LocalStore::queryReferrers(const StorePath & path, StorePathSet & referrers)
-{
-    return retrySQLite<void>([&]() {
-        auto state(_state.lock());
-        queryReferrers(*state, path, referrers);
-    });
+    if (state->pendingLastUse.size() >= lastUseBatchSize
+        || now - state->lastUseFlushed >= lastUseFlushInterval)
+        flushLastUse(*state);
 }
 
 
-StorePathSet LocalStore::queryValidDerivers(const StorePath & path)
+void LocalStore::flushLastUse(State & state)
 {
-    return retrySQLite<StorePathSet>([&]() {
-        auto state(_state.lock());
+    state.lastUseFlushed = time(0);
 
-        auto useQueryValidDerivers(state->stmtQueryValidDerivers.use()(printStorePath(path)));
+    if (state.pendingLastUse.empty()) return;
 
-        StorePathSet derivers;
-        while (useQueryValidDerivers.next())
-            derivers.insert(parseStorePath(useQueryValidDerivers.getStr(1)));
-
-        return derivers;
+    retrySQLite<void>([&]() {
+        SQLiteTxn txn(state.db);
+        for (auto & [path, time] : state.pendingLastUse)
+            state.stmtRegisterLastUse.use()
+                ((int64_t) time)
+                (pathKey(path))
+                .exec();
+        txn.commit();
     });
+
+    state.pendingLastUse.clear();
 }
 
 
-OutputPathMap LocalStore::queryDerivationOutputMap(const StorePath & path)
+std::unordered_map<std::string, time_t> LocalStore::queryLastUse()
 {
-    return retrySQLite<OutputPathMap>([&]() {
+    {
         auto state(_state.lock());
+        flushLastUse(*state);
+    }
 
-        auto useQueryDerivationOutputs(state->stmtQueryDerivationOutputs.use()
-            (queryValidPathId(*state, path)));
-
-        OutputPathMap outputs;
-        while (useQueryDerivationOutputs.next())
-            outputs.emplace(
-                useQueryDerivationOutputs.getStr(0),
-                parseStorePath(useQueryDerivationOutputs.getStr(1))
-            );
-
-        return outputs;
+    return retryQuery<std::unordered_map<std::string, time_t>>([&](DBConnection & conn) {
+        std::unordered_map<std::string, time_t> res;
+        SQLiteStmt stmt;
+        stmt.create(conn.db,
+            "select v.hashPart, v.name, coalesce(l.time, v.registrationTime) from ValidPaths v left join LastUse l on l.id = v.id;");
+        auto use(stmt.use());
+        while (use.next())
+            res.emplace(printStorePath(readPath(use, 0)), use.getInt(2));
+        return res;
     });
 }
 
 
-std::optional<StorePath> LocalStore::queryPathFromHashPart(const std::string & hashPart)
+LocalStore::ReferenceGraph LocalStore::queryReferenceGraph()
 {
-    if (hashPart.size() != StorePath::HashLen) throw Error("invalid hash part");
+    return retryQuery<ReferenceGraph>([&](DBConnection & conn) {
+        ReferenceGraph graph;
 
-    Path prefix = storeDir + "/" + hashPart;
+        /* Read all tables in one transaction, so that we get a
+           consistent snapshot. */
+        SQLiteTxn txn(conn.db);
 
-    return retrySQLite<std::optional<StorePath>>([&]() -> std::optional<StorePath> {
-        auto state(_state.lock());
+        std::unordered_map<int64_t, uint32_t> ids;
+        std::vector<std::string> derivers;
+
+        {
+            SQLiteStmt stmt;
+            stmt.create(conn.db, "select id, hashPart, name, deriver from ValidPaths order by id;");
+            auto use(stmt.use());
+            while (use.next()) {
+                uint32_t n = graph.paths.size();
+                ids.emplace(use.getInt(0), n);
+                graph.paths.push_back(printStorePath(readPath(use, 1)));
+                graph.index.emplace(graph.paths.back(), n);
+                derivers.push_back(use.isNull(3) ? "" : use.getStr(3));
+            }
+        }
 
-        auto useQueryPathFromHashPart(state->stmtQueryPathFromHashPart.use()(prefix));
+        auto n = graph.paths.size();
 
-        if (!useQueryPathFromHashPart.next()) return {};
+        graph.deriver.resize(n, ReferenceGraph::none);
+        for (size_t i = 0; i < n; ++i) {
+            auto j = graph.index.find(derivers[i]);
+            if (j != graph.index.end()) graph.deriver[i] = j->second;
+        }
+        derivers.clear();
 
-        const char * s = (const char *) sqlite3_column_text(state->stmtQueryPathFromHashPart, 0);
-        if (s && prefix.compare(0, prefix.size(), s, prefix.size()) == 0)
-            return parseStorePath(s);
-        return {};
+        /* Since both tables are scanned in the order of the
+           referrer's ID, which is also the order of the path numbers,
+           the rows can be appended directly. */
+        auto readEdges = [&](const std::string & query, bool pathColumn,
+            std::vector<uint32_t> & start, std::vector<uint32_t> & edges)
+        {
+            start.assign(n + 1, 0);
+            SQLiteStmt stmt;
+            stmt.create(conn.db, query);
+            auto use(stmt.use());
+            while (use.next()) {
+                auto from = ids.find(use.getInt(0));
+                if (from == ids.end()) continue;
+                uint32_t to;
+                if (pathColumn) {
+                    auto i = graph.index.find(use.getStr(1));
+                    if (i == graph.index.end()) continue;
+                    to = i->second;
+                } else {
+                    auto i = ids.find(use.getInt(1));
+                    if (i == ids.end()) continue;
+                    to = i->second;
+                }
+                start[from->second + 1]++;
+                edges.push_back(to);
+            }
+            for (size_t i = 0; i < n; ++i)
+                start[i + 1] += start[i];
+        };
+
+        readEdges("select referrer, reference from Refs order by referrer;",
+            false, graph.refStart, graph.refs);
+        readEdges("select drv, path from DerivationOutputs order by drv;",
+            true, graph.outputStart, graph.outputs);
+
+        txn.commit();
+
+        return graph;
     });
 }
 
 
-StorePathSet LocalStore::querySubstitutablePaths(const StorePathSet & paths)
+StorePathSet LocalStore::queryUnoptimisedPaths()
 {
-    if (!settings.useSubstitutes) return StorePathSet();
+    return retryQuery<StorePathSet>([&](DBConnection & conn) {
+        SQLiteStmt stmt;
+        stmt.create(conn.db,
+            "select hashPart, name from ValidPaths where id not in (select id from OptimisedPaths);");
+        auto use(stmt.use());
+        StorePathSet res;
+        while (use.next()) res.insert(readPath(use, 0));
+        return res;
+    });
+}
 
-    StorePathSet remaining;
+
+void LocalStore::registerOptimisedPath(const StorePath & path)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmtRegisterOptimisedPath.use()(pathKey(path)).exec();
+    });
+}
+
+
+uint64_t LocalStore::queryOptimiseQueueLength()
+{
+    return retryQuery<uint64_t>([&](DBConnection & conn) {
+        SQLiteStmt stmt;
+        stmt.create(conn.db, "select count(*) from PendingOptimisations;");
+        auto use(stmt.use());
+        return use.next() ? (uint64_t) use.getInt(0) : 0;
+    });
+}
+
+
+std::vector<StorePath> LocalStore::queryPendingOptimisations(size_t max)
+{
+    return retryQuery<std::vector<StorePath>>([&](DBConnection & conn) {
+        SQLiteStmt stmt;
+        stmt.create(conn.db,
+            "select v.hashPart, v.name from PendingOptimisations p join ValidPaths v on p.id = v.id order by p.id limit ?;");
+        auto use(stmt.use()((int64_t) max));
+        std::vector<StorePath> res;
+        while (use.next()) res.push_back(readPath(use, 0));
+        return res;
+    });
+}
+
+
+void LocalStore::finishOptimisation(const StorePath & path)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmtFinishOptimisation.use()(pathKey(path)).exec();
+    });
+}
+
+
+std::unordered_map<std::string, time_t> LocalStore::queryVerificationTimes()
+{
+    return retryQuery<std::unordered_map<std::string, time_t>>([&](DBConnection & conn) {
+        std::unordered_map<std::string, time_t> res;
+        SQLiteStmt stmt;
+        stmt.create(conn.db,
+            "select v.hashPart, v.name, p.time from ValidPaths v join VerifiedPaths p on p.id = v.id;");
+        auto use(stmt.use());
+        while (use.next())
+            res.emplace(printStorePath(readPath(use, 0)), use.getInt(2));
+        return res;
+    });
+}
+
+
+void LocalStore::registerVerifiedPath(const StorePath & path, time_t time)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmtRegisterVerifiedPath.use()(time)(pathKey(path)).exec();
+    });
+}
+
+
+void LocalStore::queryReferrers(DBConnection & conn, const StorePath & path, StorePathSet & referrers)
+{
+    auto useQueryReferrers(conn.stmtQueryReferrers.use()(pathKey(path)));
+
+    while (useQueryReferrers.next())
+        referrers.insert(readPath(useQueryReferrers, 0));
+}
+
+
+void LocalStore::queryReferrers(const StorePath & path, StorePathSet & referrers)
+{
+    return retryQuery<void>([&](DBConnection & conn) {
+        queryReferrers(conn, path, referrers);
+    });
+}
+
+
+StorePathSet LocalStore::queryValidDerivers(const StorePath & path)
+{
+    return retryQuery<StorePathSet>([&](DBConnection & conn) {
+        auto useQueryValidDerivers(conn.stmtQueryValidDerivers.use()(printStorePath(path)));
+
+        StorePathSet derivers;
+        while (useQueryValidDerivers.next())
+            derivers.insert(readPath(useQueryValidDerivers, 1));
+
+        return derivers;
+    });
+}
+
+
+OutputPathMap LocalStore::queryDerivationOutputMap(const StorePath & path)
+{
+    return retryQuery<OutputPathMap>([&](DBConnection & conn) {
+        auto useQueryDerivationOutputs(conn.stmtQueryDerivationOutputs.use()
+            (queryValidPathId(conn, path)));
+
+        OutputPathMap outputs;
+        while (useQueryDerivationOutputs.next())
+            outputs.emplace(
+                useQueryDerivationOutputs.getStr(0),
+                parseStorePath(useQueryDerivationOutputs.getStr(1))
+            );
+
+        return outputs;
+    });
+}
+
+
+std::optional<Hash> LocalStore::queryDrvHashModulo(const StorePath & drvPath)
+{
+    return retryQuery<std::optional<Hash>>([&](DBConnection & conn) -> std::optional<Hash> {
+        auto useQueryDrvHash(conn.stmtQueryDrvHash.use()(pathKey(drvPath)));
+
+        if (!useQueryDrvHash.next()) return {};
+
+        return Hash(useQueryDrvHash.getStr(0));
+    });
+}
+
+
+void LocalStore::registerDrvHashModulo(const StorePath & drvPath, const Hash & hash)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmtRegisterDrvHash.use()
+            (hash.to_string(Base16, true))
+            (pathKey(drvPath))
+            .exec();
+    });
+}
+
+
+std::pair<uint64_t, uint64_t> LocalStore::getClosureSize(const StorePath & storePath)
+{
+    auto cached = retryQuery<std::optional<uint64_t>>([&](DBConnection & conn) -> std::optional<uint64_t> {
+        auto useQueryClosureSize(conn.stmtQueryClosureSize.use()(pathKey(storePath)));
+        if (!useQueryClosureSize.next()) return {};
+        return useQueryClosureSize.getInt(0);
+    });
+    if (cached) return {*cached, 0};
+
+    StorePathSet closure;
+    computeFSClosure(storePath, closure);
+
+    uint64_t narSize = 0;
+    bool sizesKnown = true;
+    for (auto & path : closure) {
+        auto info = queryPathInfo(path);
+        narSize += info->narSize;
+        if (!info->narSize) sizesKnown = false;
+    }
+
+    /* Paths registered by old versions of Nix may lack a NAR size
+       until 'nix-store --verify' fills it in, which would make the
+       memoised size wrong. */
+    if (sizesKnown)
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+            state->stmtRegisterClosureSize.use()
+                (narSize)
+                (pathKey(storePath))
+                .exec();
+        });
+
+    return {narSize, 0};
+}
+
+
+std::optional<uint64_t> LocalStore::queryBuildTime(const std::string & name)
+{
+    return retryQuery<std::optional<uint64_t>>([&](DBConnection & conn) -> std::optional<uint64_t> {
+        auto useQueryBuildTime(conn.stmtQueryBuildTime.use()(name));
+        if (!useQueryBuildTime.next()) return {};
+        return useQueryBuildTime.getInt(0);
+    });
+}
+
+
+void LocalStore::recordBuildTime(const std::string & name, uint64_t duration)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmtRegisterBuildTime.use()
+            (name)
+            (duration)
+            .exec();
+    });
+}
+
+
+std::optional<uint64_t> LocalStore::queryOutputSize(const std::string & name)
+{
+    return retryQuery<std::optional<uint64_t>>([&](DBConnection & conn) -> std::optional<uint64_t> {
+        auto useQueryOutputSize(conn.stmtQueryOutputSize.use()(name));
+        if (!useQueryOutputSize.next()) return {};
+        return useQueryOutputSize.getInt(0);
+    });
+}
+
+
+void LocalStore::recordOutputSize(const std::string & name, uint64_t size)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmtRegisterOutputSize.use()
+            (name)
+            (size)
+            .exec();
+    });
+}
+
+
+std::optional<BuildResult::Status> LocalStore::queryFailedBuild(const StorePath & drvPath)
+{
+    return retryQuery<std::optional<BuildResult::Status>>([&](DBConnection & conn) -> std::optional<BuildResult::Status> {
+        auto useQueryFailedBuild(conn.stmtQueryFailedBuild.use()(pathKey(drvPath)));
+        if (!useQueryFailedBuild.next()) return {};
+        return (BuildResult::Status) useQueryFailedBuild.getInt(0);
+    });
+}
+
+
+void LocalStore::recordFailedBuild(const StorePath & drvPath, BuildResult::Status status)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmtRegisterFailedBuild.use()
+            ((int64_t) status)
+            (time(0))
+            (pathKey(drvPath))
+            .exec();
+    });
+}
+
+
+StorePathSet LocalStore::queryFailedPaths()
+{
+    return retryQuery<StorePathSet>([&](DBConnection & conn) {
+        auto use(conn.stmtQueryFailedBuilds.use());
+        StorePathSet res;
+        while (use.next()) res.insert(readPath(use, 0));
+        return res;
+    });
+}
+
+
+void LocalStore::clearFailedPaths(const StorePathSet & paths)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        SQLiteTxn txn(state->db);
+        if (paths.empty())
+            state->db.exec("delete from FailedBuilds");
+        else
+            for (auto & path : paths)
+                state->stmtClearFailedBuild.use()(pathKey(path)).exec();
+        txn.commit();
+    });
+}
+
+
+std::optional<StorePath> LocalStore::queryPathFromHashPart(const std::string & hashPart)
+{
+    if (hashPart.size() != StorePath::HashLen) throw Error("invalid hash part");
+
+    SQLiteBlob key;
+    try {
+        key = pathKey(hashPart);
+    } catch (BadHash &) {
+        return {};
+    }
+
+    return retryQuery<std::optional<StorePath>>([&](DBConnection & conn) -> std::optional<StorePath> {
+        auto useQueryPathFromHashPart(conn.stmtQueryPathFromHashPart.use()(key));
+
+        if (!useQueryPathFromHashPart.next()) return {};
+
+        return readPath(useQueryPathFromHashPart, 0);
+    });
+}
+
+
+StorePathSet LocalStore::querySubstitutablePaths(const StorePathSet & paths)
+{
+    if (!settings.useSubstitutes) return StorePathSet();
+
+    StorePathSet remaining;
     for (auto & i : paths)
         remaining.insert(i);
 
@@ -850,28 +1814,99 @@ void LocalStore::querySubstitutablePathInfos(const StorePathSet & paths,
     SubstitutablePathInfos & infos)
 {
     if (!settings.useSubstitutes) return;
-    for (auto & sub : getDefaultSubstituters()) {
-        if (sub->storeDir != storeDir) continue;
-        for (auto & path : paths) {
-            if (infos.count(path)) continue;
-            debug("checking substituter '%s' for path '%s'", sub->getUri(), printStorePath(path));
-            try {
-                auto info = sub->queryPathInfo(path);
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-                    std::shared_ptr<const ValidPathInfo>(info));
-                infos.insert_or_assign(path, SubstitutablePathInfo{
-                    info->deriver,
-                    info->references,
-                    narInfo ? narInfo->fileSize : 0,
-                    info->narSize});
-            } catch (InvalidPath &) {
-            } catch (SubstituterDisabled &) {
-            } catch (Error & e) {
-                if (settings.tryFallback)
-                    logError(e.info());
-                else
-                    throw;
+
+    std::vector<ref<Store>> subs;
+    for (auto & sub : getDefaultSubstituters())
+        if (sub->storeDir == storeDir) subs.push_back(sub);
+
+    /* Ask all substituters about all paths concurrently. For each
+       path, the answer of the highest-priority substituter that has
+       it wins, so we only have to wait until that one and all
+       substituters before it have answered. Queries that are still
+       in flight after that are abandoned; their callbacks only touch
+       `shared'. */
+    struct Result
+    {
+        bool done = false;
+        std::shared_ptr<const ValidPathInfo> info;
+        std::exception_ptr exc;
+    };
+
+    struct Shared
+    {
+        Sync<std::map<StorePath, std::vector<Result>>> results;
+        std::condition_variable wakeup;
+    };
+
+    auto shared = std::make_shared<Shared>();
+
+    std::vector<StorePath> todo;
+    for (auto & path : paths)
+        if (!infos.count(path)) {
+            todo.push_back(path);
+            shared->results.lock()->emplace(path, std::vector<Result>(subs.size()));
+        }
+
+    for (auto & path : todo)
+        for (size_t n = 0; n < subs.size(); ++n) {
+            debug("checking substituter '%s' for path '%s'", subs[n]->getUri(), printStorePath(path));
+            subs[n]->queryPathInfo(path,
+                {[shared, path, n](std::future<ref<const ValidPathInfo>> fut) {
+                    Result res;
+                    res.done = true;
+                    try {
+                        res.info = fut.get().get_ptr();
+                    } catch (...) {
+                        res.exc = std::current_exception();
+                    }
+                    shared->results.lock()->at(path)[n] = std::move(res);
+                    shared->wakeup.notify_one();
+                }});
+        }
+
+    /* Return the index of the substituter whose answer is
+       authoritative for a path, or -1 if we have to wait for more
+       answers. */
+    auto decide = [&](const std::vector<Result> & results) -> ssize_t {
+        for (size_t n = 0; n < results.size(); ++n) {
+            if (!results[n].done) return -1;
+            if (results[n].info) return n;
+        }
+        return results.size();
+    };
+
+    auto results(shared->results.lock());
+
+    for (auto & path : todo) {
+        ssize_t winner;
+        while ((winner = decide(results->at(path))) == -1)
+            results.wait(shared->wakeup);
+
+        auto & pathResults = results->at(path);
+
+        for (ssize_t n = 0; n <= winner && n < (ssize_t) subs.size(); ++n) {
+            auto & res = pathResults[n];
+
+            if (res.exc) {
+                try {
+                    std::rethrow_exception(res.exc);
+                } catch (InvalidPath &) {
+                } catch (SubstituterDisabled &) {
+                } catch (Error & e) {
+                    if (settings.tryFallback)
+                        logError(e.info());
+                    else
+                        throw;
+                }
+                continue;
             }
+
+            auto narInfo = std::dynamic_pointer_cast<const NarInfo>(res.info);
+            infos.insert_or_assign(path, SubstitutablePathInfo{
+                res.info->deriver,
+                res.info->references,
+                narInfo ? narInfo->fileSize : 0,
+                res.info->narSize});
         }
     }
 }
@@ -885,15 +1920,94 @@ void LocalStore::registerValidPath(const ValidPathInfo & info)
 }
 
 
+void LocalStore::syncStoreFS()
+{
+#if __linux__
+    AutoCloseFD fd = open(realStoreDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!fd)
+        throw SysError("opening directory '%s'", realStoreDir);
+    if (syncfs(fd.get()) == -1)
+        throw SysError("syncing the file system of '%s'", realStoreDir);
+#else
+    sync();
+#endif
+}
+
+
 void LocalStore::registerValidPaths(const ValidPathInfos & infos)
 {
     /* SQLite will fsync by default, but the new valid paths may not
        be fsync-ed.  So some may want to fsync them before registering
        the validity, at the expense of some speed of the path
        registering operation. */
-    if (settings.syncBeforeRegistering) sync();
+    if (!settings.syncBeforeRegistering) {
+        registerValidPaths_(infos);
+        return;
+    }
+
+    /* To keep that cost down, calls from concurrent threads (such as
+       the substitutions of a build) are grouped: whoever finds no
+       group being committed takes all pending registrations, syncs
+       the file system once and registers them in one transaction,
+       while the others wait for it. */
+    Registration registration(infos);
+
+    std::vector<Registration *> group;
+
+    {
+        auto regs(registrations.lock());
+        regs->pending.push_back(&registration);
+        while (regs->committing && !registration.done)
+            regs.wait(registrationsDone);
+        if (registration.done) {
+            if (registration.exc) std::rethrow_exception(registration.exc);
+            return;
+        }
+        regs->committing = true;
+        group = std::move(regs->pending);
+        regs->pending.clear();
+    }
+
+    try {
+        syncStoreFS();
+
+        ValidPathInfos all;
+        for (auto & r : group)
+            all.insert(all.end(), r->infos.begin(), r->infos.end());
+
+        try {
+            registerValidPaths_(all);
+        } catch (Error &) {
+            if (group.size() == 1) throw;
+            /* Don't let an invalid registration fail the others. */
+            for (auto & r : group)
+                try {
+                    registerValidPaths_(r->infos);
+                } catch (...) {
+                    r->exc = std::current_exception();
+                }
+        }
+    } catch (...) {
+        for (auto & r : group)
+            if (!r->exc) r->exc = std::current_exception();
+    }
+
+    {
+        auto regs(registrations.lock());
+        for (auto & r : group) r->done = true;
+        regs->committing = false;
+    }
+    registrationsDone.notify_all();
 
-    return retrySQLite<void>([&]() {
+    if (registration.exc) std::rethrow_exception(registration.exc);
+}
+
+
+void LocalStore::registerValidPaths_(const ValidPathInfos & infos)
+{
+    bool queued = false;
+
+    retrySQLite<void>([&]() {
         auto state(_state.lock());
 
         SQLiteTxn txn(state->db);
@@ -908,6 +2022,16 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
             paths.insert(i.path);
         }
 
+        /* Queue the paths that optimisePath() left to the background
+           optimiser in the same transaction, so that none are lost
+           if we crash after registering them. */
+        queued = false;
+        for (auto & i : infos)
+            if (state->toOptimise.count(std::string(i.path.to_string()))) {
+                state->stmtQueueOptimisation.use()(pathKey(i.path)).exec();
+                queued = true;
+            }
+
         for (auto & i : infos) {
             auto referrer = queryValidPathId(*state, i.path);
             for (auto & j : i.references)
@@ -930,7 +2054,14 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
         topoSortPaths(paths);
 
         txn.commit();
+
+        for (auto & i : infos)
+            state->toOptimise.erase(std::string(i.path.to_string()));
+
+        invalidateSharedPathInfoCache(*state);
     });
+
+    if (queued) startOptimiser();
 }
 
 
@@ -940,15 +2071,14 @@ void LocalStore::invalidatePath(State & state, const StorePath & path)
 {
     debug("invalidating path '%s'", printStorePath(path));
 
-    state.stmtInvalidatePath.use()(printStorePath(path)).exec();
+    state.stmtInvalidatePath.use()(pathKey(path)).exec();
+
+    state.pathInfoChanged = true;
 
     /* Note that the foreign key constraints on the Refs table take
        care of deleting the references entries for `path'. */
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.erase(std::string(path.hashPart()));
-    }
+    pathInfoCache.erase(std::string(path.hashPart()));
 }
 
 
@@ -961,14 +2091,63 @@ const PublicKeys & LocalStore::getPublicKeys()
 }
 
 
-void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
-    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+void LocalStore::checkImport(const ValidPathInfo & info, CheckSigsFlag checkSigs)
 {
     if (!info.narHash)
         throw Error("cannot add path '%s' because it lacks a hash", printStorePath(info.path));
 
     if (requireSigs && checkSigs && !info.checkSignatures(*this, getPublicKeys()))
         throw Error("cannot add path '%s' because it lacks a valid signature", printStorePath(info.path));
+}
+
+
+void LocalStore::restoreNar(const ValidPathInfo & info, const Path & realPath, Source & source)
+{
+    deletePath(realPath);
+
+    // text hashing has long been allowed to have non-self-references because it is used for drv files.
+    bool refersToSelf = info.references.count(info.path) > 0;
+    if (info.ca.has_value() && !info.references.empty() && !(std::holds_alternative<TextHash>(*info.ca) && !refersToSelf))
+        settings.requireExperimentalFeature("ca-references");
+
+    /* While restoring the path from the NAR, compute the hash
+       of the NAR. */
+    std::unique_ptr<AbstractHashSink> hashSink;
+    if (!info.ca.has_value() || !info.references.count(info.path))
+        hashSink = std::make_unique<HashSink>(htSHA256);
+    else
+        hashSink = std::make_unique<HashModuloSink>(htSHA256, std::string(info.path.hashPart()));
+
+    LambdaSource wrapperSource([&](unsigned char * data, size_t len) -> size_t {
+        size_t n = source.read(data, len);
+        (*hashSink)(data, n);
+        return n;
+    });
+
+    restorePath(realPath, wrapperSource);
+
+    auto hashResult = hashSink->finish();
+
+    if (hashResult.first != info.narHash)
+        throw Error("hash mismatch importing path '%s';\n  wanted: %s\n  got:    %s",
+            printStorePath(info.path), info.narHash.to_string(Base32, true), hashResult.first.to_string(Base32, true));
+
+    if (hashResult.second != info.narSize)
+        throw Error("size mismatch importing path '%s';\n  wanted: %s\n  got:   %s",
+            printStorePath(info.path), info.narSize, hashResult.second);
+
+    autoGC();
+
+    canonicalisePathMetaData(realPath, -1);
+
+    optimisePath(realPath); // FIXME: combine with hashPath()
+}
+
+
+void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
+    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+{
+    checkImport(info, checkSigs);
 
     addTempRoot(info.path);
 
@@ -985,51 +2164,177 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
             outputLock.lockPaths({realPath});
 
         if (repair || !isValidPath(info.path)) {
+            restoreNar(info, realPath, source);
+            registerValidPath(info);
+        }
 
-            deletePath(realPath);
+        outputLock.setDeletion(true);
+    }
+}
 
-            // text hashing has long been allowed to have non-self-references because it is used for drv files.
-            bool refersToSelf = info.references.count(info.path) > 0;
-            if (info.ca.has_value() && !info.references.empty() && !(std::holds_alternative<TextHash>(*info.ca) && !refersToSelf))
-                settings.requireExperimentalFeature("ca-references");
 
-            /* While restoring the path from the NAR, compute the hash
-               of the NAR. */
-            std::unique_ptr<AbstractHashSink> hashSink;
-            if (!info.ca.has_value() || !info.references.count(info.path))
-                hashSink = std::make_unique<HashSink>(htSHA256);
-            else
-                hashSink = std::make_unique<HashModuloSink>(htSHA256, std::string(info.path.hashPart()));
+/* Recreate the file system object `from' at `to', cloning regular
+   files. */
+static void cloneTree(const Path & from, const Path & to)
+{
+    checkInterrupt();
 
-            LambdaSource wrapperSource([&](unsigned char * data, size_t len) -> size_t {
-                size_t n = source.read(data, len);
-                (*hashSink)(data, n);
-                return n;
-            });
+    auto st = lstat(from);
+
+    if (S_ISREG(st.st_mode))
+        copyFileFast(from, to, st.st_mode & 0777);
+
+    else if (S_ISDIR(st.st_mode)) {
+        if (mkdir(to.c_str(), 0755) == -1)
+            throw SysError("creating directory '%1%'", to);
+        for (auto & i : readDirectory(from))
+            cloneTree(from + "/" + i.name, to + "/" + i.name);
+    }
+
+    else if (S_ISLNK(st.st_mode))
+        createSymlink(readLink(from), to);
+
+    else
+        throw Error("file '%1%' has an unsupported type", from);
+}
+
+
+bool LocalStore::addToStoreFrom(Store & srcStore, const ValidPathInfo & info,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    auto srcFSStore = dynamic_cast<LocalFSStore *>(&srcStore);
+    if (!srcFSStore || srcFSStore == this || srcStore.storeDir != storeDir) return false;
+
+    /* restoreNar() applies some checks to content-addressed paths
+       with references; leave them to it. */
+    if (info.ca && !info.references.empty()) return false;
+
+    Path srcPath = srcFSStore->getRealStoreDir() + "/" + std::string(info.path.to_string());
+
+    /* Cloning only pays off on the same file system. */
+    struct stat srcSt, dstSt;
+    if (lstat(srcPath.c_str(), &srcSt) == -1 || stat(realStoreDir.c_str(), &dstSt) == -1
+        || srcSt.st_dev != dstSt.st_dev)
+        return false;
+
+    checkImport(info, checkSigs);
+
+    addTempRoot(info.path);
+
+    /* Keep the source from being garbage-collected while we read it. */
+    srcStore.addTempRoot(info.path);
+
+    if (repair || !isValidPath(info.path)) {
+
+        PathLocks outputLock;
 
-            restorePath(realPath, wrapperSource);
+        Path realPath = realStoreDir + "/" + std::string(info.path.to_string());
 
-            auto hashResult = hashSink->finish();
+        if (!locksHeld.count(printStorePath(info.path)))
+            outputLock.lockPaths({realPath});
 
-            if (hashResult.first != info.narHash)
-                throw Error("hash mismatch importing path '%s';\n  wanted: %s\n  got:    %s",
-                    printStorePath(info.path), info.narHash.to_string(Base32, true), hashResult.first.to_string(Base32, true));
+        if (repair || !isValidPath(info.path)) {
+            debug("cloning '%s' from '%s'", printStorePath(info.path), srcStore.getUri());
+
+            deletePath(realPath);
 
-            if (hashResult.second != info.narSize)
-                throw Error("size mismatch importing path '%s';\n  wanted: %s\n  got:   %s",
-                    printStorePath(info.path), info.narSize, hashResult.second);
+            /* The NAR hash and size are taken from the source store's
+               database rather than recomputed. */
+            cloneTree(srcPath, realPath);
 
             autoGC();
 
             canonicalisePathMetaData(realPath, -1);
 
-            optimisePath(realPath); // FIXME: combine with hashPath()
+            optimisePath(realPath);
 
             registerValidPath(info);
         }
 
         outputLock.setDeletion(true);
     }
+
+    return true;
+}
+
+
+std::unique_ptr<Store::PathImporter> LocalStore::beginImport(
+    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+{
+    /* Restore the imported paths and register them in batches of at
+       most `import-batch-size' paths, each in one transaction. Since
+       the paths arrive in topological order, their references are
+       either valid already or in the same batch, so
+       registerValidPaths() can check them. A restored path only
+       becomes valid once its batch is committed, so after a crash it
+       is at worst an invalid path that the garbage collector
+       removes. Each unregistered path holds its lock file open. */
+    struct Importer : PathImporter
+    {
+        LocalStore & store;
+        RepairFlag repair;
+        CheckSigsFlag checkSigs;
+
+        ValidPathInfos batch;
+        std::vector<std::unique_ptr<PathLocks>> locks;
+
+        Importer(LocalStore & store, RepairFlag repair, CheckSigsFlag checkSigs)
+            : store(store), repair(repair), checkSigs(checkSigs)
+        { }
+
+        void add(const ValidPathInfo & info, Source & source) override
+        {
+            store.checkImport(info, checkSigs);
+
+            store.addTempRoot(info.path);
+
+            Path realPath = store.realStoreDir + "/" + std::string(info.path.to_string());
+
+            /* Don't wait for a lock while holding the locks of the
+               current batch, since other processes may acquire them
+               in a different order. */
+            auto lock = std::make_unique<PathLocks>();
+            if (!store.locksHeld.count(store.printStorePath(info.path))
+                && !lock->lockPaths({realPath}, "", false))
+            {
+                finish();
+                lock->lockPaths({realPath});
+            }
+
+            if (repair || !store.isValidPath(info.path)) {
+                store.restoreNar(info, realPath, source);
+                batch.push_back(info);
+                locks.push_back(std::move(lock));
+                if (batch.size() >= std::max((size_t) 1, settings.importBatchSize.get())) finish();
+            } else {
+                ParseSink sink;
+                parseDump(sink, source);
+                lock->setDeletion(true);
+            }
+        }
+
+        void finish() override
+        {
+            if (!batch.empty()) {
+                /* Make sure the new store directory entries are on
+                   disk before the database says they're valid. A
+                   single fsync() of the store directory covers the
+                   whole batch, unless registerValidPaths() syncs
+                   the whole file system anyway. */
+                if (settings.fsyncMetadata && !settings.syncBeforeRegistering) {
+                    AutoCloseFD fd = open(store.realStoreDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                    if (fd && fsync(fd.get()) == -1)
+                        throw SysError("syncing directory '%s'", store.realStoreDir);
+                }
+                store.registerValidPaths(batch);
+            }
+            for (auto & lock : locks) lock->setDeletion(true);
+            batch.clear();
+            locks.clear();
+        }
+    };
+
+    return std::make_unique<Importer>(*this, repair, checkSigs);
 }
 
 
@@ -1157,6 +2462,62 @@ StorePath LocalStore::addTextToStore(const string & name, const string & s,
 }
 
 
+void LocalStore::addTextsToStore(const std::vector<StoreText> & texts,
+    RepairFlag repair)
+{
+    /* Write all files while holding their locks, then register them
+       in a single transaction. */
+    std::list<PathLocks> outputLocks;
+    ValidPathInfos infos;
+    StorePathSet seen;
+
+    autoGC();
+
+    for (auto & text : texts) {
+        auto hash = hashString(htSHA256, text.contents);
+        auto dstPath = makeTextPath(text.name, hash, text.references);
+
+        addTempRoot(dstPath);
+
+        if (!seen.insert(dstPath).second) continue;
+
+        if (!repair && isValidPath(dstPath)) continue;
+
+        Path realPath = realStoreDir + "/";
+        realPath += dstPath.to_string();
+
+        outputLocks.emplace_back(PathSet{realPath});
+
+        if (!repair && isValidPath(dstPath)) continue;
+
+        deletePath(realPath);
+
+        writeFile(realPath, text.contents);
+
+        canonicalisePathMetaData(realPath, -1);
+
+        StringSink sink;
+        dumpString(text.contents, sink);
+        auto narHash = hashString(htSHA256, *sink.s);
+
+        optimisePath(realPath);
+
+        ValidPathInfo info(dstPath);
+        info.narHash = narHash;
+        info.narSize = sink.s->size();
+        info.references = text.references;
+        info.ca = TextHash { .hash = hash };
+        infos.push_back(std::move(info));
+    }
+
+    if (!infos.empty())
+        registerValidPaths(infos);
+
+    for (auto & lock : outputLocks)
+        lock.setDeletion(true);
+}
+
+
 /* Create a temporary directory in the store that won't be
    garbage-collected. */
 Path LocalStore::createTempDirInStore()
@@ -1174,13 +2535,20 @@ Path LocalStore::createTempDirInStore()
 
 
 void LocalStore::invalidatePathChecked(const StorePath & path)
+{
+    invalidatePathsChecked({path});
+}
+
+
+void LocalStore::invalidatePathsChecked(const std::vector<StorePath> & paths)
 {
     retrySQLite<void>([&]() {
         auto state(_state.lock());
 
         SQLiteTxn txn(state->db);
 
-        if (isValidPath_(*state, path)) {
+        for (auto & path : paths) {
+            if (!isValidPath_(*state, path)) continue;
             StorePathSet referrers; queryReferrers(*state, path, referrers);
             referrers.erase(path); /* ignore self-references */
             if (!referrers.empty())
@@ -1190,6 +2558,8 @@ void LocalStore::invalidatePathChecked(const StorePath & path)
         }
 
         txn.commit();
+
+        invalidateSharedPathInfoCache(*state);
     });
 }
 
@@ -1221,92 +2591,167 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
     /* Optionally, check the content hashes (slow). */
     if (checkContents) {
 
+        std::atomic<bool> errors_{errors};
+
         printInfo("checking link hashes...");
 
-        for (auto & link : readDirectory(linksDir)) {
-            printMsg(lvlTalkative, "checking contents of '%s'", link.name);
-            Path linkPath = linksDir + "/" + link.name;
-            string hash = hashPath(htSHA256, linkPath).first.to_string(Base32, false);
-            if (hash != link.name) {
-                logError({
-                    .name = "Invalid hash",
-                    .hint = hintfmt(
-                        "link '%s' was modified! expected hash '%s', got '%s'",
-                        linkPath, link.name, hash)
-                });
-                if (repair) {
-                    if (unlink(linkPath.c_str()) == 0)
-                        printInfo("removed link '%s'", linkPath);
-                    else
-                        throw SysError("removing corrupt link '%s'", linkPath);
-                } else {
-                    errors = true;
+        {
+            std::vector<std::string> names;
+            std::vector<Path> linkPaths;
+            for (auto & link : readDirectory(linksDir)) {
+                names.push_back(link.name);
+                linkPaths.push_back(linksDir + "/" + link.name);
+            }
+
+            auto hashes = hashPaths(htSHA256, linkPaths);
+
+            for (size_t n = 0; n < names.size(); n++) {
+                auto & linkPath = linkPaths[n];
+                string hash = hashes[n].first.to_string(Base32, false);
+                if (hash != names[n]) {
+                    logError({
+                        .name = "Invalid hash",
+                        .hint = hintfmt(
+                            "link '%s' was modified! expected hash '%s', got '%s'",
+                            linkPath, names[n], hash)
+                    });
+                    if (repair) {
+                        if (unlink(linkPath.c_str()) == 0)
+                            printInfo("removed link '%s'", linkPath);
+                        else
+                            throw SysError("removing corrupt link '%s'", linkPath);
+                    } else {
+                        errors_ = true;
+                    }
                 }
             }
         }
 
         printInfo("checking store hashes...");
 
-        Hash nullHash(htSHA256);
+        /* Check the paths that were verified least recently first,
+           so that runs limited by `verify-time-budget' eventually
+           cover the whole store. */
+        auto verified = queryVerificationTimes();
+        time_t now = time(0);
 
+        std::vector<std::pair<time_t, StorePath>> todo;
         for (auto & i : validPaths) {
-            try {
-                auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
+            auto j = verified.find(printStorePath(i));
+            auto lastVerified = j == verified.end() ? 0 : j->second;
+            if (settings.verifyMaxAge && lastVerified && now - lastVerified < (time_t) settings.verifyMaxAge.get())
+                continue;
+            todo.emplace_back(lastVerified, i);
+        }
+        std::stable_sort(todo.begin(), todo.end(),
+            [](auto & a, auto & b) { return a.first < b.first; });
 
-                /* Check the content hash (optionally - slow). */
-                printMsg(lvlTalkative, "checking contents of '%s'", printStorePath(i));
+        if (todo.size() != validPaths.size())
+            printInfo("skipping %d paths that were verified recently", validPaths.size() - todo.size());
 
-                std::unique_ptr<AbstractHashSink> hashSink;
-                if (!info->ca || !info->references.count(info->path))
-                    hashSink = std::make_unique<HashSink>(*info->narHash.type);
-                else
-                    hashSink = std::make_unique<HashModuloSink>(*info->narHash.type, std::string(info->path.hashPart()));
+        Activity act(*logger, actVerifyPaths);
 
-                dumpPath(Store::toRealPath(i), *hashSink);
-                auto current = hashSink->finish();
+        Hash nullHash(htSHA256);
 
-                if (info->narHash != nullHash && info->narHash != current.first) {
-                    logError({
-                        .name = "Invalid hash - path modified",
-                        .hint = hintfmt("path '%s' was modified! expected hash '%s', got '%s'",
-                        printStorePath(i), info->narHash.to_string(Base32, true), current.first.to_string(Base32, true))
-                    });
-                    if (repair) repairPath(i); else errors = true;
-                } else {
+        auto deadline = settings.verifyTimeBudget
+            ? std::optional(std::chrono::steady_clock::now() + std::chrono::seconds(settings.verifyTimeBudget.get()))
+            : std::nullopt;
 
-                    bool update = false;
+        std::atomic<size_t> done{0}, failed{0}, active{0}, skipped{0};
+        Sync<StorePathSet> toRepair;
 
-                    /* Fill in missing hashes. */
-                    if (info->narHash == nullHash) {
-                        printInfo("fixing missing hash on '%s'", printStorePath(i));
-                        info->narHash = current.first;
-                        update = true;
-                    }
+        auto showProgress = [&]() {
+            act.progress(done, todo.size(), active, failed);
+        };
 
-                    /* Fill in missing narSize fields (from old stores). */
-                    if (info->narSize == 0) {
-                        printInfo("updating size field on '%s' to %s", printStorePath(i), current.second);
-                        info->narSize = current.second;
-                        update = true;
-                    }
+        ThreadPool pool;
+
+        for (auto & i : todo)
+            pool.enqueue([&, path(i.second)]() {
+                if (deadline && std::chrono::steady_clock::now() >= *deadline) {
+                    skipped++;
+                    return;
+                }
+
+                MaintainCount<std::atomic<size_t>> mcActive(active);
+                showProgress();
+
+                try {
+                    auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(path)));
 
-                    if (update) {
-                        auto state(_state.lock());
-                        updatePathInfo(*state, *info);
+                    /* Check the content hash (optionally - slow). */
+                    printMsg(lvlTalkative, "checking contents of '%s'", printStorePath(path));
+
+                    std::unique_ptr<AbstractHashSink> hashSink;
+                    if (!info->ca || !info->references.count(info->path))
+                        hashSink = std::make_unique<HashSink>(*info->narHash.type);
+                    else
+                        hashSink = std::make_unique<HashModuloSink>(*info->narHash.type, std::string(info->path.hashPart()));
+
+                    dumpPath(Store::toRealPath(path), *hashSink);
+                    auto current = hashSink->finish();
+
+                    if (info->narHash != nullHash && info->narHash != current.first) {
+                        logError({
+                            .name = "Invalid hash - path modified",
+                            .hint = hintfmt("path '%s' was modified! expected hash '%s', got '%s'",
+                            printStorePath(path), info->narHash.to_string(Base32, true), current.first.to_string(Base32, true))
+                        });
+                        failed++;
+                        if (repair) toRepair.lock()->insert(path); else errors_ = true;
+                    } else {
+
+                        bool update = false;
+
+                        /* Fill in missing hashes. */
+                        if (info->narHash == nullHash) {
+                            printInfo("fixing missing hash on '%s'", printStorePath(path));
+                            info->narHash = current.first;
+                            update = true;
+                        }
+
+                        /* Fill in missing narSize fields (from old stores). */
+                        if (info->narSize == 0) {
+                            printInfo("updating size field on '%s' to %s", printStorePath(path), current.second);
+                            info->narSize = current.second;
+                            update = true;
+                        }
+
+                        if (update) {
+                            auto state(_state.lock());
+                            updatePathInfo(*state, *info);
+                            invalidateSharedPathInfoCache(*state);
+                        }
+
+                        registerVerifiedPath(path, now);
                     }
 
+                } catch (Error & e) {
+                    /* It's possible that the path got GC'ed, so ignore
+                       errors on invalid paths. */
+                    if (isValidPath(path))
+                        logError(e.info());
+                    else
+                        warn(e.msg());
+                    failed++;
+                    errors_ = true;
                 }
 
-            } catch (Error & e) {
-                /* It's possible that the path got GC'ed, so ignore
-                   errors on invalid paths. */
-                if (isValidPath(i))
-                    logError(e.info());
-                else
-                    warn(e.msg());
-                errors = true;
-            }
-        }
+                done++;
+                showProgress();
+            });
+
+        pool.process();
+
+        if (skipped)
+            printInfo("%d paths were not checked because 'verify-time-budget' was exceeded", skipped);
+
+        /* Repair paths one at a time, since each repair runs its own
+           build. */
+        for (auto & path : *toRepair.lock())
+            repairPath(path);
+
+        errors = errors_;
     }
 
     return errors;
@@ -1346,6 +2791,7 @@ void LocalStore::verifyPath(const Path & pathS, const StringSet & store,
             printInfo("path '%s' disappeared, removing from database...", pathS);
             auto state(_state.lock());
             invalidatePath(*state, path);
+            invalidateSharedPathInfoCache(*state);
         } else {
             logError({
                 .name = "Missing path with referrers",
@@ -1447,6 +2893,8 @@ void LocalStore::addSignatures(const StorePath & storePath, const StringSet & si
         updatePathInfo(*state, *info);
 
         txn.commit();
+
+        invalidateSharedPathInfoCache(*state);
     });
 }
 
@@ -1,15 +1,21 @@
 #pragma once
 
 #include "sqlite.hh"
+#include "archive.hh"
+#include "shared-path-info-cache.hh"
 
 #include "pathlocks.hh"
+#include "pool.hh"
 #include "store-api.hh"
 #include "sync.hh"
 #include "util.hh"
 
 #include <chrono>
+#include <condition_variable>
 #include <future>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 
 
@@ -19,16 +25,50 @@ namespace nix {
 /* Nix store and database schema version.  Version 1 (or 0) was Nix <=
    0.7.  Version 2 was Nix 0.8 and 0.9.  Version 3 is Nix 0.10.
    Version 4 is Nix 0.11.  Version 5 is Nix 0.12-0.16.  Version 6 is
-   Nix 1.0.  Version 7 is Nix 1.3. Version 10 is 2.0. */
-const int nixSchemaVersion = 10;
+   Nix 1.0.  Version 7 is Nix 1.3. Version 10 is 2.0. Version 11 keys
+   ValidPaths by the binary hash part rather than by the path. */
+const int nixSchemaVersion = 11;
 
 
 struct Derivation;
 
 
+/* The hashes that optimisePath_() uses to find identical files,
+   i.e. those of the NAR serialisations of the individual regular
+   files and symlinks of a path, keyed by their absolute path. */
+typedef std::map<Path, Hash> FileHashes;
+
+
+/* A ParseSink that computes the FileHashes of the files in a NAR, so
+   that they can be obtained in the same pass as the NAR hash. */
+struct FileHashesSink : ParseSink
+{
+    FileHashes hashes;
+
+    FileHashesSink(const Path & root) : root(root) { }
+
+    void createRegularFile(const Path & path) override;
+    void isExecutable() override;
+    void preallocateContents(unsigned long long size) override;
+    void receiveContents(unsigned char * data, unsigned int len) override;
+    void createSymlink(const Path & path, const string & target) override;
+
+private:
+    Path root, current;
+    bool executable = false;
+    unsigned long long size = 0, left = 0;
+    std::unique_ptr<HashSink> sink;
+
+    void finishFile();
+};
+
+
 struct OptimiseStats
 {
     unsigned long filesLinked = 0;
+    /* Files that were deduplicated by sharing extents
+       (optimise-method = reflink) rather than by hard-linking. */
+    unsigned long filesReflinked = 0;
     unsigned long long bytesFreed = 0;
     unsigned long long blocksFreed = 0;
 };
@@ -41,24 +81,55 @@ private:
     /* Lock file used for upgrading. */
     AutoCloseFD globalLock;
 
-    struct State
+    /* A database connection with the statements needed by read-only
+       queries. */
+    struct DBConnection
     {
         /* The SQLite database object. */
         SQLite db;
 
-        /* Some precompiled SQLite statements. */
-        SQLiteStmt stmtRegisterValidPath;
-        SQLiteStmt stmtUpdatePathInfo;
-        SQLiteStmt stmtAddReference;
         SQLiteStmt stmtQueryPathInfo;
         SQLiteStmt stmtQueryReferences;
         SQLiteStmt stmtQueryReferrers;
-        SQLiteStmt stmtInvalidatePath;
-        SQLiteStmt stmtAddDerivationOutput;
         SQLiteStmt stmtQueryValidDerivers;
         SQLiteStmt stmtQueryDerivationOutputs;
         SQLiteStmt stmtQueryPathFromHashPart;
         SQLiteStmt stmtQueryValidPaths;
+        SQLiteStmt stmtQueryDrvHash;
+        SQLiteStmt stmtQueryClosureSize;
+        SQLiteStmt stmtQueryBuildTime;
+        SQLiteStmt stmtQueryOutputSize;
+        SQLiteStmt stmtQueryFailedBuild;
+        SQLiteStmt stmtQueryFailedBuilds;
+
+        /* Statements that take a batch of paths or IDs. */
+        SQLiteStmt stmtQueryValidPathsIn;
+        SQLiteStmt stmtQueryPathInfos;
+        SQLiteStmt stmtQueryReferencesOf;
+        SQLiteStmt stmtQueryClosureInfos;
+
+        void prepareQueries();
+    };
+
+    struct State : DBConnection
+    {
+        /* Some precompiled SQLite statements. */
+        SQLiteStmt stmtRegisterValidPath;
+        SQLiteStmt stmtUpdatePathInfo;
+        SQLiteStmt stmtAddReference;
+        SQLiteStmt stmtInvalidatePath;
+        SQLiteStmt stmtAddDerivationOutput;
+        SQLiteStmt stmtRegisterDrvHash;
+        SQLiteStmt stmtRegisterClosureSize;
+        SQLiteStmt stmtRegisterBuildTime;
+        SQLiteStmt stmtRegisterOutputSize;
+        SQLiteStmt stmtRegisterLastUse;
+        SQLiteStmt stmtRegisterOptimisedPath;
+        SQLiteStmt stmtQueueOptimisation;
+        SQLiteStmt stmtFinishOptimisation;
+        SQLiteStmt stmtRegisterVerifiedPath;
+        SQLiteStmt stmtRegisterFailedBuild;
+        SQLiteStmt stmtClearFailedBuild;
 
         /* The file to which we write our temporary roots. */
         AutoCloseFD fdTempRoots;
@@ -79,10 +150,86 @@ private:
         uint64_t availAfterGC = std::numeric_limits<uint64_t>::max();
 
         std::unique_ptr<PublicKeys> publicKeys;
+
+        /* Whether the info of a valid path has been changed or deleted
+           since the shared path info cache was last invalidated. */
+        bool pathInfoChanged = false;
+
+        /* Paths used since the last-use times were last written to
+           the database, and when that was. */
+        std::map<StorePath, time_t> pendingLastUse;
+        time_t lastUseFlushed = time(0);
+
+        /* The names of the paths that optimisePath() left to the
+           background optimiser, which are queued in the database
+           once they are registered. */
+        StringSet toOptimise;
+
+        /* Whether the background optimiser is running, and whether
+           paths were queued since it last looked. */
+        bool optimiserRunning = false;
+        bool optimiserWakeup = false;
     };
 
     Sync<State, std::recursive_mutex> _state;
 
+    /* Additional read-only connections, so that queries from
+       different threads don't have to wait for each other (or for
+       writes) in WAL mode. Null if disabled. */
+    std::unique_ptr<Pool<DBConnection>> readConnections;
+
+    /* Run the read-only query `f' on a read connection if available,
+       or on the main connection otherwise, retrying if the database
+       is busy. */
+    template<typename T, typename F>
+    T retryQuery(F && f);
+
+    std::unique_ptr<SharedPathInfoCache> sharedPathInfoCache;
+
+    /* The thread that deduplicates queued paths in the background. */
+    std::mutex optimiserMutex;
+    std::thread optimiserThread;
+
+    /* Calls to registerValidPaths() waiting to be committed together
+       with sync-before-registering. */
+    struct Registration
+    {
+        const ValidPathInfos & infos;
+        bool done = false;
+        std::exception_ptr exc;
+        Registration(const ValidPathInfos & infos) : infos(infos) { }
+    };
+
+    struct Registrations
+    {
+        std::vector<Registration *> pending;
+        bool committing = false;
+    };
+
+    Sync<Registrations> registrations;
+    std::condition_variable registrationsDone;
+
+    /* Builds waiting for the post-build hook to run in the
+       background (post-build-hook-jobs). */
+    struct PostBuildHooks
+    {
+        std::list<std::pair<StorePath, StorePathSet>> pending;
+
+        /* Outputs that are pending or being processed. */
+        StorePathSet inFlight;
+
+        /* Outputs for which the hook failed, and the error. */
+        std::map<StorePath, std::string> failed;
+
+        std::vector<std::thread> threads;
+        bool quit = false;
+    };
+
+    Sync<PostBuildHooks> postBuildHooks;
+    std::condition_variable postBuildHookQueued, postBuildHookDone;
+
+    void postBuildHookThread();
+
 public:
 
     PathSetting realStoreDir_;
@@ -102,8 +249,15 @@ private:
         settings.requireSigs,
         "require-sigs", "whether store paths should have a trusted signature on import"};
 
+    Setting<unsigned int> maxReadConnections{(Store*) this, 4,
+        "max-read-connections", "maximum number of read-only database connections for concurrent queries in WAL mode; 0 runs all queries on the main connection"};
+
     const PublicKeys & getPublicKeys();
 
+    /* Invalidate the shared path info cache if the path info has
+       changed. Must be called after committing such a change. */
+    void invalidateSharedPathInfoCache(State & state);
+
 public:
 
     // Hack for build-remote.cc.
@@ -129,12 +283,52 @@ public:
     void queryPathInfoUncached(const StorePath & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept override;
 
+    bool queryPathInfosUncached(const StorePathSet & paths,
+        std::map<StorePath, std::shared_ptr<const ValidPathInfo>> & infos) override;
+
+    void prefetchClosureInfos(const StorePathSet & paths) override;
+
     void queryReferrers(const StorePath & path, StorePathSet & referrers) override;
 
     StorePathSet queryValidDerivers(const StorePath & path) override;
 
     OutputPathMap queryDerivationOutputMap(const StorePath & path) override;
 
+    std::optional<Hash> queryDrvHashModulo(const StorePath & drvPath) override;
+
+    /* Return the number of hits and misses of the shared path info
+       cache across all processes, if it's enabled. */
+    std::optional<std::pair<uint64_t, uint64_t>> getSharedPathInfoCacheStats();
+
+    void registerDrvHashModulo(const StorePath & drvPath, const Hash & hash) override;
+
+    /* Closure sizes are memoised in the database, since the closure
+       of a valid path never changes. */
+    std::pair<uint64_t, uint64_t> getClosureSize(const StorePath & storePath) override;
+
+    /* Return the smoothed duration in seconds of previous builds of
+       derivations with the given name (without version), if any.
+       Used by the build scheduler to estimate critical paths. */
+    std::optional<uint64_t> queryBuildTime(const std::string & name);
+
+    void recordBuildTime(const std::string & name, uint64_t duration);
+
+    /* Likewise for the total NAR size of the outputs of previous
+       builds. */
+    std::optional<uint64_t> queryOutputSize(const std::string & name);
+
+    void recordOutputSize(const std::string & name, uint64_t size);
+
+    /* Return the status of the recorded failed build of the given
+       derivation, if any (see ‘cache-failures’). */
+    std::optional<BuildResult::Status> queryFailedBuild(const StorePath & drvPath);
+
+    void recordFailedBuild(const StorePath & drvPath, BuildResult::Status status);
+
+    StorePathSet queryFailedPaths() override;
+
+    void clearFailedPaths(const StorePathSet & paths) override;
+
     std::optional<StorePath> queryPathFromHashPart(const std::string & hashPart) override;
 
     StorePathSet querySubstitutablePaths(const StorePathSet & paths) override;
@@ -146,6 +340,14 @@ public:
         RepairFlag repair, CheckSigsFlag checkSigs,
         std::shared_ptr<FSAccessor> accessor) override;
 
+    /* Clone the path from another store whose files are on the same
+       file system. */
+    bool addToStoreFrom(Store & srcStore, const ValidPathInfo & info,
+        RepairFlag repair, CheckSigsFlag checkSigs) override;
+
+    std::unique_ptr<PathImporter> beginImport(RepairFlag repair, CheckSigsFlag checkSigs,
+        std::shared_ptr<FSAccessor> accessor) override;
+
     StorePath addToStore(const string & name, const Path & srcPath,
         FileIngestionMethod method, HashType hashAlgo,
         PathFilter & filter, RepairFlag repair) override;
@@ -160,6 +362,9 @@ public:
     StorePath addTextToStore(const string & name, const string & s,
         const StorePathSet & references, RepairFlag repair) override;
 
+    void addTextsToStore(const std::vector<StoreText> & texts,
+        RepairFlag repair) override;
+
     void buildPaths(
         const std::vector<StorePathWithOutputs> & paths,
         BuildMode buildMode) override;
@@ -188,17 +393,36 @@ public:
 
     void collectGarbage(const GCOptions & options, GCResults & results) override;
 
+    /* Record that the given paths have just been used, so that the
+       garbage collector can delete the least recently used paths
+       first. The times are written to the database in batches. This
+       does nothing unless `gc-lru' is enabled. */
+    void recordPathUse(const StorePathSet & paths);
+
     /* Optimise the disk space usage of the Nix store by hard-linking
        files with the same contents. */
     void optimiseStore(OptimiseStats & stats);
 
     void optimiseStore() override;
 
-    /* Optimise a single store path. */
-    void optimisePath(const Path & path);
+    /* Optimise a single store path. If `fileHashes' is given, the
+       files it lists are not read again. */
+    void optimisePath(const Path & path, const FileHashes * fileHashes = nullptr);
 
     bool verifyStore(bool checkContents, RepairFlag repair) override;
 
+    /* Run the post-build hook on the outputs of the given
+       derivations. */
+    void runPostBuildHook(const StorePathSet & drvPaths, const StorePathSet & outputs);
+
+    /* Queue the outputs of a build for the post-build hook, waiting
+       for space in the queue if necessary. */
+    void queuePostBuildHook(const StorePath & drvPath, const StorePathSet & outputs);
+
+    /* Wait until the post-build hook has processed `outputs', and
+       throw an error if it failed on any of them. */
+    void waitForPostBuildHook(const StorePathSet & outputs);
+
     /* Register the validity of a path, i.e., that `path' exists, that
        the paths referenced by it exists, and in the case of an output
        path of a derivation, that it has been produced by a successful
@@ -220,8 +444,12 @@ public:
     void addSignatures(const StorePath & storePath, const StringSet & sigs) override;
 
     /* If free disk space in /nix/store if below minFree, delete
-       garbage until it exceeds maxFree. */
-    void autoGC(bool sync = true);
+       garbage until it exceeds maxFree. If given, ‘pendingUse’
+       returns the number of bytes that pending work is about to add
+       to the store; this is counted as used already, so that the GC
+       starts before that work runs out of space. It is only called
+       when free space is actually checked. */
+    void autoGC(bool sync = true, std::function<uint64_t()> pendingUse = {});
 
 private:
 
@@ -231,7 +459,7 @@ private:
 
     void makeStoreWritable();
 
-    uint64_t queryValidPathId(State & state, const StorePath & path);
+    uint64_t queryValidPathId(DBConnection & conn, const StorePath & path);
 
     uint64_t addValidPath(State & state, const ValidPathInfo & info, bool checkOutputs = true);
 
@@ -240,11 +468,27 @@ private:
     /* Delete a path from the Nix store. */
     void invalidatePathChecked(const StorePath & path);
 
+    /* Likewise for several paths in a single transaction. Referrers
+       must come before the paths they refer to. */
+    void invalidatePathsChecked(const std::vector<StorePath> & paths);
+
     void verifyPath(const Path & path, const StringSet & store,
         PathSet & done, StorePathSet & validPaths, RepairFlag repair, bool & errors);
 
     void updatePathInfo(State & state, const ValidPathInfo & info);
 
+    /* Read the path info columns (id, hash, registrationTime, deriver,
+       narSize, ultimate, sigs, ca) of the current row of `use'. */
+    void readPathInfoRow(SQLiteStmt::Use & use, ValidPathInfo & info);
+
+    /* Check that `info' may be added to the store. */
+    void checkImport(const ValidPathInfo & info, CheckSigsFlag checkSigs);
+
+    /* Restore the NAR of `info' from `source' to `realPath' and check
+       its hash, without registering it. The caller must hold the
+       lock on `realPath'. */
+    void restoreNar(const ValidPathInfo & info, const Path & realPath, Source & source);
+
     void upgradeStore6();
     void upgradeStore7();
     PathSet queryValidPathsOld();
@@ -260,6 +504,51 @@ private:
 
     void deletePathRecursive(GCState & state, const Path & path);
 
+    void deleteFromStore(GCState & state, const Path & path, uint64_t narSize);
+
+    void flushDeletions(GCState & state);
+
+    void deleteTrash(GCState & state);
+
+    bool isStillDead(GCState & state, StorePathSet & visited, const StorePath & path);
+
+    void collectGarbageIncremental(GCState & state, AutoCloseFD & fdGCLock, FDs & fds);
+
+    /* The reference graph of all valid paths in compressed sparse
+       row form, loaded by the garbage collector in a few table
+       scans. Paths are numbered 0..n-1 in the order of their
+       database IDs. */
+    struct ReferenceGraph
+    {
+        static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+        std::vector<std::string> paths;
+
+        /* The references of path i are refs[refStart[i]] up to
+           refs[refStart[i + 1]]. */
+        std::vector<uint32_t> refStart, refs;
+
+        /* Likewise for the valid outputs of derivation i. */
+        std::vector<uint32_t> outputStart, outputs;
+
+        /* The deriver of path i, or `none'. */
+        std::vector<uint32_t> deriver;
+
+        std::unordered_map<std::string, uint32_t> index;
+    };
+
+    ReferenceGraph queryReferenceGraph();
+
+    void flushLastUse(State & state);
+
+    /* Return the time at which each valid path was last used, or its
+       registration time if it hasn't been used since. */
+    std::unordered_map<std::string, time_t> queryLastUse();
+
+    void orderGarbage(std::vector<Path> & paths);
+
+    void markLive(GCState & state);
+
     bool isActiveTempFile(const GCState & state,
         const Path & path, const string & suffix);
 
@@ -273,6 +562,10 @@ private:
 
     void removeUnusedLinks(const GCState & state);
 
+    void removeCandidateLinks(const GCState & state, int fdCandidates);
+
+    void recordLinkCandidates(GCState & state, const std::vector<ino_t> & inodes);
+
     Path createTempDirInStore();
 
     void checkDerivationOutputs(const StorePath & drvPath, const Derivation & drv);
@@ -280,12 +573,38 @@ private:
     typedef std::unordered_set<ino_t> InodeHash;
 
     InodeHash loadInodeHash();
-    Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
-    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash);
+    Strings readDirectoryIgnoringInodes(const Path & path, Sync<InodeHash> & inodeHash);
+    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, Sync<InodeHash> & inodeHash,
+        const FileHashes * fileHashes = nullptr);
+
+    /* Return the valid paths that optimiseStore() hasn't processed
+       yet, and record that it has processed a path. */
+    StorePathSet queryUnoptimisedPaths();
+    void registerOptimisedPath(const StorePath & path);
+
+    /* Deduplicate the paths in the PendingOptimisations table in a
+       background thread, unless it is already running. */
+    void startOptimiser();
+    void runOptimiser();
+    uint64_t queryOptimiseQueueLength();
+    std::vector<StorePath> queryPendingOptimisations(size_t max);
+    void finishOptimisation(const StorePath & path);
+
+    /* Return when verifyStore() last checked the contents of each
+       valid path, and record that it has checked a path. */
+    std::unordered_map<std::string, time_t> queryVerificationTimes();
+    void registerVerifiedPath(const StorePath & path, time_t time);
+
+    /* Register `infos' without syncing the store file system first. */
+    void registerValidPaths_(const ValidPathInfos & infos);
+
+    /* Write all modified data of the file system containing the
+       store to disk. */
+    void syncStoreFS();
 
     // Internal versions that are not wrapped in retry_sqlite.
-    bool isValidPath_(State & state, const StorePath & path);
-    void queryReferrers(State & state, const StorePath & path, StorePathSet & referrers);
+    bool isValidPath_(DBConnection & conn, const StorePath & path);
+    void queryReferrers(DBConnection & conn, const StorePath & path, StorePathSet & referrers);
 
     /* Add signatures to a ValidPathInfo using the secret keys
        specified by the ‘secret-key-files’ option. */
@@ -0,0 +1,154 @@
+#include "maintenance-priority.hh"
+#include "globals.hh"
+#include "util.hh"
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if __linux__
+#include "cgroup.hh"
+
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+namespace nix {
+
+#if __linux__
+
+/* From <linux/ioprio.h>, which glibc doesn't wrap. */
+static constexpr int ioprioWhoProcess = 1;
+static constexpr int ioprioClassShift = 13;
+static constexpr int ioprioClassBE = 2;
+static constexpr int ioprioClassIdle = 3;
+
+static int parseIOClass(const std::string & cls)
+{
+    if (cls == "idle")
+        return ioprioClassIdle << ioprioClassShift;
+    /* The lowest priority level within the best-effort class. */
+    if (cls == "best-effort")
+        return ioprioClassBE << ioprioClassShift | 7;
+    throw Error("unknown I/O scheduling class '%s'", cls);
+}
+
+/* Return the ‘major:minor’ of the disk containing ‘path’. The io
+   controller only accepts whole disks, not partitions. */
+static std::string diskOf(const Path & path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st))
+        throw SysError("getting status of '%s'", path);
+
+    auto dev = fmt("%d:%d", major(st.st_dev), minor(st.st_dev));
+
+    auto sysDir = "/sys/dev/block/" + dev;
+    if (!pathExists(sysDir))
+        throw Error("'%s' is not on a block device", path);
+
+    sysDir = canonPath(sysDir, true);
+    if (pathExists(sysDir + "/partition"))
+        dev = trim(readFile(dirOf(sysDir) + "/dev"));
+
+    return dev;
+}
+
+#endif
+
+
+MaintenancePriority::MaintenancePriority(const Path & storeDir, bool wholeProcess,
+    const std::string & defaultIOClass)
+{
+#if __linux__
+    auto ioClass = settings.maintenanceIOClass.get();
+    if (ioClass.empty()) ioClass = defaultIOClass;
+    std::optional<int> ioPrio;
+    if (!ioClass.empty()) ioPrio = parseIOClass(ioClass);
+
+    /* On Linux, the niceness is a property of the thread. */
+    niceWho = syscall(SYS_gettid);
+#else
+    /* Elsewhere, it applies to the whole process, so leave it alone
+       if other threads keep doing foreground work. */
+    if (!wholeProcess) return;
+#endif
+
+    if (settings.maintenanceNiceness) {
+        errno = 0;
+        int nice = getpriority(PRIO_PROCESS, niceWho);
+        if (errno == 0 && setpriority(PRIO_PROCESS, niceWho, nice + settings.maintenanceNiceness) == 0)
+            oldNice = nice;
+    }
+
+#if __linux__
+    if (ioPrio) {
+        int old = syscall(SYS_ioprio_get, ioprioWhoProcess, 0);
+        if (old != -1 && syscall(SYS_ioprio_set, ioprioWhoProcess, 0, *ioPrio) == 0)
+            oldIOPrio = old;
+    }
+
+    if (wholeProcess && settings.maintenanceIOMax && !storeDir.empty()) {
+        std::optional<Path> newCgroup;
+        try {
+            auto disk = diskOf(storeDir);
+
+            auto ownCgroup = getOwnCgroup();
+            if (!ownCgroup)
+                throw Error("this system does not use the unified cgroup hierarchy");
+
+            /* As with memory accounting in createCgroup(), this fails
+               if our cgroup contains processes with other controllers
+               enabled; writing io.max below then fails too. */
+            try {
+                writeFile(*ownCgroup + "/cgroup.subtree_control", "+io");
+            } catch (SysError &) { }
+
+            newCgroup = createCgroup(fmt("nix-maintenance-%d", getpid()));
+
+            writeFile(*newCgroup + "/io.max",
+                fmt("%s rbps=%d wbps=%d", disk, settings.maintenanceIOMax, settings.maintenanceIOMax));
+            writeFile(*newCgroup + "/cgroup.procs", std::to_string(getpid()));
+
+            oldCgroup = ownCgroup;
+            cgroup = newCgroup;
+        } catch (Error & e) {
+            if (newCgroup) {
+                try {
+                    destroyCgroup(*newCgroup);
+                } catch (...) {
+                    ignoreException();
+                }
+            }
+            warn("not limiting the I/O throughput of store maintenance: %s", e.msg());
+        }
+    }
+#endif
+}
+
+
+MaintenancePriority::~MaintenancePriority()
+{
+#if __linux__
+    /* Only destroy the cgroup once we're out of it, since that kills
+       everything in it. */
+    if (cgroup) {
+        try {
+            writeFile(*oldCgroup + "/cgroup.procs", std::to_string(getpid()));
+            destroyCgroup(*cgroup);
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
+    if (oldIOPrio)
+        syscall(SYS_ioprio_set, ioprioWhoProcess, 0, *oldIOPrio);
+#endif
+
+    /* Raising the priority again requires privileges, so this may
+       fail for unprivileged users. */
+    if (oldNice)
+        setpriority(PRIO_PROCESS, niceWho, *oldNice);
+}
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "types.hh"
+
+#include <optional>
+
+namespace nix {
+
+/* While in scope, run the calling thread with the CPU and I/O
+   priority configured for store maintenance (‘maintenance-niceness’
+   and ‘maintenance-io-class’); ‘defaultIOClass’ is used if the latter
+   is empty. Threads started in the scope inherit the priority. If
+   ‘wholeProcess’ is set, the process is also moved into a cgroup of
+   its own that limits its I/O on the disk of ‘storeDir’ to
+   ‘maintenance-io-max’. */
+struct MaintenancePriority
+{
+    MaintenancePriority(const Path & storeDir, bool wholeProcess,
+        const std::string & defaultIOClass = "");
+
+    ~MaintenancePriority();
+
+private:
+    int niceWho = 0;
+    std::optional<int> oldNice;
+#if __linux__
+    std::optional<int> oldIOPrio;
+    std::optional<Path> oldCgroup, cgroup;
+#endif
+};
+
+}
@@ -5,6 +5,8 @@
 #include "store-api.hh"
 #include "thread-pool.hh"
 
+#include <unordered_set>
+
 
 namespace nix {
 
@@ -12,64 +14,90 @@ namespace nix {
 void Store::computeFSClosure(const StorePathSet & startPaths,
     StorePathSet & paths_, bool flipDirection, bool includeOutputs, bool includeDerivers)
 {
+    /* Visited paths are tracked in a hash set and only merged into
+       `paths_' (in sorted order, which std::set inserts cheaply at
+       the end hint) when the traversal is done. That avoids a tree
+       lookup and node allocation under the lock for every reference
+       of every path. */
     struct State
     {
         size_t pending;
-        StorePathSet & paths;
+        const StorePathSet & initial;
+        std::unordered_set<StorePath> seen;
         std::exception_ptr exc;
     };
 
-    Sync<State> state_(State{0, paths_, 0});
+    /* If the store can answer many path info queries in one round
+       trip, walk the closure a level at a time first, so that the
+       traversal below is served from the path info cache. */
+    if (!flipDirection) {
+        StorePathSet level(startPaths);
+        std::unordered_set<StorePath> seen;
+        while (!level.empty() && prefetchPathInfos(level)) {
+            StorePathSet next;
+            for (auto & path : level) {
+                seen.insert(path);
+                if (!isValidPath(path)) continue;
+                auto info = queryPathInfo(path);
+                for (auto & ref : info->references)
+                    if (!seen.count(ref)) next.insert(ref);
+                if (includeDerivers && info->deriver && !seen.count(*info->deriver))
+                    next.insert(*info->deriver);
+            }
+            level = std::move(next);
+        }
+    }
+
+    Sync<State> state_(State{0, paths_, {}, 0});
 
-    std::function<void(const Path &)> enqueue;
+    std::function<void(const StorePath &)> enqueue;
 
     std::condition_variable done;
 
-    enqueue = [&](const Path & path) -> void {
+    enqueue = [&](const StorePath & path) -> void {
         {
             auto state(state_.lock());
             if (state->exc) return;
-            if (!state->paths.insert(parseStorePath(path)).second) return;
+            if (state->initial.count(path)) return;
+            if (!state->seen.insert(path).second) return;
             state->pending++;
         }
 
-        queryPathInfo(parseStorePath(path), {[&, pathS(path)](std::future<ref<const ValidPathInfo>> fut) {
+        queryPathInfo(path, {[&, path](std::future<ref<const ValidPathInfo>> fut) {
             // FIXME: calls to isValidPath() should be async
 
             try {
                 auto info = fut.get();
 
-                auto path = parseStorePath(pathS);
-
                 if (flipDirection) {
 
                     StorePathSet referrers;
                     queryReferrers(path, referrers);
                     for (auto & ref : referrers)
                         if (ref != path)
-                            enqueue(printStorePath(ref));
+                            enqueue(ref);
 
                     if (includeOutputs)
                         for (auto & i : queryValidDerivers(path))
-                            enqueue(printStorePath(i));
+                            enqueue(i);
 
                     if (includeDerivers && path.isDerivation())
                         for (auto & i : queryDerivationOutputs(path))
                             if (isValidPath(i) && queryPathInfo(i)->deriver == path)
-                                enqueue(printStorePath(i));
+                                enqueue(i);
 
                 } else {
 
                     for (auto & ref : info->references)
                         if (ref != path)
-                            enqueue(printStorePath(ref));
+                            enqueue(ref);
 
                     if (includeOutputs && path.isDerivation())
                         for (auto & i : queryDerivationOutputs(path))
-                            if (isValidPath(i)) enqueue(printStorePath(i));
+                            if (isValidPath(i)) enqueue(i);
 
                     if (includeDerivers && info->deriver && isValidPath(*info->deriver))
-                        enqueue(printStorePath(*info->deriver));
+                        enqueue(*info->deriver);
 
                 }
 
@@ -89,13 +117,18 @@ void Store::computeFSClosure(const StorePathSet & startPaths,
     };
 
     for (auto & startPath : startPaths)
-        enqueue(printStorePath(startPath));
-
-    {
-        auto state(state_.lock());
-        while (state->pending) state.wait(done);
-        if (state->exc) std::rethrow_exception(state->exc);
-    }
+        enqueue(startPath);
+
+    auto state(state_.lock());
+    while (state->pending) state.wait(done);
+    if (state->exc) std::rethrow_exception(state->exc);
+
+    std::vector<StorePath> found(
+        std::make_move_iterator(state->seen.begin()),
+        std::make_move_iterator(state->seen.end()));
+    std::sort(found.begin(), found.end());
+    for (auto & path : found)
+        paths_.insert(paths_.end(), std::move(path));
 }
 
 
@@ -144,6 +177,11 @@ void Store::queryMissing(const std::vector<StorePathWithOutputs> & targets,
             state->willBuild.insert(drvPath);
         }
 
+        StorePathSet inputDrvs;
+        for (auto & i : drv.inputDrvs)
+            inputDrvs.insert(i.first);
+        prefetchPathInfos(inputDrvs);
+
         for (auto & i : drv.inputDrvs)
             pool.enqueue(std::bind(doPath, StorePathWithOutputs { i.first, i.second }));
     };
@@ -195,6 +233,12 @@ void Store::queryMissing(const std::vector<StorePathWithOutputs> & targets,
             auto drv = make_ref<Derivation>(derivationFromPath(path.path));
             ParsedDerivation parsedDrv(StorePath(path.path), *drv);
 
+            StorePathSet outputs;
+            for (auto & j : drv->outputs)
+                if (wantOutput(j.first, path.outputs))
+                    outputs.insert(j.second.path);
+            prefetchPathInfos(outputs);
+
             PathSet invalid;
             for (auto & j : drv->outputs)
                 if (wantOutput(j.first, path.outputs)
@@ -203,6 +247,14 @@ void Store::queryMissing(const std::vector<StorePathWithOutputs> & targets,
             if (invalid.empty()) return;
 
             if (settings.useSubstitutes && parsedDrv.substitutesAllowed()) {
+                /* Look up the outputs in the substituters' disk
+                   caches in one transaction each. */
+                StorePathSet invalidPaths;
+                for (auto & output : invalid)
+                    invalidPaths.insert(parseStorePath(output));
+                for (auto & sub : getDefaultSubstituters())
+                    sub->prefetchPathInfos(invalidPaths);
+
                 auto drvState = make_ref<Sync<DrvState>>(DrvState(invalid.size()));
                 for (auto & output : invalid)
                     pool.enqueue(std::bind(checkOutput, printStorePath(path.path), drv, output, drvState));
@@ -213,6 +265,12 @@ void Store::queryMissing(const std::vector<StorePathWithOutputs> & targets,
 
             if (isValidPath(path.path)) return;
 
+            /* If a substituter can tell us about the entire closure
+               in one go, avoid discovering it level by level. */
+            if (settings.useSubstitutes)
+                for (auto & sub : getDefaultSubstituters())
+                    sub->prefetchClosureInfos({path.path});
+
             SubstitutablePathInfos infos;
             querySubstitutablePathInfos({path.path}, infos);
 
@@ -237,6 +295,11 @@ void Store::queryMissing(const std::vector<StorePathWithOutputs> & targets,
         }
     };
 
+    StorePathSet targetPaths;
+    for (auto & path : targets)
+        targetPaths.insert(path.path);
+    prefetchPathInfos(targetPaths);
+
     for (auto & path : targets)
         pool.enqueue(std::bind(doPath, path));
 
@@ -247,7 +310,8 @@ void Store::queryMissing(const std::vector<StorePathWithOutputs> & targets,
 StorePaths Store::topoSortPaths(const StorePathSet & paths)
 {
     StorePaths sorted;
-    StorePathSet visited, parents;
+    sorted.reserve(paths.size());
+    std::unordered_set<StorePath> visited, parents;
 
     std::function<void(const StorePath & path, const StorePath * parent)> dfsVisit;
 
@@ -259,17 +323,18 @@ StorePaths Store::topoSortPaths(const StorePathSet & paths)
         if (!visited.insert(path).second) return;
         parents.insert(path);
 
-        StorePathSet references;
+        std::shared_ptr<const ValidPathInfo> info;
         try {
-            references = queryPathInfo(path)->references;
+            info = queryPathInfo(path);
         } catch (InvalidPath &) {
         }
 
-        for (auto & i : references)
-            /* Don't traverse into paths that don't exist.  That can
-               happen due to substitutes for non-existent paths. */
-            if (i != path && paths.count(i))
-                dfsVisit(i, &path);
+        if (info)
+            for (auto & i : info->references)
+                /* Don't traverse into paths that don't exist.  That can
+                   happen due to substitutes for non-existent paths. */
+                if (i != path && paths.count(i))
+                    dfsVisit(i, &path);
 
         sorted.push_back(path);
         parents.erase(path);
@@ -34,19 +34,29 @@ struct NarAccessor : public FSAccessor
 
     NarMember root;
 
-    struct NarIndexer : ParseSink, StringSource
+    struct NarIndexer : ParseSink, Source
     {
         NarAccessor & acc;
+        Source & source;
 
         std::stack<NarMember *> parents;
 
-        std::string currentStart;
         bool isExec = false;
 
-        NarIndexer(NarAccessor & acc, const std::string & nar)
-            : StringSource(nar), acc(acc)
+        /* Number of bytes read from `source' so far. */
+        size_t pos = 0;
+
+        NarIndexer(NarAccessor & acc, Source & source)
+            : acc(acc), source(source)
         { }
 
+        size_t read(unsigned char * data, size_t len) override
+        {
+            auto n = source.read(data, len);
+            pos += n;
+            return n;
+        }
+
         void createMember(const Path & path, NarMember member) {
             size_t level = std::count(path.begin(), path.end(), '/');
             while (parents.size() > level) parents.pop();
@@ -79,7 +89,6 @@ struct NarAccessor : public FSAccessor
 
         void preallocateContents(unsigned long long size) override
         {
-            currentStart = string(s, pos, 16);
             assert(size <= std::numeric_limits<size_t>::max());
             parents.top()->size = (size_t)size;
             parents.top()->start = pos;
@@ -87,11 +96,6 @@ struct NarAccessor : public FSAccessor
 
         void receiveContents(unsigned char * data, unsigned int len) override
         {
-            // Sanity check
-            if (!currentStart.empty()) {
-                assert(len < 16 || currentStart == string((char *) data, 16));
-                currentStart.clear();
-            }
         }
 
         void createSymlink(const Path & path, const string & target) override
@@ -103,7 +107,14 @@ struct NarAccessor : public FSAccessor
 
     NarAccessor(ref<const std::string> nar) : nar(nar)
     {
-        NarIndexer indexer(*this, *nar);
+        StringSource source(*nar);
+        NarIndexer indexer(*this, source);
+        parseDump(indexer, indexer);
+    }
+
+    NarAccessor(Source & source)
+    {
+        NarIndexer indexer(*this, source);
         parseDump(indexer, indexer);
     }
 
@@ -201,7 +212,8 @@ struct NarAccessor : public FSAccessor
 
         if (getNarBytes) return getNarBytes(i.start, i.size);
 
-        assert(nar);
+        if (!nar)
+            throw Error("cannot read '%s' because the contents of the NAR file are not available", path);
         return std::string(*nar, i.start, i.size);
     }
 
@@ -219,6 +231,11 @@ ref<FSAccessor> makeNarAccessor(ref<const std::string> nar)
     return make_ref<NarAccessor>(nar);
 }
 
+ref<FSAccessor> makeNarAccessor(Source & source)
+{
+    return make_ref<NarAccessor>(source);
+}
+
 ref<FSAccessor> makeLazyNarAccessor(const std::string & listing,
     GetNarBytes getNarBytes)
 {
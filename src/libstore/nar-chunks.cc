@@ -0,0 +1,147 @@
+#include "nar-chunks.hh"
+#include "compression.hh"
+#include "util.hh"
+
+#include <array>
+
+namespace nix {
+
+/* The gear table must never change, since chunk boundaries (and thus
+   deduplication across NARs) depend on it. */
+static const std::array<uint64_t, 256> & gearTable()
+{
+    static auto table = []() {
+        std::array<uint64_t, 256> table;
+        uint64_t x = 0x6a09e667f3bcc908ULL;
+        for (auto & entry : table) {
+            /* splitmix64 */
+            uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            entry = z ^ (z >> 31);
+        }
+        return table;
+    }();
+    return table;
+}
+
+
+ChunkingSink::ChunkingSink(size_t avgSize, ChunkCallback onChunk)
+    : onChunk(onChunk)
+{
+    unsigned int bits = 0;
+    while (((size_t) 2 << bits) <= avgSize) bits++;
+    if (bits < 8) bits = 8;
+    this->avgSize = (size_t) 1 << bits;
+    minSize = this->avgSize / 4;
+    maxSize = this->avgSize * 8;
+
+    /* Normalised chunking: before the average size, require more
+       zero bits; after, fewer. Since the gear hash is shifted left,
+       the high bits depend on the most input. */
+    maskS = ~0ULL << (64 - (bits + 1));
+    maskL = ~0ULL << (64 - (bits - 1));
+}
+
+
+void ChunkingSink::operator () (const unsigned char * data, size_t len)
+{
+    auto & gear = gearTable();
+
+    size_t i = 0;
+
+    while (i < len) {
+        size_t size = current.size();
+
+        /* Don't look for boundaries in the first `minSize' bytes of
+           a chunk. */
+        if (size < minSize) {
+            auto n = std::min(len - i, minSize - size);
+            current.append((const char *) data + i, n);
+            i += n;
+            continue;
+        }
+
+        size_t start = i;
+        bool cut = false;
+
+        while (i < len) {
+            hash = (hash << 1) + gear[data[i++]];
+            size++;
+            if ((hash & (size < avgSize ? maskS : maskL)) == 0 || size >= maxSize) {
+                cut = true;
+                break;
+            }
+        }
+
+        current.append((const char *) data + start, i - start);
+
+        if (cut) emit();
+    }
+}
+
+
+void ChunkingSink::finish()
+{
+    if (!current.empty()) emit();
+}
+
+
+void ChunkingSink::emit()
+{
+    onChunk(current);
+    current.clear();
+    hash = 0;
+}
+
+
+ChunkManifest::ChunkManifest(const std::string & s, const std::string & whence)
+{
+    auto corrupt = [&]() {
+        throw Error("chunk manifest '%s' is corrupt", whence);
+    };
+
+    bool haveCompression = false;
+
+    for (auto & line : tokenizeString<Strings>(s, "\n")) {
+        auto colon = line.find(": ");
+        if (colon == std::string::npos) corrupt();
+        auto name = line.substr(0, colon);
+        auto value = line.substr(colon + 2);
+
+        if (name == "Compression") {
+            compression = value;
+            haveCompression = true;
+        }
+
+        else if (name == "Chunk") {
+            auto fields = tokenizeString<std::vector<std::string>>(value, " ");
+            uint64_t size;
+            if (fields.size() != 2 || !string2Int(fields[1], size)) corrupt();
+            try {
+                chunks.emplace_back(Hash(fields[0], htSHA256), size);
+            } catch (BadHash &) {
+                corrupt();
+            }
+        }
+    }
+
+    if (!haveCompression) corrupt();
+}
+
+
+std::string ChunkManifest::to_string() const
+{
+    std::string res = "Compression: " + compression + "\n";
+    for (auto & [hash, size] : chunks)
+        res += fmt("Chunk: %s %d\n", hash.to_string(Base32, false), size);
+    return res;
+}
+
+
+std::string chunkFileFor(const Hash & hash, const std::string & compression)
+{
+    return "chunks/" + hash.to_string(Base32, false) + compressionExtension(compression);
+}
+
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "types.hh"
+#include "hash.hh"
+#include "serialise.hh"
+
+#include <functional>
+#include <string_view>
+
+namespace nix {
+
+/* A sink that splits its input into content-defined chunks using a
+   FastCDC-style gear hash, so that an insertion or deletion only
+   affects the chunks around it. Chunks are between a quarter and
+   eight times `avgSize' bytes long. */
+struct ChunkingSink : Sink
+{
+    typedef std::function<void(std::string_view chunk)> ChunkCallback;
+
+    ChunkingSink(size_t avgSize, ChunkCallback onChunk);
+
+    void operator () (const unsigned char * data, size_t len) override;
+
+    /* Emit the last chunk, if any. */
+    void finish();
+
+private:
+
+    size_t minSize, avgSize, maxSize;
+    uint64_t maskS, maskL;
+    uint64_t hash = 0;
+    std::string current;
+    ChunkCallback onChunk;
+
+    void emit();
+};
+
+/* The list of chunks that make up a NAR, stored in a binary cache
+   under the URL of the NAR. */
+struct ChunkManifest
+{
+    /* The compression method applied to each chunk. */
+    std::string compression;
+
+    /* The SHA-256 hash and size of each uncompressed chunk. */
+    std::vector<std::pair<Hash, uint64_t>> chunks;
+
+    ChunkManifest(const std::string & compression) : compression(compression) { }
+
+    ChunkManifest(const std::string & s, const std::string & whence);
+
+    std::string to_string() const;
+};
+
+/* The name of the file holding the specified chunk in a binary
+   cache. */
+std::string chunkFileFor(const Hash & hash, const std::string & compression);
+
+}
@@ -2,6 +2,7 @@
 #include "sync.hh"
 #include "sqlite.hh"
 #include "globals.hh"
+#include "lru-cache.hh"
 
 #include <sqlite3.h>
 
@@ -15,7 +16,8 @@ create table if not exists BinaryCaches (
     timestamp integer not null,
     storeDir  text not null,
     wantMassQuery integer not null,
-    priority  integer not null
+    priority  integer not null,
+    presenceFilter text
 );
 
 create table if not exists NARs (
@@ -32,12 +34,18 @@ create table if not exists NARs (
     deriver          text,
     sigs             text,
     ca               text,
+    deltas           text,
     timestamp        integer not null,
     present          integer not null,
     primary key (cache, hashPart),
     foreign key (cache) references BinaryCaches(id) on delete cascade
 );
 
+create table if not exists VerifiedSigs (
+    key              text primary key not null,
+    timestamp        integer not null
+);
+
 create table if not exists LastPurge (
     dummy            text primary key,
     value            integer
@@ -58,22 +66,65 @@ public:
         Path storeDir;
         bool wantMassQuery;
         int priority;
+        std::string presenceFilter;
     };
 
     struct State
     {
         SQLite db;
         SQLiteStmt insertCache, queryCache, insertNAR, insertMissingNAR, queryNAR, purgeCache;
+        SQLiteStmt insertVerifiedSig, queryVerifiedSig;
         std::map<std::string, Cache> caches;
     };
 
     Sync<State> _state;
 
+    /* Writes are batched: they go to an in-memory cache immediately,
+       and to the database in a single transaction once enough of
+       them have accumulated, or they've been pending for a while. */
+    static constexpr size_t maxPending = 64;
+    static constexpr std::chrono::seconds maxPendingTime{1};
+
+    struct FrontEntry
+    {
+        Outcome outcome;
+        std::shared_ptr<NarInfo> narInfo;
+        time_t timestamp;
+    };
+
+    struct PendingWrite
+    {
+        int cacheId;
+        std::string hashPart;
+        std::shared_ptr<const ValidPathInfo> info;
+        time_t timestamp;
+    };
+
+    /* A per-process cache in front of the database, so that repeated
+       lookups don't contend on the SQLite lock. */
+    struct Front
+    {
+        LRUCache<std::pair<int, std::string>, FrontEntry> entries{65536};
+        std::vector<PendingWrite> pending;
+        std::chrono::steady_clock::time_point firstPending;
+    };
+
+    Sync<Front> _front;
+
+    ~NarInfoDiskCacheImpl()
+    {
+        try {
+            flush();
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
     NarInfoDiskCacheImpl()
     {
         auto state(_state.lock());
 
-        Path dbPath = getCacheDir() + "/nix/binary-cache-v6.sqlite";
+        Path dbPath = getCacheDir() + "/nix/binary-cache-v8.sqlite";
         createDirs(dirOf(dbPath));
 
         state->db = SQLite(dbPath);
@@ -83,20 +134,26 @@ public:
         state->db.exec(schema);
 
         state->insertCache.create(state->db,
-            "insert or replace into BinaryCaches(url, timestamp, storeDir, wantMassQuery, priority) values (?, ?, ?, ?, ?)");
+            "insert or replace into BinaryCaches(url, timestamp, storeDir, wantMassQuery, priority, presenceFilter) values (?, ?, ?, ?, ?, ?)");
 
         state->queryCache.create(state->db,
-            "select id, storeDir, wantMassQuery, priority from BinaryCaches where url = ?");
+            "select id, storeDir, wantMassQuery, priority, presenceFilter from BinaryCaches where url = ?");
 
         state->insertNAR.create(state->db,
             "insert or replace into NARs(cache, hashPart, namePart, url, compression, fileHash, fileSize, narHash, "
-            "narSize, refs, deriver, sigs, ca, timestamp, present) values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 1)");
+            "narSize, refs, deriver, sigs, ca, deltas, timestamp, present) values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 1)");
 
         state->insertMissingNAR.create(state->db,
             "insert or replace into NARs(cache, hashPart, timestamp, present) values (?, ?, ?, 0)");
 
         state->queryNAR.create(state->db,
-            "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
+            "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca, deltas, timestamp from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
+
+        state->insertVerifiedSig.create(state->db,
+            "insert or replace into VerifiedSigs(key, timestamp) values (?, ?)");
+
+        state->queryVerifiedSig.create(state->db,
+            "select 1 from VerifiedSigs where key = ? and timestamp > ?");
 
         /* Periodically purge expired entries from the database. */
         retrySQLite<void>([&]() {
@@ -115,6 +172,12 @@ public:
 
                 debug("deleted %d entries from the NAR info disk cache", sqlite3_changes(state->db));
 
+                SQLiteStmt(state->db,
+                    "delete from VerifiedSigs where timestamp < ?")
+                    .use()
+                    (now - settings.ttlPositiveNarInfoCache)
+                    .exec();
+
                 SQLiteStmt(state->db,
                     "insert or replace into LastPurge(dummy, value) values ('', ?)")
                     .use()(now).exec();
@@ -129,16 +192,18 @@ public:
         return i->second;
     }
 
-    void createCache(const std::string & uri, const Path & storeDir, bool wantMassQuery, int priority) override
+    void createCache(const std::string & uri, const Path & storeDir, bool wantMassQuery, int priority,
+        const std::string & presenceFilter) override
     {
         retrySQLite<void>([&]() {
             auto state(_state.lock());
 
             // FIXME: race
 
-            state->insertCache.use()(uri)(time(0))(storeDir)(wantMassQuery)(priority).exec();
+            state->insertCache.use()(uri)(time(0))(storeDir)(wantMassQuery)(priority)
+                (presenceFilter, !presenceFilter.empty()).exec();
             assert(sqlite3_changes(state->db) == 1);
-            state->caches[uri] = Cache{(int) sqlite3_last_insert_rowid(state->db), storeDir, wantMassQuery, priority};
+            state->caches[uri] = Cache{(int) sqlite3_last_insert_rowid(state->db), storeDir, wantMassQuery, priority, presenceFilter};
         });
     }
 
@@ -153,99 +218,292 @@ public:
                 if (!queryCache.next())
                     return std::nullopt;
                 state->caches.emplace(uri,
-                    Cache{(int) queryCache.getInt(0), queryCache.getStr(1), queryCache.getInt(2) != 0, (int) queryCache.getInt(3)});
+                    Cache{(int) queryCache.getInt(0), queryCache.getStr(1), queryCache.getInt(2) != 0, (int) queryCache.getInt(3),
+                        queryCache.isNull(4) ? "" : queryCache.getStr(4)});
             }
 
             auto & cache(getCache(*state, uri));
 
             return CacheInfo {
                 .wantMassQuery = cache.wantMassQuery,
-                .priority = cache.priority
+                .priority = cache.priority,
+                .presenceFilter = cache.presenceFilter
             };
         });
     }
 
+    /* Look up a NAR in the database. The caller must hold the state
+       lock. */
+    std::pair<Outcome, std::shared_ptr<NarInfo>> queryNarInfo(
+        State & state, Cache & cache, const std::string & hashPart, time_t now, time_t & timestamp)
+    {
+        auto queryNAR(state.queryNAR.use()
+            (cache.id)
+            (hashPart)
+            (now - settings.ttlNegativeNarInfoCache)
+            (now - settings.ttlPositiveNarInfoCache));
+
+        if (!queryNAR.next())
+            return {oUnknown, 0};
+
+        timestamp = queryNAR.getInt(13);
+
+        if (!queryNAR.getInt(0))
+            return {oInvalid, 0};
+
+        auto namePart = queryNAR.getStr(1);
+        auto narInfo = make_ref<NarInfo>(StorePath(hashPart + "-" + namePart));
+        narInfo->url = queryNAR.getStr(2);
+        narInfo->compression = queryNAR.getStr(3);
+        if (!queryNAR.isNull(4))
+            narInfo->fileHash = Hash(queryNAR.getStr(4));
+        narInfo->fileSize = queryNAR.getInt(5);
+        narInfo->narHash = Hash(queryNAR.getStr(6));
+        narInfo->narSize = queryNAR.getInt(7);
+        for (auto & r : tokenizeString<Strings>(queryNAR.getStr(8), " "))
+            narInfo->references.insert(StorePath(r));
+        if (!queryNAR.isNull(9))
+            narInfo->deriver = StorePath(queryNAR.getStr(9));
+        for (auto & sig : tokenizeString<Strings>(queryNAR.getStr(10), " "))
+            narInfo->sigs.insert(sig);
+        narInfo->ca = parseContentAddressOpt(queryNAR.getStr(11));
+        if (!queryNAR.isNull(12))
+            for (auto & delta : tokenizeString<Strings>(queryNAR.getStr(12), "\n"))
+                narInfo->deltas.push_back(NarInfo::Delta::parse(delta));
+
+        return {oValid, narInfo};
+    }
+
+    /* Return the entry for `hashPart' from the in-memory cache, if
+       it's there and hasn't expired. */
+    std::optional<std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupFront(
+        Front & front, int cacheId, const std::string & hashPart, time_t now)
+    {
+        auto entry = front.entries.get({cacheId, hashPart});
+        if (!entry) return std::nullopt;
+        if (entry->timestamp <= now - (entry->outcome == oValid
+                ? settings.ttlPositiveNarInfoCache : settings.ttlNegativeNarInfoCache))
+            return std::nullopt;
+        return std::make_pair(entry->outcome, entry->narInfo);
+    }
+
     std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
         const std::string & uri, const std::string & hashPart) override
     {
-        return retrySQLite<std::pair<Outcome, std::shared_ptr<NarInfo>>>(
-            [&]() -> std::pair<Outcome, std::shared_ptr<NarInfo>> {
+        auto res = lookupNarInfos(uri, {hashPart});
+        return res.begin()->second;
+    }
+
+    std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupNarInfos(
+        const std::string & uri, const std::vector<std::string> & hashParts) override
+    {
+        std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> res;
+
+        auto now = time(0);
+
+        int cacheId;
+        {
+            auto state(_state.lock());
+            cacheId = getCache(*state, uri).id;
+        }
+
+        std::vector<std::string> missing;
+        bool mustFlush;
+
+        {
+            auto front(_front.lock());
+            for (auto & hashPart : hashParts) {
+                if (auto r = lookupFront(*front, cacheId, hashPart, now))
+                    res.insert_or_assign(hashPart, *r);
+                else
+                    missing.push_back(hashPart);
+            }
+            mustFlush = !front->pending.empty()
+                && std::chrono::steady_clock::now() - front->firstPending >= maxPendingTime;
+        }
+
+        if (mustFlush) flush();
+
+        if (missing.empty()) return res;
+
+        /* Do all lookups in a single transaction, so that we acquire
+           the database lock only once. */
+        std::vector<std::tuple<std::string, Outcome, std::shared_ptr<NarInfo>, time_t>> found;
+
+        retrySQLite<void>([&]() {
+            found.clear();
+
             auto state(_state.lock());
 
             auto & cache(getCache(*state, uri));
 
-            auto now = time(0);
+            SQLiteTxn txn(state->db);
+
+            for (auto & hashPart : missing) {
+                time_t timestamp = 0;
+                auto [outcome, narInfo] = queryNarInfo(*state, cache, hashPart, now, timestamp);
+                found.emplace_back(hashPart, outcome, narInfo, timestamp);
+            }
 
-            auto queryNAR(state->queryNAR.use()
-                (cache.id)
-                (hashPart)
-                (now - settings.ttlNegativeNarInfoCache)
-                (now - settings.ttlPositiveNarInfoCache));
-
-            if (!queryNAR.next())
-                return {oUnknown, 0};
-
-            if (!queryNAR.getInt(0))
-                return {oInvalid, 0};
-
-            auto namePart = queryNAR.getStr(1);
-            auto narInfo = make_ref<NarInfo>(StorePath(hashPart + "-" + namePart));
-            narInfo->url = queryNAR.getStr(2);
-            narInfo->compression = queryNAR.getStr(3);
-            if (!queryNAR.isNull(4))
-                narInfo->fileHash = Hash(queryNAR.getStr(4));
-            narInfo->fileSize = queryNAR.getInt(5);
-            narInfo->narHash = Hash(queryNAR.getStr(6));
-            narInfo->narSize = queryNAR.getInt(7);
-            for (auto & r : tokenizeString<Strings>(queryNAR.getStr(8), " "))
-                narInfo->references.insert(StorePath(r));
-            if (!queryNAR.isNull(9))
-                narInfo->deriver = StorePath(queryNAR.getStr(9));
-            for (auto & sig : tokenizeString<Strings>(queryNAR.getStr(10), " "))
-                narInfo->sigs.insert(sig);
-            narInfo->ca = parseContentAddressOpt(queryNAR.getStr(11));
-
-            return {oValid, narInfo};
+            txn.commit();
         });
+
+        auto front(_front.lock());
+
+        for (auto & [hashPart, outcome, narInfo, timestamp] : found) {
+            res.insert_or_assign(hashPart, std::make_pair(outcome, narInfo));
+            if (outcome != oUnknown)
+                front->entries.upsert({cacheId, hashPart}, FrontEntry{outcome, narInfo, timestamp});
+        }
+
+        return res;
     }
 
     void upsertNarInfo(
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<const ValidPathInfo> info) override
     {
-        retrySQLite<void>([&]() {
+        upsertNarInfos(uri, {{hashPart, info}}, false);
+    }
+
+    void upsertNarInfos(
+        const std::string & uri,
+        const std::vector<std::pair<std::string, std::shared_ptr<const ValidPathInfo>>> & infos,
+        bool flushNow) override
+    {
+        int cacheId;
+        {
             auto state(_state.lock());
+            cacheId = getCache(*state, uri).id;
+        }
+
+        auto now = time(0);
+
+        bool mustFlush;
+
+        {
+            auto front(_front.lock());
+
+            for (auto & [hashPart, info] : infos) {
+                std::shared_ptr<NarInfo> narInfo;
+                if (info) {
+                    auto p = std::dynamic_pointer_cast<const NarInfo>(info);
+                    narInfo = std::make_shared<NarInfo>(p ? *p : NarInfo(*info));
+                }
+                front->entries.upsert({cacheId, hashPart},
+                    FrontEntry{narInfo ? oValid : oInvalid, narInfo, now});
+                if (front->pending.empty())
+                    front->firstPending = std::chrono::steady_clock::now();
+                front->pending.push_back({cacheId, hashPart, info, now});
+            }
 
-            auto & cache(getCache(*state, uri));
+            mustFlush = flushNow
+                || front->pending.size() >= maxPending
+                || std::chrono::steady_clock::now() - front->firstPending >= maxPendingTime;
+        }
+
+        if (mustFlush) flush();
+    }
 
-            if (info) {
-
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
-
-                //assert(hashPart == storePathToHash(info->path));
-
-                state->insertNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (std::string(info->path.name()))
-                    (narInfo ? narInfo->url : "", narInfo != 0)
-                    (narInfo ? narInfo->compression : "", narInfo != 0)
-                    (narInfo && narInfo->fileHash ? narInfo->fileHash.to_string(Base32, true) : "", narInfo && narInfo->fileHash)
-                    (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
-                    (info->narHash.to_string(Base32, true))
-                    (info->narSize)
-                    (concatStringsSep(" ", info->shortRefs()))
-                    (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
-                    (concatStringsSep(" ", info->sigs))
-                    (renderContentAddress(info->ca))
-                    (time(0)).exec();
-
-            } else {
-                state->insertMissingNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (time(0)).exec();
+    void flush() override
+    {
+        std::vector<PendingWrite> pending;
+        {
+            auto front(_front.lock());
+            pending = std::move(front->pending);
+            front->pending.clear();
+        }
+
+        if (pending.empty()) return;
+
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            SQLiteTxn txn(state->db);
+
+            for (auto & write : pending) {
+                auto & info = write.info;
+
+                if (info) {
+
+                    auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
+
+                    Strings deltas;
+                    if (narInfo)
+                        for (auto & delta : narInfo->deltas)
+                            deltas.push_back(delta.to_string());
+
+                    state->insertNAR.use()
+                        (write.cacheId)
+                        (write.hashPart)
+                        (std::string(info->path.name()))
+                        (narInfo ? narInfo->url : "", narInfo != 0)
+                        (narInfo ? narInfo->compression : "", narInfo != 0)
+                        (narInfo && narInfo->fileHash ? narInfo->fileHash.to_string(Base32, true) : "", narInfo && narInfo->fileHash)
+                        (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
+                        (info->narHash.to_string(Base32, true))
+                        (info->narSize)
+                        (concatStringsSep(" ", info->shortRefs()))
+                        (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
+                        (concatStringsSep(" ", info->sigs))
+                        (renderContentAddress(info->ca))
+                        (concatStringsSep("\n", deltas), !deltas.empty())
+                        (write.timestamp).exec();
+
+                } else {
+                    state->insertMissingNAR.use()
+                        (write.cacheId)
+                        (write.hashPart)
+                        (write.timestamp).exec();
+                }
             }
+
+            txn.commit();
+        });
+
+        debug("wrote %d entries to the NAR info disk cache", pending.size());
+    }
+
+    std::set<std::string> lookupVerifiedSignatures(const std::vector<std::string> & keys) override
+    {
+        std::set<std::string> res;
+
+        if (keys.empty()) return res;
+
+        auto now = time(0);
+
+        retrySQLite<void>([&]() {
+            res.clear();
+
+            auto state(_state.lock());
+
+            SQLiteTxn txn(state->db);
+
+            for (auto & key : keys)
+                if (state->queryVerifiedSig.use()(key)(now - settings.ttlPositiveNarInfoCache).next())
+                    res.insert(key);
+
+            txn.commit();
+        });
+
+        return res;
+    }
+
+    void upsertVerifiedSignatures(const std::vector<std::string> & keys) override
+    {
+        if (keys.empty()) return;
+
+        auto now = time(0);
+
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            SQLiteTxn txn(state->db);
+
+            for (auto & key : keys)
+                state->insertVerifiedSig.use()(key)(now).exec();
+
+            txn.commit();
         });
     }
 };
@@ -13,12 +13,14 @@ public:
     virtual ~NarInfoDiskCache() { }
 
     virtual void createCache(const std::string & uri, const Path & storeDir,
-        bool wantMassQuery, int priority) = 0;
+        bool wantMassQuery, int priority, const std::string & presenceFilter) = 0;
 
     struct CacheInfo
     {
         bool wantMassQuery;
         int priority;
+        /* The file holding the cache's presence filter, if any. */
+        std::string presenceFilter;
     };
 
     virtual std::optional<CacheInfo> cacheExists(const std::string & uri) = 0;
@@ -29,6 +31,30 @@ public:
     virtual void upsertNarInfo(
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<const ValidPathInfo> info) = 0;
+
+    /* Look up several NARs at once, using a single database
+       transaction for those that are not in memory. */
+    virtual std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupNarInfos(
+        const std::string & uri, const std::vector<std::string> & hashParts) = 0;
+
+    /* Insert several NARs at once. Writes are normally buffered and
+       committed in batches; `flushNow' forces them to be written
+       immediately. */
+    virtual void upsertNarInfos(
+        const std::string & uri,
+        const std::vector<std::pair<std::string, std::shared_ptr<const ValidPathInfo>>> & infos,
+        bool flushNow = true) = 0;
+
+    /* Write all buffered entries to the database. */
+    virtual void flush() = 0;
+
+    /* Return which of `keys' identify signatures that were verified
+       before (see ValidPathInfo::checkSignature()). */
+    virtual std::set<std::string> lookupVerifiedSignatures(
+        const std::vector<std::string> & keys) = 0;
+
+    /* Record that the signatures identified by `keys' are valid. */
+    virtual void upsertVerifiedSignatures(const std::vector<std::string> & keys) = 0;
 };
 
 /* Return a singleton cache object that can be used concurrently by
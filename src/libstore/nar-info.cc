@@ -66,6 +66,13 @@ NarInfo::NarInfo(const Store & store, const std::string & s, const std::string &
             system = value;
         else if (name == "Sig")
             sigs.insert(value);
+        else if (name == "Delta") {
+            try {
+                deltas.push_back(Delta::parse(value));
+            } catch (Error &) {
+                corrupt();
+            }
+        }
         else if (name == "CA") {
             if (ca) corrupt();
             // FIXME: allow blank ca or require skipping field?
@@ -108,7 +115,29 @@ std::string NarInfo::to_string(const Store & store) const
     if (ca)
         res += "CA: " + renderContentAddress(*ca) + "\n";
 
+    for (auto & delta : deltas)
+        res += "Delta: " + delta.to_string() + "\n";
+
     return res;
 }
 
+NarInfo::Delta NarInfo::Delta::parse(const std::string & s)
+{
+    auto fields = tokenizeString<std::vector<std::string>>(s, " ");
+    uint64_t fileSize;
+    if (fields.size() != 4 || !string2Int(fields[3], fileSize))
+        throw Error("invalid delta '%s'", s);
+    return Delta {
+        .base = StorePath(fields[0]),
+        .baseNarHash = Hash(fields[1]),
+        .url = fields[2],
+        .fileSize = fileSize
+    };
+}
+
+std::string NarInfo::Delta::to_string() const
+{
+    return fmt("%s %s %s %d", base.to_string(), baseNarHash.to_string(Base32, true), url, fileSize);
+}
+
 }
@@ -14,6 +14,25 @@ struct NarInfo : ValidPathInfo
     uint64_t fileSize = 0;
     std::string system;
 
+    /* A binary delta (see makeDelta()) that reconstructs this NAR from
+       the NAR of another store path, typically an older version of the
+       same package. */
+    struct Delta
+    {
+        StorePath base;
+        Hash baseNarHash;
+        std::string url;
+        uint64_t fileSize = 0;
+
+        /* Parse or render the value of a 'Delta' field:
+           '<base> <baseNarHash> <url> <fileSize>', where <base> is the
+           base name of the store path. */
+        static Delta parse(const std::string & s);
+        std::string to_string() const;
+    };
+
+    std::vector<Delta> deltas;
+
     NarInfo() = delete;
     NarInfo(StorePath && path) : ValidPathInfo(std::move(path)) { }
     NarInfo(const ValidPathInfo & info) : ValidPathInfo(info) { }
@@ -1,6 +1,8 @@
 #include "util.hh"
 #include "local-store.hh"
 #include "globals.hh"
+#include "thread-pool.hh"
+#include "maintenance-priority.hh"
 
 #include <cstdlib>
 #include <cstring>
@@ -10,6 +12,12 @@
 #include <errno.h>
 #include <stdio.h>
 #include <regex>
+#include <fcntl.h>
+
+#if __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 
 namespace nix {
@@ -41,6 +49,109 @@ struct MakeReadOnly
 };
 
 
+/* Make `dst' share the extents of `src', which must have the same
+   contents, using the FIDEDUPERANGE ioctl.  Unlike replacing `dst'
+   with a hard link, this keeps its inode and metadata, and the kernel
+   verifies that the contents are identical.  Returns false if the
+   file system doesn't support it. */
+static bool dedupeFile(const Path & src, const Path & dst, off_t size)
+{
+#ifdef FIDEDUPERANGE
+    AutoCloseFD fdSrc = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fdSrc) throw SysError("opening '%1%'", src);
+
+    AutoCloseFD fdDst = open(dst.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fdDst) throw SysError("opening '%1%'", dst);
+
+    std::vector<char> buf(sizeof(file_dedupe_range) + sizeof(file_dedupe_range_info));
+    auto range = (file_dedupe_range *) buf.data();
+
+    /* The kernel may dedupe less than requested, so loop. */
+    off_t pos = 0;
+    while (pos < size) {
+        memset(buf.data(), 0, buf.size());
+        range->src_offset = pos;
+        range->src_length = size - pos;
+        range->dest_count = 1;
+        range->info[0].dest_fd = fdDst.get();
+        range->info[0].dest_offset = pos;
+
+        if (ioctl(fdSrc.get(), FIDEDUPERANGE, range) == -1) {
+            if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL || errno == EXDEV)
+                return false;
+            throw SysError("deduplicating '%1%' with '%2%'", dst, src);
+        }
+
+        auto & info = range->info[0];
+        if (info.status == FILE_DEDUPE_RANGE_DIFFERS)
+            throw Error("cannot deduplicate '%1%' with '%2%' because their contents differ", dst, src);
+        if (info.status < 0) {
+            errno = -info.status;
+            if (errno == EOPNOTSUPP || errno == EINVAL) return false;
+            throw SysError("deduplicating '%1%' with '%2%'", dst, src);
+        }
+        if (!info.bytes_deduped) return false;
+
+        pos += info.bytes_deduped;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+void FileHashesSink::createRegularFile(const Path & path)
+{
+    current = root + path;
+    executable = false;
+}
+
+
+void FileHashesSink::isExecutable()
+{
+    executable = true;
+}
+
+
+/* Hash the file the way hashPath() would serialise it. */
+void FileHashesSink::preallocateContents(unsigned long long size)
+{
+    sink = std::make_unique<HashSink>(htSHA256);
+    *sink << narVersionMagic1 << "(" << "type" << "regular";
+    if (executable) *sink << "executable" << "";
+    *sink << "contents" << size;
+    this->size = left = size;
+    if (!left) finishFile();
+}
+
+
+void FileHashesSink::receiveContents(unsigned char * data, unsigned int len)
+{
+    (*sink)(data, len);
+    left -= len;
+    if (!left) finishFile();
+}
+
+
+void FileHashesSink::finishFile()
+{
+    writePadding(size, *sink);
+    *sink << ")";
+    hashes.insert_or_assign(current, sink->finish().first);
+    sink.reset();
+}
+
+
+void FileHashesSink::createSymlink(const Path & path, const string & target)
+{
+    HashSink sink(htSHA256);
+    sink << narVersionMagic1 << "(" << "type" << "symlink" << "target" << target << ")";
+    hashes.insert_or_assign(root + path, sink.finish().first);
+}
+
+
 LocalStore::InodeHash LocalStore::loadInodeHash()
 {
     debug("loading hash inodes in memory");
@@ -63,34 +174,27 @@ LocalStore::InodeHash LocalStore::loadInodeHash()
 }
 
 
-Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash)
+Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, Sync<InodeHash> & inodeHash)
 {
     Strings names;
 
     AutoCloseDir dir(opendir(path.c_str()));
     if (!dir) throw SysError("opening directory '%1%'", path);
 
-    struct dirent * dirent;
-    while (errno = 0, dirent = readdir(dir.get())) { /* sic */
-        checkInterrupt();
-
-        if (inodeHash.count(dirent->d_ino)) {
-            debug(format("'%1%' is already linked") % dirent->d_name);
-            continue;
+    readDirectory(dir.get(), path, [&](std::string_view name, ino_t ino, unsigned char type) {
+        if (inodeHash.lock()->count(ino)) {
+            debug("'%1%' is already linked", name);
+            return;
         }
-
-        string name = dirent->d_name;
-        if (name == "." || name == "..") continue;
-        names.push_back(name);
-    }
-    if (errno) throw SysError("reading directory '%1%'", path);
+        names.emplace_back(name);
+    });
 
     return names;
 }
 
 
 void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
-    const Path & path, InodeHash & inodeHash)
+    const Path & path, Sync<InodeHash> & inodeHash, const FileHashes * fileHashes)
 {
     checkInterrupt();
 
@@ -114,7 +218,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     if (S_ISDIR(st.st_mode)) {
         Strings names = readDirectoryIgnoringInodes(path, inodeHash);
         for (auto & i : names)
-            optimisePath_(act, stats, path + "/" + i, inodeHash);
+            optimisePath_(act, stats, path + "/" + i, inodeHash, fileHashes);
         return;
     }
 
@@ -138,7 +242,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     }
 
     /* This can still happen on top-level files. */
-    if (st.st_nlink > 1 && inodeHash.count(st.st_ino)) {
+    if (st.st_nlink > 1 && inodeHash.lock()->count(st.st_ino)) {
         debug(format("'%1%' is already linked, with %2% other file(s)") % path % (st.st_nlink - 2));
         return;
     }
@@ -152,7 +256,12 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
        Also note that if `path' is a symlink, then we're hashing the
        contents of the symlink (i.e. the result of readlink()), not
        the contents of the target (which may not even exist). */
-    Hash hash = hashPath(htSHA256, path).first;
+    std::optional<Hash> known;
+    if (fileHashes) {
+        auto i = fileHashes->find(path);
+        if (i != fileHashes->end()) known = i->second;
+    }
+    Hash hash = known ? *known : hashPath(htSHA256, path).first;
     debug(format("'%1%' has hash '%2%'") % path % hash.to_string(Base32, true));
 
     /* Check if this is a known hash. */
@@ -162,7 +271,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     if (!pathExists(linkPath)) {
         /* Nope, create a hard link in the links directory. */
         if (link(path.c_str(), linkPath.c_str()) == 0) {
-            inodeHash.insert(st.st_ino);
+            inodeHash.lock()->insert(st.st_ino);
             return;
         }
 
@@ -205,6 +314,25 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
         goto retry;
     }
 
+    if (settings.optimiseMethod == omReflink && S_ISREG(st.st_mode)) {
+        /* Empty files have no extents to share. */
+        if (!st.st_size) return;
+
+        if (dedupeFile(linkPath, path, st.st_size)) {
+            printMsg(lvlTalkative, format("sharing extents of '%1%' with '%2%'") % path % linkPath);
+            stats.filesReflinked++;
+            stats.bytesFreed += st.st_size;
+            stats.blocksFreed += st.st_blocks;
+            if (act)
+                act->result(resFileLinked, st.st_size, st.st_blocks);
+            return;
+        }
+
+        static std::atomic<bool> warned{false};
+        if (!warned.exchange(true))
+            printInfo("the file system of '%s' does not support reflinks; using hard links instead", realStoreDir);
+    }
+
     printMsg(lvlTalkative, format("linking '%1%' to '%2%'") % path % linkPath);
 
     /* Make the containing directory writable, but only if it's not
@@ -263,23 +391,42 @@ void LocalStore::optimiseStore(OptimiseStats & stats)
 {
     Activity act(*logger, actOptimiseStore);
 
-    auto paths = queryAllValidPaths();
-    InodeHash inodeHash = loadInodeHash();
+    /* Paths that have been optimised before don't need to be looked
+       at again, since their contents can't change. */
+    auto paths = queryUnoptimisedPaths();
 
     act.progress(0, paths.size());
 
-    uint64_t done = 0;
+    if (paths.empty()) return;
+
+    Sync<InodeHash> inodeHash(loadInodeHash());
+
+    /* Hash and link the paths in parallel. */
+    ThreadPool pool;
+    std::mutex statsMutex;
+    std::atomic<uint64_t> done{0};
+
+    for (auto & i : paths)
+        pool.enqueue([&, path(i)]() {
+            addTempRoot(path);
+            if (!isValidPath(path)) return; /* path was GC'ed, probably */
+            OptimiseStats pathStats;
+            {
+                Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(path)));
+                optimisePath_(&act, pathStats, realStoreDir + "/" + std::string(path.to_string()), inodeHash);
+            }
+            registerOptimisedPath(path);
+            {
+                std::lock_guard<std::mutex> lock(statsMutex);
+                stats.filesLinked += pathStats.filesLinked;
+                stats.filesReflinked += pathStats.filesReflinked;
+                stats.bytesFreed += pathStats.bytesFreed;
+                stats.blocksFreed += pathStats.blocksFreed;
+            }
+            act.progress(++done, paths.size());
+        });
 
-    for (auto & i : paths) {
-        addTempRoot(i);
-        if (!isValidPath(i)) continue; /* path was GC'ed, probably */
-        {
-            Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(i)));
-            optimisePath_(&act, stats, realStoreDir + "/" + std::string(i.to_string()), inodeHash);
-        }
-        done++;
-        act.progress(done, paths.size());
-    }
+    pool.process();
 }
 
 static string showBytes(unsigned long long bytes)
@@ -293,18 +440,148 @@ void LocalStore::optimiseStore()
 
     optimiseStore(stats);
 
-    printInfo(
-        format("%1% freed by hard-linking %2% files")
-        % showBytes(stats.bytesFreed)
-        % stats.filesLinked);
+    if (stats.filesReflinked)
+        printInfo(
+            format("%1% freed by hard-linking %2% files and reflinking %3% files")
+            % showBytes(stats.bytesFreed)
+            % stats.filesLinked
+            % stats.filesReflinked);
+    else
+        printInfo(
+            format("%1% freed by hard-linking %2% files")
+            % showBytes(stats.bytesFreed)
+            % stats.filesLinked);
+}
+
+/* Collect the files below `path' that optimisePath_() would hash. */
+static void findLinkableFiles(const Path & path, std::vector<Path> & files)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st))
+        throw SysError("getting attributes of path '%1%'", path);
+
+    if (S_ISDIR(st.st_mode)) {
+        AutoCloseDir dir(opendir(path.c_str()));
+        if (!dir) throw SysError("opening directory '%1%'", path);
+        readDirectory(dir.get(), path, [&](std::string_view name, ino_t ino, unsigned char type) {
+            findLinkableFiles(path + "/" + std::string(name), files);
+        });
+        return;
+    }
+
+    if ((S_ISREG(st.st_mode) && !(st.st_mode & S_IWUSR))
+#if CAN_LINK_SYMLINK
+        || S_ISLNK(st.st_mode)
+#endif
+        )
+        files.push_back(path);
 }
 
-void LocalStore::optimisePath(const Path & path)
+void LocalStore::optimisePath(const Path & path, const FileHashes * fileHashes)
 {
     OptimiseStats stats;
-    InodeHash inodeHash;
+    Sync<InodeHash> inodeHash;
+
+    if (!settings.autoOptimiseStore) return;
+
+    /* Leave paths whose files would have to be read again to the
+       background optimiser, as long as its queue isn't full. They
+       are queued once registerValidPaths() registers them. */
+    if (!fileHashes && settings.autoOptimiseQueueSize) {
+        auto queued = queryOptimiseQueueLength();
+        auto state(_state.lock());
+        if (queued + state->toOptimise.size() < settings.autoOptimiseQueueSize) {
+            state->toOptimise.insert(std::string(baseNameOf(path)));
+            return;
+        }
+    }
+
+    /* Without known hashes, hash the files of the path in parallel
+       first, rather than one at a time while linking them. */
+    FileHashes hashes;
+    if (!fileHashes) {
+        std::vector<Path> files;
+        findLinkableFiles(path, files);
+        if (files.size() > 1) {
+            auto results = hashPaths(htSHA256, files);
+            for (size_t n = 0; n < files.size(); n++)
+                hashes.emplace(files[n], results[n].first);
+            fileHashes = &hashes;
+        }
+    }
+
+    optimisePath_(nullptr, stats, path, inodeHash, fileHashes);
+}
+
+
+
+void LocalStore::startOptimiser()
+{
+    {
+        auto state(_state.lock());
+        state->optimiserWakeup = true;
+        if (state->optimiserRunning) return;
+        state->optimiserRunning = true;
+    }
+
+    std::lock_guard<std::mutex> lock(optimiserMutex);
+    if (optimiserThread.joinable())
+        optimiserThread.join();
+    optimiserThread = std::thread([this]() { runOptimiser(); });
+}
+
+
+void LocalStore::runOptimiser()
+{
+    try {
+        /* Only one process works through the queue at a time. Paths
+           queued by the others are picked up by it, or by whoever
+           queues the next path. */
+        AutoCloseFD fdLock = openLockFile(stateDir + "/optimise.lock", true);
+
+        if (lockFile(fdLock.get(), ltWrite, false)) {
+
+            /* Only use the disk when nobody else needs it, unless
+               configured otherwise. */
+            MaintenancePriority priority(realStoreDir, false, "idle");
+
+            Sync<InodeHash> inodeHash;
+
+            while (true) {
+                {
+                    auto state(_state.lock());
+                    state->optimiserWakeup = false;
+                }
+
+                auto paths = queryPendingOptimisations(100);
+
+                if (paths.empty()) {
+                    auto state(_state.lock());
+                    if (state->optimiserWakeup) continue;
+                    break;
+                }
+
+                for (auto & path : paths) {
+                    try {
+                        addTempRoot(path);
+                        if (isValidPath(path)) {
+                            OptimiseStats stats;
+                            optimisePath_(nullptr, stats, realStoreDir + "/" + std::string(path.to_string()), inodeHash);
+                            registerOptimisedPath(path);
+                        }
+                    } catch (Error & e) {
+                        printError("error deduplicating '%s': %s", printStorePath(path), e.msg());
+                    }
+                    finishOptimisation(path);
+                }
+            }
+        }
+    } catch (...) {
+        ignoreException();
+    }
 
-    if (settings.autoOptimiseStore) optimisePath_(nullptr, stats, path, inodeHash);
+    auto state(_state.lock());
+    state->optimiserRunning = false;
 }
 
 
@@ -4,6 +4,28 @@ namespace nix {
 
 MakeError(BadStorePath, Error);
 
+/* Lookup tables for the characters allowed in the hash part and in
+   the name of store paths, since these checks run for every path that
+   is parsed. */
+struct CharClasses
+{
+    bool base32[256] = {};
+    bool name[256] = {};
+
+    constexpr CharClasses()
+    {
+        for (char c : std::string_view("0123456789abcdfghijklmnpqrsvwxyz"))
+            base32[(unsigned char) c] = true;
+        for (int c = 0; c < 256; ++c)
+            name[c] = (c >= '0' && c <= '9')
+                || (c >= 'a' && c <= 'z')
+                || (c >= 'A' && c <= 'Z')
+                || c == '+' || c == '-' || c == '.' || c == '_' || c == '?' || c == '=';
+    }
+};
+
+static constexpr CharClasses charClasses;
+
 static void checkName(std::string_view path, std::string_view name)
 {
     if (name.empty())
@@ -11,10 +33,7 @@ static void checkName(std::string_view path, std::string_view name)
     if (name.size() > 211)
         throw BadStorePath("store path '%s' has a name longer than 211 characters", path);
     for (auto c : name)
-        if (!((c >= '0' && c <= '9')
-                || (c >= 'a' && c <= 'z')
-                || (c >= 'A' && c <= 'Z')
-                || c == '+' || c == '-' || c == '.' || c == '_' || c == '?' || c == '='))
+        if (!charClasses.name[(unsigned char) c])
             throw BadStorePath("store path '%s' contains illegal character '%s'", path, c);
 }
 
@@ -24,8 +43,7 @@ StorePath::StorePath(std::string_view _baseName)
     if (baseName.size() < HashLen + 1)
         throw BadStorePath("'%s' is too short to be a valid store path", baseName);
     for (auto c : hashPart())
-        if (c == 'e' || c == 'o' || c == 'u' || c == 't'
-            || !((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')))
+        if (!charClasses.base32[(unsigned char) c])
             throw BadStorePath("store path '%s' contains illegal base-32 character '%s'", baseName, c);
     checkName(baseName, name());
 }
@@ -45,6 +63,16 @@ StorePath StorePath::dummy("ffffffffffffffffffffffffffffffff-x");
 
 StorePath Store::parseStorePath(std::string_view path) const
 {
+    /* Fast path for the common case of a path that is already
+       canonical: '<storeDir>/<base name>' where the base name
+       contains no slashes and isn't '.' or '..' (which StorePath
+       rejects anyway, since they're too short). */
+    if (path.size() > storeDir.size() + 1
+        && path.compare(0, storeDir.size(), storeDir) == 0
+        && path[storeDir.size()] == '/'
+        && path.find('/', storeDir.size() + 1) == std::string_view::npos)
+        return StorePath(path.substr(storeDir.size() + 1));
+
     auto p = canonPath(std::string(path));
     if (dirOf(p) != storeDir)
         throw BadStorePath("path '%s' is not in the Nix store", p);
@@ -74,7 +102,10 @@ StorePathSet Store::parseStorePathSet(const PathSet & paths) const
 
 std::string Store::printStorePath(const StorePath & path) const
 {
-    return (storeDir + "/").append(path.to_string());
+    std::string res;
+    res.reserve(storeDir.size() + 1 + path.to_string().size());
+    res.append(storeDir).append("/").append(path.to_string());
+    return res;
 }
 
 PathSet Store::printStorePathSet(const StorePathSet & paths) const
@@ -1,9 +1,12 @@
 #include "pathlocks.hh"
 #include "util.hh"
 #include "sync.hh"
+#include "daemon-metrics.hh"
+#include "finally.hh"
 
 #include <cerrno>
 #include <cstdlib>
+#include <condition_variable>
 
 #include <fcntl.h>
 #include <sys/types.h>
@@ -68,6 +71,43 @@ bool lockFile(int fd, LockType lockType, bool wait)
 }
 
 
+/* The lock files held by PathLocks objects in this process. Since
+   flock() locks belong to open file descriptions, a thread or goal
+   trying to lock a path that another part of this process holds
+   would otherwise open the lock file and block in (or poll) flock()
+   for it. Checking this table first lets it fail or wait without
+   touching the file system. The file lock is still taken to exclude
+   other processes. */
+static Sync<std::set<Path>> processLocks;
+static std::condition_variable processLocksCV;
+
+
+/* Claim `lockPath' in the process lock table, waiting for another
+   thread to release it if `wait' is set. Returns false if the path
+   is held and `wait' is not set. */
+static bool lockInProcess(const Path & lockPath, const string & waitMsg, bool wait)
+{
+    auto locks(processLocks.lock());
+    if (locks->count(lockPath)) {
+        if (!wait) return false;
+        if (waitMsg != "") printError(waitMsg);
+        while (locks->count(lockPath)) {
+            checkInterrupt();
+            locks.wait_for(processLocksCV, std::chrono::seconds(1));
+        }
+    }
+    locks->insert(lockPath);
+    return true;
+}
+
+
+static void unlockInProcess(const Path & lockPath)
+{
+    processLocks.lock()->erase(lockPath);
+    processLocksCV.notify_all();
+}
+
+
 PathLocks::PathLocks()
     : deletePaths(false)
 {
@@ -98,6 +138,19 @@ bool PathLocks::lockPaths(const PathSet & paths,
 
         debug(format("locking path '%1%'") % path);
 
+        auto start = std::chrono::steady_clock::now();
+
+        if (!lockInProcess(lockPath, waitMsg, wait)) {
+            unlock();
+            return false;
+        }
+
+        /* Release the claim if we don't end up holding the lock. */
+        Finally releaseClaim([&]() {
+            if (fds.empty() || fds.back().second != lockPath)
+                unlockInProcess(lockPath);
+        });
+
         AutoCloseFD fd;
 
         while (1) {
@@ -137,6 +190,14 @@ bool PathLocks::lockPaths(const PathSet & paths,
 
         /* Use borrow so that the descriptor isn't closed. */
         fds.push_back(FDPair(fd.release(), lockPath));
+
+        auto waited = std::chrono::steady_clock::now() - start;
+        if (waited >= std::chrono::milliseconds(1)) {
+            auto micros = std::chrono::duration_cast<std::chrono::microseconds>(waited).count();
+            debug("waited %.3f s for the lock on '%s'", micros / 1e6, path);
+            daemonMetrics->pathLockWaits++;
+            daemonMetrics->pathLockWaitMicros += micros;
+        }
     }
 
     return true;
@@ -164,6 +225,8 @@ void PathLocks::unlock()
                 i.second);
 
         debug(format("lock released on '%1%'") % i.second);
+
+        unlockInProcess(i.second);
     }
 
     fds.clear();
@@ -0,0 +1,161 @@
+#include "local-store.hh"
+#include "globals.hh"
+#include "util.hh"
+
+
+namespace nix {
+
+
+void LocalStore::runPostBuildHook(const StorePathSet & drvPaths, const StorePathSet & outputs)
+{
+    assert(!drvPaths.empty());
+
+    Activity act(*logger, lvlInfo, actPostBuildHook,
+        fmt("running post-build-hook '%s'", settings.postBuildHook),
+        Logger::Fields{printStorePath(*drvPaths.begin())});
+    PushActivity pact(act.id);
+    std::map<std::string, std::string> hookEnvironment = getEnv();
+
+    /* With batching, DRV_PATH lists several derivations in the same
+       way as OUT_PATHS. */
+    hookEnvironment.emplace("DRV_PATH", chomp(concatStringsSep(" ", printStorePathSet(drvPaths))));
+    hookEnvironment.emplace("OUT_PATHS", chomp(concatStringsSep(" ", printStorePathSet(outputs))));
+
+    RunOptions opts(settings.postBuildHook, {});
+    opts.environment = hookEnvironment;
+
+    struct LogSink : Sink {
+        Activity & act;
+        std::string currentLine;
+
+        LogSink(Activity & act) : act(act) { }
+
+        void operator() (const unsigned char * data, size_t len) override {
+            for (size_t i = 0; i < len; i++) {
+                auto c = data[i];
+
+                if (c == '\n') {
+                    flushLine();
+                } else {
+                    currentLine += c;
+                }
+            }
+        }
+
+        void flushLine() {
+            act.result(resPostBuildLogLine, currentLine);
+            currentLine.clear();
+        }
+
+        ~LogSink() {
+            if (currentLine != "") {
+                currentLine += '\n';
+                flushLine();
+            }
+        }
+    };
+    LogSink sink(act);
+
+    opts.standardOut = &sink;
+    opts.mergeStderrToStdout = true;
+    runProgram2(opts);
+}
+
+
+void LocalStore::queuePostBuildHook(const StorePath & drvPath, const StorePathSet & outputs)
+{
+    {
+        auto state(postBuildHooks.lock());
+
+        /* Apply backpressure: rather than letting the queue grow
+           without bound when the hook is slower than the builds,
+           hold up the build until there is space. */
+        while (settings.postBuildHookQueueSize && state->pending.size() >= settings.postBuildHookQueueSize)
+            state.wait(postBuildHookDone);
+
+        state->pending.emplace_back(drvPath, outputs);
+        for (auto & path : outputs) {
+            state->inFlight.insert(path);
+            state->failed.erase(path);
+        }
+
+        if (state->threads.empty())
+            for (unsigned int n = 0; n < std::max(1U, settings.postBuildHookJobs.get()); n++)
+                state->threads.emplace_back([this]() { postBuildHookThread(); });
+    }
+
+    postBuildHookQueued.notify_one();
+}
+
+
+void LocalStore::postBuildHookThread()
+{
+    while (true) {
+        StorePathSet drvPaths, outputs;
+
+        {
+            auto state(postBuildHooks.lock());
+            while (state->pending.empty() && !state->quit)
+                state.wait(postBuildHookQueued);
+            if (state->pending.empty()) return;
+
+            /* Pass the outputs of all builds that finished while the
+               hook was busy to a single invocation. */
+            while (!state->pending.empty()
+                && (!settings.postBuildHookBatchSize || drvPaths.size() < settings.postBuildHookBatchSize))
+            {
+                auto & [drvPath, paths] = state->pending.front();
+                drvPaths.insert(drvPath);
+                outputs.insert(paths.begin(), paths.end());
+                state->pending.pop_front();
+            }
+        }
+
+        /* Make room for builds waiting to queue. */
+        postBuildHookDone.notify_all();
+
+        std::optional<std::string> error;
+
+        try {
+            runPostBuildHook(drvPaths, outputs);
+        } catch (std::exception & e) {
+            printError("error: post-build hook failed on '%s': %s",
+                concatStringsSep(", ", printStorePathSet(drvPaths)), e.what());
+            error = e.what();
+        }
+
+        {
+            auto state(postBuildHooks.lock());
+            for (auto & path : outputs) {
+                state->inFlight.erase(path);
+                if (error) state->failed.insert_or_assign(path, *error);
+            }
+        }
+
+        postBuildHookDone.notify_all();
+    }
+}
+
+
+void LocalStore::waitForPostBuildHook(const StorePathSet & outputs)
+{
+    auto state(postBuildHooks.lock());
+
+    auto busy = [&]() {
+        for (auto & path : outputs)
+            if (state->inFlight.count(path)) return true;
+        return false;
+    };
+
+    while (busy())
+        state.wait(postBuildHookDone);
+
+    for (auto & path : outputs) {
+        auto i = state->failed.find(path);
+        if (i != state->failed.end())
+            throw Error("post-build hook failed on '%s': %s", printStorePath(path), i->second);
+    }
+}
+
+
+}
@@ -0,0 +1,115 @@
+#include "presence-filter.hh"
+#include "hash.hh"
+#include "util.hh"
+
+namespace nix {
+
+/* With 7 hashes, 10 bits per path give a false positive rate of
+   about 0.8%. */
+static const uint64_t bitsPerPath = 10;
+
+
+PresenceFilter::PresenceFilter(uint64_t capacity)
+    : timestamp(time(0))
+    , bits(std::max(capacity, (uint64_t) 64) * bitsPerPath / 8, 0)
+{
+}
+
+
+PresenceFilter::PresenceFilter(const std::string & s, const std::string & whence)
+{
+    auto corrupt = [&]() {
+        throw Error("presence filter '%s' is corrupt", whence);
+    };
+
+    auto end = s.find("\n\n");
+    if (end == std::string::npos) corrupt();
+
+    uint64_t size = 0;
+    bool haveVersion = false;
+
+    for (auto & line : tokenizeString<Strings>(s.substr(0, end), "\n")) {
+        auto colon = line.find(": ");
+        if (colon == std::string::npos) corrupt();
+        auto name = line.substr(0, colon);
+        auto value = line.substr(colon + 2);
+
+        if (name == "PresenceFilter") {
+            if (value != "1")
+                throw Error("presence filter '%s' has unsupported version %s", whence, value);
+            haveVersion = true;
+        }
+        else if (name == "Timestamp") {
+            if (!string2Int(value, timestamp)) corrupt();
+        }
+        else if (name == "Count") {
+            if (!string2Int(value, count)) corrupt();
+        }
+        else if (name == "Hashes") {
+            if (!string2Int(value, hashes) || !hashes) corrupt();
+        }
+        else if (name == "Size") {
+            if (!string2Int(value, size)) corrupt();
+        }
+    }
+
+    bits = s.substr(end + 2);
+
+    if (!haveVersion || bits.empty() || bits.size() != size) corrupt();
+}
+
+
+uint64_t PresenceFilter::capacity() const
+{
+    return bits.size() * 8 / bitsPerPath;
+}
+
+
+/* Call `f' with the index of each bit belonging to `hashPart'. The
+   indices are derived from two 64-bit hashes by double hashing,
+   which is as good as independent hash functions for a Bloom
+   filter. */
+template<typename F>
+static bool forEachBit(const PresenceFilter & filter, std::string_view hashPart, F f)
+{
+    auto h = hashString(htSHA256, std::string(hashPart));
+    uint64_t h1 = 0, h2 = 0;
+    for (int i = 0; i < 8; i++) {
+        h1 = (h1 << 8) | h.hash[i];
+        h2 = (h2 << 8) | h.hash[i + 8];
+    }
+    h2 |= 1;
+
+    uint64_t nrBits = filter.bits.size() * 8;
+    for (unsigned int i = 0; i < filter.hashes; i++)
+        if (!f((h1 + i * h2) % nrBits)) return false;
+    return true;
+}
+
+
+void PresenceFilter::insert(std::string_view hashPart)
+{
+    forEachBit(*this, hashPart, [&](uint64_t n) {
+        bits[n / 8] |= 1 << (n % 8);
+        return true;
+    });
+    count++;
+}
+
+
+bool PresenceFilter::mayContain(std::string_view hashPart) const
+{
+    return forEachBit(*this, hashPart, [&](uint64_t n) {
+        return bits[n / 8] & (1 << (n % 8));
+    });
+}
+
+
+std::string PresenceFilter::to_string() const
+{
+    return fmt("PresenceFilter: 1\nTimestamp: %d\nCount: %d\nHashes: %d\nSize: %d\n\n",
+        timestamp, count, hashes, bits.size())
+        + bits;
+}
+
+}
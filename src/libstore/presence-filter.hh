@@ -0,0 +1,44 @@
+#pragma once
+
+#include "types.hh"
+
+#include <string_view>
+
+namespace nix {
+
+/* A Bloom filter of the hash parts of the paths in a binary cache.
+   Caches can publish one (see 'write-presence-filter') so that
+   clients don't have to ask for .narinfo files that don't exist.
+   Lookups may yield false positives, about 1% when the filter is
+   full, but never false negatives. */
+struct PresenceFilter
+{
+    /* When the filter was last rebuilt from the full contents of the
+       cache, as opposed to having paths added to it. */
+    time_t timestamp = 0;
+
+    /* The number of paths inserted. */
+    uint64_t count = 0;
+
+    /* The number of bits set for each path. */
+    unsigned int hashes = 7;
+
+    std::string bits;
+
+    /* Create an empty filter sized for `capacity' paths. */
+    PresenceFilter(uint64_t capacity);
+
+    PresenceFilter(const std::string & s, const std::string & whence);
+
+    /* The number of paths the filter can hold before its false
+       positive rate exceeds the intended one. */
+    uint64_t capacity() const;
+
+    void insert(std::string_view hashPart);
+
+    bool mayContain(std::string_view hashPart) const;
+
+    std::string to_string() const;
+};
+
+}
@@ -5,43 +5,160 @@
 
 #include <map>
 #include <cstdlib>
+#include <cstring>
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 namespace nix {
 
 
-static unsigned int refLength = 32; /* characters */
+static const size_t refLength = 32; /* characters */
 
 
-static void search(const unsigned char * s, size_t len,
-    StringSet & hashes, StringSet & seen)
+/* A set of hash parts to search for, as an open-addressing hash table
+   that can be probed with a pointer into the data being scanned,
+   without constructing a string. */
+struct RefSet
 {
-    static bool initialised = false;
-    static bool isBase32[256];
-    if (!initialised) {
+    std::vector<std::string> hashes;
+
+    /* Indices into `hashes' plus one, or 0 for empty slots. */
+    std::vector<uint32_t> table;
+    size_t mask = 0;
+
+    std::vector<bool> found;
+    StringSet seen;
+
+    /* The offset of the first occurrence of each hash. */
+    std::vector<uint64_t> offsets;
+
+    static size_t hash(const unsigned char * s)
+    {
+        uint64_t h;
+        memcpy(&h, s, sizeof(h));
+        return (h * 0x9e3779b97f4a7c15ULL) >> 32;
+    }
+
+    void build()
+    {
+        size_t size = 16;
+        while (size < hashes.size() * 2) size *= 2;
+        table.assign(size, 0);
+        mask = size - 1;
+        found.assign(hashes.size(), false);
+        offsets.assign(hashes.size(), 0);
+        for (size_t i = 0; i < hashes.size(); ++i) {
+            auto slot = hash((const unsigned char *) hashes[i].data()) & mask;
+            while (table[slot]) slot = (slot + 1) & mask;
+            table[slot] = i + 1;
+        }
+    }
+
+    /* Check whether the refLength bytes at `s' are one of the
+       hashes. */
+    void probe(const unsigned char * s, size_t offset)
+    {
+        for (auto slot = hash(s) & mask; table[slot]; slot = (slot + 1) & mask) {
+            auto i = table[slot] - 1;
+            if (memcmp(hashes[i].data(), s, refLength)) continue;
+            if (!found[i]) {
+                found[i] = true;
+                offsets[i] = offset;
+                debug("found reference to '%1%' at offset '%2%'", hashes[i], offset);
+                seen.insert(hashes[i]);
+            }
+            return;
+        }
+    }
+};
+
+
+struct Base32Table
+{
+    bool isBase32[256];
+
+    Base32Table()
+    {
         for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
         for (unsigned int i = 0; i < base32Chars.size(); ++i)
             isBase32[(unsigned char) base32Chars[i]] = true;
-        initialised = true;
     }
+};
+
 
-    for (size_t i = 0; i + refLength <= len; ) {
-        int j;
-        bool match = true;
-        for (j = refLength - 1; j >= 0; --j)
-            if (!isBase32[(unsigned char) s[i + j]]) {
-                i += j + 1;
-                match = false;
-                break;
+#if __SSE2__
+/* Return a bit mask of the bytes in `s[0..15]' that are base-32
+   characters ([0-9a-z] minus 'e', 'o', 'u' and 't'). */
+static inline unsigned int base32Mask(const unsigned char * s)
+{
+    auto v = _mm_loadu_si128((const __m128i *) s);
+    auto inRange = [&](char lo, char hi) {
+        return _mm_and_si128(
+            _mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+            _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+    };
+    auto excluded = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('e')), _mm_cmpeq_epi8(v, _mm_set1_epi8('o'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('u')), _mm_cmpeq_epi8(v, _mm_set1_epi8('t'))));
+    auto m = _mm_or_si128(inRange('0', '9'), _mm_andnot_si128(excluded, inRange('a', 'z')));
+    return _mm_movemask_epi8(m);
+}
+#endif
+
+
+/* Probe every window of refLength base-32 characters in `s[0..len)'
+   whose start is below `maxStart'. `base' is the offset of `s' in the
+   NAR, for debug messages. */
+static void search(const unsigned char * s, size_t len, size_t maxStart,
+    RefSet & refs, uint64_t base)
+{
+    static const Base32Table table;
+    auto & isBase32 = table.isBase32;
+
+    /* Length of the run of base-32 characters ending at `i'. */
+    size_t run = 0;
+
+    size_t i = 0;
+
+    while (i < len) {
+
+#if __SSE2__
+        /* Skip or consume blocks of 16 bytes that are entirely
+           non-base-32 or entirely base-32. Mixed blocks are handled
+           byte by byte. */
+        if (i + 16 <= len) {
+            auto m = base32Mask(s + i);
+            if (m == 0) {
+                run = 0;
+                i += 16;
+                continue;
+            }
+            if (m == 0xffff) {
+                for (size_t j = 0; j < 16; ++j) {
+                    if (++run >= refLength) {
+                        auto start = i + j + 1 - refLength;
+                        if (start >= maxStart) return;
+                        refs.probe(s + start, base + start);
+                    }
+                }
+                i += 16;
+                continue;
+            }
+        }
+#endif
+
+        auto end = std::min(len, i + 16);
+        for (; i < end; ++i) {
+            if (!isBase32[s[i]]) { run = 0; continue; }
+            if (++run >= refLength) {
+                auto start = i + 1 - refLength;
+                if (start >= maxStart) return;
+                refs.probe(s + start, base + start);
             }
-        if (!match) continue;
-        string ref((const char *) s + i, refLength);
-        if (hashes.erase(ref)) {
-            debug(format("found reference to '%1%' at offset '%2%'")
-                  % ref % i);
-            seen.insert(ref);
         }
-        ++i;
     }
 }
 
@@ -49,10 +166,16 @@ static void search(const unsigned char * s, size_t len,
 struct RefScanSink : Sink
 {
     HashSink hashSink;
-    StringSet hashes;
-    StringSet seen;
+    RefSet refs;
+
+    /* The last refLength - 1 bytes seen, for references that span
+       two fragments. */
+    unsigned char tail[refLength - 1];
+    size_t tailLen = 0;
 
-    string tail;
+    uint64_t pos = 0;
+
+    Sink * narSink = nullptr;
 
     RefScanSink() : hashSink(htSHA256) { }
 
@@ -64,25 +187,41 @@ void RefScanSink::operator () (const unsigned char * data, size_t len)
 {
     hashSink(data, len);
 
+    if (narSink) (*narSink)(data, len);
+
     /* It's possible that a reference spans the previous and current
-       fragment, so search in the concatenation of the tail of the
-       previous fragment and the start of the current fragment. */
-    string s = tail + string((const char *) data, len > refLength ? refLength : len);
-    search((const unsigned char *) s.data(), s.size(), hashes, seen);
+       fragment, so search the windows that start in the tail of the
+       previous fragment. */
+    if (tailLen) {
+        unsigned char buf[2 * (refLength - 1)];
+        auto n = std::min(len, refLength - 1);
+        memcpy(buf, tail, tailLen);
+        memcpy(buf + tailLen, data, n);
+        search(buf, tailLen + n, tailLen, refs, pos - tailLen);
+    }
 
-    search(data, len, hashes, seen);
+    search(data, len, len, refs, pos);
 
-    size_t tailLen = len <= refLength ? len : refLength;
-    tail =
-        string(tail, tail.size() < refLength - tailLen ? 0 : tail.size() - (refLength - tailLen)) +
-        string((const char *) data + len - tailLen, tailLen);
+    pos += len;
+
+    /* Keep the last refLength - 1 bytes. */
+    if (len >= refLength - 1) {
+        memcpy(tail, data + len - (refLength - 1), refLength - 1);
+        tailLen = refLength - 1;
+    } else {
+        auto keep = std::min(tailLen, refLength - 1 - len);
+        memmove(tail, tail + tailLen - keep, keep);
+        memcpy(tail + keep, data, len);
+        tailLen = keep + len;
+    }
 }
 
 
 PathSet scanForReferences(const string & path,
-    const PathSet & refs, HashResult & hash)
+    const PathSet & refs, HashResult & hash, Sink * narSink)
 {
     RefScanSink sink;
+    sink.narSink = narSink;
     std::map<string, Path> backMap;
 
     /* For efficiency (and a higher hit rate), just search for the
@@ -97,16 +236,18 @@ PathSet scanForReferences(const string & path,
         assert(s.size() == refLength);
         assert(backMap.find(s) == backMap.end());
         // parseHash(htSHA256, s);
-        sink.hashes.insert(s);
+        sink.refs.hashes.push_back(s);
         backMap[s] = i;
     }
 
+    sink.refs.build();
+
     /* Look for the hashes in the NAR dump of the path. */
     dumpPath(path, sink);
 
     /* Map the hashes found back to their store paths. */
     PathSet found;
-    for (auto & i : sink.seen) {
+    for (auto & i : sink.refs.seen) {
         std::map<string, Path>::iterator j;
         if ((j = backMap.find(i)) == backMap.end()) abort();
         found.insert(j->second);
@@ -118,38 +259,57 @@ PathSet scanForReferences(const string & path,
 }
 
 
+std::map<std::string, size_t> findReferences(std::string_view data, const StringSet & hashes)
+{
+    RefSet refs;
+    for (auto & hash : hashes) {
+        assert(hash.size() == refLength);
+        refs.hashes.push_back(hash);
+    }
+    refs.build();
+
+    search((const unsigned char *) data.data(), data.size(), data.size(), refs, 0);
+
+    std::map<std::string, size_t> res;
+    for (size_t i = 0; i < refs.hashes.size(); ++i)
+        if (refs.found[i])
+            res.emplace(refs.hashes[i], refs.offsets[i]);
+    return res;
+}
+
+
 RewritingSink::RewritingSink(const std::string & from, const std::string & to, Sink & nextSink)
-    : from(from), to(to), nextSink(nextSink)
+    : RewritingSink(StringMap{{from, to}}, nextSink)
 {
     assert(from.size() == to.size());
 }
 
-void RewritingSink::operator () (const unsigned char * data, size_t len)
+RewritingSink::RewritingSink(const StringMap & rewrites, Sink & nextSink)
+    : rewriter(rewrites), nextSink(nextSink)
 {
-    std::string s(prev);
-    s.append((const char *) data, len);
-
-    size_t j = 0;
-    while ((j = s.find(from, j)) != string::npos) {
-        matches.push_back(pos + j);
-        s.replace(j, from.size(), to);
-    }
-
-    prev = s.size() < from.size() ? s : std::string(s, s.size() - from.size() + 1, from.size() - 1);
-
-    auto consumed = s.size() - prev.size();
+}
 
-    pos += consumed;
+void RewritingSink::write(const std::string & out, const std::vector<size_t> & offsets)
+{
+    for (auto offset : offsets)
+        matches.push_back(pos + offset);
+    pos += out.size();
+    if (!out.empty()) nextSink((unsigned char *) out.data(), out.size());
+}
 
-    if (consumed) nextSink((unsigned char *) s.data(), consumed);
+void RewritingSink::operator () (const unsigned char * data, size_t len)
+{
+    std::string out;
+    std::vector<size_t> offsets;
+    rewriter.feed(stream, std::string_view((const char *) data, len), out, &offsets);
+    write(out, offsets);
 }
 
 void RewritingSink::flush()
 {
-    if (prev.empty()) return;
-    pos += prev.size();
-    nextSink((unsigned char *) prev.data(), prev.size());
-    prev.clear();
+    std::string out;
+    rewriter.finish(stream, out);
+    write(out, {});
 }
 
 HashModuloSink::HashModuloSink(HashType ht, const std::string & modulus)
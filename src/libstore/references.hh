@@ -5,22 +5,43 @@
 
 namespace nix {
 
+/* Return the paths in `refs' whose hash parts occur in the NAR
+   serialisation of `path', and set `hash' to the SHA-256 hash of the
+   NAR. If `narSink' is given, the NAR is also written to it, so that
+   other information can be computed from it in the same pass. */
 PathSet scanForReferences(const Path & path, const PathSet & refs,
-    HashResult & hash);
+    HashResult & hash, Sink * narSink = nullptr);
 
+/* Return the offset of the first occurrence in `data' of each of
+   `hashes' (the hash parts of store paths). Hashes that don't occur
+   are omitted. */
+std::map<std::string, size_t> findReferences(std::string_view data, const StringSet & hashes);
+
+/* A sink that applies a set of string rewrites in a single pass (see
+   StringRewriter) and passes the result on to `nextSink'. */
 struct RewritingSink : Sink
 {
-    std::string from, to, prev;
+    const StringRewriter rewriter;
+    StringRewriter::Stream stream;
     Sink & nextSink;
+
+    /* The number of bytes written to `nextSink'. */
     uint64_t pos = 0;
 
+    /* The offsets of the replacements in the output. */
     std::vector<uint64_t> matches;
 
     RewritingSink(const std::string & from, const std::string & to, Sink & nextSink);
 
+    RewritingSink(const StringMap & rewrites, Sink & nextSink);
+
     void operator () (const unsigned char * data, size_t len) override;
 
     void flush();
+
+private:
+
+    void write(const std::string & out, const std::vector<size_t> & offsets);
 };
 
 struct HashModuloSink : AbstractHashSink
@@ -1,16 +1,23 @@
 #include "remote-fs-accessor.hh"
 #include "nar-accessor.hh"
+#include "binary-cache-store.hh"
+#include "nar-info.hh"
 #include "json.hh"
 
+#include <nlohmann/json.hpp>
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/time.h>
 
 namespace nix {
 
-RemoteFSAccessor::RemoteFSAccessor(ref<Store> store, const Path & cacheDir)
+RemoteFSAccessor::RemoteFSAccessor(ref<Store> store, const Path & cacheDir,
+    uint64_t maxSegmentCacheSize)
     : store(store)
     , cacheDir(cacheDir)
+    , maxSegmentCacheSize(cacheDir != "" ? maxSegmentCacheSize : 0)
 {
     if (cacheDir != "")
         createDirs(cacheDir);
@@ -25,7 +32,7 @@ Path RemoteFSAccessor::makeCacheFile(const Path & storePath, const std::string &
 void RemoteFSAccessor::addToCache(const Path & storePath, const std::string & nar,
     ref<FSAccessor> narAccessor)
 {
-    nars.emplace(storePath, narAccessor);
+    nars.lock()->emplace(storePath, narAccessor);
 
     if (cacheDir != "") {
         try {
@@ -43,6 +50,135 @@ void RemoteFSAccessor::addToCache(const Path & storePath, const std::string & na
     }
 }
 
+std::shared_ptr<FSAccessor> RemoteFSAccessor::fetchLazy(const Path & storePath)
+{
+    /* If the binary cache has a listing of an uncompressed NAR, use
+       the member offsets in the listing to fetch only the parts of
+       the NAR that we need. */
+    auto binaryCache = std::dynamic_pointer_cast<BinaryCacheStore>(store.get_ptr());
+    if (!binaryCache || !binaryCache->supportsFileRanges()) return nullptr;
+
+    auto info = store->queryPathInfo(store->parseStorePath(storePath));
+    auto narInfo = dynamic_cast<const NarInfo *>(&*info);
+    if (!narInfo || narInfo->compression != "none" || narInfo->url.empty()) return nullptr;
+
+    auto url = narInfo->url;
+
+    auto makeAccessor = [&](const std::string & listing) {
+        debug("using NAR listing to access '%s' in '%s'", storePath, binaryCache->getUri());
+        return makeLazyNarAccessor(listing,
+            [this, binaryCache, storePath, url](uint64_t offset, uint64_t length) {
+                return fetchSegment(*binaryCache, storePath, url, offset, length);
+            }).get_ptr();
+    };
+
+    /* Reuse a listing we cached earlier. */
+    Path listingFile;
+    if (cacheDir != "" && pathExists(listingFile = makeCacheFile(storePath, "ls"))) {
+        try {
+            return makeAccessor(nix::readFile(listingFile));
+        } catch (Error & e) {
+            debug("ignoring cached NAR listing '%s': %s", listingFile, e.what());
+        }
+    }
+
+    try {
+        auto listing = binaryCache->getFile(std::string(info->path.to_string()) + ".ls");
+        if (!listing) return nullptr;
+
+        auto json = nlohmann::json::parse(*listing);
+        if (json.value("version", 0) != 1 || !json.count("root")) return nullptr;
+
+        auto root = json["root"].dump();
+        auto accessor = makeAccessor(root);
+
+        if (cacheDir != "") {
+            try {
+                writeFile(listingFile, root);
+            } catch (...) {
+                ignoreException();
+            }
+        }
+
+        return accessor;
+    } catch (nlohmann::json::exception & e) {
+        warn("ignoring invalid NAR listing for '%s': %s", storePath, e.what());
+        return nullptr;
+    }
+}
+
+std::string RemoteFSAccessor::fetchSegment(BinaryCacheStore & binaryCache, const Path & storePath,
+    const std::string & url, uint64_t offset, uint64_t length)
+{
+    if (!maxSegmentCacheSize || length > maxSegmentCacheSize)
+        return binaryCache.getFileRange(url, offset, length);
+
+    auto dir = cacheDir + "/segments";
+    auto segmentFile = fmt("%s/%s-%d-%d", dir, store->parseStorePath(storePath).hashPart(), offset, length);
+
+    try {
+        auto data = nix::readFile(segmentFile);
+        if (data.size() == length) {
+            /* Record the use for the LRU policy. */
+            utimes(segmentFile.c_str(), nullptr);
+            return data;
+        }
+    } catch (SysError &) { }
+
+    auto data = binaryCache.getFileRange(url, offset, length);
+
+    try {
+        createDirs(dir);
+        auto tmp = segmentFile + ".tmp." + std::to_string(getpid());
+        writeFile(tmp, data);
+        if (rename(tmp.c_str(), segmentFile.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, segmentFile);
+
+        auto size(segmentCacheSize.lock());
+        if (!*size) {
+            /* Count what's already there, including the segment we
+               just wrote. */
+            *size = 0;
+            for (auto & entry : nix::readDirectory(dir))
+                **size += lstat(dir + "/" + entry.name).st_size;
+        } else
+            **size += length;
+        if (**size > maxSegmentCacheSize)
+            pruneSegmentCache(**size);
+    } catch (...) {
+        ignoreException();
+    }
+
+    return data;
+}
+
+void RemoteFSAccessor::pruneSegmentCache(uint64_t & size)
+{
+    auto dir = cacheDir + "/segments";
+
+    std::vector<std::tuple<time_t, uint64_t, Path>> segments;
+    size = 0;
+    for (auto & entry : nix::readDirectory(dir)) {
+        auto path = dir + "/" + entry.name;
+        auto st = lstat(path);
+        segments.emplace_back(st.st_mtime, st.st_size, path);
+        size += st.st_size;
+    }
+
+    std::sort(segments.begin(), segments.end());
+
+    /* Leave some slack so that we don't prune on every write. */
+    auto goal = maxSegmentCacheSize / 4 * 3;
+
+    for (auto & [mtime, segmentSize, path] : segments) {
+        if (size <= goal) break;
+        debug("removing cached NAR segment '%s'", path);
+        if (unlink(path.c_str()) == -1 && errno != ENOENT)
+            throw SysError("deleting '%s'", path);
+        size -= segmentSize;
+    }
+}
+
 std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_)
 {
     auto path = canonPath(path_);
@@ -53,8 +189,11 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_)
     if (!store->isValidPath(store->parseStorePath(storePath)))
         throw InvalidPath("path '%1%' is not a valid store path", storePath);
 
-    auto i = nars.find(storePath);
-    if (i != nars.end()) return {i->second, restPath};
+    {
+        auto nars_(nars.lock());
+        auto i = nars_->find(storePath);
+        if (i != nars_->end()) return {i->second, restPath};
+    }
 
     StringSink sink;
     std::string listing;
@@ -81,7 +220,7 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_)
                     return buf;
                 });
 
-            nars.emplace(storePath, narAccessor);
+            nars.lock()->emplace(storePath, narAccessor);
             return {narAccessor, restPath};
 
         } catch (SysError &) { }
@@ -90,12 +229,17 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_)
             *sink.s = nix::readFile(cacheFile);
 
             auto narAccessor = makeNarAccessor(sink.s);
-            nars.emplace(storePath, narAccessor);
+            nars.lock()->emplace(storePath, narAccessor);
             return {narAccessor, restPath};
 
         } catch (SysError &) { }
     }
 
+    if (auto narAccessor = fetchLazy(storePath)) {
+        nars.lock()->emplace(storePath, ref<FSAccessor>(narAccessor));
+        return {ref<FSAccessor>(narAccessor), restPath};
+    }
+
     store->narFromPath(store->parseStorePath(storePath), sink);
     auto narAccessor = makeNarAccessor(sink.s);
     addToCache(storePath, *sink.s, narAccessor);
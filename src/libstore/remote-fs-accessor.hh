@@ -3,19 +3,42 @@
 #include "fs-accessor.hh"
 #include "ref.hh"
 #include "store-api.hh"
+#include "sync.hh"
 
 namespace nix {
 
+class BinaryCacheStore;
+
 class RemoteFSAccessor : public FSAccessor
 {
     ref<Store> store;
 
-    std::map<Path, ref<FSAccessor>> nars;
+    Sync<std::map<Path, ref<FSAccessor>>> nars;
 
     Path cacheDir;
 
+    /* Maximum total size of the NAR segments fetched by byte range
+       that are kept in `cacheDir', or 0 to not keep them. */
+    uint64_t maxSegmentCacheSize;
+
+    /* Total size of the cached segments, computed on first use. */
+    Sync<std::optional<uint64_t>> segmentCacheSize;
+
     std::pair<ref<FSAccessor>, Path> fetch(const Path & path_);
 
+    /* Return an accessor that fetches file contents on demand, if
+       the store supports it for this path. */
+    std::shared_ptr<FSAccessor> fetchLazy(const Path & storePath);
+
+    /* Return `length' bytes at `offset' in the NAR at `url', from the
+       segment cache if possible. */
+    std::string fetchSegment(BinaryCacheStore & binaryCache, const Path & storePath,
+        const std::string & url, uint64_t offset, uint64_t length);
+
+    /* Delete the least recently used segments until their total size
+       is below the limit. */
+    void pruneSegmentCache(uint64_t & size);
+
     friend class BinaryCacheStore;
 
     Path makeCacheFile(const Path & storePath, const std::string & ext);
@@ -26,7 +49,8 @@ class RemoteFSAccessor : public FSAccessor
 public:
 
     RemoteFSAccessor(ref<Store> store,
-        const /* FIXME: use std::optional */ Path & cacheDir = "");
+        const /* FIXME: use std::optional */ Path & cacheDir = "",
+        uint64_t maxSegmentCacheSize = 0);
 
     Stat stat(const Path & path) override;
 
@@ -1,6 +1,7 @@
 #include "serialise.hh"
 #include "util.hh"
 #include "remote-store.hh"
+#include "compression.hh"
 #include "worker-protocol.hh"
 #include "archive.hh"
 #include "affinity.hh"
@@ -39,6 +40,33 @@ void writeStorePaths(const Store & store, Sink & out, const StorePathSet & paths
         out << store.printStorePath(i);
 }
 
+ValidPathInfo readValidPathInfo(const Store & store, Source & from)
+{
+    ValidPathInfo info(store.parseStorePath(readString(from)));
+    auto deriver = readString(from);
+    if (deriver != "") info.deriver = store.parseStorePath(deriver);
+    info.narHash = Hash(readString(from), htSHA256);
+    info.references = readStorePaths<StorePathSet>(store, from);
+    from >> info.registrationTime >> info.narSize >> info.ultimate;
+    info.sigs = readStrings<StringSet>(from);
+    info.ca = parseContentAddressOpt(readString(from));
+    return info;
+}
+
+
+void writeValidPathInfo(const Store & store, Sink & out, const ValidPathInfo & info)
+{
+    out << store.printStorePath(info.path)
+        << (info.deriver ? store.printStorePath(*info.deriver) : "")
+        << info.narHash.to_string(Base16, false);
+    writeStorePaths(store, out, info.references);
+    out << info.registrationTime << info.narSize
+        << info.ultimate
+        << info.sigs
+        << renderContentAddress(info.ca);
+}
+
+
 std::map<string, StorePath> readOutputPathMap(const Store & store, Source & from)
 {
     std::map<string, StorePath> pathMap;
@@ -111,6 +139,20 @@ UDSRemoteStore::UDSRemoteStore(std::string socket_path, const Params & params)
 }
 
 
+UDSRemoteStore::~UDSRemoteStore()
+{
+    /* Callers should have called flush() themselves, so that errors
+       are reported to them. This is only a last resort, and can't
+       be done in ~RemoteStore(), which can no longer open a new
+       connection. */
+    try {
+        flush();
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
 std::string UDSRemoteStore::getUri()
 {
     if (path) {
@@ -184,6 +226,25 @@ void RemoteStore::initConnection(Connection & conn)
         if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 11)
             conn.to << false;
 
+        /* Negotiate transport compression. The daemon only replies
+           if we asked for a method. */
+        if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 0x1a) {
+            auto wanted = transportCompression();
+            conn.to << wanted;
+            if (wanted != "") {
+                conn.to.flush();
+                auto method = readString(conn.from);
+                if (method == wanted) {
+                    conn.channel = makeCompressedChannel(method, conn.from.fd, conn.to.fd, conn.from.takeBuffered());
+                    conn.to = FdSink(conn.channel.get());
+                    conn.from = FdSource(conn.channel.get());
+                } else if (method != "")
+                    throw Error("daemon chose unexpected transport compression '%s'", method);
+                else
+                    debug("daemon does not support transport compression '%s'", wanted);
+            }
+        }
+
         auto ex = conn.processStderr();
         if (ex) std::rethrow_exception(ex);
     }
@@ -273,10 +334,32 @@ struct ConnectionHandle
 
 ConnectionHandle RemoteStore::getConnection()
 {
+    flush();
     return ConnectionHandle(connections->get());
 }
 
 
+void RemoteStore::flush()
+{
+    auto pending(pendingTexts.lock());
+    if (pending->empty()) return;
+
+    /* Keep the lock until the daemon has added the files, so that
+       other threads can't overtake us. */
+    std::vector<StoreText> texts;
+    std::swap(texts, *pending);
+
+    ConnectionHandle conn(connections->get());
+    conn->to << wopAddTextsToStore << texts.size();
+    for (auto & text : texts) {
+        conn->to << text.name << text.contents;
+        writeStorePaths(*this, conn->to, text.references);
+    }
+    conn.processStderr();
+    readInt(conn->from);
+}
+
+
 bool RemoteStore::isValidPathUncached(const StorePath & path)
 {
     auto conn(getConnection());
@@ -376,6 +459,26 @@ void RemoteStore::querySubstitutablePathInfos(const StorePathSet & paths,
 }
 
 
+/* Read the fields of a ValidPathInfo that follow its path in replies
+   to wopQueryPathInfo and wopQueryPathInfos. */
+static std::shared_ptr<ValidPathInfo> readPathInfo(const Store & store,
+    Source & from, StorePath && path, unsigned int daemonVersion)
+{
+    auto info = std::make_shared<ValidPathInfo>(std::move(path));
+    auto deriver = readString(from);
+    if (deriver != "") info->deriver = store.parseStorePath(deriver);
+    info->narHash = Hash(readString(from), htSHA256);
+    info->references = readStorePaths<StorePathSet>(store, from);
+    from >> info->registrationTime >> info->narSize;
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 16) {
+        from >> info->ultimate;
+        info->sigs = readStrings<StringSet>(from);
+        info->ca = parseContentAddressOpt(readString(from));
+    }
+    return info;
+}
+
+
 void RemoteStore::queryPathInfoUncached(const StorePath & path,
     Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
 {
@@ -396,23 +499,64 @@ void RemoteStore::queryPathInfoUncached(const StorePath & path,
                 bool valid; conn->from >> valid;
                 if (!valid) throw InvalidPath("path '%s' is not valid", printStorePath(path));
             }
-            info = std::make_shared<ValidPathInfo>(StorePath(path));
-            auto deriver = readString(conn->from);
-            if (deriver != "") info->deriver = parseStorePath(deriver);
-            info->narHash = Hash(readString(conn->from), htSHA256);
-            info->references = readStorePaths<StorePathSet>(*this, conn->from);
-            conn->from >> info->registrationTime >> info->narSize;
-            if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 16) {
-                conn->from >> info->ultimate;
-                info->sigs = readStrings<StringSet>(conn->from);
-                info->ca = parseContentAddressOpt(readString(conn->from));
-            }
+            info = readPathInfo(*this, conn->from, StorePath(path), conn->daemonVersion);
         }
         callback(std::move(info));
     } catch (...) { callback.rethrow(); }
 }
 
 
+bool RemoteStore::queryPathInfosUncached(const StorePathSet & paths,
+    std::map<StorePath, std::shared_ptr<const ValidPathInfo>> & infos)
+{
+    auto conn(getConnection());
+
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 0x18) {
+        conn->to << wopQueryPathInfos;
+        writeStorePaths(*this, conn->to, paths);
+        conn.processStderr();
+        auto count = readNum<size_t>(conn->from);
+        for (size_t n = 0; n < count; n++) {
+            auto info = std::make_shared<ValidPathInfo>(readValidPathInfo(*this, conn->from));
+            auto path = info->path;
+            infos.insert_or_assign(std::move(path), std::move(info));
+        }
+        return true;
+    }
+
+    /* Older daemons process one wopQueryPathInfo at a time, but
+       since they handle requests in order, we can send up to
+       `pipeline-depth' of them before reading the replies. Daemons
+       older than 1.17 report invalid paths as errors, which would
+       leave the remaining replies unread. */
+    if (pipelineDepth <= 1 || GET_PROTOCOL_MINOR(conn->daemonVersion) < 17)
+        return false;
+
+    try {
+        for (auto i = paths.begin(); i != paths.end(); ) {
+            std::vector<StorePath> sent;
+            for (; i != paths.end() && sent.size() < pipelineDepth; ++i) {
+                conn->to << wopQueryPathInfo << printStorePath(*i);
+                sent.push_back(*i);
+            }
+            for (auto & path : sent) {
+                conn.processStderr();
+                bool valid; conn->from >> valid;
+                if (valid)
+                    infos.insert_or_assign(path,
+                        readPathInfo(*this, conn->from, StorePath(path), conn->daemonVersion));
+            }
+        }
+    } catch (...) {
+        /* The connection may still have unread replies. */
+        conn.daemonException = false;
+        throw;
+    }
+
+    return true;
+}
+
+
 void RemoteStore::queryReferrers(const StorePath & path,
     StorePathSet & referrers)
 {
@@ -510,15 +654,54 @@ void RemoteStore::addToStore(const ValidPathInfo & info, Source & source,
 }
 
 
+void RemoteStore::addMultipleToStore(Source & source, RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    {
+        auto conn(getConnection());
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 0x19)
+            // Don't hold the connection handle in the fallback case
+            // to prevent a deadlock.
+            goto fallback;
+        conn->to << wopAddMultipleToStore << repair << !checkSigs;
+        conn.processStderr(0, &source);
+        return;
+    }
+
+ fallback:
+    Store::addMultipleToStore(source, repair, checkSigs);
+}
+
+
+bool RemoteStore::batchesImports()
+{
+    return GET_PROTOCOL_MINOR(getProtocol()) >= 0x19;
+}
+
+
 StorePath RemoteStore::addToStore(const string & name, const Path & _srcPath,
     FileIngestionMethod method, HashType hashAlgo, PathFilter & filter, RepairFlag repair)
 {
     if (repair) throw Error("repairing is not supported when building through the Nix daemon");
 
-    auto conn(getConnection());
-
     Path srcPath(absPath(_srcPath));
 
+    /* Don't send the contents if the daemon already has the resulting
+       path, as with sources that haven't changed since the last
+       evaluation. The temporary root keeps the path alive for the
+       caller, like adding it would. The daemon is asked directly,
+       since a cached answer from before the temporary root was added
+       could refer to a path that has been garbage-collected since. */
+    if (hashBeforeUpload) {
+        auto path = computeStorePathForPath(name, srcPath, method, hashAlgo, filter).first;
+        addTempRoot(path);
+        if (isValidPathUncached(path)) {
+            debug("daemon already has '%s', not sending '%s'", printStorePath(path), srcPath);
+            return path;
+        }
+    }
+
+    auto conn(getConnection());
+
     conn->to
         << wopAddToStore
         << name
@@ -555,6 +738,17 @@ StorePath RemoteStore::addTextToStore(const string & name, const string & s,
 {
     if (repair) throw Error("repairing is not supported when building through the Nix daemon");
 
+    if (textBatchSize && GET_PROTOCOL_MINOR(getProtocol()) >= 0x17) {
+        auto path = computeStorePathForText(name, s, references);
+        {
+            auto pending(pendingTexts.lock());
+            pending->push_back(StoreText { .name = name, .contents = s, .references = references });
+            if (pending->size() < textBatchSize) return path;
+        }
+        flush();
+        return path;
+    }
+
     auto conn(getConnection());
     conn->to << wopAddTextToStore << name << s;
     writeStorePaths(*this, conn->to, references);
@@ -671,10 +865,7 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
     results.bytesFreed = readLongLong(conn->from);
     readLongLong(conn->from); // obsolete
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.clear();
-    }
+    pathInfoCache.clear();
 }
 
 
@@ -687,6 +878,29 @@ void RemoteStore::optimiseStore()
 }
 
 
+StorePathSet RemoteStore::queryFailedPaths()
+{
+    auto conn(getConnection());
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 0x1b)
+        unsupported("queryFailedPaths");
+    conn->to << wopQueryFailedPaths;
+    conn.processStderr();
+    return readStorePaths<StorePathSet>(*this, conn->from);
+}
+
+
+void RemoteStore::clearFailedPaths(const StorePathSet & paths)
+{
+    auto conn(getConnection());
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 0x1b)
+        unsupported("clearFailedPaths");
+    conn->to << wopClearFailedPaths;
+    writeStorePaths(*this, conn->to, paths);
+    conn.processStderr();
+    readInt(conn->from);
+}
+
+
 bool RemoteStore::verifyStore(bool checkContents, RepairFlag repair)
 {
     auto conn(getConnection());
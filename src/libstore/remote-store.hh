@@ -4,6 +4,7 @@
 #include <string>
 
 #include "store-api.hh"
+#include "sync.hh"
 
 
 namespace nix {
@@ -29,6 +30,15 @@ public:
     const Setting<unsigned int> maxConnectionAge{(Store*) this, std::numeric_limits<unsigned int>::max(),
             "max-connection-age", "number of seconds to reuse a connection"};
 
+    const Setting<unsigned int> textBatchSize{(Store*) this, 0,
+            "text-batch-size", "maximum number of text files (such as .drv files) to send to the daemon at once; 0 (the default) disables batching"};
+
+    const Setting<unsigned int> pipelineDepth{(Store*) this, 64,
+            "pipeline-depth", "maximum number of path info queries to send to older daemons before reading the replies; 1 disables pipelining"};
+
+    const Setting<bool> hashBeforeUpload{(Store*) this, true,
+            "hash-before-upload", "whether to compute the store path of files added to the store locally, and only send them to the daemon if it doesn't have that path yet"};
+
     virtual bool sameMachine() = 0;
 
     RemoteStore(const Params & params);
@@ -45,6 +55,9 @@ public:
     void queryPathInfoUncached(const StorePath & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept override;
 
+    bool queryPathInfosUncached(const StorePathSet & paths,
+        std::map<StorePath, std::shared_ptr<const ValidPathInfo>> & infos) override;
+
     void queryReferrers(const StorePath & path, StorePathSet & referrers) override;
 
     StorePathSet queryValidDerivers(const StorePath & path) override;
@@ -63,6 +76,10 @@ public:
         RepairFlag repair, CheckSigsFlag checkSigs,
         std::shared_ptr<FSAccessor> accessor) override;
 
+    void addMultipleToStore(Source & source, RepairFlag repair, CheckSigsFlag checkSigs) override;
+
+    bool batchesImports() override;
+
     StorePath addToStore(const string & name, const Path & srcPath,
         FileIngestionMethod method = FileIngestionMethod::Recursive, HashType hashAlgo = htSHA256,
         PathFilter & filter = defaultPathFilter, RepairFlag repair = NoRepair) override;
@@ -91,6 +108,10 @@ public:
 
     bool verifyStore(bool checkContents, RepairFlag repair) override;
 
+    StorePathSet queryFailedPaths() override;
+
+    void clearFailedPaths(const StorePathSet & paths) override;
+
     void addSignatures(const StorePath & storePath, const StringSet & sigs) override;
 
     void queryMissing(const std::vector<StorePathWithOutputs> & targets,
@@ -103,6 +124,9 @@ public:
 
     void flushBadConnections();
 
+    /* Send the files queued by addTextToStore() to the daemon. */
+    void flush() override;
+
 protected:
 
     struct Connection
@@ -110,6 +134,9 @@ protected:
         AutoCloseFD fd;
         FdSink to;
         FdSource from;
+        /* If transport compression is in use, the uncompressed end of
+           the channel that `to' and `from' use. */
+        AutoCloseFD channel;
         unsigned int daemonVersion;
         std::chrono::time_point<std::chrono::steady_clock> startTime;
 
@@ -128,6 +155,11 @@ protected:
 
     virtual void setOptions(Connection & conn);
 
+    /* The compression method to request for the connection to the
+       daemon, if any. */
+    virtual std::string transportCompression()
+    { return ""; }
+
     ConnectionHandle getConnection();
 
     friend struct ConnectionHandle;
@@ -136,6 +168,12 @@ private:
 
     std::atomic_bool failed{false};
 
+    /* Files that addTextToStore() has returned but not yet sent to
+       the daemon. Since their paths are determined by their
+       contents, they only need to be sent before any other operation
+       that might refer to them. */
+    Sync<std::vector<StoreText>> pendingTexts;
+
 };
 
 class UDSRemoteStore : public LocalFSStore, public RemoteStore
@@ -145,6 +183,8 @@ public:
     UDSRemoteStore(const Params & params);
     UDSRemoteStore(std::string path, const Params & params);
 
+    ~UDSRemoteStore();
+
     std::string getUri() override;
 
     bool sameMachine() override
@@ -8,6 +8,8 @@
 #include "compression.hh"
 #include "filetransfer.hh"
 #include "istringstream_nocopy.hh"
+#include "thread-pool.hh"
+#include "sync.hh"
 
 #include <aws/core/Aws.h>
 #include <aws/core/VersionConfig.h>
@@ -22,6 +24,7 @@
 #include <aws/s3/model/GetObjectRequest.h>
 #include <aws/s3/model/HeadObjectRequest.h>
 #include <aws/s3/model/ListObjectsRequest.h>
+#include <aws/s3/model/ListObjectsV2Request.h>
 #include <aws/s3/model/PutObjectRequest.h>
 #include <aws/transfer/TransferManager.h>
 
@@ -186,6 +189,13 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
         this, false, "multipart-upload", "whether to use multi-part uploads"};
     const Setting<uint64_t> bufferSize{
         this, 5 * 1024 * 1024, "buffer-size", "size (in bytes) of each part in multi-part uploads"};
+    const Setting<uint64_t> partSize{
+        this, 0, "part-size", "size (in bytes) of each part in multi-part uploads, overriding 'buffer-size'"};
+    const Setting<unsigned int> uploadConcurrency{
+        this, 0, "upload-concurrency", "number of parts of multi-part uploads to send in parallel (0 for the number of CPUs)"};
+    const Setting<bool> batchExistenceChecks{
+        this, false, "batch-existence-checks",
+        "whether to find out which paths exist by listing the bucket rather than by fetching each .narinfo"};
 
     std::string bucketName;
 
@@ -212,9 +222,10 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
         if (auto cacheInfo = diskCache->cacheExists(getUri())) {
             wantMassQuery.setDefault(cacheInfo->wantMassQuery ? "true" : "false");
             priority.setDefault(fmt("%d", cacheInfo->priority));
+            presenceFilter.setDefault(cacheInfo->presenceFilter);
         } else {
             BinaryCacheStore::init();
-            diskCache->createCache(getUri(), storeDir, wantMassQuery, priority);
+            diskCache->createCache(getUri(), storeDir, wantMassQuery, priority, presenceFilter);
         }
     }
 
@@ -259,6 +270,82 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
         return true;
     }
 
+    /* Return which of `paths' exist in the bucket. If
+       'batch-existence-checks' is enabled, this lists each two-letter
+       prefix of the hash parts of `paths' with ListObjectsV2, which
+       takes far fewer requests than one GET per path if there are
+       many paths. Missing paths are recorded in the disk cache so
+       that subsequent isValidPath() calls don't hit the bucket. */
+    StorePathSet queryValidPaths(const StorePathSet & paths,
+        SubstituteFlag maybeSubstitute = NoSubstitute) override
+    {
+        if (!batchExistenceChecks || paths.size() < 2)
+            return S3BinaryCacheStore::queryValidPaths(paths, maybeSubstitute);
+
+        std::map<std::string, std::map<std::string, StorePath>> byPrefix;
+        for (auto & path : paths) {
+            std::string hashPart(path.hashPart());
+            byPrefix[hashPart.substr(0, 2)].emplace(hashPart, path);
+        }
+
+        Sync<StorePathSet> valid;
+
+        ThreadPool pool;
+
+        for (auto & i : byPrefix)
+            pool.enqueue([&, prefix(i.first), &wanted(i.second)]() {
+                auto found = listNarInfos(prefix);
+                for (auto & [hashPart, path] : wanted) {
+                    if (found.count(hashPart))
+                        valid.lock()->insert(path);
+                    else if (diskCache)
+                        diskCache->upsertNarInfo(getUri(), hashPart, nullptr);
+                }
+            });
+
+        pool.process();
+
+        return std::move(*valid.lock());
+    }
+
+    /* Return the hash parts of the .narinfo files whose name starts
+       with `prefix'. */
+    std::set<std::string> listNarInfos(const std::string & prefix)
+    {
+        std::set<std::string> res;
+        std::string token;
+
+        do {
+            checkInterrupt();
+
+            stats.list++;
+
+            auto request =
+                Aws::S3::Model::ListObjectsV2Request()
+                .WithBucket(bucketName)
+                .WithPrefix(prefix);
+
+            if (!token.empty())
+                request.SetContinuationToken(token);
+
+            auto result = checkAws(fmt("AWS error listing bucket '%s'", bucketName),
+                s3Helper.client->ListObjectsV2(request));
+
+            for (auto & object : result.GetContents()) {
+                auto & key = object.GetKey();
+                if (key.size() != 40 || !hasSuffix(key, ".narinfo")) continue;
+                res.insert(key.substr(0, 32));
+            }
+
+            token = result.GetIsTruncated() ? result.GetNextContinuationToken() : "";
+        } while (!token.empty());
+
+        debug("found %d .narinfo files with prefix '%s' in 's3://%s'", res.size(), prefix, bucketName);
+
+        return res;
+    }
+
+    std::shared_ptr<Aws::Utils::Threading::PooledThreadExecutor> executor;
     std::shared_ptr<TransferManager> transferManager;
     std::once_flag transferManagerCreated;
 
@@ -266,20 +353,33 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
         const std::string & mimeType,
         const std::string & contentEncoding)
     {
-        auto stream = std::make_shared<istringstream_nocopy>(data);
-
-        auto maxThreads = std::thread::hardware_concurrency();
+        uploadFile(path, std::make_shared<istringstream_nocopy>(data), mimeType, contentEncoding);
+    }
 
-        static std::shared_ptr<Aws::Utils::Threading::PooledThreadExecutor>
-            executor = std::make_shared<Aws::Utils::Threading::PooledThreadExecutor>(maxThreads);
+    void uploadFile(const std::string & path,
+        std::shared_ptr<std::basic_iostream<char>> stream,
+        const std::string & mimeType,
+        const std::string & contentEncoding)
+    {
+        stream->seekg(0, stream->end);
+        auto size = stream->tellg();
+        stream->seekg(0, stream->beg);
 
         std::call_once(transferManagerCreated, [&]()
         {
             if (multipartUpload) {
+                size_t threads = uploadConcurrency;
+                if (!threads) threads = std::max(1U, std::thread::hardware_concurrency());
+
+                executor = std::make_shared<Aws::Utils::Threading::PooledThreadExecutor>(threads);
+
                 TransferManagerConfiguration transferConfig(executor.get());
 
                 transferConfig.s3Client = s3Helper.client;
-                transferConfig.bufferSize = bufferSize;
+                transferConfig.bufferSize = partSize ? partSize : bufferSize;
+                /* Allow a part per thread to be in flight; the
+                   default heap limit only allows 10. */
+                transferConfig.transferBufferMaxHeapSize = transferConfig.bufferSize * threads;
 
                 transferConfig.uploadProgressCallback =
                     [](const TransferManager *transferManager,
@@ -333,8 +433,6 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
             if (contentEncoding != "")
                 request.SetContentEncoding(contentEncoding);
 
-            auto stream = std::make_shared<istringstream_nocopy>(data);
-
             request.SetBody(stream);
 
             auto result = checkAws(fmt("AWS error uploading '%s'", path),
@@ -348,10 +446,10 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
                 .count();
 
         printInfo(format("uploaded 's3://%1%/%2%' (%3% bytes) in %4% ms") %
-                  bucketName % path % data.size() % duration);
+                  bucketName % path % size % duration);
 
         stats.putTimeMs += duration;
-        stats.putBytes += data.size();
+        stats.putBytes += size;
         stats.put++;
     }
 
@@ -368,6 +466,18 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
             uploadFile(path, data, mimeType, "");
     }
 
+    void upsertFile(const std::string & path,
+        std::shared_ptr<std::basic_iostream<char>> istream,
+        const std::string & mimeType) override
+    {
+        /* Only NARs are uploaded this way, and they're already
+           compressed. */
+        if (hasSuffix(path, ".narinfo") || hasSuffix(path, ".ls") || hasPrefix(path, "log/"))
+            BinaryCacheStore::upsertFile(path, istream, mimeType);
+        else
+            uploadFile(path, istream, mimeType, "");
+    }
+
     void getFile(const std::string & path, Sink & sink) override
     {
         stats.get++;
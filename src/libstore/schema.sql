@@ -1,6 +1,7 @@
 create table if not exists ValidPaths (
     id               integer primary key autoincrement not null,
-    path             text unique not null,
+    hashPart         blob unique not null, -- the 20 bytes encoded by the hash part of the path
+    name             text not null,
     hash             text not null,
     registrationTime integer not null,
     deriver          text,
@@ -5,7 +5,7 @@ namespace nix {
 #define SERVE_MAGIC_1 0x390c9deb
 #define SERVE_MAGIC_2 0x5452eecb
 
-#define SERVE_PROTOCOL_VERSION 0x205
+#define SERVE_PROTOCOL_VERSION 0x206
 #define GET_PROTOCOL_MAJOR(x) ((x) & 0xff00)
 #define GET_PROTOCOL_MINOR(x) ((x) & 0x00ff)
 
@@ -19,6 +19,7 @@ typedef enum {
     cmdQueryClosure = 7,
     cmdBuildDerivation = 8,
     cmdAddToStoreNar = 9,
+    cmdAddMultipleToStore = 10,
 } ServeCommand;
 
 }
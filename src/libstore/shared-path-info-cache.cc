@@ -0,0 +1,176 @@
+#include "shared-path-info-cache.hh"
+#include "pathlocks.hh"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace nix {
+
+/* Bump this when changing the layout below or the format of the
+   entries. */
+static constexpr uint64_t cacheMagic = 0x4e495850494331ULL;
+
+static constexpr size_t slotSize = 1024;
+
+static constexpr size_t hashPartLen = 32;
+
+struct SharedPathInfoCache::Header
+{
+    uint64_t magic;
+    uint64_t nrSlots;
+    std::atomic<uint64_t> generation;
+    std::atomic<uint64_t> hits, misses;
+};
+
+struct SharedPathInfoCache::Slot
+{
+    /* Odd while the slot is being written. */
+    std::atomic<uint32_t> seq;
+    uint32_t size;
+    uint64_t generation;
+    char hashPart[hashPartLen];
+    char data[slotSize - 48];
+};
+
+static_assert(sizeof(std::atomic<uint64_t>) == 8 && std::atomic<uint64_t>::is_always_lock_free);
+static_assert(sizeof(std::atomic<uint32_t>) == 4 && std::atomic<uint32_t>::is_always_lock_free);
+
+
+SharedPathInfoCache::SharedPathInfoCache(const Path & path, size_t nrSlots)
+    : nrSlots(nrSlots)
+{
+    static_assert(sizeof(Header) <= slotSize && sizeof(Slot) == slotSize);
+
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (!fd)
+        throw SysError("opening shared path info cache '%s'", path);
+
+    /* The first process to open the cache initialises it, while
+       holding a lock so that others don't see it half-initialised. */
+    lockFile(fd.get(), ltWrite, true);
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw SysError("statting '%s'", path);
+
+    bool init = st.st_size == 0;
+
+    if (init) {
+        if (!nrSlots)
+            throw Error("shared path info cache '%s' must have at least one entry", path);
+        if (ftruncate(fd.get(), (nrSlots + 1) * slotSize) == -1)
+            throw SysError("resizing '%s'", path);
+    } else {
+        uint64_t fields[2];
+        if (pread(fd.get(), fields, sizeof(fields), 0) != sizeof(fields))
+            throw SysError("reading '%s'", path);
+        if (fields[0] != cacheMagic || !fields[1] || (uint64_t) st.st_size != (fields[1] + 1) * slotSize)
+            throw Error("shared path info cache '%s' has an unsupported format", path);
+        this->nrSlots = fields[1];
+    }
+
+    mappedSize = (this->nrSlots + 1) * slotSize;
+
+    auto p = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+    if (p == MAP_FAILED)
+        throw SysError("mapping '%s'", path);
+
+    header = (Header *) p;
+    slots = (Slot *) ((char *) p + slotSize);
+
+    if (init) {
+        header->nrSlots = this->nrSlots;
+        header->magic = cacheMagic;
+    }
+
+    lockFile(fd.get(), ltNone, true);
+}
+
+
+SharedPathInfoCache::~SharedPathInfoCache()
+{
+    munmap(header, mappedSize);
+}
+
+
+SharedPathInfoCache::Slot & SharedPathInfoCache::slotFor(std::string_view hashPart)
+{
+    /* Hash parts are uniformly distributed already. */
+    uint64_t h = 0;
+    memcpy(&h, hashPart.data(), std::min(hashPart.size(), sizeof(h)));
+    return slots[h % nrSlots];
+}
+
+
+uint64_t SharedPathInfoCache::generation()
+{
+    return header->generation.load(std::memory_order_acquire);
+}
+
+
+std::optional<std::string> SharedPathInfoCache::lookup(std::string_view hashPart)
+{
+    if (hashPart.size() != hashPartLen) return {};
+
+    auto & slot = slotFor(hashPart);
+
+    auto seq = slot.seq.load(std::memory_order_acquire);
+
+    std::optional<std::string> res;
+
+    if (!(seq & 1)
+        && slot.generation == generation()
+        && slot.size <= sizeof(slot.data)
+        && !memcmp(slot.hashPart, hashPart.data(), hashPartLen))
+    {
+        res = std::string(slot.data, slot.size);
+
+        /* Discard what we read if the slot was written meanwhile. */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq)
+            res.reset();
+    }
+
+    (res ? header->hits : header->misses).fetch_add(1, std::memory_order_relaxed);
+
+    return res;
+}
+
+
+void SharedPathInfoCache::insert(std::string_view hashPart, std::string_view data, uint64_t generation)
+{
+    if (hashPart.size() != hashPartLen) return;
+
+    auto & slot = slotFor(hashPart);
+
+    if (data.size() > sizeof(slot.data)) return;
+
+    /* If another process is writing this slot, just give up. */
+    auto seq = slot.seq.load(std::memory_order_relaxed);
+    if ((seq & 1) || !slot.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire))
+        return;
+
+    slot.generation = generation;
+    slot.size = data.size();
+    memcpy(slot.hashPart, hashPart.data(), hashPartLen);
+    memcpy(slot.data, data.data(), data.size());
+
+    slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+
+void SharedPathInfoCache::invalidate()
+{
+    header->generation.fetch_add(1, std::memory_order_acq_rel);
+}
+
+
+std::pair<uint64_t, uint64_t> SharedPathInfoCache::getStats()
+{
+    return {header->hits.load(), header->misses.load()};
+}
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "util.hh"
+
+#include <atomic>
+#include <optional>
+
+namespace nix {
+
+/* A fixed-size cache of serialised path info in a memory-mapped file
+   that is shared by all processes using the same store, such as the
+   processes forked by the daemon for each connection. Each slot is
+   protected by a sequence lock, so readers never block; a concurrent
+   update just causes a miss. Instead of tracking individual entries,
+   the whole cache is invalidated by bumping a generation counter
+   whenever the info of a valid path changes or a path is deleted. */
+class SharedPathInfoCache
+{
+    struct Header;
+    struct Slot;
+
+    AutoCloseFD fd;
+    size_t nrSlots, mappedSize;
+    Header * header;
+    Slot * slots;
+
+    Slot & slotFor(std::string_view hashPart);
+
+public:
+
+    /* Open the cache in 'path', creating it with room for 'nrSlots'
+       entries if it doesn't exist yet. */
+    SharedPathInfoCache(const Path & path, size_t nrSlots);
+
+    ~SharedPathInfoCache();
+
+    /* Return the current generation. This must be read before
+       querying the database for info that is then passed to
+       insert(). */
+    uint64_t generation();
+
+    std::optional<std::string> lookup(std::string_view hashPart);
+
+    /* Cache 'data' under 'hashPart', unless the cache has been
+       invalidated since 'generation' was read. Data that doesn't fit
+       in a slot is not cached. */
+    void insert(std::string_view hashPart, std::string_view data, uint64_t generation);
+
+    /* Invalidate all entries. Must be called after committing a change
+       to the info of a valid path or its deletion. */
+    void invalidate();
+
+    /* The number of hits and misses of all processes using the
+       cache. */
+    std::pair<uint64_t, uint64_t> getStats();
+};
+
+}
@@ -1,5 +1,6 @@
 #include "sqlite.hh"
 #include "util.hh"
+#include "daemon-metrics.hh"
 
 #include <sqlite3.h>
 
@@ -61,6 +62,11 @@ void SQLite::exec(const std::string & stmt)
     });
 }
 
+uint64_t SQLite::getLastInsertedRowId()
+{
+    return sqlite3_last_insert_rowid(db);
+}
+
 void SQLiteStmt::create(sqlite3 * db, const string & sql)
 {
     checkInterrupt();
@@ -115,6 +121,11 @@ SQLiteStmt::Use & SQLiteStmt::Use::operator () (const unsigned char * data, size
     return *this;
 }
 
+SQLiteStmt::Use & SQLiteStmt::Use::operator () (const SQLiteBlob & blob, bool notNull)
+{
+    return (*this)((const unsigned char *) blob.data.data(), blob.data.size(), notNull);
+}
+
 SQLiteStmt::Use & SQLiteStmt::Use::operator () (int64_t value, bool notNull)
 {
     if (notNull) {
@@ -160,6 +171,12 @@ std::string SQLiteStmt::Use::getStr(int col)
     return s;
 }
 
+std::string SQLiteStmt::Use::getBlob(int col)
+{
+    auto data = (const char *) sqlite3_column_blob(stmt, col);
+    return std::string(data ? data : "", sqlite3_column_bytes(stmt, col));
+}
+
 int64_t SQLiteStmt::Use::getInt(int col)
 {
     // FIXME: detect nulls?
@@ -200,6 +217,8 @@ void handleSQLiteBusy(const SQLiteBusy & e)
 {
     static std::atomic<time_t> lastWarned{0};
 
+    daemonMetrics->sqliteBusy++;
+
     time_t now = time(0);
 
     if (now > lastWarned + 10) {
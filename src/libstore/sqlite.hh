@@ -26,6 +26,14 @@ struct SQLite
     void isCache();
 
     void exec(const std::string & stmt);
+
+    uint64_t getLastInsertedRowId();
+};
+
+/* A value to be bound as a BLOB rather than as text. */
+struct SQLiteBlob
+{
+    std::string data;
 };
 
 /* RAII wrapper to create and destroy SQLite prepared statements. */
@@ -56,6 +64,7 @@ struct SQLiteStmt
         /* Bind the next parameter. */
         Use & operator () (const std::string & value, bool notNull = true);
         Use & operator () (const unsigned char * data, size_t len, bool notNull = true);
+        Use & operator () (const SQLiteBlob & blob, bool notNull = true);
         Use & operator () (int64_t value, bool notNull = true);
         Use & bind(); // null
 
@@ -69,6 +78,7 @@ struct SQLiteStmt
         bool next();
 
         std::string getStr(int col);
+        std::string getBlob(int col);
         int64_t getInt(int col);
         bool isNull(int col);
     };
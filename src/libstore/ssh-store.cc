@@ -16,8 +16,12 @@ public:
 
     const Setting<Path> sshKey{(Store*) this, "", "ssh-key", "path to an SSH private key"};
     const Setting<bool> compress{(Store*) this, false, "compress", "whether to compress the connection"};
+    const Setting<std::string> transportCompression_{(Store*) this, "", "transport-compression",
+        "compression method to use on the worker protocol stream if the remote daemon supports it (only 'zstd' is supported)"};
     const Setting<Path> remoteProgram{(Store*) this, "nix-daemon", "remote-program", "path to the nix-daemon executable on the remote system"};
     const Setting<std::string> remoteStore{(Store*) this, "", "remote-store", "URI of the store on the remote system"};
+    const Setting<unsigned int> masterPersist{(Store*) this, 0, "master-persist",
+        "number of seconds to keep an SSH master connection shared with other processes alive after its last use"};
 
     SSHStore(const std::string & host, const Params & params)
         : Store(params)
@@ -28,10 +32,21 @@ public:
             sshKey,
             // Use SSH master only if using more than 1 connection.
             connections->capacity() > 1,
-            compress)
+            compress,
+            -1,
+            masterPersist)
     {
     }
 
+    ~SSHStore()
+    {
+        try {
+            flush();
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
     std::string getUri() override
     {
         return uriScheme + host;
@@ -57,6 +72,9 @@ private:
 
     SSHMaster master;
 
+    std::string transportCompression() override
+    { return transportCompression_; }
+
     void setOptions(RemoteStore::Connection & conn) override
     {
         /* TODO Add a way to explicitly ask for some options to be
@@ -70,6 +88,7 @@ private:
 
 void SSHStore::narFromPath(const StorePath & path, Sink & sink)
 {
+    flush();
     auto conn(connections->get());
     conn->to << wopNarFromPath << printStorePath(path);
     conn->processStderr();
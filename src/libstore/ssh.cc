@@ -1,14 +1,17 @@
 #include "ssh.hh"
+#include "hash.hh"
+#include "pathlocks.hh"
 
 namespace nix {
 
-SSHMaster::SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD)
+SSHMaster::SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD, unsigned int persist)
     : host(host)
     , fakeSSH(host == "localhost")
     , keyFile(keyFile)
-    , useMaster(useMaster && !fakeSSH)
+    , useMaster((useMaster || persist) && !fakeSSH)
     , compress(compress)
     , logFD(logFD)
+    , persist(persist)
 {
     if (host == "" || hasPrefix(host, "-"))
         throw Error("invalid SSH host name '%s'", host);
@@ -85,11 +88,43 @@ Path SSHMaster::startMaster()
 
     auto state(state_.lock());
 
-    if (state->sshMaster != -1) return state->socketPath;
+    if (state->sshMaster != -1 || !state->socketPath.empty()) return state->socketPath;
 
-    state->tmpDir = std::make_unique<AutoDelete>(createTempDir("", "nix", true, true, 0700));
+    AutoCloseFD lock;
 
-    state->socketPath = (Path) *state->tmpDir + "/ssh.sock";
+    if (persist) {
+        /* Use a socket path that is the same for every process
+           connecting to this host with the same options, short
+           enough to stay within the limit on socket path lengths. */
+        auto dir = getCacheDir() + "/nix/ssh";
+        createDirs(dir);
+        chmod(dir.c_str(), 0700);
+        auto socketPath = dir + "/" + hashString(htSHA256,
+            concatStringsSep("\n", Strings{host, keyFile, compress ? "1" : "0", getEnv("NIX_SSHOPTS").value_or("")})).to_string(Base32, false).substr(0, 32);
+
+        /* Serialise against other processes starting a master for
+           the same host. */
+        lock = openLockFile(socketPath + ".lock", true);
+        lockFile(lock.get(), ltWrite, true);
+
+        if (pathExists(socketPath)) {
+            Strings args = {host, "-O", "check", "-S", socketPath};
+            addCommonSSHOpts(args);
+            auto res = runProgram(RunOptions("ssh", args).killStderr(true));
+            if (statusOk(res.first)) {
+                debug("reusing SSH master connection to '%s'", host);
+                state->socketPath = socketPath;
+                return state->socketPath;
+            }
+            unlink(socketPath.c_str());
+        }
+
+        state->socketPath = socketPath;
+    } else {
+        state->tmpDir = std::make_unique<AutoDelete>(createTempDir("", "nix", true, true, 0700));
+
+        state->socketPath = (Path) *state->tmpDir + "/ssh.sock";
+    }
 
     Pipe out;
     out.create();
@@ -110,6 +145,8 @@ Path SSHMaster::startMaster()
             , "-o", "LocalCommand=echo started"
             , "-o", "PermitLocalCommand=yes"
             };
+        if (persist)
+            args.insert(args.end(), {"-o", fmt("ControlPersist=%d", persist)});
         if (verbosity >= lvlChatty)
             args.push_back("-v");
         addCommonSSHOpts(args);
@@ -125,8 +162,14 @@ Path SSHMaster::startMaster()
         reply = readLine(out.readSide.get());
     } catch (EndOfFile & e) { }
 
-    if (reply != "started")
+    if (reply != "started") {
+        state->socketPath.clear();
         throw Error("failed to start SSH master connection to '%s'", host);
+    }
+
+    /* Leave a shared master running for the next process; ssh exits
+       by itself after being idle for 'persist' seconds. */
+    if (persist) state->sshMaster.release();
 
     return state->socketPath;
 }
@@ -16,6 +16,11 @@ private:
     const bool compress;
     const int logFD;
 
+    /* If non-zero, the master connection is shared with other
+       processes through a socket in the cache directory, and stays
+       alive for this many seconds after its last use. */
+    const unsigned int persist;
+
     struct State
     {
         Pid sshMaster;
@@ -29,7 +34,7 @@ private:
 
 public:
 
-    SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD = -1);
+    SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD = -1, unsigned int persist = 0);
 
     struct Connection
     {
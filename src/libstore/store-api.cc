@@ -1,3 +1,4 @@
+#include "archive.hh"
 #include "crypto.hh"
 #include "globals.hh"
 #include "store-api.hh"
@@ -7,9 +8,13 @@
 #include "json.hh"
 #include "derivations.hh"
 #include "url.hh"
+#include "worker-protocol.hh"
+#include "nar-info.hh"
 
 #include <future>
 
+#include <fcntl.h>
+
 
 namespace nix {
 
@@ -179,6 +184,9 @@ StorePath Store::makeFixedOutputPath(
     const StorePathSet & references,
     bool hasSelfReference) const
 {
+    if (hash.type == htBLAKE3)
+        throw Error("BLAKE3 hashes cannot be used to compute store paths");
+
     if (hash.type == htSHA256 && method == FileIngestionMethod::Recursive) {
         return makeStorePath(makeType(*this, "source", references, hasSelfReference), hash, name);
     } else {
@@ -221,9 +229,39 @@ StorePath Store::computeStorePathForText(const string & name, const string & s,
 }
 
 
+StorePath Store::addToStoreFromDump(const string & dump, const string & name,
+    FileIngestionMethod method, HashType hashAlgo, RepairFlag repair)
+{
+    StringSink sink;
+    if (method == FileIngestionMethod::Flat)
+        dumpString(dump, sink);
+    auto & nar = method == FileIngestionMethod::Recursive ? dump : *sink.s;
+
+    auto h = hashString(hashAlgo, dump);
+
+    ValidPathInfo info(makeFixedOutputPath(method, h, name));
+    info.narHash = hashAlgo == htSHA256 && method == FileIngestionMethod::Recursive
+        ? h : hashString(htSHA256, nar);
+    info.narSize = nar.size();
+    info.ca = FixedOutputHash { .method = method, .hash = h };
+
+    StringSource source(nar);
+    addToStore(info, source, repair, NoCheckSigs);
+
+    return std::move(info.path);
+}
+
+
+void Store::addTextsToStore(const std::vector<StoreText> & texts, RepairFlag repair)
+{
+    for (auto & text : texts)
+        addTextToStore(text.name, text.contents, text.references, repair);
+}
+
+
 Store::Store(const Params & params)
     : Config(params)
-    , state({(size_t) pathInfoCacheSize})
+    , pathInfoCache((size_t) pathInfoCacheSize, pathInfoCacheCompact)
 {
 }
 
@@ -242,6 +280,83 @@ bool Store::PathInfoCacheValue::isKnownNow()
     return std::chrono::steady_clock::now() < time_point + ttl;
 }
 
+void Store::PathInfoCache::upsert(const std::string & key, const PathInfoCacheValue & value)
+{
+    Entry entry{value.time_point, value.value, {}};
+
+    if (compact && value.value && !value.value->references.empty()) {
+        /* Copy the info without its references, preserving its
+           dynamic type. */
+        std::shared_ptr<ValidPathInfo> stripped;
+        if (auto narInfo = std::dynamic_pointer_cast<const NarInfo>(value.value))
+            stripped = std::make_shared<NarInfo>(*narInfo);
+        else
+            stripped = std::make_shared<ValidPathInfo>(*value.value);
+        stripped->references.clear();
+        entry.references.reserve(value.value->references.size());
+        {
+            auto paths(paths_.lock());
+            for (auto & ref : value.value->references) {
+                auto i = paths->ids.find(ref.to_string());
+                if (i != paths->ids.end()) {
+                    entry.references.push_back(i->second);
+                    continue;
+                }
+                uint32_t id = paths->paths.size();
+                auto & path = paths->paths.emplace_back(ref);
+                paths->ids.emplace(path.to_string(), id);
+                entry.references.push_back(id);
+            }
+            entry.generation = paths->generation;
+        }
+        entry.value = std::move(stripped);
+    }
+
+    cache.upsert(key, entry);
+}
+
+
+std::optional<Store::PathInfoCacheValue> Store::PathInfoCache::toValue(const Entry & entry)
+{
+    PathInfoCacheValue res{.time_point = entry.time_point, .value = entry.value};
+
+    if (!entry.references.empty()) {
+        std::shared_ptr<ValidPathInfo> info;
+        if (auto narInfo = std::dynamic_pointer_cast<const NarInfo>(entry.value))
+            info = std::make_shared<NarInfo>(*narInfo);
+        else
+            info = std::make_shared<ValidPathInfo>(*entry.value);
+        auto paths(paths_.readLock());
+        /* Raced with clear(). */
+        if (entry.generation != paths->generation) return {};
+        /* The references were interned in sorted order. */
+        for (auto id : entry.references)
+            info->references.insert(info->references.end(), paths->paths[id]);
+        res.value = std::move(info);
+    }
+
+    return res;
+}
+
+
+std::optional<Store::PathInfoCacheValue> Store::PathInfoCache::get(const std::string & key)
+{
+    auto entry = cache.get(key);
+    if (!entry) return {};
+    return toValue(*entry);
+}
+
+
+void Store::PathInfoCache::clear()
+{
+    cache.clear();
+    auto paths(paths_.lock());
+    paths->ids.clear();
+    paths->paths.clear();
+    paths->generation++;
+}
+
+
 StorePathSet Store::queryDerivationOutputs(const StorePath & path)
 {
     auto outputMap = this->queryDerivationOutputMap(path);
@@ -257,8 +372,7 @@ bool Store::isValidPath(const StorePath & storePath)
     std::string hashPart(storePath.hashPart());
 
     {
-        auto state_(state.lock());
-        auto res = state_->pathInfoCache.get(hashPart);
+        auto res = pathInfoCache.get(hashPart);
         if (res && res->isKnownNow()) {
             stats.narInfoReadAverted++;
             return res->didExist();
@@ -269,8 +383,7 @@ bool Store::isValidPath(const StorePath & storePath)
         auto res = diskCache->lookupNarInfo(getUri(), hashPart);
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            auto state_(state.lock());
-            state_->pathInfoCache.upsert(hashPart,
+            pathInfoCache.upsert(hashPart,
                 res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue { .value = res.second });
             return res.first == NarInfoDiskCache::oValid;
         }
@@ -286,6 +399,25 @@ bool Store::isValidPath(const StorePath & storePath)
 }
 
 
+void Store::isValidPath(const StorePath & storePath,
+    Callback<bool> callback) noexcept
+{
+    auto callbackPtr = std::make_shared<decltype(callback)>(std::move(callback));
+
+    queryPathInfo(storePath,
+        {[callbackPtr](std::future<ref<const ValidPathInfo>> fut) {
+            try {
+                fut.get();
+                (*callbackPtr)(true);
+            } catch (InvalidPath &) {
+                (*callbackPtr)(false);
+            } catch (...) {
+                callbackPtr->rethrow();
+            }
+        }});
+}
+
+
 /* Default implementation for stores that only implement
    queryPathInfoUncached(). */
 bool Store::isValidPathUncached(const StorePath & path)
@@ -325,7 +457,7 @@ void Store::queryPathInfo(const StorePath & storePath,
         hashPart = storePath.hashPart();
 
         {
-            auto res = state.lock()->pathInfoCache.get(hashPart);
+            auto res = pathInfoCache.get(hashPart);
             if (res && res->isKnownNow()) {
                 stats.narInfoReadAverted++;
                 if (!res->didExist())
@@ -338,14 +470,11 @@ void Store::queryPathInfo(const StorePath & storePath,
             auto res = diskCache->lookupNarInfo(getUri(), hashPart);
             if (res.first != NarInfoDiskCache::oUnknown) {
                 stats.narInfoReadAverted++;
-                {
-                    auto state_(state.lock());
-                    state_->pathInfoCache.upsert(hashPart,
-                        res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = res.second });
-                    if (res.first == NarInfoDiskCache::oInvalid ||
-                        res.second->path != storePath)
-                        throw InvalidPath("path '%s' is not valid", printStorePath(storePath));
-                }
+                pathInfoCache.upsert(hashPart,
+                    res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = res.second });
+                if (res.first == NarInfoDiskCache::oInvalid ||
+                    res.second->path != storePath)
+                    throw InvalidPath("path '%s' is not valid", printStorePath(storePath));
                 return callback(ref<const ValidPathInfo>(res.second));
             }
         }
@@ -363,10 +492,7 @@ void Store::queryPathInfo(const StorePath & storePath,
                 if (diskCache)
                     diskCache->upsertNarInfo(getUri(), hashPart, info);
 
-                {
-                    auto state_(state.lock());
-                    state_->pathInfoCache.upsert(hashPart, PathInfoCacheValue { .value = info });
-                }
+                pathInfoCache.upsert(hashPart, PathInfoCacheValue { .value = info });
 
                 if (!info || info->path != parseStorePath(storePath)) {
                     stats.narInfoMissing++;
@@ -379,8 +505,108 @@ void Store::queryPathInfo(const StorePath & storePath,
 }
 
 
+bool Store::prefetchPathInfos(const StorePathSet & paths)
+{
+    StorePathSet missing;
+
+    for (auto & path : paths) {
+        auto res = pathInfoCache.get(std::string(path.hashPart()));
+        if (!res || !res->isKnownNow())
+            missing.insert(path);
+    }
+
+    if (missing.empty()) return true;
+
+    /* Get whatever we can from the disk cache in one go. */
+    if (diskCache) {
+        std::vector<std::string> hashParts;
+        for (auto & path : missing)
+            hashParts.emplace_back(path.hashPart());
+
+        auto res = diskCache->lookupNarInfos(getUri(), hashParts);
+
+        for (auto i = missing.begin(); i != missing.end(); ) {
+            std::string hashPart(i->hashPart());
+            auto & [outcome, narInfo] = res[hashPart];
+            if (outcome == NarInfoDiskCache::oUnknown
+                || (outcome == NarInfoDiskCache::oValid && narInfo->path != *i))
+            {
+                ++i;
+                continue;
+            }
+            stats.narInfoReadAverted++;
+            pathInfoCache.upsert(hashPart,
+                outcome == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue { .value = narInfo });
+            i = missing.erase(i);
+        }
+
+        if (missing.empty()) return true;
+    }
+
+    std::map<StorePath, std::shared_ptr<const ValidPathInfo>> infos;
+    if (!queryPathInfosUncached(missing, infos)) return false;
+
+    for (auto & path : missing) {
+        auto i = infos.find(path);
+        if (i == infos.end()) {
+            stats.narInfoMissing++;
+            pathInfoCache.upsert(std::string(path.hashPart()), PathInfoCacheValue{});
+        } else
+            pathInfoCache.upsert(std::string(path.hashPart()), PathInfoCacheValue { .value = i->second });
+    }
+
+    return true;
+}
+
+
+void Store::queryValidPaths(const StorePathSet & paths,
+    Callback<StorePathSet> callback) noexcept
+{
+    if (paths.empty()) return callback(StorePathSet());
+
+    struct State
+    {
+        size_t left;
+        StorePathSet valid;
+        std::exception_ptr exc;
+        Callback<StorePathSet> callback;
+    };
+
+    auto state_ = std::make_shared<Sync<State>>(State{paths.size(), {}, nullptr, std::move(callback)});
+
+    for (auto & path : paths)
+        isValidPath(path, {[path, state_](std::future<bool> fut) {
+            auto state(state_->lock());
+            try {
+                if (fut.get()) state->valid.insert(path);
+            } catch (...) {
+                state->exc = std::current_exception();
+            }
+            assert(state->left);
+            if (--state->left) return;
+            if (state->exc)
+                state->callback.rethrow(state->exc);
+            else
+                state->callback(std::move(state->valid));
+        }});
+}
+
+
 StorePathSet Store::queryValidPaths(const StorePathSet & paths, SubstituteFlag maybeSubstitute)
 {
+    if (asyncQueries()) {
+        std::promise<StorePathSet> promise;
+        queryValidPaths(paths,
+            {[&](std::future<StorePathSet> result) {
+                try {
+                    promise.set_value(result.get());
+                } catch (...) {
+                    promise.set_exception(std::current_exception());
+                }
+            }});
+        return promise.get_future().get();
+    }
+
     struct State
     {
         size_t left;
@@ -461,15 +687,63 @@ void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const StorePathSet & store
     bool includeImpureInfo, bool showClosureSize,
     Base hashBase,
     AllowInvalidFlag allowInvalid)
+{
+    pathInfoToJSON(jsonOut, StorePaths(storePaths.begin(), storePaths.end()),
+        includeImpureInfo, showClosureSize, hashBase, allowInvalid);
+}
+
+
+void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const StorePaths & storePaths,
+    bool includeImpureInfo, bool showClosureSize,
+    Base hashBase,
+    AllowInvalidFlag allowInvalid)
 {
     auto jsonList = jsonOut.list();
 
-    for (auto & storePath : storePaths) {
-        auto jsonPath = jsonList.object();
-        jsonPath.attr("path", printStorePath(storePath));
+    struct Entry
+    {
+        std::shared_ptr<const ValidPathInfo> info;
+        std::pair<uint64_t, uint64_t> closureSizes;
+    };
+
+    /* Large enough to keep the thread pool busy, small enough that
+       the first paths are printed without noticeable delay. */
+    const size_t windowSize = 1024;
+
+    std::vector<Entry> window;
+
+    for (size_t start = 0; start < storePaths.size(); start += windowSize) {
+        auto end = std::min(storePaths.size(), start + windowSize);
 
-        try {
-            auto info = queryPathInfo(storePath);
+        window.clear();
+        window.resize(end - start);
+
+        {
+            ThreadPool pool;
+            for (size_t i = start; i < end; i++)
+                pool.enqueue([&, i]() {
+                    auto & entry = window[i - start];
+                    try {
+                        entry.info = queryPathInfo(storePaths[i]);
+                    } catch (InvalidPath &) {
+                        return;
+                    }
+                    if (showClosureSize)
+                        entry.closureSizes = getClosureSize(storePaths[i]);
+                });
+            pool.process();
+        }
+
+        for (size_t i = start; i < end; i++) {
+            auto & [info, closureSizes] = window[i - start];
+
+            auto jsonPath = jsonList.object();
+            jsonPath.attr("path", printStorePath(storePaths[i]));
+
+            if (!info) {
+                jsonPath.attr("valid", false);
+                continue;
+            }
 
             jsonPath
                 .attr("narHash", info->narHash.to_string(hashBase, true))
@@ -484,12 +758,8 @@ void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const StorePathSet & store
             if (info->ca)
                 jsonPath.attr("ca", renderContentAddress(info->ca));
 
-            std::pair<uint64_t, uint64_t> closureSizes;
-
-            if (showClosureSize) {
-                closureSizes = getClosureSize(info->path);
+            if (showClosureSize)
                 jsonPath.attr("closureSize", closureSizes.first);
-            }
 
             if (includeImpureInfo) {
 
@@ -508,8 +778,7 @@ void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const StorePathSet & store
                         jsonSigs.elem(sig);
                 }
 
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-                    std::shared_ptr<const ValidPathInfo>(info));
+                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
 
                 if (narInfo) {
                     if (!narInfo->url.empty())
@@ -522,9 +791,6 @@ void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const StorePathSet & store
                         jsonPath.attr("closureDownloadSize", closureSizes.second);
                 }
             }
-
-        } catch (InvalidPath &) {
-            jsonPath.attr("valid", false);
         }
     }
 }
@@ -549,10 +815,7 @@ std::pair<uint64_t, uint64_t> Store::getClosureSize(const StorePath & storePath)
 
 const Store::Stats & Store::getStats()
 {
-    {
-        auto state_(state.lock());
-        stats.pathInfoCacheSize = state_->pathInfoCache.size();
-    }
+    stats.pathInfoCacheSize = pathInfoCache.size();
     return stats;
 }
 
@@ -611,13 +874,22 @@ void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
         info = info2;
     }
 
-    auto source = sinkToSource([&](Sink & sink) {
+    if (dstStore->addToStoreFrom(*srcStore, *info, repair, checkSigs)) {
+        act.progress(info->narSize, info->narSize);
+        return;
+    }
+
+    /* Fetch (and typically decompress) the NAR on a separate thread,
+       so that it overlaps with unpacking and hashing it on the
+       destination. */
+    auto source = sinkToSourceThreaded([&](Sink & sink) {
+        PushActivity pact(act.id);
         LambdaSink wrapperSink([&](const unsigned char * data, size_t len) {
             sink(data, len);
             total += len;
             act.progress(total, info->narSize);
         });
-        srcStore->narFromPath(storePath, wrapperSink);
+        srcStore->narFromPathUsingDeltas(storePath, *dstStore, wrapperSink);
     }, [&]() {
            throw EndOfFile("NAR for '%s' fetched from '%s' is incomplete", srcStore->printStorePath(storePath), srcStore->getUri());
     });
@@ -626,16 +898,124 @@ void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
 }
 
 
+std::unique_ptr<Store::PathImporter> Store::beginImport(
+    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+{
+    struct Importer : PathImporter
+    {
+        Store & store;
+        RepairFlag repair;
+        CheckSigsFlag checkSigs;
+        std::shared_ptr<FSAccessor> accessor;
+
+        Importer(Store & store, RepairFlag repair, CheckSigsFlag checkSigs,
+            std::shared_ptr<FSAccessor> accessor)
+            : store(store), repair(repair), checkSigs(checkSigs), accessor(accessor)
+        { }
+
+        void add(const ValidPathInfo & info, Source & narSource) override
+        {
+            store.addToStore(info, narSource, repair, checkSigs, accessor);
+        }
+    };
+
+    return std::make_unique<Importer>(*this, repair, checkSigs, accessor);
+}
+
+
+void Store::addMultipleToStore(Source & source, RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    auto importer = beginImport(repair, checkSigs);
+    auto expected = readNum<uint64_t>(source);
+    for (uint64_t n = 0; n < expected; n++) {
+        auto info = readValidPathInfo(*this, source);
+        info.ultimate = false;
+        importer->add(info, source);
+    }
+    importer->finish();
+}
+
+
+/* A log of the paths that copyPaths() has copied, so that an
+   interrupted copy can be resumed. Each path is appended as a line
+   once it is valid in the destination store. */
+struct CopyJournal
+{
+    Path path;
+    Sync<AutoCloseFD> fd;
+
+    CopyJournal(const Path & path) : path(path)
+    {
+        if (path.empty()) return;
+        createDirs(dirOf(path));
+        *fd.lock() = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (!*fd.lock()) throw SysError("opening copy journal '%s'", path);
+    }
+
+    /* Return the paths recorded by earlier runs. A line may be
+       truncated if a run was killed while writing it. */
+    StorePathSet read(const Store & store)
+    {
+        StorePathSet res;
+        if (path.empty()) return res;
+        for (auto & line : tokenizeString<Strings>(readFile(path), "\n"))
+            try {
+                res.insert(store.parseStorePath(line));
+            } catch (Error &) {
+            }
+        return res;
+    }
+
+    void record(const Store & store, const StorePath & storePath)
+    {
+        if (path.empty()) return;
+        writeFull(fd.lock()->get(), store.printStorePath(storePath) + "\n");
+    }
+
+    void remove()
+    {
+        if (path.empty()) return;
+        *fd.lock() = -1;
+        unlink(path.c_str());
+    }
+};
+
+/* The number of paths per addMultipleToStore() call when a journal
+   is used, so that an interruption loses at most this many. */
+static const size_t journaledBatchSize = 1024;
+
+/* The number of paths copyPaths() works on (has queried but not yet
+   copied) at a time. */
+static const size_t copyFrontier = 1024;
+
+
 void copyPaths(ref<Store> srcStore, ref<Store> dstStore, const StorePathSet & storePaths,
-    RepairFlag repair, CheckSigsFlag checkSigs, SubstituteFlag substitute)
+    RepairFlag repair, CheckSigsFlag checkSigs, SubstituteFlag substitute, const Path & journalPath)
 {
-    auto valid = dstStore->queryValidPaths(storePaths, substitute);
+    CopyJournal journal(journalPath);
 
-    PathSet missing;
+    /* Paths that an earlier run has copied don't need to be checked
+       again. */
+    auto copied = journal.read(*srcStore);
+
+    StorePathSet toCheck;
     for (auto & path : storePaths)
+        if (!copied.count(path)) toCheck.insert(path);
+
+    if (!copied.empty())
+        printInfo("resuming copy: %d of %d paths were copied earlier",
+            storePaths.size() - toCheck.size(), storePaths.size());
+
+    auto valid = dstStore->queryValidPaths(toCheck, substitute);
+
+    PathSet missing;
+    for (auto & path : toCheck)
         if (!valid.count(path)) missing.insert(srcStore->printStorePath(path));
 
-    if (missing.empty()) return;
+    if (missing.empty()) {
+        journal.remove();
+        return;
+    }
 
     Activity act(*logger, lvlInfo, actCopyPaths, fmt("copying %d paths", missing.size()));
 
@@ -648,6 +1028,56 @@ void copyPaths(ref<Store> srcStore, ref<Store> dstStore, const StorePathSet & st
         act.progress(nrDone, missing.size(), nrRunning, nrFailed);
     };
 
+    /* Send the paths as one stream, in topological order. With
+       --keep-going we copy them separately so that one failure
+       doesn't abort the rest. */
+    if (dstStore->batchesImports() && !settings.keepGoing) {
+        StorePathSet missingPaths;
+        for (auto & path : missing)
+            missingPaths.insert(srcStore->parseStorePath(path));
+        auto sorted = srcStore->topoSortPaths(missingPaths);
+        std::reverse(sorted.begin(), sorted.end());
+
+        auto sendBatch = [&](StorePaths::iterator begin, StorePaths::iterator end) {
+            auto source = sinkToSource([&](Sink & sink) {
+                sink << (end - begin);
+                for (auto i = begin; i != end; ++i) {
+                    auto & path = *i;
+                    checkInterrupt();
+                    ValidPathInfo info(*srcStore->queryPathInfo(path));
+                    info.ultimate = false;
+                    if (!info.narHash) {
+                        StringSink narSink;
+                        srcStore->narFromPath(path, narSink);
+                        info.narHash = hashString(htSHA256, *narSink.s);
+                        if (!info.narSize) info.narSize = narSink.s->size();
+                        writeValidPathInfo(*dstStore, sink, info);
+                        sink(*narSink.s);
+                    } else {
+                        writeValidPathInfo(*dstStore, sink, info);
+                        srcStore->narFromPath(path, sink);
+                    }
+                    nrDone++;
+                    showProgress();
+                }
+            });
+
+            dstStore->addMultipleToStore(*source, repair, checkSigs);
+
+            for (auto i = begin; i != end; ++i)
+                journal.record(*srcStore, *i);
+        };
+
+        /* With a journal, send the paths in several batches so that
+           an interruption doesn't lose all progress. */
+        size_t batchSize = journalPath.empty() ? sorted.size() : journaledBatchSize;
+        for (size_t start = 0; start < sorted.size(); start += batchSize)
+            sendBatch(sorted.begin() + start, sorted.begin() + std::min(start + batchSize, sorted.size()));
+
+        journal.remove();
+        return;
+    }
+
     ThreadPool pool;
 
     processGraph<Path>(pool,
@@ -688,9 +1118,17 @@ void copyPaths(ref<Store> srcStore, ref<Store> dstStore, const StorePathSet & st
                 }
             }
 
+            journal.record(*srcStore, storePath);
+
             nrDone++;
             showProgress();
-        });
+        },
+
+        /* Don't query the infos of the entire closure before the
+           first copies finish. */
+        copyFrontier);
+
+    if (!nrFailed) journal.remove();
 }
 
 
@@ -811,9 +1249,135 @@ size_t ValidPathInfo::checkSignatures(const Store & store, const PublicKeys & pu
 }
 
 
+/* Signatures known to be valid, identified by signatureKey(). */
+static SharedSync<std::unordered_set<std::string>> verifiedSignatures;
+
+
+/* Return a key that identifies the verification of `sig' on
+   `fingerprint', or nothing if `sig' isn't made by one of
+   `publicKeys'. It includes the public key so that changing a trusted
+   key under the same name invalidates earlier results. */
+static std::optional<std::string> signatureKey(const std::string & fingerprint,
+    const std::string & sig, const PublicKeys & publicKeys)
+{
+    auto key = publicKeys.find(sig.substr(0, sig.find(':')));
+    if (key == publicKeys.end()) return {};
+    return hashString(htSHA256, fingerprint + '\0' + sig + '\0' + key->second.key).to_string(Base32, false);
+}
+
+
+/* Look up signature keys in memory and in the NAR info disk cache,
+   and return the ones that are known to be valid. The disk cache is
+   only an optimisation, so its errors are ignored. */
+static std::set<std::string> lookupVerifiedSignatures(const std::vector<std::string> & keys)
+{
+    std::set<std::string> res;
+    std::vector<std::string> missing;
+
+    {
+        auto verified(verifiedSignatures.readLock());
+        for (auto & key : keys)
+            if (verified->count(key)) res.insert(key); else missing.push_back(key);
+    }
+
+    if (missing.empty()) return res;
+
+    try {
+        auto found = getNarInfoDiskCache()->lookupVerifiedSignatures(missing);
+        verifiedSignatures.lock()->insert(found.begin(), found.end());
+        res.insert(found.begin(), found.end());
+    } catch (Error & e) {
+        debug("cannot look up verified signatures: %s", e.what());
+    }
+
+    return res;
+}
+
+
+static void recordVerifiedSignatures(const std::vector<std::string> & keys)
+{
+    if (keys.empty()) return;
+
+    verifiedSignatures.lock()->insert(keys.begin(), keys.end());
+
+    try {
+        getNarInfoDiskCache()->upsertVerifiedSignatures(keys);
+    } catch (Error & e) {
+        debug("cannot record verified signatures: %s", e.what());
+    }
+}
+
+
 bool ValidPathInfo::checkSignature(const Store & store, const PublicKeys & publicKeys, const std::string & sig) const
 {
-    return verifyDetached(fingerprint(store), sig, publicKeys);
+    auto fp = fingerprint(store);
+
+    auto key = signatureKey(fp, sig, publicKeys);
+    if (!key) return false;
+
+    if (lookupVerifiedSignatures({*key}).count(*key)) return true;
+
+    if (!verifyDetached(fp, sig, publicKeys)) return false;
+
+    recordVerifiedSignatures({*key});
+    return true;
+}
+
+
+std::vector<size_t> ValidPathInfo::checkSignatures(const Store & store,
+    const std::vector<std::shared_ptr<const ValidPathInfo>> & infos,
+    const PublicKeys & publicKeys)
+{
+    std::vector<size_t> res(infos.size(), 0);
+
+    struct Todo
+    {
+        size_t index;
+        std::string fingerprint, sig, key;
+    };
+    std::vector<Todo> todo;
+
+    for (size_t n = 0; n < infos.size(); n++) {
+        auto & info = infos[n];
+        if (info->isContentAddressed(store)) {
+            res[n] = maxSigs;
+            continue;
+        }
+        if (info->sigs.empty()) continue;
+        auto fp = info->fingerprint(store);
+        for (auto & sig : info->sigs)
+            if (auto key = signatureKey(fp, sig, publicKeys))
+                todo.push_back({n, fp, sig, *key});
+    }
+
+    std::vector<std::string> keys;
+    for (auto & i : todo) keys.push_back(i.key);
+    auto verified = lookupVerifiedSignatures(keys);
+
+    std::vector<std::atomic<bool>> valid(todo.size());
+    ThreadPool pool;
+
+    for (size_t n = 0; n < todo.size(); n++) {
+        if (verified.count(todo[n].key))
+            valid[n] = true;
+        else
+            pool.enqueue([&, n]() {
+                valid[n] = verifyDetached(todo[n].fingerprint, todo[n].sig, publicKeys);
+            });
+    }
+
+    pool.process();
+
+    std::vector<std::string> newlyVerified;
+    for (size_t n = 0; n < todo.size(); n++)
+        if (valid[n]) {
+            if (!verified.count(todo[n].key)) newlyVerified.push_back(todo[n].key);
+            res[todo[n].index]++;
+        }
+
+    recordVerifiedSignatures(newlyVerified);
+
+    return res;
 }
 
 
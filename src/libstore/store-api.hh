@@ -12,6 +12,7 @@
 #include "derivations.hh"
 
 #include <atomic>
+#include <deque>
 #include <limits>
 #include <map>
 #include <unordered_map>
@@ -173,9 +174,17 @@ struct ValidPathInfo
        is content-addressed. */
     size_t checkSignatures(const Store & store, const PublicKeys & publicKeys) const;
 
-    /* Verify a single signature. */
+    /* Verify a single signature. Valid signatures are remembered in
+       memory and in the NAR info disk cache, so they are only
+       verified once. */
     bool checkSignature(const Store & store, const PublicKeys & publicKeys, const std::string & sig) const;
 
+    /* Like checkSignatures(), but for many paths at once. Signatures
+       that haven't been verified before are checked in parallel. */
+    static std::vector<size_t> checkSignatures(const Store & store,
+        const std::vector<std::shared_ptr<const ValidPathInfo>> & infos,
+        const PublicKeys & publicKeys);
+
     Strings shortRefs() const;
 
     ValidPathInfo(const ValidPathInfo & other) = default;
@@ -189,6 +198,15 @@ struct ValidPathInfo
 typedef list<ValidPathInfo> ValidPathInfos;
 
 
+/* A regular file to be added to the store by addTextsToStore(). */
+struct StoreText
+{
+    std::string name;
+    std::string contents;
+    StorePathSet references;
+};
+
+
 enum BuildMode { bmNormal, bmRepair, bmCheck };
 
 
@@ -205,7 +223,7 @@ struct BuildResult
         InputRejected,
         OutputRejected,
         TransientFailure, // possibly transient
-        CachedFailure, // no longer used
+        CachedFailure, // see ‘cache-failures’
         TimedOut,
         MiscFailure,
         DependencyFailed,
@@ -227,6 +245,12 @@ struct BuildResult
        was repeated). */
     time_t startTime = 0, stopTime = 0;
 
+    /* The CPU time and peak memory used by the build (or the last
+       round), if it ran in its own cgroup (see ‘use-cgroups’). These
+       are not transferred by the worker protocol. */
+    std::optional<std::chrono::microseconds> cpuUser, cpuSystem;
+    std::optional<uint64_t> memoryPeak;
+
     bool success() {
         return status == Built || status == Substituted || status == AlreadyValid;
     }
@@ -245,6 +269,10 @@ public:
 
     const Setting<int> pathInfoCacheSize{this, 65536, "path-info-cache-size", "size of the in-memory store path information cache"};
 
+    const Setting<bool> pathInfoCacheCompact{this, false, "path-info-cache-compact",
+        "whether to store the references of cached path information as indices into a shared path table, "
+        "trading some CPU time on lookups for much less memory in large caches"};
+
     const Setting<bool> isTrusted{this, false, "trusted", "whether paths from this store can be used as substitutes even when they lack trusted signatures"};
 
     Setting<int> priority{this, 0, "priority", "priority of this substituter (lower value means higher priority)"};
@@ -271,13 +299,59 @@ protected:
         }
     };
 
-    struct State
+    /* A thread-safe LRU cache of PathInfoCacheValues, keyed by the
+       hash part of the store path. In compact mode, the references of
+       the cached ValidPathInfos are stored as indices into a table of
+       the paths seen by this cache, which is much smaller than a
+       StorePathSet per entry, and the full object is materialised on
+       lookup. */
+    class PathInfoCache
     {
-        // FIXME: fix key
-        LRUCache<std::string, PathInfoCacheValue> pathInfoCache;
+        struct Entry
+        {
+            std::chrono::time_point<std::chrono::steady_clock> time_point;
+            /* In compact mode, a copy without references. */
+            std::shared_ptr<const ValidPathInfo> value;
+            std::vector<uint32_t> references;
+            /* The generation of the path table that `references'
+               refers to. */
+            uint64_t generation = 0;
+        };
+
+        ShardedLRUCache<std::string, Entry> cache;
+        bool compact;
+
+        /* Interned paths. `ids' points into the elements of `paths',
+           which a deque never moves. clear() bumps `generation', so
+           entries added concurrently with it are ignored. */
+        struct Paths
+        {
+            std::deque<StorePath> paths;
+            std::unordered_map<std::string_view, uint32_t> ids;
+            uint64_t generation = 0;
+        };
+
+        SharedSync<Paths> paths_;
+
+        std::optional<PathInfoCacheValue> toValue(const Entry & entry);
+
+    public:
+
+        PathInfoCache(size_t capacity, bool compact)
+            : cache(capacity), compact(compact) { }
+
+        void upsert(const std::string & key, const PathInfoCacheValue & value);
+
+        std::optional<PathInfoCacheValue> get(const std::string & key);
+
+        bool erase(const std::string & key) { return cache.erase(key); }
+
+        void clear();
+
+        size_t size() { return cache.size(); }
     };
 
-    Sync<State> state;
+    PathInfoCache pathInfoCache;
 
     std::shared_ptr<NarInfoDiskCache> diskCache;
 
@@ -372,6 +446,10 @@ public:
     /* Check whether a path is valid. */
     bool isValidPath(const StorePath & path);
 
+    /* Asynchronous version of isValidPath(). */
+    void isValidPath(const StorePath & path,
+        Callback<bool> callback) noexcept;
+
 protected:
 
     virtual bool isValidPathUncached(const StorePath & path);
@@ -383,6 +461,19 @@ public:
     virtual StorePathSet queryValidPaths(const StorePathSet & paths,
         SubstituteFlag maybeSubstitute = NoSubstitute);
 
+    /* Asynchronous version of queryValidPaths(). All queries are
+       issued from the calling thread, so this only overlaps them on
+       stores with asyncQueries(). */
+    void queryValidPaths(const StorePathSet & paths,
+        Callback<StorePathSet> callback) noexcept;
+
+    /* Whether queryPathInfoUncached() returns without waiting for
+       the result (e.g. because it hands the request to the file
+       transfer thread). Such stores don't need a thread pool to
+       have many queries in flight. */
+    virtual bool asyncQueries()
+    { return false; }
+
     /* Query the set of all valid paths. Note that for some store
        backends, the name part of store paths may be omitted
        (i.e. you'll get /nix/store/<hash> rather than
@@ -404,8 +495,28 @@ protected:
     virtual void queryPathInfoUncached(const StorePath & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept = 0;
 
+    /* Query information about several paths at once, for stores
+       where that is cheaper than separate queryPathInfoUncached()
+       calls. Invalid paths are omitted from `infos'. Return false if
+       the store cannot do batched queries. */
+    virtual bool queryPathInfosUncached(const StorePathSet & paths,
+        std::map<StorePath, std::shared_ptr<const ValidPathInfo>> & infos)
+    { return false; }
+
 public:
 
+    /* Fill the path info cache with information about `paths' using
+       as few round trips as possible, consulting the disk cache in
+       bulk first. Return false if some paths remain unknown and the
+       store doesn't support batched queries. */
+    bool prefetchPathInfos(const StorePathSet & paths);
+
+    /* Fill the path info cache with information about the closures
+       of `paths', if the store can do so cheaply (e.g. a binary cache
+       with closure manifests). Otherwise, do nothing. */
+    virtual void prefetchClosureInfos(const StorePathSet & paths)
+    { }
+
     /* Queries the set of incoming FS references for a store path.
        The result is not cleared. */
     virtual void queryReferrers(const StorePath & path, StorePathSet & referrers)
@@ -424,6 +535,17 @@ public:
     virtual OutputPathMap queryDerivationOutputMap(const StorePath & path)
     { unsupported("queryDerivationOutputMap"); }
 
+    /* Return the hash modulo fixed-output subderivations (see
+       hashDerivationModulo()) of the valid derivation `drvPath', if
+       it has been recorded previously. */
+    virtual std::optional<Hash> queryDrvHashModulo(const StorePath & drvPath)
+    { return {}; }
+
+    /* Record the hash modulo fixed-output subderivations of
+       `drvPath'. This is a no-op if `drvPath' is not valid. */
+    virtual void registerDrvHashModulo(const StorePath & drvPath, const Hash & hash)
+    { }
+
     /* Query the full store path given the hash part of a valid store
        path, or empty if the path doesn't exist. */
     virtual std::optional<StorePath> queryPathFromHashPart(const std::string & hashPart) = 0;
@@ -442,6 +564,46 @@ public:
         RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs,
         std::shared_ptr<FSAccessor> accessor = 0) = 0;
 
+    /* Import a path from `srcStore' without serialising it to a NAR,
+       e.g. by cloning its files. `info' is trusted to describe the
+       contents of the path in `srcStore'. Returns false if this
+       store can't do that, in which case the caller should fall back
+       to addToStore(). */
+    virtual bool addToStoreFrom(Store & srcStore, const ValidPathInfo & info,
+        RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs)
+    { return false; }
+
+    /* A sink for a sequence of paths to import, in topological
+       order. Paths may only become valid when finish() is called. */
+    struct PathImporter
+    {
+        virtual ~PathImporter() { }
+
+        virtual void add(const ValidPathInfo & info, Source & narSource) = 0;
+
+        /* Register the paths that haven't been registered yet. */
+        virtual void finish() { }
+    };
+
+    /* Start an import of several paths. The default implementation
+       calls addToStore() for each path. */
+    virtual std::unique_ptr<PathImporter> beginImport(
+        RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs,
+        std::shared_ptr<FSAccessor> accessor = 0);
+
+    /* Import several paths into the store. `source' contains the
+       number of paths, followed by the ValidPathInfo (see
+       writeValidPathInfo()) and NAR of each path, in topological
+       order. The paths are not marked as ultimately trusted. */
+    virtual void addMultipleToStore(Source & source,
+        RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs);
+
+    /* Whether copyPaths() should send all paths to this store through
+       a single addMultipleToStore() call rather than copying them one
+       at a time in parallel. */
+    virtual bool batchesImports()
+    { return false; }
+
     /* Copy the contents of a path to the store and register the
        validity the resulting path.  The resulting path is returned.
        The function object `filter' can be used to exclude files (see
@@ -450,21 +612,33 @@ public:
         FileIngestionMethod method = FileIngestionMethod::Recursive, HashType hashAlgo = htSHA256,
         PathFilter & filter = defaultPathFilter, RepairFlag repair = NoRepair) = 0;
 
-    // FIXME: remove?
+    /* Like addToStore(), but the contents are given as a NAR (or,
+       for flat files, the file contents) in memory. The default
+       implementation imports it as a content-addressed NAR, so it
+       works on any store. */
     virtual StorePath addToStoreFromDump(const string & dump, const string & name,
-        FileIngestionMethod method = FileIngestionMethod::Recursive, HashType hashAlgo = htSHA256, RepairFlag repair = NoRepair)
-    {
-        throw Error("addToStoreFromDump() is not supported by this store");
-    }
+        FileIngestionMethod method = FileIngestionMethod::Recursive, HashType hashAlgo = htSHA256, RepairFlag repair = NoRepair);
 
     /* Like addToStore, but the contents written to the output path is
        a regular file containing the given string. */
     virtual StorePath addTextToStore(const string & name, const string & s,
         const StorePathSet & references, RepairFlag repair = NoRepair) = 0;
 
+    /* Like addTextToStore(), but for several files at once. Files
+       may refer to files that precede them in `texts'. */
+    virtual void addTextsToStore(const std::vector<StoreText> & texts,
+        RepairFlag repair = NoRepair);
+
     /* Write a NAR dump of a store path. */
     virtual void narFromPath(const StorePath & path, Sink & sink) = 0;
 
+    /* Like narFromPath(), but the NAR may be reconstructed from a
+       binary delta against a path that is valid in `baseStore'. */
+    virtual void narFromPathUsingDeltas(const StorePath & path, Store & baseStore, Sink & sink)
+    {
+        narFromPath(path, sink);
+    }
+
     /* For each path, if it's a derivation, build it.  Building a
        derivation means ensuring that the output paths are valid.  If
        they are already valid, this is a no-op.  Otherwise, validity
@@ -549,10 +723,20 @@ public:
         Base hashBase = Base32,
         AllowInvalidFlag allowInvalid = DisallowInvalid);
 
+    /* Likewise, but preserving the order of ‘storePaths’. Path info
+       and closure sizes are fetched in parallel a window at a time,
+       and each window is written out before the next is fetched, so
+       output starts right away and memory use does not grow with the
+       number of paths. */
+    void pathInfoToJSON(JSONPlaceholder & jsonOut, const StorePaths & storePaths,
+        bool includeImpureInfo, bool showClosureSize,
+        Base hashBase = Base32,
+        AllowInvalidFlag allowInvalid = DisallowInvalid);
+
     /* Return the size of the closure of the specified path, that is,
        the sum of the size of the NAR serialisation of each path in
        the closure. */
-    std::pair<uint64_t, uint64_t> getClosureSize(const StorePath & storePath);
+    virtual std::pair<uint64_t, uint64_t> getClosureSize(const StorePath & storePath);
 
     /* Optimise the disk space usage of the Nix store by hard-linking files
        with the same contents. */
@@ -562,6 +746,16 @@ public:
        remain. */
     virtual bool verifyStore(bool checkContents, RepairFlag repair = NoRepair) { return false; };
 
+    /* Return the derivations whose builds were recorded as failed
+       (see ‘cache-failures’). */
+    virtual StorePathSet queryFailedPaths()
+    { unsupported("queryFailedPaths"); }
+
+    /* Forget that the builds of the given derivations failed, or of
+       all derivations if ‘paths’ is empty. */
+    virtual void clearFailedPaths(const StorePathSet & paths)
+    { unsupported("clearFailedPaths"); }
+
     /* Return an object to access files in the Nix store. */
     virtual ref<FSAccessor> getFSAccessor()
     { unsupported("getFSAccessor"); }
@@ -647,13 +841,19 @@ public:
        occasionally flush their path info cache. */
     void clearPathInfoCache()
     {
-        state.lock()->pathInfoCache.clear();
+        pathInfoCache.clear();
     }
 
     /* Establish a connection to the store, for store types that have
        a notion of connection. Otherwise this is a no-op. */
     virtual void connect() { };
 
+    /* Perform any writes that the store has deferred, such as
+       batched addTextToStore() calls, so that the paths returned by
+       them are valid. This must be done before those paths are shown
+       to the user or passed to another process. */
+    virtual void flush() { };
+
     /* Get the protocol version of this store or it's connection. */
     virtual unsigned int getProtocol()
     {
@@ -718,7 +918,9 @@ public:
     Path toRealPath(const Path & storePath) override
     {
         assert(isInStore(storePath));
-        return getRealStoreDir() + "/" + std::string(storePath, storeDir.size() + 1);
+        auto realStoreDir = getRealStoreDir();
+        if (realStoreDir == storeDir) return storePath;
+        return realStoreDir + "/" + std::string(storePath, storeDir.size() + 1);
     }
 
     std::shared_ptr<std::string> getBuildLog(const StorePath & path) override;
@@ -734,11 +936,15 @@ void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
    in parallel. They are copied in a topologically sorted order
    (i.e. if A is a reference of B, then A is copied before B), but
    the set of store paths is not automatically closed; use
-   copyClosure() for that. */
+   copyClosure() for that. If `journal' is not empty, the paths that
+   have been copied are recorded in that file, and a later call with
+   the same journal doesn't check or copy them again. The journal is
+   removed once all paths have been copied. */
 void copyPaths(ref<Store> srcStore, ref<Store> dstStore, const StorePathSet & storePaths,
     RepairFlag repair = NoRepair,
     CheckSigsFlag checkSigs = CheckSigs,
-    SubstituteFlag substitute = NoSubstitute);
+    SubstituteFlag substitute = NoSubstitute,
+    const Path & journal = "");
 
 
 /* Copy the closure of the specified paths from one store to another. */
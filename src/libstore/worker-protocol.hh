@@ -6,7 +6,7 @@ namespace nix {
 #define WORKER_MAGIC_1 0x6e697863
 #define WORKER_MAGIC_2 0x6478696f
 
-#define PROTOCOL_VERSION 0x116
+#define PROTOCOL_VERSION 0x11b
 #define GET_PROTOCOL_MAJOR(x) ((x) & 0xff00)
 #define GET_PROTOCOL_MINOR(x) ((x) & 0x00ff)
 
@@ -50,6 +50,9 @@ typedef enum {
     wopAddToStoreNar = 39,
     wopQueryMissing = 40,
     wopQueryDerivationOutputMap = 41,
+    wopAddTextsToStore = 42,
+    wopQueryPathInfos = 43,
+    wopAddMultipleToStore = 44,
 } WorkerOp;
 
 
@@ -65,6 +68,7 @@ typedef enum {
 
 class Store;
 struct Source;
+struct ValidPathInfo;
 
 template<class T> T readStorePaths(const Store & store, Source & from);
 
@@ -72,4 +76,10 @@ void writeStorePaths(const Store & store, Sink & out, const StorePathSet & paths
 
 void writeOutputPathMap(const Store & store, Sink & out, const OutputPathMap & paths);
 
+/* Read or write a ValidPathInfo, including its path, in the format
+   used by wopQueryPathInfos and wopAddMultipleToStore. */
+ValidPathInfo readValidPathInfo(const Store & store, Source & from);
+
+void writeValidPathInfo(const Store & store, Sink & out, const ValidPathInfo & info);
+
 }
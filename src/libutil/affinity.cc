@@ -4,6 +4,8 @@
 
 #if __linux__
 #include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #endif
 
 namespace nix {
@@ -67,4 +69,81 @@ void restoreAffinity()
 }
 
 
+
+#if __linux__
+/* Parse a sysfs CPU list such as "0-31,64-95". */
+static std::vector<int> parseCPUList(const std::string & s)
+{
+    std::vector<int> res;
+    for (auto & range : tokenizeString<Strings>(s, ",\n")) {
+        auto dash = range.find('-');
+        int from, to;
+        if (!string2Int(range.substr(0, dash), from)) continue;
+        if (dash == std::string::npos) to = from;
+        else if (!string2Int(range.substr(dash + 1), to)) continue;
+        for (int cpu = from; cpu <= to; cpu++) res.push_back(cpu);
+    }
+    return res;
+}
+#endif
+
+
+std::vector<NumaNode> getNumaNodes()
+{
+    std::vector<NumaNode> nodes;
+
+#if __linux__
+    /* Only CPUs in the original affinity mask are usable, not just
+       the one we might have locked ourselves to. */
+    cpu_set_t allowed;
+    if (didSaveAffinity)
+        allowed = savedAffinity;
+    else if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == -1)
+        return {};
+
+    Path nodeDir = "/sys/devices/system/node";
+
+    try {
+        for (auto & ent : readDirectory(nodeDir)) {
+            unsigned int id;
+            if (!hasPrefix(ent.name, "node") || !string2Int(ent.name.substr(4), id)) continue;
+            NumaNode node{id, {}};
+            for (auto cpu : parseCPUList(readFile(nodeDir + "/" + ent.name + "/cpulist")))
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                    node.cpus.push_back(cpu);
+            if (!node.cpus.empty())
+                nodes.push_back(std::move(node));
+        }
+    } catch (SysError &) {
+        return {};
+    }
+
+    std::sort(nodes.begin(), nodes.end(),
+        [](const NumaNode & a, const NumaNode & b) { return a.id < b.id; });
+#endif
+
+    if (nodes.size() < 2) return {};
+
+    return nodes;
+}
+
+
+void bindToNumaNode(const NumaNode & node)
+{
+#if __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (auto cpu : node.cpus) CPU_SET(cpu, &cpus);
+    sched_setaffinity(0, sizeof(cpu_set_t), &cpus);
+
+    /* Prefer rather than bind, so that a build that needs more memory
+       than its node has spills over instead of failing. */
+    const size_t bits = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(node.id / bits + 1, 0);
+    mask[node.id / bits] |= 1UL << (node.id % bits);
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.data(), mask.size() * bits + 1);
+#endif
+}
+
+
 }
@@ -1,9 +1,28 @@
 #pragma once
 
+#include <vector>
+
 namespace nix {
 
 void setAffinityTo(int cpu);
 int lockToCurrentCPU();
 void restoreAffinity();
 
+struct NumaNode
+{
+    unsigned int id;
+    std::vector<int> cpus;
+};
+
+/* Return the NUMA nodes of this machine, each with the CPUs that this
+   process is allowed to run on (e.g. by its cgroup's cpuset). Nodes
+   without such CPUs are omitted. Returns an empty list if there is
+   only one usable node or the topology is unknown. */
+std::vector<NumaNode> getNumaNodes();
+
+/* Restrict the calling process to the CPUs of the given node, and
+   make it allocate memory from that node by preference. Errors are
+   ignored: this is only an optimisation. */
+void bindToNumaNode(const NumaNode & node);
+
 }
@@ -14,6 +14,8 @@
 #include "archive.hh"
 #include "util.hh"
 #include "config.hh"
+#include "thread-pool.hh"
+#include "finally.hh"
 
 namespace nix {
 
@@ -40,20 +42,42 @@ static string caseHackSuffix = "~nix~case~hack~";
 PathFilter defaultPathFilter = [](const Path &) { return true; };
 
 
-static void dumpContents(const Path & path, size_t size,
+/* Number of upcoming regular files in a directory for which we ask
+   the kernel to start reading ahead while dumping the current one. */
+static const size_t prefetchWindow = 16;
+
+
+static void prefetch(int dirfd, const DirEntry & entry)
+{
+#if defined(POSIX_FADV_WILLNEED)
+    if (entry.type != DT_REG) return;
+    AutoCloseFD fd = openat(dirfd, entry.name.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    /* This is only a hint, so ignore any errors; they'll be reported
+       when we get to the file. */
+    if (fd) posix_fadvise(fd.get(), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+}
+
+
+static void dumpContents(int fd, const Path & path, size_t size,
     Sink & sink)
 {
     sink << "contents" << size;
 
-    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
-    if (!fd) throw SysError("opening file '%1%'", path);
+    /* When writing to a file descriptor (such as the daemon socket),
+       let the kernel copy the contents. */
+    if (auto fdSink = dynamic_cast<FdSink *>(&sink)) {
+        fdSink->writeFromFd(fd, size);
+        writePadding(size, sink);
+        return;
+    }
 
     std::vector<unsigned char> buf(65536);
     size_t left = size;
 
     while (left > 0) {
         auto n = std::min(left, buf.size());
-        readFull(fd.get(), buf.data(), n);
+        readFull(fd, buf.data(), n);
         left -= n;
         sink(buf.data(), n);
     }
@@ -62,12 +86,28 @@ static void dumpContents(const Path & path, size_t size,
 }
 
 
-static void dump(const Path & path, Sink & sink, PathFilter & filter)
+static Path readLinkAt(int dirfd, const string & name, const Path & path)
+{
+    std::vector<char> buf;
+    for (ssize_t bufSize = PATH_MAX/4; true; bufSize += bufSize/2) {
+        buf.resize(bufSize);
+        ssize_t rlSize = readlinkat(dirfd, name.c_str(), buf.data(), bufSize);
+        if (rlSize == -1)
+            throw SysError("reading symbolic link '%1%'", path);
+        else if (rlSize < bufSize)
+            return string(buf.data(), rlSize);
+    }
+}
+
+
+/* Dump the file `name' relative to the directory `dirfd'. `path' is
+   its full path, used for filtering and error messages. */
+static void dump(int dirfd, const string & name, const Path & path, Sink & sink, PathFilter & filter)
 {
     checkInterrupt();
 
     struct stat st;
-    if (lstat(path.c_str(), &st))
+    if (fstatat(dirfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW))
         throw SysError("getting attributes of path '%1%'", path);
 
     sink << "(";
@@ -76,16 +116,33 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
         sink << "type" << "regular";
         if (st.st_mode & S_IXUSR)
             sink << "executable" << "";
-        dumpContents(path, (size_t) st.st_size, sink);
+        AutoCloseFD fd = openat(dirfd, name.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (!fd) throw SysError("opening file '%1%'", path);
+        dumpContents(fd.get(), path, (size_t) st.st_size, sink);
     }
 
     else if (S_ISDIR(st.st_mode)) {
         sink << "type" << "directory";
 
+        AutoCloseFD fd = openat(dirfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        if (!fd) throw SysError("opening directory '%1%'", path);
+
+        DirEntries entries;
+        {
+            /* fdopendir() takes ownership of its argument, so give it
+               a copy. */
+            AutoCloseFD fd2 = dup(fd.get());
+            if (!fd2) throw SysError("duplicating file descriptor");
+            AutoCloseDir dir(fdopendir(fd2.get()));
+            if (!dir) throw SysError("opening directory '%1%'", path);
+            fd2.release();
+            entries = readDirectory(dir.get(), path);
+        }
+
         /* If we're on a case-insensitive system like macOS, undo
            the case hack applied by restorePath(). */
-        std::map<string, string> unhacked;
-        for (auto & i : readDirectory(path))
+        std::map<string, const DirEntry *> unhacked;
+        for (auto & i : entries)
             if (archiveSettings.useCaseHack) {
                 string name(i.name);
                 size_t pos = i.name.find(caseHackSuffix);
@@ -95,22 +152,33 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
                 }
                 if (unhacked.find(name) != unhacked.end())
                     throw Error("file name collision in between '%1%' and '%2%'",
-                       (path + "/" + unhacked[name]),
+                       (path + "/" + unhacked[name]->name),
                        (path + "/" + i.name));
-                unhacked[name] = i.name;
+                unhacked[name] = &i;
             } else
-                unhacked[i.name] = i.name;
+                unhacked[i.name] = &i;
 
+        /* Select the entries to dump in NAR order, then dump them
+           while keeping the kernel busy reading the next few files
+           ahead of us. */
+        std::vector<std::pair<const string *, const DirEntry *>> todo;
+        todo.reserve(unhacked.size());
         for (auto & i : unhacked)
-            if (filter(path + "/" + i.first)) {
-                sink << "entry" << "(" << "name" << i.first << "node";
-                dump(path + "/" + i.second, sink, filter);
-                sink << ")";
-            }
+            if (filter(path + "/" + i.first))
+                todo.emplace_back(&i.first, i.second);
+
+        size_t prefetched = 0;
+        for (size_t n = 0; n < todo.size(); ++n) {
+            for (; prefetched < todo.size() && prefetched < n + prefetchWindow; ++prefetched)
+                prefetch(fd.get(), *todo[prefetched].second);
+            sink << "entry" << "(" << "name" << *todo[n].first << "node";
+            dump(fd.get(), todo[n].second->name, path + "/" + todo[n].second->name, sink, filter);
+            sink << ")";
+        }
     }
 
     else if (S_ISLNK(st.st_mode))
-        sink << "type" << "symlink" << "target" << readLink(path);
+        sink << "type" << "symlink" << "target" << readLinkAt(dirfd, name, path);
 
     else throw Error("file '%1%' has an unsupported type", path);
 
@@ -121,7 +189,7 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
 void dumpPath(const Path & path, Sink & sink, PathFilter & filter)
 {
     sink << narVersionMagic1;
-    dump(path, sink, filter);
+    dump(AT_FDCWD, path, path, sink, filter);
 }
 
 
@@ -295,13 +363,123 @@ void parseDump(ParseSink & sink, Source & source)
 }
 
 
+/* Files up to this size are buffered in memory and written by a
+   pool of worker threads, so that unpacking trees with many small
+   files isn't bound by the latency of creating them one at a time.
+   Larger files are written directly. */
+static const size_t maxBufferedFile = 128 * 1024;
+
+/* Upper bound on the amount of buffered file contents waiting to be
+   written. */
+static const size_t maxBufferedBytes = 64 * 1024 * 1024;
+
+
 struct RestoreSink : ParseSink
 {
     Path dstPath;
+
+    /* The regular file currently being parsed. */
+    Path curPath;
+    bool executable = false;
+    bool direct = false;
     AutoCloseFD fd;
+    std::string contents;
+
+    struct State
+    {
+        size_t bytesQueued = 0;
+        std::exception_ptr exception;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+
+    /* Must come last so that the workers are stopped before the
+       members they refer to are destroyed. */
+    std::unique_ptr<ThreadPool> pool;
+
+    static void setExecutable(int fd)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+            throw SysError("fstat");
+        if (fchmod(fd, st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
+            throw SysError("fchmod");
+    }
+
+    void openFile()
+    {
+        Path p = dstPath + curPath;
+        fd = open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+        if (!fd) throw SysError("creating file '%1%'", p);
+        if (executable) setExecutable(fd.get());
+    }
+
+    /* Rethrow the first error encountered by a worker. */
+    void checkWorkers()
+    {
+        auto state(state_.lock());
+        if (state->exception)
+            std::rethrow_exception(state->exception);
+    }
+
+    /* Finish the regular file currently being parsed, if any. */
+    void finishFile()
+    {
+        if (curPath.empty()) return;
+
+        if (direct)
+            fd = -1;
+
+        else {
+            checkWorkers();
+
+            size_t size = contents.size();
+            {
+                auto state(state_.lock());
+                while (state->bytesQueued && state->bytesQueued + size > maxBufferedBytes)
+                    state.wait(wakeup);
+                state->bytesQueued += size;
+            }
+
+            /* Make sure there is at least one worker besides the
+               parsing thread, since we may have to wait for it. */
+            if (!pool) pool = std::make_unique<ThreadPool>(
+                std::max(2U, std::thread::hardware_concurrency()));
+
+            pool->enqueue([this, p(dstPath + curPath), contents(std::move(contents)), executable(executable)]() {
+                Finally release([&]() {
+                    state_.lock()->bytesQueued -= contents.size();
+                    wakeup.notify_one();
+                });
+                try {
+                    AutoCloseFD fd = open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+                    if (!fd) throw SysError("creating file '%1%'", p);
+                    if (executable) setExecutable(fd.get());
+                    writeFull(fd.get(), contents);
+                } catch (...) {
+                    auto state(state_.lock());
+                    if (!state->exception)
+                        state->exception = std::current_exception();
+                }
+            });
+        }
+
+        curPath.clear();
+        contents.clear();
+    }
+
+    /* Wait for all queued files to be written. */
+    void finish()
+    {
+        finishFile();
+        if (pool) pool->process();
+        checkWorkers();
+    }
 
     void createDirectory(const Path & path)
     {
+        finishFile();
         Path p = dstPath + path;
         if (mkdir(p.c_str(), 0777) == -1)
             throw SysError("creating directory '%1%'", p);
@@ -309,42 +487,50 @@ struct RestoreSink : ParseSink
 
     void createRegularFile(const Path & path)
     {
-        Path p = dstPath + path;
-        fd = open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
-        if (!fd) throw SysError("creating file '%1%'", p);
+        finishFile();
+        curPath = path;
+        executable = false;
+        direct = false;
     }
 
     void isExecutable()
     {
-        struct stat st;
-        if (fstat(fd.get(), &st) == -1)
-            throw SysError("fstat");
-        if (fchmod(fd.get(), st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
-            throw SysError("fchmod");
+        executable = true;
+        if (direct) setExecutable(fd.get());
     }
 
     void preallocateContents(unsigned long long len)
     {
-#if HAVE_POSIX_FALLOCATE
-        if (len) {
-            errno = posix_fallocate(fd.get(), 0, len);
-            /* Note that EINVAL may indicate that the underlying
-               filesystem doesn't support preallocation (e.g. on
-               OpenSolaris).  Since preallocation is just an
-               optimisation, ignore it. */
-            if (errno && errno != EINVAL && errno != EOPNOTSUPP && errno != ENOSYS)
-                throw SysError("preallocating file of %1% bytes", len);
+        if (len <= maxBufferedFile) {
+            contents.reserve(len);
+            return;
         }
+
+        direct = true;
+        openFile();
+
+#if HAVE_POSIX_FALLOCATE
+        errno = posix_fallocate(fd.get(), 0, len);
+        /* Note that EINVAL may indicate that the underlying
+           filesystem doesn't support preallocation (e.g. on
+           OpenSolaris).  Since preallocation is just an
+           optimisation, ignore it. */
+        if (errno && errno != EINVAL && errno != EOPNOTSUPP && errno != ENOSYS)
+            throw SysError("preallocating file of %1% bytes", len);
 #endif
     }
 
     void receiveContents(unsigned char * data, unsigned int len)
     {
-        writeFull(fd.get(), data, len);
+        if (direct)
+            writeFull(fd.get(), data, len);
+        else
+            contents.append((const char *) data, len);
     }
 
     void createSymlink(const Path & path, const string & target)
     {
+        finishFile();
         Path p = dstPath + path;
         nix::createSymlink(target, p);
     }
@@ -356,6 +542,7 @@ void restorePath(const Path & path, Source & source)
     RestoreSink sink;
     sink.dstPath = path;
     parseDump(sink, source);
+    sink.finish();
 }
 
 
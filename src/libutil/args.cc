@@ -158,7 +158,7 @@ Args::Flag Args::Flag::mkHashTypeFlag(std::string && longName, HashType * ht)
 {
     return Flag {
         .longName = std::move(longName),
-        .description = "hash algorithm ('md5', 'sha1', 'sha256', or 'sha512')",
+        .description = "hash algorithm ('md5', 'sha1', 'sha256', 'sha512', or, if supported, 'blake3')",
         .labels = {"hash-algo"},
         .handler = {[ht](std::string s) {
             *ht = parseHashType(s);
@@ -170,7 +170,7 @@ Args::Flag Args::Flag::mkHashTypeOptFlag(std::string && longName, std::optional<
 {
     return Flag {
         .longName = std::move(longName),
-        .description = "hash algorithm ('md5', 'sha1', 'sha256', or 'sha512'). Optional as can also be gotten from SRI hash itself.",
+        .description = "hash algorithm ('md5', 'sha1', 'sha256', 'sha512', or, if supported, 'blake3'). Optional as can also be gotten from SRI hash itself.",
         .labels = {"hash-algo"},
         .handler = {[oht](std::string s) {
             *oht = std::optional<HashType> { parseHashType(s) };
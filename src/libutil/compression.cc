@@ -13,7 +13,15 @@
 
 #include <zlib.h>
 
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #include <iostream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 namespace nix {
 
@@ -111,10 +119,34 @@ struct XzDecompressionSink : CompressionSink
     lzma_stream strm = LZMA_STREAM_INIT;
     bool finished = false;
 
-    XzDecompressionSink(Sink & nextSink) : nextSink(nextSink)
+    XzDecompressionSink(Sink & nextSink, bool parallel) : nextSink(nextSink)
     {
-        lzma_ret ret = lzma_stream_decoder(
-            &strm, UINT64_MAX, LZMA_CONCATENATED);
+        lzma_ret ret;
+        bool done = false;
+
+        if (parallel) {
+#ifdef HAVE_LZMA_MT_DECODER
+            /* This only decodes in parallel if the file consists of
+               multiple blocks with known sizes, as produced by
+               lzma_stream_encoder_mt(); otherwise it behaves like the
+               single-threaded decoder. */
+            lzma_mt mt_options = {};
+            mt_options.flags = LZMA_CONCATENATED;
+            mt_options.threads = lzma_cputhreads();
+            if (mt_options.threads == 0)
+                mt_options.threads = 1;
+            /* Fall back to fewer threads rather than using more than
+               a quarter of the RAM for buffers. */
+            mt_options.memlimit_threading = lzma_physmem() / 4;
+            mt_options.memlimit_stop = UINT64_MAX;
+            ret = lzma_stream_decoder_mt(&strm, &mt_options);
+            done = true;
+#endif
+        }
+
+        if (!done)
+            ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+
         if (ret != LZMA_OK)
             throw CompressionError("unable to initialise lzma decoder");
 
@@ -260,6 +292,68 @@ struct BrotliDecompressionSink : ChunkedCompressionSink
     }
 };
 
+#if HAVE_ZSTD
+static size_t checkZstd(size_t ret, const char * what)
+{
+    if (ZSTD_isError(ret))
+        throw CompressionError("error while %s zstd file: %s", what, ZSTD_getErrorName(ret));
+    return ret;
+}
+
+struct ZstdDecompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    uint8_t outbuf[32 * 1024];
+    ZSTD_DCtx * ctx;
+    /* Whether we're in the middle of a frame. */
+    bool inFrame = false;
+
+    ZstdDecompressionSink(Sink & nextSink) : nextSink(nextSink)
+    {
+        ctx = ZSTD_createDCtx();
+        if (!ctx)
+            throw CompressionError("unable to initialise zstd decoder");
+
+        /* Accept files compressed with a large window (e.g. with
+           'zstd --long=31'). */
+        checkZstd(ZSTD_DCtx_setParameter(ctx, ZSTD_d_windowLogMax,
+                ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound),
+            "decompressing");
+    }
+
+    ~ZstdDecompressionSink()
+    {
+        ZSTD_freeDCtx(ctx);
+    }
+
+    void finish() override
+    {
+        flush();
+        write(nullptr, 0);
+        if (inFrame)
+            throw CompressionError("zstd file is truncated");
+    }
+
+    void write(const unsigned char * data, size_t len) override
+    {
+        ZSTD_inBuffer in = {data, len, 0};
+
+        while (true) {
+            checkInterrupt();
+
+            ZSTD_outBuffer out = {outbuf, sizeof(outbuf), 0};
+            inFrame = checkZstd(ZSTD_decompressStream(ctx, &out, &in), "decompressing") != 0;
+
+            if (out.pos) nextSink(outbuf, out.pos);
+
+            /* If the output buffer was filled, the decoder may have
+               more data to flush. */
+            if (in.pos == in.size && out.pos < out.size) break;
+        }
+    }
+};
+#endif
+
 ref<std::string> decompress(const std::string & method, const std::string & in)
 {
     StringSink ssink;
@@ -269,18 +363,22 @@ ref<std::string> decompress(const std::string & method, const std::string & in)
     return ssink.s;
 }
 
-ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & nextSink)
+ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & nextSink, const bool parallel)
 {
     if (method == "none" || method == "")
         return make_ref<NoneSink>(nextSink);
     else if (method == "xz")
-        return make_ref<XzDecompressionSink>(nextSink);
+        return make_ref<XzDecompressionSink>(nextSink, parallel);
     else if (method == "bzip2")
         return make_ref<BzipDecompressionSink>(nextSink);
     else if (method == "gzip")
         return make_ref<GzipDecompressionSink>(nextSink);
     else if (method == "br")
         return make_ref<BrotliDecompressionSink>(nextSink);
+#if HAVE_ZSTD
+    else if (method == "zstd")
+        return make_ref<ZstdDecompressionSink>(nextSink);
+#endif
     else
         throw UnknownCompressionMethod("unknown compression method '%s'", method);
 }
@@ -292,8 +390,10 @@ struct XzCompressionSink : CompressionSink
     lzma_stream strm = LZMA_STREAM_INIT;
     bool finished = false;
 
-    XzCompressionSink(Sink & nextSink, bool parallel) : nextSink(nextSink)
+    XzCompressionSink(Sink & nextSink, bool parallel, int level) : nextSink(nextSink)
     {
+        uint32_t preset = level == -1 ? LZMA_PRESET_DEFAULT : level;
+
         lzma_ret ret;
         bool done = false;
 
@@ -302,7 +402,7 @@ struct XzCompressionSink : CompressionSink
             lzma_mt mt_options = {};
             mt_options.flags = 0;
             mt_options.timeout = 300; // Using the same setting as the xz cmd line
-            mt_options.preset = LZMA_PRESET_DEFAULT;
+            mt_options.preset = preset;
             mt_options.filters = NULL;
             mt_options.check = LZMA_CHECK_CRC64;
             mt_options.threads = lzma_cputhreads();
@@ -319,7 +419,7 @@ struct XzCompressionSink : CompressionSink
         }
 
         if (!done)
-            ret = lzma_easy_encoder(&strm, 6, LZMA_CHECK_CRC64);
+            ret = lzma_easy_encoder(&strm, preset, LZMA_CHECK_CRC64);
 
         if (ret != LZMA_OK)
             throw CompressionError("unable to initialise lzma encoder");
@@ -370,10 +470,10 @@ struct BzipCompressionSink : ChunkedCompressionSink
     bz_stream strm;
     bool finished = false;
 
-    BzipCompressionSink(Sink & nextSink) : nextSink(nextSink)
+    BzipCompressionSink(Sink & nextSink, int level) : nextSink(nextSink)
     {
         memset(&strm, 0, sizeof(strm));
-        int ret = BZ2_bzCompressInit(&strm, 9, 0, 30);
+        int ret = BZ2_bzCompressInit(&strm, level == -1 ? 9 : level, 0, 30);
         if (ret != BZ_OK)
             throw CompressionError("unable to initialise bzip2 encoder");
 
@@ -424,11 +524,13 @@ struct BrotliCompressionSink : ChunkedCompressionSink
     BrotliEncoderState *state;
     bool finished = false;
 
-    BrotliCompressionSink(Sink & nextSink) : nextSink(nextSink)
+    BrotliCompressionSink(Sink & nextSink, int level) : nextSink(nextSink)
     {
         state = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
         if (!state)
             throw CompressionError("unable to initialise brotli encoder");
+        if (level != -1)
+            BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, level);
     }
 
     ~BrotliCompressionSink()
@@ -470,27 +572,246 @@ struct BrotliCompressionSink : ChunkedCompressionSink
     }
 };
 
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel)
+#if HAVE_ZSTD
+struct ZstdCompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    uint8_t outbuf[32 * 1024];
+    ZSTD_CCtx * ctx;
+
+    ZstdCompressionSink(Sink & nextSink, bool parallel, int level, bool longWindow)
+        : nextSink(nextSink)
+    {
+        ctx = ZSTD_createCCtx();
+        if (!ctx)
+            throw CompressionError("unable to initialise zstd encoder");
+
+        checkZstd(ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel,
+                level == -1 ? ZSTD_CLEVEL_DEFAULT : level),
+            "compressing");
+
+        if (longWindow)
+            checkZstd(ZSTD_CCtx_setParameter(ctx, ZSTD_c_enableLongDistanceMatching, 1),
+                "compressing");
+
+        if (parallel) {
+            auto threads = std::thread::hardware_concurrency();
+            if (ZSTD_isError(ZSTD_CCtx_setParameter(ctx, ZSTD_c_nbWorkers, threads ? threads : 1)))
+                printMsg(lvlError, "warning: parallel zstd compression requested but not supported, falling back to single-threaded compression");
+        }
+    }
+
+    ~ZstdCompressionSink()
+    {
+        ZSTD_freeCCtx(ctx);
+    }
+
+    void finish() override
+    {
+        flush();
+        write(nullptr, 0);
+    }
+
+    void write(const unsigned char * data, size_t len) override
+    {
+        ZSTD_inBuffer in = {data, len, 0};
+
+        while (true) {
+            checkInterrupt();
+
+            ZSTD_outBuffer out = {outbuf, sizeof(outbuf), 0};
+            auto left = checkZstd(ZSTD_compressStream2(ctx, &out, &in,
+                    data ? ZSTD_e_continue : ZSTD_e_end),
+                "compressing");
+
+            if (out.pos) nextSink(outbuf, out.pos);
+
+            if (data ? in.pos == in.size : left == 0) break;
+        }
+    }
+};
+#endif
+
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink,
+    const bool parallel, int level, bool longWindow)
 {
     if (method == "none")
         return make_ref<NoneSink>(nextSink);
     else if (method == "xz")
-        return make_ref<XzCompressionSink>(nextSink, parallel);
+        return make_ref<XzCompressionSink>(nextSink, parallel, level);
     else if (method == "bzip2")
-        return make_ref<BzipCompressionSink>(nextSink);
+        return make_ref<BzipCompressionSink>(nextSink, level);
     else if (method == "br")
-        return make_ref<BrotliCompressionSink>(nextSink);
+        return make_ref<BrotliCompressionSink>(nextSink, level);
+#if HAVE_ZSTD
+    else if (method == "zstd")
+        return make_ref<ZstdCompressionSink>(nextSink, parallel, level, longWindow);
+#endif
     else
         throw UnknownCompressionMethod("unknown compression method '%s'", method);
 }
 
-ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel)
+ref<std::string> compress(const std::string & method, const std::string & in,
+    const bool parallel, int level, bool longWindow)
 {
     StringSink ssink;
-    auto sink = makeCompressionSink(method, ssink, parallel);
+    auto sink = makeCompressionSink(method, ssink, parallel, level, longWindow);
     (*sink)(in);
     sink->finish();
     return ssink.s;
 }
 
+std::string compressionExtension(const std::string & method)
+{
+    return
+        method == "xz" ? ".xz" :
+        method == "bzip2" ? ".bz2" :
+        method == "br" ? ".br" :
+        method == "zstd" ? ".zst" :
+        "";
+}
+
+#if HAVE_ZSTD
+struct ZstdContexts
+{
+    ZSTD_CCtx * cctx = nullptr;
+    ZSTD_DCtx * dctx = nullptr;
+    ~ZstdContexts()
+    {
+        if (cctx) ZSTD_freeCCtx(cctx);
+        if (dctx) ZSTD_freeDCtx(dctx);
+    }
+};
+#endif
+
+ref<std::string> makeDelta(const std::string & base, const std::string & target, int level)
+{
+#if HAVE_ZSTD
+    ZstdContexts ctxs;
+    ctxs.cctx = ZSTD_createCCtx();
+    if (!ctxs.cctx) throw CompressionError("unable to initialise zstd encoder");
+
+    /* The window must cover the base so that matches against it can
+       be found. */
+    int windowLog = 10;
+    while (windowLog < ZSTD_cParam_getBounds(ZSTD_c_windowLog).upperBound
+        && ((size_t) 1 << windowLog) < base.size() + target.size())
+        windowLog++;
+
+    checkZstd(ZSTD_CCtx_setParameter(ctxs.cctx, ZSTD_c_compressionLevel,
+            level == -1 ? 19 : level), "creating delta");
+    checkZstd(ZSTD_CCtx_setParameter(ctxs.cctx, ZSTD_c_windowLog, windowLog), "creating delta");
+    checkZstd(ZSTD_CCtx_setParameter(ctxs.cctx, ZSTD_c_enableLongDistanceMatching, 1), "creating delta");
+    checkZstd(ZSTD_CCtx_refPrefix(ctxs.cctx, base.data(), base.size()), "creating delta");
+
+    auto res = make_ref<std::string>();
+    res->resize(ZSTD_compressBound(target.size()));
+    res->resize(checkZstd(ZSTD_compress2(ctxs.cctx, res->data(), res->size(),
+                target.data(), target.size()), "creating delta"));
+    return res;
+#else
+    throw UnknownCompressionMethod("creating deltas requires zstd support");
+#endif
+}
+
+ref<std::string> applyDelta(const std::string & base, const std::string & delta)
+{
+#if HAVE_ZSTD
+    auto size = ZSTD_getFrameContentSize(delta.data(), delta.size());
+    if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+        throw CompressionError("delta is not a zstd frame of known size");
+
+    ZstdContexts ctxs;
+    ctxs.dctx = ZSTD_createDCtx();
+    if (!ctxs.dctx) throw CompressionError("unable to initialise zstd decoder");
+
+    checkZstd(ZSTD_DCtx_setParameter(ctxs.dctx, ZSTD_d_windowLogMax,
+            ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound), "applying delta");
+    checkZstd(ZSTD_DCtx_refPrefix(ctxs.dctx, base.data(), base.size()), "applying delta");
+
+    auto res = make_ref<std::string>();
+    res->resize(size);
+    if (checkZstd(ZSTD_decompressDCtx(ctxs.dctx, res->data(), res->size(),
+                delta.data(), delta.size()), "applying delta") != size)
+        throw CompressionError("delta has the wrong size");
+    return res;
+#else
+    throw UnknownCompressionMethod("applying deltas requires zstd support");
+#endif
+}
+
+AutoCloseFD makeCompressedChannel(const std::string & method, int in, int out,
+    const std::string & initialInput)
+{
+#if HAVE_ZSTD
+    if (method != "zstd")
+        throw UnknownCompressionMethod("compression method '%s' is not supported for channels", method);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+        throw SysError("creating socket pair");
+    AutoCloseFD ours(fds[0]);
+
+    /* The threads own their file descriptors, so they don't depend on
+       the lifetime of the caller's. */
+    auto plain = std::make_shared<AutoCloseFD>(fds[1]);
+    auto in2 = std::make_shared<AutoCloseFD>(fcntl(in, F_DUPFD_CLOEXEC, 0));
+    auto out2 = std::make_shared<AutoCloseFD>(fcntl(out, F_DUPFD_CLOEXEC, 0));
+    if (!*in2 || !*out2) throw SysError("duplicating file descriptor");
+
+    std::thread([plain, out2]() {
+        auto ctx = ZSTD_createCCtx();
+        Finally freeCtx([&]() { ZSTD_freeCCtx(ctx); });
+        std::vector<char> inBuf(64 * 1024), outBuf(ZSTD_CStreamOutSize());
+        try {
+            while (true) {
+                auto n = read(plain->get(), inBuf.data(), inBuf.size());
+                if (n == -1 && errno == EINTR) continue;
+                if (n <= 0) break;
+                ZSTD_inBuffer input{inBuf.data(), (size_t) n, 0};
+                size_t remaining;
+                do {
+                    ZSTD_outBuffer output{outBuf.data(), outBuf.size(), 0};
+                    remaining = checkZstd(ZSTD_compressStream2(ctx, &output, &input, ZSTD_e_flush), "compressing");
+                    writeFull(out2->get(), (unsigned char *) outBuf.data(), output.pos, false);
+                } while (remaining || input.pos < input.size);
+            }
+        } catch (...) {
+        }
+        /* Let the other side see EOF. */
+        *out2 = -1;
+        shutdown(plain->get(), SHUT_RD);
+    }).detach();
+
+    std::thread([plain, in2, initialInput]() {
+        auto ctx = ZSTD_createDCtx();
+        Finally freeCtx([&]() { ZSTD_freeDCtx(ctx); });
+        std::vector<char> inBuf(ZSTD_DStreamInSize()), outBuf(ZSTD_DStreamOutSize());
+        auto decompress = [&](const char * data, size_t len) {
+            ZSTD_inBuffer input{data, len, 0};
+            while (input.pos < input.size) {
+                ZSTD_outBuffer output{outBuf.data(), outBuf.size(), 0};
+                checkZstd(ZSTD_decompressStream(ctx, &output, &input), "decompressing");
+                writeFull(plain->get(), (unsigned char *) outBuf.data(), output.pos, false);
+            }
+        };
+        try {
+            decompress(initialInput.data(), initialInput.size());
+            while (true) {
+                auto n = read(in2->get(), inBuf.data(), inBuf.size());
+                if (n == -1 && errno == EINTR) continue;
+                if (n <= 0) break;
+                decompress(inBuf.data(), n);
+            }
+        } catch (...) {
+        }
+        shutdown(plain->get(), SHUT_WR);
+    }).detach();
+
+    return ours;
+#else
+    throw UnknownCompressionMethod("compression method '%s' is not supported for channels", method);
+#endif
+}
+
 }
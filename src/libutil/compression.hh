@@ -15,11 +15,41 @@ struct CompressionSink : BufferedSink
 
 ref<std::string> decompress(const std::string & method, const std::string & in);
 
-ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & nextSink);
-
-ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel = false);
-
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false);
+/* Return a sink that decompresses using the specified method. If
+   `parallel' is set, use multiple threads where the method and the
+   file's framing permit it (currently multi-block xz files). */
+ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false);
+
+/* Compress using the specified method. `level' is the compression
+   level, or -1 for the method's default. `longWindow' enables
+   long-distance matching (zstd only). */
+ref<std::string> compress(const std::string & method, const std::string & in,
+    const bool parallel = false, int level = -1, bool longWindow = false);
+
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink,
+    const bool parallel = false, int level = -1, bool longWindow = false);
+
+/* Return the conventional file name extension for files compressed
+   with the specified method (e.g. ".xz"), or "" if there is none. */
+std::string compressionExtension(const std::string & method);
+
+/* Return a zstd-compressed binary delta that turns `base' into
+   `target', and apply such a delta to `base'. These throw
+   UnknownCompressionMethod if Nix was built without zstd. */
+ref<std::string> makeDelta(const std::string & base, const std::string & target, int level = -1);
+
+ref<std::string> applyDelta(const std::string & base, const std::string & delta);
+
+/* Return one end of a socket pair through which a request/response
+   protocol can run compressed. Data written to it is compressed and
+   written to `out', and data read from `in' is decompressed and can
+   be read from it. `initialInput' is compressed data that has already
+   been read from `in'. Every write is flushed, so that small messages
+   aren't held back. Background threads do the work on duplicates of
+   `in' and `out' until either side is closed. Only "zstd" is
+   supported. */
+AutoCloseFD makeCompressedChannel(const std::string & method, int in, int out,
+    const std::string & initialInput = "");
 
 MakeError(UnknownCompressionMethod, Error);
 
@@ -4,11 +4,16 @@
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 
+#if HAVE_BLAKE3
+#include <blake3.h>
+#endif
+
 #include "args.hh"
 #include "hash.hh"
 #include "archive.hh"
 #include "util.hh"
 #include "istringstream_nocopy.hh"
+#include "thread-pool.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -25,6 +30,7 @@ void Hash::init()
     case htSHA1: hashSize = sha1HashSize; break;
     case htSHA256: hashSize = sha256HashSize; break;
     case htSHA512: hashSize = sha512HashSize; break;
+    case htBLAKE3: hashSize = blake3HashSize; break;
     }
     assert(hashSize <= maxHashSize);
     memset(hash, 0, maxHashSize);
@@ -236,6 +242,9 @@ union Ctx
     SHA_CTX sha1;
     SHA256_CTX sha256;
     SHA512_CTX sha512;
+#if HAVE_BLAKE3
+    blake3_hasher blake3;
+#endif
 };
 
 
@@ -245,6 +254,13 @@ static void start(HashType ht, Ctx & ctx)
     else if (ht == htSHA1) SHA1_Init(&ctx.sha1);
     else if (ht == htSHA256) SHA256_Init(&ctx.sha256);
     else if (ht == htSHA512) SHA512_Init(&ctx.sha512);
+    else if (ht == htBLAKE3) {
+#if HAVE_BLAKE3
+        blake3_hasher_init(&ctx.blake3);
+#else
+        throw Error("this Nix was built without BLAKE3 support");
+#endif
+    }
 }
 
 
@@ -255,6 +271,9 @@ static void update(HashType ht, Ctx & ctx,
     else if (ht == htSHA1) SHA1_Update(&ctx.sha1, bytes, len);
     else if (ht == htSHA256) SHA256_Update(&ctx.sha256, bytes, len);
     else if (ht == htSHA512) SHA512_Update(&ctx.sha512, bytes, len);
+#if HAVE_BLAKE3
+    else if (ht == htBLAKE3) blake3_hasher_update(&ctx.blake3, bytes, len);
+#endif
 }
 
 
@@ -264,6 +283,9 @@ static void finish(HashType ht, Ctx & ctx, unsigned char * hash)
     else if (ht == htSHA1) SHA1_Final(hash, &ctx.sha1);
     else if (ht == htSHA256) SHA256_Final(hash, &ctx.sha256);
     else if (ht == htSHA512) SHA512_Final(hash, &ctx.sha512);
+#if HAVE_BLAKE3
+    else if (ht == htBLAKE3) blake3_hasher_finalize(&ctx.blake3, hash, blake3HashSize);
+#endif
 }
 
 
@@ -288,9 +310,10 @@ Hash hashFile(HashType ht, const Path & path)
 
 HashSink::HashSink(HashType ht) : ht(ht)
 {
-    ctx = new Ctx;
-    bytes = 0;
+    auto ctx = std::make_unique<Ctx>();
     start(ht, *ctx);
+    this->ctx = ctx.release();
+    bytes = 0;
 }
 
 HashSink::~HashSink()
@@ -332,6 +355,39 @@ HashResult hashPath(
 }
 
 
+std::vector<HashResult> hashPaths(HashType ht, const std::vector<Path> & paths,
+    unsigned int nrThreads)
+{
+    std::vector<HashResult> res(paths.size());
+
+    if (paths.size() <= 1) {
+        for (size_t n = 0; n < paths.size(); n++)
+            res[n] = hashPath(ht, paths[n]);
+        return res;
+    }
+
+    /* Hand out the paths in chunks, since the inputs are typically
+       small files for which queueing a work item per path costs
+       about as much as hashing it. */
+    static const size_t chunkSize = 64;
+
+    ThreadPool pool(nrThreads);
+
+    for (size_t start = 0; start < paths.size(); start += chunkSize)
+        pool.enqueue([&, start]() {
+            auto end = std::min(start + chunkSize, paths.size());
+            for (size_t n = start; n < end; n++) {
+                checkInterrupt();
+                res[n] = hashPath(ht, paths[n]);
+            }
+        });
+
+    pool.process();
+
+    return res;
+}
+
+
 Hash compressHash(const Hash & hash, unsigned int newSize)
 {
     Hash h;
@@ -348,6 +404,9 @@ std::optional<HashType> parseHashTypeOpt(const string & s)
     else if (s == "sha1") return htSHA1;
     else if (s == "sha256") return htSHA256;
     else if (s == "sha512") return htSHA512;
+#if HAVE_BLAKE3
+    else if (s == "blake3") return htBLAKE3;
+#endif
     else return std::optional<HashType> {};
 }
 
@@ -367,6 +426,7 @@ string printHashType(HashType ht)
     case htSHA1: return "sha1";
     case htSHA256: return "sha256";
     case htSHA512: return "sha512";
+    case htBLAKE3: return "blake3";
     default:
         // illegal hash type enum value internally, as opposed to external input
         // which should be validated with nice error message.
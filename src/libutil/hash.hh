@@ -10,13 +10,18 @@ namespace nix {
 MakeError(BadHash, Error);
 
 
-enum HashType : char { htMD5 = 42, htSHA1, htSHA256, htSHA512 };
+/* BLAKE3 is only available if Nix was built with libblake3. Since it
+   is much faster than SHA-256, it's meant for hashes that are only
+   used internally (e.g. as cache keys); it can't be used to compute
+   store paths. */
+enum HashType : char { htMD5 = 42, htSHA1, htSHA256, htSHA512, htBLAKE3 };
 
 
 const int md5HashSize = 16;
 const int sha1HashSize = 20;
 const int sha256HashSize = 32;
 const int sha512HashSize = 64;
+const int blake3HashSize = 32;
 
 extern const string base32Chars;
 
@@ -116,6 +121,11 @@ typedef std::pair<Hash, unsigned long long> HashResult;
 HashResult hashPath(HashType ht, const Path & path,
     PathFilter & filter = defaultPathFilter);
 
+/* Compute hashPath() for several independent paths at once, spread
+   over `nrThreads' threads (0 meaning the number of cores). */
+std::vector<HashResult> hashPaths(HashType ht, const std::vector<Path> & paths,
+    unsigned int nrThreads = 0);
+
 /* Compress a hash to the specified number of bytes by cyclically
    XORing bytes together. */
 Hash compressHash(const Hash & hash, unsigned int newSize);
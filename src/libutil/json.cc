@@ -1,22 +1,91 @@
 #include "json.hh"
 
-#include <iomanip>
 #include <cstring>
 
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace nix {
 
+static inline bool needsEscape(char c)
+{
+    return c == '\"' || c == '\\' || (c >= 0 && c < 32);
+}
+
+/* Return a pointer to the first character in [i, end) that needs
+   escaping, or `end'. */
+static const char * findEscape(const char * i, const char * end)
+{
+#if __SSE2__
+    auto quote = _mm_set1_epi8('"');
+    auto backslash = _mm_set1_epi8('\\');
+    auto space = _mm_set1_epi8(32);
+    auto minusOne = _mm_set1_epi8(-1);
+
+    for (; end - i >= 16; i += 16) {
+        auto v = _mm_loadu_si128((const __m128i *) i);
+        /* Bytes >= 128 are negative as signed chars, so the range
+           check for control characters needs both bounds. */
+        auto m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+            _mm_and_si128(_mm_cmplt_epi8(v, space), _mm_cmpgt_epi8(v, minusOne)));
+        if (auto mask = _mm_movemask_epi8(m))
+            return i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i != end; i++)
+        if (needsEscape(*i)) return i;
+    return end;
+}
+
 void toJSON(std::ostream & str, const char * start, const char * end)
 {
-    str << '"';
-    for (auto i = start; i != end; i++)
-        if (*i == '\"' || *i == '\\') str << '\\' << *i;
-        else if (*i == '\n') str << "\\n";
-        else if (*i == '\r') str << "\\r";
-        else if (*i == '\t') str << "\\t";
-        else if (*i >= 0 && *i < 32)
-            str << "\\u" << std::setfill('0') << std::setw(4) << std::hex << (uint16_t) *i << std::dec;
-        else str << *i;
-    str << '"';
+    auto i = findEscape(start, end);
+
+    /* Most strings (store paths, hashes, names) need no escaping at
+       all, so don't bother copying them. */
+    if (i == end) {
+        str << '"';
+        str.write(start, end - start);
+        str << '"';
+        return;
+    }
+
+    /* Otherwise build the escaped string in a buffer that is reused
+       across calls, appending unescaped runs in bulk, and write it
+       out in one go. */
+    static thread_local std::string buf;
+    buf.clear();
+    buf.reserve((end - start) + 16);
+
+    buf += '"';
+    buf.append(start, i);
+
+    while (i != end) {
+        auto c = *i++;
+        if (c == '\"' || c == '\\') { buf += '\\'; buf += c; }
+        else if (c == '\n') buf += "\\n";
+        else if (c == '\r') buf += "\\r";
+        else if (c == '\t') buf += "\\t";
+        else {
+            static const char hex[] = "0123456789abcdef";
+            buf += "\\u00";
+            buf += hex[(c >> 4) & 0xf];
+            buf += hex[c & 0xf];
+        }
+        auto next = findEscape(i, end);
+        buf.append(i, next);
+        i = next;
+    }
+
+    buf += '"';
+
+    str.write(buf.data(), buf.size());
+
+    /* Don't keep a huge buffer around after escaping a huge string. */
+    if (buf.capacity() > 1 << 20) std::string().swap(buf);
 }
 
 void toJSON(std::ostream & str, const char * s)
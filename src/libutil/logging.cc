@@ -1,6 +1,8 @@
 #include "logging.hh"
 #include "util.hh"
 #include "config.hh"
+#include "sync.hh"
+#include "serialise.hh"
 
 #include <atomic>
 #include <nlohmann/json.hpp>
@@ -227,6 +229,331 @@ Logger * makeJSONLogger(Logger & prevLogger)
     return new JSONLogger(prevLogger);
 }
 
+static std::string showActivityType(ActivityType type)
+{
+    switch (type) {
+    case actCopyPath: return "copy-path";
+    case actFileTransfer: return "file-transfer";
+    case actRealise: return "realise";
+    case actCopyPaths: return "copy-paths";
+    case actBuilds: return "builds";
+    case actBuild: return "build";
+    case actOptimiseStore: return "optimise-store";
+    case actVerifyPaths: return "verify-paths";
+    case actSubstitute: return "substitute";
+    case actQueryPathInfo: return "query-path-info";
+    case actPostBuildHook: return "post-build-hook";
+    case actBuildWaiting: return "build-waiting";
+    default: return "unknown";
+    }
+}
+
+struct TraceLogger : Logger {
+    Logger & prevLogger;
+    Path path;
+
+    typedef std::chrono::steady_clock Clock;
+
+    const Clock::time_point epoch = Clock::now();
+
+    struct Running
+    {
+        std::string name;
+        ActivityType type;
+        ActivityId parent;
+        uint64_t tid;
+        Clock::time_point start;
+    };
+
+    struct State
+    {
+        std::map<ActivityId, Running> running;
+        nlohmann::json events = nlohmann::json::array();
+    };
+
+    Sync<State> state_;
+
+    TraceLogger(Logger & prevLogger, const Path & path)
+        : prevLogger(prevLogger), path(path)
+    { }
+
+    /* Chrome wants small integer thread IDs. */
+    static uint64_t getTid()
+    {
+        static std::atomic<uint64_t> nextTid{1};
+        static thread_local uint64_t tid = nextTid++;
+        return tid;
+    }
+
+    uint64_t micros(Clock::time_point t)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(t - epoch).count();
+    }
+
+    nlohmann::json makeEvent(ActivityId act, const Running & r, Clock::time_point end)
+    {
+        nlohmann::json ev;
+        ev["name"] = r.name;
+        ev["cat"] = showActivityType(r.type);
+        ev["ph"] = "X";
+        ev["ts"] = micros(r.start);
+        ev["dur"] = micros(end) - micros(r.start);
+        ev["pid"] = getpid();
+        ev["tid"] = r.tid;
+        ev["args"]["id"] = act;
+        if (r.parent) ev["args"]["parent"] = r.parent;
+        return ev;
+    }
+
+    /* Write everything recorded so far. This may happen more than
+       once (e.g. stopProgressBar() followed by the final stop()), so
+       activities that are still running are written as ending now
+       but kept. */
+    void stop() override
+    {
+        {
+            auto state(state_.lock());
+            auto now = Clock::now();
+            auto events = state->events;
+            for (auto & [act, r] : state->running)
+                events.push_back(makeEvent(act, r, now));
+            try {
+                nlohmann::json json;
+                json["traceEvents"] = std::move(events);
+                json["displayTimeUnit"] = "ms";
+                writeFile(path, json.dump());
+            } catch (Error & e) {
+                prevLogger.warn(fmt("cannot write activity trace: %s", e.msg()));
+            }
+        }
+        prevLogger.stop();
+    }
+
+    bool isVerbose() override
+    {
+        return prevLogger.isVerbose();
+    }
+
+    void log(Verbosity lvl, const FormatOrString & fs) override
+    {
+        prevLogger.log(lvl, fs);
+    }
+
+    void logEI(const ErrorInfo & ei) override
+    {
+        prevLogger.logEI(ei);
+    }
+
+    void warn(const std::string & msg) override
+    {
+        prevLogger.warn(msg);
+    }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        {
+            auto state(state_.lock());
+            state->running.emplace(act, Running{
+                s.empty() ? showActivityType(type) : s, type, parent, getTid(), Clock::now()});
+        }
+        prevLogger.startActivity(act, lvl, type, s, fields, parent);
+    }
+
+    void stopActivity(ActivityId act) override
+    {
+        {
+            auto state(state_.lock());
+            auto i = state->running.find(act);
+            if (i != state->running.end()) {
+                state->events.push_back(makeEvent(act, i->second, Clock::now()));
+                state->running.erase(i);
+            }
+        }
+        prevLogger.stopActivity(act);
+    }
+
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        if (type == resSetPhase && fields.size() == 1 && fields[0].type == Field::tString) {
+            auto state(state_.lock());
+            auto i = state->running.find(act);
+            if (i != state->running.end()) {
+                nlohmann::json ev;
+                ev["name"] = fields[0].s;
+                ev["cat"] = "phase";
+                ev["ph"] = "i";
+                ev["s"] = "t";
+                ev["ts"] = micros(Clock::now());
+                ev["pid"] = getpid();
+                ev["tid"] = i->second.tid;
+                ev["args"]["id"] = act;
+                state->events.push_back(std::move(ev));
+            }
+        }
+        prevLogger.result(act, type, fields);
+    }
+
+    void writeToStdout(std::string_view s) override
+    {
+        prevLogger.writeToStdout(s);
+    }
+};
+
+Logger * makeTraceLogger(Logger & prevLogger, const Path & path)
+{
+    return new TraceLogger(prevLogger, path);
+}
+
+typedef enum {
+    blogMsg = 0,
+    blogStart = 1,
+    blogStop = 2,
+    blogResult = 3,
+} BinaryLogRecord;
+
+static void writeFields(Sink & sink, const Logger::Fields & fields)
+{
+    sink << fields.size();
+    for (auto & f : fields) {
+        sink << f.type;
+        if (f.type == Logger::Field::tInt)
+            sink << f.i;
+        else if (f.type == Logger::Field::tString)
+            sink << f.s;
+        else
+            abort();
+    }
+}
+
+static Logger::Fields readFields(Source & source)
+{
+    Logger::Fields fields;
+    auto n = readNum<size_t>(source);
+    for (size_t i = 0; i < n; i++) {
+        auto type = readInt(source);
+        if (type == Logger::Field::tInt)
+            fields.push_back(readNum<uint64_t>(source));
+        else if (type == Logger::Field::tString)
+            fields.push_back(readString(source));
+        else
+            throw Error("unsupported field type %d in binary log", type);
+    }
+    return fields;
+}
+
+struct BinaryLogger : Logger {
+    int fd;
+
+    /* Serialises records from different threads. */
+    std::mutex lock;
+
+    BinaryLogger(int fd) : fd(fd) { }
+
+    bool isVerbose() override {
+        return true;
+    }
+
+    void write(const StringSink & sink)
+    {
+        StringSink record;
+        record << *sink.s;
+        std::lock_guard<std::mutex> guard(lock);
+        writeFull(fd, *record.s);
+    }
+
+    void log(Verbosity lvl, const FormatOrString & fs) override
+    {
+        StringSink sink;
+        sink << blogMsg << lvl << fs.s;
+        write(sink);
+    }
+
+    void logEI(const ErrorInfo & ei) override
+    {
+        std::ostringstream oss;
+        showErrorInfo(oss, ei, loggerSettings.showTrace.get());
+        log(ei.level, oss.str());
+    }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        StringSink sink;
+        sink << blogStart << act << lvl << type << s << parent;
+        writeFields(sink, fields);
+        write(sink);
+    }
+
+    void stopActivity(ActivityId act) override
+    {
+        StringSink sink;
+        sink << blogStop << act;
+        write(sink);
+    }
+
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        StringSink sink;
+        sink << blogResult << act << type;
+        writeFields(sink, fields);
+        write(sink);
+    }
+};
+
+Logger * makeBinaryLogger(int fd)
+{
+    return new BinaryLogger(fd);
+}
+
+void decodeBinaryLog(Source & source, Logger & logger)
+{
+    while (true) {
+        std::string record;
+        try {
+            record = readString(source);
+        } catch (EndOfFile &) {
+            break;
+        }
+
+        StringSource in(record);
+
+        switch (readInt(in)) {
+
+        case blogMsg: {
+            auto lvl = (Verbosity) readInt(in);
+            logger.log(lvl, readString(in));
+            break;
+        }
+
+        case blogStart: {
+            auto act = readNum<ActivityId>(in);
+            auto lvl = (Verbosity) readInt(in);
+            auto type = (ActivityType) readInt(in);
+            auto s = readString(in);
+            auto parent = readNum<ActivityId>(in);
+            logger.startActivity(act, lvl, type, s, readFields(in), parent);
+            break;
+        }
+
+        case blogStop:
+            logger.stopActivity(readNum<ActivityId>(in));
+            break;
+
+        case blogResult: {
+            auto act = readNum<ActivityId>(in);
+            auto type = (ResultType) readInt(in);
+            logger.result(act, type, readFields(in));
+            break;
+        }
+
+        default:
+            /* Skip records from newer versions. */
+            break;
+        }
+    }
+}
+
 static Logger::Fields getFields(nlohmann::json & json)
 {
     Logger::Fields fields;
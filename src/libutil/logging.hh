@@ -6,6 +6,8 @@
 
 namespace nix {
 
+struct Source;
+
 typedef enum {
     actUnknown = 0,
     actCopyPath = 100,
@@ -41,6 +43,11 @@ struct LoggerSettings : Config
         false,
         "show-trace",
         "Whether to show a stack trace on evaluation errors."};
+
+    Setting<Path> activityTraceFile{this,
+        "",
+        "activity-trace-file",
+        "Write the start and stop times of all activities to this file, in Chrome trace event format."};
 };
 
 extern LoggerSettings loggerSettings;
@@ -161,6 +168,22 @@ Logger * makeSimpleLogger(bool printBuildLogs = true);
 
 Logger * makeJSONLogger(Logger & prevLogger);
 
+/* Return a logger that writes all messages and activity events to
+   `fd' in a compact binary format. Each record is a 64-bit length
+   followed by the record itself, encoded like the worker
+   protocol. */
+Logger * makeBinaryLogger(int fd = STDERR_FILENO);
+
+/* Read records written by the binary logger from `source' and replay
+   them on `logger', until end of file. */
+void decodeBinaryLog(Source & source, Logger & logger);
+
+/* Return a logger that forwards everything to `prevLogger', and in
+   addition records activities as Chrome trace events (viewable in
+   chrome://tracing or Perfetto). The trace is written to `path' when
+   the logger is stopped. */
+Logger * makeTraceLogger(Logger & prevLogger, const Path & path);
+
 bool handleJSONLogMessage(const std::string & msg,
     const Activity & act, std::map<ActivityId, Activity> & activities,
     bool trusted);
@@ -201,6 +224,7 @@ extern Verbosity verbosity; /* suppress msgs > this */
 template<typename... Args>
 inline void warn(const std::string & fs, const Args & ... args)
 {
+    if (lvlWarn > verbosity) return;
     boost::format f(fs);
     formatHelper(f, args...);
     logger->warn(f.str());
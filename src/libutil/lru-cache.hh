@@ -1,9 +1,13 @@
 #pragma once
 
+#include "sync.hh"
+
 #include <cassert>
 #include <map>
 #include <list>
+#include <memory>
 #include <optional>
+#include <unordered_map>
 
 namespace nix {
 
@@ -90,4 +94,102 @@ public:
     }
 };
 
+
+/* A thread-safe LRU cache for large numbers of entries under
+   concurrent access. It is split into shards by key hash, each with
+   its own lock, hash table and LRU list, so all operations are O(1)
+   and threads using different shards don't contend. Recency is
+   tracked per shard, so eviction is approximately LRU. */
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class ShardedLRUCache
+{
+private:
+
+    struct Shard
+    {
+        typedef std::list<std::pair<Key, Value>> LRU;
+        LRU lru;
+        std::unordered_map<Key, typename LRU::iterator, Hash> index;
+    };
+
+    size_t nrShards, shardCapacity;
+    std::unique_ptr<Sync<Shard>[]> shards;
+    Hash hash;
+
+    Sync<Shard> & shardFor(const Key & key)
+    {
+        return shards[hash(key) % nrShards];
+    }
+
+public:
+
+    ShardedLRUCache(size_t capacity, size_t maxShards = 16)
+        /* Don't make shards so small that eviction gets unfair. */
+        : nrShards(std::max((size_t) 1, std::min(maxShards, capacity / 64)))
+        , shardCapacity((capacity + nrShards - 1) / nrShards)
+        , shards(new Sync<Shard>[nrShards])
+    { }
+
+    /* Insert or upsert an item in the cache. */
+    void upsert(const Key & key, const Value & value)
+    {
+        if (shardCapacity == 0) return;
+
+        auto shard(shardFor(key).lock());
+
+        auto i = shard->index.find(key);
+        if (i != shard->index.end()) {
+            i->second->second = value;
+            shard->lru.splice(shard->lru.end(), shard->lru, i->second);
+            return;
+        }
+
+        if (shard->index.size() >= shardCapacity) {
+            /* Retire the oldest item. */
+            shard->index.erase(shard->lru.front().first);
+            shard->lru.pop_front();
+        }
+
+        shard->index.emplace(key, shard->lru.insert(shard->lru.end(), {key, value}));
+    }
+
+    bool erase(const Key & key)
+    {
+        auto shard(shardFor(key).lock());
+        auto i = shard->index.find(key);
+        if (i == shard->index.end()) return false;
+        shard->lru.erase(i->second);
+        shard->index.erase(i);
+        return true;
+    }
+
+    /* Look up an item in the cache. If it exists, it becomes the most
+       recently used item of its shard. */
+    std::optional<Value> get(const Key & key)
+    {
+        auto shard(shardFor(key).lock());
+        auto i = shard->index.find(key);
+        if (i == shard->index.end()) return {};
+        shard->lru.splice(shard->lru.end(), shard->lru, i->second);
+        return i->second->second;
+    }
+
+    size_t size()
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < nrShards; i++)
+            n += shards[i].lock()->index.size();
+        return n;
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < nrShards; i++) {
+            auto shard(shards[i].lock());
+            shard->index.clear();
+            shard->lru.clear();
+        }
+    }
+};
+
 }
@@ -7,6 +7,17 @@
 
 #include <boost/coroutine2/coroutine.hpp>
 
+#include <list>
+#include <thread>
+
+#include "sync.hh"
+
+#include <sys/uio.h>
+
+#if __linux__
+#include <sys/sendfile.h>
+#endif
+
 
 namespace nix {
 
@@ -19,8 +30,7 @@ void BufferedSink::operator () (const unsigned char * data, size_t len)
         /* Optimisation: bypass the buffer if the data exceeds the
            buffer size. */
         if (bufPos + len >= bufSize) {
-            flush();
-            write(data, len);
+            writeWithBuffer(data, len);
             break;
         }
         /* Otherwise, copy the bytes to the buffer.  Flush the buffer
@@ -42,6 +52,13 @@ void BufferedSink::flush()
 }
 
 
+void BufferedSink::writeWithBuffer(const unsigned char * data, size_t len)
+{
+    flush();
+    write(data, len);
+}
+
+
 FdSink::~FdSink()
 {
     try { flush(); } catch (...) { ignoreException(); }
@@ -59,7 +76,7 @@ static void warnLargeDump()
 }
 
 
-void FdSink::write(const unsigned char * data, size_t len)
+void FdSink::countWritten(size_t len)
 {
     written += len;
     static bool warned = false;
@@ -69,6 +86,12 @@ void FdSink::write(const unsigned char * data, size_t len)
             warned = true;
         }
     }
+}
+
+
+void FdSink::write(const unsigned char * data, size_t len)
+{
+    countWritten(len);
     try {
         writeFull(fd, data, len);
     } catch (SysError & e) {
@@ -78,6 +101,75 @@ void FdSink::write(const unsigned char * data, size_t len)
 }
 
 
+void FdSink::writeWithBuffer(const unsigned char * data, size_t len)
+{
+    struct iovec iov[2] = {
+        { buffer.get(), bufPos },
+        { (void *) data, len },
+    };
+    countWritten(bufPos + len);
+    bufPos = 0;
+
+    struct iovec * cur = iov;
+    int count = 2;
+
+    try {
+        while (count) {
+            checkInterrupt();
+            ssize_t res = ::writev(fd, cur, count);
+            if (res == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("writing to file");
+            }
+            while (count && (size_t) res >= cur->iov_len) {
+                res -= cur->iov_len;
+                cur++;
+                count--;
+            }
+            if (count) {
+                cur->iov_base = (char *) cur->iov_base + res;
+                cur->iov_len -= res;
+            }
+        }
+    } catch (SysError & e) {
+        _good = false;
+        throw;
+    }
+}
+
+
+void FdSink::writeFromFd(int fdIn, size_t len)
+{
+    flush();
+
+#if __linux__
+    while (len > 0) {
+        checkInterrupt();
+        auto res = sendfile(fd, fdIn, nullptr, std::min(len, (size_t) 1 << 22));
+        if (res == -1) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            /* Not supported for this pair of file descriptors; copy
+               the rest through user space. */
+            if (errno == EINVAL || errno == ENOSYS) break;
+            _good = false;
+            throw SysError("sending file contents");
+        }
+        if (res == 0) throw EndOfFile("unexpected end-of-file");
+        countWritten(res);
+        len -= res;
+    }
+#endif
+
+    std::vector<unsigned char> buf(65536);
+    while (len > 0) {
+        auto n = std::min(len, buf.size());
+        readFull(fdIn, buf.data(), n);
+        write(buf.data(), n);
+        len -= n;
+    }
+}
+
+
 bool FdSink::good()
 {
     return _good;
@@ -131,6 +223,15 @@ bool BufferedSource::hasData()
 }
 
 
+std::string BufferedSource::takeBuffered()
+{
+    if (!hasData()) return "";
+    std::string res((char *) buffer.get() + bufPosOut, bufPosIn - bufPosOut);
+    bufPosOut = bufPosIn = 0;
+    return res;
+}
+
+
 size_t FdSource::readUnbuffered(unsigned char * data, size_t len)
 {
     ssize_t n;
@@ -170,7 +271,9 @@ std::unique_ptr<Source> sinkToSource(
 {
     struct SinkToSource : Source
     {
-        typedef boost::coroutines2::coroutine<std::string> coro_t;
+        /* The producer is suspended while the consumer reads from the
+           chunk, so it can be passed without copying. */
+        typedef boost::coroutines2::coroutine<std::string_view> coro_t;
 
         std::function<void(Sink &)> fun;
         std::function<void()> eof;
@@ -182,7 +285,7 @@ std::unique_ptr<Source> sinkToSource(
         {
         }
 
-        std::string cur;
+        std::string_view cur;
         size_t pos = 0;
 
         size_t read(unsigned char * data, size_t len) override
@@ -190,7 +293,7 @@ std::unique_ptr<Source> sinkToSource(
             if (!coro)
                 coro = coro_t::pull_type([&](coro_t::push_type & yield) {
                     LambdaSink sink([&](const unsigned char * data, size_t len) {
-                            if (len) yield(std::string((const char *) data, len));
+                            if (len) yield(std::string_view((const char *) data, len));
                         });
                     fun(sink);
                 });
@@ -215,6 +318,128 @@ std::unique_ptr<Source> sinkToSource(
 }
 
 
+std::unique_ptr<Source> sinkToSourceThreaded(
+    std::function<void(Sink &)> fun,
+    std::function<void()> eof,
+    size_t chunkSize,
+    size_t maxChunks)
+{
+    struct Cancelled { };
+
+    struct SinkToSourceThreaded : Source
+    {
+        typedef std::vector<unsigned char> Chunk;
+
+        struct State
+        {
+            std::list<Chunk> full, free;
+            size_t allocated = 0;
+            bool done = false, cancelled = false;
+            std::exception_ptr exc;
+        };
+
+        Sync<State> state_;
+        std::condition_variable wakeup;
+
+        std::function<void()> eof;
+        size_t chunkSize, maxChunks;
+
+        Chunk cur;
+        size_t pos = 0;
+
+        std::thread thread;
+
+        SinkToSourceThreaded(std::function<void(Sink &)> fun,
+            std::function<void()> eof, size_t chunkSize, size_t maxChunks)
+            : eof(eof), chunkSize(chunkSize), maxChunks(std::max(maxChunks, (size_t) 2))
+        {
+            thread = std::thread([this, fun]() {
+                try {
+                    Chunk chunk;
+                    LambdaSink sink([&](const unsigned char * data, size_t len) {
+                        while (len) {
+                            if (chunk.capacity() < this->chunkSize) chunk.reserve(this->chunkSize);
+                            auto n = std::min(len, this->chunkSize - chunk.size());
+                            chunk.insert(chunk.end(), data, data + n);
+                            data += n;
+                            len -= n;
+                            if (chunk.size() == this->chunkSize) push(chunk);
+                        }
+                    });
+                    fun(sink);
+                    if (!chunk.empty()) push(chunk);
+                } catch (Cancelled &) {
+                } catch (...) {
+                    state_.lock()->exc = std::current_exception();
+                }
+                state_.lock()->done = true;
+                wakeup.notify_all();
+            });
+        }
+
+        ~SinkToSourceThreaded()
+        {
+            state_.lock()->cancelled = true;
+            wakeup.notify_all();
+            thread.join();
+        }
+
+        /* Hand a full chunk to the consumer and replace it with a
+           recycled one, waiting while the queue is full. */
+        void push(Chunk & chunk)
+        {
+            auto state(state_.lock());
+            while (true) {
+                if (state->cancelled) throw Cancelled();
+                if (!state->free.empty() || state->allocated < maxChunks) break;
+                state.wait(wakeup);
+            }
+            state->full.push_back(std::move(chunk));
+            if (!state->free.empty()) {
+                chunk = std::move(state->free.front());
+                state->free.pop_front();
+            } else {
+                chunk = Chunk();
+                state->allocated++;
+            }
+            chunk.clear();
+            wakeup.notify_all();
+        }
+
+        size_t read(unsigned char * data, size_t len) override
+        {
+            if (pos == cur.size()) {
+                auto state(state_.lock());
+                if (cur.capacity()) {
+                    state->free.push_back(std::move(cur));
+                    cur = Chunk();
+                    wakeup.notify_all();
+                }
+                while (state->full.empty()) {
+                    if (state->done) {
+                        if (state->exc) std::rethrow_exception(state->exc);
+                        eof();
+                        abort();
+                    }
+                    state.wait(wakeup);
+                }
+                cur = std::move(state->full.front());
+                state->full.pop_front();
+                pos = 0;
+            }
+
+            auto n = std::min(cur.size() - pos, len);
+            memcpy(data, cur.data() + pos, n);
+            pos += n;
+
+            return n;
+        }
+    };
+
+    return std::make_unique<SinkToSourceThreaded>(fun, eof, chunkSize, maxChunks);
+}
+
+
 void writePadding(size_t len, Sink & sink)
 {
     if (len % 8) {
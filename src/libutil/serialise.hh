@@ -42,6 +42,13 @@ struct BufferedSink : virtual Sink
     void flush();
 
     virtual void write(const unsigned char * data, size_t len) = 0;
+
+protected:
+
+    /* Write out the buffer followed by `data'. Used when `data' is
+       too large to be buffered, so it isn't copied. Sinks that can do
+       gather writes should override this. */
+    virtual void writeWithBuffer(const unsigned char * data, size_t len);
 };
 
 
@@ -79,6 +86,11 @@ struct BufferedSource : Source
 
     bool hasData();
 
+    /* Return and discard the data that has been read into the buffer
+       but not consumed yet. Unlike drain(), this doesn't read from
+       the underlying source. */
+    std::string takeBuffered();
+
 protected:
     /* Underlying read call, to be overridden. */
     virtual size_t readUnbuffered(unsigned char * data, size_t len) = 0;
@@ -110,10 +122,21 @@ struct FdSink : BufferedSink
 
     void write(const unsigned char * data, size_t len) override;
 
+    /* Write `len' bytes read from `fdIn'. On Linux this uses
+       sendfile(), so the data doesn't pass through user space. */
+    void writeFromFd(int fdIn, size_t len);
+
     bool good() override;
 
+protected:
+
+    /* Uses a single writev(). */
+    void writeWithBuffer(const unsigned char * data, size_t len) override;
+
 private:
     bool _good = true;
+
+    void countWritten(size_t len);
 };
 
 
@@ -252,6 +275,20 @@ std::unique_ptr<Source> sinkToSource(
         throw EndOfFile("coroutine has finished");
     });
 
+/* Like sinkToSource(), but run the function on its own thread, so
+   that producing and consuming the data overlap. The data is passed
+   through a bounded queue of at most `maxChunks' recycled buffers of
+   `chunkSize' bytes. Exceptions thrown by the function are rethrown
+   in the reader. Destroying the Source early makes the function's
+   next write to its sink unwind it. */
+std::unique_ptr<Source> sinkToSourceThreaded(
+    std::function<void(Sink &)> fun,
+    std::function<void()> eof = []() {
+        throw EndOfFile("producer thread has finished");
+    },
+    size_t chunkSize = 64 * 1024,
+    size_t maxChunks = 16);
+
 
 void writePadding(size_t len, Sink & sink);
 void writeString(const unsigned char * buf, size_t len, Sink & sink);
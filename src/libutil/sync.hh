@@ -2,6 +2,7 @@
 
 #include <cstdlib>
 #include <mutex>
+#include <shared_mutex>
 #include <condition_variable>
 #include <cassert>
 
@@ -85,4 +86,55 @@ public:
     Lock lock() { return Lock(this); }
 };
 
+
+/* Like Sync, but for read-mostly data: any number of threads can
+   hold a readLock() at the same time, which gives const access,
+   while lock() gives exclusive access. */
+
+template<class T>
+class SharedSync
+{
+private:
+    std::shared_mutex mutex;
+    T data;
+
+public:
+
+    SharedSync() { }
+    SharedSync(const T & data) : data(data) { }
+    SharedSync(T && data) noexcept : data(std::move(data)) { }
+
+    class Lock
+    {
+    private:
+        SharedSync * s;
+        std::unique_lock<std::shared_mutex> lk;
+        friend SharedSync;
+        Lock(SharedSync * s) : s(s), lk(s->mutex) { }
+    public:
+        Lock(Lock && l) : s(l.s) { abort(); }
+        Lock(const Lock & l) = delete;
+        T * operator -> () { return &s->data; }
+        T & operator * () { return s->data; }
+    };
+
+    class ReadLock
+    {
+    private:
+        const SharedSync * s;
+        std::shared_lock<std::shared_mutex> lk;
+        friend SharedSync;
+        ReadLock(SharedSync * s) : s(s), lk(s->mutex) { }
+    public:
+        ReadLock(ReadLock && l) : s(l.s) { abort(); }
+        ReadLock(const ReadLock & l) = delete;
+        const T * operator -> () const { return &s->data; }
+        const T & operator * () const { return s->data; }
+    };
+
+    Lock lock() { return Lock(this); }
+
+    ReadLock readLock() { return ReadLock(this); }
+};
+
 }
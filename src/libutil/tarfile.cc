@@ -2,6 +2,10 @@
 #include <archive_entry.h>
 
 #include "serialise.hh"
+#include "archive.hh"
+#include "tarfile.hh"
+
+#include <sys/stat.h>
 
 namespace nix {
 
@@ -122,4 +126,175 @@ void unpackTarfile(const Path & tarFile, const Path & destDir)
     extract_archive(archive, destDir);
 }
 
+/* A file tree held in memory, so that the members of an archive,
+   which can come in any order, can be serialised in NAR order. */
+struct MemoryFile
+{
+    enum { tRegular, tDirectory, tSymlink } type = tDirectory;
+    bool executable = false;
+    /* The contents of a regular file or the target of a symlink. */
+    std::string contents;
+    std::map<std::string, MemoryFile> entries;
+    std::optional<time_t> mtime;
+};
+
+/* Return the file at `path' in `root', creating it (and its parent
+   directories) if it doesn't exist. */
+static MemoryFile & lookupMemoryFile(MemoryFile & root, const std::string & path)
+{
+    auto file = &root;
+    for (auto & name : tokenizeString<std::vector<std::string>>(path, "/")) {
+        if (name == ".") continue;
+        if (name == "..")
+            throw Error("archive member '%s' has an unsafe path", path);
+        if (file->type != MemoryFile::tDirectory)
+            throw Error("archive member '%s' is inside a non-directory", path);
+        file = &file->entries[name];
+    }
+    return *file;
+}
+
+/* Write `file' to `sink', freeing memory as we go. */
+static void dumpMemoryFile(MemoryFile & file, Sink & sink)
+{
+    sink << "(";
+
+    switch (file.type) {
+
+    case MemoryFile::tRegular:
+        sink << "type" << "regular";
+        if (file.executable)
+            sink << "executable" << "";
+        sink << "contents" << file.contents;
+        break;
+
+    case MemoryFile::tDirectory:
+        sink << "type" << "directory";
+        for (auto i = file.entries.begin(); i != file.entries.end(); i = file.entries.erase(i)) {
+            sink << "entry" << "(" << "name" << i->first << "node";
+            dumpMemoryFile(i->second, sink);
+            sink << ")";
+        }
+        break;
+
+    case MemoryFile::tSymlink:
+        sink << "type" << "symlink" << "target" << file.contents;
+        break;
+    }
+
+    sink << ")";
+
+    file.contents = {};
+}
+
+/* Read all members of `archive' into memory. `newest' is set to the
+   newest mtime of any member. */
+static MemoryFile readArchive(TarArchive & archive, std::optional<time_t> & newest)
+{
+    MemoryFile root;
+    std::vector<unsigned char> buf(65536);
+
+    for (;;) {
+        checkInterrupt();
+
+        struct archive_entry * entry;
+        int r = archive_read_next_header(archive.archive, &entry);
+        if (r == ARCHIVE_EOF) break;
+        else if (r == ARCHIVE_WARN)
+            warn(archive_error_string(archive.archive));
+        else
+            archive.check(r);
+
+        std::string path = archive_entry_pathname(entry);
+        auto & file = lookupMemoryFile(root, path);
+
+        if (auto link = archive_entry_hardlink(entry)) {
+            auto & target = lookupMemoryFile(root, link);
+            if (target.type != MemoryFile::tRegular)
+                throw Error("archive member '%s' is a hard link to non-file '%s'", path, link);
+            file = MemoryFile(target);
+        }
+
+        else switch (archive_entry_filetype(entry)) {
+
+        case AE_IFREG: {
+            file = MemoryFile();
+            file.type = MemoryFile::tRegular;
+            file.executable = archive_entry_mode(entry) & S_IXUSR;
+            if (archive_entry_size_is_set(entry))
+                file.contents.reserve(archive_entry_size(entry));
+            for (;;) {
+                auto n = archive_read_data(archive.archive, buf.data(), buf.size());
+                if (n == 0) break;
+                if (n < 0) archive.check(n);
+                file.contents.append((const char *) buf.data(), n);
+            }
+            break;
+        }
+
+        case AE_IFDIR:
+            if (file.type != MemoryFile::tDirectory)
+                file = MemoryFile();
+            break;
+
+        case AE_IFLNK:
+            file = MemoryFile();
+            file.type = MemoryFile::tSymlink;
+            file.contents = archive_entry_symlink(entry);
+            break;
+
+        default:
+            throw Error("archive member '%s' has an unsupported type", path);
+        }
+
+        file.mtime = archive_entry_mtime(entry);
+        newest = std::max(newest.value_or(*file.mtime), *file.mtime);
+    }
+
+    archive.close();
+
+    return root;
+}
+
+static std::optional<time_t> tarballToNar(TarArchive & archive, Sink & sink)
+{
+    std::optional<time_t> newest;
+    auto root = readArchive(archive, newest);
+
+    if (root.entries.size() != 1) return {};
+
+    auto & top = root.entries.begin()->second;
+
+    /* Use the newest member if the top-level directory is implicit. */
+    auto mtime = top.mtime ? *top.mtime : newest.value_or(0);
+
+    sink << narVersionMagic1;
+    dumpMemoryFile(top, sink);
+
+    return mtime;
+}
+
+std::optional<time_t> tarballToNar(Source & source, Sink & sink)
+{
+    auto archive = TarArchive(source);
+    return tarballToNar(archive, sink);
+}
+
+std::optional<time_t> tarballToNar(const Path & tarFile, Sink & sink)
+{
+    auto archive = TarArchive(tarFile);
+    return tarballToNar(archive, sink);
+}
+
+void unpackTarfileToNar(Source & source, Sink & sink)
+{
+    auto archive = TarArchive(source);
+
+    std::optional<time_t> newest;
+    auto root = readArchive(archive, newest);
+
+    sink << narVersionMagic1;
+    dumpMemoryFile(root, sink);
+}
+
 }
@@ -6,4 +6,16 @@ void unpackTarfile(Source & source, const Path & destDir);
 
 void unpackTarfile(const Path & tarFile, const Path & destDir);
 
+/* Write the NAR serialisation of the single top-level file or
+   directory of a tarball to `sink', without unpacking it to disk.
+   Returns its modification time, or nullopt (having written nothing)
+   if the tarball doesn't have exactly one top-level member. */
+std::optional<time_t> tarballToNar(Source & source, Sink & sink);
+
+std::optional<time_t> tarballToNar(const Path & tarFile, Sink & sink);
+
+/* Like unpackTarfile(), but write the NAR serialisation of the
+   directory it would have created to `sink'. */
+void unpackTarfileToNar(Source & source, Sink & sink);
+
 }
@@ -72,4 +72,42 @@ namespace nix {
                 "7299aeadb6889018501d289e4900f7e4331b99dec4b5433a"
                 "c7d329eeb6dd26545e96e55b874be909");
     }
+
+#if HAVE_BLAKE3
+    TEST(hashString, testKnownBLAKE3Hashes) {
+        // values taken from: https://github.com/BLAKE3-team/BLAKE3
+        ASSERT_EQ(hashString(HashType::htBLAKE3, "").to_string(Base::Base16, true),
+                "blake3:af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262");
+        ASSERT_EQ(hashString(HashType::htBLAKE3, "abc").to_string(Base::Base16, true),
+                "blake3:6437b3ac38465133ffb63b75273a8db548c558465d79db03fd359c6cd5bd9d85");
+    }
+
+    TEST(hashSink, BLAKE3MatchesHashString) {
+        std::string s(100000, 'x');
+        HashSink sink(htBLAKE3);
+        for (size_t n = 0; n < s.size(); n += 777)
+            sink((const unsigned char *) s.data() + n, std::min((size_t) 777, s.size() - n));
+        ASSERT_EQ(sink.finish().first, hashString(htBLAKE3, s));
+    }
+#endif
+
+    /* ----------------------------------------------------------------------------
+     * hashPaths
+     * --------------------------------------------------------------------------*/
+
+    TEST(hashPaths, matchesHashPath) {
+        AutoDelete tmpDir(createTempDir(), true);
+
+        std::vector<Path> paths;
+        for (int n = 0; n < 200; n++) {
+            Path p = (Path) tmpDir + "/" + std::to_string(n);
+            writeFile(p, std::string(n, 'x'));
+            paths.push_back(p);
+        }
+
+        auto hashes = hashPaths(htSHA256, paths, 4);
+        ASSERT_EQ(hashes.size(), paths.size());
+        for (size_t n = 0; n < paths.size(); n++)
+            ASSERT_EQ(hashes[n], hashPath(htSHA256, paths[n]));
+    }
 }
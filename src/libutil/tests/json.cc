@@ -108,6 +108,36 @@ namespace nix {
         ASSERT_EQ(out.str(), "\"\\t\"");
     }
 
+    TEST(toJSON, escapesWithinRuns) {
+        std::stringstream out;
+        toJSON(out, "a\"b\\c\x01" "d\u00e9");
+
+        ASSERT_EQ(out.str(), "\"a\\\"b\\\\c\\u0001d\u00e9\"");
+    }
+
+    TEST(toJSON, escapesInLongStrings) {
+        /* Put each special character at every offset of a string
+           longer than a few vector blocks. */
+        for (char c : std::string("\"\\\n\x1f\x7f\x80")) {
+            for (size_t pos = 0; pos < 40; pos++) {
+                std::string s(40, 'x');
+                s[pos] = c;
+
+                std::string expected = "\"" + s.substr(0, pos);
+                if (c == '"') expected += "\\\"";
+                else if (c == '\\') expected += "\\\\";
+                else if (c == '\n') expected += "\\n";
+                else if (c == '\x1f') expected += "\\u001f";
+                else expected += c;
+                expected += s.substr(pos + 1) + "\"";
+
+                std::stringstream out;
+                toJSON(out, s);
+                ASSERT_EQ(out.str(), expected);
+            }
+        }
+    }
+
     /* ----------------------------------------------------------------------------
      * JSONObject
      * --------------------------------------------------------------------------*/
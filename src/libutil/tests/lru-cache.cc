@@ -127,4 +127,53 @@ namespace nix {
         ASSERT_EQ(c.size(), 0);
         ASSERT_EQ(c.get("one").value_or("empty"), "empty");
     }
+
+    /* ----------------------------------------------------------------------------
+     * ShardedLRUCache
+     * --------------------------------------------------------------------------*/
+
+    TEST(ShardedLRUCache, upsertAndGet) {
+        ShardedLRUCache<std::string, std::string> c(1024);
+        c.upsert("foo", "bar");
+        c.upsert("foo", "baz");
+        ASSERT_EQ(c.size(), 1);
+        ASSERT_EQ(c.get("foo"), "baz");
+        ASSERT_EQ(c.get("x").has_value(), false);
+    }
+
+    TEST(ShardedLRUCache, staysWithinCapacity) {
+        ShardedLRUCache<int, int> c(1024);
+        for (int i = 0; i < 10000; i++)
+            c.upsert(i, i);
+        ASSERT_LE(c.size(), 1024);
+        ASSERT_EQ(c.get(9999), 9999);
+    }
+
+    TEST(ShardedLRUCache, evictsLeastRecentlyUsedInShard) {
+        ShardedLRUCache<int, int> c(2, 1);
+        c.upsert(1, 1);
+        c.upsert(2, 2);
+        c.get(1);
+        c.upsert(3, 3);
+        ASSERT_EQ(c.get(1), 1);
+        ASSERT_EQ(c.get(2).has_value(), false);
+        ASSERT_EQ(c.get(3), 3);
+    }
+
+    TEST(ShardedLRUCache, eraseAndClear) {
+        ShardedLRUCache<std::string, std::string> c(1024);
+        c.upsert("one", "eins");
+        c.upsert("two", "zwei");
+        ASSERT_EQ(c.erase("one"), true);
+        ASSERT_EQ(c.erase("one"), false);
+        ASSERT_EQ(c.size(), 1);
+        c.clear();
+        ASSERT_EQ(c.size(), 0);
+    }
+
+    TEST(ShardedLRUCache, zeroCapacity) {
+        ShardedLRUCache<int, int> c(0);
+        c.upsert(1, 1);
+        ASSERT_EQ(c.size(), 0);
+    }
 }
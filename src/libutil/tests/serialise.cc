@@ -0,0 +1,77 @@
+#include "serialise.hh"
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * FdSink
+     * --------------------------------------------------------------------------*/
+
+    TEST(FdSink, largeWritesKeepOrderWithBufferedData) {
+        auto file = createTempDir() + "/out";
+        AutoDelete del(dirOf(file), true);
+
+        std::string big(100 * 1024, 'x');
+        for (size_t i = 0; i < big.size(); i += 4096) big[i] = 'a' + (i / 4096) % 26;
+
+        {
+            AutoCloseFD fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            FdSink sink(fd.get());
+            sink << "small" << big << 42 << big;
+            sink.flush();
+            ASSERT_EQ(sink.written, 16 + (8 + big.size()) + 8 + (8 + big.size()));
+        }
+
+        auto data = readFile(file);
+        StringSource source(data);
+        ASSERT_EQ(readString(source), "small");
+        ASSERT_EQ(readString(source), big);
+        ASSERT_EQ(readInt(source), 42);
+        ASSERT_EQ(readString(source), big);
+        ASSERT_THROW(readInt(source), EndOfFile);
+    }
+
+    /* ----------------------------------------------------------------------------
+     * sinkToSource
+     * --------------------------------------------------------------------------*/
+
+    static void produce(Sink & sink)
+    {
+        for (size_t i = 0; i < 1000; i++)
+            sink << fmt("chunk %d", i) << std::string(i * 37, 'a' + i % 26);
+    }
+
+    TEST(sinkToSource, coroutineMatchesDirect) {
+        StringSink direct;
+        produce(direct);
+        auto source = sinkToSource(produce);
+        ASSERT_EQ(source->drain(), *direct.s);
+    }
+
+    TEST(sinkToSourceThreaded, matchesDirect) {
+        StringSink direct;
+        produce(direct);
+        auto source = sinkToSourceThreaded(produce, []() { throw EndOfFile("done"); }, 1000, 2);
+        ASSERT_EQ(source->drain(), *direct.s);
+    }
+
+    TEST(sinkToSourceThreaded, propagatesExceptions) {
+        auto source = sinkToSourceThreaded([](Sink & sink) {
+            sink << "foo";
+            throw Error("producer failed");
+        });
+        ASSERT_EQ(readString(*source), "foo");
+        ASSERT_THROW(readString(*source), Error);
+    }
+
+    TEST(sinkToSourceThreaded, earlyDestructionStopsProducer) {
+        auto source = sinkToSourceThreaded([](Sink & sink) {
+            while (true) sink << "endless";
+        }, []() { throw EndOfFile("done"); }, 64, 2);
+        ASSERT_EQ(readString(*source), "endless");
+        source.reset();
+    }
+
+}
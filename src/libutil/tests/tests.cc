@@ -87,6 +87,39 @@ namespace nix {
         ASSERT_DEATH({ canonPath(""); }, "path != \"\"");
     }
 
+    TEST(canonPath, keepsCanonicalPaths) {
+        ASSERT_EQ(canonPath("/"), "/");
+        ASSERT_EQ(canonPath("/nix/store/foo..bar/.baz"), "/nix/store/foo..bar/.baz");
+    }
+
+    /* ----------------------------------------------------------------------------
+     * isCanonPath
+     * --------------------------------------------------------------------------*/
+
+    TEST(isCanonPath, acceptsCanonicalPaths) {
+        ASSERT_TRUE(isCanonPath("/"));
+        ASSERT_TRUE(isCanonPath("/foo"));
+        ASSERT_TRUE(isCanonPath("/foo/bar"));
+        ASSERT_TRUE(isCanonPath("/foo/..."));
+        ASSERT_TRUE(isCanonPath("/.foo/..bar"));
+    }
+
+    TEST(isCanonPath, rejectsOtherPaths) {
+        ASSERT_FALSE(isCanonPath(""));
+        ASSERT_FALSE(isCanonPath("foo"));
+        ASSERT_FALSE(isCanonPath("//"));
+        ASSERT_FALSE(isCanonPath("/foo/"));
+        ASSERT_FALSE(isCanonPath("/foo//bar"));
+        ASSERT_FALSE(isCanonPath("/foo/./bar"));
+        ASSERT_FALSE(isCanonPath("/foo/.."));
+        ASSERT_FALSE(isCanonPath("/."));
+    }
+
+    TEST(isCanonPath, agreesWithCanonPath) {
+        for (auto & p : {"/", "/a", "/a/b/", "/a/./b", "/a/../b", "//a", "/a/.b/..c", "/..", "/a/b/."})
+            ASSERT_EQ(isCanonPath(p), canonPath(p) == p) << p;
+    }
+
     /* ----------------------------------------------------------------------------
      * dirOf
      * --------------------------------------------------------------------------*/
@@ -202,6 +235,52 @@ namespace nix {
         ASSERT_FALSE(pathExists("/home/schnitzel/darmstadt/pommes"));
     }
 
+    /* ----------------------------------------------------------------------------
+     * readFile
+     * --------------------------------------------------------------------------*/
+
+    TEST(readFile, readsWholeFile) {
+        AutoDelete tmpDir(createTempDir(), true);
+        Path path = (Path) tmpDir + "/file";
+        std::string contents;
+        for (int i = 0; i < 100000; i++)
+            contents += std::to_string(i);
+        writeFile(path, contents);
+        ASSERT_EQ(readFile(path), contents);
+        writeFile(path, "");
+        ASSERT_EQ(readFile(path), "");
+    }
+
+#if __linux__
+    TEST(readFile, readsFilesWithWrongSize) {
+        ASSERT_NE(readFile("/proc/self/status"), "");
+    }
+#endif
+
+    /* ----------------------------------------------------------------------------
+     * readDirectory
+     * --------------------------------------------------------------------------*/
+
+    TEST(readDirectory, streamsEntries) {
+        AutoDelete tmpDir(createTempDir(), true);
+        writeFile((Path) tmpDir + "/a", "");
+        createDirs((Path) tmpDir + "/b");
+
+        AutoCloseDir dir(opendir(((Path) tmpDir).c_str()));
+        ASSERT_TRUE(dir);
+
+        std::map<std::string, unsigned char> entries;
+        readDirectory(dir.get(), tmpDir, [&](std::string_view name, ino_t ino, unsigned char type) {
+            entries.emplace(name, type);
+        });
+
+        ASSERT_EQ(entries.size(), 2);
+        ASSERT_EQ(entries.count("a"), 1);
+        if (entries["b"] != DT_UNKNOWN)
+            ASSERT_EQ(entries["b"], DT_DIR);
+        ASSERT_EQ(readDirectory(tmpDir).size(), 2);
+    }
+
     /* ----------------------------------------------------------------------------
      * concatStringsSep
      * --------------------------------------------------------------------------*/
@@ -397,6 +476,55 @@ namespace nix {
         ASSERT_EQ(rewriteStrings("this and that", rewrites), "this and that");
     }
 
+    TEST(rewriteStrings, multipleRewrites) {
+        StringMap rewrites;
+        rewrites["this"] = "these";
+        rewrites["that"] = "those";
+
+        ASSERT_EQ(rewriteStrings("this and that and this", rewrites), "these and those and these");
+    }
+
+    TEST(rewriteStrings, replacementsAreNotRewritten) {
+        StringMap rewrites;
+        rewrites["a"] = "b";
+        rewrites["b"] = "c";
+
+        ASSERT_EQ(rewriteStrings("aabb", rewrites), "bbcc");
+    }
+
+    TEST(rewriteStrings, firstEndingMatchWins) {
+        StringMap rewrites;
+        rewrites["abcd"] = "1";
+        rewrites["bcx"] = "2";
+
+        ASSERT_EQ(rewriteStrings("abcxabcd", rewrites), "a21");
+    }
+
+    TEST(StringRewriter, streaming) {
+        StringMap rewrites;
+        rewrites["0123456789abcdef"] = "fedcba9876543210";
+        rewrites["0123"] = "3210";
+        rewrites["xyz"] = "X";
+
+        std::string s;
+        for (int i = 0; i < 100; ++i)
+            s += "--0123456789abcdef--xy" + std::to_string(i) + "xyz0123";
+
+        StringRewriter rewriter(rewrites);
+        auto expected = rewriter(s);
+
+        /* Feeding the input in pieces of any size gives the same
+           result, including for matches that span pieces. */
+        for (size_t piece = 1; piece < 20; ++piece) {
+            StringRewriter::Stream stream;
+            std::string out;
+            for (size_t i = 0; i < s.size(); i += piece)
+                rewriter.feed(stream, std::string_view(s).substr(i, piece), out);
+            rewriter.finish(stream, out);
+            ASSERT_EQ(out, expected);
+        }
+    }
+
     /* ----------------------------------------------------------------------------
      * replaceStrings
      * --------------------------------------------------------------------------*/
@@ -0,0 +1,75 @@
+#include "thread-pool.hh"
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * ThreadPool
+     * --------------------------------------------------------------------------*/
+
+    TEST(ThreadPool, higherPriorityRunsFirst) {
+        /* With one thread, process() runs all items itself, in order. */
+        ThreadPool pool(1);
+        std::vector<std::string> order;
+
+        pool.enqueue([&]() { order.push_back("a"); });
+        pool.enqueue([&]() { order.push_back("b"); }, 1);
+        pool.enqueue([&]() { order.push_back("c"); });
+        pool.enqueue([&]() { order.push_back("d"); }, -1);
+        pool.enqueue([&]() { order.push_back("e"); }, 1);
+
+        pool.process();
+
+        ASSERT_EQ(order, std::vector<std::string>({"b", "e", "a", "c", "d"}));
+    }
+
+    TEST(ThreadPool, nestedEnqueue) {
+        ThreadPool pool(4);
+        Sync<size_t> count(0);
+
+        std::function<void(int)> work = [&](int depth) {
+            (*count.lock())++;
+            if (depth < 6)
+                for (int i = 0; i < 3; i++)
+                    pool.enqueue(std::bind(work, depth + 1), depth);
+        };
+
+        pool.enqueue(std::bind(work, 0));
+        pool.process();
+
+        /* 1 + 3 + 9 + ... + 3^6 */
+        ASSERT_EQ(*count.lock(), (size_t) 1093);
+    }
+
+    /* ----------------------------------------------------------------------------
+     * processGraph
+     * --------------------------------------------------------------------------*/
+
+    TEST(processGraph, boundedFrontierProcessesDependenciesFirst) {
+        /* Node i depends on i + 1 and i + 2, so starting in the order of
+           `nodes' needs dependencies beyond the frontier. */
+        std::set<int> nodes;
+        for (int i = 0; i < 200; i++) nodes.insert(i);
+
+        Sync<std::set<int>> done_;
+
+        ThreadPool pool(4);
+        processGraph<int>(pool, nodes,
+            [&](const int & n) {
+                std::set<int> deps;
+                if (n + 1 < 200) deps.insert(n + 1);
+                if (n + 2 < 200) deps.insert(n + 2);
+                return deps;
+            },
+            [&](const int & n) {
+                auto done(done_.lock());
+                if (n + 1 < 200) ASSERT_TRUE(done->count(n + 1));
+                if (n + 2 < 200) ASSERT_TRUE(done->count(n + 2));
+                done->insert(n);
+            },
+            2);
+
+        ASSERT_EQ(done_.lock()->size(), nodes.size());
+    }
+
+}
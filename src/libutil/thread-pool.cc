@@ -40,16 +40,24 @@ void ThreadPool::shutdown()
         thr.join();
 }
 
-void ThreadPool::enqueue(const work_t & t)
+void ThreadPool::enqueue(const work_t & t, int priority)
 {
-    auto state(state_.lock());
-    if (quit)
-        throw ThreadPoolShutDown("cannot enqueue a work item while the thread pool is shutting down");
-    state->pending.push(t);
-    /* Note: process() also executes items, so count it as a worker. */
-    if (state->pending.size() > state->workers.size() + 1 && state->workers.size() + 1 < maxThreads)
-        state->workers.emplace_back(&ThreadPool::doWork, this, false);
-    work.notify_one();
+    bool wakeUp;
+    {
+        auto state(state_.lock());
+        if (quit)
+            throw ThreadPoolShutDown("cannot enqueue a work item while the thread pool is shutting down");
+        state->pending[priority].push(t);
+        state->nrPending++;
+        /* Note: process() also executes items, so count it as a worker. */
+        if (state->nrPending > state->workers.size() + 1 && state->workers.size() + 1 < maxThreads)
+            state->workers.emplace_back(&ThreadPool::doWork, this, false);
+        /* Only signal if somebody is waiting, and do it after
+           releasing the lock, so that the woken thread doesn't
+           immediately block on it. */
+        wakeUp = state->idle > 0;
+    }
+    if (wakeUp) work.notify_one();
 }
 
 void ThreadPool::process()
@@ -122,7 +130,7 @@ void ThreadPool::doWork(bool mainThread)
             while (true) {
                 if (quit) return;
 
-                if (!state->pending.empty()) break;
+                if (state->nrPending) break;
 
                 /* If there are no active or pending items, and the
                    main thread is running process(), then no new items
@@ -133,11 +141,16 @@ void ThreadPool::doWork(bool mainThread)
                     return;
                 }
 
+                state->idle++;
                 state.wait(work);
+                state->idle--;
             }
 
-            w = std::move(state->pending.front());
-            state->pending.pop();
+            auto i = state->pending.begin();
+            w = std::move(i->second.front());
+            i->second.pop();
+            if (i->second.empty()) state->pending.erase(i);
+            state->nrPending--;
             state->active++;
         }
 
@@ -26,8 +26,11 @@ public:
     // FIXME: use std::packaged_task?
     typedef std::function<void()> work_t;
 
-    /* Enqueue a function to be executed by the thread pool. */
-    void enqueue(const work_t & t);
+    /* Enqueue a function to be executed by the thread pool. Items with
+       a higher priority are started first; items with the same
+       priority are started in the order they were enqueued. This
+       never blocks, so work items can enqueue more work. */
+    void enqueue(const work_t & t, int priority = 0);
 
     /* Execute work items until the queue is empty. Note that work
        items are allowed to add new items to the queue; this is
@@ -44,8 +47,10 @@ private:
 
     struct State
     {
-        std::queue<work_t> pending;
+        std::map<int, std::queue<work_t>, std::greater<int>> pending;
+        size_t nrPending = 0;
         size_t active = 0;
+        size_t idle = 0;
         std::exception_ptr exception;
         std::vector<std::thread> workers;
         bool draining = false;
@@ -64,23 +69,44 @@ private:
 
 /* Process in parallel a set of items of type T that have a partial
    ordering between them. Thus, any item is only processed after all
-   its dependencies have been processed. */
+   its dependencies have been processed. Edges are discovered on the
+   fly, so processing of leaves starts right away. If `maxFrontier' is
+   non-zero, at most that many items are started (i.e. have their
+   edges discovered but are not yet processed) at any time, bounding
+   the memory used on huge graphs. The dependencies of a started item
+   are started regardless, so that it can't stall. */
 template<typename T>
 void processGraph(
     ThreadPool & pool,
     const std::set<T> & nodes,
     std::function<std::set<T>(const T &)> getEdges,
-    std::function<void(const T &)> processNode)
+    std::function<void(const T &)> processNode,
+    size_t maxFrontier = 0)
 {
     struct Graph {
         std::set<T> left;
         std::map<T, std::set<T>> refs, rrefs;
+        std::set<T> started;
+        typename std::set<T>::const_iterator next;
+        size_t inFlight = 0;
     };
 
-    Sync<Graph> graph_(Graph{nodes, {}, {}});
+    Sync<Graph> graph_(Graph{nodes, {}, {}, {}, nodes.begin()});
 
     std::function<void(const T &)> worker;
 
+    auto start = [&](Graph & graph, const T & node, int priority) {
+        if (!graph.started.insert(node).second) return;
+        graph.inFlight++;
+        pool.enqueue(std::bind(worker, node), priority);
+    };
+
+    /* Start more items from `nodes' while there is room. */
+    auto feed = [&](Graph & graph) {
+        while (graph.next != nodes.end() && (!maxFrontier || graph.inFlight < maxFrontier))
+            start(graph, *graph.next++, 0);
+    };
+
     worker = [&](const T & node) {
 
         {
@@ -102,6 +128,7 @@ void processGraph(
                     if (graph->left.count(ref)) {
                         graph->refs[node].insert(ref);
                         graph->rrefs[ref].insert(node);
+                        start(*graph, ref, 1);
                     }
                 if (graph->refs[node].empty())
                     goto doWork;
@@ -122,17 +149,21 @@ void processGraph(
                 auto i = refs.find(node);
                 assert(i != refs.end());
                 refs.erase(i);
+                /* Give nodes that are ready to be processed
+                   precedence over discovering more edges, so
+                   that results come in early. */
                 if (refs.empty())
-                    pool.enqueue(std::bind(worker, rref));
+                    pool.enqueue(std::bind(worker, rref), 2);
             }
             graph->left.erase(node);
             graph->refs.erase(node);
             graph->rrefs.erase(node);
+            graph->inFlight--;
+            feed(*graph);
         }
     };
 
-    for (auto & node : nodes)
-        pool.enqueue(std::bind(worker, std::ref(node)));
+    feed(*graph_.lock());
 
     pool.process();
 
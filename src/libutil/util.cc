@@ -5,6 +5,7 @@
 #include "finally.hh"
 #include "serialise.hh"
 
+#include <algorithm>
 #include <cctype>
 #include <cerrno>
 #include <cstdio>
@@ -14,6 +15,7 @@
 #include <iostream>
 #include <sstream>
 #include <thread>
+#include <chrono>
 #include <future>
 
 #include <fcntl.h>
@@ -32,6 +34,7 @@
 
 #ifdef __linux__
 #include <sys/prctl.h>
+#include <linux/fs.h>
 #endif
 
 
@@ -69,6 +72,19 @@ void clearEnv()
         unsetenv(name.first.c_str());
 }
 
+
+/* Close enough to program start: static initialisation. */
+static auto startupTime = std::chrono::steady_clock::now();
+
+void showStartupPhase(const std::string & phase)
+{
+    static bool show = getEnv("NIX_SHOW_STARTUP").value_or("0") != "0";
+    if (!show) return;
+    auto elapsed = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - startupTime).count();
+    writeToStderr(fmt("startup: %-20s %8.3f ms\n", phase, elapsed));
+}
+
 void replaceEnv(std::map<std::string, std::string> newEnv)
 {
     clearEnv();
@@ -100,6 +116,7 @@ Path absPath(Path path, std::optional<Path> dir)
         }
         path = *dir + "/" + path;
     }
+    if (isCanonPath(path)) return path;
     return canonPath(path);
 }
 
@@ -113,6 +130,11 @@ Path canonPath(const Path & path, bool resolveSymlinks)
     if (path[0] != '/')
         throw Error("not an absolute path: '%1%'", path);
 
+    /* Most paths are canonical already. */
+    if (!resolveSymlinks && isCanonPath(path)) return path;
+
+    s.reserve(path.size());
+
     string::const_iterator i = path.begin(), end = path.end();
     string temp;
 
@@ -140,8 +162,10 @@ Path canonPath(const Path & path, bool resolveSymlinks)
 
         /* Normal component; copy it. */
         else {
+            auto j = std::find(i, end, '/');
             s += '/';
-            while (i != end && *i != '/') s += *i++;
+            s.append(i, j);
+            i = j;
 
             /* If s points to a symlink, resolve it and restart (since
                the symlink target might contain new symlinks). */
@@ -161,6 +185,24 @@ Path canonPath(const Path & path, bool resolveSymlinks)
 }
 
 
+bool isCanonPath(std::string_view path)
+{
+    if (path.empty() || path[0] != '/') return false;
+    if (path.size() == 1) return true;
+
+    /* Check the component following each slash. */
+    for (size_t i = 0; i < path.size(); ) {
+        auto j = path.find('/', i + 1);
+        if (j == std::string_view::npos) j = path.size();
+        auto c = path.substr(i + 1, j - i - 1);
+        if (c.empty() || c == "." || c == "..") return false;
+        i = j;
+    }
+
+    return true;
+}
+
+
 Path dirOf(const Path & path)
 {
     Path::size_type pos = path.rfind('/');
@@ -189,16 +231,17 @@ std::string_view baseNameOf(std::string_view path)
 }
 
 
-bool isInDir(const Path & path, const Path & dir)
+bool isInDir(std::string_view path, std::string_view dir)
 {
-    return path[0] == '/'
-        && string(path, 0, dir.size()) == dir
+    return !path.empty()
+        && path[0] == '/'
         && path.size() >= dir.size() + 2
+        && path.compare(0, dir.size(), dir) == 0
         && path[dir.size()] == '/';
 }
 
 
-bool isDirOrInDir(const Path & path, const Path & dir)
+bool isDirOrInDir(std::string_view path, std::string_view dir)
 {
     return path == dir || isInDir(path, dir);
 }
@@ -250,17 +293,15 @@ bool isLink(const Path & path)
 }
 
 
-DirEntries readDirectory(DIR *dir, const Path & path)
+void readDirectory(DIR * dir, const Path & path,
+    std::function<void(std::string_view name, ino_t ino, unsigned char type)> fun)
 {
-    DirEntries entries;
-    entries.reserve(64);
-
     struct dirent * dirent;
     while (errno = 0, dirent = readdir(dir)) { /* sic */
         checkInterrupt();
-        string name = dirent->d_name;
+        std::string_view name = dirent->d_name;
         if (name == "." || name == "..") continue;
-        entries.emplace_back(name, dirent->d_ino,
+        fun(name, dirent->d_ino,
 #ifdef HAVE_STRUCT_DIRENT_D_TYPE
             dirent->d_type
 #else
@@ -269,6 +310,16 @@ DirEntries readDirectory(DIR *dir, const Path & path)
         );
     }
     if (errno) throw SysError("reading directory '%1%'", path);
+}
+
+DirEntries readDirectory(DIR *dir, const Path & path)
+{
+    DirEntries entries;
+    entries.reserve(64);
+
+    readDirectory(dir, path, [&](std::string_view name, ino_t ino, unsigned char type) {
+        entries.emplace_back(std::string(name), ino, type);
+    });
 
     return entries;
 }
@@ -298,7 +349,35 @@ string readFile(int fd)
     if (fstat(fd, &st) == -1)
         throw SysError("statting file");
 
-    return drainFD(fd, true, st.st_size);
+    if (!S_ISREG(st.st_mode))
+        return drainFD(fd, true, st.st_size);
+
+    /* Read regular files straight into a string of their size. The
+       size may be wrong (e.g. in /proc and /sys), or the file may be
+       growing, so keep reading until EOF. */
+    auto s = make_ref<std::string>();
+    s->resize(st.st_size);
+
+    size_t pos = 0;
+    while (pos < s->size()) {
+        checkInterrupt();
+        ssize_t rd = read(fd, s->data() + pos, s->size() - pos);
+        if (rd == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("reading from file");
+        }
+        if (rd == 0) break;
+        pos += rd;
+    }
+
+    if (pos < s->size())
+        s->resize(pos);
+    else {
+        StringSink sink(s);
+        drainFD(fd, sink);
+    }
+
+    return std::move(*s);
 }
 
 
@@ -374,7 +453,8 @@ void writeLine(int fd, string s)
 }
 
 
-static void _deletePath(int parentfd, const Path & path, unsigned long long & bytesFreed)
+static void _deletePath(int parentfd, const Path & path, unsigned long long & bytesFreed,
+    std::vector<ino_t> * lastLinks)
 {
     checkInterrupt();
 
@@ -389,6 +469,9 @@ static void _deletePath(int parentfd, const Path & path, unsigned long long & by
     if (!S_ISDIR(st.st_mode) && st.st_nlink == 1)
         bytesFreed += st.st_size;
 
+    if (lastLinks && S_ISREG(st.st_mode) && st.st_nlink == 2)
+        lastLinks->push_back(st.st_ino);
+
     if (S_ISDIR(st.st_mode)) {
         /* Make the directory accessible. */
         const auto PERM_MASK = S_IRUSR | S_IWUSR | S_IXUSR;
@@ -404,7 +487,7 @@ static void _deletePath(int parentfd, const Path & path, unsigned long long & by
         if (!dir)
             throw SysError("opening directory '%1%'", path);
         for (auto & i : readDirectory(dir.get(), path))
-            _deletePath(dirfd(dir.get()), path + "/" + i.name, bytesFreed);
+            _deletePath(dirfd(dir.get()), path + "/" + i.name, bytesFreed, lastLinks);
     }
 
     int flags = S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0;
@@ -414,7 +497,8 @@ static void _deletePath(int parentfd, const Path & path, unsigned long long & by
     }
 }
 
-static void _deletePath(const Path & path, unsigned long long & bytesFreed)
+static void _deletePath(const Path & path, unsigned long long & bytesFreed,
+    std::vector<ino_t> * lastLinks)
 {
     Path dir = dirOf(path);
     if (dir == "")
@@ -429,7 +513,7 @@ static void _deletePath(const Path & path, unsigned long long & bytesFreed)
         throw SysError("opening directory '%1%'", path);
     }
 
-    _deletePath(dirfd.get(), path, bytesFreed);
+    _deletePath(dirfd.get(), path, bytesFreed, lastLinks);
 }
 
 
@@ -444,7 +528,14 @@ void deletePath(const Path & path, unsigned long long & bytesFreed)
 {
     //Activity act(*logger, lvlDebug, format("recursively deleting path '%1%'") % path);
     bytesFreed = 0;
-    _deletePath(path, bytesFreed);
+    _deletePath(path, bytesFreed, nullptr);
+}
+
+
+void deletePath(const Path & path, unsigned long long & bytesFreed, std::vector<ino_t> & lastLinks)
+{
+    bytesFreed = 0;
+    _deletePath(path, bytesFreed, &lastLinks);
 }
 
 
@@ -608,6 +699,40 @@ void replaceSymlink(const Path & target, const Path & link)
 }
 
 
+void copyFileFast(const Path & from, const Path & to, mode_t mode)
+{
+    AutoCloseFD fdFrom = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fdFrom) throw SysError("opening file '%1%'", from);
+
+    AutoCloseFD fdTo = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (!fdTo) throw SysError("opening file '%1%' for writing", to);
+
+#if __linux__
+#ifdef FICLONE
+    if (ioctl(fdTo.get(), FICLONE, fdFrom.get()) == 0) return;
+#endif
+
+    while (true) {
+        auto n = copy_file_range(fdFrom.get(), nullptr, fdTo.get(), nullptr, 1 << 30, 0);
+        if (n == 0) return;
+        if (n == -1) {
+            /* Fall back to copying the rest below. */
+            if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) break;
+            throw SysError("copying '%1%' to '%2%'", from, to);
+        }
+    }
+#endif
+
+    std::vector<unsigned char> buf(65536);
+    while (true) {
+        auto n = read(fdFrom.get(), buf.data(), buf.size());
+        if (n == -1) throw SysError("reading file '%1%'", from);
+        if (n == 0) break;
+        writeFull(fdTo.get(), buf.data(), n);
+    }
+}
+
+
 void readFull(int fd, unsigned char * buf, size_t count)
 {
     while (count) {
@@ -670,10 +795,12 @@ void drainFD(int fd, Sink & sink, bool block)
             throw SysError("making file descriptor non-blocking");
     }
 
-    std::vector<unsigned char> buf(64 * 1024);
+    /* Not a vector, which would clear the buffer first. */
+    const size_t bufSize = 64 * 1024;
+    std::unique_ptr<unsigned char[]> buf(new unsigned char[bufSize]);
     while (1) {
         checkInterrupt();
-        ssize_t rd = read(fd, buf.data(), buf.size());
+        ssize_t rd = read(fd, buf.get(), bufSize);
         if (rd == -1) {
             if (!block && (errno == EAGAIN || errno == EWOULDBLOCK))
                 break;
@@ -681,7 +808,7 @@ void drainFD(int fd, Sink & sink, bool block)
                 throw SysError("reading from file");
         }
         else if (rd == 0) break;
-        else sink(buf.data(), rd);
+        else sink(buf.get(), rd);
     }
 }
 
@@ -1258,16 +1385,132 @@ string replaceStrings(const std::string & s,
 }
 
 
-std::string rewriteStrings(const std::string & _s, const StringMap & rewrites)
+std::string rewriteStrings(const std::string & s, const StringMap & rewrites)
 {
-    auto s = _s;
-    for (auto & i : rewrites) {
-        if (i.first == i.second) continue;
-        size_t j = 0;
-        while ((j = s.find(i.first, j)) != string::npos)
-            s.replace(j, i.first.size(), i.second);
+    return StringRewriter(rewrites)(s);
+}
+
+
+StringRewriter::StringRewriter(const StringMap & rewrites_)
+{
+    states.emplace_back();
+
+    /* Build the trie of the strings to replace. */
+    for (auto & [from, to] : rewrites_) {
+        if (from.empty() || from == to) continue;
+        uint32_t s = 0;
+        for (unsigned char c : from) {
+            auto next = child(s, c);
+            if (!next) {
+                next = states.size();
+                auto & n = states[s].next;
+                n.insert(std::upper_bound(n.begin(), n.end(), std::make_pair(c, (uint32_t) 0),
+                        [](auto & a, auto & b) { return a.first < b.first; }),
+                    {c, next});
+                states.emplace_back();
+                states.back().depth = states[s].depth + 1;
+            }
+            s = next;
+        }
+        states[s].match = rewrites.size();
+        rewrites.emplace_back(from, to);
     }
-    return s;
+
+    for (unsigned int c = 0; c < 256; ++c)
+        rootNext[c] = child(0, c);
+
+    /* Compute the failure links in breadth-first order, and let each
+       state inherit the match of its longest proper suffix if it
+       doesn't have one itself. */
+    std::vector<uint32_t> queue;
+    for (auto & [c, s] : states[0].next)
+        queue.push_back(s);
+    for (size_t i = 0; i < queue.size(); ++i) {
+        auto s = queue[i];
+        for (auto & [c, t] : states[s].next) {
+            states[t].fail = step(states[s].fail, c);
+            if (states[t].match == -1)
+                states[t].match = states[states[t].fail].match;
+            queue.push_back(t);
+        }
+    }
+}
+
+
+uint32_t StringRewriter::child(uint32_t s, unsigned char c) const
+{
+    for (auto & [c2, t] : states[s].next)
+        if (c2 == c) return t;
+    return 0;
+}
+
+
+uint32_t StringRewriter::step(uint32_t s, unsigned char c) const
+{
+    while (s) {
+        if (auto t = child(s, c)) return t;
+        s = states[s].fail;
+    }
+    return rootNext[c];
+}
+
+
+void StringRewriter::feed(Stream & stream, std::string_view data, std::string & out,
+    std::vector<size_t> * matches) const
+{
+    /* The input not yet copied to `out' is `stream.pending' followed
+       by `data[start..]'. */
+    size_t start = 0;
+
+    auto emit = [&](size_t n) {
+        auto fromPending = std::min(n, stream.pending.size());
+        out.append(stream.pending, 0, fromPending);
+        stream.pending.erase(0, fromPending);
+        out.append(data.substr(start, n - fromPending));
+        start += n - fromPending;
+    };
+
+    auto s = stream.state;
+
+    if (!empty())
+        for (size_t i = 0; i < data.size(); ++i) {
+            s = step(s, data[i]);
+            auto match = states[s].match;
+            if (match == -1) continue;
+            auto & [from, to] = rewrites[match];
+            auto unemitted = stream.pending.size() + (i + 1 - start);
+            emit(unemitted - from.size());
+            if (matches) matches->push_back(out.size());
+            out += to;
+            stream.pending.clear();
+            start = i + 1;
+            s = 0;
+        }
+
+    /* Hold back the input that may be the start of a match. */
+    auto unemitted = stream.pending.size() + (data.size() - start);
+    emit(unemitted - states[s].depth);
+    stream.pending.append(data.substr(start));
+    stream.state = s;
+}
+
+
+void StringRewriter::finish(Stream & stream, std::string & out) const
+{
+    out += stream.pending;
+    stream.pending.clear();
+    stream.state = 0;
+}
+
+
+std::string StringRewriter::operator () (std::string_view s) const
+{
+    std::string res;
+    res.reserve(s.size());
+    Stream stream;
+    feed(stream, s, res);
+    finish(stream, res);
+    return res;
 }
 
 
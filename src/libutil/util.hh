@@ -46,6 +46,11 @@ std::map<std::string, std::string> getEnv();
 /* Clear the environment. */
 void clearEnv();
 
+/* If $NIX_SHOW_STARTUP is set, print to stderr how long after
+   program start `phase' was reached, to find what makes short
+   commands slow to start. */
+void showStartupPhase(const std::string & phase);
+
 /* Return an absolutized path, resolving paths relative to the
    specified directory, or the current directory otherwise.  The path
    is also canonicalised. */
@@ -57,6 +62,11 @@ Path absPath(Path path, std::optional<Path> dir = {});
    a symbolic link. */
 Path canonPath(const Path & path, bool resolveSymlinks = false);
 
+/* Whether `path' is already in the form returned by canonPath()
+   without resolving symlinks, i.e. absolute and without `.' or `..'
+   components or double or trailing slashes. */
+bool isCanonPath(std::string_view path);
+
 /* Return the directory part of the given canonical path, i.e.,
    everything before the final `/'.  If the path is the root or an
    immediate child thereof (e.g., `/foo'), this means `/'
@@ -68,10 +78,10 @@ Path dirOf(const Path & path);
 std::string_view baseNameOf(std::string_view path);
 
 /* Check whether 'path' is a descendant of 'dir'. */
-bool isInDir(const Path & path, const Path & dir);
+bool isInDir(std::string_view path, std::string_view dir);
 
 /* Check whether 'path' is equal to 'dir' or a descendant of 'dir'. */
-bool isDirOrInDir(const Path & path, const Path & dir);
+bool isDirOrInDir(std::string_view path, std::string_view dir);
 
 /* Get status of `path'. */
 struct stat lstat(const Path & path);
@@ -100,6 +110,15 @@ typedef vector<DirEntry> DirEntries;
 
 DirEntries readDirectory(const Path & path);
 
+/* Read the contents of an open directory stream.  `path' is only
+   used in error messages. */
+DirEntries readDirectory(DIR * dir, const Path & path);
+
+/* Call `fun' for every entry of an open directory stream as it is
+   read, without collecting the entries first. */
+void readDirectory(DIR * dir, const Path & path,
+    std::function<void(std::string_view name, ino_t ino, unsigned char type)> fun);
+
 unsigned char getFileType(const Path & path);
 
 /* Read the contents of a file into a string. */
@@ -125,6 +144,11 @@ void deletePath(const Path & path);
 
 void deletePath(const Path & path, unsigned long long & bytesFreed);
 
+/* Like the above, but also return the inode numbers of the regular
+   files that still had exactly one other link when they were
+   deleted. */
+void deletePath(const Path & path, unsigned long long & bytesFreed, std::vector<ino_t> & lastLinks);
+
 std::string getUserName();
 
 /* Return $HOME or the user's home directory from /etc/passwd. */
@@ -152,6 +176,11 @@ void createSymlink(const Path & target, const Path & link);
 /* Atomically create or replace a symlink. */
 void replaceSymlink(const Path & target, const Path & link);
 
+/* Copy the regular file `from' to the new file `to', sharing its
+   extents if the file system supports that, or else without copying
+   the data through user space if possible. */
+void copyFileFast(const Path & from, const Path & to, mode_t mode = 0666);
+
 
 /* Wrappers arount read()/write() that read/write exactly the
    requested number of bytes. */
@@ -387,9 +416,61 @@ string replaceStrings(const std::string & s,
     const std::string & from, const std::string & to);
 
 
+/* Apply a set of string rewrites (see StringRewriter). */
 std::string rewriteStrings(const std::string & s, const StringMap & rewrites);
 
 
+/* Applies a set of string rewrites in a single pass over the input,
+   using an Aho-Corasick automaton, so the cost doesn't grow with the
+   number of rewrites. Where matches overlap, the one that ends first
+   (and of those, the longest) wins. Replaced text is not rewritten
+   again. Build one and reuse it when rewriting many strings. */
+class StringRewriter
+{
+    struct State
+    {
+        /* Sorted by character. */
+        std::vector<std::pair<unsigned char, uint32_t>> next;
+        uint32_t fail = 0;
+        uint32_t depth = 0;
+        /* The longest rewrite whose `from' ends here, or -1. */
+        int32_t match = -1;
+    };
+
+    std::vector<State> states;
+    uint32_t rootNext[256];
+    std::vector<std::pair<std::string, std::string>> rewrites;
+
+    uint32_t child(uint32_t s, unsigned char c) const;
+    uint32_t step(uint32_t s, unsigned char c) const;
+
+public:
+
+    StringRewriter(const StringMap & rewrites);
+
+    bool empty() const { return rewrites.empty(); }
+
+    std::string operator () (std::string_view s) const;
+
+    /* The state of a stream being rewritten piecewise. */
+    struct Stream
+    {
+        uint32_t state = 0;
+        /* Input that may still turn out to be part of a match. */
+        std::string pending;
+    };
+
+    /* Rewrite the next piece of a stream, appending the output to
+       `out'. The offset in `out' of each replacement is appended to
+       `matches', if given. */
+    void feed(Stream & stream, std::string_view data, std::string & out,
+        std::vector<size_t> * matches = nullptr) const;
+
+    /* Flush the input held back at the end of the stream. */
+    void finish(Stream & stream, std::string & out) const;
+};
+
+
 /* Convert the exit status of a child as returned by wait() into an
    error string. */
 string statusToString(int status);
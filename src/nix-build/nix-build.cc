@@ -320,6 +320,8 @@ static void _main(int argc, char * * argv)
         }
     }
 
+    queryDrvPaths(*state, drvs);
+
     state->printStats();
 
     auto buildPaths = [&](const std::vector<StorePathWithOutputs> & paths) {
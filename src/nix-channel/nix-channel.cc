@@ -102,14 +102,10 @@ static void update(const StringSet & channelNames)
 
         std::string extraAttrs;
 
-        bool unpacked = false;
-        if (std::regex_search(filename, std::regex("\\.tar\\.(gz|bz2|xz)$"))) {
-            runProgram(settings.nixBinDir + "/nix-build", false, { "--no-out-link", "--expr", "import <nix/unpack-channel.nix> "
-                        "{ name = \"" + cname + "\"; channelName = \"" + name + "\"; src = builtins.storePath \"" + filename + "\"; }" });
-            unpacked = true;
-        }
-
-        if (!unpacked) {
+        /* If the URL is a tarball, use it directly. It's unpacked
+           below by nix-env together with the other channels, so
+           there is no need to build it separately first. */
+        if (!std::regex_search(filename, std::regex("\\.tar\\.(gz|bz2|xz)$"))) {
             // Download the channel tarball.
             try {
                 filename = store->toRealPath(fetchers::downloadFile(store, url + "/nixexprs.tar.xz", "nixexprs.tar.xz", false).storePath);
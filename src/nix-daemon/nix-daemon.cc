@@ -8,6 +8,7 @@
 #include "finally.hh"
 #include "../nix/legacy.hh"
 #include "daemon.hh"
+#include "daemon-metrics.hh"
 
 #include <algorithm>
 #include <climits>
@@ -29,6 +30,10 @@
 #include <sys/ucred.h>
 #endif
 
+#if __linux__
+#include <sys/prctl.h>
+#endif
+
 using namespace nix;
 using namespace nix::daemon;
 
@@ -149,6 +154,223 @@ static ref<Store> openUncachedStore()
 }
 
 
+/* Check whether the peer on 'remote' may connect, and log the
+   connection. */
+static TrustedFlag authenticatePeer(int remote, PeerInfo & peer, string & user)
+{
+    TrustedFlag trusted = NotTrusted;
+    peer = getPeerInfo(remote);
+
+    struct passwd * pw = peer.uidKnown ? getpwuid(peer.uid) : 0;
+    user = pw ? pw->pw_name : std::to_string(peer.uid);
+
+    struct group * gr = peer.gidKnown ? getgrgid(peer.gid) : 0;
+    string group = gr ? gr->gr_name : std::to_string(peer.gid);
+
+    Strings trustedUsers = settings.trustedUsers;
+    Strings allowedUsers = settings.allowedUsers;
+
+    if (matchUser(user, group, trustedUsers))
+        trusted = Trusted;
+
+    if ((!trusted && !matchUser(user, group, allowedUsers)) || group == settings.buildUsersGroup)
+        throw Error("user '%1%' is not allowed to connect to the Nix daemon", user);
+
+    printInfo(format((string) "accepted connection from pid %1%, user %2%" + (trusted ? " (trusted)" : ""))
+        % (peer.pidKnown ? std::to_string(peer.pid) : "<unknown>")
+        % (peer.uidKnown ? user : "<unknown>"));
+
+    return trusted;
+}
+
+
+static void printStoreStats(Store & store)
+{
+    if (auto localStore = dynamic_cast<LocalStore *>(&store))
+        if (auto stats = localStore->getSharedPathInfoCacheStats())
+            debug("shared path info cache: %d hits, %d misses", stats->first, stats->second);
+}
+
+
+/* Set up a forked daemon process for handling a connection. */
+static void initConnectionProcess()
+{
+    //  Background the daemon.
+    if (setsid() == -1)
+        throw SysError("creating a new session");
+
+    //  Restore normal handling of SIGCHLD.
+    setSigChldAction(false);
+}
+
+
+//  For debugging, stuff the pid of the peer into argv[1].
+static void showPeerPid(const PeerInfo & peer, char * * argv)
+{
+    if (peer.pidKnown && argv[1]) {
+        string processName = std::to_string(peer.pid);
+        strncpy(argv[1], processName.c_str(), strlen(argv[1]));
+    }
+}
+
+
+/* The body of a pre-forked daemon process: open the store, then wait
+   for a connection and handle it. The parent is notified through
+   'fdNotify' when this process is no longer available, so that it can
+   start another one. */
+static void preforkedWorker(int fdSocket, int fdNotify, char * * argv)
+{
+    initConnectionProcess();
+
+    auto notify = [&]() { writeFull(fdNotify, "x"); };
+
+    std::shared_ptr<Store> store;
+    try {
+        store = openUncachedStore();
+    } catch (...) {
+        /* Don't make the parent fork replacements in a tight loop. */
+        sleep(1);
+        notify();
+        throw;
+    }
+
+    AutoCloseFD remote;
+    while (true) {
+        struct sockaddr_un remoteAddr;
+        socklen_t remoteAddrLen = sizeof(remoteAddr);
+        remote = accept(fdSocket, (struct sockaddr *) &remoteAddr, &remoteAddrLen);
+        if (remote) break;
+        if (errno == EINTR) {
+            checkInterrupt();
+            continue;
+        }
+        notify();
+        throw SysError("accepting connection");
+    }
+
+    notify();
+
+#if __linux__
+    /* Like daemon processes forked for a connection, keep handling it
+       if the parent goes away. */
+    if (prctl(PR_SET_PDEATHSIG, 0) == -1)
+        throw SysError("resetting death signal");
+#endif
+
+    closeOnExec(remote.get());
+
+    PeerInfo peer;
+    string user;
+    TrustedFlag trusted = authenticatePeer(remote.get(), peer, user);
+
+    showPeerPid(peer, argv);
+
+    FdSource from(remote.get());
+    FdSink to(remote.get());
+    processConnection(ref<Store>(store), from, to, trusted, NotRecursive, user, peer.uid);
+
+    printStoreStats(*store);
+}
+
+
+/* Keep 'nrWorkers' pre-forked daemon processes waiting for
+   connections, replacing each one as soon as it has accepted a
+   connection. This hides the cost of forking and of opening the store
+   (e.g. the SQLite database) from clients. */
+static void preforkLoop(AutoCloseFD & fdSocket, unsigned int nrWorkers, char * * argv)
+{
+    Pipe notifyPipe;
+    notifyPipe.create();
+
+    /* Idle workers go away together with the parent. */
+    ProcessOptions options;
+    options.errorPrefix = "unexpected Nix daemon error: ";
+    options.dieWithParent = true;
+    options.runExitHandlers = true;
+    options.allowVfork = false;
+
+    auto startWorker = [&]() {
+        startProcess([&]() {
+            notifyPipe.readSide = -1;
+            preforkedWorker(fdSocket.get(), notifyPipe.writeSide.get(), argv);
+            exit(0);
+        }, options);
+    };
+
+    for (unsigned int n = 0; n < nrWorkers; ++n)
+        startWorker();
+
+    while (1) {
+        char c;
+        auto res = read(notifyPipe.readSide.get(), &c, 1);
+        try {
+            checkInterrupt();
+        } catch (Interrupted & e) {
+            return;
+        }
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("waiting for daemon workers");
+        }
+        if (res == 0)
+            throw EndOfFile("unexpected EOF from daemon workers");
+        startWorker();
+    }
+}
+
+
+/* Start a process that answers every HTTP request on the socket
+   'socketPath' with the daemon metrics. */
+static void startMetricsServer(const Path & socketPath)
+{
+    shareDaemonMetrics();
+
+    createDirs(dirOf(socketPath));
+    auto fdMetrics = createUnixDomainSocket(socketPath, 0666);
+
+    ProcessOptions options;
+    options.errorPrefix = "unexpected Nix daemon metrics error: ";
+    options.dieWithParent = true;
+    options.allowVfork = false;
+
+    startProcess([&]() {
+        while (true) {
+            try {
+                AutoCloseFD remote = accept(fdMetrics.get(), nullptr, nullptr);
+                checkInterrupt();
+                if (!remote) {
+                    if (errno == EINTR) continue;
+                    throw SysError("accepting connection");
+                }
+
+                /* Read the request headers. We don't care what was
+                   requested. */
+                std::string request;
+                char buf[4096];
+                while (request.find("\r\n\r\n") == std::string::npos && request.size() < 65536) {
+                    auto n = read(remote.get(), buf, sizeof(buf));
+                    if (n <= 0) break;
+                    request.append(buf, n);
+                }
+
+                auto body = daemonMetrics->render();
+                writeFull(remote.get(),
+                    fmt("HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %d\r\n"
+                        "\r\n", body.size())
+                    + body);
+            } catch (Interrupted & e) {
+                break;
+            } catch (Error & e) {
+                logError(e.info());
+            }
+        }
+        exit(0);
+    }, options);
+}
+
+
 static void daemonLoop(char * * argv)
 {
     if (chdir("/") == -1)
@@ -174,6 +396,14 @@ static void daemonLoop(char * * argv)
         fdSocket = createUnixDomainSocket(settings.nixDaemonSocketFile, 0666);
     }
 
+    if (settings.daemonMetricsSocket != "")
+        startMetricsServer(settings.daemonMetricsSocket);
+
+    if (settings.daemonPreforkWorkers) {
+        preforkLoop(fdSocket, settings.daemonPreforkWorkers, argv);
+        return;
+    }
+
     //  Loop accepting connections.
     while (1) {
 
@@ -192,27 +422,9 @@ static void daemonLoop(char * * argv)
 
             closeOnExec(remote.get());
 
-            TrustedFlag trusted = NotTrusted;
-            PeerInfo peer = getPeerInfo(remote.get());
-
-            struct passwd * pw = peer.uidKnown ? getpwuid(peer.uid) : 0;
-            string user = pw ? pw->pw_name : std::to_string(peer.uid);
-
-            struct group * gr = peer.gidKnown ? getgrgid(peer.gid) : 0;
-            string group = gr ? gr->gr_name : std::to_string(peer.gid);
-
-            Strings trustedUsers = settings.trustedUsers;
-            Strings allowedUsers = settings.allowedUsers;
-
-            if (matchUser(user, group, trustedUsers))
-                trusted = Trusted;
-
-            if ((!trusted && !matchUser(user, group, allowedUsers)) || group == settings.buildUsersGroup)
-                throw Error("user '%1%' is not allowed to connect to the Nix daemon", user);
-
-            printInfo(format((string) "accepted connection from pid %1%, user %2%" + (trusted ? " (trusted)" : ""))
-                % (peer.pidKnown ? std::to_string(peer.pid) : "<unknown>")
-                % (peer.uidKnown ? user : "<unknown>"));
+            PeerInfo peer;
+            string user;
+            TrustedFlag trusted = authenticatePeer(remote.get(), peer, user);
 
             //  Fork a child to handle the connection.
             ProcessOptions options;
@@ -223,23 +435,16 @@ static void daemonLoop(char * * argv)
             startProcess([&]() {
                 fdSocket = -1;
 
-                //  Background the daemon.
-                if (setsid() == -1)
-                    throw SysError("creating a new session");
-
-                //  Restore normal handling of SIGCHLD.
-                setSigChldAction(false);
-
-                //  For debugging, stuff the pid into argv[1].
-                if (peer.pidKnown && argv[1]) {
-                    string processName = std::to_string(peer.pid);
-                    strncpy(argv[1], processName.c_str(), strlen(argv[1]));
-                }
+                initConnectionProcess();
+                showPeerPid(peer, argv);
 
                 //  Handle the connection.
                 FdSource from(remote.get());
                 FdSink to(remote.get());
-                processConnection(openUncachedStore(), from, to, trusted, NotRecursive, user, peer.uid);
+                auto store = openUncachedStore();
+                processConnection(store, from, to, trusted, NotRecursive, user, peer.uid);
+
+                printStoreStats(*store);
 
                 exit(0);
             }, options);
@@ -2,6 +2,9 @@
 #include "common-eval-args.hh"
 #include "derivations.hh"
 #include "eval.hh"
+#include "eval-inline.hh"
+#include "eval-cache.hh"
+#include "filetransfer.hh"
 #include "get-drvs.hh"
 #include "globals.hh"
 #include "names.hh"
@@ -10,6 +13,7 @@
 #include "store-api.hh"
 #include "user-env.hh"
 #include "util.hh"
+#include "serialise.hh"
 #include "json.hh"
 #include "value-to-json.hh"
 #include "xml-writer.hh"
@@ -20,10 +24,16 @@
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <list>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <poll.h>
+
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#endif
 
 using namespace nix;
 using std::cout;
@@ -46,6 +56,8 @@ struct InstallSourceInfo
     Path profile; /* for srcProfile */
     string systemFilter; /* for srcNixExprDrvs */
     Bindings * autoArgs;
+    std::map<string, string> autoArgStrings; /* for the evaluation cache */
+    std::shared_ptr<eval_cache::EvalCache> evalCache;
 };
 
 
@@ -173,17 +185,170 @@ static void loadSourceExpr(EvalState & state, const Path & path, Value & v)
 }
 
 
-static void loadDerivations(EvalState & state, Path nixExprPath,
-    string systemFilter, Bindings & autoArgs,
-    const string & pathPrefix, DrvInfos & elems)
+/* Identify the inputs of evaluating the Nix expression of
+   `instSource', for keying the evaluation cache: the expressions
+   themselves (those in the Nix store, such as channels, are
+   identified by their path), the search path and the automatic
+   arguments. */
+static Hash getSourceFingerprint(EvalState & state, const InstallSourceInfo & instSource)
+{
+    HashSink sink(htSHA256);
+    sink << "nix-env-v1" << settings.thisSystem.get();
+
+    for (auto & i : instSource.autoArgStrings)
+        sink << i.first << i.second;
+
+    std::function<void(const Path & path)> addSource;
+    addSource = [&](const Path & path) {
+        auto path2 = canonPath(path, true);
+        if (!pathExists(path2)) return;
+        sink << path2;
+        if (state.store->isInStore(path2)) return;
+        auto st = lstat(path2);
+        if (S_ISDIR(st.st_mode)) {
+            StringSet names;
+            for (auto & i : readDirectory(path2))
+                /* Version control metadata doesn't affect
+                   evaluation. */
+                if (i.name != ".git" && i.name != ".hg" && i.name != ".svn")
+                    names.insert(i.name);
+            for (auto & name : names) {
+                sink << name;
+                addSource(path2 + "/" + name);
+            }
+        } else if (S_ISREG(st.st_mode))
+            sink << readFile(path2);
+    };
+
+    /* A file may import its neighbours, so hash its whole
+       directory. */
+    auto path = canonPath(instSource.nixExprPath, true);
+    addSource(pathExists(path) && !S_ISDIR(lstat(path).st_mode) ? dirOf(path) : path);
+
+    for (auto & i : state.getSearchPath()) {
+        sink << i.first << i.second;
+        /* Don't download anything just for the fingerprint. */
+        if (isUri(i.second)) continue;
+        auto r = state.resolveSearchPathElem(i);
+        if (r.first) addSource(r.second);
+    }
+
+    return sink.finish().first;
+}
+
+
+static std::shared_ptr<eval_cache::EvalCache> getEvalCache(EvalState & state,
+    InstallSourceInfo & instSource)
+{
+    if (!evalSettings.useEvalCache) return nullptr;
+
+    if (!instSource.evalCache) {
+        try {
+            auto fingerprint = getSourceFingerprint(state, instSource);
+            instSource.evalCache = std::make_shared<eval_cache::EvalCache>(
+                std::cref(fingerprint),
+                state,
+                [&state, &instSource]() {
+                    auto v = state.allocValue();
+                    loadSourceExpr(state, instSource.nixExprPath, *v);
+                    return v;
+                },
+                instSource.autoArgs);
+        } catch (Error & e) {
+            debug("not using the evaluation cache: %s", e.msg());
+        }
+    }
+
+    return instSource.evalCache;
+}
+
+
+/* Return the value of `attrPath' in `vRoot', called with the
+   automatic arguments if it is a function, as getDerivations() sees
+   it. The values of the prefixes of `attrPath' are remembered in
+   `prefixes', so functions along the way are only called once. */
+static Value & getAttrPathValue(EvalState & state, Value & vRoot,
+    const string & attrPath, Bindings & autoArgs, std::map<string, RootValue> & prefixes)
 {
+    auto i = prefixes.find(attrPath);
+    if (i != prefixes.end()) return **i->second;
+
+    Value * v = &vRoot;
+
+    /* The attribute names that getDerivations() considers don't
+       contain dots. */
+    if (!attrPath.empty()) {
+        auto dot = attrPath.rfind('.');
+        auto & vParent = getAttrPathValue(state, vRoot,
+            dot == string::npos ? "" : string(attrPath, 0, dot), autoArgs, prefixes);
+        v = findAlongAttrPath(state,
+            dot == string::npos ? attrPath : string(attrPath, dot + 1), autoArgs, vParent).first;
+    }
+
+    auto vCalled = state.allocValue();
+    state.autoCallFunction(autoArgs, *v, *vCalled);
+    prefixes.emplace(attrPath, allocRootValue(vCalled));
+    return *vCalled;
+}
+
+
+/* Load the derivations below `pathPrefix' in the Nix expression of
+   `instSource'. If `wanted' is set, only the derivations for whose
+   name it returns true are needed; if the evaluation cache has a
+   record of all derivations, only those are evaluated. */
+static void loadDerivations(EvalState & state, InstallSourceInfo & instSource,
+    const string & pathPrefix, DrvInfos & elems,
+    std::function<bool(const string & name)> wanted = {})
+{
+    auto & autoArgs(*instSource.autoArgs);
+    auto & systemFilter(instSource.systemFilter);
+
     Value vRoot;
-    loadSourceExpr(state, nixExprPath, vRoot);
+    loadSourceExpr(state, instSource.nixExprPath, vRoot);
+
+    auto evalCache = getEvalCache(state, instSource);
+
+    auto index = evalCache && wanted ? evalCache->getDrvIndex(pathPrefix) : std::nullopt;
+
+    if (index) {
+        debug("using the derivations recorded in the evaluation cache");
+
+        std::map<string, RootValue> prefixes;
+        std::set<Bindings *> done;
+
+        for (auto & drv : *index) {
+            if (systemFilter != "*" && drv.system != systemFilter) continue;
+            if (!wanted(drv.name)) continue;
+            try {
+                auto & v(getAttrPathValue(state, vRoot, drv.attrPath, autoArgs, prefixes));
+                state.forceValue(v);
+                /* Skip duplicates like getDerivations() does. */
+                if (!state.isDerivation(v) || !done.insert(v.attrs).second) continue;
+                DrvInfo elem(state, drv.attrPath, v.attrs);
+                elem.queryName();
+                elems.push_back(elem);
+            } catch (AssertionError &) {
+            }
+        }
+
+        return;
+    }
 
     Value & v(*findAlongAttrPath(state, pathPrefix, autoArgs, vRoot).first);
 
     getDerivations(state, v, pathPrefix, autoArgs, elems, true);
 
+    if (evalCache) {
+        try {
+            std::vector<eval_cache::DrvIndexEntry> drvs;
+            for (auto & i : elems)
+                drvs.push_back({i.attrPath, i.queryName(), i.querySystem()});
+            evalCache->setDrvIndex(pathPrefix, drvs);
+        } catch (Error & e) {
+            debug("not recording the derivations in the evaluation cache: %s", e.msg());
+        }
+    }
+
     /* Filter out all derivations not applicable to the current
        system. */
     for (DrvInfos::iterator i = elems.begin(), j; i != elems.end(); i = j) {
@@ -226,9 +391,8 @@ static void checkSelectorUse(DrvNames & selectors)
 
 
 static DrvInfos filterBySelector(EvalState & state, const DrvInfos & allElems,
-    const Strings & args, bool newestOnly)
+    DrvNames & selectors, bool newestOnly)
 {
-    DrvNames selectors = drvNamesFromArgs(args);
     if (selectors.empty())
         selectors.push_back(DrvName("*"));
 
@@ -311,15 +475,26 @@ static DrvInfos filterBySelector(EvalState & state, const DrvInfos & allElems,
 }
 
 
+static DrvInfos filterBySelector(EvalState & state, const DrvInfos & allElems,
+    const Strings & args, bool newestOnly)
+{
+    DrvNames selectors = drvNamesFromArgs(args);
+    return filterBySelector(state, allElems, selectors, newestOnly);
+}
+
+
 static bool isPath(const string & s)
 {
     return s.find('/') != string::npos;
 }
 
 
+/* If `wanted' is set, derivations in a Nix expression for whose name
+   it returns false may be omitted. */
 static void queryInstSources(EvalState & state,
     InstallSourceInfo & instSource, const Strings & args,
-    DrvInfos & elems, bool newestOnly)
+    DrvInfos & elems, bool newestOnly,
+    std::function<bool(const DrvName & name)> wanted = {})
 {
     InstallSourceType type = instSource.type;
     if (type == srcUnknown && args.size() > 0 && isPath(args.front()))
@@ -333,13 +508,30 @@ static void queryInstSources(EvalState & state,
         case srcUnknown:
         case srcNixExprDrvs: {
 
+            DrvNames selectors = drvNamesFromArgs(args);
+
+            /* Only the derivations matching a selector are needed.
+               Selectors that only match unwanted derivations still
+               count as used. */
+            std::function<bool(const string & name)> matches;
+            if (!selectors.empty() || wanted)
+                matches = [&](const string & name) {
+                    DrvName drvName(name);
+                    bool hit = selectors.empty();
+                    for (auto & i : selectors)
+                        if (i.matches(drvName)) {
+                            i.hits++;
+                            hit = true;
+                        }
+                    return hit && (!wanted || wanted(drvName));
+                };
+
             /* Load the derivations from the (default or specified)
                Nix expression. */
             DrvInfos allElems;
-            loadDerivations(state, instSource.nixExprPath,
-                instSource.systemFilter, *instSource.autoArgs, "", allElems);
+            loadDerivations(state, instSource, "", allElems, matches);
 
-            elems = filterBySelector(state, allElems, args, newestOnly);
+            elems = filterBySelector(state, allElems, selectors, newestOnly);
 
             break;
         }
@@ -532,9 +724,15 @@ static void upgradeDerivations(Globals & globals,
 
         DrvInfos installedElems = queryInstalled(*globals.state, globals.profile);
 
-        /* Fetch all derivations from the input file. */
+        /* Fetch the derivations from the input file that have the
+           name of an installed derivation. */
+        StringSet installedNames;
+        for (auto & i : installedElems)
+            installedNames.insert(DrvName(i.queryName()).name);
+
         DrvInfos availElems;
-        queryInstSources(*globals.state, globals.instSource, args, availElems, false);
+        queryInstSources(*globals.state, globals.instSource, args, availElems, false,
+            [&](const DrvName & name) { return installedNames.count(name.name) > 0; });
 
         /* Go through all installed derivations. */
         DrvInfos newElems;
@@ -854,36 +1052,286 @@ static VersionDiff compareVersionAgainstSet(
 }
 
 
+static void queryJSON(Globals & globals, JSONObject & topObj, DrvInfo & i)
+{
+    JSONObject pkgObj = topObj.object(i.attrPath);
+
+    auto drvName = DrvName(i.queryName());
+    pkgObj.attr("name", drvName.fullName);
+    pkgObj.attr("pname", drvName.name);
+    pkgObj.attr("version", drvName.version);
+    pkgObj.attr("system", i.querySystem());
+
+    JSONObject metaObj = pkgObj.object("meta");
+    StringSet metaNames = i.queryMetaNames();
+    for (auto & j : metaNames) {
+        auto placeholder = metaObj.placeholder(j);
+        Value * v = i.queryMeta(j);
+        if (!v) {
+            logError({
+                .name = "Invalid meta attribute",
+                .hint = hintfmt("derivation '%s' has invalid meta attribute '%s'",
+                    i.queryName(), j)
+            });
+            placeholder.write(nullptr);
+        } else {
+            PathSet context;
+            printValueAsJSON(*globals.state, true, *v, placeholder, context);
+        }
+    }
+}
+
+
 static void queryJSON(Globals & globals, vector<DrvInfo> & elems)
 {
-    JSONObject topObj(cout, true);
-    for (auto & i : elems) {
-        JSONObject pkgObj = topObj.object(i.attrPath);
-
-        auto drvName = DrvName(i.queryName());
-        pkgObj.attr("name", drvName.fullName);
-        pkgObj.attr("pname", drvName.name);
-        pkgObj.attr("version", drvName.version);
-        pkgObj.attr("system", i.querySystem());
-
-        JSONObject metaObj = pkgObj.object("meta");
-        StringSet metaNames = i.queryMetaNames();
-        for (auto & j : metaNames) {
-            auto placeholder = metaObj.placeholder(j);
-            Value * v = i.queryMeta(j);
-            if (!v) {
-                logError({
-                    .name = "Invalid meta attribute",
-                    .hint = hintfmt("derivation '%s' has invalid meta attribute '%s'",
-                        i.queryName(), j)
-                });
-                placeholder.write(nullptr);
+    /* Render the output before printing it, so that any derivations
+       it refers to can be written to the store first. */
+    std::ostringstream str;
+    {
+        JSONObject topObj(str, true);
+        for (auto & i : elems)
+            queryJSON(globals, topObj, i);
+    }
+    globals.state->store->flush();
+    cout << str.str();
+}
+
+
+/* A derivation found by an evaluation worker, together with its
+   entry in the output of queryJSON(). */
+struct QueryResult
+{
+    string name, attrPath, json;
+};
+
+
+/* Body of an evaluation worker process. It reads the indices of
+   attributes of 'v' from 'fdIn', and writes the derivations found in
+   each of them to 'fdOut'. It exits when its input is closed, on
+   error, or when its heap has grown too large. */
+static void evalWorker(Globals & globals, Value & v, const std::vector<Symbol> & attrs,
+    const string & attrPath, int fdIn, int fdOut)
+{
+    auto & state(*globals.state);
+    FdSource from(fdIn);
+    FdSink to(fdOut);
+
+    while (true) {
+        size_t n;
+        try {
+            n = readNum<size_t>(from);
+        } catch (EndOfFile &) {
+            return;
+        }
+
+        try {
+            DrvInfos drvs;
+            getDerivationsFromAttr(state, v, attrs.at(n), attrPath,
+                *globals.instSource.autoArgs, drvs, true);
+
+            std::vector<QueryResult> results;
+            for (auto & i : drvs) {
+                if (globals.instSource.systemFilter != "*" && i.querySystem() != globals.instSource.systemFilter)
+                    continue;
+                /* Render the entry as a member of a top-level object,
+                   then strip the enclosing braces so that the parent
+                   can splice it into its own output. */
+                std::ostringstream str;
+                {
+                    JSONObject topObj(str, true);
+                    queryJSON(globals, topObj, i);
+                }
+                auto json = str.str();
+                assert(hasPrefix(json, "{") && hasSuffix(json, "\n}"));
+                results.push_back({i.queryName(), i.attrPath, string(json, 1, json.size() - 3)});
+            }
+
+            bool restart = false;
+#if HAVE_BOEHMGC
+            restart = GC_get_heap_size() > evalSettings.maxEvalWorkerHeapSize * 1024 * 1024;
+#endif
+
+            state.store->flush();
+
+            to << 0 << results.size();
+            for (auto & r : results)
+                to << r.name << r.attrPath << r.json;
+            to << restart;
+            to.flush();
+
+            if (restart) return;
+
+        } catch (BaseError & e) {
+            logError(e.info());
+            to << 1 << e.status;
+            to.flush();
+            return;
+        }
+    }
+}
+
+
+/* Print the same output as 'nix-env -qa --json', except that the
+   top-level attributes of the Nix expression are evaluated in
+   'eval-workers' processes forked from this one. Returns false if the
+   expression is not an attribute set of derivations, in which case
+   the query should be done sequentially. */
+static bool queryJSONParallel(Globals & globals, const string & attrPath, const Strings & opArgs)
+{
+    auto & state(*globals.state);
+
+    Value vRoot;
+    loadSourceExpr(state, globals.instSource.nixExprPath, vRoot);
+
+    Value & vTop(*findAlongAttrPath(state, attrPath, *globals.instSource.autoArgs, vRoot).first);
+
+    Value v;
+    state.autoCallFunction(*globals.instSource.autoArgs, vTop, v);
+    if (v.type() != tAttrs || state.isDerivation(v)) return false;
+
+    std::vector<Symbol> attrs;
+    for (auto & i : v.attrs->lexicographicOrder())
+        attrs.push_back(i->name);
+
+    /* The workers are forked from this thread, the only one that the
+       garbage collector knows about, and served by a poll() loop.
+       Each worker evaluates one attribute at a time. */
+    struct EvalWorker
+    {
+        Pid pid;
+        AutoCloseFD to, fromFd;
+        FdSource from;
+        size_t current;
+    };
+
+    size_t next = 0;
+    std::vector<std::vector<QueryResult>> results(attrs.size());
+    std::optional<unsigned int> failed;
+    std::list<EvalWorker> workers;
+
+    /* Give the next attribute to `worker', if there is any work
+       left. */
+    auto assignWork = [&](EvalWorker & worker) {
+        if (failed || next == attrs.size()) return false;
+        worker.current = next++;
+        FdSink to(worker.to.get());
+        to << worker.current;
+        to.flush();
+        return true;
+    };
+
+    auto startWorker = [&]() {
+        Pipe toWorker, fromWorker;
+        toWorker.create();
+        fromWorker.create();
+
+        auto & worker(workers.emplace_back());
+
+        worker.pid = startProcess([&]() {
+            closeMostFDs({STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO,
+                toWorker.readSide.get(), fromWorker.writeSide.get()});
+            evalWorker(globals, v, attrs, attrPath,
+                toWorker.readSide.get(), fromWorker.writeSide.get());
+        }, ProcessOptions { .allowVfork = false });
+
+        worker.to = std::move(toWorker.writeSide);
+        worker.fromFd = std::move(fromWorker.readSide);
+        worker.from = FdSource(worker.fromFd.get());
+
+        if (!assignWork(worker)) {
+            worker.to = -1;
+            worker.pid.wait();
+            workers.pop_back();
+        }
+    };
+
+    for (unsigned int n = 0; n < std::max(1U, evalSettings.evalWorkers.get()) && next < attrs.size(); ++n)
+        startWorker();
+
+    while (!workers.empty()) {
+        std::vector<struct pollfd> fds;
+        for (auto & worker : workers)
+            fds.push_back({.fd = worker.fromFd.get(), .events = POLLIN});
+
+        if (poll(fds.data(), fds.size(), -1) == -1) {
+            if (errno != EINTR) throw SysError("polling evaluation workers");
+            checkInterrupt();
+            continue;
+        }
+
+        /* Replacements for workers that restart, started after the
+           loop so that `workers' stays in step with `fds'. */
+        size_t restarts = 0;
+
+        auto fd = fds.begin();
+        for (auto worker = workers.begin(); worker != workers.end(); ++fd) {
+            if (!fd->revents) { ++worker; continue; }
+
+            auto & from(worker->from);
+            bool finished, restart = false;
+
+            if (readNum<unsigned int>(from)) {
+                failed = readNum<unsigned int>(from);
+                finished = true;
             } else {
-                PathSet context;
-                printValueAsJSON(*globals.state, true, *v, placeholder, context);
+                auto & res(results[worker->current]);
+                res.resize(readNum<size_t>(from));
+                for (auto & r : res) {
+                    r.name = readString(from);
+                    r.attrPath = readString(from);
+                    r.json = readString(from);
+                }
+                restart = readNum<unsigned int>(from);
+                finished = restart || !assignWork(*worker);
             }
+
+            if (finished) {
+                worker->to = -1;
+                worker->pid.wait();
+                worker = workers.erase(worker);
+                if (restart) restarts++;
+            } else
+                ++worker;
+        }
+
+        while (restarts--) startWorker();
+    }
+
+    /* The worker has already printed the evaluation error. */
+    if (failed) throw Exit(*failed);
+
+    /* Apply the same selection and ordering as opQuery(), using the
+       derivations in the order in which getDerivations() would have
+       returned them. */
+    DrvInfos allElems;
+    std::map<string, string> json;
+    for (auto & res : results)
+        for (auto & r : res) {
+            DrvInfo drv(state);
+            drv.setName(r.name);
+            drv.attrPath = r.attrPath;
+            allElems.push_back(drv);
+            json[r.attrPath] = std::move(r.json);
         }
+
+    DrvInfos elems_ = filterBySelector(state, allElems, opArgs, false);
+
+    vector<DrvInfo> elems;
+    for (auto & i : elems_) elems.push_back(i);
+    sort(elems.begin(), elems.end(), cmpElemByName);
+
+    /* Write the entries the way JSONObject would. */
+    cout << '{';
+    bool first = true;
+    for (auto & i : elems) {
+        if (!first) cout << ',';
+        first = false;
+        cout << json[i.attrPath];
     }
+    if (!first) cout << '\n';
+    cout << '}';
+
+    return true;
 }
 
 
@@ -932,6 +1380,11 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     if (printAttrPath && source != sAvailable)
         throw UsageError("--attr-path(-P) only works with --available");
 
+    if (jsonOutput && source == sAvailable && !compareVersions && !printStatus
+        && !globals.prebuiltOnly && evalSettings.evalWorkers > 1
+        && queryJSONParallel(globals, attrPath, opArgs))
+        return;
+
     /* Obtain derivation information from the specified source. */
     DrvInfos availElems, installedElems;
 
@@ -939,9 +1392,7 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
         installedElems = queryInstalled(*globals.state, globals.profile);
 
     if (source == sAvailable || compareVersions)
-        loadDerivations(*globals.state, globals.instSource.nixExprPath,
-            globals.instSource.systemFilter, *globals.instSource.autoArgs,
-            attrPath, availElems);
+        loadDerivations(*globals.state, globals.instSource, attrPath, availElems);
 
     DrvInfos elems_ = filterBySelector(*globals.state,
         source == sInstalled ? installedElems : availElems,
@@ -984,6 +1435,19 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     }
 
 
+    /* Instantiate the derivations before printing their paths, so
+       that they can be written to the store first. */
+    if (printDrvPath) {
+        for (auto & i : elems)
+            try {
+                i.queryDrvPath();
+            } catch (AssertionError & e) {
+                /* Reported below. */
+            }
+        globals.state->store->flush();
+    }
+
+
     /* Print the desired columns, or XML output. */
     if (jsonOutput) {
         queryJSON(globals, elems);
@@ -1134,19 +1598,19 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
                                         i.queryName(), j)
                                 });
                             else {
-                                if (v->type == tString) {
+                                if (v->type() == tString) {
                                     attrs2["type"] = "string";
                                     attrs2["value"] = v->string.s;
                                     xml.writeEmptyElement("meta", attrs2);
-                                } else if (v->type == tInt) {
+                                } else if (v->type() == tInt) {
                                     attrs2["type"] = "int";
                                     attrs2["value"] = (format("%1%") % v->integer).str();
                                     xml.writeEmptyElement("meta", attrs2);
-                                } else if (v->type == tFloat) {
+                                } else if (v->type() == tFloat) {
                                     attrs2["type"] = "float";
                                     attrs2["value"] = (format("%1%") % v->fpoint).str();
                                     xml.writeEmptyElement("meta", attrs2);
-                                } else if (v->type == tBool) {
+                                } else if (v->type() == tBool) {
                                     attrs2["type"] = "bool";
                                     attrs2["value"] = v->boolean ? "true" : "false";
                                     xml.writeEmptyElement("meta", attrs2);
@@ -1154,18 +1618,18 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
                                     attrs2["type"] = "strings";
                                     XMLOpenElement m(xml, "meta", attrs2);
                                     for (unsigned int j = 0; j < v->listSize(); ++j) {
-                                        if (v->listElems()[j]->type != tString) continue;
+                                        if (v->listElems()[j]->type() != tString) continue;
                                         XMLAttrs attrs3;
                                         attrs3["value"] = v->listElems()[j]->string.s;
                                         xml.writeEmptyElement("string", attrs3);
                                     }
-                              } else if (v->type == tAttrs) {
+                              } else if (v->type() == tAttrs) {
                                   attrs2["type"] = "strings";
                                   XMLOpenElement m(xml, "meta", attrs2);
                                   Bindings & attrs = *v->attrs;
                                   for (auto &i : attrs) {
                                       Attr & a(*attrs.find(i.name));
-                                      if(a.value->type != tString) continue;
+                                      if(a.value->type() != tString) continue;
                                       XMLAttrs attrs3;
                                       attrs3["type"] = i.name;
                                       attrs3["value"] = a.value->string.s;
@@ -1366,6 +1830,7 @@ static int _main(int argc, char * * argv)
         struct MyArgs : LegacyArgs, MixEvalArgs
         {
             using LegacyArgs::LegacyArgs;
+            using MixEvalArgs::autoArgs;
         };
 
         MyArgs myArgs(std::string(baseNameOf(argv[0])), [&](Strings::iterator & arg, const Strings::iterator & end) {
@@ -1444,6 +1909,7 @@ static int _main(int argc, char * * argv)
             globals.instSource.nixExprPath = lookupFileArg(*globals.state, file);
 
         globals.instSource.autoArgs = myArgs.getAutoArgs(*globals.state);
+        globals.instSource.autoArgStrings = myArgs.autoArgs;
 
         if (globals.profile == "")
             globals.profile = getEnv("NIX_PROFILE").value_or("");
@@ -1453,6 +1919,8 @@ static int _main(int argc, char * * argv)
 
         op(globals, opFlags, opArgs);
 
+        store->flush();
+
         globals.state->printStats();
 
         logger->stop();
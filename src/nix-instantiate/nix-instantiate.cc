@@ -9,11 +9,17 @@
 #include "util.hh"
 #include "store-api.hh"
 #include "common-eval-args.hh"
+#include "thread-pool.hh"
+#include "json.hh"
 #include "../nix/legacy.hh"
 
 #include <map>
 #include <iostream>
 
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#endif
+
 
 using namespace nix;
 
@@ -49,17 +55,25 @@ void processExpr(EvalState & state, const Strings & attrPaths,
                 vRes = v;
             else
                 state.autoCallFunction(autoArgs, v, vRes);
+            /* Render the result before printing it, so that any
+               derivations it refers to can be written to the store
+               first. */
+            std::ostringstream str;
             if (output == okXML)
-                printValueAsXML(state, strict, location, vRes, std::cout, context);
+                printValueAsXML(state, strict, location, vRes, str, context);
             else if (output == okJSON)
-                printValueAsJSON(state, strict, vRes, std::cout, context);
+                printValueAsJSON(state, strict, vRes, str, context);
             else {
                 if (strict) state.forceValueDeep(vRes);
-                std::cout << vRes << std::endl;
+                str << vRes << std::endl;
             }
+            state.store->flush();
+            std::cout << str.str();
         } else {
             DrvInfos drvs;
             getDerivations(state, v, "", autoArgs, drvs, false);
+            queryDrvPaths(state, drvs);
+            state.store->flush();
             for (auto & i : drvs) {
                 Path drvPath = i.queryDrvPath();
 
@@ -84,6 +98,106 @@ void processExpr(EvalState & state, const Strings & attrPaths,
 }
 
 
+/* Evaluate each attribute path in a separate nix-instantiate
+   process, running at most 'workers' of them at the same time. The
+   evaluator is single-threaded, but the attributes are independent,
+   so this lets e.g. the jobs for several systems be evaluated on
+   several cores. The output is printed in the order of the attribute
+   paths, as if they had been evaluated sequentially. */
+static void processAttrsInParallel(const Strings & args,
+    const Strings & attrPaths, size_t workers)
+{
+    std::vector<std::pair<int, std::string>> results(attrPaths.size());
+
+    ThreadPool pool(std::min(workers, attrPaths.size()));
+
+    for (size_t n = 0; n < attrPaths.size(); ++n)
+        pool.enqueue([&, n]() {
+            auto args2 = args;
+            args2.push_back("--eval-worker-attr");
+            args2.push_back(std::to_string(n));
+            results[n] = runProgram(RunOptions(settings.nixBinDir + "/nix-instantiate", args2));
+        });
+
+    pool.process();
+
+    /* The workers have already printed their errors, so just
+       propagate the exit status of the first one that failed. */
+    for (auto & [status, output] : results) {
+        std::cout << output;
+        if (!statusOk(status))
+            throw Exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+    }
+}
+
+
+/* Read attribute paths from standard input, one per line, and print
+   the derivations they evaluate to as one JSON object per line. The
+   expression is evaluated once, so everything it imports stays parsed
+   and evaluated between jobs. When the heap grows beyond
+   'max-eval-worker-heap-size', the process re-executes itself to
+   start over with an empty heap, without losing any input. */
+static void runWorker(EvalState & state, Bindings & autoArgs, Expr * e, char * * argv)
+{
+    Value vRoot;
+    state.eval(e, vRoot);
+
+    while (true) {
+        string attrPath;
+        try {
+            /* Note: this reads unbuffered, so no input is lost when
+               restarting. */
+            attrPath = readLine(STDIN_FILENO);
+        } catch (EndOfFile &) {
+            break;
+        }
+
+        Strings drvPaths;
+        std::optional<std::string> error;
+
+        try {
+            Value & v(*findAlongAttrPath(state, attrPath, autoArgs, vRoot).first);
+            state.forceValue(v);
+
+            DrvInfos drvs;
+            getDerivations(state, v, "", autoArgs, drvs, false);
+            queryDrvPaths(state, drvs);
+            for (auto & i : drvs) {
+                string outputName = i.queryOutputName();
+                if (outputName == "")
+                    throw Error("derivation '%1%' lacks an 'outputName' attribute ", i.queryDrvPath());
+                drvPaths.push_back(i.queryDrvPath() + (outputName != "out" ? "!" + outputName : ""));
+            }
+            state.store->flush();
+        } catch (Error & e) {
+            error = filterANSIEscapes(e.what(), true);
+        }
+
+        {
+            JSONObject res(std::cout);
+            res.attr("attr", attrPath);
+            if (error)
+                res.attr("error", *error);
+            else {
+                auto list = res.list("drvPaths");
+                for (auto & i : drvPaths) list.elem(i);
+            }
+        }
+        std::cout << std::endl;
+
+#if HAVE_BOEHMGC
+        if (GC_get_heap_size() > evalSettings.maxEvalWorkerHeapSize * 1024 * 1024) {
+            printInfo("heap size exceeds %d MiB, restarting", evalSettings.maxEvalWorkerHeapSize);
+            /* Don't lose any derivations that are still queued. */
+            state.store->flush();
+            execv(readLink("/proc/self/exe").c_str(), argv);
+            throw SysError("restarting nix-instantiate");
+        }
+#endif
+    }
+}
+
+
 static int _main(int argc, char * * argv)
 {
     {
@@ -99,6 +213,8 @@ static int _main(int argc, char * * argv)
         Strings attrPaths;
         bool wantsReadWrite = false;
         RepairFlag repair = NoRepair;
+        std::optional<size_t> workerAttr;
+        bool worker = false;
 
         struct MyArgs : LegacyArgs, MixEvalArgs
         {
@@ -140,6 +256,10 @@ static int _main(int argc, char * * argv)
                 repair = Repair;
             else if (*arg == "--dry-run")
                 settings.readOnlyMode = true;
+            else if (*arg == "--worker")
+                worker = true;
+            else if (*arg == "--eval-worker-attr") // internal
+                workerAttr = getIntArg<size_t>(*arg, arg, end, false);
             else if (*arg != "" && arg->at(0) == '-')
                 return false;
             else
@@ -163,6 +283,37 @@ static int _main(int argc, char * * argv)
 
         if (attrPaths.empty()) attrPaths = {""};
 
+        if (worker) {
+            if (files.empty() && !fromArgs)
+                files.push_back("./default.nix");
+            if (evalOnly || findFile || readStdin || files.size() != 1 || gcRoot != "")
+                throw UsageError("'--worker' requires a single input and cannot be combined with other modes");
+            Expr * e = fromArgs
+                ? state->parseExprFromString(files.front(), absPath("."))
+                : state->parseExprFromFile(resolveExprPath(state->checkSourcePath(lookupFileArg(*state, files.front()))));
+            printGCWarning();
+            runWorker(*state, autoArgs, e, argv);
+            return 0;
+        }
+
+        if (workerAttr) {
+            if (*workerAttr >= attrPaths.size())
+                throw UsageError("invalid attribute index %d", *workerAttr);
+            attrPaths = {*std::next(attrPaths.begin(), *workerAttr)};
+        }
+
+        /* Only the common case of a single input is parallelised, and
+           not when creating GC roots, since their names depend on the
+           order in which the derivations are instantiated. */
+        if (evalSettings.evalWorkers > 1 && attrPaths.size() > 1 && !parseOnly && !findFile
+            && !readStdin && files.size() <= 1 && gcRoot == "")
+        {
+            auto args = argvToStrings(argc, argv);
+            args.pop_front();
+            processAttrsInParallel(args, attrPaths, evalSettings.evalWorkers);
+            return 0;
+        }
+
         if (findFile) {
             for (auto & i : files) {
                 Path p = state->findFile(i);
@@ -187,6 +338,8 @@ static int _main(int argc, char * * argv)
                 evalOnly, outputKind, xmlOutputSourceLocation, e);
         }
 
+        store->flush();
+
         state->printStats();
 
         return 0;
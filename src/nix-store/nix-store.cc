@@ -326,7 +326,10 @@ static void opQuery(Strings opFlags, Strings opArgs)
             for (auto & i : opArgs) {
                 auto ps = maybeUseOutputs(store->followLinksToStorePath(i), useOutput, forceRealise);
                 for (auto & j : ps) {
-                    if (query == qRequisites) store->computeFSClosure(j, paths, false, includeOutputs);
+                    if (query == qRequisites) {
+                        store->prefetchClosureInfos({j});
+                        store->computeFSClosure(j, paths, false, includeOutputs);
+                    }
                     else if (query == qReferences) {
                         for (auto & p : store->queryPathInfo(j)->references)
                             paths.insert(p);
@@ -381,9 +384,13 @@ static void opQuery(Strings opFlags, Strings opArgs)
             break;
 
         case qTree: {
-            StorePathSet done;
+            StorePaths roots;
             for (auto & i : opArgs)
-                printTree(store->followLinksToStorePath(i), "", "", done);
+                roots.push_back(store->followLinksToStorePath(i));
+            store->prefetchClosureInfos(StorePathSet(roots.begin(), roots.end()));
+            StorePathSet done;
+            for (auto & root : roots)
+                printTree(root, "", "", done);
             break;
         }
 
@@ -392,6 +399,7 @@ static void opQuery(Strings opFlags, Strings opArgs)
             for (auto & i : opArgs)
                 for (auto & j : maybeUseOutputs(store->followLinksToStorePath(i), useOutput, forceRealise))
                     roots.insert(j);
+            store->prefetchClosureInfos(roots);
             printDotGraph(ref<Store>(store), std::move(roots));
             break;
         }
@@ -401,6 +409,7 @@ static void opQuery(Strings opFlags, Strings opArgs)
             for (auto & i : opArgs)
                 for (auto & j : maybeUseOutputs(store->followLinksToStorePath(i), useOutput, forceRealise))
                     roots.insert(j);
+            store->prefetchClosureInfos(roots);
             printGraphML(ref<Store>(store), std::move(roots));
             break;
         }
@@ -766,6 +775,33 @@ static void opOptimise(Strings opFlags, Strings opArgs)
     store->optimiseStore();
 }
 
+/* Print the derivations whose builds were recorded as failed. */
+static void opQueryFailedPaths(Strings opFlags, Strings opArgs)
+{
+    if (!opArgs.empty() || !opFlags.empty())
+        throw UsageError("no arguments expected");
+
+    for (auto & i : store->queryFailedPaths())
+        cout << fmt("%s\n", store->printStorePath(i));
+}
+
+/* Forget that the builds of the given derivations failed, or of all
+   derivations if the argument is `*'. */
+static void opClearFailedPaths(Strings opFlags, Strings opArgs)
+{
+    if (!opFlags.empty()) throw UsageError("unknown flag");
+
+    if (opArgs.size() == 1 && opArgs.front() == "*")
+        store->clearFailedPaths({});
+    else {
+        if (opArgs.empty()) throw UsageError("no derivations specified");
+        StorePathSet paths;
+        for (auto & i : opArgs)
+            paths.insert(store->followLinksToStorePath(i));
+        store->clearFailedPaths(paths);
+    }
+}
+
 /* Serve the nix store in a way usable by a restricted ssh user. */
 static void opServe(Strings opFlags, Strings opArgs)
 {
@@ -969,6 +1005,18 @@ static void opServe(Strings opFlags, Strings opArgs)
                 break;
             }
 
+            case cmdAddMultipleToStore: {
+                if (!writeAllowed) throw Error("importing paths is not allowed");
+
+                /* The paths arrive back to back without per-path
+                   acknowledgements, and are registered in batches. */
+                store->addMultipleToStore(in, NoRepair, NoCheckSigs);
+
+                out << 1; // indicate success
+
+                break;
+            }
+
             default:
                 throw Error("unknown serve command %1%", cmd);
         }
@@ -1073,6 +1121,10 @@ static int _main(int argc, char * * argv)
                 op = opRepairPath;
             else if (*arg == "--optimise" || *arg == "--optimize")
                 op = opOptimise;
+            else if (*arg == "--query-failed-paths")
+                op = opQueryFailedPaths;
+            else if (*arg == "--clear-failed-paths")
+                op = opClearFailedPaths;
             else if (*arg == "--serve")
                 op = opServe;
             else if (*arg == "--generate-binary-cache-key")
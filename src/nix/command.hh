@@ -10,6 +10,8 @@ namespace nix {
 
 extern std::string programPath;
 
+namespace eval_cache { class EvalCache; }
+
 static constexpr Command::Category catSecondary = 100;
 static constexpr Command::Category catUtility = 101;
 static constexpr Command::Category catNixInstallation = 102;
@@ -41,11 +43,37 @@ struct SourceExprCommand : virtual StoreCommand, MixEvalArgs
 
     ref<EvalState> getEvalState();
 
+    /* Return the evaluation cache for the source expression. The
+       cache is keyed by a fingerprint of the expression's sources
+       (see getSourceFingerprint()), so it is invalidated
+       automatically when they change. It is not persistent when
+       ‘--file’ is used. */
+    ref<eval_cache::EvalCache> getEvalCache(EvalState & state);
+
+    /* Compute a hash of everything the source expression is loaded
+       from: the contents of the $NIX_PATH entries, the automatic
+       arguments and the system type. Paths in the Nix store are
+       immutable, so only their names are hashed. */
+    Hash getSourceFingerprint(EvalState & state);
+
+    /* Return the value of ‘attrPath’ in the source expression, like
+       findAlongAttrPath(). The sets selected along the way are
+       memoised, so installables that share a prefix (such as
+       ‘nixpkgs’) call it with the automatic arguments and evaluate it
+       only once. */
+    Value * getAttrPathValue(EvalState & state, const std::string & attrPath);
+
 private:
 
     std::shared_ptr<EvalState> evalState;
 
     RootValue vSourceExpr;
+
+    std::shared_ptr<eval_cache::EvalCache> evalCache;
+
+    /* Auto-called values of attribute path prefixes, keyed by the
+       prefix with each element quoted. */
+    std::map<std::string, RootValue> attrPathPrefixes;
 };
 
 enum RealiseMode { Build, NoBuild, DryRun };
@@ -1,5 +1,6 @@
 #include "command.hh"
 #include "shared.hh"
+#include "ssh.hh"
 #include "store-api.hh"
 #include "sync.hh"
 #include "thread-pool.hh"
@@ -8,14 +9,31 @@
 
 using namespace nix;
 
+/* The SSH host of a destination store that runs Nix on the other end,
+   and so can forward paths to other stores. */
+static std::optional<std::string> relayHost(const std::string & uri)
+{
+    for (auto scheme : {"ssh://", "ssh-ng://"})
+        if (hasPrefix(uri, scheme)) {
+            auto host = uri.substr(strlen(scheme));
+            return host.substr(0, host.find('?'));
+        }
+    return std::nullopt;
+}
+
 struct CmdCopy : StorePathsCommand
 {
-    std::string srcUri, dstUri;
+    std::string srcUri;
+    std::vector<std::string> dstUris;
+
+    unsigned int fanOut = 0;
 
     CheckSigsFlag checkSigs = CheckSigs;
 
     SubstituteFlag substitute = NoSubstitute;
 
+    bool resumable = false;
+
     CmdCopy()
         : StorePathsCommand(true)
     {
@@ -28,11 +46,13 @@ struct CmdCopy : StorePathsCommand
 
         addFlag({
             .longName = "to",
-            .description = "URI of the destination Nix store",
+            .description = "URI of the destination Nix store (may be repeated)",
             .labels = {"store-uri"},
-            .handler = {&dstUri},
+            .handler = {[&](std::string s) { dstUris.push_back(s); }},
         });
 
+        mkIntFlag(0, "fan-out", "number of destinations that each SSH destination forwards the paths to, once it has them", &fanOut);
+
         addFlag({
             .longName = "no-check-sigs",
             .description = "do not require that paths are signed by trusted keys",
@@ -45,6 +65,12 @@ struct CmdCopy : StorePathsCommand
             .description = "whether to try substitutes on the destination store (only supported by SSH)",
             .handler = {&substitute, Substitute},
         });
+
+        addFlag({
+            .longName = "resumable",
+            .description = "record the copied paths, so that an interrupted copy continues where it left off when run again",
+            .handler = {&resumable, true},
+        });
     }
 
     std::string description() override
@@ -63,6 +89,14 @@ struct CmdCopy : StorePathsCommand
                 "To copy the entire current NixOS system closure to another machine via SSH:",
                 "nix copy --to ssh://server /run/current-system"
             },
+            Example{
+                "To copy a large closure to a binary cache, continuing an earlier interrupted copy:",
+                "nix copy --resumable --to file:///tmp/cache /run/current-system"
+            },
+            Example{
+                "To deploy a closure to many machines, letting each machine that has it forward it to two more:",
+                "nix copy --fan-out 2 --to ssh://host1 --to ssh://host2 --to ssh://host3 --to ssh://host4 /run/current-system"
+            },
             Example{
                 "To copy a closure from another machine via SSH:",
                 "nix copy --from ssh://server /nix/store/a6cnl93nk1wxnq84brbbwr6hxw9gp2w9-blender-2.79-rc2"
@@ -87,15 +121,137 @@ struct CmdCopy : StorePathsCommand
         return srcUri.empty() ? StoreCommand::createStore() : openStore(srcUri);
     }
 
+    void copyTo(ref<Store> srcStore, ref<Store> dstStore, const StorePathSet & paths)
+    {
+        /* The journal is specific to the pair of stores, so any
+           interrupted copy between them can be continued. */
+        Path journal = resumable
+            ? getCacheDir() + "/nix/copy-journals/"
+                + hashString(htSHA256, srcStore->getUri() + " " + dstStore->getUri()).to_string(Base32, false)
+            : "";
+
+        copyPaths(srcStore, dstStore, paths, NoRepair, checkSigs, substitute, journal);
+    }
+
+    /* Let the destination `via', which already has the paths, run
+       'nix copy' to copy the closure of `roots' to `target'. */
+    bool relay(const std::string & via, const std::string & target, const Strings & roots)
+    {
+        auto params = splitUriAndParams(via).second;
+        SSHMaster master(*relayHost(via), get(params, "ssh-key").value_or(""), false, false);
+
+        auto cmd = "nix --experimental-features nix-command copy --to " + shellEscape(target);
+        if (checkSigs == NoCheckSigs) cmd += " --no-check-sigs";
+        if (substitute) cmd += " --substitute-on-destination";
+        for (auto & root : roots) cmd += " " + shellEscape(root);
+
+        debug("copying to '%s' through '%s'", target, via);
+
+        auto conn = master.startCommand(cmd);
+        conn->in = AutoCloseFD();
+        drainFD(conn->out.get());
+        int status = conn->sshPid.wait();
+        if (status == 0) return true;
+
+        warn("could not copy to '%s' through '%s' (%s); copying directly",
+            target, via, statusToString(status));
+        return false;
+    }
+
+    /* Copy the paths to several destinations. The source copies to up
+       to `fanOut' of them at a time, and each SSH destination that
+       receives the paths then forwards them to up to `fanOut' others,
+       so that the copies form a tree rather than all leaving the
+       source. */
+    void fanOutCopy(ref<Store> srcStore, const StorePathSet & paths)
+    {
+        std::vector<std::shared_ptr<Store>> stores(dstUris.size());
+        std::vector<char> missing(dstUris.size(), false);
+
+        /* Find out which destinations lack some of the paths, with one
+           batched query per destination. */
+        {
+            ThreadPool pool;
+            for (size_t n = 0; n < dstUris.size(); n++)
+                pool.enqueue([&, n]() {
+                    stores[n] = openStore(dstUris[n]);
+                    missing[n] = stores[n]->queryValidPaths(paths).size() < paths.size();
+                });
+            pool.process();
+        }
+
+        /* The relayed copies are given the top-level paths only, and
+           compute the closure themselves. */
+        StorePathSet referenced;
+        for (auto & path : paths)
+            for (auto & ref : srcStore->queryPathInfo(path)->references)
+                if (ref != path) referenced.insert(ref);
+        Strings roots;
+        for (auto & path : paths)
+            if (!referenced.count(path))
+                roots.push_back(srcStore->printStorePath(path));
+
+        struct State
+        {
+            std::list<size_t> pending;
+            size_t failed = 0;
+        };
+
+        Sync<State> state_;
+
+        for (size_t n = 0; n < dstUris.size(); n++)
+            if (missing[n]) state_.lock()->pending.push_back(n);
+
+        ThreadPool pool;
+
+        std::function<void(std::optional<size_t>)> serve;
+
+        serve = [&](std::optional<size_t> via) {
+            while (true) {
+                size_t target;
+                {
+                    auto state(state_.lock());
+                    if (state->pending.empty()) return;
+                    target = state->pending.front();
+                    state->pending.pop_front();
+                }
+
+                try {
+                    if (!via || !relay(dstUris[*via], dstUris[target], roots))
+                        copyTo(srcStore, ref<Store>(stores[target]), paths);
+                } catch (Error & e) {
+                    logError(e.info());
+                    state_.lock()->failed++;
+                    continue;
+                }
+
+                if (fanOut && relayHost(dstUris[target]))
+                    for (unsigned int n = 0; n < fanOut; n++)
+                        pool.enqueue([&serve, target]() { serve(target); });
+            }
+        };
+
+        for (unsigned int n = 0; n < std::max(1U, fanOut); n++)
+            pool.enqueue([&]() { serve({}); });
+
+        pool.process();
+
+        auto state(state_.lock());
+        if (state->failed)
+            throw Error("could not copy to %d of %d stores", state->failed, dstUris.size());
+    }
+
     void run(ref<Store> srcStore, StorePaths storePaths) override
     {
-        if (srcUri.empty() && dstUri.empty())
+        if (srcUri.empty() && dstUris.empty())
             throw UsageError("you must pass '--from' and/or '--to'");
 
-        ref<Store> dstStore = dstUri.empty() ? openStore() : openStore(dstUri);
+        StorePathSet paths(storePaths.begin(), storePaths.end());
 
-        copyPaths(srcStore, dstStore, StorePathSet(storePaths.begin(), storePaths.end()),
-            NoRepair, checkSigs, substitute);
+        if (dstUris.size() > 1)
+            fanOutCopy(srcStore, paths);
+        else
+            copyTo(srcStore, dstUris.empty() ? openStore() : openStore(dstUris.front()), paths);
     }
 };
 
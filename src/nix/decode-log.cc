@@ -0,0 +1,32 @@
+#include "command.hh"
+#include "serialise.hh"
+
+using namespace nix;
+
+struct CmdDecodeLog : Command
+{
+    std::string description() override
+    {
+        return "read a log written with '--log-format internal-binary' from standard input and replay it";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To convert a binary log to the JSON log format:",
+                "nix --log-format internal-json decode-log < build.log"
+            },
+        };
+    }
+
+    Category category() override { return catUtility; }
+
+    void run() override
+    {
+        FdSource source(STDIN_FILENO);
+        decodeBinaryLog(source, *logger);
+    }
+};
+
+static auto r1 = registerCommand<CmdDecodeLog>("decode-log");
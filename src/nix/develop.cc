@@ -6,8 +6,10 @@
 #include "derivations.hh"
 #include "affinity.hh"
 #include "progress-bar.hh"
+#include "serialise.hh"
 
 #include <regex>
+#include <fcntl.h>
 
 using namespace nix;
 
@@ -95,6 +97,82 @@ BuildEnvironment readEnvironment(const Path & path)
     return res;
 }
 
+/* Environments are cached in the user's cache directory, so that
+   entering a shell for a derivation that was entered before needs
+   neither a rebuild of the environment derivation nor a re-parse of
+   its output. The cache is only an optimisation: unreadable entries
+   are ignored, and entries whose store path has been garbage
+   collected are recomputed. */
+static Path devEnvCachePath(std::string_view name)
+{
+    return getCacheDir() + "/nix/dev-env-v1/" + std::string(name);
+}
+
+static std::optional<std::string> readDevEnvCache(const Path & path)
+{
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) return {};
+    try {
+        return readFile(fd.get());
+    } catch (Error & e) {
+        debug("ignoring unreadable environment cache entry '%s': %s", path, e.msg());
+        return {};
+    }
+}
+
+static void writeDevEnvCache(const Path & path, const std::string & contents)
+{
+    try {
+        createDirs(dirOf(path));
+        auto tmp = fmt("%s.tmp-%d", path, getpid());
+        writeFile(tmp, contents);
+        if (rename(tmp.c_str(), path.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, path);
+    } catch (Error & e) {
+        debug("cannot write environment cache entry '%s': %s", path, e.msg());
+    }
+}
+
+/* Return the environment stored in the output of an environment
+   derivation, parsing it only if it isn't cached yet. */
+BuildEnvironment getEnvironment(ref<Store> store, const StorePath & shellOutPath)
+{
+    auto cachePath = devEnvCachePath(std::string(shellOutPath.hashPart()) + ".env");
+
+    if (auto data = readDevEnvCache(cachePath)) {
+        try {
+            StringSource source(*data);
+            BuildEnvironment res;
+            for (auto n = readNum<size_t>(source); n--; ) {
+                auto name = readString(source);
+                Var var;
+                var.exported = readInt(source);
+                var.associative = readInt(source);
+                var.value = readString(source);
+                res.env.emplace(std::move(name), std::move(var));
+            }
+            res.bashFunctions = readString(source);
+            if (source.pos != data->size())
+                throw Error("trailing garbage");
+            debug("using cached environment '%s'", cachePath);
+            return res;
+        } catch (Error & e) {
+            debug("ignoring invalid environment cache entry '%s': %s", cachePath, e.msg());
+        }
+    }
+
+    auto res = readEnvironment(store->printStorePath(shellOutPath));
+
+    StringSink sink;
+    sink << res.env.size();
+    for (auto & [name, var] : res.env)
+        sink << name << (uint64_t) var.exported << (uint64_t) var.associative << var.value;
+    sink << res.bashFunctions;
+    writeDevEnvCache(cachePath, *sink.s);
+
+    return res;
+}
+
 const static std::string getEnvSh =
     #include "get-env.sh.gen.hh"
     ;
@@ -106,6 +184,26 @@ const static std::string getEnvSh =
    environment to a file and exits. */
 StorePath getDerivationEnvironment(ref<Store> store, const StorePath & drvPath)
 {
+    /* The environment derivation is a function of the derivation and
+       of get-env.sh, so if we made it before and its output is still
+       valid, we can skip reading the derivation's closure to rehash
+       it. */
+    HashSink keySink(htSHA256);
+    keySink << store->printStorePath(drvPath) << getEnvSh;
+    auto cachePath = devEnvCachePath(keySink.finish().first.to_string(Base32, false) + ".path");
+
+    if (auto cached = readDevEnvCache(cachePath)) {
+        try {
+            auto shellOutPath = store->parseStorePath(*cached);
+            if (store->isValidPath(shellOutPath)) {
+                debug("using cached environment of '%s'", store->printStorePath(drvPath));
+                return shellOutPath;
+            }
+        } catch (Error & e) {
+            debug("ignoring invalid environment cache entry '%s': %s", cachePath, e.msg());
+        }
+    }
+
     auto drv = store->derivationFromPath(drvPath);
 
     auto builder = baseNameOf(drv.builder);
@@ -144,6 +242,8 @@ StorePath getDerivationEnvironment(ref<Store> store, const StorePath & drvPath)
 
     assert(store->isValidPath(shellOutPath));
 
+    writeDevEnvCache(cachePath, store->printStorePath(shellOutPath));
+
     return shellOutPath;
 }
 
@@ -227,7 +327,7 @@ struct Common : InstallableCommand, MixProfile
 
         updateProfile(shellOutPath);
 
-        return {readEnvironment(strPath), strPath};
+        return {getEnvironment(store, shellOutPath), strPath};
     }
 };
 
@@ -57,14 +57,22 @@ struct CmdEval : MixJSON, InstallableCommand
         auto v = installable->toValue(*state).first;
         PathSet context;
 
+        /* Evaluate completely before printing, so that any
+           derivations in the result can be written to the store
+           first. */
         if (raw) {
+            auto s = state->coerceToString(noPos, *v, context);
+            store->flush();
             stopProgressBar();
-            std::cout << state->coerceToString(noPos, *v, context);
+            std::cout << s;
         } else if (json) {
-            JSONPlaceholder jsonOut(std::cout);
-            printValueAsJSON(*state, true, *v, jsonOut, context);
+            std::ostringstream str;
+            printValueAsJSON(*state, true, *v, str, context);
+            store->flush();
+            std::cout << str.str();
         } else {
             state->forceValueDeep(*v);
+            store->flush();
             logger->stdout("%s", *v);
         }
     }
@@ -4,9 +4,11 @@
 #include "derivations.hh"
 #include "eval-inline.hh"
 #include "eval.hh"
+#include "eval-cache.hh"
 #include "get-drvs.hh"
 #include "store-api.hh"
 #include "shared.hh"
+#include "archive.hh"
 
 #include <regex>
 
@@ -81,6 +83,118 @@ ref<EvalState> SourceExprCommand::getEvalState()
     return ref<EvalState>(evalState);
 }
 
+Hash SourceExprCommand::getSourceFingerprint(EvalState & state)
+{
+    HashSink sink(htSHA256);
+    sink << "source-expr-v1" << settings.thisSystem.get();
+
+    for (auto & i : autoArgs)
+        sink << i.first << i.second;
+
+    /* Version control metadata doesn't affect evaluation, and is
+       often much larger than the expressions themselves. */
+    PathFilter filter = [](const Path & path) {
+        auto name = baseNameOf(path);
+        return name != ".git" && name != ".hg" && name != ".svn";
+    };
+
+    auto addSource = [&](const Path & path) {
+        if (!pathExists(path)) return;
+        auto path2 = canonPath(path, true);
+        sink << path2;
+        if (!state.store->isInStore(path2))
+            dumpPath(path2, sink, filter);
+    };
+
+    assert(file == "");
+
+    for (auto & i : state.getSearchPath()) {
+        auto r = state.resolveSearchPathElem(i);
+        if (!r.first) continue;
+        sink << i.first;
+        addSource(r.second);
+    }
+
+    return sink.finish().first;
+}
+
+ref<eval_cache::EvalCache> SourceExprCommand::getEvalCache(EvalState & state)
+{
+    if (!evalCache) {
+        /* A file given with ‘--file’ can import anything, so there is
+           no way to tell up front whether it has changed. */
+        std::optional<Hash> fingerprint;
+        if (evalSettings.useEvalCache && file == "")
+            fingerprint = getSourceFingerprint(state);
+        evalCache = std::make_shared<eval_cache::EvalCache>(
+            fingerprint ? std::optional(std::cref(*fingerprint)) : std::nullopt,
+            state,
+            [&state, this]() { return getSourceExpr(state); },
+            getAutoArgs(state));
+    }
+    return ref<eval_cache::EvalCache>(evalCache);
+}
+
+Value * SourceExprCommand::getAttrPathValue(EvalState & state, const std::string & attrPath)
+{
+    auto source = getSourceExpr(state);
+
+    Bindings & autoArgs = *getAutoArgs(state);
+
+    /* keys[n] identifies the prefix consisting of the first n
+       elements of the attribute path. */
+    std::vector<std::string> keys{""};
+    for (auto & attr : parseAttrPath(state, attrPath))
+        keys.push_back((keys.size() == 1 ? "" : keys.back() + ".") + "\"" + (const std::string &) attr + "\"");
+
+    auto elems = keys.size() - 1;
+
+    if (!elems)
+        return findAlongAttrPath(state, attrPath, autoArgs, *source).first;
+
+    auto autoCall = [&](Value & v, const std::string & key) {
+        auto vCalled = state.allocValue();
+        state.autoCallFunction(autoArgs, v, *vCalled);
+        state.forceValue(*vCalled);
+        /* Calling a set or list again is a no-op, so these can be the
+           starting point of later lookups. */
+        if (vCalled->type() == tAttrs || vCalled->isList())
+            attrPathPrefixes.insert_or_assign(key, allocRootValue(vCalled));
+        return vCalled;
+    };
+
+    try {
+        /* Start from the longest prefix that has been evaluated
+           already. */
+        Value * v = nullptr;
+        size_t n = elems;
+        while (n-- > 0) {
+            auto i = attrPathPrefixes.find(keys[n]);
+            if (i != attrPathPrefixes.end()) {
+                v = *i->second;
+                break;
+            }
+        }
+        if (!v) {
+            n = 0;
+            v = autoCall(*source, keys[0]);
+        }
+
+        for (; n < elems; n++) {
+            auto elem = n ? keys[n + 1].substr(keys[n].size() + 1) : keys[1];
+            v = findAlongAttrPath(state, elem, autoArgs, *v).first;
+            if (n + 1 < elems)
+                v = autoCall(*v, keys[n + 1]);
+        }
+
+        return v;
+    } catch (Error &) {
+        /* Redo the lookup in one go to get an error message that
+           mentions the whole attribute path. */
+        return findAlongAttrPath(state, attrPath, autoArgs, *source).first;
+    }
+}
+
 Buildable Installable::toBuildable()
 {
     auto buildables = toBuildables();
@@ -134,6 +248,7 @@ struct InstallableValue : Installable
 
         DrvInfos drvs;
         getDerivations(*state, *v, "", autoArgs, drvs, false);
+        queryDrvPaths(*state, drvs);
 
         Buildables res;
 
@@ -194,13 +309,32 @@ struct InstallableAttrPath : InstallableValue
 
     std::string what() override { return attrPath; }
 
-    std::pair<Value *, Pos> toValue(EvalState & state) override
+    Buildables toBuildables() override
     {
-        auto source = cmd.getSourceExpr(state);
+        auto state = cmd.getEvalState();
+
+        /* If the attribute is a single derivation, we can answer from
+           the evaluation cache without evaluating anything. */
+        if (evalSettings.useEvalCache) {
+            auto cursor = cmd.getEvalCache(*state)->getRoot()->findAlongAttrPath(
+                parseAttrPath(*state, attrPath));
+            if (cursor && cursor->isDerivation()) {
+                Buildable b{.drvPath = cursor->forceDerivation()};
+                auto outPath = cursor->getAttr(state->sOutPath)->getString();
+                auto outputName = cursor->getAttr(state->sOutputName)->getString();
+                b.outputs.emplace(outputName, state->store->parseStorePath(outPath));
+                Buildables bs;
+                bs.push_back(std::move(b));
+                return bs;
+            }
+        }
 
-        Bindings & autoArgs = *cmd.getAutoArgs(state);
+        return InstallableValue::toBuildables();
+    }
 
-        auto v = findAlongAttrPath(state, attrPath, autoArgs, *source).first;
+    std::pair<Value *, Pos> toValue(EvalState & state) override
+    {
+        auto v = cmd.getAttrPathValue(state, attrPath);
         state.forceValue(*v);
 
         return {v, noPos};
@@ -262,22 +396,30 @@ Buildables build(ref<Store> store, RealiseMode mode,
 
     Buildables buildables;
 
-    std::vector<StorePathWithOutputs> pathsToBuild;
+    /* Installables often overlap (e.g. ‘foo’ and ‘foo.dev’), so
+       merge the outputs wanted from each derivation. */
+    std::map<StorePath, StringSet> drvsToBuild;
+    StorePathSet pathsToSubstitute;
 
     for (auto & i : installables) {
         for (auto & b : i->toBuildables()) {
             if (b.drvPath) {
-                StringSet outputNames;
+                auto & outputNames = drvsToBuild[*b.drvPath];
                 for (auto & output : b.outputs)
                     outputNames.insert(output.first);
-                pathsToBuild.push_back({*b.drvPath, outputNames});
             } else
                 for (auto & output : b.outputs)
-                    pathsToBuild.push_back({output.second});
+                    pathsToSubstitute.insert(output.second);
             buildables.push_back(std::move(b));
         }
     }
 
+    std::vector<StorePathWithOutputs> pathsToBuild;
+    for (auto & [drvPath, outputNames] : drvsToBuild)
+        pathsToBuild.push_back({drvPath, outputNames});
+    for (auto & path : pathsToSubstitute)
+        pathsToBuild.push_back({path});
+
     if (mode == DryRun)
         printMissing(store, pathsToBuild, lvlError);
     else if (mode == Build)
@@ -153,7 +153,8 @@ void mainWrapped(int argc, char * * argv)
     }
 
     initNix();
-    initGC();
+
+    showStartupPhase("initNix");
 
     programPath = argv[0];
     auto programName = std::string(baseNameOf(programPath));
@@ -174,8 +175,15 @@ void mainWrapped(int argc, char * * argv)
 
     args.parseCmdline(argvToStrings(argc, argv));
 
+    showStartupPhase("parse arguments");
+
+    if (loggerSettings.activityTraceFile != "")
+        logger = makeTraceLogger(*logger, loggerSettings.activityTraceFile);
+
     initPlugins();
 
+    showStartupPhase("plugins");
+
     if (!args.command) args.showHelpAndExit();
 
     if (args.command->first != "repl"
@@ -204,7 +212,12 @@ void mainWrapped(int argc, char * * argv)
         settings.tarballTtl = 0;
 
     args.command->second->prepare();
+
+    showStartupPhase("prepare command");
+
     args.command->second->run();
+
+    showStartupPhase("run command");
 }
 
 }
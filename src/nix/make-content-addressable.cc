@@ -3,6 +3,7 @@
 #include "references.hh"
 #include "common-args.hh"
 #include "json.hh"
+#include "thread-pool.hh"
 
 using namespace nix;
 
@@ -36,72 +37,92 @@ struct CmdMakeContentAddressable : StorePathsCommand, MixJSON
 
     void run(ref<Store> store, StorePaths storePaths) override
     {
-        auto paths = store->topoSortPaths(StorePathSet(storePaths.begin(), storePaths.end()));
+        StorePathSet paths(storePaths.begin(), storePaths.end());
 
-        std::reverse(paths.begin(), paths.end());
+        Sync<std::map<StorePath, StorePath>> remappings_;
 
-        std::map<StorePath, StorePath> remappings;
+        /* Paths whose references have all been rewritten are
+           independent of each other, so rewrite them in parallel. The
+           NAR is streamed twice (once to compute the new hash and once
+           to add the result), rather than being kept in memory. */
+        ThreadPool pool;
 
-        auto jsonRoot = json ? std::make_unique<JSONObject>(std::cout) : nullptr;
-        auto jsonRewrites = json ? std::make_unique<JSONObject>(jsonRoot->object("rewrites")) : nullptr;
-
-        for (auto & path : paths) {
-            auto pathS = store->printStorePath(path);
-            auto oldInfo = store->queryPathInfo(path);
-            std::string oldHashPart(path.hashPart());
-
-            StringSink sink;
-            store->narFromPath(path, sink);
-
-            StringMap rewrites;
-
-            StorePathSet references;
-            bool hasSelfReference = false;
-            for (auto & ref : oldInfo->references) {
-                if (ref == path)
-                    hasSelfReference = true;
-                else {
-                    auto i = remappings.find(ref);
-                    auto replacement = i != remappings.end() ? i->second : ref;
-                    // FIXME: warn about unremapped paths?
-                    if (replacement != ref)
-                        rewrites.insert_or_assign(store->printStorePath(ref), store->printStorePath(replacement));
-                    references.insert(std::move(replacement));
+        processGraph<StorePath>(pool, paths,
+            [&](const StorePath & path) {
+                return store->queryPathInfo(path)->references;
+            },
+            [&](const StorePath & path) {
+                auto pathS = store->printStorePath(path);
+                auto oldInfo = store->queryPathInfo(path);
+                std::string oldHashPart(path.hashPart());
+
+                StringMap rewrites;
+
+                StorePathSet references;
+                bool hasSelfReference = false;
+                {
+                    auto remappings(remappings_.lock());
+                    for (auto & ref : oldInfo->references) {
+                        if (ref == path)
+                            hasSelfReference = true;
+                        else {
+                            auto i = remappings->find(ref);
+                            auto replacement = i != remappings->end() ? i->second : ref;
+                            // FIXME: warn about unremapped paths?
+                            if (replacement != ref)
+                                rewrites.insert_or_assign(store->printStorePath(ref), store->printStorePath(replacement));
+                            references.insert(std::move(replacement));
+                        }
+                    }
                 }
-            }
-
-            *sink.s = rewriteStrings(*sink.s, rewrites);
 
-            HashModuloSink hashModuloSink(htSHA256, oldHashPart);
-            hashModuloSink((unsigned char *) sink.s->data(), sink.s->size());
-
-            auto narHash = hashModuloSink.finish().first;
-
-            ValidPathInfo info(store->makeFixedOutputPath(FileIngestionMethod::Recursive, narHash, path.name(), references, hasSelfReference));
-            info.references = std::move(references);
-            if (hasSelfReference) info.references.insert(info.path);
-            info.narHash = narHash;
-            info.narSize = sink.s->size();
-            info.ca = FixedOutputHash {
-                .method = FileIngestionMethod::Recursive,
-                .hash = info.narHash,
-            };
-
-            if (!json)
-                printInfo("rewrote '%s' to '%s'", pathS, store->printStorePath(info.path));
-
-            auto source = sinkToSource([&](Sink & nextSink) {
-                RewritingSink rsink2(oldHashPart, std::string(info.path.hashPart()), nextSink);
-                rsink2((unsigned char *) sink.s->data(), sink.s->size());
-                rsink2.flush();
+                /* Stream the NAR of `path' with the references
+                   rewritten into `sink'. */
+                auto rewrittenNar = [&](Sink & sink) {
+                    RewritingSink rsink(rewrites, sink);
+                    store->narFromPath(path, rsink);
+                    rsink.flush();
+                };
+
+                HashModuloSink hashModuloSink(htSHA256, oldHashPart);
+                uint64_t narSize = 0;
+                LambdaSink hashSink([&](const unsigned char * data, size_t len) {
+                    hashModuloSink(data, len);
+                    narSize += len;
+                });
+                rewrittenNar(hashSink);
+
+                auto narHash = hashModuloSink.finish().first;
+
+                ValidPathInfo info(store->makeFixedOutputPath(FileIngestionMethod::Recursive, narHash, path.name(), references, hasSelfReference));
+                info.references = std::move(references);
+                if (hasSelfReference) info.references.insert(info.path);
+                info.narHash = narHash;
+                info.narSize = narSize;
+                info.ca = FixedOutputHash {
+                    .method = FileIngestionMethod::Recursive,
+                    .hash = info.narHash,
+                };
+
+                if (!json)
+                    printInfo("rewrote '%s' to '%s'", pathS, store->printStorePath(info.path));
+
+                auto source = sinkToSource([&](Sink & nextSink) {
+                    RewritingSink rsink2(oldHashPart, std::string(info.path.hashPart()), nextSink);
+                    rewrittenNar(rsink2);
+                    rsink2.flush();
+                });
+
+                store->addToStore(info, *source);
+
+                remappings_.lock()->insert_or_assign(path, std::move(info.path));
             });
 
-            store->addToStore(info, *source);
-
-            if (json)
-                jsonRewrites->attr(store->printStorePath(path), store->printStorePath(info.path));
-
-            remappings.insert_or_assign(std::move(path), std::move(info.path));
+        if (json) {
+            JSONObject jsonRoot(std::cout);
+            JSONObject jsonRewrites(jsonRoot.object("rewrites"));
+            for (auto & [from, to] : *remappings_.lock())
+                jsonRewrites.attr(store->printStorePath(from), store->printStorePath(to));
         }
     }
 };
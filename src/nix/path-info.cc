@@ -88,9 +88,7 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
 
         if (json) {
             JSONPlaceholder jsonRoot(std::cout);
-            store->pathInfoToJSON(jsonRoot,
-                // FIXME: preserve order?
-                StorePathSet(storePaths.begin(), storePaths.end()),
+            store->pathInfoToJSON(jsonRoot, storePaths,
                 true, showClosureSize, SRI, AllowInvalid);
         }
 
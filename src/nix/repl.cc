@@ -436,11 +436,11 @@ bool NixRepl::processLine(string line)
 
         Pos pos;
 
-        if (v.type == tPath || v.type == tString) {
+        if (v.type() == tPath || v.type() == tString) {
             PathSet context;
             auto filename = state->coerceToString(noPos, v, context);
             pos.file = state->symbols.create(filename);
-        } else if (v.type == tLambda) {
+        } else if (v.type() == tLambda) {
             pos = v.lambda.fun->pos;
         } else {
             // assume it's a derivation
@@ -517,9 +517,7 @@ bool NixRepl::processLine(string line)
         {
             Expr * e = parseString(string(line, p + 1));
             Value & v(*state->allocValue());
-            v.type = tThunk;
-            v.thunk.env = env;
-            v.thunk.expr = e;
+            v.setThunk(env, e);
             addVarToScope(state->symbols.create(name), v);
         } else {
             Value v;
@@ -635,7 +633,7 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
 
     state->forceValue(v);
 
-    switch (v.type) {
+    switch (v.type()) {
 
     case tInt:
         str << ANSI_CYAN << v.integer << ANSI_NORMAL;
@@ -705,7 +703,6 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
     }
 
     case tList1:
-    case tList2:
     case tListN:
         seen.insert(&v);
 
@@ -2,15 +2,13 @@
 #include "globals.hh"
 #include "eval.hh"
 #include "eval-inline.hh"
+#include "eval-cache.hh"
 #include "names.hh"
-#include "get-drvs.hh"
 #include "common-args.hh"
 #include "json.hh"
-#include "json-to-value.hh"
 #include "shared.hh"
 
 #include <regex>
-#include <fstream>
 
 using namespace nix;
 
@@ -29,6 +27,16 @@ std::string hilite(const std::string & s, const std::smatch & m, std::string pos
           + std::string(m.suffix());
 }
 
+/* If the extended regular expression 're' only matches a fixed
+   string, return it. */
+static std::optional<std::string> literalRegex(const std::string & re)
+{
+    for (auto c : re)
+        if (!isalnum((unsigned char) c) && c != '-' && c != '_' && c != ' ')
+            return {};
+    return re;
+}
+
 struct CmdSearch : SourceExprCommand, MixJSON
 {
     std::vector<std::string> res;
@@ -43,13 +51,13 @@ struct CmdSearch : SourceExprCommand, MixJSON
         addFlag({
             .longName = "update-cache",
             .shortName = 'u',
-            .description = "update the package search cache",
+            .description = "discard cached evaluation results",
             .handler = {[&]() { writeCache = true; useCache = false; }}
         });
 
         addFlag({
             .longName = "no-cache",
-            .description = "do not use or update the package search cache",
+            .description = "do not use or update the evaluation cache",
             .handler = {[&]() { writeCache = false; useCache = false; }}
         });
     }
@@ -104,116 +112,110 @@ struct CmdSearch : SourceExprCommand, MixJSON
         auto jsonOut = json ? std::make_unique<JSONObject>(std::cout) : nullptr;
 
         auto sToplevel = state->symbols.create("_toplevel");
-        auto sRecurse = state->symbols.create("recurseForDerivations");
-
-        bool fromCache = false;
+        auto sDescription = state->symbols.create("description");
 
         std::map<std::string, std::string> results;
 
-        std::function<void(Value *, std::string, bool, JSONObject *)> doExpr;
+        auto match = [&](const eval_cache::SearchIndexEntry & package) {
+            std::smatch attrPathMatch;
+            std::smatch descriptionMatch;
+            std::smatch nameMatch;
 
-        doExpr = [&](Value * v, std::string attrPath, bool toplevel, JSONObject * cache) {
-            debug("at attribute '%s'", attrPath);
+            DrvName parsed(package.name);
 
-            try {
-                uint found = 0;
+            uint found = 0;
 
-                state->forceValue(*v);
+            for (auto & regex : regexes) {
+                std::regex_search(package.attrPath, attrPathMatch, regex);
+                std::regex_search(parsed.name, nameMatch, regex);
+                std::regex_search(package.description, descriptionMatch, regex);
 
-                if (v->type == tLambda && toplevel) {
-                    Value * v2 = state->allocValue();
-                    state->autoCallFunction(*state->allocBindings(1), *v, *v2);
-                    v = v2;
-                    state->forceValue(*v);
+                if (!attrPathMatch.empty()
+                    || !nameMatch.empty()
+                    || !descriptionMatch.empty())
+                {
+                    found++;
                 }
+            }
 
-                if (state->isDerivation(*v)) {
+            if (found == res.size()) {
+                if (json) {
 
-                    DrvInfo drv(*state, attrPath, v->attrs);
-                    std::string description;
-                    std::smatch attrPathMatch;
-                    std::smatch descriptionMatch;
-                    std::smatch nameMatch;
-                    std::string name;
+                    auto jsonElem = jsonOut->object(package.attrPath);
 
-                    DrvName parsed(drv.queryName());
+                    jsonElem.attr("pkgName", parsed.name);
+                    jsonElem.attr("version", parsed.version);
+                    jsonElem.attr("description", package.description);
 
-                    for (auto &regex : regexes) {
-                        std::regex_search(attrPath, attrPathMatch, regex);
+                } else {
+                    auto name = hilite(parsed.name, nameMatch, "\e[0;2m")
+                        + std::string(parsed.fullName, parsed.name.length());
+                    results[package.attrPath] = fmt(
+                        "* %s (%s)\n  %s\n",
+                        wrap("\e[0;1m", hilite(package.attrPath, attrPathMatch, "\e[0;1m")),
+                        wrap("\e[0;2m", hilite(name, nameMatch, "\e[0;2m")),
+                        hilite(package.description, descriptionMatch, ANSI_NORMAL));
+                }
+            }
+        };
 
-                        name = parsed.name;
-                        std::regex_search(name, nameMatch, regex);
+        /* The packages found by the traversal below, to be recorded
+           in the evaluation cache so that subsequent searches don't
+           have to walk the attribute tree again. */
+        std::vector<eval_cache::SearchIndexEntry> packages;
 
-                        description = drv.queryMetaString("description");
-                        std::replace(description.begin(), description.end(), '\n', ' ');
-                        std::regex_search(description, descriptionMatch, regex);
+        std::function<void(eval_cache::AttrCursor & cursor, std::string attrPath, bool toplevel)> visit;
 
-                        if (!attrPathMatch.empty()
-                            || !nameMatch.empty()
-                            || !descriptionMatch.empty())
-                        {
-                            found++;
-                        }
-                    }
+        visit = [&](eval_cache::AttrCursor & cursor, std::string attrPath, bool toplevel) {
+            debug("at attribute '%s'", attrPath);
 
-                    if (found == res.size()) {
-                        if (json) {
+            try {
+                if (cursor.isDerivation()) {
 
-                            auto jsonElem = jsonOut->object(attrPath);
+                    std::string description;
 
-                            jsonElem.attr("pkgName", parsed.name);
-                            jsonElem.attr("version", parsed.version);
-                            jsonElem.attr("description", description);
+                    auto name = cursor.getAttr(state->sName)->getString();
 
-                        } else {
-                            auto name = hilite(parsed.name, nameMatch, "\e[0;2m")
-                                + std::string(parsed.fullName, parsed.name.length());
-                            results[attrPath] = fmt(
-                                "* %s (%s)\n  %s\n",
-                                wrap("\e[0;1m", hilite(attrPath, attrPathMatch, "\e[0;1m")),
-                                wrap("\e[0;2m", hilite(name, nameMatch, "\e[0;2m")),
-                                hilite(description, descriptionMatch, ANSI_NORMAL));
-                        }
+                    auto aMeta = cursor.maybeGetAttr(state->sMeta);
+                    auto aDescription = aMeta ? aMeta->maybeGetAttr(sDescription) : nullptr;
+                    try {
+                        description = aDescription ? aDescription->getString() : "";
+                    } catch (TypeError &) {
                     }
+                    std::replace(description.begin(), description.end(), '\n', ' ');
 
-                    if (cache) {
-                        cache->attr("type", "derivation");
-                        cache->attr("name", drv.queryName());
-                        cache->attr("system", drv.querySystem());
-                        if (description != "") {
-                            auto meta(cache->object("meta"));
-                            meta.attr("description", description);
-                        }
-                    }
+                    packages.push_back({attrPath, name, description});
+                    match(packages.back());
                 }
 
-                else if (v->type == tAttrs) {
+                else {
 
                     if (!toplevel) {
-                        auto attrs = v->attrs;
-                        Bindings::iterator j = attrs->find(sRecurse);
-                        if (j == attrs->end() || !state->forceBool(*j->value, *j->pos)) {
+                        auto j = cursor.maybeGetAttr(state->sRecurseForDerivations);
+                        if (!j || !j->getBool()) {
                             debug("skip attribute '%s'", attrPath);
                             return;
                         }
                     }
 
-                    bool toplevel2 = false;
-                    if (!fromCache) {
-                        Bindings::iterator j = v->attrs->find(sToplevel);
-                        toplevel2 = j != v->attrs->end() && state->forceBool(*j->value, *j->pos);
+                    std::vector<Symbol> attrs;
+                    try {
+                        attrs = cursor.getAttrs();
+                    } catch (TypeError &) {
+                        return;
                     }
 
-                    for (auto & i : *v->attrs) {
-                        auto cache2 =
-                            cache ? std::make_unique<JSONObject>(cache->object(i.name)) : nullptr;
-                        doExpr(i.value,
-                            attrPath == "" ? (std::string) i.name : attrPath + "." + (std::string) i.name,
-                            toplevel2 || fromCache, cache2 ? cache2.get() : nullptr);
-                    }
+                    auto j = cursor.maybeGetAttr(sToplevel);
+                    bool toplevel2 = j && j->getBool();
+
+                    for (auto & attr : attrs)
+                        visit(*cursor.getAttr(attr),
+                            attrPath == "" ? (std::string) attr : attrPath + "." + (std::string) attr,
+                            toplevel2);
                 }
 
             } catch (AssertionError & e) {
+            } catch (eval_cache::CachedEvalError & e) {
             } catch (Error & e) {
                 if (!toplevel) {
                     e.addTrace(std::nullopt, "While evaluating the attribute '%s'", attrPath);
@@ -222,47 +224,26 @@ struct CmdSearch : SourceExprCommand, MixJSON
             }
         };
 
-        Path jsonCacheFileName = getCacheDir() + "/nix/package-search.json";
-
-        if (useCache && pathExists(jsonCacheFileName)) {
-
-            warn("using cached results; pass '-u' to update the cache");
-
-            Value vRoot;
-            parseJSON(*state, readFile(jsonCacheFileName), vRoot);
-
-            fromCache = true;
+        if (!writeCache) evalSettings.useEvalCache = false;
 
-            doExpr(&vRoot, "", true, nullptr);
-        }
-
-        else {
-            createDirs(dirOf(jsonCacheFileName));
-
-            Path tmpFile = fmt("%s.tmp.%d", jsonCacheFileName, getpid());
-
-            std::ofstream jsonCacheFile;
+        auto cache = getEvalCache(*state);
 
-            try {
-                // iostream considered harmful
-                jsonCacheFile.exceptions(std::ofstream::failbit);
-                jsonCacheFile.open(tmpFile);
-
-                auto cache = writeCache ? std::make_unique<JSONObject>(jsonCacheFile, false) : nullptr;
+        if (!useCache) cache->clear();
 
-                doExpr(getSourceExpr(*state), "", true, cache.get());
-
-            } catch (std::exception &) {
-                /* Fun fact: catching std::ios::failure does not work
-                   due to C++11 ABI shenanigans.
-                   https://gcc.gnu.org/bugzilla/show_bug.cgi?id=66145 */
-                if (!jsonCacheFile)
-                    throw Error("error writing to %s", tmpFile);
-                throw;
-            }
+        /* Fixed strings let the index skip most packages; the regexes
+           are still checked against whatever it returns. */
+        std::vector<std::string> terms;
+        for (auto & re : res)
+            if (auto s = literalRegex(re))
+                terms.push_back(*s);
 
-            if (writeCache && rename(tmpFile.c_str(), jsonCacheFileName.c_str()) == -1)
-                throw SysError("cannot rename '%s' to '%s'", tmpFile, jsonCacheFileName);
+        if (auto index = cache->getSearchIndex("", terms)) {
+            debug("using search index with %d candidate packages", index->size());
+            for (auto & package : *index)
+                match(package);
+        } else {
+            visit(*cache->getRoot(), "", true);
+            cache->setSearchIndex("", packages);
         }
 
         if (!json && results.size() == 0)
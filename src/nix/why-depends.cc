@@ -3,7 +3,10 @@
 #include "progress-bar.hh"
 #include "fs-accessor.hh"
 #include "shared.hh"
+#include "references.hh"
+#include "thread-pool.hh"
 
+#include <atomic>
 #include <queue>
 
 using namespace nix;
@@ -179,9 +182,40 @@ struct CmdWhyDepends : SourceExprCommand
             }
 
             /* For each reference, find the files and symlinks that
-               contain the reference. */
+               contain the reference. Walking the tree is cheap, so do
+               that first; then read and scan the regular files
+               concurrently. */
             std::map<std::string, Strings> hits;
 
+            auto getColour = [&](const std::string & hash) {
+                return hash == dependencyPathHash ? ANSI_GREEN : ANSI_BLUE;
+            };
+
+            struct File
+            {
+                Path path;
+                bool isSymlink = false;
+                std::vector<std::pair<std::string, std::string>> hits;
+            };
+
+            std::vector<File> files;
+
+            /* Unless we're showing all edges, we only print the first
+               hit of the closest reference, and bail out afterwards.
+               So there is no point in scanning files that come after
+               the first hit in traversal order. */
+            bool firstOnly = !all && packagePath != dependencyPath && !refs.empty();
+            if (firstOnly)
+                hashes = {std::string(refs.begin()->second->path.hashPart())};
+
+            const size_t none = std::numeric_limits<size_t>::max();
+            std::atomic<size_t> firstHit{none};
+
+            auto foundAt = [&](size_t i) {
+                auto cur = firstHit.load();
+                while (i < cur && !firstHit.compare_exchange_weak(cur, i)) ;
+            };
+
             std::function<void(const Path &)> visitPath;
 
             visitPath = [&](const Path & p) {
@@ -189,49 +223,65 @@ struct CmdWhyDepends : SourceExprCommand
 
                 auto p2 = p == pathS ? "/" : std::string(p, pathS.size() + 1);
 
-                auto getColour = [&](const std::string & hash) {
-                    return hash == dependencyPathHash ? ANSI_GREEN : ANSI_BLUE;
-                };
-
                 if (st.type == FSAccessor::Type::tDirectory) {
                     auto names = accessor->readDirectory(p);
                     for (auto & name : names)
                         visitPath(p + "/" + name);
                 }
 
-                else if (st.type == FSAccessor::Type::tRegular) {
-                    auto contents = accessor->readFile(p);
+                else if (st.type == FSAccessor::Type::tRegular)
+                    files.push_back({.path = p});
 
+                else if (st.type == FSAccessor::Type::tSymlink) {
+                    auto target = accessor->readLink(p);
+
+                    File file{.path = p, .isSymlink = true};
                     for (auto & hash : hashes) {
-                        auto pos = contents.find(hash);
-                        if (pos != std::string::npos) {
+                        auto pos = target.find(hash);
+                        if (pos != std::string::npos)
+                            file.hits.emplace_back(hash, fmt("%s -> %s\n", p2,
+                                    hilite(target, pos, StorePath::HashLen, getColour(hash))));
+                    }
+                    if (!file.hits.empty()) foundAt(files.size());
+                    files.push_back(std::move(file));
+                }
+            };
+
+            if (!hashes.empty()) {
+                visitPath(pathS);
+
+                ThreadPool pool;
+
+                for (size_t i = 0; i < files.size(); ++i) {
+                    if (files[i].isSymlink) continue;
+                    pool.enqueue([&, i]() {
+                        if (firstOnly && i > firstHit) return;
+
+                        auto & file = files[i];
+                        auto p2 = file.path == pathS ? "/" : std::string(file.path, pathS.size() + 1);
+                        auto contents = accessor->readFile(file.path);
+
+                        for (auto & [hash, pos] : findReferences(contents, hashes)) {
                             size_t margin = 32;
                             auto pos2 = pos >= margin ? pos - margin : 0;
-                            hits[hash].emplace_back(fmt("%s: …%s…\n",
+                            file.hits.emplace_back(hash, fmt("%s: …%s…\n",
                                     p2,
                                     hilite(filterPrintable(
                                             std::string(contents, pos2, pos - pos2 + hash.size() + margin)),
                                         pos - pos2, StorePath::HashLen,
                                         getColour(hash))));
                         }
-                    }
-                }
-
-                else if (st.type == FSAccessor::Type::tSymlink) {
-                    auto target = accessor->readLink(p);
 
-                    for (auto & hash : hashes) {
-                        auto pos = target.find(hash);
-                        if (pos != std::string::npos)
-                            hits[hash].emplace_back(fmt("%s -> %s\n", p2,
-                                    hilite(target, pos, StorePath::HashLen, getColour(hash))));
-                    }
+                        if (!file.hits.empty()) foundAt(i);
+                    });
                 }
-            };
 
-            // FIXME: should use scanForReferences().
+                pool.process();
 
-            visitPath(pathS);
+                for (auto & file : files)
+                    for (auto & [hash, hit] : file.hits)
+                        hits[hash].push_back(std::move(hit));
+            }
 
             RunPager pager;
             for (auto & ref : refs) {
@@ -86,6 +86,14 @@ nix-build --substituters "file://$cacheDir" --no-require-sigs dependencies.nix -
 mv $cacheDir/nar2 $cacheDir/nar
 
 
+# Concurrent substitutions share the sync before registering them.
+clearStore
+
+nix-build --substituters "file://$cacheDir" --no-require-sigs dependencies.nix -o $TEST_ROOT/result \
+    --option sync-before-registering true -j4
+nix-store --verify-path $(nix-store -qR $TEST_ROOT/result)
+
+
 # Test whether fallback works if a NAR is corrupted. This does require --fallback.
 clearStore
 
@@ -182,3 +190,94 @@ clearCacheCache
 nix-store -r $outPath --substituters "file://$cacheDir2 file://$cacheDir" --trusted-public-keys "$publicKey"
 
 fi # HAVE_LIBSODIUM
+
+
+# Test substituting from multi-block xz NARs, which can be
+# decompressed in parallel.
+unset _NIX_FORCE_HTTP
+clearStore
+clearCache
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix copy --to "file://$cacheDir?parallel-compression=true" $outPath
+HASH=$(nix hash-path $outPath)
+clearStore
+clearCacheCache
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath
+[[ $(nix hash-path $outPath) = $HASH ]]
+
+
+# NARs are staged in the cache and linked into place.
+clearStore
+clearCache
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix copy --to "file://$cacheDir?compression=none" $outPath
+[[ -z $(ls -A $cacheDir/nar | grep -v '\.nar$') ]]
+for nar in $cacheDir/nar/*.nar; do [[ $(stat --format=%h $nar) = 1 ]]; done
+HASH=$(nix hash-path $outPath)
+clearStore
+clearCacheCache
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath
+[[ $(nix hash-path $outPath) = $HASH ]]
+
+
+# Test closure manifests.
+clearStore
+clearCache
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix copy --to "file://$cacheDir?write-closure-manifest=true" $outPath
+grep -q "ClosureManifests: 1" $cacheDir/nix-cache-info
+manifest=$cacheDir/$(basename $outPath | cut -c1-32).closure
+[[ $(grep -c '^StorePath: ' $manifest) = $(nix-store -qR $outPath | wc -l) ]]
+clearStore
+clearCacheCache
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath --dry-run --debug 2>&1 | grep -q "got info about .* paths from"
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath
+[[ $(nix hash-path $outPath) = $HASH ]]
+
+
+# Test presence filters. A path uploaded without updating the filter
+# is not found by clients that use it.
+clearStore
+clearCache
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix copy --to "file://$cacheDir?write-presence-filter=true" $outPath
+grep -q "PresenceFilter: presence-filter" $cacheDir/nix-cache-info
+[[ -s $cacheDir/presence-filter ]]
+echo presence > $TEST_ROOT/presence
+otherPath=$(nix-store --add $TEST_ROOT/presence)
+nix copy --to "file://$cacheDir" $otherPath
+clearCacheCache
+nix path-info --store "file://$cacheDir" $outPath
+(! nix path-info --store "file://$cacheDir" $otherPath)
+nix path-info --store "file://$cacheDir?presence-filter=" $otherPath
+# Rebuilding the filter picks it up.
+echo presence2 > $TEST_ROOT/presence2
+nix copy --to "file://$cacheDir?write-presence-filter=true&presence-filter-refresh=0" $(nix-store --add $TEST_ROOT/presence2)
+clearCacheCache
+nix path-info --store "file://$cacheDir" $otherPath
+
+
+# Test content-defined chunking of NARs.
+clearStore
+clearCache
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix copy --to "file://$cacheDir?nar-chunk-size=4096&compression=none" $outPath
+grep -q "Compression: chunked" $cacheDir/*.narinfo
+[[ -n $(ls $cacheDir/chunks) ]]
+HASH=$(nix hash-path $outPath)
+clearStore
+clearCacheCache
+rm -rf $TEST_ROOT/chunk-cache
+nix-store --substituters "file://$cacheDir?chunk-cache=$TEST_ROOT/chunk-cache" --no-require-sigs -r $outPath
+[[ $(nix hash-path $outPath) = $HASH ]]
+[[ -n $(ls $TEST_ROOT/chunk-cache) ]]
+
+
+# Test resumable copies. The journal is removed once the copy is done.
+clearStore
+clearCache
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix copy --resumable --to file://$cacheDir $outPath
+[[ -z $(ls $TEST_HOME/.cache/nix/copy-journals) ]]
+clearStore
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath
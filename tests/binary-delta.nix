@@ -0,0 +1,17 @@
+with import ./config.nix;
+
+let
+
+  mk = version: mkDerivation {
+    name = "delta-test-${version}";
+    buildCommand = ''
+      mkdir $out
+      for ((i = 0; i < 20000; i++)); do echo "line $i"; done > $out/data
+      echo ${version} > $out/version
+    '';
+  };
+
+in {
+  old = mk "1.0";
+  new = mk "1.1";
+}
@@ -0,0 +1,37 @@
+source common.sh
+
+clearStore
+clearCache
+
+oldPath=$(nix-build binary-delta.nix -A old --no-out-link)
+newPath=$(nix-build binary-delta.nix -A new --no-out-link)
+
+nix copy --to file://$cacheDir $oldPath
+
+if ! nix copy --to "file://$cacheDir?delta-base-store=auto" $newPath 2> $TEST_ROOT/log; then
+    if grep -q "requires zstd support" $TEST_ROOT/log; then
+        echo "zstd not supported; skipping binary delta tests"
+        exit 99
+    fi
+    cat $TEST_ROOT/log
+    exit 1
+fi
+
+newInfo=$cacheDir/$(basename $newPath | cut -c1-32).narinfo
+grep -q "^Delta: $(basename $oldPath) " $newInfo
+ls $cacheDir/delta/*.zst
+
+HASH=$(nix hash-path $newPath)
+
+# Substituting the new version while the old one is present should
+# use the delta.
+nix-store --delete $newPath
+clearCacheCache
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $newPath --debug 2>&1 | grep -q "reconstructed '$newPath'"
+[[ $(nix hash-path $newPath) = $HASH ]]
+
+# Without the old version, the full NAR is downloaded.
+clearStore
+clearCacheCache
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $newPath
+[[ $(nix hash-path $newPath) = $HASH ]]
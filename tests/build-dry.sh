@@ -50,3 +50,21 @@ nix build -f dependencies.nix -o $RESULT --dry-run
 nix build -f dependencies.nix -o $RESULT
 
 [[ -h $RESULT ]]
+
+###################################################
+# Installables that share an attribute path prefix evaluate it only
+# once.
+clearStore
+
+cat > $TEST_ROOT/shared-prefix.nix <<EOF2
+{ }:
+with import $PWD/config.nix;
+{
+  pkgs = builtins.trace "evaluating pkgs" {
+    a = mkDerivation { name = "a"; builder = builtins.toFile "builder.sh" "mkdir \$out"; };
+    b = mkDerivation { name = "b"; builder = builtins.toFile "builder.sh" "mkdir \$out"; };
+  };
+}
+EOF2
+
+[[ $(nix build --option eval-cache false -f $TEST_ROOT/shared-prefix.nix --dry-run pkgs.a pkgs.b pkgs.a 2>&1 | grep -c "evaluating pkgs") = 1 ]]
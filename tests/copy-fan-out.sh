@@ -0,0 +1,19 @@
+source common.sh
+
+clearStore
+
+# Copy one closure to several stores at once. Binary caches can't
+# forward paths, so all copies come from the source.
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+rm -rf $TEST_ROOT/cache1 $TEST_ROOT/cache2 $TEST_ROOT/cache3
+
+nix copy --fan-out 2 --to file://$TEST_ROOT/cache1 --to file://$TEST_ROOT/cache2 --to file://$TEST_ROOT/cache3 $outPath
+
+for i in 1 2 3; do
+    nix path-info --store file://$TEST_ROOT/cache$i -r $outPath > $TEST_ROOT/paths$i
+    nix path-info -r $outPath | diff - $TEST_ROOT/paths$i
+done
+
+# Stores that already have everything are skipped.
+nix copy --to file://$TEST_ROOT/cache1 --to file://$TEST_ROOT/cache2 $outPath --debug 2>&1 | (! grep -q "copying path")
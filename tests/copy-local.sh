@@ -0,0 +1,22 @@
+source common.sh
+
+clearStore
+
+# Copies between local stores on the same file system clone the
+# files instead of going through a NAR.
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+chmod -R u+w $TEST_ROOT/store2 || true
+rm -rf $TEST_ROOT/store2
+
+nix copy --to "$TEST_ROOT/store2?require-sigs=false" -r $outPath --debug 2>&1 | grep -q "cloning '$outPath'"
+
+cmp $TEST_ROOT/store2$outPath/foobar $outPath/foobar
+
+# The copy must hash to what the source database says.
+nix verify --store $TEST_ROOT/store2 -r $outPath --no-trust
+
+# Without signatures the copy is still refused.
+chmod -R u+w $TEST_ROOT/store2
+rm -rf $TEST_ROOT/store2
+(! nix copy --to $TEST_ROOT/store2 $outPath)
@@ -26,6 +26,12 @@ fi
 
 nix-store -q --tree "$outPath" | grep '───.*dependencies-input-2'
 
+# The tree and the graph mention every path in the closure, and only
+# those.
+requisites=$(nix-store -qR "$outPath" | sort)
+[[ $(nix-store -q --tree "$outPath" | grep -o "$NIX_STORE_DIR/[^ ]*" | sort -u) = "$requisites" ]]
+[[ $(nix-store -q --graph "$outPath" | grep -c 'shape = box') = $(echo "$requisites" | wc -l) ]]
+
 echo "output path is $outPath"
 
 text=$(cat "$outPath"/foobar)
@@ -50,3 +56,17 @@ nix-store -q --referrers-closure "$input2OutPath" | grep "$outPath"
 # Check that the derivers are set properly.
 test $(nix-store -q --deriver "$outPath") = "$drvPath"
 nix-store -q --deriver "$input2OutPath" | grep -q -- "-input-2.drv"
+
+# Queries give the same answers on the main database connection.
+[[ $(nix-store -qR $drvPath) = $(NIX_REMOTE="local?max-read-connections=0" nix-store -qR $drvPath) ]]
+[[ $(nix-store -q --referrers-closure "$input2OutPath") = $(NIX_REMOTE="local?max-read-connections=0" nix-store -q --referrers-closure "$input2OutPath") ]]
+
+# The closure size is the sum of the NAR sizes in the closure, also
+# when it's memoised.
+closureSize=$(nix path-info -rs $outPath | awk '{ s += $2 } END { print s }')
+[[ $(nix path-info -S $outPath | awk '{ print $2 }') = $closureSize ]]
+[[ $(nix path-info -S $outPath | awk '{ print $2 }') = $closureSize ]]
+
+# The JSON output of 'nix path-info' lists the paths in the same order
+# as the plain output.
+[[ $(nix path-info --json --all | grep -o '"path":"[^"]*"' | cut -d'"' -f4) = $(nix path-info --all) ]]
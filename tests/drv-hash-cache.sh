@@ -0,0 +1,30 @@
+source common.sh
+
+clearStore
+
+drvPath=$(nix-instantiate dependencies.nix)
+outPath=$(nix-store -q --outputs $drvPath)
+
+# Instantiating again must give the same result, whether the hashes
+# of the input derivations come from the database or not.
+[[ $(nix-instantiate dependencies.nix) = $drvPath ]]
+[[ $(nix-store -q --outputs $drvPath) = $outPath ]]
+
+if [ -n "$(type -p sqlite3)" ]; then
+    db=$NIX_STATE_DIR/db/db.sqlite
+
+    [[ $(sqlite3 $db 'select count(*) from DrvHashes') -gt 0 ]]
+
+    # The recorded hashes are actually used: tampering with them
+    # changes the output paths of dependent derivations.
+    sqlite3 $db "update DrvHashes set hash = 'sha256:$(printf '0%.0s' {1..64})'"
+    [[ $(nix-instantiate dependencies.nix) != $drvPath ]]
+
+    # Without them, the hashes are recomputed from the store.
+    sqlite3 $db 'delete from DrvHashes'
+    [[ $(nix-instantiate dependencies.nix) = $drvPath ]]
+
+    # Garbage-collecting the derivations removes their recorded hashes.
+    nix-collect-garbage
+    [[ $(sqlite3 $db 'select count(*) from DrvHashes') -eq 0 ]]
+fi
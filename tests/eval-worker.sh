@@ -0,0 +1,27 @@
+source common.sh
+
+clearStore
+
+cat > $TEST_ROOT/jobs.nix <<EOF2
+with import $(pwd)/config.nix;
+{
+  a = mkDerivation { name = "worker-a"; buildCommand = "mkdir \$out"; };
+  b.c = mkDerivation { name = "worker-c"; buildCommand = "mkdir \$out"; };
+  d = throw "no d";
+}
+EOF2
+
+drvA=$(nix-instantiate $TEST_ROOT/jobs.nix -A a)
+drvC=$(nix-instantiate $TEST_ROOT/jobs.nix -A b.c)
+
+# Each attribute path gives one line of output, in order; evaluation
+# errors are reported but don't stop the worker.
+printf 'a\nd\nb.c\n' | nix-instantiate --worker $TEST_ROOT/jobs.nix > $TEST_ROOT/worker.out
+[[ $(wc -l < $TEST_ROOT/worker.out) = 3 ]]
+[[ $(sed -n 1p $TEST_ROOT/worker.out) = "{\"attr\":\"a\",\"drvPaths\":[\"$drvA\"]}" ]]
+sed -n 2p $TEST_ROOT/worker.out | grep -q '"error":".*no d'
+[[ $(sed -n 3p $TEST_ROOT/worker.out) = "{\"attr\":\"b.c\",\"drvPaths\":[\"$drvC\"]}" ]]
+
+# Restarting after every job doesn't lose or reorder any input.
+printf 'a\nd\nb.c\n' | nix-instantiate --worker --max-eval-worker-heap-size 0 $TEST_ROOT/jobs.nix > $TEST_ROOT/worker2.out
+diff $TEST_ROOT/worker.out $TEST_ROOT/worker2.out
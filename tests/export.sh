@@ -34,3 +34,17 @@ clearStore
 # Regression test: the derivers in exp_all2 are empty, which shouldn't
 # cause a failure.
 nix-store --import < $TEST_ROOT/exp_all2
+
+
+clearStore
+
+# Registering the closure in batches of one path must work as well.
+nix-store --import --option import-batch-size 1 < $TEST_ROOT/exp_all
+nix-store --verify-path $(nix-store -qR $outPath)
+
+
+clearStore
+
+# Likewise when syncing the store before registering each batch.
+nix-store --import --option sync-before-registering true < $TEST_ROOT/exp_all
+nix-store --verify-path $(nix-store -qR $outPath)
@@ -0,0 +1,23 @@
+source common.sh
+
+clearStore
+
+drvPath=$(nix-instantiate -E 'with import ./config.nix; mkDerivation { name = "fails"; builder = builtins.toFile "builder.sh" "exit 1"; }')
+
+# Failures aren't recorded by default.
+(! nix-store -r $drvPath)
+[[ -z $(nix-store --query-failed-paths) ]]
+
+# With cache-failures, the second build fails without running the builder.
+(! nix-store -r $drvPath --option cache-failures true)
+[[ $(nix-store --query-failed-paths) = $drvPath ]]
+(! nix-store -r $drvPath --option cache-failures true 2> $TEST_ROOT/log)
+grep -q "failed previously" $TEST_ROOT/log
+
+nix-store --clear-failed-paths $drvPath
+[[ -z $(nix-store --query-failed-paths) ]]
+(! nix-store -r $drvPath --option cache-failures true 2> $TEST_ROOT/log)
+(! grep -q "failed previously" $TEST_ROOT/log)
+
+nix-store --clear-failed-paths '*'
+[[ -z $(nix-store --query-failed-paths) ]]
@@ -135,6 +135,14 @@ path4=$(nix eval --raw "(builtins.fetchGit $repo).outPath")
 path5=$(nix eval --raw "(builtins.fetchGit { url = $repo; ref = \"dev\"; }).outPath")
 [[ $path3 = $path5 ]]
 
+# A commit with the same tree gives the same store path, but its own
+# revCount.
+revCount5=$(nix eval "(builtins.fetchGit { url = $repo; ref = \"dev\"; }).revCount")
+git -C $repo commit --allow-empty -m 'Bla6'
+rev6=$(git -C $repo rev-parse HEAD)
+[[ $(nix eval --raw "(builtins.fetchGit { url = $repo; rev = \"$rev6\"; }).outPath") = $path3 ]]
+[[ $(nix eval "(builtins.fetchGit { url = $repo; rev = \"$rev6\"; }).revCount") = $((revCount5 + 1)) ]]
+
 
 # Nuke the cache
 rm -rf $TEST_HOME/.cache/nix
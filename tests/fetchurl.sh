@@ -76,3 +76,25 @@ outPath=$(nix-build '<nix/fetchurl.nix>' --argstr url file://$narxz --argstr sha
 
 test -x $outPath/fetchurl.sh
 test -L $outPath/symlink
+
+# The same, without a builder process.
+clearStore
+
+outPath=$(nix-build '<nix/fetchurl.nix>' --argstr url file://$narxz --argstr sha256 $hash \
+          --arg unpack true --argstr name xyzzy --no-out-link --builtin-fetchurl-in-process)
+
+test -x $outPath/fetchurl.sh
+test -L $outPath/symlink
+
+hash=$(nix hash-file --type sha512 --base64 ./fetchurl.sh)
+
+outPath=$(nix-build '<nix/fetchurl.nix>' --argstr url file:///no-such-dir/fetchurl.sh --argstr sha512 $hash --no-out-link \
+          --hashed-mirrors "file:///no-such-mirror file://$mirror" --builtin-fetchurl-in-process)
+
+cmp $outPath fetchurl.sh
+
+# A failing download fails the build with its error.
+clearStore
+
+(! nix-build '<nix/fetchurl.nix>' --argstr url file:///no-such-dir/fetchurl.sh --argstr sha512 $hash --no-out-link \
+   --hashed-mirrors '' --builtin-fetchurl-in-process 2>&1) | grep -q 'no-such-dir'
@@ -83,3 +83,15 @@ function-trace exited (string):1:1 at
 "
 
 set -e
+
+# Aggregated profiles
+nix-instantiate --eval --option eval-profiler chrome-trace --option eval-profile-file $TEST_ROOT/profile.json \
+    --expr 'let f = x: builtins.length x; in f [ 1 2 ] + f [ 3 ]'
+grep -q '"name":"f at (string):1:9".*"calls":2' $TEST_ROOT/profile.json
+grep -q '"name":"primop length"' $TEST_ROOT/profile.json
+
+nix-instantiate --eval --option eval-profiler flamegraph --option eval-profile-file $TEST_ROOT/profile.txt \
+    --expr 'let f = x: builtins.length x; in f [ 1 2 ]'
+(! grep -v '^[^;]*\(;[^;]*\)* [0-9]*$' $TEST_ROOT/profile.txt)
+
+(! nix-instantiate --eval --option eval-profiler bogus --expr 1)
@@ -77,3 +77,39 @@ wait "$pid2"
 
 [[ foo = $(cat $TEST_ROOT/result-A/bar) ]]
 [[ foo = $(cat $TEST_ROOT/result-B/bar) ]]
+
+# The auto-GC anticipates the space that pending builds will need,
+# judging from the size of previous outputs of the same derivation.
+clearStore
+
+echo 1000000000 > $fake_free
+
+nix build -o $TEST_ROOT/result-C -L --min-free 1000 --max-free 2000 --min-free-check-interval 1 "(
+with import ./config.nix; mkDerivation {
+  name = \"gc-C\";
+  buildCommand = \"head -c 100000 /dev/zero > \$out\";
+})"
+
+garbage1=$(nix add-to-store --name garbage1 ./nar-access.sh)
+garbage2=$(nix add-to-store --name garbage2 ./nar-access.sh)
+garbage3=$(nix add-to-store --name garbage3 ./nar-access.sh)
+
+# There is enough free space for the build itself, but not for its
+# expected output, so the GC has to run while it is going on.
+echo 50000 > $fake_free
+
+nix build -o $TEST_ROOT/result-C -L --min-free 1000 --max-free 60000 --min-free-check-interval 1 "(
+with import ./config.nix; mkDerivation {
+  name = \"gc-C\";
+  version = 2;
+  buildCommand = ''
+    for i in {1..20}; do
+        if [[ \$(ls \$NIX_STORE/*-garbage? 2> /dev/null | wc -l) -lt 3 ]]; then
+            head -c 100000 /dev/zero > \$out
+            exit 0
+        fi
+        sleep 1
+    done
+    exit 1
+  '';
+})"
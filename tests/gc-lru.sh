@@ -0,0 +1,23 @@
+source common.sh
+
+clearStore
+
+garbage1=$(nix add-to-store --name garbage1 ./nar-access.sh)
+sleep 1
+garbage2=$(nix add-to-store --name garbage2 ./nar-access.sh)
+sleep 1
+
+# Using garbage1 makes garbage2 the least recently used path.
+nix-store -r $garbage1
+
+nix-store --gc --gc-lru --max-freed 1
+test -e $garbage1
+(! test -e $garbage2)
+
+# Without a use, the oldest registered path goes first.
+sleep 1
+garbage3=$(nix add-to-store --name garbage3 ./nar-access.sh)
+
+nix-store --gc --gc-lru --max-freed 1
+test -e $garbage3
+(! test -e $garbage1)
@@ -16,6 +16,11 @@ if nix-store --gc --print-dead | grep $outPath; then false; fi
 
 nix-store --gc --print-dead
 
+# Dependencies of a root are live, as are derivers with keep-derivations.
+nix-store --gc --print-live | grep $(readLink $outPath/input-2)
+nix-store --gc --print-live --keep-derivations --keep-outputs | grep $drvPath
+if nix-store --gc --print-live --no-keep-derivations | grep $drvPath; then false; fi
+
 inUse=$(readLink $outPath/input-2)
 if nix-store --delete $inUse; then false; fi
 test -e $inUse
@@ -38,3 +43,22 @@ nix-collect-garbage
 
 # Check that the output has been GC'd.
 if test -e $outPath/foobar; then false; fi
+
+# Test deleting garbage in batches.
+outPath=$(nix-store -rvv "$drvPath")
+ln -sf $outPath "$NIX_STATE_DIR"/gcroots/foo
+
+nix-collect-garbage --gc-batch-size 1
+
+cat $outPath/foobar
+cat $outPath/input-2/bar
+if test -e $drvPath; then false; fi
+
+rm "$NIX_STATE_DIR"/gcroots/foo
+
+nix-collect-garbage --gc-batch-size 2 --gc-delete-threads 4 | grep -q 'store paths deleted'
+if test -e $outPath/foobar; then false; fi
+(! test -e $NIX_STORE_DIR/trash)
+
+# Test running the collector at maintenance priority.
+nix-collect-garbage --option maintenance-niceness 5 --option maintenance-io-class idle --option maintenance-io-max 100000000
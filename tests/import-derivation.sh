@@ -10,3 +10,16 @@ fi
 outPath=$(nix-build ./import-derivation.nix --no-out-link)
 
 [ "$(cat $outPath)" = FOO579 ]
+
+# With batch-import-from-derivation, the derivations imported by
+# sibling values are built together.
+clearStore
+
+[[ $(nix-build ./import-derivation.nix --no-out-link --option batch-import-from-derivation true) = $outPath ]]
+
+[[ $(nix-instantiate --eval --strict --option batch-import-from-derivation true -j3 -E '
+  with import ./config.nix;
+  map (n: import (mkDerivation {
+    name = "import-${toString n}";
+    builder = builtins.toFile "builder.sh" "echo ${toString n} > $out";
+  })) [ 1 2 3 ]') = "[ 1 2 3 ]" ]]
@@ -53,6 +53,23 @@ for i in lang/eval-okay-*.nix; do
             echo "FAIL: evaluation result of $i not as expected"
             fail=1
         fi
+
+        # The previous run has populated the parse cache.
+        if ! NIX_PATH=lang/dir3:lang/dir4 nix-instantiate $flags --eval --strict lang/$i.nix > lang/$i.out; then
+            echo "FAIL: $i should evaluate from the parse cache"
+            fail=1
+        elif ! diff lang/$i.out lang/$i.exp; then
+            echo "FAIL: evaluation result of $i from the parse cache not as expected"
+            fail=1
+        fi
+
+        if ! NIX_PATH=lang/dir3:lang/dir4 nix-instantiate $flags --option compile-expressions true --eval --strict lang/$i.nix > lang/$i.out; then
+            echo "FAIL: $i should evaluate with compile-expressions"
+            fail=1
+        elif ! diff lang/$i.out lang/$i.exp; then
+            echo "FAIL: compiled evaluation result of $i not as expected"
+            fail=1
+        fi
     fi
 
     if test -e lang/$i.exp.xml; then
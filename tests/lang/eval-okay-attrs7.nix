@@ -0,0 +1,9 @@
+# Large sets are looked up through a hash index.
+let
+  names = map (n: "a${toString n}") (builtins.genList (x: x) 200);
+  set = builtins.listToAttrs (map (name: { inherit name; value = name; }) names);
+  set2 = set // { a0 = "b0"; a200 = "b200"; };
+in
+  [ set.a0 set.a137 set.a199 (set ? a200) (set.a250 or "missing")
+    set2.a0 set2.a100 set2.a200 (builtins.length (builtins.attrNames set2))
+  ]
@@ -0,0 +1,6 @@
+# Keys that compare equal are only visited once, even if they are of
+# different numeric types.
+builtins.length (builtins.genericClosure {
+  startSet = [ { key = 1; } { key = 1.0; } { key = 2.0; } ];
+  operator = { key }: if key < 4 then [ { key = key + 1; } { key = key + 1.0; } ] else [];
+})
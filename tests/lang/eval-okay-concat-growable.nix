@@ -0,0 +1,11 @@
+let
+  xs = builtins.foldl' (acc: x: acc ++ [ x ]) [ ] (builtins.genList (x: x) 100);
+
+  # Only the longest list sharing a buffer may be extended in place.
+  a = [ 1 2 ] ++ [ 3 ];
+  b = a ++ [ 4 ];
+  c = a ++ [ 5 ];
+  d = b ++ c;
+in
+  [ (builtins.length xs) (builtins.elemAt xs 99) (builtins.foldl' builtins.add 0 xs)
+    a b c d (a ++ a) (builtins.concatLists [ [ ] a [ ] c ]) ]
@@ -0,0 +1,12 @@
+# Constant sets and lists are shared between evaluations.
+let
+  f = x: { type = "option"; meta = { }; outputs = [ "out" ]; nested.a = [ 1 2.5 ]; };
+  g = x: [ [ "a" ] { b = "c"; } [ ] ];
+  a = f 1;
+  b = f 2;
+in [
+  (a == b)
+  (a // { x = 1; })
+  a
+  (map g [ 1 2 ])
+]
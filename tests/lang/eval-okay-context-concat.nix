@@ -0,0 +1,19 @@
+let
+  drv = derivation {
+    name = "fail";
+    builder = "/bin/false";
+    system = "x86_64-linux";
+    outputs = [ "out" "foo" ];
+  };
+
+  # The context of the accumulator is carried along unchanged.
+  s1 = builtins.foldl' (acc: x: acc + x) drv.outPath [ "a" "b" "c" ];
+
+  # Different contexts are merged.
+  s2 = builtins.foldl' (acc: x: acc + x) "" [ "a" drv.outPath "b" drv.foo.outPath drv.outPath ];
+
+in [
+  (builtins.getContext s1 == builtins.getContext drv.outPath)
+  (builtins.getContext s2 == builtins.getContext "${drv.outPath}${drv.foo.outPath}")
+  (builtins.unsafeDiscardStringContext s1 == builtins.unsafeDiscardStringContext drv.outPath + "abc")
+]
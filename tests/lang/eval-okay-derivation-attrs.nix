@@ -0,0 +1,20 @@
+let
+  drvAttrs = {
+    name = "a";
+    system = "x";
+    builder = "y";
+    outputs = [ "out" "dev" "out" ];
+    type = "not-overridden";
+  };
+  drv = derivation drvAttrs;
+in
+  { names = builtins.attrNames drv;
+    outputName = drv.outputName;
+    devOutputName = drv.dev.outputName;
+    devDevOutputName = drv.dev.dev.outputName;
+    all = map (x: x.outputName) drv.all;
+    type = drv.dev.type;
+    drvAttrs = drv.drvAttrs == drvAttrs;
+    name = drv.dev.name;
+    isFunction = builtins.isFunction derivation;
+  }
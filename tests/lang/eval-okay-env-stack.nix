@@ -0,0 +1,10 @@
+# Functions whose environment cannot escape the call.
+let
+  inc = n: n + 1;
+  isPos = { n, d ? 0 }: n > d;
+  check = n: if n < 0 then throw "negative" else n;
+in {
+  a = builtins.foldl' (acc: x: acc + inc x) 0 (builtins.genList (x: x) 1000);
+  b = map (n: (builtins.tryEval (check n)).success) [ 1 (-1) 2 ];
+  c = isPos { n = 3; } && !(isPos { n = 3; d = 4; });
+}
@@ -0,0 +1,23 @@
+builtins.fromTOML ''
+  # Dotted keys, which the previous parser did not support.
+  a.b.c = 1
+  a.d = 2
+  "quoted"."dotted key" = true
+
+  ml = """
+  Roses are red
+  Violets are "blue" \
+      and so on"""
+  lit = 'C:\Users\nix'
+  esc = "tab\there, \u00e9 and \U0001F600"
+  neg = -9_223_372_036_854_775_808
+  big = 0x7fff_ffff_ffff_ffff
+  inline = { x.y = 1, z = [ { w = "v" } ] }
+  empty = []
+
+  [t.u]
+  v = 1
+
+  [t]
+  w = 2
+''
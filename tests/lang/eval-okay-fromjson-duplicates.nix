@@ -0,0 +1 @@
+builtins.fromJSON ''{ "b": [ { "x": 1, "y": 2, "x": 3 } ], "a": 1, "c": {}, "a": 2 }''
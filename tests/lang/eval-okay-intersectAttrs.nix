@@ -0,0 +1,10 @@
+let
+  big = builtins.listToAttrs (map (n: { name = "a${toString n}"; value = n; }) (builtins.genList (x: x) 100));
+  small = { a3 = "x"; a50 = "y"; b = "z"; a99 = "w"; };
+in [
+  (builtins.attrValues (builtins.intersectAttrs small big))
+  (builtins.attrValues (builtins.intersectAttrs big small))
+  (builtins.intersectAttrs { } big)
+  (builtins.attrNames (removeAttrs big (builtins.genList (x: "a${toString (x + 1)}") 98 ++ [ "a5" "c" ])))
+  (builtins.listToAttrs [ { name = "b"; value = 1; } { name = "a"; value = 2; } { name = "b"; value = 3; } ])
+]
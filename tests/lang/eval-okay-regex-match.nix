@@ -23,6 +23,9 @@ assert !matches "[[:space:]]+([[:upper:]]+)[[:space:]]+" "  foo   ";
 assert match "(.*)\\.nix" "foobar.nix" == [ "foobar" ];
 assert match "[[:space:]]+([[:upper:]]+)[[:space:]]+" "  FOO   " == [ "FOO" ];
 
+assert match "foo\\.nix" "foo.nix" == [ ];
+assert match "foo" "foobar" == null;
+
 assert splitFN "/path/to/foobar.nix" == [ "/path/to/" "/path/to" "foobar" "nix" ];
 assert splitFN "foobar.cc" == [ null null "foobar" "cc" ];
 
@@ -39,6 +39,13 @@ assert  split "[[:space:]]+|([',.!?])" ''
   ""
 ];
 
+# Patterns without special characters, which are matched as plain
+# strings.
+assert  split "/" "/a/b//c/"     == [ "" [ ] "a" [ ] "b" [ ] "" [ ] "c" [ ] "" ];
+assert  split "ab" "ababa"       == [ "" [ ] "" [ ] "a" ];
+assert  split "\\." "1.2.3"      == [ "1" [ ] "2" [ ] "3" ];
+assert  split "xyz" "abc"        == [ "abc" ];
+
 # Documentation examples
 assert  split  "(a)b" "abc"      == [ "" [ "a" ] "c" ];
 assert  split  "([ac])" "abc"    == [ "" [ "a" ] "b" [ "c" ] "" ];
@@ -0,0 +1,11 @@
+# The same selection sites see sets of different shapes.
+let
+  sets = [ { a = 1; b = 2; } { b = 3; } { a = 4; c = 5; } { x = 0; a = 6; } { } ];
+  get = s: s.a or null;
+  has = s: s ? b;
+  deep = s: s.p.q or "none";
+in {
+  a = map get sets;
+  b = map has sets;
+  c = map deep [ { p.q = 1; } { p = { a = 1; q = 2; }; } { p = { }; } { } ];
+}
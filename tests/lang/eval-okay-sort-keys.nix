@@ -0,0 +1,15 @@
+with builtins;
+
+let
+  xs = [ { a.b = 3; n = "x"; } { a.b = 1; n = "y"; } { a.b = 3; n = "z"; } { a.b = 2; n = "w"; } ];
+  names = map (x: x.n);
+in
+
+[ (names (sort (x: y: x.a.b < y.a.b) xs))
+  (names (sort (x: y: y.a.b < x.a.b) xs))
+  (names (sort (x: y: x.a.b > y.a.b) xs))
+  (let __lessThan = x: y: builtins.lessThan y x; in sort (x: y: x < y) [ 1 3 2 ])
+  (names (sortOn (x: x.a.b) xs))
+  (sortOn (x: -x) [ 1 3 2 ])
+  (sortOn (x: x) [ ])
+]
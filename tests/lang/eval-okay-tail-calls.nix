@@ -0,0 +1,6 @@
+let
+  loop = n: acc:
+    if n == 0 then acc
+    else if acc < 0 then throw "unreachable"
+    else let n' = n - 1; in loop n' (acc + n);
+in loop 1000000 0
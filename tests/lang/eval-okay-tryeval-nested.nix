@@ -0,0 +1,11 @@
+let
+  f = x: { a = assert x > 1; x; b.c = throw "b"; };
+  failing = (f 1).a;
+in {
+  select = builtins.tryEval (f 1).b.c;
+  call = builtins.tryEval (builtins.addErrorContext "context" failing);
+  again = builtins.tryEval failing;
+  nested = builtins.tryEval (builtins.tryEval (throw "x")).value;
+  inner = builtins.tryEval ((builtins.tryEval (throw "x")).success || throw "y");
+  ok = builtins.tryEval (f 2).a;
+}
@@ -0,0 +1,14 @@
+let
+  # The same variable occurrence is resolved against different sets,
+  # so that it is found in different "with"s and at different
+  # positions.
+  f = inner: outer: with outer; with inner; x;
+in
+  [ (f { x = 1; } { x = 2; })
+    (f { a = 0; b = 0; x = 3; } { })
+    (f { } { x = 4; })
+    (f { y = 0; } { a = 0; x = 5; })
+    (f { y = 0; } { a = 0; x = 5; })
+    (f { x = 6; } { })
+    (builtins.foldl' (acc: s: acc + f s { x = 1; }) 0 [ {} { x = 10; } {} { z = 0; x = 100; } ])
+  ]
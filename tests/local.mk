@@ -4,6 +4,7 @@ nix_tests = \
   gc.sh \
   gc-concurrent.sh \
   gc-auto.sh \
+  gc-lru.sh \
   referrers.sh user-envs.sh logging.sh nix-build.sh misc.sh fixed.sh \
   gc-runtime.sh check-refs.sh filter-source.sh \
   remote-store.sh export.sh export-graph.sh \
@@ -24,6 +25,8 @@ nix_tests = \
   signing.sh \
   shell.sh \
   brotli.sh \
+  zstd.sh \
+  binary-delta.sh \
   pure-eval.sh \
   check.sh \
   plugins.sh \
@@ -31,7 +34,14 @@ nix_tests = \
   nix-copy-ssh.sh \
   post-hook.sh \
   function-trace.sh \
-  recursive.sh
+  source-cache.sh \
+  drv-hash-cache.sh \
+  eval-worker.sh \
+  recursive.sh \
+  make-content-addressable.sh \
+  copy-local.sh \
+  copy-fan-out.sh \
+  failed-builds.sh
   # parallel.sh
 
 install-tests += $(foreach x, $(nix_tests), tests/$(x))
@@ -13,3 +13,13 @@ rm -rf $NIX_LOG_DIR
 (! nix-store -l $path)
 nix-build dependencies.nix --no-out-link --compress-build-log
 [ "$(nix-store -l $path)" = FOO ]
+
+# Test the activity trace.
+clearStore
+nix build -f dependencies.nix --no-link --activity-trace-file $TEST_ROOT/trace.json
+grep -q '"cat":"build"' $TEST_ROOT/trace.json
+
+# Test the binary log format.
+clearStore
+nix build -f dependencies.nix --no-link --log-format internal-binary 2> $TEST_ROOT/log.bin
+nix --log-format internal-json decode-log < $TEST_ROOT/log.bin 2>&1 | grep -q '"action":"start"'
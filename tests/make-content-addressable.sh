@@ -0,0 +1,26 @@
+source common.sh
+
+clearStore
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+closure=$(nix-store -qR $outPath)
+
+nix make-content-addressable -r $outPath 2> $TEST_ROOT/rewrites
+
+# Every path in the closure is rewritten, in dependency order.
+[[ $(grep -c "^rewrote " $TEST_ROOT/rewrites) = $(echo "$closure" | wc -l) ]]
+
+newOutPath=$(sed -n "s|^rewrote '$outPath' to '\(.*\)'\$|\1|p" $TEST_ROOT/rewrites)
+[[ -n $newOutPath ]]
+nix-store --verify-path $newOutPath
+nix path-info --sigs $newOutPath | grep -q 'ca:fixed:r:sha256:'
+
+# The new closure doesn't refer to any of the old paths.
+newClosure=$(nix-store -qR $newOutPath)
+for p in $closure; do
+    if echo "$newClosure" | grep -q "$p"; then exit 1; fi
+done
+
+# The result doesn't depend on the order in which paths were processed.
+nix make-content-addressable -r $outPath 2> $TEST_ROOT/rewrites2
+[[ $(sed -n "s|^rewrote '$outPath' to '\(.*\)'\$|\1|p" $TEST_ROOT/rewrites2) = $newOutPath ]]
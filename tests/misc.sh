@@ -24,3 +24,16 @@ eval_stdin_res=$(echo 'let a = {} // a; in a.foo' | nix-instantiate --eval -E -
 echo $eval_stdin_res | grep "at: (1:15) from stdin"
 echo $eval_stdin_res | grep "infinite recursion encountered"
 
+
+# Evaluating attributes in parallel gives the same output in the same order.
+expr='{ a = 1; b = { c = 2; }; d = builtins.abort "d"; }'
+[[ $(nix-instantiate --eval --eval-workers 4 -E "$expr" -A b.c -A a -A b.c) = $(printf '2\n1\n2') ]]
+[[ $(nix-instantiate --eval --eval-workers 2 -E "$expr" -A a -A d 2>/dev/null || true) = 1 ]]
+(! nix-instantiate --eval --eval-workers 2 -E "$expr" -A a -A d)
+
+# Commands that don't evaluate anything don't initialise the garbage
+# collector.
+startup=$(NIX_SHOW_STARTUP=1 nix to-base32 --type sha256 "$(nix-hash --type sha256 --flat ./misc.sh)" 2>&1 >/dev/null)
+echo "$startup" | grep -q "startup: plugins"
+(! echo "$startup" | grep -q "startup: initGC")
+NIX_SHOW_STARTUP=1 nix eval 1 2>&1 >/dev/null | grep -q "startup: initGC"
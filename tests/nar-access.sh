@@ -37,6 +37,28 @@ diff -u baz.cat-nar $storePath/foo/baz
 nix ls-store --json -R $storePath/xyzzy 2>&1 | grep 'does not exist in NAR'
 nix ls-store $storePath/xyzzy 2>&1 | grep 'does not exist'
 
+# Test reading parts of an uncompressed NAR using its listing.
+narCache="$TEST_ROOT/nar-cache"
+rm -rf "$narCache"
+nix copy --to "file://$narCache?compression=none&write-nar-listing=true" $storePath
+nix cat-store --store "file://$narCache" --debug $storePath/foo/data 2> cat-store.log > data.cat-store
+diff -u data.cat-store $storePath/foo/data
+grep -q 'using NAR listing' cat-store.log
+[[ $(nix ls-store --store "file://$narCache" --json -R $storePath/foo/bar) = '{"type":"regular","size":0,"narOffset":368}' ]]
+
+# The listing and the parts of the NAR that were read can be kept in a
+# local cache, after which the NAR itself is no longer needed.
+localNarCache="$TEST_ROOT/local-nar-cache"
+rm -rf "$localNarCache"
+nix cat-store --store "file://$narCache?local-nar-cache=$localNarCache" $storePath/foo/data > data.cat-store
+diff -u data.cat-store $storePath/foo/data
+[[ -e $localNarCache/$(basename $storePath | cut -c1-32).ls ]]
+[[ -n $(ls $localNarCache/segments) ]]
+mv $narCache/nar $narCache/nar.old
+nix cat-store --store "file://$narCache?local-nar-cache=$localNarCache" $storePath/foo/data > data.cat-store
+diff -u data.cat-store $storePath/foo/data
+mv $narCache/nar.old $narCache/nar
+
 # Test failure to dump.
 if nix-store --dump $storePath >/dev/full ; then
     echo "dumping to /dev/full should fail"
@@ -62,3 +62,11 @@ nix develop -f shell.nix shellDrv -c bash -c '[[ -n $stdenv ]]'
 # Test 'nix print-dev-env'.
 source <(nix print-dev-env -f shell.nix shellDrv)
 [[ -n $stdenv ]]
+
+# The environment is cached: a second run gives the same result, and
+# so does a run after the cache has been corrupted.
+[[ -n $(find $TEST_HOME/.cache/nix/dev-env-v1 -name '*.env') ]]
+[[ $(nix print-dev-env -f shell.nix shellDrv) = $(nix print-dev-env -f shell.nix shellDrv) ]]
+env1=$(nix print-dev-env -f shell.nix shellDrv)
+for i in $TEST_HOME/.cache/nix/dev-env-v1/*; do echo garbage > $i; done
+[[ $(nix print-dev-env -f shell.nix shellDrv) = $env1 ]]
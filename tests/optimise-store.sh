@@ -35,9 +35,70 @@ if [ "$inode1" != "$inode3" ]; then
     exit 1
 fi
 
+# Optimising again only looks at paths that are new since the last run.
+outPath4=$(echo 'with import ./config.nix; mkDerivation { name = "foo4"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo"; }' | nix-build - --no-out-link)
+
+nix-store --optimise 2>&1 | grep 'hard-linking 1 files'
+
+inode4="$(stat --format=%i $outPath4/foo)"
+if [ "$inode1" != "$inode4" ]; then
+    echo "inodes do not match"
+    exit 1
+fi
+
+nix-store --optimise 2>&1 | grep 'hard-linking 0 files'
+
+# With reflinks, files keep their own inode if the file system supports
+# sharing extents, and are hard-linked otherwise.
+outPath5=$(echo 'with import ./config.nix; mkDerivation { name = "foo5"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo"; }' | nix-build - --no-out-link)
+nix-store --optimise --optimise-method reflink
+[ "$(cat $outPath5/foo)" = hello ]
+nix-store --verify --check-contents
+(! nix-store --optimise --optimise-method bogus)
+
 nix-store --gc
 
 if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then
     echo ".links directory not empty after GC"
     exit 1
 fi
+
+# The first GC scanned all of .links; later ones only check the links
+# of the files they deleted.
+test -e "$NIX_STATE_DIR"/gc-link-candidates
+
+outPath1=$(echo 'with import ./config.nix; mkDerivation { name = "foo1"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo"; }' | nix-build - --no-out-link --auto-optimise-store)
+outPath2=$(echo 'with import ./config.nix; mkDerivation { name = "foo2"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo"; }' | nix-build - --no-out-link --auto-optimise-store)
+[ -n "$(ls $NIX_STORE_DIR/.links)" ]
+
+nix-store --gc
+
+if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then
+    echo ".links directory not empty after incremental GC"
+    exit 1
+fi
+[ ! -s "$NIX_STATE_DIR"/gc-link-candidates ]
+
+# Links left unused by anything other than the collector are found by
+# the periodic full scan.
+outPath1=$(echo 'with import ./config.nix; mkDerivation { name = "foo3"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo"; }' | nix-build - --no-out-link --auto-optimise-store)
+chmod u+w $outPath1
+rm $outPath1/foo
+nix-store --gc
+[ -n "$(ls $NIX_STORE_DIR/.links)" ]
+echo 0 > "$NIX_STATE_DIR"/gc-links-scanned
+nix-store --gc
+if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then
+    echo ".links directory not empty after full scan"
+    exit 1
+fi
+
+# With a queue, added paths are deduplicated in the background, at the
+# latest before the process exits.
+mkdir -p $TEST_ROOT/queued1 $TEST_ROOT/queued2
+echo queued > $TEST_ROOT/queued1/foo
+echo queued > $TEST_ROOT/queued2/foo
+queued1=$(nix-store --add $TEST_ROOT/queued1 --auto-optimise-store --auto-optimise-queue-size 10)
+queued2=$(nix-store --add $TEST_ROOT/queued2 --auto-optimise-store --auto-optimise-queue-size 10)
+[ "$(stat --format=%i $queued1/foo)" = "$(stat --format=%i $queued2/foo)" ]
+nix-store --verify --check-contents
@@ -15,3 +15,17 @@ clearStore
 # closure of what we've just built
 nix copy --from "$REMOTE_STORE" --no-require-sigs -f dependencies.nix
 nix copy --from "$REMOTE_STORE" --no-require-sigs -f dependencies.nix input1_drv
+
+# The same with the hook running in the background, where the build
+# waits for it to finish.
+rm -rf $REMOTE_STORE
+nix-build -o $TEST_ROOT/result dependencies.nix --post-build-hook $PWD/push-to-store.sh --post-build-hook-jobs 2
+
+clearStore
+
+nix copy --from "$REMOTE_STORE" --no-require-sigs -f dependencies.nix
+nix copy --from "$REMOTE_STORE" --no-require-sigs -f dependencies.nix input1_drv
+
+# A failing background hook fails the build once it is waited for.
+clearStore
+(! nix-build -o $TEST_ROOT/result dependencies.nix --post-build-hook false --post-build-hook-jobs 2)
@@ -12,8 +12,88 @@ cmp $TEST_ROOT/d1 $TEST_ROOT/d2
 
 nix-store --gc --max-freed 1K
 
+# Derivations can be sent to the daemon in batches, which must be
+# flushed before the paths are printed or used.
+drvPath=$(NIX_REMOTE="daemon?text-batch-size=3" nix-instantiate dependencies.nix)
+nix-store --check-validity $drvPath $(nix-store -qR $drvPath)
+[[ $(NIX_REMOTE="daemon?text-batch-size=0" nix-instantiate dependencies.nix) = $drvPath ]]
+NIX_REMOTE="daemon?text-batch-size=1000" nix-build dependencies.nix --no-out-link
+nix-store --check-validity $(NIX_REMOTE="daemon?text-batch-size=1000" nix eval --raw -f dependencies.nix drvPath)
+
+# Closures are computed with batched path info queries.
+[[ $(nix path-info -r --json $drvPath) = $(NIX_REMOTE= nix path-info -r --json $drvPath) ]]
+[[ $(nix-store -qR $drvPath) = $(NIX_REMOTE= nix-store -qR $drvPath) ]]
+
+# NARs served by the daemon match local dumps.
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix dump-path $outPath > $TEST_ROOT/nar1
+nix-store --dump $outPath > $TEST_ROOT/nar2
+cmp $TEST_ROOT/nar1 $TEST_ROOT/nar2
+nix-store --dump $outPath | cat > $TEST_ROOT/nar3
+cmp $TEST_ROOT/nar1 $TEST_ROOT/nar3
+
+killDaemon
+
+# Pre-forked daemon processes serve concurrent clients like forked ones.
+startDaemon --daemon-prefork-workers 2
+pids=()
+for i in 1 2 3 4 5; do
+    nix-store --check-validity $drvPath &
+    pids+=($!)
+done
+for pid in "${pids[@]}"; do wait $pid; done
+[[ $(nix-instantiate dependencies.nix) = $drvPath ]]
+killDaemon
+
+# The shared path info cache doesn't return paths deleted by other
+# processes.
+startDaemon --shared-path-info-cache-size 1024
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix-store --check-validity $outPath
+nix-store -q --references $outPath > $TEST_ROOT/refs1
+[[ $(nix-store -q --references $outPath) = $(cat $TEST_ROOT/refs1) ]]
+NIX_REMOTE= nix-store --delete $outPath
+(! nix-store --check-validity $outPath)
 killDaemon
 
+# Closures copied to the daemon are sent in one operation.
+startDaemon --no-require-sigs
+cacheDir=$TEST_ROOT/multi-cache
+rm -rf $cacheDir
+outPath=$(nix-build dependencies.nix --no-out-link)
+closure=$(nix-store -qR $outPath | grep -- '-dependencies-')
+nix copy --to file://$cacheDir $outPath
+nix-store --delete $closure
+(! nix-store --check-validity $outPath)
+nix copy --from file://$cacheDir --no-check-sigs $outPath
+nix-store --check-validity $closure
+nix-store --verify-path $closure
+killDaemon
+
+# Files the daemon already has are not sent again.
+startDaemon
+rm -rf $TEST_ROOT/upload
+mkdir -p $TEST_ROOT/upload
+echo foo > $TEST_ROOT/upload/file
+path=$(nix-store --add $TEST_ROOT/upload)
+nix-store --add $TEST_ROOT/upload --debug 2>&1 | grep -q "daemon already has '$path'"
+[[ $(NIX_REMOTE="daemon?hash-before-upload=false" nix-store --add $TEST_ROOT/upload) = $path ]]
+echo bar > $TEST_ROOT/upload/file
+[[ $(nix-store --add $TEST_ROOT/upload) != $path ]]
+killDaemon
+
+# The daemon reports metrics for the operations it handles.
+if [[ -n $(type -p curl) ]]; then
+    startDaemon --daemon-metrics-socket $TEST_ROOT/metrics.socket
+    nix-store --check-validity $drvPath
+    nix path-info -r $drvPath > /dev/null
+    metrics=$(curl -s --unix-socket $TEST_ROOT/metrics.socket http://localhost/metrics)
+    echo "$metrics" | grep -q '^nix_daemon_operations_total{op="IsValidPath"} [1-9]'
+    echo "$metrics" | grep -q '^nix_daemon_operation_duration_seconds_count{op="QueryPathInfos"} [1-9]'
+    echo "$metrics" | grep -q '^nix_daemon_connections_total [1-9]'
+    killDaemon
+fi
+
 user=$(whoami)
 [ -e $NIX_STATE_DIR/gcroots/per-user/$user ]
 [ -e $NIX_STATE_DIR/profiles/per-user/$user ]
@@ -75,3 +75,23 @@ if [ "$(nix-hash $path2)" != "$hash" -o -e $path2/bad ]; then
     echo "path not repaired properly" >&2
     exit 1
 fi
+
+
+# A recently verified path is skipped with verify-max-age, so the
+# corruption goes unnoticed until the entry expires.
+clearStore
+
+path=$(nix-build dependencies.nix -o $TEST_ROOT/result)
+path2=$(nix-store -qR $path | grep input-2)
+
+nix-store --verify --check-contents
+
+chmod u+w $path2
+touch $path2/bad
+
+nix-store --verify --check-contents --option verify-max-age 3600
+
+if nix-store --verify --check-contents; then
+    echo "nix-store --verify succeeded unexpectedly" >&2
+    exit 1
+fi
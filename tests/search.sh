@@ -6,38 +6,49 @@ clearCache
 # No packages
 (( $(NIX_PATH= nix search -u|wc -l) == 0 ))
 
-# Haven't updated cache, still nothing
-(( $(nix search -f search.nix hello|wc -l) == 0 ))
-(( $(nix search -f search.nix |wc -l) == 0 ))
-
-# Update cache, search should work
-(( $(nix search -f search.nix -u hello|wc -l) > 0 ))
+# Search the Nix search path, which populates the evaluation cache
+(( $(NIX_PATH=search=$PWD/search.nix nix search hello|wc -l) > 0 ))
+[[ -n $(echo $TEST_HOME/.cache/nix/eval-cache-v1/*.sqlite) ]]
 
 # Use cache
-(( $(nix search -f search.nix foo|wc -l) > 0 ))
-(( $(nix search foo|wc -l) > 0 ))
+(( $(NIX_PATH=search=$PWD/search.nix nix search foo|wc -l) > 0 ))
+
+# Search a file, which is not cached
+(( $(nix search -f search.nix hello|wc -l) > 0 ))
+
+# Discard the cache, search should still work
+(( $(nix search -f search.nix -u hello|wc -l) > 0 ))
 
 # Test --no-cache works
-# No results from cache
-(( $(nix search --no-cache foo |wc -l) == 0 ))
-# Does find results from file pointed at
 (( $(nix search -f search.nix --no-cache foo |wc -l) > 0 ))
 
 # Check descriptions are searched
-(( $(nix search broken | wc -l) > 0 ))
+(( $(nix search -f search.nix broken | wc -l) > 0 ))
 
 # Check search that matches nothing
-(( $(nix search nosuchpackageexists | wc -l) == 0 ))
+(( $(nix search -f search.nix nosuchpackageexists | wc -l) == 0 ))
 
 # Search for multiple arguments
-(( $(nix search hello empty | wc -l) == 3 ))
+(( $(nix search -f search.nix hello empty | wc -l) == 3 ))
 
 # Multiple arguments will not exist
-(( $(nix search hello broken | wc -l) == 0 ))
+(( $(nix search -f search.nix hello broken | wc -l) == 0 ))
 
 ## Search expressions
 
 # Check that empty search string matches all
-nix search|grep -q foo
-nix search|grep -q bar
-nix search|grep -q hello
+nix search -f search.nix|grep -q foo
+nix search -f search.nix|grep -q bar
+nix search -f search.nix|grep -q hello
+
+# Changing the expressions invalidates the cache
+mkdir -p $TEST_ROOT/search
+cp search.nix config.nix $TEST_ROOT/search/
+(( $(nix search -f $TEST_ROOT/search/search.nix foo|wc -l) > 0 ))
+sed -i 's/foo-5/qux-5/' $TEST_ROOT/search/search.nix
+(( $(nix search -f $TEST_ROOT/search/search.nix qux|wc -l) > 0 ))
+
+# Searches answered from the search index give the same results as a
+# fresh traversal
+diff <(nix search -f search.nix --json hello) <(nix search -f search.nix --no-cache --json hello)
+diff <(nix search -f search.nix --json 'hel+o|bar') <(nix search -f search.nix --no-cache --json 'hel+o|bar')
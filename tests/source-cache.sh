@@ -0,0 +1,54 @@
+source common.sh
+
+clearStore
+
+rm -rf $TEST_ROOT/src $TEST_ROOT/.cache
+mkdir -p $TEST_ROOT/src/sub
+echo foo > $TEST_ROOT/src/a
+echo bar > $TEST_ROOT/src/sub/b
+
+export XDG_CACHE_HOME=$TEST_ROOT/.cache
+
+srcPath() {
+    nix-instantiate --eval --expr "\"\${$TEST_ROOT/src}\"" "$@"
+}
+
+# Trees modified in the last second are not recorded, so wait a bit
+# to make sure that the cache is actually used.
+sleep 2
+path1=$(srcPath)
+[[ $(srcPath) = $path1 ]]
+
+# Changing a file in a subdirectory must yield a different path.
+echo baz > $TEST_ROOT/src/sub/b
+sleep 2
+path2=$(srcPath)
+[[ $path2 != $path1 ]]
+[[ $(srcPath --option source-cache false) = $path2 ]]
+
+# A cached path that has been garbage-collected is copied again.
+nix-store --delete ${path2//\"/}
+[[ $(srcPath) = $path2 ]]
+nix-store --verify-path ${path2//\"/}
+
+# Filtered sources are cached too, and only changes to files that pass
+# the filter matter.
+filteredPath() {
+    nix-instantiate --eval --expr "builtins.filterSource (p: t: builtins.trace p (baseNameOf p != \"a\")) $TEST_ROOT/src" "$@"
+}
+
+path3=$(filteredPath 2> $TEST_ROOT/filter.log)
+[[ $path3 != $path2 ]]
+[[ $(filteredPath 2> /dev/null) = $path3 ]]
+# The filter is called once for every file, even when copying.
+[[ $(grep -c "trace: " $TEST_ROOT/filter.log) = 3 ]]
+
+echo changed > $TEST_ROOT/src/a
+sleep 2
+[[ $(filteredPath 2> /dev/null) = $path3 ]]
+
+echo changed > $TEST_ROOT/src/sub/b
+sleep 2
+path4=$(filteredPath 2> /dev/null)
+[[ $path4 != $path3 ]]
+[[ $(filteredPath --option source-cache false 2> /dev/null) = $path4 ]]
@@ -9,6 +9,9 @@ rm -rf $tarroot
 mkdir -p $tarroot
 cp dependencies.nix $tarroot/default.nix
 cp config.nix dependencies.builder*.sh $tarroot/
+ln -s default.nix $tarroot/link
+ln $tarroot/config.nix $tarroot/hardlink.nix
+mkdir $tarroot/empty
 
 hash=$(nix hash-path $tarroot)
 
@@ -18,6 +18,12 @@ outPath10=$(nix-env -f ./user-envs.nix -qa --out-path --no-name '*' | grep foo-1
 drvPath10=$(nix-env -f ./user-envs.nix -qa --drv-path --no-name '*' | grep foo-1.0)
 [ -n "$outPath10" -a -n "$drvPath10" ]
 
+# Querying with several evaluation workers must give the same result,
+# also when the workers are restarted after every attribute.
+nix-env -f ./search.nix -qa --json > $TEST_ROOT/qa.json
+nix-env -f ./search.nix -qa --json --option eval-workers 3 --option max-eval-worker-heap-size 0 > $TEST_ROOT/qa-parallel.json
+cmp $TEST_ROOT/qa.json $TEST_ROOT/qa-parallel.json
+
 # Query descriptions.
 nix-env -f ./user-envs.nix -qa '*' --description | grep -q silly
 rm -rf $HOME/.nix-defexpr
@@ -179,3 +185,22 @@ nix-env --set $outPath10
 [ "$(nix-store -q --resolve $profiles/test)" = $outPath10 ]
 nix-env --set $drvPath10
 [ "$(nix-store -q --resolve $profiles/test)" = $outPath10 ]
+
+# Installing and upgrading by name only evaluates the matching
+# derivations once their names are in the evaluation cache. Use a
+# copy of the expressions so that files created by other tests don't
+# change the cache key.
+mkdir -p $TEST_ROOT/user-envs
+cp user-envs.nix user-envs.builder.sh config.nix $TEST_ROOT/user-envs/
+nix-env -f $TEST_ROOT/user-envs/user-envs.nix -qa '*' > /dev/null
+nix-env -e '*'
+nix-env -f $TEST_ROOT/user-envs/user-envs.nix -i foo-1.0 --debug 2>&1 | grep -q 'derivations recorded in the evaluation cache'
+nix-env -f $TEST_ROOT/user-envs/user-envs.nix -u bar --debug 2>&1 | grep -q 'derivations recorded in the evaluation cache'
+test "$(nix-env -q '*')" = foo-1.0
+nix-env -f $TEST_ROOT/user-envs/user-envs.nix -u
+test "$(nix-env -q '*')" = foo-2.0
+
+nix-env -e '*'
+nix-env -f $TEST_ROOT/user-envs/user-envs.nix -i foo-1.0 --option eval-cache false
+nix-env -f $TEST_ROOT/user-envs/user-envs.nix -u --option eval-cache false
+test "$(nix-env -q '*')" = foo-2.0
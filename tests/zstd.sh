@@ -0,0 +1,45 @@
+source common.sh
+
+clearStore
+clearCache
+
+cacheURI="file://$cacheDir?compression=zstd&compression-level=19&compression-long-window=true&parallel-compression=true"
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+if ! nix copy --to $cacheURI $outPath 2> $TEST_ROOT/log; then
+    if grep -q "unknown compression method 'zstd'" $TEST_ROOT/log; then
+        echo "zstd not supported; skipping zstd tests"
+        exit 99
+    fi
+    cat $TEST_ROOT/log
+    exit 1
+fi
+
+grep -q "Compression: zstd" $cacheDir/*.narinfo
+ls $cacheDir/nar/*.nar.zst
+
+HASH=$(nix hash-path $outPath)
+
+clearStore
+clearCacheCache
+
+nix copy --from $cacheURI $outPath --no-check-sigs
+
+HASH2=$(nix hash-path $outPath)
+
+[[ $HASH = $HASH2 ]]
+
+# Test zstd-compressed build logs.
+clearStore
+rm -rf $NIX_LOG_DIR
+outPath=$(nix-build dependencies.nix --no-out-link --compress-build-log --build-log-compression zstd)
+ls $NIX_LOG_DIR/drvs/*/*.zst
+[ "$(nix-store -l $outPath)" = FOO ]
+
+# Logs written with bzip2 remain readable.
+clearStore
+rm -rf $NIX_LOG_DIR
+outPath=$(nix-build dependencies.nix --no-out-link --compress-build-log --build-log-compression bzip2)
+ls $NIX_LOG_DIR/drvs/*/*.bz2
+[ "$(nix-store -l $outPath)" = FOO ]